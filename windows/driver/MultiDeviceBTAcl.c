@@ -0,0 +1,326 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAcl.c
+
+Abstract:
+    ACL transmit credits.
+
+    The HCI transport agent used to write ACL data whenever the
+    controller had a free buffer, in the order packets reached it. A
+    bulk transfer kept every buffer full, and each other link's next
+    packet waited for the bulk link's packets to complete.
+
+    The agent now asks with IOCTL_MULTI_BT_ACL_ACQUIRE_CREDITS how many
+    of the packets it has ready for each link it may write, and the
+    allocator (MultiDeviceBTAclCredit.c) answers: reserved buffers for
+    CRITICAL links, and a weighted share of the rest for everyone. The
+    event intake keeps the allocator current:
+    - A successful ACL or LE connection opens a link, at the priority
+      the device was given, or MEDIUM for a device the driver does not
+      know yet. SCO links carry no ACL data.
+    - A disconnection closes it and frees what it held.
+    - Number Of Completed Packets returns buffers.
+    - Command Complete for Read Buffer Size or LE Read Buffer Size sets
+      the pool size. A controller with a separate LE pool reports it
+      through the latter, which then wins: most of the links are LE.
+    IOCTL_MULTI_BT_GET_ACL_CREDITS reports the pool and each link's use.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+/*++
+Routine Description:
+    Initializes the allocator with the default pool size
+--*/
+VOID
+AclInitialize(
+    _Out_ PACL_CONTEXT Acl
+)
+{
+    RtlZeroMemory(Acl, sizeof(*Acl));
+    KeInitializeSpinLock(&Acl->Lock);
+    AclCreditInitialize(&Acl->Pool);
+}
+
+/*++
+Routine Description:
+    Looks up the priority set for a connected device
+
+Return Value:
+    The device's CONNECTION_PRIORITY, PRIORITY_MEDIUM if unknown
+--*/
+static UCHAR
+AclDevicePriority(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    UCHAR priority = PRIORITY_MEDIUM;
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&DeviceContext->DeviceListLock, &irql);
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        if (DeviceContext->ConnectedDevices[i].IsConnected &&
+            DeviceContext->ConnectedDevices[i].DeviceAddress == DeviceAddress &&
+            DeviceContext->ConnectedDevices[i].ConnectionPriority <= PRIORITY_LOW) {
+            priority = (UCHAR)DeviceContext->ConnectedDevices[i].ConnectionPriority;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&DeviceContext->DeviceListLock, irql);
+
+    return priority;
+}
+
+/*++
+Routine Description:
+    Opens a link for each successful ACL or LE connection
+
+Arguments:
+    DeviceContext - Device context
+    Connections - Connection complete events
+    Count - Number of events
+--*/
+VOID
+AclConnectionsOpened(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_reads_(Count) const HCI_CONNECTION_COMPLETE* Connections,
+    _In_ ULONG Count
+)
+{
+    PACL_CONTEXT acl = &DeviceContext->Acl;
+    NTSTATUS status;
+    UCHAR priority;
+    KIRQL irql;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        if (Connections[i].Status != 0 || Connections[i].LinkType == HCI_LINK_SCO) {
+            continue;
+        }
+
+        priority = AclDevicePriority(DeviceContext, Connections[i].PeerAddress);
+
+        KeAcquireSpinLock(&acl->Lock, &irql);
+        status = AclCreditOpen(&acl->Pool, Connections[i].Handle, priority, Connections[i].PeerAddress);
+        KeReleaseSpinLock(&acl->Lock, irql);
+
+        if (!NT_SUCCESS(status)) {
+            KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+                "MultiDeviceBT: No ACL credit slot for handle 0x%03x - 0x%x\n",
+                Connections[i].Handle, status));
+        }
+    }
+}
+
+/*++
+Routine Description:
+    Closes the links of successful disconnections
+--*/
+VOID
+AclConnectionsClosed(
+    _Inout_ PACL_CONTEXT Acl,
+    _In_reads_(Count) const HCI_DISCONNECTION* Disconnections,
+    _In_ ULONG Count
+)
+{
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&Acl->Lock, &irql);
+    for (i = 0; i < Count; i++) {
+        if (Disconnections[i].Status == 0) {
+            AclCreditClose(&Acl->Pool, Disconnections[i].Handle);
+        }
+    }
+    KeReleaseSpinLock(&Acl->Lock, irql);
+}
+
+/*++
+Routine Description:
+    Returns the buffers of completed packets
+--*/
+VOID
+AclPacketsCompleted(
+    _Inout_ PACL_CONTEXT Acl,
+    _In_reads_(Count) const HCI_COMPLETED_PACKETS* Completed,
+    _In_ ULONG Count
+)
+{
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&Acl->Lock, &irql);
+    for (i = 0; i < Count; i++) {
+        AclCreditComplete(&Acl->Pool, Completed[i].Handle, Completed[i].Packets);
+    }
+    KeReleaseSpinLock(&Acl->Lock, irql);
+}
+
+/*++
+Routine Description:
+    Sizes the pool from successful Read Buffer Size and LE Read Buffer
+    Size replies. An LE count of zero means LE shares the BR/EDR pool.
+--*/
+VOID
+AclCommandsCompleted(
+    _Inout_ PACL_CONTEXT Acl,
+    _In_reads_(Count) const HCI_COMMAND_EVENT* Events,
+    _In_ ULONG Count
+)
+{
+    const HCI_COMMAND_EVENT* event;
+    ULONG buffers;
+    KIRQL irql;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        event = &Events[i];
+        if (!event->Complete || event->Status != 0) {
+            continue;
+        }
+
+        switch (event->Opcode) {
+        case HCI_OP_READ_BUFFER_SIZE:
+            // Status, ACL length (2), SCO length, Total_Num_ACL_Data_Packets (2), ...
+            if (event->ReturnLength < 6 || Acl->LeBuffers) {
+                continue;
+            }
+            buffers = event->ReturnParameters[4] | (event->ReturnParameters[5] << 8);
+            break;
+
+        case HCI_OP_LE_READ_BUFFER_SIZE:
+        case HCI_OP_LE_READ_BUFFER_SIZE_V2:
+            // Status, LE ACL length (2), Total_Num_LE_ACL_Data_Packets, ...
+            if (event->ReturnLength < 4 || event->ReturnParameters[3] == 0) {
+                continue;
+            }
+            buffers = event->ReturnParameters[3];
+            Acl->LeBuffers = TRUE;
+            break;
+
+        default:
+            continue;
+        }
+
+        KeAcquireSpinLock(&Acl->Lock, &irql);
+        AclCreditSetBuffers(&Acl->Pool, buffers);
+        KeReleaseSpinLock(&Acl->Lock, irql);
+
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: Controller has %u ACL buffers\n", buffers));
+    }
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_ACL_ACQUIRE_CREDITS. Each entry's Granted is
+    filled in where it lies; the granted packets may be sent at once.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Request with an ACL_CREDIT_REQUEST
+    InputBufferLength - Input size
+    OutputBufferLength - Output size
+    BytesReturned - Receives the size of the request echoed back
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleAclAcquireCredits(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PACL_CONTEXT acl = &DeviceContext->Acl;
+    PACL_CREDIT_REQUEST request;
+    NTSTATUS status;
+    size_t size;
+    KIRQL irql;
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        FIELD_OFFSET(ACL_CREDIT_REQUEST, Wants), (PVOID*)&request, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (request->Count == 0 || request->Count > ACL_CREDIT_MAX_LINKS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    size = FIELD_OFFSET(ACL_CREDIT_REQUEST, Wants) + request->Count * sizeof(ACL_CREDIT_WANT);
+    if (InputBufferLength < size || OutputBufferLength < size) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    KeAcquireSpinLock(&acl->Lock, &irql);
+    AclCreditAcquireBatch(&acl->Pool, request->Wants, request->Count);
+    KeReleaseSpinLock(&acl->Lock, irql);
+
+    *BytesReturned = size;
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_ACL_CREDITS: the pool's counters and as
+    many links as the output buffer holds
+--*/
+NTSTATUS
+HandleGetAclCredits(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PACL_CONTEXT acl = &DeviceContext->Acl;
+    PACL_CREDIT_REPORT report;
+    NTSTATUS status;
+    size_t size;
+    ULONG room, i;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        FIELD_OFFSET(ACL_CREDIT_REPORT, Links), (PVOID*)&report, &size);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    room = (ULONG)((size - FIELD_OFFSET(ACL_CREDIT_REPORT, Links)) / sizeof(ACL_CREDIT_LINK));
+    report->LinkCount = 0;
+    report->Reserved = 0;
+
+    KeAcquireSpinLock(&acl->Lock, &irql);
+    report->Stats = acl->Pool.Stats;
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS && report->LinkCount < room; i++) {
+        if (acl->Pool.Links[i].InUse) {
+            report->Links[report->LinkCount++] = acl->Pool.Links[i];
+        }
+    }
+    KeReleaseSpinLock(&acl->Lock, irql);
+
+    *BytesReturned = FIELD_OFFSET(ACL_CREDIT_REPORT, Links) + report->LinkCount * sizeof(ACL_CREDIT_LINK);
+    return STATUS_SUCCESS;
+}
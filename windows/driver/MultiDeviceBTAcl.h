@@ -0,0 +1,76 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAcl.h
+
+Abstract:
+    ACL transmit credits. The HCI transport agent asks for controller
+    buffers before it writes ACL data, and the allocator
+    (MultiDeviceBTAclCredit.h) decides how many each link gets. The
+    event intake (MultiDeviceBTHciEvent.h) opens and closes links,
+    returns buffers on Number Of Completed Packets and sizes the pool
+    from the controller's buffer size replies.
+
+--*/
+
+#ifndef _MULTIDEVICEBTACL_H_
+#define _MULTIDEVICEBTACL_H_
+
+#include "MultiDeviceBTHci.h"
+#include "MultiDeviceBTAclCredit.h"
+
+// Opcodes whose Command Complete carries the controller's ACL buffer count
+#define HCI_OP_READ_BUFFER_SIZE             0x1005
+#define HCI_OP_LE_READ_BUFFER_SIZE          0x2002
+#define HCI_OP_LE_READ_BUFFER_SIZE_V2       0x2060
+
+// IOCTL_MULTI_BT_ACL_ACQUIRE_CREDITS input and output
+typedef struct _ACL_CREDIT_REQUEST {
+    ULONG Count;                // Up to ACL_CREDIT_MAX_LINKS
+    ULONG Reserved;
+    ACL_CREDIT_WANT Wants[1];
+} ACL_CREDIT_REQUEST, *PACL_CREDIT_REQUEST;
+
+// IOCTL_MULTI_BT_GET_ACL_CREDITS output: as many links as fit
+typedef struct _ACL_CREDIT_REPORT {
+    ACL_CREDIT_STATS Stats;
+    ULONG LinkCount;
+    ULONG Reserved;
+    ACL_CREDIT_LINK Links[1];
+} ACL_CREDIT_REPORT, *PACL_CREDIT_REPORT;
+
+typedef struct _ACL_CONTEXT {
+    KSPIN_LOCK Lock;            // Pool
+    BOOLEAN LeBuffers;          // The pool size came from LE Read Buffer Size
+    ACL_CREDIT_POOL Pool;
+} ACL_CONTEXT, *PACL_CONTEXT;
+
+VOID AclInitialize(
+    _Out_ PACL_CONTEXT Acl
+);
+
+VOID AclConnectionsOpened(
+    _In_ struct _DEVICE_CONTEXT* DeviceContext,
+    _In_reads_(Count) const HCI_CONNECTION_COMPLETE* Connections,
+    _In_ ULONG Count
+);
+
+VOID AclConnectionsClosed(
+    _Inout_ PACL_CONTEXT Acl,
+    _In_reads_(Count) const HCI_DISCONNECTION* Disconnections,
+    _In_ ULONG Count
+);
+
+VOID AclPacketsCompleted(
+    _Inout_ PACL_CONTEXT Acl,
+    _In_reads_(Count) const HCI_COMPLETED_PACKETS* Completed,
+    _In_ ULONG Count
+);
+
+VOID AclCommandsCompleted(
+    _Inout_ PACL_CONTEXT Acl,
+    _In_reads_(Count) const HCI_COMMAND_EVENT* Events,
+    _In_ ULONG Count
+);
+
+#endif // _MULTIDEVICEBTACL_H_
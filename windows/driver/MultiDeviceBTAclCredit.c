@@ -0,0 +1,377 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAclCredit.c
+
+Abstract:
+    ACL buffer credit allocator.
+
+    The controller's ACL buffers are shared by every link, and a buffer
+    only comes back when the controller reports the packet in it as
+    completed. A host that hands out buffers on demand lets one bulk
+    sender fill them all. A mouse report or an audio packet queued
+    after that waits until the bulk link's next connection event frees
+    some, which is several milliseconds. So do the other links.
+
+    Each CRITICAL link gets ACL_CREDIT_RESERVE buffers of its own, which
+    no other link may use. At most half the pool is reserved this way.
+    The rest is shared under a weighted dynamic threshold: a link may
+    take another shared buffer only while the shared buffers it holds
+    are fewer than its weight times the shared buffers still free.
+    Weights double with each priority step, from 1 for LOW to 8 for
+    CRITICAL.
+    - A lone sender of weight w stops at w / (w + 1) of the shared
+      buffers. The rest stays free, so a link that starts sending is
+      granted a buffer at once.
+    - With several senders the shares settle in proportion to their
+      weights, and each keeps a free margin as well.
+    - An idle link holds nothing, so nothing is wasted on it.
+
+    A link's buffers count against its reservation first. Completions
+    return shared buffers first, so the reservation stays available to
+    the link that owns it. A link that disconnects gives back what it
+    held: the controller flushes those packets.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTAclCredit.h"
+
+static const UCHAR AclCreditWeight[ACL_CREDIT_PRIORITIES] = { 8, 4, 2, 1 };
+
+static PACL_CREDIT_LINK
+AclCreditFind(
+    _In_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle
+)
+{
+    ULONG i;
+
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        if (Pool->Links[i].InUse && Pool->Links[i].Handle == Handle) {
+            return &Pool->Links[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*++
+Routine Description:
+    Recomputes the reservations after the pool or the set of CRITICAL
+    links changes. Buffers a link holds beyond its new reservation
+    become shared; the shared count may then exceed the shared pool
+    until enough of them complete.
+--*/
+static VOID
+AclCreditRebalance(
+    _Inout_ PACL_CREDIT_POOL Pool
+)
+{
+    PACL_CREDIT_LINK link;
+    ULONG limit = Pool->Stats.Buffers / 2;
+    ULONG reserved = 0;
+    ULONG shared = 0;
+    ULONG i;
+
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        link = &Pool->Links[i];
+        if (!link->InUse) {
+            continue;
+        }
+
+        link->Reserved = 0;
+        if (link->Priority == 0) {
+            link->Reserved = min(ACL_CREDIT_RESERVE, limit - reserved);
+            reserved += link->Reserved;
+        }
+
+        if (link->Held > link->Reserved) {
+            shared += link->Held - link->Reserved;
+        }
+    }
+
+    Pool->Stats.ReservedBuffers = reserved;
+    Pool->Stats.SharedUsed = shared;
+}
+
+/*++
+Routine Description:
+    Initializes an empty pool of ACL_CREDIT_DEFAULT_BUFFERS buffers
+--*/
+VOID
+AclCreditInitialize(
+    _Out_ PACL_CREDIT_POOL Pool
+)
+{
+    RtlZeroMemory(Pool, sizeof(*Pool));
+    Pool->Stats.Buffers = ACL_CREDIT_DEFAULT_BUFFERS;
+}
+
+/*++
+Routine Description:
+    Sets the pool size from the controller's Total_Num_ACL_Data_Packets
+    or Total_Num_LE_ACL_Data_Packets. Buffers already held stay held; if
+    the pool shrank below them, nothing is granted until enough complete.
+--*/
+VOID
+AclCreditSetBuffers(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ ULONG Buffers
+)
+{
+    if (Buffers == 0) {
+        return;
+    }
+
+    Pool->Stats.Buffers = Buffers;
+    AclCreditRebalance(Pool);
+}
+
+/*++
+Routine Description:
+    Starts tracking a connection, or changes its priority if it is
+    already tracked
+
+Arguments:
+    Pool - Allocator
+    Handle - Connection handle
+    Priority - CONNECTION_PRIORITY; CRITICAL links get a reservation
+    PeerAddress - Remote device, for reporting
+
+Return Value:
+    STATUS_SUCCESS
+    STATUS_INVALID_PARAMETER for a bad priority
+    STATUS_INSUFFICIENT_RESOURCES when ACL_CREDIT_MAX_LINKS are tracked
+--*/
+NTSTATUS
+AclCreditOpen(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle,
+    _In_ UCHAR Priority,
+    _In_ BTH_ADDR PeerAddress
+)
+{
+    PACL_CREDIT_LINK link;
+    ULONG i;
+
+    if (Priority >= ACL_CREDIT_PRIORITIES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    link = AclCreditFind(Pool, Handle);
+    if (link == NULL) {
+        for (i = 0; i < ACL_CREDIT_MAX_LINKS && Pool->Links[i].InUse; i++) {
+        }
+        if (i == ACL_CREDIT_MAX_LINKS) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        link = &Pool->Links[i];
+        RtlZeroMemory(link, sizeof(*link));
+        link->InUse = TRUE;
+        link->Handle = Handle;
+        Pool->Stats.Links++;
+    }
+
+    link->Priority = Priority;
+    link->PeerAddress = PeerAddress;
+    AclCreditRebalance(Pool);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Stops tracking a disconnected link. The controller discards its
+    queued packets, so the buffers it held are free again.
+--*/
+VOID
+AclCreditClose(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle
+)
+{
+    PACL_CREDIT_LINK link = AclCreditFind(Pool, Handle);
+
+    if (link == NULL) {
+        return;
+    }
+
+    Pool->Stats.Held -= link->Held;
+    Pool->Stats.Flushed += link->Held;
+    Pool->Stats.Links--;
+    link->InUse = FALSE;
+    link->Held = 0;
+    AclCreditRebalance(Pool);
+}
+
+/*++
+Routine Description:
+    Returns the peer a link was opened for
+
+Arguments:
+    Pool - Allocator
+    Handle - Connection handle
+
+Return Value:
+    Peer address, or BTH_ADDR_NULL if no link has the handle
+--*/
+BTH_ADDR
+AclCreditPeerAddress(
+    _In_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle
+)
+{
+    PACL_CREDIT_LINK link = AclCreditFind(Pool, Handle);
+
+    return link != NULL ? link->PeerAddress : BTH_ADDR_NULL;
+}
+
+/*++
+Routine Description:
+    Grants one buffer to a link about to send a packet
+
+Arguments:
+    Pool - Allocator
+    Handle - Sending link
+
+Return Value:
+    TRUE if the packet may be sent now; FALSE if it must wait for a
+    completion, or the link is unknown
+--*/
+BOOLEAN
+AclCreditAcquire(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle
+)
+{
+    PACL_CREDIT_LINK link = AclCreditFind(Pool, Handle);
+    PACL_CREDIT_STATS stats = &Pool->Stats;
+    ULONG sharedFree;
+
+    if (link == NULL) {
+        stats->Denied++;
+        return FALSE;
+    }
+
+    if (stats->Held >= stats->Buffers) {
+        goto Denied;
+    }
+
+    if (link->Held >= link->Reserved) {
+        sharedFree = stats->Buffers - stats->ReservedBuffers;
+        if (stats->SharedUsed >= sharedFree) {
+            goto Denied;
+        }
+        sharedFree -= stats->SharedUsed;
+
+        if (link->Held - link->Reserved >= AclCreditWeight[link->Priority] * sharedFree) {
+            goto Denied;
+        }
+        stats->SharedUsed++;
+    }
+
+    link->Held++;
+    link->Granted++;
+    if (link->Held > link->MaxHeld) {
+        link->MaxHeld = link->Held;
+    }
+    stats->Held++;
+    stats->Granted++;
+    return TRUE;
+
+Denied:
+    link->Denied++;
+    stats->Denied++;
+    return FALSE;
+}
+
+/*++
+Routine Description:
+    Grants buffers to several links at once, one buffer per link per
+    round, so the order of Wants does not favour the links listed first
+
+Arguments:
+    Pool - Allocator
+    Wants - Packets each link has ready; Granted is filled in
+    Count - Number of entries
+
+Return Value:
+    Buffers granted in all
+--*/
+ULONG
+AclCreditAcquireBatch(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _Inout_updates_(Count) PACL_CREDIT_WANT Wants,
+    _In_ ULONG Count
+)
+{
+    ULONG granted = 0;
+    ULONG progress;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        Wants[i].Granted = 0;
+    }
+
+    do {
+        progress = 0;
+        for (i = 0; i < Count; i++) {
+            if (Wants[i].Granted < Wants[i].Packets && AclCreditAcquire(Pool, Wants[i].Handle)) {
+                Wants[i].Granted++;
+                progress++;
+            }
+        }
+        granted += progress;
+    } while (progress != 0);
+
+    return granted;
+}
+
+/*++
+Routine Description:
+    Returns buffers reported by a Number Of Completed Packets event
+
+Arguments:
+    Pool - Allocator
+    Handle - Connection handle from the event
+    Packets - Completed packets for it
+--*/
+VOID
+AclCreditComplete(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle,
+    _In_ ULONG Packets
+)
+{
+    PACL_CREDIT_LINK link = AclCreditFind(Pool, Handle);
+    ULONG shared;
+
+    if (link == NULL) {
+        Pool->Stats.UnknownCompletions += Packets;
+        return;
+    }
+
+    // A controller reporting more than was sent is not trusted past it
+    Packets = min(Packets, link->Held);
+
+    shared = (link->Held > link->Reserved) ? link->Held - link->Reserved : 0;
+    Pool->Stats.SharedUsed -= min(shared, Packets);
+
+    link->Held -= Packets;
+    link->Completed += Packets;
+    Pool->Stats.Held -= Packets;
+    Pool->Stats.Completed += Packets;
+}
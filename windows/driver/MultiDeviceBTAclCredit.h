@@ -0,0 +1,110 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAclCredit.h
+
+Abstract:
+    Host-side allocator for the controller's ACL data buffers. The
+    controller holds every link's outgoing packets in one pool and
+    returns buffers through Number Of Completed Packets events. Each
+    CRITICAL link has buffers reserved for it. The rest are lent by
+    weighted fairness, with headroom kept so that a link starting to
+    send never waits for a bulk sender's packets to complete.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the storage and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTACLCREDIT_H_
+#define _MULTIDEVICEBTACLCREDIT_H_
+
+#define ACL_CREDIT_MAX_LINKS        32      // Controllers accept far fewer links than handles
+#define ACL_CREDIT_RESERVE          2       // Buffers reserved per CRITICAL link
+#define ACL_CREDIT_PRIORITIES       4       // Same order as CONNECTION_PRIORITY
+#define ACL_CREDIT_DEFAULT_BUFFERS  8       // Until the controller's buffer size is read
+
+typedef struct _ACL_CREDIT_LINK {
+    USHORT Handle;
+    UCHAR Priority;             // CONNECTION_PRIORITY
+    BOOLEAN InUse;
+    ULONG Held;                 // Sent, not yet completed
+    ULONG Reserved;             // Buffers set aside for the link; held ones count here first
+    ULONG MaxHeld;
+    BTH_ADDR PeerAddress;
+    ULONG64 Granted;
+    ULONG64 Completed;
+    ULONG64 Denied;             // Requests refused for want of a buffer
+} ACL_CREDIT_LINK, *PACL_CREDIT_LINK;
+
+typedef struct _ACL_CREDIT_STATS {
+    ULONG Buffers;              // Controller's pool
+    ULONG Held;                 // All links
+    ULONG ReservedBuffers;      // Set aside for CRITICAL links
+    ULONG SharedUsed;           // Held beyond the links' reservations
+    ULONG Links;
+    ULONG Reserved;
+    ULONG64 Granted;
+    ULONG64 Completed;
+    ULONG64 Denied;
+    ULONG64 Flushed;            // Held by a link when it disconnected
+    ULONG64 UnknownCompletions; // Completed packets for a handle with no link
+} ACL_CREDIT_STATS, *PACL_CREDIT_STATS;
+
+typedef struct _ACL_CREDIT_POOL {
+    ACL_CREDIT_LINK Links[ACL_CREDIT_MAX_LINKS];
+    ACL_CREDIT_STATS Stats;
+} ACL_CREDIT_POOL, *PACL_CREDIT_POOL;
+
+// One link's share of an IOCTL_MULTI_BT_ACL_ACQUIRE_CREDITS request
+typedef struct _ACL_CREDIT_WANT {
+    USHORT Handle;
+    USHORT Packets;             // Queued and ready to send
+    USHORT Granted;             // Out: may be sent now
+    USHORT Reserved;
+} ACL_CREDIT_WANT, *PACL_CREDIT_WANT;
+
+VOID AclCreditInitialize(
+    _Out_ PACL_CREDIT_POOL Pool
+);
+
+VOID AclCreditSetBuffers(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ ULONG Buffers
+);
+
+NTSTATUS AclCreditOpen(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle,
+    _In_ UCHAR Priority,
+    _In_ BTH_ADDR PeerAddress
+);
+
+VOID AclCreditClose(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle
+);
+
+BTH_ADDR AclCreditPeerAddress(
+    _In_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle
+);
+
+BOOLEAN AclCreditAcquire(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle
+);
+
+ULONG AclCreditAcquireBatch(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _Inout_updates_(Count) PACL_CREDIT_WANT Wants,
+    _In_ ULONG Count
+);
+
+VOID AclCreditComplete(
+    _Inout_ PACL_CREDIT_POOL Pool,
+    _In_ USHORT Handle,
+    _In_ ULONG Packets
+);
+
+#endif // _MULTIDEVICEBTACLCREDIT_H_
@@ -0,0 +1,669 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAdapter.c
+
+Abstract:
+    Driver-wide view across Bluetooth adapters. Each adapter's
+    DEVICE_CONTEXT registers here so hosts with several radios can
+    spread devices between them: new connections go to the adapter with
+    the lowest combined connection count, airtime and RSSI penalty, and
+    LOW priority links are queued for migration when a radio stays
+    congested. The policy itself is MultiDeviceBTPlacement.c; this file
+    snapshots the adapters for it under the registry lock.
+
+    RSSI reaches the registry from advertising reports in the event
+    intake and, while more than one adapter is registered, from HCI
+    Read RSSI on every open link, polled with the load window.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+/*++
+Routine Description:
+    Initializes the driver-wide adapter registry
+
+Arguments:
+    Registry - Registry in the driver object context
+
+Return Value:
+    None
+--*/
+VOID
+AdapterRegistryInitialize(
+    _Out_ PADAPTER_REGISTRY Registry
+)
+{
+    RtlZeroMemory(Registry, sizeof(*Registry));
+    KeInitializeSpinLock(&Registry->Lock);
+    AdapterRssiInitialize(Registry->RssiCache);
+}
+
+/*++
+Routine Description:
+    Adds an adapter to the registry and assigns its index
+
+Arguments:
+    Registry - Adapter registry
+    DeviceContext - Adapter's device context
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+AdapterRegister(
+    _Inout_ PADAPTER_REGISTRY Registry,
+    _In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+    KIRQL oldIrql;
+    ULONG i;
+    NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+
+    KeAcquireSpinLock(&Registry->Lock, &oldIrql);
+
+    for (i = 0; i < MAX_BLUETOOTH_ADAPTERS; i++) {
+        if (Registry->Adapters[i] == NULL) {
+            Registry->Adapters[i] = DeviceContext;
+            Registry->AdapterCount++;
+            DeviceContext->Load.AdapterIndex = i;
+            DeviceContext->Load.Registered = TRUE;
+            KeQuerySystemTime(&DeviceContext->Load.WindowStart);
+            status = STATUS_SUCCESS;
+            break;
+        }
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, oldIrql);
+
+    if (NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: Adapter %u registered (%u adapters)\n",
+            i, Registry->AdapterCount));
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Removes an adapter and forgets its RSSI observations and migrations
+
+Arguments:
+    Registry - Adapter registry
+    DeviceContext - Adapter's device context
+
+Return Value:
+    None
+--*/
+VOID
+AdapterUnregister(
+    _Inout_ PADAPTER_REGISTRY Registry,
+    _In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+    KIRQL oldIrql;
+    ULONG index = DeviceContext->Load.AdapterIndex;
+    ULONG i;
+
+    if (!DeviceContext->Load.Registered) {
+        return;
+    }
+
+    KeAcquireSpinLock(&Registry->Lock, &oldIrql);
+
+    Registry->Adapters[index] = NULL;
+    Registry->AdapterCount--;
+    DeviceContext->Load.Registered = FALSE;
+
+    AdapterRssiForget(Registry->RssiCache, index);
+
+    // Drop pending migrations that involve this adapter
+    for (i = Registry->MigrationHead; i != Registry->MigrationTail; i++) {
+        PADAPTER_MIGRATION migration =
+            &Registry->Migrations[i & (ADAPTER_MIGRATION_QUEUE_SIZE - 1)];
+        if (migration->SourceAdapter == index || migration->TargetAdapter == index) {
+            migration->DeviceAddress = BTH_ADDR_NULL;
+        }
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, oldIrql);
+}
+
+/*++
+Routine Description:
+    Accounts bytes moved over an adapter's radio for airtime estimation
+
+Arguments:
+    DeviceContext - Adapter's device context
+    Bytes - Payload bytes transferred
+
+Return Value:
+    None
+--*/
+VOID
+AdapterAccountAirtime(
+    _Inout_ PDEVICE_CONTEXT DeviceContext,
+    _In_ size_t Bytes
+)
+{
+    InterlockedExchangeAdd64(&DeviceContext->Load.WindowBytes, (LONG64)Bytes);
+    InterlockedExchangeAdd64(&DeviceContext->Load.TotalBytes, (LONG64)Bytes);
+}
+
+/*++
+Routine Description:
+    Records the RSSI at which an adapter hears devices, from a batch of
+    advertising reports or a link's RSSI read
+
+Arguments:
+    Registry - Adapter registry
+    DeviceContext - Adapter that observed the devices
+    DeviceAddresses - Observed devices (identity addresses)
+    Rssi - Signal strength of each, in dBm
+    Count - Observations
+
+Return Value:
+    None
+--*/
+VOID
+AdapterRecordRssi(
+    _Inout_ PADAPTER_REGISTRY Registry,
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_reads_(Count) const BTH_ADDR* DeviceAddresses,
+    _In_reads_(Count) const CHAR* Rssi,
+    _In_ ULONG Count
+)
+{
+    KIRQL oldIrql;
+    ULONG i;
+
+    if (!DeviceContext->Load.Registered || Count == 0) {
+        return;
+    }
+
+    KeAcquireSpinLock(&Registry->Lock, &oldIrql);
+
+    for (i = 0; i < Count; i++) {
+        AdapterRssiRecord(Registry->RssiCache, DeviceContext->Load.AdapterIndex,
+            DeviceAddresses[i], Rssi[i]);
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, oldIrql);
+}
+
+/*++
+Routine Description:
+    Queues HCI Read RSSI for every open link of an adapter. The command
+    pipeline merges a read still queued for the same handle, so a slow
+    transport never piles them up; the event intake records the replies.
+
+Arguments:
+    DeviceContext - Adapter whose links to read
+
+Return Value:
+    None
+--*/
+VOID
+AdapterPollLinkRssi(
+    _In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+    USHORT handles[ACL_CREDIT_MAX_LINKS];
+    UCHAR parameters[2];
+    ULONG count = 0;
+    ULONG id;
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&DeviceContext->Acl.Lock, &irql);
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        if (DeviceContext->Acl.Pool.Links[i].InUse) {
+            handles[count++] = DeviceContext->Acl.Pool.Links[i].Handle;
+        }
+    }
+    KeReleaseSpinLock(&DeviceContext->Acl.Lock, irql);
+
+    // Outside the ACL lock: a submission may complete a pended fetch
+    for (i = 0; i < count; i++) {
+        parameters[0] = (UCHAR)handles[i];
+        parameters[1] = (UCHAR)(handles[i] >> 8);
+        HciCommandSubmit(&DeviceContext->HciCommands, HCI_OP_READ_RSSI, PRIORITY_LOW,
+            parameters, sizeof(parameters), &id, NULL);
+    }
+}
+
+/*++
+Routine Description:
+    Copies every adapter's load into the policy's view. Caller holds
+    the registry lock.
+--*/
+static VOID
+AdapterSnapshot(
+    _In_ PADAPTER_REGISTRY Registry,
+    _Out_writes_(MAX_BLUETOOTH_ADAPTERS) PADAPTER_STATE States
+)
+{
+    ULONG i;
+
+    RtlZeroMemory(States, MAX_BLUETOOTH_ADAPTERS * sizeof(ADAPTER_STATE));
+
+    for (i = 0; i < MAX_BLUETOOTH_ADAPTERS; i++) {
+        PDEVICE_CONTEXT adapter = Registry->Adapters[i];
+
+        if (adapter == NULL) {
+            continue;
+        }
+
+        States[i].Present = TRUE;
+        States[i].Congested = adapter->Load.Congested;
+        States[i].Connections = adapter->ActiveConnections;
+        States[i].MaxConnections = MAX_BLUETOOTH_CONNECTIONS;
+        States[i].AirtimePermille = adapter->Load.AirtimePermille;
+    }
+}
+
+/*++
+Routine Description:
+    Chooses the adapter a new connection should be placed on
+
+Arguments:
+    Registry - Adapter registry
+    DeviceAddress - Device about to be connected
+    Priority - Requested CONNECTION_PRIORITY
+    Score - Optionally receives the winning score
+
+Return Value:
+    Adapter device context, or NULL if every adapter is full
+--*/
+PDEVICE_CONTEXT
+AdapterSelectForConnection(
+    _Inout_ PADAPTER_REGISTRY Registry,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ ULONG Priority,
+    _Out_opt_ PULONG Score
+)
+{
+    ADAPTER_STATE states[MAX_BLUETOOTH_ADAPTERS];
+    PDEVICE_CONTEXT best = NULL;
+    KIRQL oldIrql;
+    ULONG index;
+
+    KeAcquireSpinLock(&Registry->Lock, &oldIrql);
+
+    AdapterSnapshot(Registry, states);
+    index = AdapterPlacementSelect(Registry->RssiCache, states, DeviceAddress, Priority, Score);
+    if (index != ADAPTER_NONE) {
+        best = Registry->Adapters[index];
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, oldIrql);
+
+    return best;
+}
+
+/*++
+Routine Description:
+    Closes an adapter's load window and updates its smoothed airtime
+
+Arguments:
+    Load - Adapter load record
+
+Return Value:
+    None
+--*/
+static VOID
+AdapterRollLoadWindow(
+    _Inout_ PADAPTER_LOAD Load
+)
+{
+    LARGE_INTEGER now;
+    LONGLONG elapsed;
+    LONG64 bytes;
+    ULONGLONG permille;
+
+    KeQuerySystemTime(&now);
+    elapsed = now.QuadPart - Load->WindowStart.QuadPart;   // 100 ns units
+    if (elapsed <= 0) {
+        return;
+    }
+
+    bytes = InterlockedExchange64(&Load->WindowBytes, 0);
+    Load->WindowStart = now;
+
+    // bits / (capacity * seconds), in permille
+    permille = ((ULONGLONG)bytes * 8 * 1000 * 10000000) /
+        ((ULONGLONG)ADAPTER_LINK_CAPACITY_BPS * (ULONGLONG)elapsed);
+    if (permille > 1000) {
+        permille = 1000;
+    }
+
+    Load->AirtimePermille = (Load->AirtimePermille * 3 + (ULONG)permille) / 4;
+
+    if (!Load->Congested && Load->AirtimePermille >= ADAPTER_CONGESTED_PERMILLE) {
+        Load->Congested = TRUE;
+    } else if (Load->Congested && Load->AirtimePermille < ADAPTER_RELIEVED_PERMILLE) {
+        Load->Congested = FALSE;
+    }
+}
+
+/*++
+Routine Description:
+    Finds a LOW priority link on a congested adapter that another adapter
+    can take over, and queues at most one migration per call.
+
+Arguments:
+    Registry - Adapter registry
+
+Return Value:
+    None
+--*/
+VOID
+AdapterRebalance(
+    _Inout_ PADAPTER_REGISTRY Registry
+)
+{
+    ADAPTER_STATE states[MAX_BLUETOOTH_ADAPTERS];
+    KIRQL oldIrql;
+    ULONG s;
+    ULONG i;
+
+    KeAcquireSpinLock(&Registry->Lock, &oldIrql);
+
+    if (Registry->MigrationTail - Registry->MigrationHead >= ADAPTER_MIGRATION_QUEUE_SIZE) {
+        goto Exit;
+    }
+
+    AdapterSnapshot(Registry, states);
+
+    for (s = 0; s < MAX_BLUETOOTH_ADAPTERS; s++) {
+        PDEVICE_CONTEXT source = Registry->Adapters[s];
+
+        if (source == NULL || !source->Load.Congested) {
+            continue;
+        }
+
+        KeAcquireSpinLockAtDpcLevel(&source->DeviceListLock);
+
+        for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+            PBTH_DEVICE_INFO device = &source->ConnectedDevices[i];
+            PADAPTER_MIGRATION migration;
+            ULONG target;
+            ULONG q;
+
+            if (!device->IsConnected || device->ConnectionPriority != PRIORITY_LOW) {
+                continue;
+            }
+
+            // Skip links that already have a migration pending
+            for (q = Registry->MigrationHead; q != Registry->MigrationTail; q++) {
+                if (Registry->Migrations[q & (ADAPTER_MIGRATION_QUEUE_SIZE - 1)].DeviceAddress ==
+                    device->DeviceAddress) {
+                    break;
+                }
+            }
+            if (q != Registry->MigrationTail) {
+                continue;
+            }
+
+            target = AdapterPlacementMigrationTarget(Registry->RssiCache, states, s,
+                device->DeviceAddress);
+            if (target == ADAPTER_NONE) {
+                continue;
+            }
+
+            migration = &Registry->Migrations[
+                Registry->MigrationTail & (ADAPTER_MIGRATION_QUEUE_SIZE - 1)];
+            migration->DeviceAddress = device->DeviceAddress;
+            migration->SourceAdapter = s;
+            migration->TargetAdapter = target;
+            Registry->MigrationTail++;
+
+            KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+                "MultiDeviceBT: Migrating LOW priority link %I64x from adapter %u to %u\n",
+                device->DeviceAddress, s, target));
+
+            KeReleaseSpinLockFromDpcLevel(&source->DeviceListLock);
+            goto Exit;
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&source->DeviceListLock);
+    }
+
+Exit:
+    KeReleaseSpinLock(&Registry->Lock, oldIrql);
+}
+
+/*++
+Routine Description:
+    Periodic per-adapter timer: rolls the load window, rebalances links
+    across adapters and device affinity across processors. With more
+    than one adapter, also refreshes the RSSI of this adapter's links.
+
+Arguments:
+    Timer - Adapter load timer (parent is the WDFDEVICE)
+
+Return Value:
+    None
+--*/
+VOID
+BTDriverEvtAdapterLoadTimer(
+    _In_ WDFTIMER Timer
+)
+{
+    PDEVICE_CONTEXT deviceContext = DeviceGetContext(WdfTimerGetParentObject(Timer));
+    PDRIVER_CONTEXT driverContext = DriverGetContext(WdfGetDriver());
+
+    AdapterRollLoadWindow(&deviceContext->Load);
+    if (driverContext->AdapterRegistry.AdapterCount > 1) {
+        AdapterPollLinkRssi(deviceContext);
+    }
+    AdapterRebalance(&driverContext->AdapterRegistry);
+    AffinityRebalance(&deviceContext->Affinity);
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_SELECT_ADAPTER: tells the service which
+    adapter a new connection should be opened on
+
+Arguments:
+    DeviceContext - Device context of the adapter that received the request
+    Request - Handle to I/O request
+    InputBufferLength - Input buffer length
+    OutputBufferLength - Output buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleSelectAdapter(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PADAPTER_SELECT_REQUEST selectRequest;
+    PADAPTER_SELECT_RESULT result;
+    PDRIVER_CONTEXT driverContext = DriverGetContext(WdfGetDriver());
+    PDEVICE_CONTEXT adapter;
+    BTH_ADDR deviceAddress;
+    ULONG priority;
+    ULONG score;
+
+    UNREFERENCED_PARAMETER(DeviceContext);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(ADAPTER_SELECT_REQUEST), (PVOID*)&selectRequest, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    deviceAddress = selectRequest->DeviceAddress;
+    priority = selectRequest->Priority;
+    if (priority > PRIORITY_LOW) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(ADAPTER_SELECT_RESULT), (PVOID*)&result, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    adapter = AdapterSelectForConnection(&driverContext->AdapterRegistry,
+        deviceAddress, priority, &score);
+    if (adapter == NULL) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    result->AdapterIndex = adapter->Load.AdapterIndex;
+    result->Score = score;
+    *BytesReturned = sizeof(ADAPTER_SELECT_RESULT);
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_ADAPTER_LOAD: reports every registered
+    adapter's connection count and airtime
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    OutputBufferLength - Output buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleGetAdapterLoad(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PADAPTER_LOAD_INFO info;
+    PADAPTER_REGISTRY registry = &DriverGetContext(WdfGetDriver())->AdapterRegistry;
+    ULONG capacity;
+    ULONG count = 0;
+    KIRQL oldIrql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(DeviceContext);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(ADAPTER_LOAD_INFO), (PVOID*)&info, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    capacity = (ULONG)(OutputBufferLength / sizeof(ADAPTER_LOAD_INFO));
+
+    KeAcquireSpinLock(&registry->Lock, &oldIrql);
+
+    for (i = 0; i < MAX_BLUETOOTH_ADAPTERS; i++) {
+        PDEVICE_CONTEXT adapter = registry->Adapters[i];
+
+        if (adapter == NULL) {
+            continue;
+        }
+        if (count == capacity) {
+            status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        info[count].AdapterIndex = i;
+        info[count].ActiveConnections = adapter->ActiveConnections;
+        info[count].AirtimePermille = adapter->Load.AirtimePermille;
+        info[count].Congested = adapter->Load.Congested;
+        count++;
+    }
+
+    KeReleaseSpinLock(&registry->Lock, oldIrql);
+
+    *BytesReturned = (size_t)count * sizeof(ADAPTER_LOAD_INFO);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_MIGRATIONS: drains queued migrations so
+    the service can disconnect on the source and reconnect on the target
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    OutputBufferLength - Output buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleGetMigrations(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PADAPTER_MIGRATION migrations;
+    PADAPTER_REGISTRY registry = &DriverGetContext(WdfGetDriver())->AdapterRegistry;
+    ULONG capacity;
+    ULONG count = 0;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(DeviceContext);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(ADAPTER_MIGRATION), (PVOID*)&migrations, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    capacity = (ULONG)(OutputBufferLength / sizeof(ADAPTER_MIGRATION));
+
+    KeAcquireSpinLock(&registry->Lock, &oldIrql);
+
+    while (registry->MigrationHead != registry->MigrationTail && count < capacity) {
+        PADAPTER_MIGRATION migration = &registry->Migrations[
+            registry->MigrationHead & (ADAPTER_MIGRATION_QUEUE_SIZE - 1)];
+
+        registry->MigrationHead++;
+        if (migration->DeviceAddress != BTH_ADDR_NULL) {
+            migrations[count++] = *migration;
+        }
+    }
+
+    KeReleaseSpinLock(&registry->Lock, oldIrql);
+
+    *BytesReturned = (size_t)count * sizeof(ADAPTER_MIGRATION);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAdapter.h
+
+Abstract:
+    Driver-wide adapter registry: places new connections on the
+    least-loaded radio and migrates LOW priority links off congested ones
+
+--*/
+
+#ifndef _MULTIDEVICEBTADAPTER_H_
+#define _MULTIDEVICEBTADAPTER_H_
+
+#include "MultiDeviceBTPlacement.h"
+
+#define ADAPTER_MIGRATION_QUEUE_SIZE    8       // Power of two
+
+// Load accounting
+#define ADAPTER_LOAD_PERIOD_MS          1000
+#define ADAPTER_LINK_CAPACITY_BPS       1400000 // Practical LE 2M throughput
+#define ADAPTER_CONGESTED_PERMILLE      800     // Enter congestion
+#define ADAPTER_RELIEVED_PERMILLE       650     // Leave congestion (hysteresis)
+
+struct _DEVICE_CONTEXT;
+
+// Per-adapter load, embedded in each DEVICE_CONTEXT
+typedef struct _ADAPTER_LOAD {
+    ULONG AdapterIndex;
+    ULONG AirtimePermille;      // Smoothed radio utilization
+    volatile LONG64 WindowBytes;
+    volatile LONG64 TotalBytes;     // Monotonic; for consumers with their own window
+    LARGE_INTEGER WindowStart;
+    BOOLEAN Congested;
+    BOOLEAN Registered;
+    WDFTIMER LoadTimer;
+} ADAPTER_LOAD, *PADAPTER_LOAD;
+
+// A LOW priority link the connection manager should move
+typedef struct _ADAPTER_MIGRATION {
+    BTH_ADDR DeviceAddress;
+    ULONG SourceAdapter;
+    ULONG TargetAdapter;
+} ADAPTER_MIGRATION, *PADAPTER_MIGRATION;
+
+// Placement request/response (IOCTL_MULTI_BT_SELECT_ADAPTER)
+typedef struct _ADAPTER_SELECT_REQUEST {
+    BTH_ADDR DeviceAddress;
+    ULONG Priority;
+} ADAPTER_SELECT_REQUEST, *PADAPTER_SELECT_REQUEST;
+
+typedef struct _ADAPTER_SELECT_RESULT {
+    ULONG AdapterIndex;
+    ULONG Score;
+} ADAPTER_SELECT_RESULT, *PADAPTER_SELECT_RESULT;
+
+// Per-adapter report (IOCTL_MULTI_BT_GET_ADAPTER_LOAD)
+typedef struct _ADAPTER_LOAD_INFO {
+    ULONG AdapterIndex;
+    ULONG ActiveConnections;
+    ULONG AirtimePermille;
+    BOOLEAN Congested;
+} ADAPTER_LOAD_INFO, *PADAPTER_LOAD_INFO;
+
+typedef struct _ADAPTER_REGISTRY {
+    KSPIN_LOCK Lock;            // Acquired before any DeviceListLock
+    ULONG AdapterCount;
+    struct _DEVICE_CONTEXT* Adapters[MAX_BLUETOOTH_ADAPTERS];
+    ADAPTER_RSSI_ENTRY RssiCache[ADAPTER_RSSI_CACHE_SIZE];
+    ULONG MigrationHead;
+    ULONG MigrationTail;
+    ADAPTER_MIGRATION Migrations[ADAPTER_MIGRATION_QUEUE_SIZE];
+} ADAPTER_REGISTRY, *PADAPTER_REGISTRY;
+
+// Driver object context
+typedef struct _DRIVER_CONTEXT {
+    ADAPTER_REGISTRY AdapterRegistry;
+    BOND_STORE Bonds;           // Shared by all adapters; loaded by the first to start
+} DRIVER_CONTEXT, *PDRIVER_CONTEXT;
+
+VOID AdapterRegistryInitialize(
+    _Out_ PADAPTER_REGISTRY Registry
+);
+
+NTSTATUS AdapterRegister(
+    _Inout_ PADAPTER_REGISTRY Registry,
+    _In_ struct _DEVICE_CONTEXT* DeviceContext
+);
+
+VOID AdapterUnregister(
+    _Inout_ PADAPTER_REGISTRY Registry,
+    _In_ struct _DEVICE_CONTEXT* DeviceContext
+);
+
+VOID AdapterAccountAirtime(
+    _Inout_ struct _DEVICE_CONTEXT* DeviceContext,
+    _In_ size_t Bytes
+);
+
+VOID AdapterRecordRssi(
+    _Inout_ PADAPTER_REGISTRY Registry,
+    _In_ struct _DEVICE_CONTEXT* DeviceContext,
+    _In_reads_(Count) const BTH_ADDR* DeviceAddresses,
+    _In_reads_(Count) const CHAR* Rssi,
+    _In_ ULONG Count
+);
+
+VOID AdapterPollLinkRssi(
+    _In_ struct _DEVICE_CONTEXT* DeviceContext
+);
+
+struct _DEVICE_CONTEXT* AdapterSelectForConnection(
+    _Inout_ PADAPTER_REGISTRY Registry,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ ULONG Priority,
+    _Out_opt_ PULONG Score
+);
+
+VOID AdapterRebalance(
+    _Inout_ PADAPTER_REGISTRY Registry
+);
+
+#endif // _MULTIDEVICEBTADAPTER_H_
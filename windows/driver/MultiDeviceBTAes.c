@@ -0,0 +1,959 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAes.c
+
+Abstract:
+    AES-128 and AES-CCM (NIST SP 800-38C), batched.
+
+    CCM runs its two passes over the whole batch. The CTR keystream
+    blocks of every packet are independent, so they go through the
+    cipher in groups. The CBC-MAC is serial within a packet, so
+    AES_LANES packets are chained at once, one block each per cipher
+    call. When a lane's packet finishes, the next packet takes the
+    lane. Encryption MACs the plaintext and then encrypts it.
+    Decryption decrypts first and MACs the result. Either pass may run
+    in place.
+
+    The AES-NI path encrypts four blocks per call. Each block may use a
+    different key.
+
+    The portable path is the bitsliced AES by Thomas Pornin, the one
+    BearSSL ships as aes_ct. Two blocks are spread across eight 32-bit
+    words, and the S-box is the Boyar-Peralta circuit. No memory access
+    or branch depends on key or data. Block A sits in the even bit
+    positions and block B in the odd ones, so two different keys are
+    merged with a mask.
+
+    A 32-bit kernel would have to save the FPU state around SSE code, so
+    it always takes the portable path. PCLMULQDQ is not used. It only
+    accelerates GHASH, and CCM has none.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__) || \
+    (!defined(_KERNEL_MODE) && (defined(_M_IX86) || defined(__i386__)))
+#define AES_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#else
+#define AES_X86 0
+#endif
+
+#include "MultiDeviceBTAes.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define AES_TARGET_AESNI            __attribute__((target("aes,sse2")))
+#else
+#define AES_TARGET_AESNI
+#endif
+
+#define AES_LANES                   8       // CBC-MAC chains in flight
+#define AES_EVEN_BITS               0x55555555
+#define AES_ODD_BITS                0xAAAAAAAA
+
+static const UCHAR AesRcon[AES_ROUNDS] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36
+};
+
+static volatile LONG AesIsaCache = -1;
+
+// One packet's CBC-MAC chain
+typedef struct _AES_CCM_LANE {
+    PAES_CCM_PACKET Packet;
+    const UCHAR* Data;          // Plaintext the MAC covers
+    PUCHAR Chain;
+    ULONG Block;
+    ULONG HeaderBlocks;         // B0 and the AAD blocks
+    ULONG Blocks;
+} AES_CCM_LANE, *PAES_CCM_LANE;
+
+
+/*++
+Routine Description:
+    Returns the widest instruction set this CPU and OS support
+--*/
+AES_ISA
+AesDetectIsa(
+    VOID
+)
+{
+    LONG cached = AesIsaCache;
+
+    if (cached < 0) {
+        cached = AesIsaPortable;
+#if AES_X86
+        {
+            int regs[4];
+
+#ifdef _MSC_VER
+            __cpuid(regs, 1);
+#else
+            __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+            if ((regs[2] & (1 << 25)) != 0) {
+                cached = AesIsaAesNi;
+            }
+        }
+#endif
+        AesIsaCache = cached;
+    }
+
+    return (AES_ISA)cached;
+}
+
+static ULONG
+AesLoad32(
+    _In_reads_bytes_(4) const UCHAR* Data
+)
+{
+    return (ULONG)Data[0] | ((ULONG)Data[1] << 8) |
+        ((ULONG)Data[2] << 16) | ((ULONG)Data[3] << 24);
+}
+
+static VOID
+AesStore32(
+    _Out_writes_bytes_(4) PUCHAR Data,
+    _In_ ULONG Value
+)
+{
+    Data[0] = (UCHAR)Value;
+    Data[1] = (UCHAR)(Value >> 8);
+    Data[2] = (UCHAR)(Value >> 16);
+    Data[3] = (UCHAR)(Value >> 24);
+}
+
+#define AES_SWAPN(cl, ch, s, x, y)                                      \
+    do {                                                                \
+        ULONG a_ = (x), b_ = (y);                                       \
+        (x) = (a_ & (ULONG)(cl)) | ((b_ & (ULONG)(cl)) << (s));         \
+        (y) = ((a_ & (ULONG)(ch)) >> (s)) | (b_ & (ULONG)(ch));         \
+    } while (0)
+
+/*++
+Routine Description:
+    Moves two blocks between byte order and bitsliced order. It is
+    its own inverse.
+--*/
+static VOID
+AesOrtho(
+    _Inout_updates_(8) ULONG* Q
+)
+{
+    AES_SWAPN(0x55555555, 0xAAAAAAAA, 1, Q[0], Q[1]);
+    AES_SWAPN(0x55555555, 0xAAAAAAAA, 1, Q[2], Q[3]);
+    AES_SWAPN(0x55555555, 0xAAAAAAAA, 1, Q[4], Q[5]);
+    AES_SWAPN(0x55555555, 0xAAAAAAAA, 1, Q[6], Q[7]);
+
+    AES_SWAPN(0x33333333, 0xCCCCCCCC, 2, Q[0], Q[2]);
+    AES_SWAPN(0x33333333, 0xCCCCCCCC, 2, Q[1], Q[3]);
+    AES_SWAPN(0x33333333, 0xCCCCCCCC, 2, Q[4], Q[6]);
+    AES_SWAPN(0x33333333, 0xCCCCCCCC, 2, Q[5], Q[7]);
+
+    AES_SWAPN(0x0F0F0F0F, 0xF0F0F0F0, 4, Q[0], Q[4]);
+    AES_SWAPN(0x0F0F0F0F, 0xF0F0F0F0, 4, Q[1], Q[5]);
+    AES_SWAPN(0x0F0F0F0F, 0xF0F0F0F0, 4, Q[2], Q[6]);
+    AES_SWAPN(0x0F0F0F0F, 0xF0F0F0F0, 4, Q[3], Q[7]);
+}
+
+/*++
+Routine Description:
+    The AES S-box on 32 bytes at once: the Boyar-Peralta circuit of
+    113 gates
+--*/
+static VOID
+AesSbox(
+    _Inout_updates_(8) ULONG* Q
+)
+{
+    ULONG x0, x1, x2, x3, x4, x5, x6, x7;
+    ULONG y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    ULONG y10, y11, y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+    ULONG z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    ULONG z10, z11, z12, z13, z14, z15, z16, z17;
+    ULONG t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    ULONG t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    ULONG t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    ULONG t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    ULONG t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    ULONG t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    ULONG t60, t61, t62, t63, t64, t65, t66, t67;
+    ULONG s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = Q[7];
+    x1 = Q[6];
+    x2 = Q[5];
+    x3 = Q[4];
+    x4 = Q[3];
+    x5 = Q[2];
+    x6 = Q[1];
+    x7 = Q[0];
+
+    // Top linear transformation
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    // Non-linear section: inversion in GF(2^8)
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    // Bottom linear transformation
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    Q[7] = s0;
+    Q[6] = s1;
+    Q[5] = s2;
+    Q[4] = s3;
+    Q[3] = s4;
+    Q[2] = s5;
+    Q[1] = s6;
+    Q[0] = s7;
+}
+
+static VOID
+AesShiftRows(
+    _Inout_updates_(8) ULONG* Q
+)
+{
+    ULONG i;
+
+    for (i = 0; i < 8; i++) {
+        ULONG x = Q[i];
+
+        Q[i] = (x & 0x000000FF) |
+            ((x & 0x0000FC00) >> 2) | ((x & 0x00000300) << 6) |
+            ((x & 0x00F00000) >> 4) | ((x & 0x000F0000) << 4) |
+            ((x & 0xC0000000) >> 6) | ((x & 0x3F000000) << 2);
+    }
+}
+
+static ULONG
+AesRotr16(
+    _In_ ULONG x
+)
+{
+    return (x << 16) | (x >> 16);
+}
+
+static VOID
+AesMixColumns(
+    _Inout_updates_(8) ULONG* Q
+)
+{
+    ULONG q0 = Q[0], q1 = Q[1], q2 = Q[2], q3 = Q[3];
+    ULONG q4 = Q[4], q5 = Q[5], q6 = Q[6], q7 = Q[7];
+    ULONG r0 = (q0 >> 8) | (q0 << 24);
+    ULONG r1 = (q1 >> 8) | (q1 << 24);
+    ULONG r2 = (q2 >> 8) | (q2 << 24);
+    ULONG r3 = (q3 >> 8) | (q3 << 24);
+    ULONG r4 = (q4 >> 8) | (q4 << 24);
+    ULONG r5 = (q5 >> 8) | (q5 << 24);
+    ULONG r6 = (q6 >> 8) | (q6 << 24);
+    ULONG r7 = (q7 >> 8) | (q7 << 24);
+
+    Q[0] = q7 ^ r7 ^ r0 ^ AesRotr16(q0 ^ r0);
+    Q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ AesRotr16(q1 ^ r1);
+    Q[2] = q1 ^ r1 ^ r2 ^ AesRotr16(q2 ^ r2);
+    Q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ AesRotr16(q3 ^ r3);
+    Q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ AesRotr16(q4 ^ r4);
+    Q[5] = q4 ^ r4 ^ r5 ^ AesRotr16(q5 ^ r5);
+    Q[6] = q5 ^ r5 ^ r6 ^ AesRotr16(q6 ^ r6);
+    Q[7] = q6 ^ r6 ^ r7 ^ AesRotr16(q7 ^ r7);
+}
+
+static VOID
+AesAddRoundKey(
+    _Inout_updates_(8) ULONG* Q,
+    _In_reads_(8) const ULONG* KeyA,
+    _In_reads_(8) const ULONG* KeyB
+)
+{
+    ULONG i;
+
+    if (KeyA == KeyB) {
+        for (i = 0; i < 8; i++) {
+            Q[i] ^= KeyA[i];
+        }
+    } else {
+        for (i = 0; i < 8; i++) {
+            Q[i] ^= (KeyA[i] & AES_EVEN_BITS) | (KeyB[i] & AES_ODD_BITS);
+        }
+    }
+}
+
+static ULONG
+AesSubWord(
+    _In_ ULONG Word
+)
+{
+    ULONG q[8];
+    ULONG i;
+
+    for (i = 0; i < 8; i++) {
+        q[i] = Word;
+    }
+    AesOrtho(q);
+    AesSbox(q);
+    AesOrtho(q);
+
+    return q[0];
+}
+
+/*++
+Routine Description:
+    Encrypts two blocks on the portable path, each under its own key
+--*/
+static VOID
+AesEncryptPair(
+    _In_ const AES_KEY* KeyA,
+    _In_ const AES_KEY* KeyB,
+    _In_reads_bytes_(2 * AES_BLOCK_BYTES) const UCHAR* Input,
+    _Out_writes_bytes_(2 * AES_BLOCK_BYTES) PUCHAR Output
+)
+{
+    ULONG q[8];
+    ULONG i, round;
+
+    for (i = 0; i < 4; i++) {
+        q[2 * i] = AesLoad32(Input + 4 * i);
+        q[2 * i + 1] = AesLoad32(Input + AES_BLOCK_BYTES + 4 * i);
+    }
+    AesOrtho(q);
+
+    AesAddRoundKey(q, KeyA->Bitsliced[0], KeyB->Bitsliced[0]);
+    for (round = 1; round < AES_ROUNDS; round++) {
+        AesSbox(q);
+        AesShiftRows(q);
+        AesMixColumns(q);
+        AesAddRoundKey(q, KeyA->Bitsliced[round], KeyB->Bitsliced[round]);
+    }
+    AesSbox(q);
+    AesShiftRows(q);
+    AesAddRoundKey(q, KeyA->Bitsliced[AES_ROUNDS], KeyB->Bitsliced[AES_ROUNDS]);
+
+    AesOrtho(q);
+    for (i = 0; i < 4; i++) {
+        AesStore32(Output + 4 * i, q[2 * i]);
+        AesStore32(Output + AES_BLOCK_BYTES + 4 * i, q[2 * i + 1]);
+    }
+}
+
+#if AES_X86
+/*++
+Routine Description:
+    Encrypts up to four blocks with AES-NI, each under its own key.
+    The four rounds interleave so the AESENC latency is hidden.
+--*/
+AES_TARGET_AESNI
+static VOID
+AesNiEncrypt4(
+    _In_reads_(Count) const AES_KEY* const* Keys,
+    _In_reads_bytes_(Count * AES_BLOCK_BYTES) const UCHAR* Input,
+    _Out_writes_bytes_(Count * AES_BLOCK_BYTES) PUCHAR Output,
+    _In_ ULONG Count
+)
+{
+    const UCHAR* k0 = &Keys[0]->RoundKeys[0][0];
+    const UCHAR* k1 = (Count > 1) ? &Keys[1]->RoundKeys[0][0] : k0;
+    const UCHAR* k2 = (Count > 2) ? &Keys[2]->RoundKeys[0][0] : k0;
+    const UCHAR* k3 = (Count > 3) ? &Keys[3]->RoundKeys[0][0] : k0;
+    __m128i x0 = _mm_loadu_si128((const __m128i*)Input);
+    __m128i x1 = (Count > 1) ? _mm_loadu_si128((const __m128i*)(Input + 16)) : x0;
+    __m128i x2 = (Count > 2) ? _mm_loadu_si128((const __m128i*)(Input + 32)) : x0;
+    __m128i x3 = (Count > 3) ? _mm_loadu_si128((const __m128i*)(Input + 48)) : x0;
+    ULONG round;
+
+    x0 = _mm_xor_si128(x0, _mm_loadu_si128((const __m128i*)k0));
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)k1));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)k2));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)k3));
+
+    for (round = 1; round < AES_ROUNDS; round++) {
+        ULONG offset = round * AES_BLOCK_BYTES;
+
+        x0 = _mm_aesenc_si128(x0, _mm_loadu_si128((const __m128i*)(k0 + offset)));
+        x1 = _mm_aesenc_si128(x1, _mm_loadu_si128((const __m128i*)(k1 + offset)));
+        x2 = _mm_aesenc_si128(x2, _mm_loadu_si128((const __m128i*)(k2 + offset)));
+        x3 = _mm_aesenc_si128(x3, _mm_loadu_si128((const __m128i*)(k3 + offset)));
+    }
+
+    x0 = _mm_aesenclast_si128(x0, _mm_loadu_si128((const __m128i*)(k0 + AES_ROUNDS * AES_BLOCK_BYTES)));
+    x1 = _mm_aesenclast_si128(x1, _mm_loadu_si128((const __m128i*)(k1 + AES_ROUNDS * AES_BLOCK_BYTES)));
+    x2 = _mm_aesenclast_si128(x2, _mm_loadu_si128((const __m128i*)(k2 + AES_ROUNDS * AES_BLOCK_BYTES)));
+    x3 = _mm_aesenclast_si128(x3, _mm_loadu_si128((const __m128i*)(k3 + AES_ROUNDS * AES_BLOCK_BYTES)));
+
+    _mm_storeu_si128((__m128i*)Output, x0);
+    if (Count > 1) {
+        _mm_storeu_si128((__m128i*)(Output + 16), x1);
+    }
+    if (Count > 2) {
+        _mm_storeu_si128((__m128i*)(Output + 32), x2);
+    }
+    if (Count > 3) {
+        _mm_storeu_si128((__m128i*)(Output + 48), x3);
+    }
+}
+#endif
+
+/*++
+Routine Description:
+    Expands a 128-bit key for both paths
+--*/
+VOID
+AesExpandKey(
+    _Out_ PAES_KEY Key,
+    _In_reads_bytes_(AES_KEY_BYTES) const UCHAR* Secret
+)
+{
+    ULONG w[4 * (AES_ROUNDS + 1)];
+    ULONG tmp, i, round;
+
+    for (i = 0; i < 4; i++) {
+        w[i] = AesLoad32(Secret + 4 * i);
+    }
+
+    tmp = w[3];
+    for (i = 4; i < 4 * (AES_ROUNDS + 1); i++) {
+        if ((i & 3) == 0) {
+            tmp = (tmp << 24) | (tmp >> 8);
+            tmp = AesSubWord(tmp) ^ AesRcon[i / 4 - 1];
+        }
+        tmp ^= w[i - 4];
+        w[i] = tmp;
+    }
+
+    for (round = 0; round <= AES_ROUNDS; round++) {
+        ULONG* q = Key->Bitsliced[round];
+
+        for (i = 0; i < 4; i++) {
+            AesStore32(&Key->RoundKeys[round][4 * i], w[4 * round + i]);
+            q[2 * i] = q[2 * i + 1] = w[4 * round + i];
+        }
+        AesOrtho(q);
+    }
+
+    RtlSecureZeroMemory(w, sizeof(w));
+}
+
+/*++
+Routine Description:
+    Encrypts Count independent blocks. Keys[i] encrypts block i.
+    Input and Output may be the same buffer.
+--*/
+VOID
+AesEncryptBlocks(
+    _In_ AES_ISA Isa,
+    _In_reads_(Count) const AES_KEY* const* Keys,
+    _In_reads_bytes_(Count * AES_BLOCK_BYTES) const UCHAR* Input,
+    _Out_writes_bytes_(Count * AES_BLOCK_BYTES) PUCHAR Output,
+    _In_ ULONG Count
+)
+{
+    ULONG i;
+
+    if (Isa == AesIsaBest || Isa > AesDetectIsa()) {
+        Isa = AesDetectIsa();
+    }
+
+#if AES_X86
+    if (Isa == AesIsaAesNi) {
+        for (i = 0; i < Count; i += 4) {
+            AesNiEncrypt4(Keys + i, Input + i * AES_BLOCK_BYTES,
+                          Output + i * AES_BLOCK_BYTES, min(Count - i, 4));
+        }
+        return;
+    }
+#endif
+
+    for (i = 0; i + 1 < Count; i += 2) {
+        AesEncryptPair(Keys[i], Keys[i + 1], Input + i * AES_BLOCK_BYTES,
+                       Output + i * AES_BLOCK_BYTES);
+    }
+
+    if (i < Count) {
+        UCHAR pair[2 * AES_BLOCK_BYTES];
+
+        RtlCopyMemory(pair, Input + i * AES_BLOCK_BYTES, AES_BLOCK_BYTES);
+        RtlCopyMemory(pair + AES_BLOCK_BYTES, pair, AES_BLOCK_BYTES);
+        AesEncryptPair(Keys[i], Keys[i], pair, pair);
+        RtlCopyMemory(Output + i * AES_BLOCK_BYTES, pair, AES_BLOCK_BYTES);
+        RtlSecureZeroMemory(pair, sizeof(pair));
+    }
+}
+
+static NTSTATUS
+AesCcmValidate(
+    _In_ const AES_CCM_PACKET* Packet
+)
+{
+    ULONG L = 15 - (ULONG)Packet->NonceLength;
+
+    if (Packet->Key == NULL || Packet->Nonce == NULL || Packet->Mic == NULL ||
+        Packet->NonceLength < AES_CCM_NONCE_MIN || Packet->NonceLength > AES_CCM_NONCE_MAX ||
+        Packet->MicLength < AES_CCM_MIC_MIN || Packet->MicLength > AES_CCM_MIC_MAX ||
+        (Packet->MicLength & 1) != 0 || Packet->AadLength > AES_CCM_AAD_MAX ||
+        (Packet->AadLength != 0 && Packet->Aad == NULL) ||
+        (Packet->Length != 0 && (Packet->Input == NULL || Packet->Output == NULL))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // The length must fit the L-byte field
+    if (L < 4 && (Packet->Length >> (8 * L)) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Writes block Lane->Block of the MAC input: B0, then the AAD with
+    its two-byte length, then the plaintext, each zero-padded
+--*/
+static VOID
+AesCcmFormatBlock(
+    _In_ const AES_CCM_LANE* Lane,
+    _Out_writes_bytes_(AES_BLOCK_BYTES) PUCHAR Block
+)
+{
+    const AES_CCM_PACKET* packet = Lane->Packet;
+    ULONG L = 15 - (ULONG)packet->NonceLength;
+    ULONG i, offset, length;
+
+    RtlZeroMemory(Block, AES_BLOCK_BYTES);
+
+    if (Lane->Block == 0) {
+        Block[0] = (UCHAR)(((packet->AadLength != 0) ? 0x40 : 0) |
+                           (((packet->MicLength - 2) / 2) << 3) | (L - 1));
+        RtlCopyMemory(Block + 1, packet->Nonce, packet->NonceLength);
+        for (i = 0, length = packet->Length; i < L && i < 4; i++, length >>= 8) {
+            Block[15 - i] = (UCHAR)length;
+        }
+    } else if (Lane->Block < Lane->HeaderBlocks) {
+        offset = (Lane->Block - 1) * AES_BLOCK_BYTES;
+        for (i = 0; i < AES_BLOCK_BYTES; i++) {
+            ULONG position = offset + i;
+
+            if (position == 0) {
+                Block[i] = (UCHAR)(packet->AadLength >> 8);
+            } else if (position == 1) {
+                Block[i] = (UCHAR)packet->AadLength;
+            } else if (position - 2 < packet->AadLength) {
+                Block[i] = packet->Aad[position - 2];
+            }
+        }
+    } else {
+        offset = (Lane->Block - Lane->HeaderBlocks) * AES_BLOCK_BYTES;
+        length = min(packet->Length - offset, AES_BLOCK_BYTES);
+        RtlCopyMemory(Block, Lane->Data + offset, length);
+    }
+}
+
+/*++
+Routine Description:
+    CBC-MAC of every valid packet, AES_LANES chains at a time. Leaves T
+    in Chains[i].
+--*/
+static VOID
+AesCcmMac(
+    _In_ AES_ISA Isa,
+    _Inout_updates_(Count) PAES_CCM_PACKET Packets,
+    _In_ ULONG Count,
+    _In_ BOOLEAN Decrypt,
+    _Out_writes_(Count) UCHAR (*Chains)[AES_BLOCK_BYTES]
+)
+{
+    AES_CCM_LANE lanes[AES_LANES];
+    const AES_KEY* keys[AES_LANES];
+    UCHAR blocks[AES_LANES][AES_BLOCK_BYTES];
+    ULONG active = 0, next = 0, i, j;
+
+    for (;;) {
+        while (active < AES_LANES && next < Count) {
+            PAES_CCM_PACKET packet = &Packets[next];
+            PAES_CCM_LANE lane = &lanes[active];
+
+            if (NT_SUCCESS(packet->Status)) {
+                lane->Packet = packet;
+                lane->Data = Decrypt ? packet->Output : packet->Input;
+                lane->Chain = Chains[next];
+                lane->Block = 0;
+                lane->HeaderBlocks = 1 +
+                    ((packet->AadLength != 0) ? (packet->AadLength + 2 + 15) / 16 : 0);
+                lane->Blocks = lane->HeaderBlocks + (packet->Length + 15) / 16;
+                RtlZeroMemory(lane->Chain, AES_BLOCK_BYTES);
+                active++;
+            }
+            next++;
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        for (i = 0; i < active; i++) {
+            AesCcmFormatBlock(&lanes[i], blocks[i]);
+            for (j = 0; j < AES_BLOCK_BYTES; j++) {
+                blocks[i][j] ^= lanes[i].Chain[j];
+            }
+            keys[i] = lanes[i].Packet->Key;
+        }
+
+        AesEncryptBlocks(Isa, keys, blocks[0], blocks[0], active);
+
+        for (i = 0; i < active; i++) {
+            RtlCopyMemory(lanes[i].Chain, blocks[i], AES_BLOCK_BYTES);
+        }
+
+        // Retire finished chains; the next packet takes the lane
+        for (i = 0; i < active; ) {
+            if (++lanes[i].Block == lanes[i].Blocks) {
+                lanes[i] = lanes[--active];
+            } else {
+                i++;
+            }
+        }
+    }
+
+    RtlSecureZeroMemory(blocks, sizeof(blocks));
+}
+
+/*++
+Routine Description:
+    Encrypts the counter blocks collected so far and applies them:
+    block 0 of a packet is S0 for the MIC, the rest are its keystream
+--*/
+static VOID
+AesCcmCtrFlush(
+    _In_ AES_ISA Isa,
+    _Inout_updates_(Count) PAES_CCM_PACKET Packets,
+    _Out_writes_(Count) UCHAR (*S0)[AES_BLOCK_BYTES],
+    _In_reads_(Pending) const AES_KEY* const* Keys,
+    _Inout_updates_(Pending) UCHAR (*Blocks)[AES_BLOCK_BYTES],
+    _In_reads_(Pending) const ULONG* Owner,
+    _In_reads_(Pending) const ULONG* Index,
+    _In_ ULONG Pending
+)
+{
+    ULONG i, j;
+
+    AesEncryptBlocks(Isa, Keys, Blocks[0], Blocks[0], Pending);
+
+    for (i = 0; i < Pending; i++) {
+        PAES_CCM_PACKET packet = &Packets[Owner[i]];
+
+        if (Index[i] == 0) {
+            RtlCopyMemory(S0[Owner[i]], Blocks[i], AES_BLOCK_BYTES);
+        } else {
+            ULONG offset = (Index[i] - 1) * AES_BLOCK_BYTES;
+            ULONG length = min(packet->Length - offset, AES_BLOCK_BYTES);
+
+            for (j = 0; j < length; j++) {
+                packet->Output[offset + j] = packet->Input[offset + j] ^ Blocks[i][j];
+            }
+        }
+    }
+}
+
+/*++
+Routine Description:
+    CTR pass over every valid packet. Counter blocks from all packets
+    share cipher calls.
+--*/
+static VOID
+AesCcmCtr(
+    _In_ AES_ISA Isa,
+    _Inout_updates_(Count) PAES_CCM_PACKET Packets,
+    _In_ ULONG Count,
+    _Out_writes_(Count) UCHAR (*S0)[AES_BLOCK_BYTES]
+)
+{
+    const AES_KEY* keys[AES_LANES];
+    UCHAR blocks[AES_LANES][AES_BLOCK_BYTES];
+    ULONG owner[AES_LANES];
+    ULONG index[AES_LANES];
+    ULONG pending = 0, p, b, i;
+
+    for (p = 0; p < Count; p++) {
+        PAES_CCM_PACKET packet = &Packets[p];
+        ULONG L = 15 - (ULONG)packet->NonceLength;
+        ULONG counters;
+
+        if (!NT_SUCCESS(packet->Status)) {
+            continue;
+        }
+
+        counters = 1 + (packet->Length + 15) / 16;
+        for (b = 0; b < counters; b++) {
+            PUCHAR block = blocks[pending];
+            ULONG counter = b;
+
+            RtlZeroMemory(block, AES_BLOCK_BYTES);
+            block[0] = (UCHAR)(L - 1);
+            RtlCopyMemory(block + 1, packet->Nonce, packet->NonceLength);
+            for (i = 0; i < L && i < 4; i++, counter >>= 8) {
+                block[15 - i] = (UCHAR)counter;
+            }
+
+            keys[pending] = packet->Key;
+            owner[pending] = p;
+            index[pending] = b;
+            if (++pending == AES_LANES) {
+                AesCcmCtrFlush(Isa, Packets, S0, keys, blocks, owner, index, pending);
+                pending = 0;
+            }
+        }
+    }
+
+    if (pending != 0) {
+        AesCcmCtrFlush(Isa, Packets, S0, keys, blocks, owner, index, pending);
+    }
+
+    RtlSecureZeroMemory(blocks, sizeof(blocks));
+}
+
+static ULONG
+AesCcmRun(
+    _In_ AES_ISA Isa,
+    _Inout_updates_(Count) PAES_CCM_PACKET Packets,
+    _In_ ULONG Count,
+    _In_ BOOLEAN Decrypt
+)
+{
+    UCHAR tags[AES_CCM_BATCH][AES_BLOCK_BYTES];
+    UCHAR s0[AES_CCM_BATCH][AES_BLOCK_BYTES];
+    ULONG base, n, i, j, succeeded = 0;
+
+    if (Isa == AesIsaBest || Isa > AesDetectIsa()) {
+        Isa = AesDetectIsa();
+    }
+
+    for (base = 0; base < Count; base += n) {
+        PAES_CCM_PACKET batch = Packets + base;
+
+        n = min(Count - base, AES_CCM_BATCH);
+        for (i = 0; i < n; i++) {
+            batch[i].Status = AesCcmValidate(&batch[i]);
+        }
+
+        if (!Decrypt) {
+            AesCcmMac(Isa, batch, n, FALSE, tags);
+            AesCcmCtr(Isa, batch, n, s0);
+        } else {
+            AesCcmCtr(Isa, batch, n, s0);
+            AesCcmMac(Isa, batch, n, TRUE, tags);
+        }
+
+        for (i = 0; i < n; i++) {
+            PAES_CCM_PACKET packet = &batch[i];
+            UCHAR diff = 0;
+
+            if (!NT_SUCCESS(packet->Status)) {
+                continue;
+            }
+
+            if (!Decrypt) {
+                for (j = 0; j < packet->MicLength; j++) {
+                    packet->Mic[j] = tags[i][j] ^ s0[i][j];
+                }
+                succeeded++;
+                continue;
+            }
+
+            // Constant-time compare; a forged packet's plaintext never leaves
+            for (j = 0; j < packet->MicLength; j++) {
+                diff |= (UCHAR)(tags[i][j] ^ s0[i][j] ^ packet->Mic[j]);
+            }
+            if (diff != 0) {
+                packet->Status = STATUS_AUTH_TAG_MISMATCH;
+                if (packet->Length != 0) {
+                    RtlSecureZeroMemory(packet->Output, packet->Length);
+                }
+            } else {
+                succeeded++;
+            }
+        }
+    }
+
+    RtlSecureZeroMemory(tags, sizeof(tags));
+    RtlSecureZeroMemory(s0, sizeof(s0));
+
+    return succeeded;
+}
+
+/*++
+Routine Description:
+    Encrypts a batch of packets and writes their MICs
+
+Arguments:
+    Isa - Instruction set, or AesIsaBest
+
+    Packets - Each packet's Status reports its own outcome
+
+    Count - Number of packets
+
+Return Value:
+    Number of packets encrypted
+--*/
+ULONG
+AesCcmEncrypt(
+    _In_ AES_ISA Isa,
+    _Inout_updates_(Count) PAES_CCM_PACKET Packets,
+    _In_ ULONG Count
+)
+{
+    return AesCcmRun(Isa, Packets, Count, FALSE);
+}
+
+/*++
+Routine Description:
+    Decrypts a batch of packets and checks their MICs
+
+Arguments:
+    Isa - Instruction set, or AesIsaBest
+
+    Packets - Each packet's Status reports its own outcome. A packet
+              that fails authentication gets STATUS_AUTH_TAG_MISMATCH
+              and a zeroed Output.
+
+    Count - Number of packets
+
+Return Value:
+    Number of packets that authenticated
+--*/
+ULONG
+AesCcmDecrypt(
+    _In_ AES_ISA Isa,
+    _Inout_updates_(Count) PAES_CCM_PACKET Packets,
+    _In_ ULONG Count
+)
+{
+    return AesCcmRun(Isa, Packets, Count, TRUE);
+}
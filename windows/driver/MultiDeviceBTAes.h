@@ -0,0 +1,96 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAes.h
+
+Abstract:
+    AES-128 and AES-CCM for link-layer, mesh and application payloads.
+    Each call takes a batch of small packets, and every packet may use
+    its own key. The serial CBC-MAC chains of several packets run side
+    by side, which keeps the AES pipeline full even when each packet is
+    only a block or two long.
+
+    AES-NI is used when the CPU has it. Otherwise the portable path runs
+    a bitsliced AES with no table lookups or secret-dependent branches,
+    so it is constant time. Both paths give identical output.
+
+    Portable C; builds in the driver and in user-mode tools.
+
+--*/
+
+#ifndef _MULTIDEVICEBTAES_H_
+#define _MULTIDEVICEBTAES_H_
+
+#define AES_BLOCK_BYTES             16
+#define AES_KEY_BYTES               16
+#define AES_ROUNDS                  10
+
+#define AES_CCM_NONCE_MIN           7
+#define AES_CCM_NONCE_MAX           13      // Every Bluetooth use: L = 2
+#define AES_CCM_MIC_MIN             4
+#define AES_CCM_MIC_MAX             16
+#define AES_CCM_AAD_MAX             0xFEFF  // Two-byte AAD length encoding only
+#define AES_CCM_BATCH               32      // Packets in flight per pass; larger batches are split
+
+// User-mode headers lack it
+#ifndef STATUS_AUTH_TAG_MISMATCH
+#define STATUS_AUTH_TAG_MISMATCH    ((NTSTATUS)0xC000A002L)
+#endif
+
+typedef enum _AES_ISA {
+    AesIsaPortable = 0,
+    AesIsaAesNi = 1,
+    AesIsaBest = 0xFF           // Pick the best the CPU supports
+} AES_ISA;
+
+// Expanded key, in the layout each path consumes
+typedef struct _AES_KEY {
+    UCHAR RoundKeys[AES_ROUNDS + 1][AES_BLOCK_BYTES];
+    ULONG Bitsliced[AES_ROUNDS + 1][8];
+} AES_KEY, *PAES_KEY;
+
+// One packet of a batch. Output may equal Input.
+typedef struct _AES_CCM_PACKET {
+    const AES_KEY* Key;
+    const UCHAR* Nonce;
+    const UCHAR* Aad;
+    const UCHAR* Input;
+    PUCHAR Output;
+    PUCHAR Mic;                 // Written by encryption, checked by decryption
+    ULONG Length;
+    USHORT AadLength;
+    UCHAR NonceLength;
+    UCHAR MicLength;            // Even, AES_CCM_MIC_MIN..AES_CCM_MIC_MAX
+    NTSTATUS Status;            // STATUS_AUTH_TAG_MISMATCH zeroes Output
+} AES_CCM_PACKET, *PAES_CCM_PACKET;
+
+AES_ISA AesDetectIsa(
+    VOID
+);
+
+VOID AesExpandKey(
+    _Out_ PAES_KEY Key,
+    _In_reads_bytes_(AES_KEY_BYTES) const UCHAR* Secret
+);
+
+VOID AesEncryptBlocks(
+    _In_ AES_ISA Isa,
+    _In_reads_(Count) const AES_KEY* const* Keys,
+    _In_reads_bytes_(Count * AES_BLOCK_BYTES) const UCHAR* Input,
+    _Out_writes_bytes_(Count * AES_BLOCK_BYTES) PUCHAR Output,
+    _In_ ULONG Count
+);
+
+ULONG AesCcmEncrypt(
+    _In_ AES_ISA Isa,
+    _Inout_updates_(Count) PAES_CCM_PACKET Packets,
+    _In_ ULONG Count
+);
+
+ULONG AesCcmDecrypt(
+    _In_ AES_ISA Isa,
+    _Inout_updates_(Count) PAES_CCM_PACKET Packets,
+    _In_ ULONG Count
+);
+
+#endif // _MULTIDEVICEBTAES_H_
@@ -0,0 +1,627 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAffinity.c
+
+Abstract:
+    CPU-affinity-aware deferred processing. Each connected device is
+    bound to one processor, and its completions and deferred work run
+    there through a device-targeted DPC. The event intake binds a
+    device when its ACL connection completes, unbinds it on
+    disconnection, and steers each link's Number Of Completed Packets
+    buffer returns through AffinityQueueWork. Its hot record, queue and
+    buffers therefore stay in one core's cache instead of following
+    whichever CPU the lower stack interrupted on. Devices start on the
+    processor their traffic arrives on. Once a period, a device moves
+    to the CPU most of its work arrives on, or off a CPU whose load has
+    skewed well above the coolest one.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+// Rebalance thresholds (completions per period)
+#define AFFINITY_SKEW_MIN_LOAD          1000
+#define AFFINITY_SKEW_RATIO             2
+#define AFFINITY_LOCALITY_HEADROOM_PCT  125
+
+static KDEFERRED_ROUTINE AffinityDpcRoutine;
+
+/*++
+Routine Description:
+    Points a device's DPC at a processor index
+--*/
+static VOID
+AffinitySetDpcTarget(
+    _Inout_ PAFFINITY_DEVICE Device,
+    _In_ ULONG ProcessorIndex
+)
+{
+    PROCESSOR_NUMBER processor;
+
+    if (NT_SUCCESS(KeGetProcessorNumberFromIndex(ProcessorIndex, &processor))) {
+        KeSetTargetProcessorDpcEx(&Device->Dpc, &processor);
+    }
+
+    Device->TargetProcessor = ProcessorIndex;
+    Device->PendingProcessor = AFFINITY_UNASSIGNED;
+}
+
+/*++
+Routine Description:
+    Initializes per-device steering state
+
+Arguments:
+    Affinity - Affinity context embedded in the device context
+    Owner - Owning device context, passed to work routines
+
+Return Value:
+    None
+--*/
+VOID
+AffinityInitialize(
+    _Out_ PAFFINITY_CONTEXT Affinity,
+    _In_ PDEVICE_CONTEXT Owner
+)
+{
+    ULONG i;
+
+    RtlZeroMemory(Affinity, sizeof(*Affinity));
+    KeInitializeSpinLock(&Affinity->Lock);
+
+    Affinity->Owner = Owner;
+    Affinity->ProcessorCount = min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+        AFFINITY_MAX_PROCESSORS);
+
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        PAFFINITY_DEVICE device = &Affinity->Devices[i];
+
+        KeInitializeSpinLock(&device->Lock);
+        KeInitializeDpc(&device->Dpc, AffinityDpcRoutine, Affinity);
+        KeSetImportanceDpc(&device->Dpc, MediumHighImportance);
+        device->TargetProcessor = AFFINITY_UNASSIGNED;
+        device->PendingProcessor = AFFINITY_UNASSIGNED;
+    }
+}
+
+/*++
+Routine Description:
+    Binds a newly connected device to a processor. The current processor
+    (where the connection completed) is preferred when it carries no more
+    devices than the least-loaded one.
+
+Arguments:
+    Affinity - Affinity context
+    Handle - ACL connection handle
+    DeviceAddress - Peer address
+
+Return Value:
+    Affinity slot, or AFFINITY_UNASSIGNED if every slot is taken
+--*/
+ULONG
+AffinityAssignDevice(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _In_ USHORT Handle,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    PAFFINITY_DEVICE device;
+    ULONG slot = AFFINITY_UNASSIGNED;
+    ULONG current;
+    ULONG best = 0;
+    ULONG cpu;
+    ULONG i;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Affinity->Lock, &oldIrql);
+
+    // At DISPATCH_LEVEL now, so this is the processor we stay on
+    current = KeGetCurrentProcessorIndex();
+
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        if (Affinity->Devices[i].Assigned && Affinity->Devices[i].Handle == Handle) {
+            // Repeated Connection Complete for a live handle
+            slot = i;
+            goto Exit;
+        }
+        if (slot == AFFINITY_UNASSIGNED && !Affinity->Devices[i].Assigned) {
+            slot = i;
+        }
+    }
+
+    if (slot == AFFINITY_UNASSIGNED) {
+        goto Exit;
+    }
+
+    device = &Affinity->Devices[slot];
+
+    for (cpu = 1; cpu < Affinity->ProcessorCount; cpu++) {
+        if (Affinity->CpuDeviceCount[cpu] < Affinity->CpuDeviceCount[best] ||
+            (Affinity->CpuDeviceCount[cpu] == Affinity->CpuDeviceCount[best] &&
+             Affinity->CpuLoad[cpu] < Affinity->CpuLoad[best])) {
+            best = cpu;
+        }
+    }
+
+    if (current < Affinity->ProcessorCount &&
+        Affinity->CpuDeviceCount[current] <= Affinity->CpuDeviceCount[best]) {
+        best = current;
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&device->Lock);
+
+    device->Assigned = TRUE;
+    device->Handle = Handle;
+    device->DeviceAddress = DeviceAddress;
+    device->CompletionRate = 0;
+    device->LocalCompletions = 0;
+    device->CrossCpuCompletions = 0;
+    device->RingOverflows = 0;
+    InterlockedExchange(&device->WindowCompletions, 0);
+    RtlZeroMemory(device->ArrivalCount, sizeof(device->ArrivalCount));
+
+    if (device->DpcQueued) {
+        device->PendingProcessor = best;
+    } else {
+        AffinitySetDpcTarget(device, best);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&device->Lock);
+
+    Affinity->CpuDeviceCount[best]++;
+
+Exit:
+    KeReleaseSpinLock(&Affinity->Lock, oldIrql);
+    return slot;
+}
+
+/*++
+Routine Description:
+    Unbinds a disconnected device. Work already queued still runs.
+
+Arguments:
+    Affinity - Affinity context
+    Handle - ACL connection handle
+
+Return Value:
+    None
+--*/
+VOID
+AffinityReleaseDevice(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _In_ USHORT Handle
+)
+{
+    PAFFINITY_DEVICE device;
+    ULONG target;
+    KIRQL oldIrql;
+    ULONG i;
+
+    KeAcquireSpinLock(&Affinity->Lock, &oldIrql);
+
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        device = &Affinity->Devices[i];
+        if (!device->Assigned || device->Handle != Handle) {
+            continue;
+        }
+
+        KeAcquireSpinLockAtDpcLevel(&device->Lock);
+        target = device->PendingProcessor != AFFINITY_UNASSIGNED ?
+            device->PendingProcessor : device->TargetProcessor;
+        device->Assigned = FALSE;
+        KeReleaseSpinLockFromDpcLevel(&device->Lock);
+
+        Affinity->CpuDeviceCount[target]--;
+        break;
+    }
+
+    KeReleaseSpinLock(&Affinity->Lock, oldIrql);
+}
+
+/*++
+Routine Description:
+    Returns the slot a connection handle is bound to
+
+Arguments:
+    Affinity - Affinity context
+    Handle - ACL connection handle
+
+Return Value:
+    Affinity slot, or AFFINITY_UNASSIGNED
+--*/
+ULONG
+AffinityFindDevice(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _In_ USHORT Handle
+)
+{
+    ULONG slot = AFFINITY_UNASSIGNED;
+    KIRQL oldIrql;
+    ULONG i;
+
+    KeAcquireSpinLock(&Affinity->Lock, &oldIrql);
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        if (Affinity->Devices[i].Assigned && Affinity->Devices[i].Handle == Handle) {
+            slot = i;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&Affinity->Lock, oldIrql);
+
+    return slot;
+}
+
+/*++
+Routine Description:
+    Runs or defers one unit of work (typically a request completion) for
+    a device. Work arriving on the device's processor with nothing queued
+    runs inline; everything else is queued in order to the device's DPC.
+    Work for an unbound slot runs inline.
+
+Arguments:
+    Affinity - Affinity context
+    Slot - Affinity slot from AffinityFindDevice, or AFFINITY_UNASSIGNED
+    Routine - Work routine
+    Context - Routine context
+
+Return Value:
+    None
+--*/
+VOID
+AffinityQueueWork(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _In_ ULONG Slot,
+    _In_ PAFFINITY_WORK_ROUTINE Routine,
+    _In_opt_ PVOID Context
+)
+{
+    PAFFINITY_DEVICE device;
+    PAFFINITY_WORK_ITEM item;
+    ULONG current;
+    KIRQL oldIrql;
+
+    if (Slot >= MAX_BLUETOOTH_CONNECTIONS) {
+        Routine(Affinity->Owner, Slot, Context);
+        return;
+    }
+
+    device = &Affinity->Devices[Slot];
+
+    KeAcquireSpinLock(&device->Lock, &oldIrql);
+
+    // Read only once raised: before that the thread could still migrate
+    current = KeGetCurrentProcessorIndex();
+
+    if (!device->Assigned) {
+        KeReleaseSpinLock(&device->Lock, oldIrql);
+        Routine(Affinity->Owner, Slot, Context);
+        return;
+    }
+
+    InterlockedIncrement(&device->WindowCompletions);
+    if (current < AFFINITY_MAX_PROCESSORS) {
+        device->ArrivalCount[current]++;
+    }
+
+    // Local and nothing ahead of us: run now, still at DISPATCH_LEVEL so
+    // the device's DPC cannot interleave on this processor
+    if (current == device->TargetProcessor && device->Head == device->Tail) {
+        device->LocalCompletions++;
+        KeReleaseSpinLockFromDpcLevel(&device->Lock);
+        Routine(Affinity->Owner, Slot, Context);
+        KeLowerIrql(oldIrql);
+        return;
+    }
+
+    if (current == device->TargetProcessor) {
+        device->LocalCompletions++;
+    } else {
+        device->CrossCpuCompletions++;
+    }
+
+    if (device->Tail - device->Head >= AFFINITY_RING_SIZE) {
+        // Ring full: complete inline rather than stall the caller
+        device->RingOverflows++;
+        KeReleaseSpinLock(&device->Lock, oldIrql);
+        Routine(Affinity->Owner, Slot, Context);
+        return;
+    }
+
+    item = &device->Ring[device->Tail & (AFFINITY_RING_SIZE - 1)];
+    item->Routine = Routine;
+    item->Context = Context;
+    device->Tail++;
+
+    if (!device->DpcQueued) {
+        device->DpcQueued = TRUE;
+        KeInsertQueueDpc(&device->Dpc, (PVOID)(ULONG_PTR)Slot, NULL);
+    }
+
+    KeReleaseSpinLock(&device->Lock, oldIrql);
+}
+
+/*++
+Routine Description:
+    Device DPC: drains the device's work ring on its target processor and
+    applies a pending retarget once the ring is empty
+--*/
+static VOID
+AffinityDpcRoutine(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+)
+{
+    PAFFINITY_CONTEXT affinity = (PAFFINITY_CONTEXT)DeferredContext;
+    ULONG slot = (ULONG)(ULONG_PTR)SystemArgument1;
+    PAFFINITY_DEVICE device = &affinity->Devices[slot];
+    AFFINITY_WORK_ITEM item;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    for (;;) {
+        KeAcquireSpinLockAtDpcLevel(&device->Lock);
+
+        if (device->Head == device->Tail) {
+            device->DpcQueued = FALSE;
+            if (device->PendingProcessor != AFFINITY_UNASSIGNED) {
+                AffinitySetDpcTarget(device, device->PendingProcessor);
+            }
+            KeReleaseSpinLockFromDpcLevel(&device->Lock);
+            break;
+        }
+
+        item = device->Ring[device->Head & (AFFINITY_RING_SIZE - 1)];
+        device->Head++;
+
+        KeReleaseSpinLockFromDpcLevel(&device->Lock);
+
+        item.Routine(affinity->Owner, slot, item.Context);
+    }
+}
+
+/*++
+Routine Description:
+    Moves a device to another processor. Caller holds Affinity->Lock.
+--*/
+static VOID
+AffinityMoveDevice(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _Inout_ PAFFINITY_DEVICE Device,
+    _In_ ULONG From,
+    _In_ ULONG To
+)
+{
+    KeAcquireSpinLockAtDpcLevel(&Device->Lock);
+    if (Device->DpcQueued) {
+        Device->PendingProcessor = To;
+    } else {
+        AffinitySetDpcTarget(Device, To);
+    }
+    KeReleaseSpinLockFromDpcLevel(&Device->Lock);
+
+    Affinity->CpuDeviceCount[From]--;
+    Affinity->CpuDeviceCount[To]++;
+    Affinity->CpuLoad[From] -= Device->CompletionRate;
+    Affinity->CpuLoad[To] += Device->CompletionRate;
+    Affinity->Migrations++;
+}
+
+/*++
+Routine Description:
+    Periodic rebalance. Closes the load window, follows each device's
+    dominant arrival processor when that CPU has headroom, then moves at
+    most one device off a processor whose load has skewed.
+
+Arguments:
+    Affinity - Affinity context
+
+Return Value:
+    None
+--*/
+VOID
+AffinityRebalance(
+    _Inout_ PAFFINITY_CONTEXT Affinity
+)
+{
+    ULONG totalLoad = 0;
+    ULONG averageLoad;
+    ULONG hottest = 0;
+    ULONG coolest = 0;
+    ULONG candidate = MAXULONG;
+    ULONG i;
+    ULONG cpu;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Affinity->Lock, &oldIrql);
+
+    RtlZeroMemory(Affinity->CpuLoad, sizeof(Affinity->CpuLoad));
+
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        PAFFINITY_DEVICE device = &Affinity->Devices[i];
+
+        if (!device->Assigned) {
+            continue;
+        }
+
+        device->CompletionRate = (ULONG)InterlockedExchange(&device->WindowCompletions, 0);
+        Affinity->CpuLoad[device->PendingProcessor != AFFINITY_UNASSIGNED ?
+            device->PendingProcessor : device->TargetProcessor] += device->CompletionRate;
+        totalLoad += device->CompletionRate;
+    }
+
+    if (Affinity->ProcessorCount == 0 || totalLoad == 0) {
+        goto Exit;
+    }
+
+    averageLoad = totalLoad / Affinity->ProcessorCount;
+
+    // Locality: follow the processor most of a device's work arrives on
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        PAFFINITY_DEVICE device = &Affinity->Devices[i];
+        ULONG current;
+        ULONG preferred = 0;
+
+        if (!device->Assigned || device->CompletionRate == 0) {
+            continue;
+        }
+
+        KeAcquireSpinLockAtDpcLevel(&device->Lock);
+        for (cpu = 0; cpu < Affinity->ProcessorCount; cpu++) {
+            if (device->ArrivalCount[cpu] > device->ArrivalCount[preferred]) {
+                preferred = cpu;
+            }
+        }
+        // Decay so the preference tracks recent traffic
+        for (cpu = 0; cpu < Affinity->ProcessorCount; cpu++) {
+            device->ArrivalCount[cpu] /= 2;
+        }
+        current = device->PendingProcessor != AFFINITY_UNASSIGNED ?
+            device->PendingProcessor : device->TargetProcessor;
+        KeReleaseSpinLockFromDpcLevel(&device->Lock);
+
+        if (preferred != current &&
+            (Affinity->CpuLoad[preferred] + device->CompletionRate) * 100 <=
+                (averageLoad + device->CompletionRate) * AFFINITY_LOCALITY_HEADROOM_PCT) {
+            AffinityMoveDevice(Affinity, device, current, preferred);
+        }
+    }
+
+    // Skew: relieve the hottest processor if it carries more than one device
+    for (cpu = 1; cpu < Affinity->ProcessorCount; cpu++) {
+        if (Affinity->CpuLoad[cpu] > Affinity->CpuLoad[hottest]) {
+            hottest = cpu;
+        }
+        if (Affinity->CpuLoad[cpu] < Affinity->CpuLoad[coolest]) {
+            coolest = cpu;
+        }
+    }
+
+    if (Affinity->CpuLoad[hottest] < AFFINITY_SKEW_MIN_LOAD ||
+        Affinity->CpuLoad[hottest] <= AFFINITY_SKEW_RATIO * Affinity->CpuLoad[coolest] ||
+        Affinity->CpuDeviceCount[hottest] < 2) {
+        goto Exit;
+    }
+
+    // Move the lightest device so the swap cannot simply invert the skew
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        PAFFINITY_DEVICE device = &Affinity->Devices[i];
+        ULONG current = device->PendingProcessor != AFFINITY_UNASSIGNED ?
+            device->PendingProcessor : device->TargetProcessor;
+
+        if (device->Assigned && current == hottest &&
+            (candidate == MAXULONG ||
+             device->CompletionRate < Affinity->Devices[candidate].CompletionRate)) {
+            candidate = i;
+        }
+    }
+
+    if (candidate != MAXULONG) {
+        AffinityMoveDevice(Affinity, &Affinity->Devices[candidate], hottest, coolest);
+    }
+
+Exit:
+    KeReleaseSpinLock(&Affinity->Lock, oldIrql);
+}
+
+/*++
+Routine Description:
+    Cancels queued device DPCs and waits for running ones
+
+Arguments:
+    Affinity - Affinity context
+
+Return Value:
+    None
+--*/
+VOID
+AffinityShutdown(
+    _Inout_ PAFFINITY_CONTEXT Affinity
+)
+{
+    ULONG i;
+
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        KeRemoveQueueDpc(&Affinity->Devices[i].Dpc);
+    }
+
+    KeFlushQueuedDpcs();
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_CPU_AFFINITY: per-CPU device load and
+    per-device local/cross-CPU completion counts
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    OutputBufferLength - Output buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleGetCpuAffinity(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PAFFINITY_REPORT report;
+    PAFFINITY_CONTEXT affinity = &DeviceContext->Affinity;
+    KIRQL oldIrql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(AFFINITY_REPORT), (PVOID*)&report, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlZeroMemory(report, sizeof(*report));
+
+    KeAcquireSpinLock(&affinity->Lock, &oldIrql);
+
+    report->ProcessorCount = affinity->ProcessorCount;
+    report->Migrations = affinity->Migrations;
+
+    for (i = 0; i < affinity->ProcessorCount; i++) {
+        report->Cpus[i].DeviceCount = affinity->CpuDeviceCount[i];
+        report->Cpus[i].CompletionsPerPeriod = affinity->CpuLoad[i];
+    }
+
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        PAFFINITY_DEVICE device = &affinity->Devices[i];
+        PAFFINITY_DEVICE_INFO info = &report->Devices[i];
+
+        info->TargetProcessor = device->Assigned ?
+            device->TargetProcessor : AFFINITY_UNASSIGNED;
+        info->CompletionsPerPeriod = device->CompletionRate;
+        info->LocalCompletions = device->LocalCompletions;
+        info->CrossCpuCompletions = device->CrossCpuCompletions;
+        info->DeviceAddress = device->Assigned ? device->DeviceAddress : BTH_ADDR_NULL;
+    }
+
+    KeReleaseSpinLock(&affinity->Lock, oldIrql);
+
+    *BytesReturned = sizeof(AFFINITY_REPORT);
+    return STATUS_SUCCESS;
+}
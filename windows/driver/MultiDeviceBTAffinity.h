@@ -0,0 +1,122 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAffinity.h
+
+Abstract:
+    Per-device CPU affinity for deferred processing and completions
+
+--*/
+
+#ifndef _MULTIDEVICEBTAFFINITY_H_
+#define _MULTIDEVICEBTAFFINITY_H_
+
+#define AFFINITY_MAX_PROCESSORS     64
+#define AFFINITY_RING_SIZE          64      // Power of two
+#define AFFINITY_UNASSIGNED         MAXULONG
+
+struct _DEVICE_CONTEXT;
+
+// Deferred work for one device, run on that device's processor
+typedef VOID
+AFFINITY_WORK_ROUTINE(
+    _In_ struct _DEVICE_CONTEXT* DeviceContext,
+    _In_ ULONG Slot,
+    _In_opt_ PVOID Context
+);
+typedef AFFINITY_WORK_ROUTINE *PAFFINITY_WORK_ROUTINE;
+
+typedef struct _AFFINITY_WORK_ITEM {
+    PAFFINITY_WORK_ROUTINE Routine;
+    PVOID Context;
+} AFFINITY_WORK_ITEM, *PAFFINITY_WORK_ITEM;
+
+// Per-connection steering state; cache aligned so two devices never share a line
+typedef struct DECLSPEC_CACHEALIGN _AFFINITY_DEVICE {
+    KSPIN_LOCK Lock;
+    KDPC Dpc;
+    BOOLEAN Assigned;
+    BOOLEAN DpcQueued;
+    USHORT Handle;                  // ACL connection handle
+    BTH_ADDR DeviceAddress;
+    ULONG TargetProcessor;
+    ULONG PendingProcessor;         // Applied once the DPC is idle
+    ULONG Head;
+    ULONG Tail;
+    AFFINITY_WORK_ITEM Ring[AFFINITY_RING_SIZE];
+    volatile LONG WindowCompletions;
+    ULONG CompletionRate;           // Completions in the last period
+    ULONG64 LocalCompletions;
+    ULONG64 CrossCpuCompletions;
+    ULONG RingOverflows;
+    ULONG ArrivalCount[AFFINITY_MAX_PROCESSORS];
+} AFFINITY_DEVICE, *PAFFINITY_DEVICE;
+
+typedef struct _AFFINITY_CONTEXT {
+    KSPIN_LOCK Lock;                // Guards assignment and per-CPU tables
+    struct _DEVICE_CONTEXT* Owner;
+    ULONG ProcessorCount;
+    ULONG Migrations;
+    ULONG CpuDeviceCount[AFFINITY_MAX_PROCESSORS];
+    ULONG CpuLoad[AFFINITY_MAX_PROCESSORS];
+    AFFINITY_DEVICE Devices[MAX_BLUETOOTH_CONNECTIONS];
+} AFFINITY_CONTEXT, *PAFFINITY_CONTEXT;
+
+// IOCTL_MULTI_BT_GET_CPU_AFFINITY report
+typedef struct _AFFINITY_CPU_INFO {
+    ULONG DeviceCount;
+    ULONG CompletionsPerPeriod;
+} AFFINITY_CPU_INFO, *PAFFINITY_CPU_INFO;
+
+typedef struct _AFFINITY_DEVICE_INFO {
+    BTH_ADDR DeviceAddress;
+    ULONG TargetProcessor;
+    ULONG CompletionsPerPeriod;
+    ULONG64 LocalCompletions;
+    ULONG64 CrossCpuCompletions;
+} AFFINITY_DEVICE_INFO, *PAFFINITY_DEVICE_INFO;
+
+typedef struct _AFFINITY_REPORT {
+    ULONG ProcessorCount;
+    ULONG Migrations;
+    AFFINITY_CPU_INFO Cpus[AFFINITY_MAX_PROCESSORS];
+    AFFINITY_DEVICE_INFO Devices[MAX_BLUETOOTH_CONNECTIONS];
+} AFFINITY_REPORT, *PAFFINITY_REPORT;
+
+VOID AffinityInitialize(
+    _Out_ PAFFINITY_CONTEXT Affinity,
+    _In_ struct _DEVICE_CONTEXT* Owner
+);
+
+ULONG AffinityAssignDevice(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _In_ USHORT Handle,
+    _In_ BTH_ADDR DeviceAddress
+);
+
+VOID AffinityReleaseDevice(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _In_ USHORT Handle
+);
+
+ULONG AffinityFindDevice(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _In_ USHORT Handle
+);
+
+VOID AffinityQueueWork(
+    _Inout_ PAFFINITY_CONTEXT Affinity,
+    _In_ ULONG Slot,
+    _In_ PAFFINITY_WORK_ROUTINE Routine,
+    _In_opt_ PVOID Context
+);
+
+VOID AffinityRebalance(
+    _Inout_ PAFFINITY_CONTEXT Affinity
+);
+
+VOID AffinityShutdown(
+    _Inout_ PAFFINITY_CONTEXT Affinity
+);
+
+#endif // _MULTIDEVICEBTAFFINITY_H_
@@ -0,0 +1,215 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAfh.c
+
+Abstract:
+    Host channel classification.
+
+    The driver left channel selection to the controller's defaults, and
+    the sites' Wi-Fi networks sit on the same channels all day. Most
+    controllers exclude nothing on LE links unless the host says so.
+
+    The HCI transport agent now reads each link's per-channel packet
+    and error counts (from the controller's vendor statistics, or from
+    its own tracking of the channel selection algorithm) and submits
+    them with IOCTL_MULTI_BT_AFH_SUBMIT_SAMPLES. The estimator
+    (MultiDeviceBTAfhEstimator.c) pools them and re-evaluates at most
+    every AFH_PERIOD_US, as submissions arrive. When a map changes, LE
+    Set Host Channel Classification and, if BR/EDR links reported too,
+    Set AFH Host Channel Classification are queued at HIGH priority. A
+    map still queued is overwritten by the next one, not sent twice.
+    IOCTL_MULTI_BT_GET_AFH_STATE reports each 1 MHz bin's error rate,
+    RSSI and state, and the maps.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+static __forceinline ULONG64
+AfhNowUs(VOID)
+{
+    return KeQueryInterruptTime() / 10;
+}
+
+/*++
+Routine Description:
+    Initializes the estimator with every channel usable
+--*/
+VOID
+AfhInitialize(
+    _Out_ PAFH_CONTEXT Afh
+)
+{
+    RtlZeroMemory(Afh, sizeof(*Afh));
+    KeInitializeSpinLock(&Afh->Lock);
+    AfhEstimatorInitialize(&Afh->Estimator, AfhNowUs());
+}
+
+/*++
+Routine Description:
+    Queues one classification command
+
+Arguments:
+    DeviceContext - Device context
+    Opcode - HCI_OP_LE_SET_HOST_CLASSIFICATION or HCI_OP_SET_AFH_CLASSIFICATION
+    Map - Channel map
+    Length - Map bytes
+    Used - Channels the map leaves in use, for the log
+--*/
+static VOID
+AfhQueueMap(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ USHORT Opcode,
+    _In_reads_bytes_(Length) const UCHAR* Map,
+    _In_ ULONG Length,
+    _In_ ULONG Used
+)
+{
+    PAFH_CONTEXT afh = &DeviceContext->Afh;
+    NTSTATUS status;
+    ULONG id;
+    KIRQL irql;
+
+    status = HciCommandSubmit(&DeviceContext->HciCommands, Opcode, PRIORITY_HIGH, Map, Length, &id, NULL);
+
+    KeAcquireSpinLock(&afh->Lock, &irql);
+    if (NT_SUCCESS(status)) {
+        afh->MapsQueued++;
+    } else {
+        afh->QueueFailures++;
+    }
+    KeReleaseSpinLock(&afh->Lock, irql);
+
+    if (NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: Channel classification 0x%04x queued, %u channels in use\n",
+            Opcode, Used));
+    } else {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+            "MultiDeviceBT: Channel classification 0x%04x not queued - 0x%x\n",
+            Opcode, status));
+    }
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_AFH_SUBMIT_SAMPLES. Samples for channels out
+    of range are counted and skipped.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Request with an AFH_SAMPLE_BATCH
+    InputBufferLength - Input size
+    BytesReturned - Receives 0
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleAfhSubmitSamples(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PAFH_CONTEXT afh = &DeviceContext->Afh;
+    PAFH_SAMPLE_BATCH batch;
+    AFH_MAPS maps;
+    BOOLEAN changed, seenLe, seenBrEdr;
+    NTSTATUS status;
+    KIRQL irql;
+    ULONG i;
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        FIELD_OFFSET(AFH_SAMPLE_BATCH, Samples), (PVOID*)&batch, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (batch->Count > AFH_MAX_SUBMIT ||
+        InputBufferLength < FIELD_OFFSET(AFH_SAMPLE_BATCH, Samples) + batch->Count * sizeof(AFH_SAMPLE)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeAcquireSpinLock(&afh->Lock, &irql);
+    for (i = 0; i < batch->Count; i++) {
+        AfhEstimatorRecord(&afh->Estimator, &batch->Samples[i]);
+    }
+    changed = AfhEstimatorEvaluate(&afh->Estimator, AfhNowUs());
+    maps = afh->Estimator.Maps;
+    seenLe = afh->Estimator.SeenLe;
+    seenBrEdr = afh->Estimator.SeenBrEdr;
+    KeReleaseSpinLock(&afh->Lock, irql);
+
+    if (changed) {
+        if (seenLe) {
+            AfhQueueMap(DeviceContext, HCI_OP_LE_SET_HOST_CLASSIFICATION,
+                maps.Le, sizeof(maps.Le), maps.LeUsed);
+        }
+        if (seenBrEdr) {
+            AfhQueueMap(DeviceContext, HCI_OP_SET_AFH_CLASSIFICATION,
+                maps.BrEdr, sizeof(maps.BrEdr), maps.BrEdrUsed);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_AFH_STATE
+--*/
+NTSTATUS
+HandleGetAfhState(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PAFH_CONTEXT afh = &DeviceContext->Afh;
+    const AFH_BIN* bin;
+    PAFH_REPORT report;
+    NTSTATUS status;
+    KIRQL irql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(AFH_REPORT), (PVOID*)&report, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&afh->Lock, &irql);
+    report->Stats = afh->Estimator.Stats;
+    report->Maps = afh->Estimator.Maps;
+    report->MapsQueued = afh->MapsQueued;
+    report->QueueFailures = afh->QueueFailures;
+    for (i = 0; i < AFH_BINS; i++) {
+        bin = &afh->Estimator.Bins[i];
+        report->Bins[i].Permille = bin->Permille;
+        report->Bins[i].Rssi = (bin->RssiCount != 0) ?
+            (CHAR)(bin->RssiSum / (LONG)bin->RssiCount) : AFH_RSSI_UNAVAILABLE;
+        report->Bins[i].State = bin->State;
+    }
+    KeReleaseSpinLock(&afh->Lock, irql);
+
+    *BytesReturned = sizeof(AFH_REPORT);
+    return STATUS_SUCCESS;
+}
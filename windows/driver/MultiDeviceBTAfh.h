@@ -0,0 +1,55 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAfh.h
+
+Abstract:
+    Host channel classification. The HCI transport agent submits per
+    channel packet statistics for every link. The estimator
+    (MultiDeviceBTAfhEstimator.h) pools them, and when its channel
+    maps change they are queued to the controller through the command
+    pipeline (MultiDeviceBTHciCommand.h).
+
+--*/
+
+#ifndef _MULTIDEVICEBTAFH_H_
+#define _MULTIDEVICEBTAFH_H_
+
+#include "MultiDeviceBTAfhEstimator.h"
+
+#define AFH_MAX_SUBMIT              1024    // Samples per IOCTL_MULTI_BT_AFH_SUBMIT_SAMPLES
+
+// IOCTL_MULTI_BT_AFH_SUBMIT_SAMPLES input
+typedef struct _AFH_SAMPLE_BATCH {
+    ULONG Count;
+    ULONG Reserved;
+    AFH_SAMPLE Samples[1];
+} AFH_SAMPLE_BATCH, *PAFH_SAMPLE_BATCH;
+
+typedef struct _AFH_BIN_REPORT {
+    USHORT Permille;            // 0xFFFF if too few packets
+    CHAR Rssi;                  // Mean; AFH_RSSI_UNAVAILABLE if none
+    UCHAR State;                // AFH_BIN_*
+} AFH_BIN_REPORT, *PAFH_BIN_REPORT;
+
+// IOCTL_MULTI_BT_GET_AFH_STATE output
+typedef struct _AFH_REPORT {
+    AFH_STATS Stats;
+    AFH_MAPS Maps;
+    ULONG64 MapsQueued;         // Classification commands queued
+    ULONG64 QueueFailures;
+    AFH_BIN_REPORT Bins[AFH_BINS];  // 2402 MHz first
+} AFH_REPORT, *PAFH_REPORT;
+
+typedef struct _AFH_CONTEXT {
+    KSPIN_LOCK Lock;
+    AFH_ESTIMATOR Estimator;
+    ULONG64 MapsQueued;
+    ULONG64 QueueFailures;
+} AFH_CONTEXT, *PAFH_CONTEXT;
+
+VOID AfhInitialize(
+    _Out_ PAFH_CONTEXT Afh
+);
+
+#endif // _MULTIDEVICEBTAFH_H_
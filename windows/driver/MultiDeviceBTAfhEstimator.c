@@ -0,0 +1,337 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAfhEstimator.c
+
+Abstract:
+    Channel quality estimator for adaptive frequency hopping.
+
+    A Wi-Fi network occupies about 20 MHz of the band, a quarter of the
+    LE data channels. Hopping onto it costs a retransmission whenever
+    the network is busy. The controller's defaults leave every channel
+    in use, and one link on its own sees too few packets per channel to
+    tell a busy channel from bad luck.
+
+    Samples from all links are pooled per 1 MHz bin: an LE data channel
+    lands on the bin of its centre frequency, a BR/EDR channel on its
+    own. Samples from links weaker than AFH_RSSI_WEAK add their RSSI
+    but not their errors, since a link near the edge of its range fails
+    on every channel alike. Each evaluation, every AFH_PERIOD_US:
+    - Halves each bin's window after reading it, so older evidence
+      fades with a half-life of one period.
+    - Takes the median error rate over bins with AFH_MIN_PACKETS as the
+      baseline. A bin fails the evaluation at max(AFH_BAD_PERMILLE, 2 x
+      baseline), and AFH_BAD_STRIKES consecutive failures exclude it.
+      Between that and max(AFH_GOOD_PERMILLE, 1.5 x baseline) its
+      strikes stay as they are.
+    - Gives an excluded bin another chance after AFH_RETRY_US, doubling
+      up to AFH_RETRY_MAX_US each time it is excluded again soon after.
+      An unused channel yields no samples, so this is the only way back.
+      Retries are rounded up to AFH_RETRY_ALIGN_US, so the bins one
+      network took out come back in one map change, not one each.
+    The LE map marks a data channel usable if its bin is good. The
+    BR/EDR map does the same, and a bin that never saw a packet follows
+    its neighbours, because LE samples only cover every other bin. When
+    a map would drop below its minimum, the least bad excluded channels
+    are used anyway.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTAfhEstimator.h"
+
+#define AFH_UNKNOWN                 0xFFFF
+
+// Bin of an LE data channel's centre frequency: 2404-2424 and 2428-2478 MHz
+static __forceinline ULONG
+AfhLeBin(
+    _In_ ULONG Channel
+)
+{
+    return (Channel <= 10) ? 2 + 2 * Channel : 26 + 2 * (Channel - 11);
+}
+
+static __forceinline VOID
+AfhMapSet(
+    _Inout_ PUCHAR Map,
+    _In_ ULONG Channel
+)
+{
+    Map[Channel / 8] |= (UCHAR)(1 << (Channel % 8));
+}
+
+/*++
+Routine Description:
+    Initializes the estimator with every channel usable
+--*/
+VOID
+AfhEstimatorInitialize(
+    _Out_ PAFH_ESTIMATOR Estimator,
+    _In_ ULONG64 NowUs
+)
+{
+    ULONG i;
+
+    RtlZeroMemory(Estimator, sizeof(*Estimator));
+
+    for (i = 0; i < AFH_BINS; i++) {
+        Estimator->Bins[i].Permille = AFH_UNKNOWN;
+        Estimator->Bins[i].BackoffUs = AFH_RETRY_US;
+    }
+    for (i = 0; i < AFH_LE_CHANNELS; i++) {
+        AfhMapSet(Estimator->Maps.Le, i);
+    }
+    for (i = 0; i < AFH_BREDR_CHANNELS; i++) {
+        AfhMapSet(Estimator->Maps.BrEdr, i);
+    }
+    Estimator->Maps.LeUsed = AFH_LE_CHANNELS;
+    Estimator->Maps.BrEdrUsed = AFH_BREDR_CHANNELS;
+    Estimator->NextEvaluationUs = NowUs + AFH_PERIOD_US;
+}
+
+/*++
+Routine Description:
+    Adds one link's counts for one channel
+
+Arguments:
+    Estimator - Estimator
+    Sample - Counts since the link's previous sample for the channel
+
+Return Value:
+    FALSE if the channel is out of range
+--*/
+BOOLEAN
+AfhEstimatorRecord(
+    _Inout_ PAFH_ESTIMATOR Estimator,
+    _In_ const AFH_SAMPLE* Sample
+)
+{
+    PAFH_BIN bin;
+
+    if (Sample->Kind == AFH_KIND_LE && Sample->Channel < AFH_LE_CHANNELS) {
+        bin = &Estimator->Bins[AfhLeBin(Sample->Channel)];
+        Estimator->SeenLe = TRUE;
+    } else if (Sample->Kind == AFH_KIND_BREDR && Sample->Channel < AFH_BREDR_CHANNELS) {
+        bin = &Estimator->Bins[Sample->Channel];
+        Estimator->SeenBrEdr = TRUE;
+    } else {
+        Estimator->Stats.Rejected++;
+        return FALSE;
+    }
+
+    Estimator->Stats.Samples++;
+
+    if (Sample->Rssi != AFH_RSSI_UNAVAILABLE) {
+        bin->RssiSum += Sample->Rssi;
+        bin->RssiCount++;
+        if (Sample->Rssi < AFH_RSSI_WEAK) {
+            Estimator->Stats.WeakSamples++;
+            return TRUE;
+        }
+    }
+
+    bin->Packets += Sample->Packets;
+    bin->Errors += min(Sample->Errors, Sample->Packets);
+    return TRUE;
+}
+
+/*++
+Routine Description:
+    Adds the excluded channels with the lowest error rates to a map
+    until it reaches its minimum
+--*/
+static VOID
+AfhReadmit(
+    _Inout_ PAFH_ESTIMATOR Estimator,
+    _Inout_ PUCHAR Map,
+    _Inout_ PUCHAR Used,
+    _In_ ULONG Channels,
+    _In_ ULONG Minimum,
+    _In_ BOOLEAN Le
+)
+{
+    ULONG best, bestPermille, permille;
+    ULONG n;
+
+    while (*Used < Minimum) {
+        best = Channels;
+        bestPermille = MAXULONG;
+
+        for (n = 0; n < Channels; n++) {
+            if (Map[n / 8] & (1 << (n % 8))) {
+                continue;
+            }
+            permille = Estimator->Bins[Le ? AfhLeBin(n) : n].Permille;
+            if (best == Channels || permille < bestPermille) {
+                best = n;
+                bestPermille = permille;
+            }
+        }
+
+        AfhMapSet(Map, best);
+        (*Used)++;
+        Estimator->Stats.Readmitted++;
+    }
+}
+
+/*++
+Routine Description:
+    Builds both maps from the bins' states
+--*/
+static VOID
+AfhBuildMaps(
+    _Inout_ PAFH_ESTIMATOR Estimator,
+    _Out_ PAFH_MAPS Maps
+)
+{
+    const AFH_BIN* bins = Estimator->Bins;
+    BOOLEAN usable;
+    ULONG n;
+
+    RtlZeroMemory(Maps, sizeof(*Maps));
+
+    for (n = 0; n < AFH_LE_CHANNELS; n++) {
+        if (bins[AfhLeBin(n)].State == AFH_BIN_GOOD) {
+            AfhMapSet(Maps->Le, n);
+            Maps->LeUsed++;
+        }
+    }
+    AfhReadmit(Estimator, Maps->Le, &Maps->LeUsed, AFH_LE_CHANNELS, AFH_LE_MIN_CHANNELS, TRUE);
+
+    for (n = 0; n < AFH_BREDR_CHANNELS; n++) {
+        usable = (bins[n].State == AFH_BIN_GOOD);
+
+        // Never measured: as bad as a neighbour. A bin on retry is not.
+        if (usable && bins[n].Permille == AFH_UNKNOWN && bins[n].RetryUs == 0) {
+            usable = !((n > 0 && bins[n - 1].State == AFH_BIN_BAD) ||
+                (n + 1 < AFH_BINS && bins[n + 1].State == AFH_BIN_BAD));
+        }
+
+        if (usable) {
+            AfhMapSet(Maps->BrEdr, n);
+            Maps->BrEdrUsed++;
+        }
+    }
+    AfhReadmit(Estimator, Maps->BrEdr, &Maps->BrEdrUsed, AFH_BREDR_CHANNELS, AFH_BREDR_MIN_CHANNELS, FALSE);
+}
+
+/*++
+Routine Description:
+    Re-evaluates the channels if AFH_PERIOD_US has passed since the
+    last evaluation
+
+Arguments:
+    Estimator - Estimator
+    NowUs - Current time
+
+Return Value:
+    TRUE if either map changed; the new maps are in Estimator->Maps
+--*/
+BOOLEAN
+AfhEstimatorEvaluate(
+    _Inout_ PAFH_ESTIMATOR Estimator,
+    _In_ ULONG64 NowUs
+)
+{
+    USHORT known[AFH_BINS];
+    ULONG count = 0;
+    ULONG baseline, failAt, clearAt;
+    PAFH_BIN bin;
+    AFH_MAPS maps;
+    USHORT value;
+    ULONG i, j;
+
+    if (NowUs < Estimator->NextEvaluationUs) {
+        return FALSE;
+    }
+    Estimator->NextEvaluationUs = NowUs + AFH_PERIOD_US;
+    Estimator->Stats.Evaluations++;
+
+    // Error rates, and their median by insertion sort
+    for (i = 0; i < AFH_BINS; i++) {
+        bin = &Estimator->Bins[i];
+        if (bin->Packets >= AFH_MIN_PACKETS) {
+            bin->Permille = (USHORT)((ULONG64)bin->Errors * 1000 / bin->Packets);
+        } else if (bin->State == AFH_BIN_GOOD) {
+            bin->Permille = AFH_UNKNOWN;
+        }
+
+        if (bin->Permille == AFH_UNKNOWN || bin->State == AFH_BIN_BAD) {
+            continue;
+        }
+        value = bin->Permille;
+        for (j = count; j > 0 && known[j - 1] > value; j--) {
+            known[j] = known[j - 1];
+        }
+        known[j] = value;
+        count++;
+    }
+
+    baseline = (count != 0) ? known[count / 2] : 0;
+    failAt = max(AFH_BAD_PERMILLE, 2 * baseline);
+    clearAt = max(AFH_GOOD_PERMILLE, baseline + baseline / 2);
+    Estimator->Stats.BaselinePermille = baseline;
+
+    for (i = 0; i < AFH_BINS; i++) {
+        bin = &Estimator->Bins[i];
+
+        if (bin->State == AFH_BIN_BAD) {
+            if (NowUs >= bin->RetryUs) {
+                // Judged afresh once back in use
+                bin->State = AFH_BIN_GOOD;
+                bin->Strikes = 0;
+                bin->Packets = 0;
+                bin->Errors = 0;
+                bin->Permille = AFH_UNKNOWN;
+                bin->RetryUs = NowUs;
+                Estimator->Stats.BadBins--;
+                Estimator->Stats.Retries++;
+            }
+        } else if (bin->Permille != AFH_UNKNOWN) {
+            if (bin->Permille >= failAt) {
+                if (++bin->Strikes >= AFH_BAD_STRIKES) {
+                    // Excluded again soon after its last retry: wait longer
+                    if (bin->RetryUs != 0 && NowUs - bin->RetryUs < bin->BackoffUs) {
+                        bin->BackoffUs = min(bin->BackoffUs * 2, AFH_RETRY_MAX_US);
+                    } else {
+                        bin->BackoffUs = AFH_RETRY_US;
+                    }
+                    bin->State = AFH_BIN_BAD;
+                    bin->RetryUs = (NowUs + bin->BackoffUs) / AFH_RETRY_ALIGN_US * AFH_RETRY_ALIGN_US + AFH_RETRY_ALIGN_US;
+                    Estimator->Stats.BadBins++;
+                    Estimator->Stats.Exclusions++;
+                }
+            } else if (bin->Permille < clearAt) {
+                bin->Strikes = 0;
+            }
+        }
+
+        bin->Packets /= 2;
+        bin->Errors /= 2;
+        bin->RssiSum /= 2;
+        bin->RssiCount /= 2;
+        if (bin->RssiCount == 0) {
+            bin->RssiSum = 0;
+        }
+    }
+
+    AfhBuildMaps(Estimator, &maps);
+
+    if (RtlEqualMemory(&maps, &Estimator->Maps, sizeof(maps))) {
+        return FALSE;
+    }
+
+    Estimator->Maps = maps;
+    Estimator->Stats.MapChanges++;
+    return TRUE;
+}
@@ -0,0 +1,114 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAfhEstimator.h
+
+Abstract:
+    Channel quality estimator for adaptive frequency hopping. Packet
+    and error counts with RSSI, per channel and per link, are pooled
+    across every link into 1 MHz bins of the 2.4 GHz band. BR/EDR and
+    LE samples share the bins. A periodic evaluation marks bins whose
+    error rate stands out as bad, with hysteresis, and derives the LE
+    and BR/EDR host channel classification maps.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the time, the storage and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTAFHESTIMATOR_H_
+#define _MULTIDEVICEBTAFHESTIMATOR_H_
+
+#define AFH_BINS                    79      // 2402 to 2480 MHz
+#define AFH_LE_CHANNELS             37      // LE data channels
+#define AFH_BREDR_CHANNELS          79
+#define AFH_LE_MAP_BYTES            5
+#define AFH_BREDR_MAP_BYTES         10
+#define AFH_LE_MIN_CHANNELS         8       // Fewer would crowd the links onto what is left
+#define AFH_BREDR_MIN_CHANNELS      20      // N_min
+#define AFH_PERIOD_US               2000000 // Between evaluations; the controller wants 1 s at least
+#define AFH_MIN_PACKETS             24      // In a bin's window before its error rate counts
+#define AFH_BAD_PERMILLE            150     // Error rate that can mark a bin bad ...
+#define AFH_GOOD_PERMILLE           60      // ... and that clears its strikes
+#define AFH_BAD_STRIKES             2       // Consecutive bad evaluations to exclude a bin
+#define AFH_RETRY_US                20000000    // First exclusion; doubles on relapse
+#define AFH_RETRY_MAX_US            320000000
+#define AFH_RETRY_ALIGN_US          10000000    // Retries fall on multiples of this, so neighbours come back together
+#define AFH_RSSI_WEAK               (-85)   // Errors on links this weak are about range, not the channel
+#define AFH_RSSI_UNAVAILABLE        127
+
+// AFH_SAMPLE.Kind
+#define AFH_KIND_BREDR              0       // Channel 0-78
+#define AFH_KIND_LE                 1       // Data channel 0-36
+
+// AFH_BIN.State
+#define AFH_BIN_GOOD                0
+#define AFH_BIN_BAD                 1
+
+// Counts for one channel of one link since the previous sample
+typedef struct _AFH_SAMPLE {
+    UCHAR Kind;                 // AFH_KIND_*
+    UCHAR Channel;
+    CHAR Rssi;                  // Mean over the packets; AFH_RSSI_UNAVAILABLE if not measured
+    UCHAR Reserved;
+    USHORT Packets;             // Received or expected
+    USHORT Errors;              // CRC failures and missed packets
+} AFH_SAMPLE, *PAFH_SAMPLE;
+
+typedef struct _AFH_BIN {
+    ULONG Packets;              // Window: halved at each evaluation
+    ULONG Errors;
+    LONG RssiSum;               // Over RssiCount samples, halved with the window
+    ULONG RssiCount;
+    ULONG64 RetryUs;            // Bad: until this time. Good: when it was last retried
+    ULONG BackoffUs;            // Next exclusion's length
+    USHORT Permille;            // Error rate at the last evaluation; 0xFFFF if too few packets
+    UCHAR State;                // AFH_BIN_*
+    UCHAR Strikes;
+} AFH_BIN, *PAFH_BIN;
+
+typedef struct _AFH_MAPS {
+    UCHAR Le[AFH_LE_MAP_BYTES];         // Bit n set: data channel n usable
+    UCHAR BrEdr[AFH_BREDR_MAP_BYTES];   // Bit n set: channel n usable
+    UCHAR LeUsed;
+    UCHAR BrEdrUsed;
+} AFH_MAPS, *PAFH_MAPS;
+
+typedef struct _AFH_STATS {
+    ULONG64 Samples;
+    ULONG64 Rejected;           // Channel out of range
+    ULONG64 WeakSamples;        // Not counted against their channel
+    ULONG64 Evaluations;
+    ULONG64 MapChanges;
+    ULONG64 Exclusions;         // Bins marked bad
+    ULONG64 Retries;            // Bins given another chance
+    ULONG64 Readmitted;         // Bad bins used anyway to keep the minimum
+    ULONG BadBins;
+    ULONG BaselinePermille;     // Median error rate at the last evaluation
+} AFH_STATS, *PAFH_STATS;
+
+typedef struct _AFH_ESTIMATOR {
+    AFH_BIN Bins[AFH_BINS];
+    AFH_MAPS Maps;              // Last evaluation's
+    ULONG64 NextEvaluationUs;
+    BOOLEAN SeenLe;
+    BOOLEAN SeenBrEdr;
+    AFH_STATS Stats;
+} AFH_ESTIMATOR, *PAFH_ESTIMATOR;
+
+VOID AfhEstimatorInitialize(
+    _Out_ PAFH_ESTIMATOR Estimator,
+    _In_ ULONG64 NowUs
+);
+
+BOOLEAN AfhEstimatorRecord(
+    _Inout_ PAFH_ESTIMATOR Estimator,
+    _In_ const AFH_SAMPLE* Sample
+);
+
+BOOLEAN AfhEstimatorEvaluate(
+    _Inout_ PAFH_ESTIMATOR Estimator,
+    _In_ ULONG64 NowUs
+);
+
+#endif // _MULTIDEVICEBTAFHESTIMATOR_H_
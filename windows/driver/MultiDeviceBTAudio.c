@@ -0,0 +1,764 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAudio.c
+
+Abstract:
+    Real-time audio lane. Each stream gets a lock-free single-producer
+    single-consumer frame ring and a dedicated thread running at
+    real-time priority. A high resolution timer wakes that thread once
+    per frame interval. The submit path copies the frame into the ring
+    and returns; it takes no lock the lane thread also takes. Playout
+    therefore never waits behind the device list lock, a DPC, or a slow
+    control request. The lane thread measures its wake-up lateness
+    against the ideal deadline, and the stats IOCTL reports it as a
+    histogram.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+// Lane thread priority: well inside the real-time class, below the
+// system's own time-critical threads
+#define AUDIO_THREAD_PRIORITY       (LOW_REALTIME_PRIORITY + 8)
+
+// Wake-ups later than this many intervals resynchronize the deadline
+#define AUDIO_RESYNC_INTERVALS      4
+
+static const ULONG AudioJitterBucketUs[AUDIO_JITTER_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2000, 5000
+};
+
+static EXT_CALLBACK AudioLaneTimerCallback;
+static KSTART_ROUTINE AudioLaneThread;
+
+/*++
+Routine Description:
+    Producer side of the SPSC ring. Only one thread may call this at a
+    time; AudioLaneSubmit and IsoStreamSubmit enforce that.
+
+Return Value:
+    FALSE if the ring is full
+--*/
+BOOLEAN
+AudioRingPush(
+    _Inout_ PAUDIO_SPSC_RING Ring,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length,
+    _In_ ULONG Sequence,
+    _In_ LONGLONG Timestamp
+)
+{
+    ULONG tail = Ring->Tail;
+    ULONG head = ReadULongAcquire(&Ring->Head);
+    PAUDIO_FRAME frame;
+
+    if (tail - head > Ring->Mask) {
+        return FALSE;
+    }
+
+    frame = &Ring->Frames[tail & Ring->Mask];
+    frame->Length = Length;
+    frame->Sequence = Sequence;
+    frame->Timestamp = Timestamp;
+    RtlCopyMemory(frame->Data, Data, Length);
+
+    // Publish the frame contents before the new tail
+    WriteULongRelease(&Ring->Tail, tail + 1);
+    return TRUE;
+}
+
+/*++
+Routine Description:
+    Consumer side of the SPSC ring, called only on the ring's one
+    consumer thread
+
+Return Value:
+    Oldest frame, or NULL if the ring is empty. The slot stays valid
+    until AudioRingRelease.
+--*/
+PAUDIO_FRAME
+AudioRingPeek(
+    _In_ PAUDIO_SPSC_RING Ring
+)
+{
+    ULONG head = Ring->Head;
+
+    if (ReadULongAcquire(&Ring->Tail) == head) {
+        return NULL;
+    }
+
+    return &Ring->Frames[head & Ring->Mask];
+}
+
+VOID
+AudioRingRelease(
+    _Inout_ PAUDIO_SPSC_RING Ring
+)
+{
+    WriteULongRelease(&Ring->Head, Ring->Head + 1);
+}
+
+ULONG
+AudioRingDepth(
+    _In_ PAUDIO_SPSC_RING Ring
+)
+{
+    return ReadULongAcquire(&Ring->Tail) - Ring->Head;
+}
+
+/*++
+Routine Description:
+    High resolution timer expiry. Wakes the lane thread; all real work
+    happens there at its own priority rather than at DISPATCH_LEVEL.
+--*/
+static VOID
+AudioLaneTimerCallback(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context
+)
+{
+    PAUDIO_LANE lane = (PAUDIO_LANE)Context;
+
+    UNREFERENCED_PARAMETER(Timer);
+
+    if (lane != NULL) {
+        KeSetEvent(&lane->TickEvent, IO_SOUND_INCREMENT, FALSE);
+    }
+}
+
+/*++
+Routine Description:
+    Records how late this wake-up was against the ideal deadline
+--*/
+static VOID
+AudioLaneRecordJitter(
+    _Inout_ PAUDIO_LANE Lane
+)
+{
+    LARGE_INTEGER now = KeQueryPerformanceCounter(NULL);
+    LONGLONG intervalTicks = (Lane->FrequencyHz * Lane->Config.FrameIntervalUs) / 1000000;
+    LONGLONG lateTicks;
+    ULONG lateUs;
+    ULONG bucket;
+
+    Lane->Stats.Ticks++;
+
+    if (Lane->NextDeadline == 0) {
+        Lane->NextDeadline = now.QuadPart + intervalTicks;
+        return;
+    }
+
+    lateTicks = now.QuadPart - Lane->NextDeadline;
+    if (lateTicks < 0) {
+        lateTicks = -lateTicks;
+    }
+
+    lateUs = (ULONG)min((lateTicks * 1000000) / Lane->FrequencyHz, MAXULONG);
+
+    for (bucket = 0; bucket < AUDIO_JITTER_BUCKETS - 1; bucket++) {
+        if (lateUs < AudioJitterBucketUs[bucket]) {
+            break;
+        }
+    }
+
+    Lane->Stats.JitterHistogram[bucket]++;
+    Lane->Stats.JitterMaxUs = max(Lane->Stats.JitterMaxUs, lateUs);
+    Lane->JitterSumUs += lateUs;
+    Lane->Stats.JitterAvgUs = (ULONG)(Lane->JitterSumUs / Lane->Stats.Ticks);
+
+    // Advance the ideal schedule; after a long stall start a fresh one
+    // instead of reporting every later tick as late
+    if (now.QuadPart - Lane->NextDeadline > intervalTicks * AUDIO_RESYNC_INTERVALS) {
+        Lane->NextDeadline = now.QuadPart + intervalTicks;
+    } else {
+        Lane->NextDeadline += intervalTicks;
+    }
+}
+
+/*++
+Routine Description:
+    Lane thread. Runs at real-time priority and emits at most one frame
+    per timer tick once the prefill threshold has been reached.
+
+Arguments:
+    StartContext - The lane
+
+Return Value:
+    None
+--*/
+static VOID
+AudioLaneThread(
+    _In_ PVOID StartContext
+)
+{
+    PAUDIO_LANE lane = (PAUDIO_LANE)StartContext;
+    PVOID waitObjects[2];
+    NTSTATUS status;
+    PAUDIO_FRAME frame;
+
+    KeSetPriorityThread(KeGetCurrentThread(), AUDIO_THREAD_PRIORITY);
+
+    waitObjects[0] = &lane->TickEvent;
+    waitObjects[1] = &lane->StopEvent;
+
+    for (;;) {
+        status = KeWaitForMultipleObjects(2, waitObjects, WaitAny,
+            Executive, KernelMode, FALSE, NULL, NULL);
+
+        if (status != STATUS_WAIT_0 || lane->Stopping) {
+            break;
+        }
+
+        AudioLaneRecordJitter(lane);
+
+        if (!lane->Started) {
+            if (AudioRingDepth(&lane->Ring) < lane->Config.PrefillFrames) {
+                continue;
+            }
+            lane->Started = TRUE;
+        }
+
+        frame = AudioRingPeek(&lane->Ring);
+        if (frame == NULL) {
+            // Starved: rebuild the prefill cushion before resuming
+            lane->Stats.Underruns++;
+            lane->Started = (lane->Config.PrefillFrames == 0);
+            continue;
+        }
+
+        if (lane->Sink != NULL) {
+            lane->Sink(lane, frame);
+            lane->Stats.FramesSent++;
+        } else {
+            lane->Stats.FramesDiscarded++;
+        }
+
+        AudioRingRelease(&lane->Ring);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/*++
+Routine Description:
+    Creates a lane, its ring, its real-time thread and its periodic timer
+
+Arguments:
+    Config - Stream parameters; RingFrames is rounded up to a power of two
+    LaneId - Identifier reported in stats
+    Sink - Called on the lane thread for each due frame; without one,
+        due frames are paced and discarded
+    SinkContext - Opaque sink state
+    Lane - Receives the lane
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+AudioLaneCreate(
+    _In_ PAUDIO_LANE_CONFIG Config,
+    _In_ ULONG LaneId,
+    _In_opt_ PAUDIO_LANE_SINK Sink,
+    _In_opt_ PVOID SinkContext,
+    _Out_ PAUDIO_LANE* Lane
+)
+{
+    NTSTATUS status;
+    PAUDIO_LANE lane;
+    ULONG ringFrames;
+    HANDLE threadHandle;
+    LARGE_INTEGER frequency;
+    LONGLONG periodHns;
+
+    PAGED_CODE();
+
+    *Lane = NULL;
+
+    if (Config->FrameIntervalUs < AUDIO_MIN_INTERVAL_US ||
+        Config->FrameIntervalUs > AUDIO_MAX_INTERVAL_US ||
+        Config->RingFrames < AUDIO_RING_MIN_FRAMES ||
+        Config->RingFrames > AUDIO_RING_MAX_FRAMES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ringFrames = AUDIO_RING_MIN_FRAMES;
+    while (ringFrames < Config->RingFrames) {
+        ringFrames <<= 1;
+    }
+
+    if (Config->PrefillFrames >= ringFrames) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Lane and frames in one non-paged block; the lane thread never faults
+    lane = (PAUDIO_LANE)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        sizeof(AUDIO_LANE) + (SIZE_T)ringFrames * sizeof(AUDIO_FRAME),
+        AUDIO_LANE_POOL_TAG);
+    if (lane == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    lane->Ring.Mask = ringFrames - 1;
+    lane->Ring.Frames = (PAUDIO_FRAME)(lane + 1);
+    lane->LaneId = LaneId;
+    lane->Config = *Config;
+    lane->Config.RingFrames = ringFrames;
+    lane->Sink = Sink;
+    lane->SinkContext = SinkContext;
+    lane->Stats.LaneId = LaneId;
+
+    KeQueryPerformanceCounter(&frequency);
+    lane->FrequencyHz = frequency.QuadPart;
+
+    KeInitializeEvent(&lane->TickEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&lane->StopEvent, NotificationEvent, FALSE);
+
+    lane->Timer = ExAllocateTimer(AudioLaneTimerCallback, lane, EX_TIMER_HIGH_RESOLUTION);
+    if (lane->Timer == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL,
+        NULL, NULL, AudioLaneThread, lane);
+    if (!NT_SUCCESS(status)) {
+        ExDeleteTimer(lane->Timer, TRUE, FALSE, NULL);
+        goto Exit;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, *PsThreadType,
+        KernelMode, (PVOID*)&lane->Thread, NULL);
+    ZwClose(threadHandle);
+
+    if (!NT_SUCCESS(status)) {
+        // Without a reference we cannot wait for exit; stop it and let
+        // it run down before the lane memory goes away
+        InterlockedExchange(&lane->Stopping, 1);
+        KeSetEvent(&lane->StopEvent, IO_NO_INCREMENT, FALSE);
+        ExDeleteTimer(lane->Timer, TRUE, FALSE, NULL);
+        lane->Timer = NULL;
+        lane = NULL;
+        goto Exit;
+    }
+
+    // Relative due time and period, both in 100 ns units
+    periodHns = (LONGLONG)Config->FrameIntervalUs * 10;
+    ExSetTimer(lane->Timer, -periodHns, periodHns, NULL);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Audio lane %u created for %llx (%u us, %u frames, prefill %u)\n",
+        LaneId, Config->DeviceAddress, Config->FrameIntervalUs, ringFrames,
+        Config->PrefillFrames));
+
+    *Lane = lane;
+    return STATUS_SUCCESS;
+
+Exit:
+    if (lane != NULL) {
+        ExFreePoolWithTag(lane, AUDIO_LANE_POOL_TAG);
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Stops the timer and thread, then frees the lane. The caller must
+    guarantee no submitter still references it.
+
+Arguments:
+    Lane - Lane to destroy
+
+Return Value:
+    None
+--*/
+VOID
+AudioLaneDestroy(
+    _In_ PAUDIO_LANE Lane
+)
+{
+    PAGED_CODE();
+
+    // Cancel and wait for any in-flight expiry before the thread goes away
+    ExDeleteTimer(Lane->Timer, TRUE, TRUE, NULL);
+
+    InterlockedExchange(&Lane->Stopping, 1);
+    KeSetEvent(&Lane->StopEvent, IO_NO_INCREMENT, FALSE);
+
+    KeWaitForSingleObject(Lane->Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(Lane->Thread);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Audio lane %u destroyed (sent %u, discarded %u, underruns %u, overruns %u, max jitter %u us)\n",
+        Lane->LaneId, Lane->Stats.FramesSent, Lane->Stats.FramesDiscarded, Lane->Stats.Underruns,
+        Lane->Stats.Overruns, Lane->Stats.JitterMaxUs));
+
+    ExFreePoolWithTag(Lane, AUDIO_LANE_POOL_TAG);
+}
+
+/*++
+Routine Description:
+    Queues one frame for playout. Never blocks: a second concurrent
+    producer is turned away rather than serialized, and a full ring is
+    reported as an overrun.
+
+Arguments:
+    Lane - Target lane
+    Data - Encoded frame
+    Length - Frame length in bytes
+    Timestamp - Producer timestamp
+
+Return Value:
+    STATUS_SUCCESS, STATUS_DEVICE_BUSY (ring full or concurrent producer),
+    or STATUS_INVALID_BUFFER_SIZE
+--*/
+NTSTATUS
+AudioLaneSubmit(
+    _Inout_ PAUDIO_LANE Lane,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length,
+    _In_ LONGLONG Timestamp
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (Length == 0 || Length > AUDIO_FRAME_MAX_BYTES) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    if (InterlockedCompareExchange(&Lane->ProducerBusy, 1, 0) != 0) {
+        InterlockedIncrement((PLONG)&Lane->Stats.ProducerContention);
+        return STATUS_DEVICE_BUSY;
+    }
+
+    if (AudioRingPush(&Lane->Ring, Data, Length, Lane->Stats.FramesSubmitted, Timestamp)) {
+        Lane->Stats.FramesSubmitted++;
+    } else {
+        Lane->Stats.Overruns++;
+        status = STATUS_DEVICE_BUSY;
+    }
+
+    InterlockedExchange(&Lane->ProducerBusy, 0);
+    return status;
+}
+
+/*++
+Routine Description:
+    Snapshots lane counters. Fields are written by one side each, so the
+    copy may be momentarily inconsistent across fields but never torn.
+--*/
+VOID
+AudioLaneGetStats(
+    _In_ PAUDIO_LANE Lane,
+    _Out_ PAUDIO_LANE_STATS Stats
+)
+{
+    *Stats = Lane->Stats;
+}
+
+/*++
+Routine Description:
+    Initializes the device's lane table
+--*/
+VOID
+AudioLaneTableInitialize(
+    _Out_ PAUDIO_LANE_TABLE Table
+)
+{
+    ULONG i;
+
+    RtlZeroMemory(Table, sizeof(*Table));
+    ExInitializePushLock(&Table->Lock);
+
+    for (i = 0; i < AUDIO_MAX_LANES; i++) {
+        ExInitializeRundownProtection(&Table->Slots[i].Rundown);
+    }
+}
+
+/*++
+Routine Description:
+    Runs down and destroys one slot's lane. Caller holds the table lock.
+--*/
+static VOID
+AudioLaneSlotTeardown(
+    _Inout_ PAUDIO_LANE_SLOT Slot
+)
+{
+    if (Slot->Lane == NULL) {
+        return;
+    }
+
+    ExWaitForRundownProtectionRelease(&Slot->Rundown);
+
+    AudioLaneDestroy(Slot->Lane);
+    Slot->Lane = NULL;
+
+    ExReInitializeRundownProtection(&Slot->Rundown);
+}
+
+/*++
+Routine Description:
+    Destroys every lane; called from device cleanup
+--*/
+VOID
+AudioLaneTableCleanup(
+    _Inout_ PAUDIO_LANE_TABLE Table
+)
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Table->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    for (i = 0; i < AUDIO_MAX_LANES; i++) {
+        AudioLaneSlotTeardown(&Table->Slots[i]);
+    }
+
+    ExReleasePushLockExclusiveEx(&Table->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_AUDIO_LANE_CREATE. No transmit path in the
+    driver takes lane frames yet, so the lane has no sink: it paces and
+    measures submitted frames, then counts them as discarded.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    OutputBufferLength - Length of output buffer
+    BytesReturned - Receives the lane identifier size
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleAudioLaneCreate(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PAUDIO_LANE_CONFIG config;
+    PULONG laneId;
+    PAUDIO_LANE_TABLE table = &DeviceContext->AudioLanes;
+    PAUDIO_LANE lane;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(AUDIO_LANE_CONFIG), (PVOID*)&config, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(ULONG), (PVOID*)&laneId, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&table->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    for (i = 0; i < AUDIO_MAX_LANES; i++) {
+        if (table->Slots[i].Lane == NULL) {
+            break;
+        }
+    }
+
+    if (i == AUDIO_MAX_LANES) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = AudioLaneCreate(config, i, NULL, DeviceContext, &lane);
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    table->Slots[i].Lane = lane;
+    *laneId = i;
+    *BytesReturned = sizeof(ULONG);
+
+Exit:
+    ExReleasePushLockExclusiveEx(&table->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_AUDIO_LANE_DESTROY; input is the lane identifier
+--*/
+NTSTATUS
+HandleAudioLaneDestroy(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PULONG laneId;
+    PAUDIO_LANE_TABLE table = &DeviceContext->AudioLanes;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(ULONG), (PVOID*)&laneId, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (*laneId >= AUDIO_MAX_LANES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&table->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    if (table->Slots[*laneId].Lane == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else {
+        AudioLaneSlotTeardown(&table->Slots[*laneId]);
+    }
+
+    ExReleasePushLockExclusiveEx(&table->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_AUDIO_SUBMIT: AUDIO_SUBMIT_HEADER followed by
+    the frame. Takes only the slot's rundown reference, never the table
+    lock, so submission cannot stall behind lane creation.
+--*/
+NTSTATUS
+HandleAudioSubmit(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PAUDIO_SUBMIT_HEADER header;
+    PAUDIO_LANE_SLOT slot;
+    size_t length;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(AUDIO_SUBMIT_HEADER), (PVOID*)&header, &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (header->LaneId >= AUDIO_MAX_LANES ||
+        header->Length > length - sizeof(AUDIO_SUBMIT_HEADER)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    slot = &DeviceContext->AudioLanes.Slots[header->LaneId];
+
+    if (!ExAcquireRundownProtection(&slot->Rundown)) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (slot->Lane == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else {
+        status = AudioLaneSubmit(slot->Lane, header + 1, header->Length, header->Timestamp);
+    }
+
+    ExReleaseRundownProtection(&slot->Rundown);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_AUDIO_LANE_STATS; input is the lane identifier
+--*/
+NTSTATUS
+HandleAudioLaneStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PULONG laneId;
+    PAUDIO_LANE_STATS stats;
+    PAUDIO_LANE_SLOT slot;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(ULONG), (PVOID*)&laneId, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (*laneId >= AUDIO_MAX_LANES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    slot = &DeviceContext->AudioLanes.Slots[*laneId];
+
+    // Read the lane id before retrieving the output buffer; for
+    // METHOD_BUFFERED they share storage
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(AUDIO_LANE_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (!ExAcquireRundownProtection(&slot->Rundown)) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (slot->Lane == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else {
+        AudioLaneGetStats(slot->Lane, stats);
+        *BytesReturned = sizeof(AUDIO_LANE_STATS);
+    }
+
+    ExReleaseRundownProtection(&slot->Rundown);
+    return status;
+}
@@ -0,0 +1,168 @@
+/*++
+
+Module Name:
+    MultiDeviceBTAudio.h
+
+Abstract:
+    Real-time audio lane: per-stream lock-free SPSC frame ring drained by
+    a dedicated real-time priority thread paced by a high resolution timer
+
+--*/
+
+#ifndef _MULTIDEVICEBTAUDIO_H_
+#define _MULTIDEVICEBTAUDIO_H_
+
+#define AUDIO_MAX_LANES             2
+#define AUDIO_FRAME_MAX_BYTES       512
+#define AUDIO_RING_MIN_FRAMES       4
+#define AUDIO_RING_MAX_FRAMES       64      // Power of two
+#define AUDIO_MIN_INTERVAL_US       1000
+#define AUDIO_MAX_INTERVAL_US       100000
+#define AUDIO_JITTER_BUCKETS        8       // <50us, <100, <250, <500, <1ms, <2ms, <5ms, >=5ms
+#define AUDIO_LANE_POOL_TAG         'ADBM'
+
+// One encoded audio frame
+typedef struct _AUDIO_FRAME {
+    ULONG Length;
+    ULONG Sequence;
+    LONGLONG Timestamp;         // Producer timestamp, 100 ns units
+    UCHAR Data[AUDIO_FRAME_MAX_BYTES];
+} AUDIO_FRAME, *PAUDIO_FRAME;
+
+// Single-producer single-consumer ring. Producer owns Tail, consumer owns
+// Head; each index lives on its own cache line.
+typedef struct _AUDIO_SPSC_RING {
+    DECLSPEC_CACHEALIGN volatile ULONG Head;
+    DECLSPEC_CACHEALIGN volatile ULONG Tail;
+    DECLSPEC_CACHEALIGN ULONG Mask;
+    PAUDIO_FRAME Frames;
+} AUDIO_SPSC_RING, *PAUDIO_SPSC_RING;
+
+struct _AUDIO_LANE;
+
+// Transmit hook invoked on the lane thread for each due frame
+typedef VOID
+AUDIO_LANE_SINK(
+    _In_ struct _AUDIO_LANE* Lane,
+    _In_ PAUDIO_FRAME Frame
+);
+typedef AUDIO_LANE_SINK *PAUDIO_LANE_SINK;
+
+// Lane configuration (IOCTL_MULTI_BT_AUDIO_LANE_CREATE)
+typedef struct _AUDIO_LANE_CONFIG {
+    BTH_ADDR DeviceAddress;
+    ULONG FrameIntervalUs;
+    ULONG RingFrames;
+    ULONG PrefillFrames;        // Frames buffered before playout starts
+} AUDIO_LANE_CONFIG, *PAUDIO_LANE_CONFIG;
+
+// Frame submission header (IOCTL_MULTI_BT_AUDIO_SUBMIT), followed by data
+typedef struct _AUDIO_SUBMIT_HEADER {
+    ULONG LaneId;
+    ULONG Length;
+    LONGLONG Timestamp;
+} AUDIO_SUBMIT_HEADER, *PAUDIO_SUBMIT_HEADER;
+
+// Lane counters (IOCTL_MULTI_BT_AUDIO_LANE_STATS)
+typedef struct _AUDIO_LANE_STATS {
+    ULONG LaneId;
+    ULONG FramesSubmitted;
+    ULONG FramesSent;
+    ULONG FramesDiscarded;      // Due with no sink attached
+    ULONG Underruns;
+    ULONG Overruns;
+    ULONG ProducerContention;
+    ULONG Ticks;
+    ULONG JitterMaxUs;
+    ULONG JitterAvgUs;
+    ULONG JitterHistogram[AUDIO_JITTER_BUCKETS];
+} AUDIO_LANE_STATS, *PAUDIO_LANE_STATS;
+
+typedef struct _AUDIO_LANE {
+    AUDIO_SPSC_RING Ring;
+    DECLSPEC_CACHEALIGN volatile LONG ProducerBusy;
+    ULONG LaneId;
+    AUDIO_LANE_CONFIG Config;
+    PAUDIO_LANE_SINK Sink;
+    PVOID SinkContext;
+
+    // Consumer side, touched only by the lane thread
+    DECLSPEC_CACHEALIGN PEX_TIMER Timer;
+    KEVENT TickEvent;
+    KEVENT StopEvent;
+    PKTHREAD Thread;
+    volatile LONG Stopping;
+    BOOLEAN Started;
+    LONGLONG NextDeadline;      // Performance counter ticks
+    LONGLONG FrequencyHz;
+    ULONG64 JitterSumUs;
+    AUDIO_LANE_STATS Stats;
+} AUDIO_LANE, *PAUDIO_LANE;
+
+// Lane slots in the device context. Create/destroy serialize on Lock, a
+// push lock held at PASSIVE_LEVEL because both start or wait for the lane
+// thread; submitters hold the slot's rundown reference while using the lane.
+typedef struct _AUDIO_LANE_SLOT {
+    EX_RUNDOWN_REF Rundown;
+    PAUDIO_LANE Lane;
+} AUDIO_LANE_SLOT, *PAUDIO_LANE_SLOT;
+
+typedef struct _AUDIO_LANE_TABLE {
+    EX_PUSH_LOCK Lock;
+    AUDIO_LANE_SLOT Slots[AUDIO_MAX_LANES];
+} AUDIO_LANE_TABLE, *PAUDIO_LANE_TABLE;
+
+// SPSC ring primitives, shared with the isochronous scheduler
+BOOLEAN AudioRingPush(
+    _Inout_ PAUDIO_SPSC_RING Ring,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length,
+    _In_ ULONG Sequence,
+    _In_ LONGLONG Timestamp
+);
+
+PAUDIO_FRAME AudioRingPeek(
+    _In_ PAUDIO_SPSC_RING Ring
+);
+
+VOID AudioRingRelease(
+    _Inout_ PAUDIO_SPSC_RING Ring
+);
+
+ULONG AudioRingDepth(
+    _In_ PAUDIO_SPSC_RING Ring
+);
+
+VOID AudioLaneTableInitialize(
+    _Out_ PAUDIO_LANE_TABLE Table
+);
+
+VOID AudioLaneTableCleanup(
+    _Inout_ PAUDIO_LANE_TABLE Table
+);
+
+NTSTATUS AudioLaneCreate(
+    _In_ PAUDIO_LANE_CONFIG Config,
+    _In_ ULONG LaneId,
+    _In_opt_ PAUDIO_LANE_SINK Sink,
+    _In_opt_ PVOID SinkContext,
+    _Out_ PAUDIO_LANE* Lane
+);
+
+VOID AudioLaneDestroy(
+    _In_ PAUDIO_LANE Lane
+);
+
+NTSTATUS AudioLaneSubmit(
+    _Inout_ PAUDIO_LANE Lane,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length,
+    _In_ LONGLONG Timestamp
+);
+
+VOID AudioLaneGetStats(
+    _In_ PAUDIO_LANE Lane,
+    _Out_ PAUDIO_LANE_STATS Stats
+);
+
+#endif // _MULTIDEVICEBTAUDIO_H_
@@ -0,0 +1,876 @@
+/*++
+
+Module Name:
+    MultiDeviceBTBond.c
+
+Abstract:
+    Driver-wide bond store. Previously a reconnect fetched link keys, LTKs
+    and IRKs from scattered registry values. That meant one registry read
+    per key, at PASSIVE_LEVEL, on every connection.
+
+    Now the first adapter to reach PrepareHardware reads the bond
+    database file whole into non-paged memory and checks it. If an
+    update was interrupted, that load also replays the write-ahead
+    record and writes the repaired slot back. After that, lookups are a
+    hash probe under a spin lock, and the file is only written.
+
+    An update is two flushed writes: the write-ahead record, then the
+    record's slot. The in-memory table changes only after both are on
+    disk. A table too full for an insert is rebuilt at twice the size
+    into a side file, which then replaces the database with one rename.
+
+    IRKs from the store are loaded into each adapter's resolver as it
+    starts, and changes to them reach every registered adapter. Key
+    material never leaves the kernel: IOCTL_MULTI_BT_BOND_LOOKUP reports
+    only which keys a bond holds.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, BondStoreLoad)
+#pragma alloc_text (PAGE, BondStoreUnload)
+#pragma alloc_text (PAGE, BondStoreUpdate)
+#pragma alloc_text (PAGE, BondStoreFeedPrivacy)
+#endif
+
+static NTSTATUS
+BondFileOpen(
+    _In_ PCWSTR Path,
+    _In_ ACCESS_MASK Access,
+    _In_ ULONG Disposition,
+    _Out_ PHANDLE File
+)
+{
+    UNICODE_STRING name;
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatus;
+
+    RtlInitUnicodeString(&name, Path);
+    InitializeObjectAttributes(&attributes, &name,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+    return ZwCreateFile(File, Access | SYNCHRONIZE, &attributes, &ioStatus, NULL,
+        FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, Disposition,
+        FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE | FILE_WRITE_THROUGH,
+        NULL, 0);
+}
+
+static NTSTATUS
+BondFileRead(
+    _In_ HANDLE File,
+    _In_ ULONG64 Offset,
+    _Out_writes_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+)
+{
+    IO_STATUS_BLOCK ioStatus;
+    LARGE_INTEGER offset;
+    NTSTATUS status;
+
+    offset.QuadPart = (LONGLONG)Offset;
+    status = ZwReadFile(File, NULL, NULL, NULL, &ioStatus, Buffer, Length, &offset, NULL);
+    if (NT_SUCCESS(status) && ioStatus.Information != Length) {
+        status = STATUS_END_OF_FILE;
+    }
+
+    return status;
+}
+
+// Returns once the bytes are on the medium
+static NTSTATUS
+BondFileWrite(
+    _In_ HANDLE File,
+    _In_ ULONG64 Offset,
+    _In_reads_bytes_(Length) const VOID* Buffer,
+    _In_ ULONG Length
+)
+{
+    IO_STATUS_BLOCK ioStatus;
+    LARGE_INTEGER offset;
+    NTSTATUS status;
+
+    offset.QuadPart = (LONGLONG)Offset;
+    status = ZwWriteFile(File, NULL, NULL, NULL, &ioStatus, (PVOID)Buffer, Length, &offset, NULL);
+    if (NT_SUCCESS(status)) {
+        status = ZwFlushBuffersFile(File, &ioStatus);
+    }
+
+    return status;
+}
+
+static VOID
+BondFreeImage(
+    _Inout_ PBONDDB Db
+)
+{
+    if (Db->Image != NULL) {
+        RtlSecureZeroMemory(Db->Image, Db->ImageSize);
+        ExFreePoolWithTag(Db->Image, BOND_POOL_TAG);
+    }
+    RtlZeroMemory(Db, sizeof(*Db));
+}
+
+static VOID
+BondUpdateStats(
+    _Inout_ PBOND_STORE Store
+)
+{
+    Store->Stats.Bonds = Store->Db.Count;
+    Store->Stats.Capacity = Store->Db.Mask + 1;
+    Store->Stats.Tombstones = Store->Db.Deleted;
+    Store->Stats.Sequence = Store->Db.Sequence;
+}
+
+/*++
+Routine Description:
+    Initializes an empty, unloaded bond store
+--*/
+VOID
+BondStoreInitialize(
+    _Out_ PBOND_STORE Store
+)
+{
+    RtlZeroMemory(Store, sizeof(*Store));
+    ExInitializePushLock(&Store->UpdateLock);
+    KeInitializeSpinLock(&Store->Lock);
+    Store->LoadStatus = STATUS_PENDING;
+}
+
+/*++
+Routine Description:
+    Opens the bond database and reads it into memory, creating an empty
+    one if none exists. Called with the store's update lock held.
+
+Arguments:
+    Store - Bond store
+
+Return Value:
+    STATUS_FILE_CORRUPT_ERROR when the file's header is damaged. The file
+    is left as it is for inspection and the store stays unloaded.
+--*/
+static NTSTATUS
+BondStoreOpen(
+    _Inout_ PBOND_STORE Store
+)
+{
+    FILE_STANDARD_INFORMATION info;
+    IO_STATUS_BLOCK ioStatus;
+    BONDDB_HEADER header;
+    BONDDB db;
+    PVOID image = NULL;
+    SIZE_T size = 0;
+    ULONG capacity;
+    ULONG64 start;
+    BONDDB old;
+    NTSTATUS status;
+    KIRQL irql;
+
+    start = KeQueryInterruptTime();
+
+    status = BondFileOpen(BOND_STORE_PATH, GENERIC_READ | GENERIC_WRITE, FILE_OPEN_IF, &Store->File);
+    if (NT_SUCCESS(status)) {
+        status = ZwQueryInformationFile(Store->File, &ioStatus, &info, sizeof(info),
+            FileStandardInformation);
+    }
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    if (info.EndOfFile.QuadPart == 0) {
+        capacity = BONDDB_MIN_CAPACITY;
+    } else {
+        status = BondFileRead(Store->File, 0, &header, sizeof(header));
+        if (!NT_SUCCESS(status)) {
+            goto Exit;
+        }
+        capacity = header.Capacity;
+        if (header.Magic != BONDDB_MAGIC || capacity < BONDDB_MIN_CAPACITY ||
+            capacity > BONDDB_MAX_CAPACITY ||
+            (ULONG64)info.EndOfFile.QuadPart < BondDbImageSize(capacity)) {
+            status = STATUS_FILE_CORRUPT_ERROR;
+            goto Exit;
+        }
+    }
+
+    size = BondDbImageSize(capacity);
+    image = ExAllocatePool2(POOL_FLAG_NON_PAGED, size, BOND_POOL_TAG);
+    if (image == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    if (info.EndOfFile.QuadPart == 0) {
+        BondDbFormat(image, capacity);
+        status = BondFileWrite(Store->File, 0, image, (ULONG)size);
+    } else {
+        status = BondFileRead(Store->File, 0, image, (ULONG)size);
+    }
+    if (NT_SUCCESS(status)) {
+        status = BondDbAttach(&db, image, size);
+    }
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    // Finish the interrupted update on disk too
+    if (db.Replayed) {
+        const BONDDB_WAL* wal = (const BONDDB_WAL*)(db.Image + BONDDB_WAL_OFFSET);
+
+        status = BondFileWrite(Store->File,
+            BONDDB_RECORDS_OFFSET + (ULONG64)wal->Slot * sizeof(BONDDB_RECORD),
+            &db.Records[wal->Slot], sizeof(BONDDB_RECORD));
+        if (!NT_SUCCESS(status)) {
+            goto Exit;
+        }
+    }
+
+    // A rebuild that lost the file leaves its table in place until this retry
+    KeAcquireSpinLock(&Store->Lock, &irql);
+    old = Store->Db;
+    Store->Db = db;
+    BondUpdateStats(Store);
+    Store->Stats.CorruptRecords = db.CorruptRecords;
+    Store->Stats.Replayed = db.Replayed;
+    Store->Stats.LoadUs = (ULONG)((KeQueryInterruptTime() - start) / 10);
+    Store->Stats.Loaded = TRUE;
+    KeReleaseSpinLock(&Store->Lock, irql);
+    image = NULL;
+
+    BondFreeImage(&old);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Bond store loaded: %u bonds, %u slots, %u corrupt, %s in %u us\n",
+        db.Count, db.Mask + 1, db.CorruptRecords,
+        db.Replayed ? "update replayed" : "clean", Store->Stats.LoadUs));
+
+    if (db.CorruptRecords != 0) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+            "MultiDeviceBT: %u bond records failed their checksum and were dropped\n",
+            db.CorruptRecords));
+    }
+
+Exit:
+    if (image != NULL) {
+        RtlSecureZeroMemory(image, size);
+        ExFreePoolWithTag(image, BOND_POOL_TAG);
+    }
+    if (!NT_SUCCESS(status) && Store->File != NULL) {
+        ZwClose(Store->File);
+        Store->File = NULL;
+    }
+    Store->LoadStatus = status;
+
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MultiDeviceBT: Bond store load failed - 0x%x\n", status));
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Loads the bond store. The first successful call does the work; later
+    calls return its status. A failed load is not kept: the next load,
+    or the next update, tries again.
+
+Arguments:
+    Store - Bond store
+
+Return Value:
+    See BondStoreOpen
+--*/
+NTSTATUS
+BondStoreLoad(
+    _Inout_ PBOND_STORE Store
+)
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Store->UpdateLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    if (Store->File != NULL) {
+        status = Store->LoadStatus;
+    } else {
+        status = BondStoreOpen(Store);
+    }
+
+    ExReleasePushLockExclusiveEx(&Store->UpdateLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Closes the database and wipes the in-memory copy
+--*/
+VOID
+BondStoreUnload(
+    _Inout_ PBOND_STORE Store
+)
+{
+    BONDDB db;
+    KIRQL irql;
+
+    PAGED_CODE();
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Store->UpdateLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    if (Store->File != NULL) {
+        ZwClose(Store->File);
+        Store->File = NULL;
+    }
+
+    KeAcquireSpinLock(&Store->Lock, &irql);
+    db = Store->Db;
+    RtlZeroMemory(&Store->Db, sizeof(Store->Db));
+    Store->Stats.Loaded = FALSE;
+    KeReleaseSpinLock(&Store->Lock, irql);
+    Store->LoadStatus = STATUS_PENDING;
+
+    BondFreeImage(&db);
+
+    ExReleasePushLockExclusiveEx(&Store->UpdateLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+/*++
+Routine Description:
+    Copies a bond's keys out. Callable at DISPATCH_LEVEL.
+
+Arguments:
+    Store - Bond store
+
+    IdentityAddress - Identity address of the bonded device
+
+    Entry - Receives the bond
+
+Return Value:
+    STATUS_NOT_FOUND when there is no bond; STATUS_DEVICE_NOT_READY
+    before the store is loaded
+--*/
+NTSTATUS
+BondStoreLookup(
+    _Inout_ PBOND_STORE Store,
+    _In_ BTH_ADDR IdentityAddress,
+    _Out_ PBOND_ENTRY Entry
+)
+{
+    const BONDDB_RECORD* record;
+    NTSTATUS status = STATUS_NOT_FOUND;
+    KIRQL irql;
+
+    RtlZeroMemory(Entry, sizeof(*Entry));
+
+    KeAcquireSpinLock(&Store->Lock, &irql);
+
+    if (Store->Db.Image == NULL) {
+        status = STATUS_DEVICE_NOT_READY;
+    } else {
+        Store->Stats.Lookups++;
+        record = BondDbLookup(&Store->Db, IdentityAddress);
+        if (record != NULL) {
+            Entry->IdentityAddress = record->IdentityAddress;
+            Entry->AddressType = record->AddressType;
+            Entry->Keys = record->Keys;
+            Entry->LinkKeyType = record->LinkKeyType;
+            Entry->LtkKeySize = record->LtkKeySize;
+            Entry->Security = record->Security;
+            Entry->Ediv = record->Ediv;
+            Entry->Rand = record->Rand;
+            RtlCopyMemory(Entry->LinkKey, record->LinkKey, BONDDB_KEY_BYTES);
+            RtlCopyMemory(Entry->Ltk, record->Ltk, BONDDB_KEY_BYTES);
+            RtlCopyMemory(Entry->Irk, record->Irk, BONDDB_KEY_BYTES);
+            Store->Stats.LookupHits++;
+            status = STATUS_SUCCESS;
+        }
+    }
+
+    KeReleaseSpinLock(&Store->Lock, irql);
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Rebuilds the table into a larger side file and renames it over the
+    database. Called with the store's update lock held. On failure the
+    old file and table stay in use.
+--*/
+static NTSTATUS
+BondStoreRebuild(
+    _Inout_ PBOND_STORE Store
+)
+{
+    static const WCHAR target[] = BOND_STORE_PATH;
+    PFILE_RENAME_INFORMATION rename = NULL;
+    IO_STATUS_BLOCK ioStatus;
+    HANDLE file = NULL;
+    BONDDB db, old;
+    PVOID image;
+    SIZE_T size;
+    ULONG capacity, renameSize;
+    NTSTATUS status;
+    KIRQL irql;
+
+    capacity = BondDbRebuildCapacity(&Store->Db);
+    if (capacity == 0) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    size = BondDbImageSize(capacity);
+    image = ExAllocatePool2(POOL_FLAG_NON_PAGED, size, BOND_POOL_TAG);
+    renameSize = FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName) + sizeof(target);
+    rename = (PFILE_RENAME_INFORMATION)ExAllocatePool2(POOL_FLAG_PAGED, renameSize, BOND_POOL_TAG);
+    if (image == NULL || rename == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = BondDbRebuild(&Store->Db, &db, image, capacity);
+    if (NT_SUCCESS(status)) {
+        status = BondFileOpen(BOND_STORE_REBUILD_PATH, GENERIC_READ | GENERIC_WRITE | DELETE,
+            FILE_OVERWRITE_IF, &file);
+    }
+    if (NT_SUCCESS(status)) {
+        status = BondFileWrite(file, 0, image, (ULONG)size);
+    }
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    // The database cannot be replaced while it is open
+    ZwClose(Store->File);
+    Store->File = NULL;
+
+    rename->ReplaceIfExists = TRUE;
+    rename->RootDirectory = NULL;
+    rename->FileNameLength = sizeof(target) - sizeof(WCHAR);
+    RtlCopyMemory(rename->FileName, target, sizeof(target));
+    status = ZwSetInformationFile(file, &ioStatus, rename, renameSize, FileRenameInformation);
+    if (!NT_SUCCESS(status)) {
+        NTSTATUS reopen = BondFileOpen(BOND_STORE_PATH, GENERIC_READ | GENERIC_WRITE,
+            FILE_OPEN, &Store->File);
+
+        if (!NT_SUCCESS(reopen)) {
+            Store->LoadStatus = reopen;
+        }
+        goto Exit;
+    }
+
+    Store->File = file;
+    file = NULL;
+
+    KeAcquireSpinLock(&Store->Lock, &irql);
+    old = Store->Db;
+    Store->Db = db;
+    Store->Stats.Rebuilds++;
+    BondUpdateStats(Store);
+    KeReleaseSpinLock(&Store->Lock, irql);
+    image = NULL;
+
+    BondFreeImage(&old);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Bond store rebuilt at %u slots for %u bonds\n", capacity, db.Count));
+
+Exit:
+    if (file != NULL) {
+        ZwClose(file);
+    }
+    if (image != NULL) {
+        RtlSecureZeroMemory(image, size);
+        ExFreePoolWithTag(image, BOND_POOL_TAG);
+    }
+    if (rename != NULL) {
+        ExFreePoolWithTag(rename, BOND_POOL_TAG);
+    }
+
+    return status;
+}
+
+// Brings every registered adapter's resolver in line with a bond's IRK
+static VOID
+BondPrivacyUpdate(
+    _In_ BTH_ADDR IdentityAddress,
+    _In_ UCHAR AddressType,
+    _In_reads_bytes_opt_(BONDDB_KEY_BYTES) const UCHAR* Irk
+)
+{
+    PADAPTER_REGISTRY registry = &DriverGetContext(WdfGetDriver())->AdapterRegistry;
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&registry->Lock, &irql);
+
+    for (i = 0; i < MAX_BLUETOOTH_ADAPTERS; i++) {
+        PDEVICE_CONTEXT adapter = registry->Adapters[i];
+
+        if (adapter == NULL) {
+            continue;
+        }
+        if (Irk != NULL) {
+            PrivacyAddIrk(&adapter->Privacy, IdentityAddress, AddressType, Irk);
+        } else {
+            PrivacyRemoveIrk(&adapter->Privacy, IdentityAddress);
+        }
+    }
+
+    KeReleaseSpinLock(&registry->Lock, irql);
+}
+
+// Feeds every stored IRK to the registered adapters, after a load that
+// succeeded only once they had started
+static VOID
+BondPrivacyFeedAll(
+    _In_ PBOND_STORE Store
+)
+{
+    const BONDDB_RECORD* record;
+    ULONG cursor = 0;
+
+    while ((record = BondDbEnumerate(&Store->Db, &cursor)) != NULL) {
+        if ((record->Keys & BONDDB_KEY_IRK) != 0) {
+            BondPrivacyUpdate(record->IdentityAddress, record->AddressType, record->Irk);
+        }
+    }
+}
+
+/*++
+Routine Description:
+    Adds, replaces or removes a bond durably
+
+Arguments:
+    Store - Bond store
+
+    IdentityAddress - Identity address of the bonded device
+
+    Entry - Keys to store; NULL removes the bond
+
+Return Value:
+    STATUS_NOT_FOUND when removing a bond that is not there;
+    STATUS_DEVICE_NOT_READY before the first load; the load status when
+    retrying a failed load fails again
+--*/
+NTSTATUS
+BondStoreUpdate(
+    _Inout_ PBOND_STORE Store,
+    _In_ BTH_ADDR IdentityAddress,
+    _In_opt_ const BOND_ENTRY* Entry
+)
+{
+    BONDDB_RECORD record;
+    BONDDB_WAL wal;
+    NTSTATUS status;
+    KIRQL irql;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(&record, sizeof(record));
+    if (Entry != NULL) {
+        record.AddressType = Entry->AddressType;
+        record.Keys = Entry->Keys;
+        record.LinkKeyType = Entry->LinkKeyType;
+        record.LtkKeySize = Entry->LtkKeySize;
+        record.Security = Entry->Security;
+        record.Ediv = Entry->Ediv;
+        record.Rand = Entry->Rand;
+        RtlCopyMemory(record.LinkKey, Entry->LinkKey, BONDDB_KEY_BYTES);
+        RtlCopyMemory(record.Ltk, Entry->Ltk, BONDDB_KEY_BYTES);
+        RtlCopyMemory(record.Irk, Entry->Irk, BONDDB_KEY_BYTES);
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Store->UpdateLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    // Retry a load that failed; before any adapter has started, wait for it
+    if (Store->File == NULL) {
+        status = (Store->LoadStatus == STATUS_PENDING) ?
+            STATUS_DEVICE_NOT_READY : BondStoreOpen(Store);
+        if (!NT_SUCCESS(status)) {
+            goto Exit;
+        }
+        BondPrivacyFeedAll(Store);
+    }
+
+    status = BondDbStage(&Store->Db, IdentityAddress, (Entry != NULL) ? &record : NULL, &wal);
+    if (status == STATUS_INSUFFICIENT_RESOURCES) {
+        status = BondStoreRebuild(Store);
+        if (NT_SUCCESS(status)) {
+            status = BondDbStage(&Store->Db, IdentityAddress, &record, &wal);
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    status = BondFileWrite(Store->File, BONDDB_WAL_OFFSET, &wal, sizeof(wal));
+    if (NT_SUCCESS(status)) {
+        status = BondFileWrite(Store->File,
+            BONDDB_RECORDS_OFFSET + (ULONG64)wal.Slot * sizeof(BONDDB_RECORD),
+            &wal.Record, sizeof(wal.Record));
+    }
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    KeAcquireSpinLock(&Store->Lock, &irql);
+    BondDbCommit(&Store->Db, &wal);
+    Store->Stats.Updates++;
+    BondUpdateStats(Store);
+    KeReleaseSpinLock(&Store->Lock, irql);
+
+Exit:
+    ExReleasePushLockExclusiveEx(&Store->UpdateLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+
+    RtlSecureZeroMemory(&record, sizeof(record));
+    RtlSecureZeroMemory(&wal, sizeof(wal));
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Loads every stored IRK into an adapter's resolver. Called as the
+    adapter starts.
+
+Arguments:
+    Store - Loaded bond store
+
+    Privacy - The adapter's privacy context
+
+Return Value:
+    None
+--*/
+VOID
+BondStoreFeedPrivacy(
+    _Inout_ PBOND_STORE Store,
+    _Inout_ PPRIVACY_CONTEXT Privacy
+)
+{
+    const BONDDB_RECORD* record;
+    ULONG cursor = 0, fed = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    // The table only changes under the update lock, so no spin lock is needed to walk it
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Store->UpdateLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    if (Store->Db.Image != NULL) {
+        while ((record = BondDbEnumerate(&Store->Db, &cursor)) != NULL) {
+            if ((record->Keys & BONDDB_KEY_IRK) == 0) {
+                continue;
+            }
+            status = PrivacyAddIrk(Privacy, record->IdentityAddress,
+                record->AddressType, record->Irk);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+            fed++;
+        }
+    }
+
+    ExReleasePushLockExclusiveEx(&Store->UpdateLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, NT_SUCCESS(status) ? DPFLTR_INFO_LEVEL : DPFLTR_WARNING_LEVEL,
+        "MultiDeviceBT: %u stored IRKs loaded into the resolver - 0x%x\n", fed, status));
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_BOND_ADD
+--*/
+NTSTATUS
+HandleBondAdd(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBOND_ENTRY entry;
+
+    UNREFERENCED_PARAMETER(DeviceContext);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(BOND_ENTRY), (PVOID*)&entry, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (entry->IdentityAddress == BTH_ADDR_NULL ||
+        entry->AddressType > RPA_IDENTITY_RANDOM_STATIC ||
+        entry->Keys == 0 ||
+        (entry->Keys & ~(BONDDB_KEY_LINK | BONDDB_KEY_LTK | BONDDB_KEY_IRK)) != 0 ||
+        ((entry->Keys & BONDDB_KEY_LTK) != 0 &&
+         (entry->LtkKeySize < 7 || entry->LtkKeySize > BONDDB_KEY_BYTES))) {
+        status = STATUS_INVALID_PARAMETER;
+    } else {
+        status = BondStoreUpdate(&DriverGetContext(WdfGetDriver())->Bonds,
+            entry->IdentityAddress, entry);
+    }
+
+    if (NT_SUCCESS(status)) {
+        BondPrivacyUpdate(entry->IdentityAddress, entry->AddressType,
+            (entry->Keys & BONDDB_KEY_IRK) != 0 ? entry->Irk : NULL);
+
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: Bond for %llx stored (keys 0x%x)\n",
+            entry->IdentityAddress, entry->Keys));
+    }
+
+    RtlSecureZeroMemory(entry->LinkKey, sizeof(entry->LinkKey));
+    RtlSecureZeroMemory(entry->Ltk, sizeof(entry->Ltk));
+    RtlSecureZeroMemory(entry->Irk, sizeof(entry->Irk));
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_BOND_REMOVE
+--*/
+NTSTATUS
+HandleBondRemove(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBTH_ADDR address;
+
+    UNREFERENCED_PARAMETER(DeviceContext);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(BTH_ADDR), (PVOID*)&address, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = BondStoreUpdate(&DriverGetContext(WdfGetDriver())->Bonds, *address, NULL);
+    if (NT_SUCCESS(status)) {
+        BondPrivacyUpdate(*address, 0, NULL);
+
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: Bond for %llx removed\n", *address));
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_BOND_LOOKUP. Reports the bond with its key
+    material zeroed.
+--*/
+NTSTATUS
+HandleBondLookup(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBTH_ADDR address;
+    PBOND_ENTRY output;
+    BOND_ENTRY entry;
+
+    UNREFERENCED_PARAMETER(DeviceContext);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(BTH_ADDR), (PVOID*)&address, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = BondStoreLookup(&DriverGetContext(WdfGetDriver())->Bonds, *address, &entry);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlSecureZeroMemory(entry.LinkKey, sizeof(entry.LinkKey));
+    RtlSecureZeroMemory(entry.Ltk, sizeof(entry.Ltk));
+    RtlSecureZeroMemory(entry.Irk, sizeof(entry.Irk));
+    entry.Rand = 0;
+    entry.Ediv = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(BOND_ENTRY), (PVOID*)&output, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    *output = entry;
+    *BytesReturned = sizeof(BOND_ENTRY);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_BOND_STATS
+--*/
+NTSTATUS
+HandleGetBondStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PBOND_STORE store = &DriverGetContext(WdfGetDriver())->Bonds;
+    NTSTATUS status;
+    PBOND_STATS stats;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(DeviceContext);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(BOND_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&store->Lock, &irql);
+    *stats = store->Stats;
+    KeReleaseSpinLock(&store->Lock, irql);
+
+    *BytesReturned = sizeof(BOND_STATS);
+    return STATUS_SUCCESS;
+}
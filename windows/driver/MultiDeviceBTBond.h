@@ -0,0 +1,90 @@
+/*++
+
+Module Name:
+    MultiDeviceBTBond.h
+
+Abstract:
+    Driver-wide bond store over the bond database file
+    (MultiDeviceBTBondDb.h). The first adapter to start loads the file
+    into non-paged memory; a failed load is retried by the next adapter
+    or update. Reconnects then look keys up at DISPATCH_LEVEL without
+    touching the disk. Updates go through the
+    write-ahead record, and bonded IRKs feed each adapter's resolver.
+
+--*/
+
+#ifndef _MULTIDEVICEBTBOND_H_
+#define _MULTIDEVICEBTBOND_H_
+
+#include "MultiDeviceBTBondDb.h"
+
+#define BOND_POOL_TAG               'KDBM'
+#define BOND_STORE_PATH             L"\\SystemRoot\\System32\\drivers\\MultiDeviceBTBonds.db"
+#define BOND_STORE_REBUILD_PATH     L"\\SystemRoot\\System32\\drivers\\MultiDeviceBTBonds.new"
+
+// IOCTL_MULTI_BT_BOND_ADD input and IOCTL_MULTI_BT_BOND_LOOKUP output
+typedef struct _BOND_ENTRY {
+    BTH_ADDR IdentityAddress;
+    UCHAR AddressType;          // Identity address type, as in HCI
+    UCHAR Keys;                 // BONDDB_KEY_*
+    UCHAR LinkKeyType;
+    UCHAR LtkKeySize;
+    UCHAR Security;             // BONDDB_SECURITY_*
+    UCHAR Reserved;
+    USHORT Ediv;
+    ULONG64 Rand;
+    UCHAR LinkKey[BONDDB_KEY_BYTES];
+    UCHAR Ltk[BONDDB_KEY_BYTES];
+    UCHAR Irk[BONDDB_KEY_BYTES];    // Least significant octet first
+} BOND_ENTRY, *PBOND_ENTRY;
+
+typedef struct _BOND_STATS {
+    ULONG Bonds;
+    ULONG Capacity;             // Table slots
+    ULONG Tombstones;
+    ULONG CorruptRecords;       // Dropped at load
+    ULONG64 Sequence;           // Last committed update
+    ULONG64 Lookups;
+    ULONG64 LookupHits;
+    ULONG64 Updates;
+    ULONG Rebuilds;
+    ULONG LoadUs;               // Open, read and check at load
+    BOOLEAN Loaded;
+    BOOLEAN Replayed;           // Load applied an interrupted update
+    UCHAR Reserved[6];
+} BOND_STATS, *PBOND_STATS;
+
+typedef struct _BOND_STORE {
+    EX_PUSH_LOCK UpdateLock;    // Serializes load, updates and file I/O; PASSIVE_LEVEL, critical region
+    KSPIN_LOCK Lock;            // Guards Db for lookups; taken under UpdateLock to change it
+    BONDDB Db;                  // Over a non-paged copy of the file
+    HANDLE File;
+    NTSTATUS LoadStatus;        // STATUS_PENDING until loaded; a failed load is retried
+    BOND_STATS Stats;
+} BOND_STORE, *PBOND_STORE;
+
+VOID BondStoreInitialize(
+    _Out_ PBOND_STORE Store
+);
+
+NTSTATUS BondStoreLoad(
+    _Inout_ PBOND_STORE Store
+);
+
+VOID BondStoreUnload(
+    _Inout_ PBOND_STORE Store
+);
+
+NTSTATUS BondStoreLookup(
+    _Inout_ PBOND_STORE Store,
+    _In_ BTH_ADDR IdentityAddress,
+    _Out_ PBOND_ENTRY Entry
+);
+
+NTSTATUS BondStoreUpdate(
+    _Inout_ PBOND_STORE Store,
+    _In_ BTH_ADDR IdentityAddress,
+    _In_opt_ const BOND_ENTRY* Entry
+);
+
+#endif // _MULTIDEVICEBTBOND_H_
@@ -0,0 +1,509 @@
+/*++
+
+Module Name:
+    MultiDeviceBTBondDb.c
+
+Abstract:
+    Bond database image: format, check and recovery, lookups and
+    write-ahead updates.
+
+    Records are open-addressed on a hash of the identity address with
+    linear probing. The table never passes BONDDB_LOAD_PERCENT full,
+    counting tombstones, so a probe always ends at a free slot and stays
+    short. Removing a bond leaves a tombstone rather than shifting
+    records, so every update touches exactly one slot. That one slot is
+    what the write-ahead record covers. When an insert would pass the
+    load limit, the caller rebuilds into a new table and replaces the
+    file as a whole.
+
+    Each update carries the next sequence number. At attach, the
+    write-ahead record is replayed when its slot holds an older sequence
+    or fails its CRC. A record that fails its CRC with no write-ahead
+    record to repair it becomes a tombstone, so the bonds around it stay
+    reachable.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTBondDb.h"
+
+// CRC-32 (IEEE 802.3, reflected), as in zip and PNG
+static const ULONG BondDbCrcTable[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+    0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+    0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+    0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+    0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+    0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+    0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+    0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+    0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+    0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+    0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+    0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+    0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+    0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+    0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+    0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+    0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+ULONG
+BondDbCrc32(
+    _In_reads_bytes_(Length) const VOID* Data,
+    _In_ SIZE_T Length
+)
+{
+    const UCHAR* p = (const UCHAR*)Data;
+    ULONG crc = 0xFFFFFFFF;
+
+    while (Length-- != 0) {
+        crc = BondDbCrcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+static __forceinline ULONG
+BondDbSlot(
+    _In_ const BONDDB* Db,
+    _In_ BTH_ADDR IdentityAddress
+)
+{
+    return (ULONG)((IdentityAddress * 0x9E3779B97F4A7C15ULL) >> 40) & Db->Mask;
+}
+
+static __forceinline BOOLEAN
+BondDbRecordValid(
+    _In_ const BONDDB_RECORD* Record
+)
+{
+    return Record->Crc == BondDbCrc32(Record, FIELD_OFFSET(BONDDB_RECORD, Crc));
+}
+
+static __forceinline BOOLEAN
+BondDbPastLoad(
+    _In_ ULONG Slots,
+    _In_ ULONG Capacity
+)
+{
+    return (ULONG64)Slots * 100 > (ULONG64)Capacity * BONDDB_LOAD_PERCENT;
+}
+
+/*++
+Routine Description:
+    Returns the file size for a table of Capacity slots
+--*/
+SIZE_T
+BondDbImageSize(
+    _In_ ULONG Capacity
+)
+{
+    return BONDDB_RECORDS_OFFSET + (SIZE_T)Capacity * sizeof(BONDDB_RECORD);
+}
+
+/*++
+Routine Description:
+    Writes an empty database image
+
+Arguments:
+    Image - BondDbImageSize(Capacity) bytes
+
+    Capacity - Table slots; a power of two
+
+Return Value:
+    None
+--*/
+VOID
+BondDbFormat(
+    _Out_writes_bytes_(BondDbImageSize(Capacity)) PVOID Image,
+    _In_ ULONG Capacity
+)
+{
+    PBONDDB_HEADER header = (PBONDDB_HEADER)Image;
+
+    RtlZeroMemory(Image, BondDbImageSize(Capacity));
+
+    header->Magic = BONDDB_MAGIC;
+    header->Version = BONDDB_VERSION;
+    header->RecordSize = sizeof(BONDDB_RECORD);
+    header->Capacity = Capacity;
+    header->WalOffset = BONDDB_WAL_OFFSET;
+    header->RecordsOffset = BONDDB_RECORDS_OFFSET;
+    header->Crc = BondDbCrc32(header, FIELD_OFFSET(BONDDB_HEADER, Crc));
+}
+
+/*++
+Routine Description:
+    Checks an image read from disk and makes it usable in place: replays
+    the write-ahead record if its update did not reach the table, and
+    turns records that fail their CRC into tombstones.
+
+Arguments:
+    Db - Receives the database over Image
+
+    Image - Whole file; it stays owned by the caller
+
+    ImageSize - Bytes in Image
+
+Return Value:
+    STATUS_FILE_CORRUPT_ERROR when the header is damaged or the image is
+    shorter than its table. On success, Db->Replayed tells the caller to
+    write the replayed slot back.
+--*/
+NTSTATUS
+BondDbAttach(
+    _Out_ PBONDDB Db,
+    _Inout_updates_bytes_(ImageSize) PVOID Image,
+    _In_ SIZE_T ImageSize
+)
+{
+    const BONDDB_HEADER* header = (const BONDDB_HEADER*)Image;
+    const BONDDB_WAL* wal;
+    ULONG capacity, i;
+
+    RtlZeroMemory(Db, sizeof(*Db));
+
+    if (ImageSize < BONDDB_RECORDS_OFFSET ||
+        header->Magic != BONDDB_MAGIC ||
+        header->Crc != BondDbCrc32(header, FIELD_OFFSET(BONDDB_HEADER, Crc)) ||
+        header->Version != BONDDB_VERSION ||
+        header->RecordSize != sizeof(BONDDB_RECORD) ||
+        header->WalOffset != BONDDB_WAL_OFFSET ||
+        header->RecordsOffset != BONDDB_RECORDS_OFFSET) {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    capacity = header->Capacity;
+    if (capacity < BONDDB_MIN_CAPACITY || capacity > BONDDB_MAX_CAPACITY ||
+        (capacity & (capacity - 1)) != 0 || ImageSize < BondDbImageSize(capacity)) {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    Db->Image = (PUCHAR)Image;
+    Db->ImageSize = ImageSize;
+    Db->Records = (PBONDDB_RECORD)(Db->Image + BONDDB_RECORDS_OFFSET);
+    Db->Mask = capacity - 1;
+
+    // A torn write-ahead record means its update never started on the table
+    wal = (const BONDDB_WAL*)(Db->Image + BONDDB_WAL_OFFSET);
+    if (wal->Magic == BONDDB_WAL_MAGIC &&
+        wal->Crc == BondDbCrc32(wal, FIELD_OFFSET(BONDDB_WAL, Crc)) &&
+        wal->Capacity == capacity && wal->Slot < capacity) {
+        PBONDDB_RECORD target = &Db->Records[wal->Slot];
+
+        if (!BondDbRecordValid(target) || target->Sequence < wal->Record.Sequence) {
+            *target = wal->Record;
+            Db->Replayed = TRUE;
+        }
+        Db->Sequence = wal->Record.Sequence;
+    }
+
+    for (i = 0; i < capacity; i++) {
+        PBONDDB_RECORD record = &Db->Records[i];
+
+        if (record->State == BONDDB_SLOT_FREE && record->Crc == 0) {
+            continue;
+        }
+
+        if (!BondDbRecordValid(record) ||
+            (record->State != BONDDB_SLOT_USED && record->State != BONDDB_SLOT_DELETED)) {
+            RtlSecureZeroMemory(record, sizeof(*record));
+            record->State = BONDDB_SLOT_DELETED;
+            record->Crc = BondDbCrc32(record, FIELD_OFFSET(BONDDB_RECORD, Crc));
+            Db->CorruptRecords++;
+        }
+
+        if (record->State == BONDDB_SLOT_USED) {
+            Db->Count++;
+        } else {
+            Db->Deleted++;
+        }
+        Db->Sequence = max(Db->Sequence, record->Sequence);
+    }
+
+    // Probes end at a free slot; a table without one is not ours
+    if (Db->Count + Db->Deleted == capacity) {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Finds a bond. Callable at any IRQL the image is resident at.
+
+Return Value:
+    The record in the image, or NULL
+--*/
+const BONDDB_RECORD*
+BondDbLookup(
+    _In_ const BONDDB* Db,
+    _In_ BTH_ADDR IdentityAddress
+)
+{
+    ULONG slot = BondDbSlot(Db, IdentityAddress);
+
+    for (;;) {
+        const BONDDB_RECORD* record = &Db->Records[slot];
+
+        if (record->State == BONDDB_SLOT_FREE) {
+            return NULL;
+        }
+        if (record->State == BONDDB_SLOT_USED && record->IdentityAddress == IdentityAddress) {
+            return record;
+        }
+        slot = (slot + 1) & Db->Mask;
+    }
+}
+
+/*++
+Routine Description:
+    Walks the bonds in table order. Start with *Cursor = 0.
+
+Return Value:
+    The next bond, or NULL at the end
+--*/
+const BONDDB_RECORD*
+BondDbEnumerate(
+    _In_ const BONDDB* Db,
+    _Inout_ PULONG Cursor
+)
+{
+    while (*Cursor <= Db->Mask) {
+        const BONDDB_RECORD* record = &Db->Records[(*Cursor)++];
+
+        if (record->State == BONDDB_SLOT_USED) {
+            return record;
+        }
+    }
+
+    return NULL;
+}
+
+/*++
+Routine Description:
+    Prepares an update as a write-ahead record without touching the
+    table. The caller makes Wal durable at BONDDB_WAL_OFFSET, then writes
+    Wal->Record to its slot, then calls BondDbCommit.
+
+Arguments:
+    Db - Database
+
+    IdentityAddress - Bond to add, replace or remove
+
+    Record - Keys and flags to store; NULL removes the bond. Its address,
+        state, sequence and CRC fields are ignored.
+
+    Wal - Receives the write-ahead record
+
+Return Value:
+    STATUS_NOT_FOUND when removing a bond that is not there;
+    STATUS_INSUFFICIENT_RESOURCES when an insert needs a rebuild first
+--*/
+NTSTATUS
+BondDbStage(
+    _In_ const BONDDB* Db,
+    _In_ BTH_ADDR IdentityAddress,
+    _In_opt_ const BONDDB_RECORD* Record,
+    _Out_ PBONDDB_WAL Wal
+)
+{
+    ULONG slot = BondDbSlot(Db, IdentityAddress);
+    ULONG tombstone = MAXULONG;
+    PBONDDB_RECORD staged = &Wal->Record;
+
+    for (;;) {
+        const BONDDB_RECORD* record = &Db->Records[slot];
+
+        if (record->State == BONDDB_SLOT_FREE) {
+            break;
+        }
+        if (record->State == BONDDB_SLOT_USED && record->IdentityAddress == IdentityAddress) {
+            tombstone = MAXULONG;
+            break;
+        }
+        if (record->State == BONDDB_SLOT_DELETED && tombstone == MAXULONG) {
+            tombstone = slot;
+        }
+        slot = (slot + 1) & Db->Mask;
+    }
+
+    if (Db->Records[slot].State == BONDDB_SLOT_FREE) {
+        if (Record == NULL) {
+            return STATUS_NOT_FOUND;
+        }
+        if (tombstone != MAXULONG) {
+            slot = tombstone;
+        } else if (BondDbPastLoad(Db->Count + Db->Deleted + 1, Db->Mask + 1)) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    RtlZeroMemory(Wal, sizeof(*Wal));
+    Wal->Magic = BONDDB_WAL_MAGIC;
+    Wal->Slot = slot;
+    Wal->Capacity = Db->Mask + 1;
+
+    if (Record != NULL) {
+        *staged = *Record;
+        RtlZeroMemory(staged->Reserved, sizeof(staged->Reserved));
+        staged->IdentityAddress = IdentityAddress;
+        staged->State = BONDDB_SLOT_USED;
+    } else {
+        staged->State = BONDDB_SLOT_DELETED;
+    }
+    staged->Sequence = Db->Sequence + 1;
+    staged->Crc = BondDbCrc32(staged, FIELD_OFFSET(BONDDB_RECORD, Crc));
+
+    Wal->Crc = BondDbCrc32(Wal, FIELD_OFFSET(BONDDB_WAL, Crc));
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Applies a staged update to the image once it is durable on disk
+--*/
+VOID
+BondDbCommit(
+    _Inout_ PBONDDB Db,
+    _In_ const BONDDB_WAL* Wal
+)
+{
+    PBONDDB_RECORD record = &Db->Records[Wal->Slot];
+
+    if (record->State == BONDDB_SLOT_USED) {
+        Db->Count--;
+    } else if (record->State == BONDDB_SLOT_DELETED) {
+        Db->Deleted--;
+    }
+
+    RtlSecureZeroMemory(record, sizeof(*record));
+    *record = Wal->Record;
+
+    if (record->State == BONDDB_SLOT_USED) {
+        Db->Count++;
+    } else {
+        Db->Deleted++;
+    }
+
+    Db->Sequence = record->Sequence;
+    RtlCopyMemory(Db->Image + BONDDB_WAL_OFFSET, Wal, sizeof(*Wal));
+}
+
+/*++
+Routine Description:
+    Chooses the table size for a rebuild: the smallest that leaves the
+    bonds, plus one, at most half the load limit
+
+Return Value:
+    Slots, or 0 when BONDDB_MAX_CAPACITY is not enough
+--*/
+ULONG
+BondDbRebuildCapacity(
+    _In_ const BONDDB* Db
+)
+{
+    ULONG capacity = BONDDB_MIN_CAPACITY;
+
+    while (BondDbPastLoad(2 * (Db->Count + 1), capacity)) {
+        if (capacity == BONDDB_MAX_CAPACITY) {
+            return 0;
+        }
+        capacity *= 2;
+    }
+
+    return capacity;
+}
+
+/*++
+Routine Description:
+    Copies the bonds into a freshly formatted image, dropping tombstones.
+    Records keep their sequence numbers.
+
+Arguments:
+    From - Current database
+
+    To - Receives the database over Image
+
+    Image - BondDbImageSize(Capacity) bytes
+
+    Capacity - From BondDbRebuildCapacity
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+BondDbRebuild(
+    _In_ const BONDDB* From,
+    _Out_ PBONDDB To,
+    _Out_writes_bytes_(BondDbImageSize(Capacity)) PVOID Image,
+    _In_ ULONG Capacity
+)
+{
+    const BONDDB_RECORD* record;
+    ULONG cursor = 0;
+    NTSTATUS status;
+
+    BondDbFormat(Image, Capacity);
+    status = BondDbAttach(To, Image, BondDbImageSize(Capacity));
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    while ((record = BondDbEnumerate(From, &cursor)) != NULL) {
+        ULONG slot = BondDbSlot(To, record->IdentityAddress);
+
+        if (BondDbPastLoad(To->Count + 1, Capacity)) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        while (To->Records[slot].State != BONDDB_SLOT_FREE) {
+            slot = (slot + 1) & To->Mask;
+        }
+        To->Records[slot] = *record;
+        To->Count++;
+    }
+
+    To->Sequence = From->Sequence;
+    return STATUS_SUCCESS;
+}
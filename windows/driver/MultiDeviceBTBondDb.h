@@ -0,0 +1,159 @@
+/*++
+
+Module Name:
+    MultiDeviceBTBondDb.h
+
+Abstract:
+    On-disk bond database: link keys, LTKs and IRKs of bonded devices,
+    keyed by identity address. The file is its own in-memory form: a
+    header, one write-ahead record and an open-addressed table of
+    fixed-size records. Loading reads or maps the file and checks it;
+    nothing is parsed or copied into other structures, and a lookup is
+    a hash and a short probe.
+
+    Every header and record carries a CRC-32. An update first writes its
+    record image to the write-ahead slot, then to its table slot. If the
+    second write is torn or lost, the next load replays the write-ahead
+    record.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    does the file I/O and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTBONDDB_H_
+#define _MULTIDEVICEBTBONDDB_H_
+
+#define BONDDB_MAGIC                0x4244424D  // "MBDB"
+#define BONDDB_WAL_MAGIC            0x4C41574D  // "MWAL"
+#define BONDDB_VERSION              1
+#define BONDDB_WAL_OFFSET           512         // Own sector, apart from the header
+#define BONDDB_RECORDS_OFFSET       4096        // Page-aligned for mapping
+#define BONDDB_MIN_CAPACITY         64
+#define BONDDB_MAX_CAPACITY         (1UL << 20)
+#define BONDDB_LOAD_PERCENT         75          // Used and deleted slots, before a rebuild
+#define BONDDB_KEY_BYTES            16
+
+// BONDDB_RECORD.State
+#define BONDDB_SLOT_FREE            0
+#define BONDDB_SLOT_USED            1
+#define BONDDB_SLOT_DELETED         2           // Tombstone; probes continue past it
+
+// BONDDB_RECORD.Keys
+#define BONDDB_KEY_LINK             0x01        // BR/EDR link key
+#define BONDDB_KEY_LTK              0x02
+#define BONDDB_KEY_IRK              0x04
+
+// BONDDB_RECORD.Security
+#define BONDDB_SECURITY_MITM        0x01        // Authenticated pairing
+#define BONDDB_SECURITY_SC          0x02        // Secure Connections
+
+typedef struct _BONDDB_HEADER {
+    ULONG Magic;
+    USHORT Version;
+    USHORT RecordSize;
+    ULONG Capacity;             // Table slots; a power of two
+    ULONG WalOffset;
+    ULONG RecordsOffset;
+    ULONG Reserved[10];
+    ULONG Crc;                  // Over the bytes before it
+} BONDDB_HEADER, *PBONDDB_HEADER;
+
+typedef struct _BONDDB_RECORD {
+    BTH_ADDR IdentityAddress;
+    ULONG64 Sequence;           // Update that last wrote the slot
+    UCHAR State;                // BONDDB_SLOT_*
+    UCHAR AddressType;          // Identity address type, as in HCI
+    UCHAR Keys;                 // BONDDB_KEY_*
+    UCHAR LinkKeyType;
+    UCHAR LtkKeySize;
+    UCHAR Security;             // BONDDB_SECURITY_*
+    USHORT Ediv;
+    ULONG64 Rand;
+    UCHAR LinkKey[BONDDB_KEY_BYTES];
+    UCHAR Ltk[BONDDB_KEY_BYTES];
+    UCHAR Irk[BONDDB_KEY_BYTES];    // Least significant octet first
+    UCHAR Reserved[12];
+    ULONG Crc;                  // Over the bytes before it
+} BONDDB_RECORD, *PBONDDB_RECORD;
+
+typedef struct _BONDDB_WAL {
+    ULONG Magic;
+    ULONG Slot;
+    ULONG Capacity;             // Table the slot belongs to
+    ULONG Reserved;
+    BONDDB_RECORD Record;
+    UCHAR Padding[12];
+    ULONG Crc;                  // Over the bytes before it
+} BONDDB_WAL, *PBONDDB_WAL;
+
+C_ASSERT(sizeof(BONDDB_HEADER) == 64);
+C_ASSERT(sizeof(BONDDB_RECORD) == 96);
+C_ASSERT(sizeof(BONDDB_WAL) == 128);
+
+typedef struct _BONDDB {
+    PUCHAR Image;               // Whole file
+    SIZE_T ImageSize;
+    PBONDDB_RECORD Records;
+    ULONG Mask;                 // Capacity - 1
+    ULONG Count;                // Used slots
+    ULONG Deleted;              // Tombstones
+    ULONG64 Sequence;           // Last committed update
+    ULONG CorruptRecords;       // Found at attach; left as tombstones
+    BOOLEAN Replayed;           // Attach applied the write-ahead record
+} BONDDB, *PBONDDB;
+
+ULONG BondDbCrc32(
+    _In_reads_bytes_(Length) const VOID* Data,
+    _In_ SIZE_T Length
+);
+
+SIZE_T BondDbImageSize(
+    _In_ ULONG Capacity
+);
+
+VOID BondDbFormat(
+    _Out_writes_bytes_(BondDbImageSize(Capacity)) PVOID Image,
+    _In_ ULONG Capacity
+);
+
+NTSTATUS BondDbAttach(
+    _Out_ PBONDDB Db,
+    _Inout_updates_bytes_(ImageSize) PVOID Image,
+    _In_ SIZE_T ImageSize
+);
+
+const BONDDB_RECORD* BondDbLookup(
+    _In_ const BONDDB* Db,
+    _In_ BTH_ADDR IdentityAddress
+);
+
+const BONDDB_RECORD* BondDbEnumerate(
+    _In_ const BONDDB* Db,
+    _Inout_ PULONG Cursor
+);
+
+NTSTATUS BondDbStage(
+    _In_ const BONDDB* Db,
+    _In_ BTH_ADDR IdentityAddress,
+    _In_opt_ const BONDDB_RECORD* Record,
+    _Out_ PBONDDB_WAL Wal
+);
+
+VOID BondDbCommit(
+    _Inout_ PBONDDB Db,
+    _In_ const BONDDB_WAL* Wal
+);
+
+ULONG BondDbRebuildCapacity(
+    _In_ const BONDDB* Db
+);
+
+NTSTATUS BondDbRebuild(
+    _In_ const BONDDB* From,
+    _Out_ PBONDDB To,
+    _Out_writes_bytes_(BondDbImageSize(Capacity)) PVOID Image,
+    _In_ ULONG Capacity
+);
+
+#endif // _MULTIDEVICEBTBONDDB_H_
@@ -0,0 +1,735 @@
+/*++
+
+Module Name:
+    MultiDeviceBTBulk.c
+
+Abstract:
+    Bulk file transfer engine.
+
+    File transfers used to arrive as ordinary writes, one user buffer at
+    a time. Each buffer was copied, cut into PDUs and drained before the
+    next write was issued. So the link went idle between buffers and
+    usually lost the rest of a connection event, and each buffer's tail
+    went out as a short PDU.
+
+    A transfer here is one pended METHOD_IN_DIRECT request whose second
+    buffer is a mapped view of the file. The region stays locked while
+    the request is pending, and PDUs point straight into it. Every PDU
+    carries a full MTU except the region's last. Up to WindowPdus are
+    kept in flight, so the controller always has the next PDU queued.
+
+    The engine runs on a below-normal thread and never takes more than
+    its share of the radio: MultiDeviceBTBulkPacer.c sets its rate from
+    the adapter traffic that is not its own and caps what it leaves
+    unacknowledged. So real-time packets are not queued behind a file.
+
+    Progress is counted in acknowledged bytes. A cancelled or
+    interrupted transfer completes with the bytes acknowledged so far,
+    and the caller resumes from that offset.
+
+    No L2CAP transmit path terminates in this driver yet. Until one
+    installs Sink, a PDU counts as delivered once its airtime is
+    accounted. The pacing, and so the transfer's duration, is still
+    that of the link.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+// Below normal: every other driver thread and user-mode I/O comes first
+#define BULK_THREAD_PRIORITY        (LOW_PRIORITY + 4)
+
+static KSTART_ROUTINE BulkEngineThread;
+static EVT_WDF_REQUEST_CANCEL BulkEvtRequestCancel;
+
+/*++
+Routine Description:
+    Initializes the device's bulk engine; the thread starts with the
+    first transfer
+--*/
+VOID
+BulkInitialize(
+    _Out_ PBULK_ENGINE Engine,
+    _In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+    LARGE_INTEGER frequency;
+
+    RtlZeroMemory(Engine, sizeof(*Engine));
+    ExInitializePushLock(&Engine->StartLock);
+    KeInitializeSpinLock(&Engine->Lock);
+    KeInitializeEvent(&Engine->WakeEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&Engine->StopEvent, NotificationEvent, FALSE);
+
+    KeQueryPerformanceCounter(&frequency);
+    BulkPacerInitialize(&Engine->Pacer, ADAPTER_LINK_CAPACITY_BPS / 8, frequency.QuadPart);
+    Engine->DeviceContext = DeviceContext;
+}
+
+/*++
+Routine Description:
+    Refills the pacer's tokens from the adapter's traffic and the bytes
+    acknowledged, and publishes the pacing in the statistics
+
+Arguments:
+    Engine - Bulk engine
+    Now - Current performance counter
+
+Return Value:
+    None
+--*/
+static VOID
+BulkRefill(
+    _Inout_ PBULK_ENGINE Engine,
+    _In_ LONGLONG Now
+)
+{
+    PBULK_PACER pacer = &Engine->Pacer;
+    ULONG64 acked;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Engine->Lock, &irql);
+    acked = Engine->Stats.BytesAcked;
+    KeReleaseSpinLock(&Engine->Lock, irql);
+
+    BulkPacerRefill(pacer, Now, Engine->DeviceContext->Load.TotalBytes, acked);
+
+    KeAcquireSpinLock(&Engine->Lock, &irql);
+    Engine->Stats.QueueLimitBytes = pacer->QueueLimitBytes;
+    Engine->Stats.RateKbps = (ULONG)((ULONG64)pacer->RateBytesPerSecond * 8 / 1000);
+    Engine->Stats.OtherKbps = (ULONG)((ULONG64)pacer->OtherBytesPerSecond * 8 / 1000);
+    KeReleaseSpinLock(&Engine->Lock, irql);
+}
+
+/*++
+Routine Description:
+    Hands the transfer's next burst of PDUs, as the pacer plans it, to
+    the transmit path
+
+Arguments:
+    Engine - Bulk engine
+    TransferId - Transfer's slot
+    Transfer - Transfer being pumped
+
+Return Value:
+    Number of PDUs sent
+--*/
+static ULONG
+BulkPump(
+    _Inout_ PBULK_ENGINE Engine,
+    _In_ ULONG TransferId,
+    _Inout_ PBULK_TRANSFER Transfer
+)
+{
+    BULK_PDU pdus[BULK_BURST_PDUS];
+    USHORT lengths[BULK_BURST_PDUS];
+    ULONGLONG offset = Transfer->NextOffset;
+    ULONG count, accepted, i, inFlight;
+    ULONG64 queued;
+    LONG64 cost = 0;
+    ULONG sent = 0;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Engine->Lock, &irql);
+    inFlight = Transfer->InFlight;
+    queued = Engine->Stats.BytesSent - Engine->Stats.BytesAcked;
+    KeReleaseSpinLock(&Engine->Lock, irql);
+
+    count = BulkPacerPlan(&Engine->Pacer, Transfer->Params.Mtu, Transfer->Length - offset,
+        Transfer->Params.WindowPdus - inFlight, queued, lengths);
+    if (count == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        pdus[i].DeviceAddress = Transfer->Params.DeviceAddress;
+        pdus[i].TransferId = TransferId;
+        pdus[i].Cid = Transfer->Params.Cid;
+        pdus[i].Length = lengths[i];
+        pdus[i].FileOffset = Transfer->Params.RegionOffset + offset;
+        pdus[i].Payload = Transfer->Data + offset;
+        offset += lengths[i];
+    }
+
+    // Reserve the window before the hook runs; it may complete PDUs
+    // from another thread before it returns
+    if (Engine->Sink != NULL) {
+        KeAcquireSpinLock(&Engine->Lock, &irql);
+        for (i = 0; i < count; i++) {
+            Transfer->PduLength[(Transfer->PduHead + Transfer->InFlight) & (BULK_WINDOW_MAX - 1)] = pdus[i].Length;
+            Transfer->InFlight++;
+        }
+        KeReleaseSpinLock(&Engine->Lock, irql);
+
+        accepted = Engine->Sink(Engine->SinkContext, pdus, count);
+        accepted = min(accepted, count);
+    } else {
+        accepted = count;
+    }
+
+    for (i = 0; i < accepted; i++) {
+        sent += pdus[i].Length;
+        cost += pdus[i].Length + BULK_L2CAP_HEADER_BYTES;
+    }
+
+    Transfer->NextOffset += sent;
+    BulkPacerCharge(&Engine->Pacer, cost);
+    AdapterAccountAirtime(Engine->DeviceContext, (size_t)cost);
+
+    KeAcquireSpinLock(&Engine->Lock, &irql);
+
+    if (Engine->Sink != NULL) {
+        // Give back what the hook turned away; only accepted PDUs complete
+        Transfer->InFlight -= count - accepted;
+    } else {
+        Transfer->AckedOffset += sent;
+        Engine->Stats.BytesAcked += sent;
+    }
+
+    Engine->Stats.BytesSent += sent;
+    Engine->Stats.PdusSent += accepted;
+
+    KeReleaseSpinLock(&Engine->Lock, irql);
+
+    return accepted;
+}
+
+/*++
+Routine Description:
+    Reports PDUs the transmit path has finished with, oldest first, and
+    returns their window credits. An undelivered PDU ends the transfer:
+    nothing after it counts as acknowledged, since the offset must stay
+    contiguous for a resume.
+
+Arguments:
+    Engine - Bulk engine
+    TransferId - BULK_PDU.TransferId of the PDUs
+    Count - PDUs completed
+    Delivered - FALSE if the PDUs were dropped, e.g. their channel closed
+
+Return Value:
+    None
+--*/
+VOID
+BulkCompletePdus(
+    _Inout_ PBULK_ENGINE Engine,
+    _In_ ULONG TransferId,
+    _In_ ULONG Count,
+    _In_ BOOLEAN Delivered
+)
+{
+    PBULK_TRANSFER transfer;
+    KIRQL irql;
+
+    if (TransferId >= BULK_MAX_TRANSFERS) {
+        return;
+    }
+
+    KeAcquireSpinLock(&Engine->Lock, &irql);
+
+    transfer = Engine->Transfers[TransferId];
+    if (transfer != NULL) {
+        Count = min(Count, transfer->InFlight);
+
+        if (!Delivered) {
+            transfer->LinkFailed = TRUE;
+            transfer->CancelRequested = TRUE;
+        }
+
+        while (Count-- > 0) {
+            ULONG length = transfer->PduLength[transfer->PduHead];
+
+            if (!transfer->LinkFailed) {
+                transfer->AckedOffset += length;
+            }
+            Engine->Stats.BytesAcked += length;
+            transfer->PduHead = (transfer->PduHead + 1) & (BULK_WINDOW_MAX - 1);
+            transfer->InFlight--;
+        }
+    }
+
+    KeReleaseSpinLock(&Engine->Lock, irql);
+
+    KeSetEvent(&Engine->WakeEvent, IO_NO_INCREMENT, FALSE);
+}
+
+/*++
+Routine Description:
+    Completes a transfer that is fully acknowledged, or cancelled with
+    nothing left in flight. If the cancel callback won the race to the
+    request, completion waits until that callback has run.
+
+Arguments:
+    Engine - Bulk engine
+    TransferId - Transfer's slot
+    Transfer - Transfer to check
+
+Return Value:
+    TRUE if the transfer was completed and freed
+--*/
+static BOOLEAN
+BulkTryFinish(
+    _Inout_ PBULK_ENGINE Engine,
+    _In_ ULONG TransferId,
+    _Inout_ PBULK_TRANSFER Transfer
+)
+{
+    BOOLEAN done;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Engine->Lock, &irql);
+    done = (Transfer->AckedOffset == Transfer->Length);
+    if ((!done && !Transfer->CancelRequested) || Transfer->InFlight != 0) {
+        KeReleaseSpinLock(&Engine->Lock, irql);
+        return FALSE;
+    }
+    KeReleaseSpinLock(&Engine->Lock, irql);
+
+    if (!Transfer->Unmarked) {
+        Transfer->Unmarked = TRUE;
+        Transfer->CancelOwed = (WdfRequestUnmarkCancelable(Transfer->Request) == STATUS_CANCELLED);
+    }
+
+    KeAcquireSpinLock(&Engine->Lock, &irql);
+
+    if (Transfer->CancelOwed && !Transfer->CancelRequested) {
+        KeReleaseSpinLock(&Engine->Lock, irql);
+        return FALSE;
+    }
+
+    Engine->Transfers[TransferId] = NULL;
+    Engine->Stats.ActiveTransfers--;
+    if (done) {
+        Engine->Stats.TransfersCompleted++;
+    } else {
+        Engine->Stats.TransfersCancelled++;
+    }
+
+    KeReleaseSpinLock(&Engine->Lock, irql);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Bulk transfer to %llx CID 0x%x %s at offset %llu\n",
+        Transfer->Params.DeviceAddress, Transfer->Params.Cid, done ? "complete" : "cancelled",
+        Transfer->Params.RegionOffset + Transfer->AckedOffset));
+
+    WdfRequestCompleteWithInformation(Transfer->Request,
+        done ? STATUS_SUCCESS : (Transfer->LinkFailed ? STATUS_CONNECTION_ABORTED : STATUS_CANCELLED),
+        (ULONG_PTR)(Transfer->AckedOffset - Transfer->StartOffset));
+
+    ExFreePoolWithTag(Transfer, BULK_POOL_TAG);
+    return TRUE;
+}
+
+/*++
+Routine Description:
+    One engine pass: finishes what is done, then sends bursts round-robin
+    across transfers while tokens and windows allow
+
+Return Value:
+    Relative wait in 100 ns units before the next pass, or 0 to wait
+    only for an event
+--*/
+static LONGLONG
+BulkService(
+    _Inout_ PBULK_ENGINE Engine
+)
+{
+    PBULK_TRANSFER transfers[BULK_MAX_TRANSFERS];
+    BOOLEAN pending = FALSE, progress;
+    KIRQL irql;
+    ULONG i;
+
+    BulkRefill(Engine, KeQueryPerformanceCounter(NULL).QuadPart);
+
+    // Only this thread removes transfers, so the snapshot stays valid
+    KeAcquireSpinLock(&Engine->Lock, &irql);
+    RtlCopyMemory(transfers, Engine->Transfers, sizeof(transfers));
+    KeReleaseSpinLock(&Engine->Lock, irql);
+
+    do {
+        progress = FALSE;
+
+        for (i = 0; i < BULK_MAX_TRANSFERS && Engine->Pacer.Tokens > 0; i++) {
+            ULONG id = (Engine->NextTransfer + i) % BULK_MAX_TRANSFERS;
+            PBULK_TRANSFER transfer = transfers[id];
+
+            if (transfer == NULL || BulkTryFinish(Engine, id, transfer)) {
+                transfers[id] = NULL;
+                continue;
+            }
+
+            if (!transfer->CancelRequested && BulkPump(Engine, id, transfer) != 0) {
+                progress = TRUE;
+            }
+        }
+
+        Engine->NextTransfer = (Engine->NextTransfer + 1) % BULK_MAX_TRANSFERS;
+    } while (progress);
+
+    for (i = 0; i < BULK_MAX_TRANSFERS; i++) {
+        if (transfers[i] != NULL && !BulkTryFinish(Engine, i, transfers[i])) {
+            pending = TRUE;
+        }
+    }
+
+    if (!pending) {
+        return 0;
+    }
+
+    if (Engine->Pacer.Tokens <= 0) {
+        // Sleep off the debt; the wait rounds up to the clock tick
+        return BulkPacerWait(&Engine->Pacer);
+    }
+
+    // Window full: credits or a cancel will wake us; poll once a slice
+    // in case the hook completes without signalling
+    return (LONGLONG)BULK_SLICE_MS * 10000;
+}
+
+/*++
+Routine Description:
+    Engine thread. Runs passes until stopped. On the way out it
+    cancels every transfer and completes each once its in-flight PDUs
+    drain; the transmit path completes those on its own teardown.
+
+Arguments:
+    StartContext - The engine
+
+Return Value:
+    None
+--*/
+static VOID
+BulkEngineThread(
+    _In_ PVOID StartContext
+)
+{
+    PBULK_ENGINE engine = (PBULK_ENGINE)StartContext;
+    PVOID waitObjects[2];
+    LARGE_INTEGER timeout;
+    LARGE_INTEGER poll;
+    NTSTATUS status;
+    BOOLEAN remaining;
+    KIRQL irql;
+    ULONG i;
+
+    KeSetPriorityThread(KeGetCurrentThread(), BULK_THREAD_PRIORITY);
+
+    waitObjects[0] = &engine->WakeEvent;
+    waitObjects[1] = &engine->StopEvent;
+
+    for (;;) {
+        LONGLONG waitHns = BulkService(engine);
+
+        timeout.QuadPart = -waitHns;
+        status = KeWaitForMultipleObjects(2, waitObjects, WaitAny,
+            Executive, KernelMode, FALSE, (waitHns != 0) ? &timeout : NULL, NULL);
+
+        if (status == STATUS_WAIT_1 || engine->Stopping) {
+            break;
+        }
+    }
+
+    KeAcquireSpinLock(&engine->Lock, &irql);
+    for (i = 0; i < BULK_MAX_TRANSFERS; i++) {
+        if (engine->Transfers[i] != NULL) {
+            engine->Transfers[i]->CancelRequested = TRUE;
+        }
+    }
+    KeReleaseSpinLock(&engine->Lock, irql);
+
+    poll.QuadPart = -10000;
+    do {
+        remaining = FALSE;
+        for (i = 0; i < BULK_MAX_TRANSFERS; i++) {
+            if (engine->Transfers[i] != NULL && !BulkTryFinish(engine, i, engine->Transfers[i])) {
+                remaining = TRUE;
+            }
+        }
+        if (remaining) {
+            KeDelayExecutionThread(KernelMode, FALSE, &poll);
+        }
+    } while (remaining);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/*++
+Routine Description:
+    Creates the engine thread. Caller holds the start lock.
+--*/
+static NTSTATUS
+BulkEngineStart(
+    _Inout_ PBULK_ENGINE Engine
+)
+{
+    NTSTATUS status;
+    HANDLE threadHandle;
+
+    // An earlier start lost its thread reference and told it to stop
+    if (Engine->Stopping) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL,
+        NULL, NULL, BulkEngineThread, Engine);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, *PsThreadType,
+        KernelMode, (PVOID*)&Engine->Thread, NULL);
+    ZwClose(threadHandle);
+
+    if (!NT_SUCCESS(status)) {
+        // No transfer exists yet; the thread sees the stop event on its
+        // first wait, and the engine lives in the device context
+        InterlockedExchange(&Engine->Stopping, 1);
+        KeSetEvent(&Engine->StopEvent, IO_NO_INCREMENT, FALSE);
+        Engine->Thread = NULL;
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Stops the engine thread, which first completes every transfer;
+    called from device cleanup
+--*/
+VOID
+BulkCleanup(
+    _Inout_ PBULK_ENGINE Engine
+)
+{
+    PAGED_CODE();
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Engine->StartLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    if (Engine->Thread != NULL) {
+        InterlockedExchange(&Engine->Stopping, 1);
+        KeSetEvent(&Engine->StopEvent, IO_NO_INCREMENT, FALSE);
+
+        KeWaitForSingleObject(Engine->Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(Engine->Thread);
+        Engine->Thread = NULL;
+    }
+
+    ExReleasePushLockExclusiveEx(&Engine->StartLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+/*++
+Routine Description:
+    Cancel callback for pended transfers. Only flags the transfer; the
+    engine thread completes it once its in-flight PDUs are back.
+--*/
+static VOID
+BulkEvtRequestCancel(
+    _In_ WDFREQUEST Request
+)
+{
+    PDEVICE_CONTEXT deviceContext = DeviceGetContext(WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request)));
+    PBULK_ENGINE engine = &deviceContext->Bulk;
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&engine->Lock, &irql);
+    for (i = 0; i < BULK_MAX_TRANSFERS; i++) {
+        if (engine->Transfers[i] != NULL && engine->Transfers[i]->Request == Request) {
+            engine->Transfers[i]->CancelRequested = TRUE;
+        }
+    }
+    KeReleaseSpinLock(&engine->Lock, irql);
+
+    KeSetEvent(&engine->WakeEvent, IO_NO_INCREMENT, FALSE);
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_BULK_TRANSFER: BULK_TRANSFER_REQUEST in the
+    input buffer, the mapped file region as the direct buffer. Returns
+    STATUS_PENDING once the engine owns the request.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    OutputBufferLength - Length of the file region
+    BytesReturned - Receives 0
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleBulkTransfer(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBULK_TRANSFER_REQUEST params;
+    PBULK_ENGINE engine = &DeviceContext->Bulk;
+    PBULK_TRANSFER transfer;
+    PMDL mdl;
+    PUCHAR data;
+    ULONGLONG length, start;
+    KIRQL irql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(BULK_TRANSFER_REQUEST), (PVOID*)&params, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRequestRetrieveOutputWdmMdl(Request, &mdl);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    data = (PUCHAR)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (data == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    length = MmGetMdlByteCount(mdl);
+
+    if (params->Mtu < BULK_MTU_MIN || params->WindowPdus > BULK_WINDOW_MAX ||
+        params->ResumeOffset < params->RegionOffset ||
+        params->ResumeOffset - params->RegionOffset > length) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    start = params->ResumeOffset - params->RegionOffset;
+    if (start == length) {
+        return STATUS_SUCCESS;
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&engine->StartLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    status = (engine->Thread == NULL) ? BulkEngineStart(engine) : STATUS_SUCCESS;
+    ExReleasePushLockExclusiveEx(&engine->StartLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    transfer = (PBULK_TRANSFER)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        sizeof(BULK_TRANSFER), BULK_POOL_TAG);
+    if (transfer == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    transfer->Request = Request;
+    transfer->Params = *params;
+    transfer->Params.WindowPdus = (params->WindowPdus == 0) ? BULK_DEFAULT_WINDOW : params->WindowPdus;
+    transfer->Data = data;
+    transfer->Length = length;
+    transfer->StartOffset = start;
+    transfer->NextOffset = start;
+    transfer->AckedOffset = start;
+
+    KeAcquireSpinLock(&engine->Lock, &irql);
+
+    for (i = 0; i < BULK_MAX_TRANSFERS; i++) {
+        if (engine->Transfers[i] == NULL) {
+            break;
+        }
+    }
+
+    if (i == BULK_MAX_TRANSFERS) {
+        status = STATUS_DEVICE_BUSY;
+    } else {
+        // Under the lock, so the cancel callback finds the transfer
+        status = WdfRequestMarkCancelableEx(Request, BulkEvtRequestCancel);
+        if (NT_SUCCESS(status)) {
+            engine->Transfers[i] = transfer;
+            engine->Stats.ActiveTransfers++;
+        }
+    }
+
+    KeReleaseSpinLock(&engine->Lock, irql);
+
+    if (!NT_SUCCESS(status)) {
+        ExFreePoolWithTag(transfer, BULK_POOL_TAG);
+        return status;
+    }
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Bulk transfer to %llx CID 0x%x: %llu bytes from offset %llu, MTU %u, window %u\n",
+        transfer->Params.DeviceAddress, transfer->Params.Cid, length - start,
+        transfer->Params.ResumeOffset, transfer->Params.Mtu, transfer->Params.WindowPdus));
+
+    KeSetEvent(&engine->WakeEvent, IO_NO_INCREMENT, FALSE);
+    return STATUS_PENDING;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_BULK_STATS
+--*/
+NTSTATUS
+HandleGetBulkStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBULK_STATS stats;
+    PBULK_ENGINE engine = &DeviceContext->Bulk;
+    KIRQL irql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(BULK_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&engine->Lock, &irql);
+
+    *stats = engine->Stats;
+    for (i = 0; i < BULK_MAX_TRANSFERS; i++) {
+        PBULK_TRANSFER transfer = engine->Transfers[i];
+
+        if (transfer != NULL) {
+            stats->Transfers[i].DeviceAddress = transfer->Params.DeviceAddress;
+            stats->Transfers[i].Cid = transfer->Params.Cid;
+            stats->Transfers[i].Mtu = transfer->Params.Mtu;
+            stats->Transfers[i].InFlight = transfer->InFlight;
+            stats->Transfers[i].AckedOffset = transfer->Params.RegionOffset + transfer->AckedOffset;
+            stats->Transfers[i].EndOffset = transfer->Params.RegionOffset + transfer->Length;
+        }
+    }
+
+    KeReleaseSpinLock(&engine->Lock, irql);
+
+    *BytesReturned = sizeof(BULK_STATS);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/*++
+
+Module Name:
+    MultiDeviceBTBulk.h
+
+Abstract:
+    Bulk file transfer engine. A transfer streams a user-mapped file
+    region to one L2CAP channel as MTU-packed PDUs. It keeps a window of
+    PDUs in flight and paces itself into the airtime that real-time
+    traffic leaves free. Progress is tracked by acknowledged file offset,
+    so an interrupted transfer resumes where it stopped. The pacing
+    itself is the portable MultiDeviceBTBulkPacer.h.
+
+--*/
+
+#ifndef _MULTIDEVICEBTBULK_H_
+#define _MULTIDEVICEBTBULK_H_
+
+#include "MultiDeviceBTBulkPacer.h"
+
+#define BULK_MAX_TRANSFERS          4       // Concurrent, per device
+#define BULK_MTU_MIN                23      // L2CAP minimum for LE
+#define BULK_DEFAULT_WINDOW         32      // PDUs in flight
+#define BULK_WINDOW_MAX             64      // Power of two
+#define BULK_POOL_TAG               'BDBM'
+
+// IOCTL_MULTI_BT_BULK_TRANSFER input. The IOCTL is METHOD_IN_DIRECT: its
+// second buffer is the mapped file region, locked for the transfer's
+// lifetime and read in place. The request stays pending until the
+// region is acknowledged or the request is cancelled. Either way it
+// completes with the bytes acknowledged past ResumeOffset, so the next
+// attempt resumes at ResumeOffset + Information.
+typedef struct _BULK_TRANSFER_REQUEST {
+    BTH_ADDR DeviceAddress;
+    USHORT Cid;                 // Destination L2CAP channel
+    USHORT Mtu;                 // PDU payload bytes, >= BULK_MTU_MIN
+    ULONG WindowPdus;           // PDUs in flight; 0 selects BULK_DEFAULT_WINDOW
+    ULONGLONG RegionOffset;     // File offset of the region's first byte
+    ULONGLONG ResumeOffset;     // File offset to start from, inside the region
+} BULK_TRANSFER_REQUEST, *PBULK_TRANSFER_REQUEST;
+
+// One PDU handed to the transmit hook. Payload points into the mapped
+// region; the hook owns it until it reports the PDU complete.
+typedef struct _BULK_PDU {
+    BTH_ADDR DeviceAddress;
+    ULONG TransferId;
+    USHORT Cid;
+    USHORT Length;              // Payload bytes
+    ULONGLONG FileOffset;
+    const UCHAR* Payload;
+} BULK_PDU, *PBULK_PDU;
+
+// Transmit hook, called on the engine thread. Returns how many of the
+// PDUs it queued; each is later reported with BulkCompletePdus, in order.
+typedef ULONG
+BULK_PDU_SINK(
+    _In_opt_ PVOID Context,
+    _In_reads_(Count) const BULK_PDU* Pdus,
+    _In_ ULONG Count
+);
+typedef BULK_PDU_SINK *PBULK_PDU_SINK;
+
+typedef struct _BULK_TRANSFER_PROGRESS {
+    BTH_ADDR DeviceAddress;
+    USHORT Cid;
+    USHORT Mtu;
+    ULONG InFlight;
+    ULONGLONG AckedOffset;      // File offset
+    ULONGLONG EndOffset;
+} BULK_TRANSFER_PROGRESS, *PBULK_TRANSFER_PROGRESS;
+
+// IOCTL_MULTI_BT_GET_BULK_STATS output
+typedef struct _BULK_STATS {
+    ULONG ActiveTransfers;
+    ULONG RateKbps;             // Current bulk pacing rate
+    ULONG OtherKbps;            // Non-bulk traffic seen in the last slice
+    ULONG TransfersCompleted;
+    ULONG TransfersCancelled;
+    ULONG QueueLimitBytes;      // Unacknowledged bytes allowed, from the delivery rate
+    ULONG64 BytesSent;          // Payload
+    ULONG64 BytesAcked;
+    ULONG64 PdusSent;
+    BULK_TRANSFER_PROGRESS Transfers[BULK_MAX_TRANSFERS];
+} BULK_STATS, *PBULK_STATS;
+
+typedef struct _BULK_TRANSFER {
+    WDFREQUEST Request;
+    BULK_TRANSFER_REQUEST Params;
+    const UCHAR* Data;          // System mapping of the region
+    ULONGLONG Length;           // Region bytes
+    ULONGLONG StartOffset;      // Region-relative, where this request began
+    ULONGLONG NextOffset;       // Region-relative, next PDU
+
+    // Under the engine lock
+    ULONGLONG AckedOffset;      // Region-relative
+    ULONG InFlight;
+    ULONG PduHead;              // Oldest in-flight PDU in PduLength
+    USHORT PduLength[BULK_WINDOW_MAX];
+    BOOLEAN CancelRequested;
+    BOOLEAN CancelOwed;         // Unmark lost to the cancel callback; wait for it
+    BOOLEAN Unmarked;
+    BOOLEAN LinkFailed;         // A PDU was dropped; AckedOffset is final
+} BULK_TRANSFER, *PBULK_TRANSFER;
+
+// One engine per device. Handlers insert transfers and the cancel and
+// completion paths flag them under Lock; only the engine thread
+// removes and completes them. The thread starts with the first transfer.
+typedef struct _BULK_ENGINE {
+    EX_PUSH_LOCK StartLock;     // Thread start and stop, at PASSIVE_LEVEL
+    KSPIN_LOCK Lock;
+    PBULK_TRANSFER Transfers[BULK_MAX_TRANSFERS];
+    struct _DEVICE_CONTEXT* DeviceContext;
+    PBULK_PDU_SINK Sink;        // NULL until a transmit path is attached: PDUs complete on accounting
+    PVOID SinkContext;
+    KEVENT WakeEvent;           // New transfer, credits returned, or cancel
+    KEVENT StopEvent;
+    PKTHREAD Thread;
+    volatile LONG Stopping;
+    BULK_PACER Pacer;           // Engine thread only
+    ULONG NextTransfer;         // Round-robin start, engine thread only
+
+    BULK_STATS Stats;           // Under Lock
+} BULK_ENGINE, *PBULK_ENGINE;
+
+VOID BulkInitialize(
+    _Out_ PBULK_ENGINE Engine,
+    _In_ struct _DEVICE_CONTEXT* DeviceContext
+);
+
+VOID BulkCleanup(
+    _Inout_ PBULK_ENGINE Engine
+);
+
+VOID BulkCompletePdus(
+    _Inout_ PBULK_ENGINE Engine,
+    _In_ ULONG TransferId,
+    _In_ ULONG Count,
+    _In_ BOOLEAN Delivered
+);
+
+#endif // _MULTIDEVICEBTBULK_H_
@@ -0,0 +1,187 @@
+/*++
+
+Module Name:
+    MultiDeviceBTBulkPacer.c
+
+Abstract:
+    Pacing of bulk file transfers.
+
+    Bulk never takes more than its share of the radio. Every slice the
+    pacer measures the traffic on the adapter that is not its own: audio
+    lanes, ISO, input, control. The next slice's rate is
+    BULK_TARGET_PERMILLE of the capacity that traffic leaves, with a
+    small floor. A token bucket holds bulk to that rate. The reserve is
+    a share of what is left, not of the whole link: taken off the top,
+    it grew with the real-time traffic it guards, and beside audio the
+    engine was no faster than plain 4 KB writes.
+
+    Unacknowledged data is also capped at BULK_QUEUE_SLICES slices of
+    the rate the link last delivered. That keeps the controller's
+    buffers shallow when the estimate runs ahead of the radio, so
+    real-time packets are not queued behind a file. One slice covers
+    more than a connection event; a deeper queue adds only delay.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTBulkPacer.h"
+
+VOID
+BulkPacerInitialize(
+    _Out_ PBULK_PACER Pacer,
+    _In_ ULONG CapacityBytesPerSecond,
+    _In_ LONGLONG FrequencyHz
+)
+{
+    RtlZeroMemory(Pacer, sizeof(*Pacer));
+    Pacer->FrequencyHz = FrequencyHz;
+    Pacer->CapacityBytesPerSecond = CapacityBytesPerSecond;
+    Pacer->QueueLimitBytes = BULK_QUEUE_FLOOR_BYTES;
+}
+
+/*++
+Routine Description:
+    Refills the token bucket. At each slice boundary it also recomputes
+    the rate from the adapter traffic that was not bulk's own, and the
+    queue limit from what the link delivered.
+
+Arguments:
+    Pacer - Bulk pacer
+    Now - Current time, in the pacer's ticks
+    TotalBytes - Bytes the adapter has carried, bulk's included
+    AckedBytes - Bulk payload bytes acknowledged
+
+Return Value:
+    None
+--*/
+VOID
+BulkPacerRefill(
+    _Inout_ PBULK_PACER Pacer,
+    _In_ LONGLONG Now,
+    _In_ LONG64 TotalBytes,
+    _In_ ULONG64 AckedBytes
+)
+{
+    LONGLONG sliceTicks = Pacer->FrequencyHz * BULK_SLICE_MS / 1000;
+    LONG64 capacity = Pacer->CapacityBytesPerSecond;
+    ULONG64 delivered;
+    LONG64 limit;
+
+    if (Pacer->SliceStart == 0) {
+        Pacer->SliceStart = Now;
+        Pacer->LastRefill = Now;
+        Pacer->SliceTotalBytes = TotalBytes;
+        Pacer->SliceOwnBytes = 0;
+        Pacer->SliceAckedBytes = AckedBytes;
+        Pacer->RateBytesPerSecond = (ULONG)(capacity * BULK_TARGET_PERMILLE / 1000);
+        Pacer->Tokens = (LONG64)Pacer->RateBytesPerSecond * BULK_SLICE_MS / 1000;
+        Pacer->QueueLimitBytes = BULK_QUEUE_FLOOR_BYTES;
+        return;
+    }
+
+    if (Now - Pacer->SliceStart >= sliceTicks) {
+        LONG64 other = (TotalBytes - Pacer->SliceTotalBytes) - Pacer->SliceOwnBytes;
+        LONG64 otherRate = (max(other, 0) * Pacer->FrequencyHz) / (Now - Pacer->SliceStart);
+        LONG64 rate = (capacity - otherRate) * BULK_TARGET_PERMILLE / 1000;
+
+        rate = max(rate, capacity * BULK_FLOOR_PERMILLE / 1000);
+        Pacer->RateBytesPerSecond = (ULONG)rate;
+        Pacer->OtherBytesPerSecond = (ULONG)otherRate;
+
+        // Keep no more unacknowledged than the link delivers in
+        // BULK_QUEUE_SLICES. If the rate above overshoots what the radio
+        // really has free, the excess waits here rather than in the
+        // controller, ahead of real-time packets.
+        delivered = ((AckedBytes - Pacer->SliceAckedBytes) * Pacer->FrequencyHz) /
+            (Now - Pacer->SliceStart);
+        Pacer->QueueLimitBytes = (ULONG)max(delivered * BULK_SLICE_MS * BULK_QUEUE_SLICES / 1000,
+            (ULONG64)BULK_QUEUE_FLOOR_BYTES);
+
+        Pacer->SliceStart = Now;
+        Pacer->SliceTotalBytes = TotalBytes;
+        Pacer->SliceOwnBytes = 0;
+        Pacer->SliceAckedBytes = AckedBytes;
+    }
+
+    limit = (LONG64)Pacer->RateBytesPerSecond * BULK_SLICE_MS * BULK_TOKEN_SLICES / 1000;
+    Pacer->Tokens += ((Now - Pacer->LastRefill) * Pacer->RateBytesPerSecond) / Pacer->FrequencyHz;
+    Pacer->Tokens = min(Pacer->Tokens, limit);
+    Pacer->LastRefill = Now;
+}
+
+/*++
+Routine Description:
+    Plans one transfer's next burst: full-MTU PDUs, bounded by the
+    window, the queue limit and the tokens. A PDU may overdraw the
+    tokens; the debt delays the next one.
+
+Arguments:
+    Pacer - Bulk pacer
+    Mtu - PDU payload bytes
+    Remaining - Bytes of the transfer not yet sent
+    WindowFree - PDUs the transfer may still put in flight
+    Queued - Bulk bytes sent and not yet acknowledged, every transfer's
+    Lengths - Receives each PDU's payload bytes
+
+Return Value:
+    Number of PDUs planned
+--*/
+ULONG
+BulkPacerPlan(
+    _In_ const BULK_PACER* Pacer,
+    _In_ ULONG Mtu,
+    _In_ ULONGLONG Remaining,
+    _In_ ULONG WindowFree,
+    _In_ ULONG64 Queued,
+    _Out_writes_to_(BULK_BURST_PDUS, return) PUSHORT Lengths
+)
+{
+    LONG64 tokens = Pacer->Tokens;
+    ULONG count = 0;
+
+    while (count < BULK_BURST_PDUS && count < WindowFree && Remaining > 0 &&
+           tokens > 0 && Queued < Pacer->QueueLimitBytes) {
+        USHORT length = (USHORT)min((ULONGLONG)Mtu, Remaining);
+
+        Lengths[count++] = length;
+        tokens -= length + BULK_L2CAP_HEADER_BYTES;
+        Queued += length;
+        Remaining -= length;
+    }
+
+    return count;
+}
+
+VOID
+BulkPacerCharge(
+    _Inout_ PBULK_PACER Pacer,
+    _In_ LONG64 Bytes
+)
+{
+    Pacer->Tokens -= Bytes;
+    Pacer->SliceOwnBytes += Bytes;
+}
+
+LONGLONG
+BulkPacerWait(
+    _In_ const BULK_PACER* Pacer
+)
+{
+    if (Pacer->Tokens > 0) {
+        return 0;
+    }
+
+    return max((-Pacer->Tokens + 1) * 10000000 / max(Pacer->RateBytesPerSecond, 1), 10000);
+}
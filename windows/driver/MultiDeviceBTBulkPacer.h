@@ -0,0 +1,85 @@
+/*++
+
+Module Name:
+    MultiDeviceBTBulkPacer.h
+
+Abstract:
+    Pacing of bulk file transfers. Every slice the pacer measures the
+    adapter traffic that is not bulk's own and sets bulk's rate to the
+    target share of the capacity that traffic leaves. A token bucket
+    holds bulk to that rate, and unacknowledged data is capped at what
+    the link last delivered in a slice. The pacer plans each burst of PDUs
+    against both bounds and the transfer's window.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the clock, the adapter byte count, the PDUs' acknowledgements
+    and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTBULKPACER_H_
+#define _MULTIDEVICEBTBULKPACER_H_
+
+#define BULK_BURST_PDUS             16      // PDUs per transmit hook call
+#define BULK_L2CAP_HEADER_BYTES     4
+#define BULK_SLICE_MS               10      // Pacing window
+#define BULK_TOKEN_SLICES           2       // Burst allowance after a late wake-up
+#define BULK_QUEUE_SLICES           1       // Unacknowledged data, in slices of the delivered rate
+#define BULK_TARGET_PERMILLE        900     // Share of the capacity other traffic leaves
+#define BULK_FLOOR_PERMILLE         50      // Bulk is never starved outright
+#define BULK_QUEUE_FLOOR_BYTES      1024    // Unacknowledged bytes allowed before any delivery is measured
+
+typedef struct _BULK_PACER {
+    LONGLONG FrequencyHz;
+    LONG64 CapacityBytesPerSecond;
+    LONGLONG SliceStart;        // 0 until the first refill
+    LONGLONG LastRefill;
+    LONG64 SliceTotalBytes;     // Adapter byte count at SliceStart
+    LONG64 SliceOwnBytes;
+    ULONG64 SliceAckedBytes;    // Acknowledged bulk bytes at SliceStart
+    LONG64 Tokens;              // Bytes bulk may put on the air now
+    ULONG RateBytesPerSecond;
+    ULONG OtherBytesPerSecond;  // Non-bulk traffic in the last slice
+    ULONG QueueLimitBytes;      // Unacknowledged bytes allowed
+} BULK_PACER, *PBULK_PACER;
+
+VOID BulkPacerInitialize(
+    _Out_ PBULK_PACER Pacer,
+    _In_ ULONG CapacityBytesPerSecond,
+    _In_ LONGLONG FrequencyHz
+);
+
+// Refills the token bucket. TotalBytes counts every byte the adapter
+// carried, bulk's included; AckedBytes counts bulk payload acknowledged.
+VOID BulkPacerRefill(
+    _Inout_ PBULK_PACER Pacer,
+    _In_ LONGLONG Now,
+    _In_ LONG64 TotalBytes,
+    _In_ ULONG64 AckedBytes
+);
+
+// Plans one transfer's next burst. Fills Lengths with the payload of
+// each PDU that may go now and returns how many; the last may overdraw
+// the tokens.
+ULONG BulkPacerPlan(
+    _In_ const BULK_PACER* Pacer,
+    _In_ ULONG Mtu,
+    _In_ ULONGLONG Remaining,
+    _In_ ULONG WindowFree,
+    _In_ ULONG64 Queued,
+    _Out_writes_to_(BULK_BURST_PDUS, return) PUSHORT Lengths
+);
+
+// Charges Bytes of bulk airtime, L2CAP headers included
+VOID BulkPacerCharge(
+    _Inout_ PBULK_PACER Pacer,
+    _In_ LONG64 Bytes
+);
+
+// Relative wait in 100 ns units until the tokens pay off their debt,
+// or 0 while some remain
+LONGLONG BulkPacerWait(
+    _In_ const BULK_PACER* Pacer
+);
+
+#endif // _MULTIDEVICEBTBULKPACER_H_
@@ -0,0 +1,639 @@
+/*++
+
+Module Name:
+    MultiDeviceBTCapture.c
+
+Abstract:
+    Packet capture to btsnoop files.
+
+    Seeing a device's traffic in the field meant turning on debug
+    prints that formatted every packet as it went by, slow enough to
+    change the timing being diagnosed, and a debugger to read them.
+
+    IOCTL_MULTI_BT_CAPTURE_START now allocates one SNOOP_RING per
+    processor and opens \SystemRoot\Temp\MultiDeviceBT<adapter>.btsnoop.
+    A packet path tests CaptureEnabled, then the filter (type,
+    direction, and for data the device and channel). A kept packet's
+    entry and first SnapLength bytes go into the current processor's
+    ring at DISPATCH_LEVEL, so each ring has one producer and needs no
+    lock. The rundown reference that keeps the rings alive is cache
+    aware, so processors capturing at once do not share a counter.
+    The packet paths are:
+    - commands as the transport agent fetches them (HciCommand.c)
+    - events as the event intake takes them (HciEvent.c)
+    - L2CAP frames the channel mux dequeues or receives (Channel.c);
+      the writer rebuilds their ACL and L2CAP headers
+    The buffers all of these point into belong to requests and SDUs
+    that complete as soon as the packet path is done, so the ring
+    keeps a copy of the snap length rather than a reference.
+
+    A writer thread drains the rings every CAPTURE_FLUSH_MS, or sooner
+    when one is a quarter full, merging them in timestamp order. It
+    formats the records into a 64 KB buffer and writes it with one
+    ZwWriteFile. A full ring drops packets and counts them, and the
+    records carry the count as btsnoop's cumulative drops.
+    IOCTL_MULTI_BT_CAPTURE_STOP waits for the packet paths to leave the
+    rings, lets the writer drain them, and closes the file.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+#include <ntstrsafe.h>
+
+#include "MultiDeviceBTDriver.h"
+
+// 1601 to 1970, in microseconds
+#define CAPTURE_UNIX_EPOCH_US       11644473600000000ULL
+
+static KSTART_ROUTINE CaptureWriterThread;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CaptureCleanup)
+#pragma alloc_text (PAGE, HandleCaptureStart)
+#pragma alloc_text (PAGE, HandleCaptureStop)
+#pragma alloc_text (PAGE, HandleGetCaptureStats)
+#endif
+
+static __forceinline ULONG64
+CaptureNowUs(VOID)
+{
+    return KeQueryInterruptTime() / 10;
+}
+
+/*++
+Routine Description:
+    Initializes a stopped capture
+--*/
+VOID
+CaptureInitialize(
+    _Out_ PCAPTURE_CONTEXT Capture
+)
+{
+    RtlZeroMemory(Capture, sizeof(*Capture));
+    ExInitializePushLock(&Capture->Lock);
+    KeInitializeEvent(&Capture->WakeEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&Capture->StopEvent, NotificationEvent, FALSE);
+}
+
+/*++
+Routine Description:
+    Records one packet if capture is running and the filter keeps it.
+    Callers test CaptureEnabled first. Runs at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+    Capture - Device's capture
+    Entry - Type, direction, framing, length and, for data, device and channel
+    Data - Packet bytes, as Entry->Framing has them
+    Length - Bytes at Data
+
+Return Value:
+    None
+--*/
+VOID
+CapturePacket(
+    _Inout_ PCAPTURE_CONTEXT Capture,
+    _Inout_ PSNOOP_ENTRY Entry,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+)
+{
+    PSNOOP_RING ring;
+    ULONG processor;
+    KIRQL irql;
+
+    if (!SnoopFilterMatch(&Capture->Filter, Entry) ||
+        !ExAcquireRundownProtectionCacheAware(Capture->Rundown)) {
+        return;
+    }
+
+    // Seen after the acquire, a stop has not finished waiting for us
+    if (CaptureEnabled(Capture)) {
+        KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+        processor = KeGetCurrentProcessorIndex();
+        if (processor < Capture->Processors) {
+            ring = &Capture->Rings[processor];
+            Entry->TimestampUs = KeQueryInterruptTimePrecise(NULL) / 10;
+
+            if (SnoopRingPush(ring, Capture->Filter.SnapLength, Entry, Data, Length) &&
+                (ring->Tail - ring->Head >= CAPTURE_WAKE_ENTRIES ||
+                 ring->DataTail - ring->DataHead >= CAPTURE_WAKE_BYTES) &&
+                ReadNoFence(&Capture->WakePending) == 0 &&
+                InterlockedExchange(&Capture->WakePending, 1) == 0) {
+                KeSetEvent(&Capture->WakeEvent, IO_NO_INCREMENT, FALSE);
+            }
+        }
+
+        KeLowerIrql(irql);
+    }
+
+    ExReleaseRundownProtectionCacheAware(Capture->Rundown);
+}
+
+/*++
+Routine Description:
+    Records each of a run of whole HCI commands or events
+
+Arguments:
+    Capture - Device's capture
+    Type - SNOOP_TYPE_COMMAND or SNOOP_TYPE_EVENT
+    Direction - SNOOP_SENT or SNOOP_RECEIVED
+    Packets - Packets back to back, each with its HCI header
+    Length - Bytes at Packets
+
+Return Value:
+    None
+--*/
+VOID
+CaptureHciPackets(
+    _Inout_ PCAPTURE_CONTEXT Capture,
+    _In_ UCHAR Type,
+    _In_ UCHAR Direction,
+    _In_reads_bytes_(Length) const UCHAR* Packets,
+    _In_ ULONG Length
+)
+{
+    ULONG header = (Type == SNOOP_TYPE_EVENT) ? 2 : 3;
+    ULONG offset = 0, bytes;
+    SNOOP_ENTRY entry;
+
+    RtlZeroMemory(&entry, sizeof(entry));
+    entry.Type = Type;
+    entry.Direction = Direction;
+    entry.Framing = SNOOP_FRAMING_HCI;
+
+    while (Length - offset >= header) {
+        bytes = header + Packets[offset + header - 1];
+        if (bytes > Length - offset) {
+            break;
+        }
+        entry.Length = bytes;
+        CapturePacket(Capture, &entry, Packets + offset, bytes);
+        offset += bytes;
+    }
+}
+
+// Connection handle of a device's ACL link, for rebuilt ACL headers
+static USHORT
+CaptureHandle(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    PACL_CONTEXT acl = &DeviceContext->Acl;
+    USHORT handle = 0;
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&acl->Lock, &irql);
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        if (acl->Pool.Links[i].InUse && acl->Pool.Links[i].PeerAddress == DeviceAddress) {
+            handle = acl->Pool.Links[i].Handle;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&acl->Lock, irql);
+
+    return handle;
+}
+
+static VOID
+CaptureWrite(
+    _Inout_ PCAPTURE_CONTEXT Capture,
+    _In_ ULONG Length
+)
+{
+    IO_STATUS_BLOCK ioStatus;
+    LARGE_INTEGER offset;
+    NTSTATUS status;
+
+    offset.QuadPart = (LONGLONG)Capture->FileOffset;
+    status = ZwWriteFile(Capture->File, NULL, NULL, NULL, &ioStatus,
+        Capture->Buffer, Length, &offset, NULL);
+    if (!NT_SUCCESS(status)) {
+        Capture->Stats.WriteErrors++;
+        return;
+    }
+
+    Capture->FileOffset += Length;
+    Capture->Stats.FileBytes += Length;
+}
+
+/*++
+Routine Description:
+    Writer: empties every ring into the file, oldest entry first
+--*/
+static VOID
+CaptureDrain(
+    _In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+    PCAPTURE_CONTEXT capture = &DeviceContext->Capture;
+    PUCHAR packet = capture->Buffer + CAPTURE_WRITE_BYTES;
+    const SNOOP_ENTRY* oldest;
+    const SNOOP_ENTRY* next;
+    SNOOP_ENTRY entry;
+    ULONG64 start = CaptureNowUs();
+    ULONG64 drops = 0;
+    ULONG used = 0;
+    ULONG i, ring, elapsed;
+    USHORT handle;
+
+    for (i = 0; i < capture->Processors; i++) {
+        drops += capture->Rings[i].Dropped;
+    }
+
+    for (;;) {
+        oldest = NULL;
+        ring = 0;
+        for (i = 0; i < capture->Processors; i++) {
+            next = SnoopRingPeek(&capture->Rings[i]);
+            if (next != NULL && (oldest == NULL || next->TimestampUs < oldest->TimestampUs)) {
+                oldest = next;
+                ring = i;
+            }
+        }
+        if (oldest == NULL) {
+            break;
+        }
+
+        SnoopRingPop(&capture->Rings[ring], &entry, packet);
+
+        if (used > CAPTURE_WRITE_BYTES - SNOOP_MAX_RECORD_BYTES) {
+            CaptureWrite(capture, used);
+            used = 0;
+        }
+
+        handle = (entry.Framing == SNOOP_FRAMING_HCI) ? 0 :
+            CaptureHandle(DeviceContext, entry.DeviceAddress);
+        used += SnoopFormatRecord(&entry, packet, handle, capture->BaseUs,
+            (ULONG)drops, capture->Buffer + used);
+        capture->Stats.Written++;
+    }
+
+    if (used != 0) {
+        CaptureWrite(capture, used);
+    }
+
+    elapsed = (ULONG)(CaptureNowUs() - start);
+    capture->Stats.LastDrainUs = elapsed;
+    capture->Stats.MaxDrainUs = max(capture->Stats.MaxDrainUs, elapsed);
+}
+
+/*++
+Routine Description:
+    Writer thread. Drains the rings when woken, when CAPTURE_FLUSH_MS
+    passes, and a last time when stopped; the packet paths have left
+    the rings by then.
+
+Arguments:
+    StartContext - Device context
+
+Return Value:
+    None
+--*/
+static VOID
+CaptureWriterThread(
+    _In_ PVOID StartContext
+)
+{
+    PDEVICE_CONTEXT deviceContext = (PDEVICE_CONTEXT)StartContext;
+    PCAPTURE_CONTEXT capture = &deviceContext->Capture;
+    PVOID waitObjects[2];
+    LARGE_INTEGER timeout;
+    NTSTATUS status;
+
+    waitObjects[0] = &capture->WakeEvent;
+    waitObjects[1] = &capture->StopEvent;
+    timeout.QuadPart = -10000LL * CAPTURE_FLUSH_MS;
+
+    do {
+        status = KeWaitForMultipleObjects(2, waitObjects, WaitAny,
+            Executive, KernelMode, FALSE, &timeout, NULL);
+
+        InterlockedExchange(&capture->WakePending, 0);
+        CaptureDrain(deviceContext);
+    } while (status != STATUS_WAIT_1);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Frees what a start allocated. Caller holds the lock; the writer has exited.
+static VOID
+CaptureRelease(
+    _Inout_ PCAPTURE_CONTEXT Capture
+)
+{
+    if (Capture->File != NULL) {
+        ZwClose(Capture->File);
+        Capture->File = NULL;
+    }
+    if (Capture->Rings != NULL) {
+        ExFreePoolWithTag(Capture->Rings, CAPTURE_POOL_TAG);
+        Capture->Rings = NULL;
+    }
+    if (Capture->Buffer != NULL) {
+        ExFreePoolWithTag(Capture->Buffer, CAPTURE_POOL_TAG);
+        Capture->Buffer = NULL;
+    }
+    Capture->Processors = 0;
+}
+
+/*++
+Routine Description:
+    Stops a running capture. Caller holds the lock.
+--*/
+static VOID
+CaptureStop(
+    _Inout_ PCAPTURE_CONTEXT Capture
+)
+{
+    ULONG i;
+
+    if (!Capture->Stats.Running) {
+        return;
+    }
+
+    InterlockedExchange(&Capture->Enabled, 0);
+    ExWaitForRundownProtectionReleaseCacheAware(Capture->Rundown);
+
+    KeSetEvent(&Capture->StopEvent, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(Capture->Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(Capture->Thread);
+    Capture->Thread = NULL;
+
+    for (i = 0; i < Capture->Processors; i++) {
+        Capture->Stats.Captured += Capture->Rings[i].Captured;
+        Capture->Stats.Dropped += Capture->Rings[i].Dropped;
+    }
+
+    CaptureRelease(Capture);
+    ExReInitializeRundownProtectionCacheAware(Capture->Rundown);
+    Capture->Stats.Running = FALSE;
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Capture stopped, %llu records written, %llu dropped\n",
+        Capture->Stats.Written, Capture->Stats.Dropped));
+}
+
+/*++
+Routine Description:
+    Stops any capture and frees the rundown reference; called from
+    device cleanup
+--*/
+VOID
+CaptureCleanup(
+    _Inout_ PCAPTURE_CONTEXT Capture
+)
+{
+    PAGED_CODE();
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Capture->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    CaptureStop(Capture);
+    if (Capture->Rundown != NULL) {
+        ExFreeCacheAwareRundownProtection(Capture->Rundown);
+        Capture->Rundown = NULL;
+    }
+    ExReleasePushLockExclusiveEx(&Capture->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+static NTSTATUS
+CaptureOpenFile(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Out_ PHANDLE File
+)
+{
+    WCHAR path[CAPTURE_PATH_CHARS];
+    UNICODE_STRING name;
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatus;
+    NTSTATUS status;
+
+    status = RtlStringCbPrintfW(path, sizeof(path), CAPTURE_PATH_FORMAT,
+        DeviceContext->Load.AdapterIndex);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlInitUnicodeString(&name, path);
+    InitializeObjectAttributes(&attributes, &name,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+    return ZwCreateFile(File, FILE_WRITE_DATA | SYNCHRONIZE, &attributes, &ioStatus, NULL,
+        FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+        FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY,
+        NULL, 0);
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_CAPTURE_START: starts capturing to a new file
+
+Arguments:
+    DeviceContext - Device context
+    Request - Request with a SNOOP_FILTER
+    InputBufferLength - Input size
+    BytesReturned - Receives 0
+
+Return Value:
+    STATUS_DEVICE_BUSY if a capture is already running
+--*/
+NTSTATUS
+HandleCaptureStart(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PCAPTURE_CONTEXT capture = &DeviceContext->Capture;
+    PSNOOP_FILTER filter;
+    LARGE_INTEGER systemTime;
+    HANDLE threadHandle;
+    NTSTATUS status;
+    ULONG i;
+
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(SNOOP_FILTER), (PVOID*)&filter, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (filter->Types == 0 || (filter->Types & ~SNOOP_TYPES_ALL) != 0 ||
+        filter->Directions == 0 || (filter->Directions & ~SNOOP_DIRECTIONS_ALL) != 0 ||
+        filter->SnapLength > SNOOP_MAX_SNAP) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&capture->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    if (capture->Stats.Running) {
+        status = STATUS_DEVICE_BUSY;
+        goto Exit;
+    }
+
+    if (capture->Rundown == NULL) {
+        capture->Rundown = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, CAPTURE_POOL_TAG);
+        if (capture->Rundown == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+    }
+
+    capture->Processors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    capture->Rings = (PSNOOP_RING)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        (SIZE_T)capture->Processors * sizeof(SNOOP_RING), CAPTURE_POOL_TAG);
+    capture->Buffer = (PUCHAR)ExAllocatePool2(POOL_FLAG_PAGED,
+        CAPTURE_WRITE_BYTES + SNOOP_MAX_SNAP, CAPTURE_POOL_TAG);
+    if (capture->Rings == NULL || capture->Buffer == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    for (i = 0; i < capture->Processors; i++) {
+        SnoopRingInitialize(&capture->Rings[i]);
+    }
+
+    status = CaptureOpenFile(DeviceContext, &capture->File);
+    if (!NT_SUCCESS(status)) {
+        capture->File = NULL;
+        goto Exit;
+    }
+
+    capture->FileOffset = 0;
+    RtlZeroMemory(&capture->Stats, sizeof(capture->Stats));
+    CaptureWrite(capture, SnoopFormatFileHeader(capture->Buffer));
+    if (capture->Stats.WriteErrors != 0) {
+        status = STATUS_UNSUCCESSFUL;
+        goto Exit;
+    }
+
+    KeQuerySystemTimePrecise(&systemTime);
+    capture->BaseUs = (ULONG64)systemTime.QuadPart / 10 - CAPTURE_UNIX_EPOCH_US -
+        KeQueryInterruptTimePrecise(NULL) / 10;
+
+    capture->Filter = *filter;
+    capture->WakePending = 0;
+    KeClearEvent(&capture->StopEvent);
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL,
+        NULL, NULL, CaptureWriterThread, DeviceContext);
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, *PsThreadType,
+        KernelMode, (PVOID*)&capture->Thread, NULL);
+    if (!NT_SUCCESS(status)) {
+        // Nothing captured yet: the writer drains empty rings and exits
+        KeSetEvent(&capture->StopEvent, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+        ZwClose(threadHandle);
+        capture->Thread = NULL;
+        goto Exit;
+    }
+    ZwClose(threadHandle);
+
+    capture->Stats.Running = TRUE;
+    capture->Stats.Processors = capture->Processors;
+    capture->Stats.Filter = *filter;
+    InterlockedExchange(&capture->Enabled, 1);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Capture started, types 0x%x, snap %u\n",
+        filter->Types, filter->SnapLength));
+
+Exit:
+    if (!NT_SUCCESS(status)) {
+        CaptureRelease(capture);
+    }
+    ExReleasePushLockExclusiveEx(&capture->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_CAPTURE_STOP. Returns once every packet
+    captured is in the file.
+--*/
+NTSTATUS
+HandleCaptureStop(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Out_ size_t* BytesReturned
+)
+{
+    PCAPTURE_CONTEXT capture = &DeviceContext->Capture;
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&capture->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    CaptureStop(capture);
+    ExReleasePushLockExclusiveEx(&capture->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_CAPTURE_STATS
+--*/
+NTSTATUS
+HandleGetCaptureStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PCAPTURE_CONTEXT capture = &DeviceContext->Capture;
+    PCAPTURE_STATS stats;
+    NTSTATUS status;
+    ULONG i;
+
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(CAPTURE_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&capture->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    *stats = capture->Stats;
+    if (capture->Stats.Running) {
+        for (i = 0; i < capture->Processors; i++) {
+            stats->Captured += capture->Rings[i].Captured;
+            stats->Dropped += capture->Rings[i].Dropped;
+        }
+    }
+    ExReleasePushLockExclusiveEx(&capture->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+
+    *BytesReturned = sizeof(CAPTURE_STATS);
+    return STATUS_SUCCESS;
+}
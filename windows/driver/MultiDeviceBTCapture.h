@@ -0,0 +1,87 @@
+/*++
+
+Module Name:
+    MultiDeviceBTCapture.h
+
+Abstract:
+    Packet capture for field diagnosis. HCI commands handed to the
+    transport agent, events from the event intake, and L2CAP frames
+    through the channel mux go into per-processor rings
+    (MultiDeviceBTSnoop.h); a writer thread turns them into a btsnoop
+    file under \SystemRoot\Temp.
+
+--*/
+
+#ifndef _MULTIDEVICEBTCAPTURE_H_
+#define _MULTIDEVICEBTCAPTURE_H_
+
+#include "MultiDeviceBTSnoop.h"
+
+#define CAPTURE_POOL_TAG            'NSBM'
+#define CAPTURE_PATH_FORMAT         L"\\SystemRoot\\Temp\\MultiDeviceBT%u.btsnoop"  // Adapter index
+#define CAPTURE_PATH_CHARS          64
+#define CAPTURE_WRITE_BYTES         65536   // Largest file write
+#define CAPTURE_FLUSH_MS            100     // The writer drains at least this often
+#define CAPTURE_WAKE_ENTRIES        (SNOOP_RING_ENTRIES / 4)    // A ring this full wakes it early
+#define CAPTURE_WAKE_BYTES          (SNOOP_RING_BYTES / 4)
+
+// One read on every packet path while capture is off
+#define CaptureEnabled(Capture)     (ReadNoFence(&(Capture)->Enabled) != 0)
+
+// IOCTL_MULTI_BT_GET_CAPTURE_STATS output; kept after a capture stops
+typedef struct _CAPTURE_STATS {
+    BOOLEAN Running;
+    UCHAR Reserved[3];
+    ULONG Processors;           // Rings
+    SNOOP_FILTER Filter;
+    ULONG64 Captured;           // Into the rings
+    ULONG64 Dropped;            // Ring full
+    ULONG64 Written;            // Records in the file
+    ULONG64 FileBytes;
+    ULONG64 WriteErrors;
+    ULONG LastDrainUs;          // Writer, one pass over the rings
+    ULONG MaxDrainUs;
+} CAPTURE_STATS, *PCAPTURE_STATS;
+
+typedef struct _CAPTURE_CONTEXT {
+    EX_PUSH_LOCK Lock;          // Start, stop and stats; held at PASSIVE_LEVEL for file I/O
+    volatile LONG Enabled;
+    PEX_RUNDOWN_REF_CACHE_AWARE Rundown;    // Packet paths inside the rings; from the first start on
+    SNOOP_FILTER Filter;        // Fixed while running
+    ULONG Processors;
+    PSNOOP_RING Rings;          // One per processor, while running
+    PUCHAR Buffer;              // Writer: CAPTURE_WRITE_BYTES, then one packet
+    HANDLE File;
+    ULONG64 FileOffset;
+    ULONG64 BaseUs;             // Interrupt time to time since 1970
+    PKTHREAD Thread;
+    KEVENT WakeEvent;
+    KEVENT StopEvent;
+    volatile LONG WakePending;
+    CAPTURE_STATS Stats;
+} CAPTURE_CONTEXT, *PCAPTURE_CONTEXT;
+
+VOID CaptureInitialize(
+    _Out_ PCAPTURE_CONTEXT Capture
+);
+
+VOID CaptureCleanup(
+    _Inout_ PCAPTURE_CONTEXT Capture
+);
+
+VOID CapturePacket(
+    _Inout_ PCAPTURE_CONTEXT Capture,
+    _Inout_ PSNOOP_ENTRY Entry,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+);
+
+VOID CaptureHciPackets(
+    _Inout_ PCAPTURE_CONTEXT Capture,
+    _In_ UCHAR Type,
+    _In_ UCHAR Direction,
+    _In_reads_bytes_(Length) const UCHAR* Packets,
+    _In_ ULONG Length
+);
+
+#endif // _MULTIDEVICEBTCAPTURE_H_
@@ -0,0 +1,1329 @@
+/*++
+
+Module Name:
+    MultiDeviceBTChannel.c
+
+Abstract:
+    Per-device logical channel multiplexer.
+
+    Before this, a device was a single FIFO. A file transfer queued
+    ahead of a control message delayed it by the whole backlog, and one
+    channel waiting for peer credits held up every channel behind it.
+
+    Now each channel has its own SDU queue and credit count. When the
+    transmit path has room for a device, it dequeues MPS-sized segments
+    by weighted deficit round robin across that device's channels
+    (MultiDeviceBTChannelSched.c). A control channel therefore waits at
+    most one round of the others' quanta, whatever the depth of the bulk
+    queue.
+
+    No ACL transmit path terminates in this driver yet. Until one sets
+    Notify, queues drain inline on enqueue and each PDU counts as sent
+    when dequeued. The bulk engine's PDUs reach their channel through
+    ChannelMuxBulkSink without a copy. PDUs for channels that were never
+    opened pass straight through, as before.
+
+    ERTM channels keep their SDUs queued here until the ERTM_CHANNEL has
+    room, then dequeue frames it builds: selective rejects and acks,
+    retransmissions, then new I-frames. Frame buffers come from pool and
+    are freed when the transmit path returns them. An SDU completes when
+    the peer acknowledges its last frame, not when it is dequeued. One
+    timer covers every ERTM channel's earliest retransmission or ack
+    deadline and notifies the transmit path when one passes. ERTM needs
+    frames to really leave and come back, so it is refused until a
+    transmit path attaches.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+static const USHORT ChannelDefaultWeight[] = { 8, 4, 1 };
+
+static EXT_CALLBACK ChannelMuxTimerCallback;
+static ERTM_SDU_ACKED ChannelErtmAcked;
+static ERTM_SDU_RECEIVED ChannelErtmReceived;
+
+static __forceinline ULONG64
+ChannelNowUs(VOID)
+{
+    return KeQueryInterruptTime() / 10;
+}
+
+static __forceinline BOOLEAN
+ChannelKeyEqual(
+    _In_ const CHANNEL_CONFIG* Config,
+    _In_ const CHANNEL_KEY* Key
+)
+{
+    return Config->Key.Cid == Key->Cid && Config->Key.Dlci == Key->Dlci;
+}
+
+/*++
+Routine Description:
+    Finds a device's entry. Caller holds the lock.
+--*/
+static PCHANNEL_DEVICE
+ChannelFindDevice(
+    _In_ PCHANNEL_MUX Mux,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    ULONG i;
+
+    for (i = 0; i < CHANNEL_MAX_DEVICES; i++) {
+        if (Mux->Devices[i].DeviceAddress == DeviceAddress && DeviceAddress != 0) {
+            return &Mux->Devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*++
+Routine Description:
+    Finds a channel and its slot. Caller holds the lock.
+--*/
+static PCHANNEL
+ChannelFind(
+    _In_ PCHANNEL_MUX Mux,
+    _In_ const CHANNEL_KEY* Key,
+    _Out_opt_ PCHANNEL_DEVICE* Device,
+    _Out_opt_ PULONG Slot
+)
+{
+    PCHANNEL_DEVICE device = ChannelFindDevice(Mux, Key->DeviceAddress);
+    ULONG i;
+
+    if (device != NULL) {
+        for (i = 0; i < CHANNEL_MAX_PER_DEVICE; i++) {
+            if (device->Channels[i] != NULL && ChannelKeyEqual(&device->Channels[i]->Config, Key)) {
+                if (Device != NULL) {
+                    *Device = device;
+                }
+                if (Slot != NULL) {
+                    *Slot = i;
+                }
+                return device->Channels[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*++
+Routine Description:
+    Completes a detached list of SDUs and frees the ones the mux owns.
+    Called without the lock.
+--*/
+static VOID
+ChannelCompleteSdus(
+    _Inout_ PLIST_ENTRY List,
+    _In_ NTSTATUS Status
+)
+{
+    while (!IsListEmpty(List)) {
+        PCHANNEL_SDU sdu = CONTAINING_RECORD(RemoveHeadList(List), CHANNEL_SDU, Link);
+
+        if (sdu->Complete != NULL) {
+            sdu->Complete(sdu->CompleteContext, sdu->Tag, Status);
+        }
+        if (sdu->Flags & CHANNEL_SDU_OWNS_DATA) {
+            ExFreePoolWithTag(sdu, CHANNEL_POOL_TAG);
+        }
+    }
+}
+
+static VOID
+ChannelMoveList(
+    _Inout_ PLIST_ENTRY To,
+    _Inout_ PLIST_ENTRY From
+)
+{
+    while (!IsListEmpty(From)) {
+        InsertTailList(To, RemoveHeadList(From));
+    }
+}
+
+// ERTM acknowledged every frame of an SDU. Called under the lock.
+static VOID
+ChannelErtmAcked(
+    _In_opt_ PVOID Context,
+    _In_opt_ PVOID Cookie
+)
+{
+    PCHANNEL channel = (PCHANNEL)Context;
+    PCHANNEL_SDU sdu = (PCHANNEL_SDU)Cookie;
+
+    if (channel != NULL && sdu != NULL) {
+        InsertTailList(&channel->Acked, &sdu->Link);
+    }
+}
+
+// ERTM reassembled an inbound SDU. Called under the lock.
+static VOID
+ChannelErtmReceived(
+    _In_opt_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+)
+{
+    PCHANNEL channel = (PCHANNEL)Context;
+
+    if (channel != NULL && channel->Mux->Receive != NULL) {
+        channel->Mux->Receive(channel->Mux->ReceiveContext, &channel->Config.Key, Data, Length);
+    }
+}
+
+/*++
+Routine Description:
+    Moves queued SDUs into the channel's ERTM state while it has room.
+    The SDU leaves the mux queue here and completes on acknowledgement.
+    Caller holds the lock.
+--*/
+static VOID
+ChannelErtmFeed(
+    _Inout_ PCHANNEL Channel
+)
+{
+    while (Channel->Queued != 0) {
+        PCHANNEL_SDU sdu = CONTAINING_RECORD(Channel->Queue.Flink, CHANNEL_SDU, Link);
+        ULONG waitUs;
+
+        if (!ErtmQueueSdu(Channel->Ertm, sdu->Data, sdu->Length, sdu)) {
+            break;
+        }
+
+        RemoveEntryList(&sdu->Link);
+        Channel->Queued--;
+
+        waitUs = (ULONG)(((LONGLONG)KeQueryInterruptTime() - sdu->Enqueued) / 10);
+        Channel->WaitSumUs += waitUs;
+        Channel->Stats.WaitMaxUs = max(Channel->Stats.WaitMaxUs, waitUs);
+        Channel->Stats.SdusSent++;
+        Channel->Stats.WaitAvgUs = (ULONG)(Channel->WaitSumUs / Channel->Stats.SdusSent);
+    }
+}
+
+/*++
+Routine Description:
+    Takes back every SDU an ERTM channel still holds, queued or in
+    flight, onto List. Caller holds the lock.
+--*/
+static VOID
+ChannelErtmAbort(
+    _Inout_ PCHANNEL Channel,
+    _Inout_ PLIST_ENTRY List
+)
+{
+    PVOID cookies[ERTM_TX_WINDOW_MAX + ERTM_SDU_QUEUE];
+    ULONG count, i;
+
+    ChannelMoveList(List, &Channel->Acked);
+    count = ErtmAbort(Channel->Ertm, cookies, ARRAYSIZE(cookies));
+    for (i = 0; i < count; i++) {
+        if (cookies[i] != NULL) {
+            InsertTailList(List, &((PCHANNEL_SDU)cookies[i])->Link);
+        }
+    }
+}
+
+// Caller holds the lock
+static BOOLEAN
+ChannelHasWork(
+    _Inout_ PCHANNEL Channel,
+    _In_ ULONG64 NowUs
+)
+{
+    if (Channel->Ertm != NULL) {
+        ChannelErtmFeed(Channel);
+        return ErtmHasWork(Channel->Ertm, NowUs);
+    }
+
+    return Channel->Queued != 0 && Channel->Credits != 0;
+}
+
+/*++
+Routine Description:
+    Arms the ERTM timer for the earliest future deadline of any ERTM
+    channel, unless it is already due sooner. Deadlines already passed
+    belong to devices the transmit path has been told about. Caller
+    holds the lock.
+--*/
+static VOID
+ChannelMuxArmTimer(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ ULONG64 NowUs
+)
+{
+    ULONG64 earliest = ERTM_NO_DEADLINE;
+    ULONG d, c;
+
+    if (Mux->Timer == NULL || Mux->ShuttingDown) {
+        return;
+    }
+
+    for (d = 0; d < CHANNEL_MAX_DEVICES; d++) {
+        for (c = 0; c < CHANNEL_MAX_PER_DEVICE; c++) {
+            PCHANNEL channel = Mux->Devices[d].Channels[c];
+
+            if (channel != NULL && channel->Ertm != NULL) {
+                ULONG64 deadline = ErtmNextDeadline(channel->Ertm);
+
+                if (deadline > NowUs && deadline < earliest) {
+                    earliest = deadline;
+                }
+            }
+        }
+    }
+
+    if (earliest == ERTM_NO_DEADLINE || (Mux->TimerDueUs != 0 && Mux->TimerDueUs <= earliest)) {
+        return;
+    }
+
+    Mux->TimerDueUs = earliest;
+    ExSetTimer(Mux->Timer, -(LONGLONG)((earliest - NowUs) * 10), 0, NULL);
+}
+
+// Records an L2CAP PDU sent or received; caller has tested CaptureEnabled
+static VOID
+ChannelCapture(
+    _In_ PCHANNEL_MUX Mux,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ USHORT Cid,
+    _In_ UCHAR Direction,
+    _In_ UCHAR Framing,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+)
+{
+    SNOOP_ENTRY entry;
+
+    RtlZeroMemory(&entry, sizeof(entry));
+    entry.DeviceAddress = DeviceAddress;
+    entry.Length = Length;
+    entry.Cid = Cid;
+    entry.Type = SNOOP_TYPE_ACL;
+    entry.Direction = Direction;
+    entry.Framing = Framing;
+
+    CapturePacket(&Mux->DeviceContext->Capture, &entry, Data, Length);
+}
+
+VOID
+ChannelMuxInitialize(
+    _Out_ PCHANNEL_MUX Mux,
+    _In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+    RtlZeroMemory(Mux, sizeof(*Mux));
+    KeInitializeSpinLock(&Mux->Lock);
+    Mux->DeviceContext = DeviceContext;
+}
+
+/*++
+Routine Description:
+    Drains the device's queues when no transmit path is attached, or
+    tells the attached one there is work
+
+Arguments:
+    Mux - Channel mux
+    DeviceAddress - Device with new work
+
+Return Value:
+    None
+--*/
+static VOID
+ChannelMuxKick(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    CHANNEL_TX_PDU pdus[CHANNEL_TX_BATCH];
+    ULONG count;
+
+    if (Mux->Notify != NULL) {
+        Mux->Notify(Mux->NotifyContext, DeviceAddress);
+        return;
+    }
+
+    while ((count = ChannelMuxDequeue(Mux, DeviceAddress, CHANNEL_TX_BATCH, pdus)) != 0) {
+        ChannelMuxCompletePdus(Mux, pdus, count, STATUS_SUCCESS);
+    }
+}
+
+/*++
+Routine Description:
+    ERTM deadline: tells the transmit path about every device with an
+    ERTM channel that now has a frame to send, then re-arms
+--*/
+static VOID
+ChannelMuxTimerCallback(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context
+)
+{
+    PCHANNEL_MUX mux = (PCHANNEL_MUX)Context;
+    BTH_ADDR ready[CHANNEL_MAX_DEVICES];
+    ULONG readyCount = 0;
+    ULONG64 nowUs;
+    KIRQL irql;
+    ULONG d, c;
+
+    UNREFERENCED_PARAMETER(Timer);
+
+    if (mux == NULL) {
+        return;
+    }
+
+    KeAcquireSpinLock(&mux->Lock, &irql);
+
+    nowUs = ChannelNowUs();
+    mux->TimerDueUs = 0;
+
+    for (d = 0; !mux->ShuttingDown && d < CHANNEL_MAX_DEVICES; d++) {
+        for (c = 0; c < CHANNEL_MAX_PER_DEVICE; c++) {
+            PCHANNEL channel = mux->Devices[d].Channels[c];
+
+            if (channel != NULL && channel->Ertm != NULL && ErtmHasWork(channel->Ertm, nowUs)) {
+                ready[readyCount++] = mux->Devices[d].DeviceAddress;
+                break;
+            }
+        }
+    }
+
+    ChannelMuxArmTimer(mux, nowUs);
+
+    KeReleaseSpinLock(&mux->Lock, irql);
+
+    for (d = 0; d < readyCount; d++) {
+        ChannelMuxKick(mux, ready[d]);
+    }
+}
+
+/*++
+Routine Description:
+    Queues an SDU on its channel. The SDU belongs to the mux until its
+    Complete callback runs.
+
+Arguments:
+    Mux - Channel mux
+    Key - Destination channel
+    Sdu - SDU with Data, Length, Complete, CompleteContext, Tag and Flags set
+
+Return Value:
+    STATUS_NOT_FOUND if the channel is not open, STATUS_DEVICE_BUSY if
+    its queue is full, STATUS_CONNECTION_ABORTED if ERTM gave up on it
+--*/
+NTSTATUS
+ChannelMuxEnqueue(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ const CHANNEL_KEY* Key,
+    _Inout_ PCHANNEL_SDU Sdu
+)
+{
+    PCHANNEL channel;
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+
+    Sdu->Offset = 0;
+    Sdu->Enqueued = (LONGLONG)KeQueryInterruptTime();
+
+    KeAcquireSpinLock(&Mux->Lock, &irql);
+
+    channel = Mux->ShuttingDown ? NULL : ChannelFind(Mux, Key, NULL, NULL);
+    if (channel == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else if (channel->Ertm != NULL && channel->Ertm->Failed) {
+        status = STATUS_CONNECTION_ABORTED;
+    } else if (channel->Queued >= CHANNEL_QUEUE_SDUS) {
+        channel->Stats.Rejected++;
+        status = STATUS_DEVICE_BUSY;
+    } else {
+        InsertTailList(&channel->Queue, &Sdu->Link);
+        channel->Queued++;
+    }
+
+    KeReleaseSpinLock(&Mux->Lock, irql);
+
+    if (NT_SUCCESS(status)) {
+        ChannelMuxKick(Mux, Key->DeviceAddress);
+    }
+
+    return status;
+}
+
+// ChannelMuxDequeue's probe context
+typedef struct _CHANNEL_PROBE_CONTEXT {
+    PCHANNEL_DEVICE Device;
+    ULONG64 NowUs;
+} CHANNEL_PROBE_CONTEXT, *PCHANNEL_PROBE_CONTEXT;
+
+static CHANNEL_SCHED_PROBE ChannelSchedProbe;
+
+// Caller holds the lock
+static PCHANNEL_SCHED_FLOW
+ChannelSchedProbe(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Slot,
+    _Out_ PBOOLEAN Ready
+)
+{
+    PCHANNEL_PROBE_CONTEXT probe = (PCHANNEL_PROBE_CONTEXT)Context;
+    PCHANNEL channel = probe->Device->Channels[Slot];
+
+    *Ready = FALSE;
+    if (channel == NULL) {
+        return NULL;
+    }
+
+    *Ready = ChannelHasWork(channel, probe->NowUs);
+    return &channel->Sched;
+}
+
+/*++
+Routine Description:
+    Picks the device's next PDUs by weighted deficit round robin. Called
+    by the transmit path whenever it can take PDUs for the device.
+
+Arguments:
+    Mux - Channel mux
+    DeviceAddress - Device with a transmit opportunity
+    MaxPdus - PDUs the transmit path can take now
+    Pdus - Receives the PDUs
+
+Return Value:
+    Number of PDUs returned
+--*/
+ULONG
+ChannelMuxDequeue(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ ULONG MaxPdus,
+    _Out_writes_to_(MaxPdus, return) PCHANNEL_TX_PDU Pdus
+)
+{
+    CHANNEL_PROBE_CONTEXT probe;
+    PCHANNEL_DEVICE device;
+    LIST_ENTRY failed;
+    ULONG64 nowUs = ChannelNowUs();
+    ULONG count = 0;
+    KIRQL irql;
+
+    InitializeListHead(&failed);
+
+    KeAcquireSpinLock(&Mux->Lock, &irql);
+
+    device = ChannelFindDevice(Mux, DeviceAddress);
+    probe.Device = device;
+    probe.NowUs = nowUs;
+
+    while (device != NULL && count < MaxPdus) {
+        PCHANNEL channel;
+        PCHANNEL_SDU sdu;
+        ULONG slot, length;
+
+        // Next channel with something to send, and credits for it
+        slot = ChannelSchedSelect(&device->Sched, ChannelSchedProbe, &probe);
+        if (slot == CHANNEL_SCHED_NONE) {
+            break;
+        }
+        channel = device->Channels[slot];
+
+        if (channel->Ertm != NULL) {
+            PUCHAR frame;
+
+            // Charged at the largest frame the channel can build
+            length = ERTM_HEADER_BYTES + channel->Config.Mps + ERTM_FCS_BYTES;
+            if (!ChannelSchedAdmit(&device->Sched, &channel->Sched, length)) {
+                continue;
+            }
+
+            frame = (PUCHAR)ExAllocatePool2(POOL_FLAG_NON_PAGED, length, CHANNEL_POOL_TAG);
+            if (frame == NULL) {
+                break;
+            }
+
+            length = ErtmBuildFrame(channel->Ertm, nowUs, frame, length);
+            if (length == 0) {
+                // A frame reached MaxTransmit: the peer is gone
+                ExFreePoolWithTag(frame, CHANNEL_POOL_TAG);
+                ChannelMoveList(&failed, &channel->Queue);
+                channel->Queued = 0;
+                ChannelErtmAbort(channel, &failed);
+                KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+                    "MultiDeviceBT: Channel %llx CID 0x%x ERTM failed after %u transmissions\n",
+                    channel->Config.Key.DeviceAddress, channel->Config.Key.Cid,
+                    channel->Config.MaxTransmit));
+                continue;
+            }
+
+            Pdus[count].Cid = channel->Config.Key.Cid;
+            Pdus[count].Dlci = channel->Config.Key.Dlci;
+            Pdus[count].LastOfSdu = FALSE;
+            Pdus[count].Length = (USHORT)length;
+            Pdus[count].Flags = CHANNEL_PDU_FRAME;
+            Pdus[count].Data = frame;
+            Pdus[count].Sdu = NULL;
+
+            channel->Stats.PdusSent++;
+            channel->Stats.BytesSent += length;
+
+            ChannelSchedCharge(&device->Sched, &channel->Sched, length,
+                channel->Queued == 0 && !ErtmHasWork(channel->Ertm, nowUs));
+
+            count++;
+            continue;
+        }
+
+        sdu = CONTAINING_RECORD(channel->Queue.Flink, CHANNEL_SDU, Link);
+        length = min(sdu->Length - sdu->Offset, (ULONG)channel->Config.Mps);
+
+        // Otherwise the deficit carries into the next round
+        if (!ChannelSchedAdmit(&device->Sched, &channel->Sched, length)) {
+            continue;
+        }
+
+        if (sdu->Offset == 0) {
+            ULONG waitUs = (ULONG)(((LONGLONG)KeQueryInterruptTime() - sdu->Enqueued) / 10);
+
+            channel->WaitSumUs += waitUs;
+            channel->Stats.WaitMaxUs = max(channel->Stats.WaitMaxUs, waitUs);
+        }
+
+        Pdus[count].Cid = channel->Config.Key.Cid;
+        Pdus[count].Dlci = channel->Config.Key.Dlci;
+        Pdus[count].Length = (USHORT)length;
+        Pdus[count].Flags = 0;
+        Pdus[count].Data = sdu->Data + sdu->Offset;
+        Pdus[count].Sdu = sdu;
+
+        sdu->Offset += length;
+        channel->Stats.PdusSent++;
+        channel->Stats.BytesSent += length;
+
+        if (channel->Credits != CHANNEL_CREDITS_UNLIMITED && --channel->Credits == 0 &&
+            (channel->Queued > 1 || sdu->Offset < sdu->Length)) {
+            channel->Stats.CreditStalls++;
+        }
+
+        Pdus[count].LastOfSdu = (sdu->Offset == sdu->Length);
+        if (Pdus[count].LastOfSdu) {
+            RemoveEntryList(&sdu->Link);
+            channel->Queued--;
+            channel->Stats.SdusSent++;
+            channel->Stats.WaitAvgUs = (ULONG)(channel->WaitSumUs / channel->Stats.SdusSent);
+        }
+
+        ChannelSchedCharge(&device->Sched, &channel->Sched, length, channel->Queued == 0);
+
+        count++;
+    }
+
+    ChannelMuxArmTimer(Mux, nowUs);
+
+    KeReleaseSpinLock(&Mux->Lock, irql);
+
+    if (CaptureEnabled(&Mux->DeviceContext->Capture)) {
+        ULONG i;
+
+        for (i = 0; i < count; i++) {
+            ChannelCapture(Mux, DeviceAddress, Pdus[i].Cid, SNOOP_SENT,
+                (Pdus[i].Flags & CHANNEL_PDU_FRAME) ? SNOOP_FRAMING_L2CAP_FRAME : SNOOP_FRAMING_L2CAP_PAYLOAD,
+                Pdus[i].Data, Pdus[i].Length);
+        }
+    }
+
+    ChannelCompleteSdus(&failed, STATUS_CONNECTION_ABORTED);
+
+    return count;
+}
+
+/*++
+Routine Description:
+    Returns PDUs from the transmit path. A basic-mode SDU completes with
+    its last PDU; ERTM frame buffers are freed.
+
+Arguments:
+    Mux - Channel mux
+    Pdus - PDUs from ChannelMuxDequeue
+    Count - Number of PDUs
+    Status - STATUS_SUCCESS once sent; a failure status if dropped
+
+Return Value:
+    None
+--*/
+VOID
+ChannelMuxCompletePdus(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_reads_(Count) const CHANNEL_TX_PDU* Pdus,
+    _In_ ULONG Count,
+    _In_ NTSTATUS Status
+)
+{
+    size_t charged = 0;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        PCHANNEL_SDU sdu = Pdus[i].Sdu;
+
+        // A lost ERTM frame is retransmitted on its own timer
+        if (Pdus[i].Flags & CHANNEL_PDU_FRAME) {
+            charged += Pdus[i].Length;
+            ExFreePoolWithTag((PVOID)Pdus[i].Data, CHANNEL_POOL_TAG);
+            continue;
+        }
+
+        if (!(sdu->Flags & CHANNEL_SDU_CHARGED)) {
+            charged += Pdus[i].Length;
+        }
+
+        if (Pdus[i].LastOfSdu) {
+            if (sdu->Complete != NULL) {
+                sdu->Complete(sdu->CompleteContext, sdu->Tag, Status);
+            }
+            if (sdu->Flags & CHANNEL_SDU_OWNS_DATA) {
+                ExFreePoolWithTag(sdu, CHANNEL_POOL_TAG);
+            }
+        }
+    }
+
+    if (charged != 0 && NT_SUCCESS(Status)) {
+        AdapterAccountAirtime(Mux->DeviceContext, charged);
+    }
+}
+
+/*++
+Routine Description:
+    Adds credits the peer granted to a channel, and restarts its queue
+
+Arguments:
+    Mux - Channel mux
+    Key - Channel
+    Credits - Credits granted
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+ChannelMuxGrantCredits(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ const CHANNEL_KEY* Key,
+    _In_ ULONG Credits
+)
+{
+    PCHANNEL channel;
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Mux->Lock, &irql);
+
+    channel = ChannelFind(Mux, Key, NULL, NULL);
+    if (channel == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else if (channel->Credits != CHANNEL_CREDITS_UNLIMITED) {
+        // LE credit-based flow control caps a channel at 65535 credits
+        channel->Credits = (ULONG)min((ULONG64)channel->Credits + Credits, 0xFFFFULL);
+    }
+
+    KeReleaseSpinLock(&Mux->Lock, irql);
+
+    if (NT_SUCCESS(status)) {
+        ChannelMuxKick(Mux, Key->DeviceAddress);
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Hands a frame from the peer to an ERTM channel. Called by the
+    receive path for every basic L2CAP frame on the channel's CID, FCS
+    included. SDUs the frame acknowledges complete before this returns,
+    and the transmit path is told if an acknowledgement or a selective
+    reject is now due.
+
+Arguments:
+    Mux - Channel mux
+    Key - Channel the frame arrived on
+    Frame - Length, CID, control field, information, FCS
+    Length - Frame length
+
+Return Value:
+    STATUS_NOT_FOUND if no ERTM channel is open on Key, STATUS_CRC_ERROR
+    if the frame was malformed or failed its FCS and was dropped
+--*/
+NTSTATUS
+ChannelMuxReceiveFrame(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ const CHANNEL_KEY* Key,
+    _In_reads_bytes_(Length) const UCHAR* Frame,
+    _In_ ULONG Length
+)
+{
+    PCHANNEL channel;
+    LIST_ENTRY acked;
+    NTSTATUS status = STATUS_SUCCESS;
+    BOOLEAN work = FALSE;
+    ULONG64 nowUs;
+    KIRQL irql;
+
+    InitializeListHead(&acked);
+
+    if (CaptureEnabled(&Mux->DeviceContext->Capture)) {
+        ChannelCapture(Mux, Key->DeviceAddress, Key->Cid, SNOOP_RECEIVED,
+            SNOOP_FRAMING_L2CAP_FRAME, Frame, Length);
+    }
+
+    KeAcquireSpinLock(&Mux->Lock, &irql);
+
+    nowUs = ChannelNowUs();
+    channel = Mux->ShuttingDown ? NULL : ChannelFind(Mux, Key, NULL, NULL);
+    if (channel == NULL || channel->Ertm == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else {
+        if (!ErtmReceiveFrame(channel->Ertm, nowUs, Frame, Length)) {
+            status = STATUS_CRC_ERROR;
+        }
+        ChannelMoveList(&acked, &channel->Acked);
+        work = ChannelHasWork(channel, nowUs);
+        ChannelMuxArmTimer(Mux, nowUs);
+    }
+
+    KeReleaseSpinLock(&Mux->Lock, irql);
+
+    ChannelCompleteSdus(&acked, STATUS_SUCCESS);
+
+    if (work) {
+        ChannelMuxKick(Mux, Key->DeviceAddress);
+    }
+
+    return status;
+}
+
+static CHANNEL_SDU_COMPLETE ChannelBulkPduComplete;
+
+// Each bulk PDU travels as one SDU; Tag is its transfer
+static VOID
+ChannelBulkPduComplete(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Tag,
+    _In_ NTSTATUS Status
+)
+{
+    BulkCompletePdus((PBULK_ENGINE)Context, Tag, 1, NT_SUCCESS(Status));
+}
+
+/*++
+Routine Description:
+    Bulk engine transmit hook. PDUs go to their channel's queue without
+    a copy, and each SDU completion returns the PDU to the engine. PDUs
+    for a channel that was never opened count as sent at once, as they
+    did without the mux.
+
+Arguments:
+    Context - The channel mux
+    Pdus - PDUs from the bulk engine
+    Count - Number of PDUs
+
+Return Value:
+    PDUs accepted; the rest are offered again later
+--*/
+ULONG
+ChannelMuxBulkSink(
+    _In_opt_ PVOID Context,
+    _In_reads_(Count) const BULK_PDU* Pdus,
+    _In_ ULONG Count
+)
+{
+    PCHANNEL_MUX mux = (PCHANNEL_MUX)Context;
+    PBULK_ENGINE engine;
+    CHANNEL_KEY key;
+    ULONG i;
+
+    if (mux == NULL || mux->ShuttingDown) {
+        return 0;
+    }
+
+    engine = &mux->DeviceContext->Bulk;
+    RtlZeroMemory(&key, sizeof(key));
+
+    for (i = 0; i < Count; i++) {
+        PCHANNEL_SDU sdu;
+        NTSTATUS status;
+
+        sdu = (PCHANNEL_SDU)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(CHANNEL_SDU), CHANNEL_POOL_TAG);
+        if (sdu == NULL) {
+            break;
+        }
+
+        sdu->Data = Pdus[i].Payload;
+        sdu->Length = Pdus[i].Length;
+        sdu->Complete = ChannelBulkPduComplete;
+        sdu->CompleteContext = engine;
+        sdu->Tag = Pdus[i].TransferId;
+        sdu->Flags = CHANNEL_SDU_CHARGED;
+
+        key.DeviceAddress = Pdus[i].DeviceAddress;
+        key.Cid = Pdus[i].Cid;
+
+        status = ChannelMuxEnqueue(mux, &key, sdu);
+        if (status == STATUS_NOT_FOUND || status == STATUS_CONNECTION_ABORTED) {
+            ExFreePoolWithTag(sdu, CHANNEL_POOL_TAG);
+            BulkCompletePdus(engine, Pdus[i].TransferId, 1, status == STATUS_NOT_FOUND);
+        } else if (!NT_SUCCESS(status)) {
+            ExFreePoolWithTag(sdu, CHANNEL_POOL_TAG);
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*++
+Routine Description:
+    Closes every channel, failing queued SDUs; called from device cleanup
+    before the bulk engine stops. PDUs already dequeued are the transmit
+    path's to complete.
+--*/
+VOID
+ChannelMuxCleanup(
+    _Inout_ PCHANNEL_MUX Mux
+)
+{
+    LIST_ENTRY failed;
+    PCHANNEL closed[CHANNEL_MAX_DEVICES * CHANNEL_MAX_PER_DEVICE];
+    ULONG closedCount = 0;
+    KIRQL irql;
+    ULONG d, c;
+
+    InitializeListHead(&failed);
+
+    KeAcquireSpinLock(&Mux->Lock, &irql);
+
+    Mux->ShuttingDown = TRUE;
+    for (d = 0; d < CHANNEL_MAX_DEVICES; d++) {
+        for (c = 0; c < CHANNEL_MAX_PER_DEVICE; c++) {
+            PCHANNEL channel = Mux->Devices[d].Channels[c];
+
+            if (channel != NULL) {
+                while (!IsListEmpty(&channel->Queue)) {
+                    InsertTailList(&failed, RemoveHeadList(&channel->Queue));
+                }
+                if (channel->Ertm != NULL) {
+                    ChannelErtmAbort(channel, &failed);
+                }
+                closed[closedCount++] = channel;
+                Mux->Devices[d].Channels[c] = NULL;
+            }
+        }
+        RtlZeroMemory(&Mux->Devices[d], sizeof(Mux->Devices[d]));
+    }
+
+    KeReleaseSpinLock(&Mux->Lock, irql);
+
+    // Waits for a running callback; nothing re-arms it once ShuttingDown is set
+    if (Mux->Timer != NULL) {
+        ExDeleteTimer(Mux->Timer, TRUE, TRUE, NULL);
+        Mux->Timer = NULL;
+    }
+
+    ChannelCompleteSdus(&failed, STATUS_DEVICE_REMOVED);
+
+    while (closedCount > 0) {
+        PCHANNEL channel = closed[--closedCount];
+
+        if (channel->Ertm != NULL) {
+            ExFreePoolWithTag(channel->Ertm, CHANNEL_POOL_TAG);
+        }
+        ExFreePoolWithTag(channel, CHANNEL_POOL_TAG);
+    }
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_CHANNEL_OPEN
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    BytesReturned - Receives 0
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleChannelOpen(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PCHANNEL_CONFIG config;
+    PCHANNEL_MUX mux = &DeviceContext->Channels;
+    PCHANNEL_DEVICE device = NULL;
+    PCHANNEL channel;
+    KIRQL irql;
+    ULONG i, slot = CHANNEL_MAX_PER_DEVICE;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(CHANNEL_CONFIG), (PVOID*)&config, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (config->Key.DeviceAddress == 0 || config->Class > ChannelClassBulk ||
+        config->Mode > ChannelModeErtm ||
+        config->Mps < CHANNEL_MPS_MIN || config->Weight > CHANNEL_WEIGHT_MAX ||
+        (config->Credits != CHANNEL_CREDITS_UNLIMITED && config->Credits > 0xFFFF)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (config->Mode == ChannelModeErtm) {
+        // ERTM windows its own I-frames; LE credits do not apply
+        if (config->Credits != CHANNEL_CREDITS_UNLIMITED || config->RemoteCid == 0 ||
+            config->Mps < ERTM_MPS_MIN || config->Mps > ERTM_MPS_MAX ||
+            config->TxWindow > ERTM_TX_WINDOW_MAX) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        // Frames dropped as "sent" would never be acknowledged
+        if (mux->Notify == NULL) {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        if (mux->Timer == NULL) {
+            PEX_TIMER timer = ExAllocateTimer(ChannelMuxTimerCallback, mux, EX_TIMER_HIGH_RESOLUTION);
+
+            if (timer == NULL) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            if (InterlockedCompareExchangePointer((PVOID volatile*)&mux->Timer, timer, NULL) != NULL) {
+                ExDeleteTimer(timer, TRUE, FALSE, NULL);
+            }
+        }
+    }
+
+    channel = (PCHANNEL)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(CHANNEL), CHANNEL_POOL_TAG);
+    if (channel == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    channel->Config = *config;
+    if (channel->Config.Weight == 0) {
+        channel->Config.Weight = ChannelDefaultWeight[config->Class];
+    }
+    channel->Sched.QuantumBytes = CHANNEL_QUANTUM_BYTES * channel->Config.Weight;
+    InitializeListHead(&channel->Queue);
+    InitializeListHead(&channel->Acked);
+    channel->Mux = mux;
+    channel->Credits = config->Credits;
+    channel->Stats.Key = config->Key;
+    channel->Stats.Class = config->Class;
+    channel->Stats.Mode = config->Mode;
+    channel->Stats.Weight = channel->Config.Weight;
+    channel->Stats.Credits = config->Credits;
+
+    if (config->Mode == ChannelModeErtm) {
+        ERTM_CONFIG ertm;
+
+        RtlZeroMemory(&ertm, sizeof(ertm));
+        ertm.RemoteCid = config->RemoteCid;
+        ertm.Mps = config->Mps;
+        ertm.TxWindow = config->TxWindow ? config->TxWindow : CHANNEL_ERTM_TX_WINDOW;
+        ertm.MaxTransmit = config->MaxTransmit ? config->MaxTransmit : CHANNEL_ERTM_MAX_TRANSMIT;
+        channel->Config.TxWindow = ertm.TxWindow;
+        channel->Config.MaxTransmit = ertm.MaxTransmit;
+
+        channel->Ertm = (PERTM_CHANNEL)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(ERTM_CHANNEL), CHANNEL_POOL_TAG);
+        if (channel->Ertm == NULL) {
+            ExFreePoolWithTag(channel, CHANNEL_POOL_TAG);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        ErtmInitialize(channel->Ertm, &ertm, ChannelErtmAcked, ChannelErtmReceived, channel);
+    }
+
+    KeAcquireSpinLock(&mux->Lock, &irql);
+
+    if (mux->ShuttingDown) {
+        status = STATUS_DEVICE_REMOVED;
+    } else if (ChannelFind(mux, &config->Key, NULL, NULL) != NULL) {
+        status = STATUS_OBJECT_NAME_COLLISION;
+    } else {
+        device = ChannelFindDevice(mux, config->Key.DeviceAddress);
+        for (i = 0; device == NULL && i < CHANNEL_MAX_DEVICES; i++) {
+            if (mux->Devices[i].DeviceAddress == 0) {
+                device = &mux->Devices[i];
+            }
+        }
+
+        for (i = 0; device != NULL && i < CHANNEL_MAX_PER_DEVICE; i++) {
+            if (device->Channels[i] == NULL) {
+                slot = i;
+                break;
+            }
+        }
+
+        if (slot == CHANNEL_MAX_PER_DEVICE) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        } else {
+            device->DeviceAddress = config->Key.DeviceAddress;
+            device->Sched.Slots = CHANNEL_MAX_PER_DEVICE;
+            device->Channels[slot] = channel;
+            device->Count++;
+        }
+    }
+
+    KeReleaseSpinLock(&mux->Lock, irql);
+
+    if (!NT_SUCCESS(status)) {
+        if (channel->Ertm != NULL) {
+            ExFreePoolWithTag(channel->Ertm, CHANNEL_POOL_TAG);
+        }
+        ExFreePoolWithTag(channel, CHANNEL_POOL_TAG);
+        return status;
+    }
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Channel %llx CID 0x%x DLCI %u open: class %u, weight %u, MPS %u, %s\n",
+        config->Key.DeviceAddress, config->Key.Cid, config->Key.Dlci, config->Class,
+        channel->Config.Weight, config->Mps, channel->Ertm != NULL ? "ERTM" : "basic"));
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_CHANNEL_CLOSE; queued SDUs, and ERTM SDUs not
+    yet acknowledged, complete with STATUS_CANCELLED
+--*/
+NTSTATUS
+HandleChannelClose(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PCHANNEL_KEY key;
+    PCHANNEL_MUX mux = &DeviceContext->Channels;
+    PCHANNEL_DEVICE device;
+    PCHANNEL channel;
+    LIST_ENTRY failed;
+    KIRQL irql;
+    ULONG slot;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(CHANNEL_KEY), (PVOID*)&key, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    InitializeListHead(&failed);
+
+    KeAcquireSpinLock(&mux->Lock, &irql);
+
+    channel = ChannelFind(mux, key, &device, &slot);
+    if (channel != NULL) {
+        while (!IsListEmpty(&channel->Queue)) {
+            InsertTailList(&failed, RemoveHeadList(&channel->Queue));
+        }
+        if (channel->Ertm != NULL) {
+            ChannelErtmAbort(channel, &failed);
+        }
+        device->Channels[slot] = NULL;
+        if (--device->Count == 0) {
+            RtlZeroMemory(device, sizeof(*device));
+        }
+    }
+
+    KeReleaseSpinLock(&mux->Lock, irql);
+
+    if (channel == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    ChannelCompleteSdus(&failed, STATUS_CANCELLED);
+    if (channel->Ertm != NULL) {
+        ExFreePoolWithTag(channel->Ertm, CHANNEL_POOL_TAG);
+    }
+    ExFreePoolWithTag(channel, CHANNEL_POOL_TAG);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Channel %llx CID 0x%x DLCI %u closed\n",
+        key->DeviceAddress, key->Cid, key->Dlci));
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_CHANNEL_SEND: copies the SDU and queues it.
+    STATUS_DEVICE_BUSY means the channel's queue is full; retry later.
+--*/
+NTSTATUS
+HandleChannelSend(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PCHANNEL_SEND_HEADER header;
+    PCHANNEL_SDU sdu;
+    size_t length;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(CHANNEL_SEND_HEADER), (PVOID*)&header, &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (header->Length == 0 || header->Length > CHANNEL_SDU_MAX ||
+        length - sizeof(CHANNEL_SEND_HEADER) < header->Length) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    sdu = (PCHANNEL_SDU)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        sizeof(CHANNEL_SDU) + header->Length, CHANNEL_POOL_TAG);
+    if (sdu == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(sdu + 1, header + 1, header->Length);
+    sdu->Data = (const UCHAR*)(sdu + 1);
+    sdu->Length = header->Length;
+    sdu->Flags = CHANNEL_SDU_OWNS_DATA;
+
+    status = ChannelMuxEnqueue(&DeviceContext->Channels, &header->Key, sdu);
+    if (!NT_SUCCESS(status)) {
+        ExFreePoolWithTag(sdu, CHANNEL_POOL_TAG);
+        return status;
+    }
+
+    DeviceContext->TotalPacketsProcessed++;
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_CHANNEL_CREDITS
+--*/
+NTSTATUS
+HandleChannelCredits(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PCHANNEL_CREDIT_GRANT grant;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(CHANNEL_CREDIT_GRANT), (PVOID*)&grant, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    return ChannelMuxGrantCredits(&DeviceContext->Channels, &grant->Key, grant->Credits);
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_CHANNEL_STATS
+--*/
+NTSTATUS
+HandleGetChannelStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBTH_ADDR address;
+    BTH_ADDR deviceAddress;
+    PCHANNEL_DEVICE_STATS stats;
+    PCHANNEL_MUX mux = &DeviceContext->Channels;
+    PCHANNEL_DEVICE device;
+    KIRQL irql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(BTH_ADDR), (PVOID*)&address, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    deviceAddress = *address;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(CHANNEL_DEVICE_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlZeroMemory(stats, sizeof(*stats));
+    stats->DeviceAddress = deviceAddress;
+
+    KeAcquireSpinLock(&mux->Lock, &irql);
+
+    device = ChannelFindDevice(mux, deviceAddress);
+    for (i = 0; device != NULL && i < CHANNEL_MAX_PER_DEVICE; i++) {
+        PCHANNEL channel = device->Channels[i];
+
+        if (channel != NULL) {
+            stats->Channels[stats->Count] = channel->Stats;
+            stats->Channels[stats->Count].Credits = channel->Credits;
+            stats->Channels[stats->Count].QueuedSdus = channel->Queued;
+            if (channel->Ertm != NULL) {
+                stats->Channels[stats->Count].Ertm = channel->Ertm->Stats;
+            }
+            stats->Count++;
+        }
+    }
+
+    KeReleaseSpinLock(&mux->Lock, irql);
+
+    if (device == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    *BytesReturned = sizeof(CHANNEL_DEVICE_STATS);
+    return STATUS_SUCCESS;
+}
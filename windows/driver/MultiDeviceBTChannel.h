@@ -0,0 +1,250 @@
+/*++
+
+Module Name:
+    MultiDeviceBTChannel.h
+
+Abstract:
+    Per-device logical channel multiplexer. Each L2CAP channel, or
+    RFCOMM DLC on top of one, that a device carries gets its own SDU
+    queue and its own peer credits. Channels of one device share the
+    device's transmit opportunities by weighted deficit round robin.
+    So a file transfer no longer delays control traffic on the same
+    link, and a channel out of credits no longer blocks the others. The
+    round itself is the portable MultiDeviceBTChannelSched.h.
+
+    A channel opened in Enhanced Retransmission Mode hands its SDUs to
+    an ERTM_CHANNEL and dequeues complete frames instead of segments.
+
+--*/
+
+#ifndef _MULTIDEVICEBTCHANNEL_H_
+#define _MULTIDEVICEBTCHANNEL_H_
+
+#include "MultiDeviceBTErtm.h"
+#include "MultiDeviceBTChannelSched.h"
+
+#define CHANNEL_MAX_DEVICES         MAX_BLUETOOTH_CONNECTIONS
+#define CHANNEL_MAX_PER_DEVICE      8
+#define CHANNEL_QUEUE_SDUS          64      // Queued per channel
+#define CHANNEL_SDU_MAX             4096    // IOCTL_MULTI_BT_CHANNEL_SEND payload
+#define CHANNEL_MPS_MIN             23
+#define CHANNEL_QUANTUM_BYTES       128     // Per round, per unit of weight
+#define CHANNEL_WEIGHT_MAX          64
+#define CHANNEL_TX_BATCH            16      // PDUs per dequeue when draining inline
+#define CHANNEL_CREDITS_UNLIMITED   0xFFFFFFFF  // Basic mode, or RFCOMM without credit flow
+#define CHANNEL_ERTM_TX_WINDOW      32      // Default for CHANNEL_CONFIG.TxWindow
+#define CHANNEL_ERTM_MAX_TRANSMIT   8       // Default for CHANNEL_CONFIG.MaxTransmit
+#define CHANNEL_POOL_TAG            'CDBM'
+
+typedef enum _CHANNEL_CLASS {
+    ChannelClassControl = 0,    // Default weight 8
+    ChannelClassStream = 1,     // Default weight 4
+    ChannelClassBulk = 2        // Default weight 1
+} CHANNEL_CLASS;
+
+typedef enum _CHANNEL_MODE {
+    ChannelModeBasic = 0,
+    ChannelModeErtm = 1         // Needs unlimited credits and an attached transmit path
+} CHANNEL_MODE;
+
+typedef struct _CHANNEL_KEY {
+    BTH_ADDR DeviceAddress;
+    USHORT Cid;                 // Local L2CAP channel
+    UCHAR Dlci;                 // RFCOMM DLC on that channel; 0 for the channel itself
+    UCHAR Reserved[5];
+} CHANNEL_KEY, *PCHANNEL_KEY;
+
+// IOCTL_MULTI_BT_CHANNEL_OPEN input
+typedef struct _CHANNEL_CONFIG {
+    CHANNEL_KEY Key;
+    UCHAR Class;                // CHANNEL_CLASS
+    UCHAR Mode;                 // CHANNEL_MODE
+    USHORT Mps;                 // Largest PDU payload the peer accepts
+    USHORT Weight;              // 0 selects the class default
+    USHORT Reserved2;
+    ULONG Credits;              // Initial peer credits, or CHANNEL_CREDITS_UNLIMITED
+    USHORT RemoteCid;           // ERTM: the peer's CID, written into each frame
+    UCHAR TxWindow;             // ERTM: 0 selects CHANNEL_ERTM_TX_WINDOW
+    UCHAR MaxTransmit;          // ERTM: 0 selects CHANNEL_ERTM_MAX_TRANSMIT
+} CHANNEL_CONFIG, *PCHANNEL_CONFIG;
+
+// IOCTL_MULTI_BT_CHANNEL_SEND input, followed by the SDU
+typedef struct _CHANNEL_SEND_HEADER {
+    CHANNEL_KEY Key;
+    ULONG Length;
+    ULONG Reserved;
+} CHANNEL_SEND_HEADER, *PCHANNEL_SEND_HEADER;
+
+// IOCTL_MULTI_BT_CHANNEL_CREDITS input: credits the peer granted
+typedef struct _CHANNEL_CREDIT_GRANT {
+    CHANNEL_KEY Key;
+    ULONG Credits;
+    ULONG Reserved;
+} CHANNEL_CREDIT_GRANT, *PCHANNEL_CREDIT_GRANT;
+
+typedef struct _CHANNEL_STATS {
+    CHANNEL_KEY Key;
+    UCHAR Class;
+    UCHAR Mode;
+    USHORT Weight;
+    ULONG Credits;
+    ULONG QueuedSdus;
+    ULONG SdusSent;
+    ULONG PdusSent;
+    ULONG Rejected;             // Queue full
+    ULONG CreditStalls;         // Ran out of credits with SDUs queued
+    ULONG WaitMaxUs;            // Enqueue to first PDU dequeued
+    ULONG WaitAvgUs;
+    ULONG64 BytesSent;
+    ERTM_STATS Ertm;            // Zero in basic mode
+} CHANNEL_STATS, *PCHANNEL_STATS;
+
+// IOCTL_MULTI_BT_GET_CHANNEL_STATS output; the input is the BTH_ADDR
+typedef struct _CHANNEL_DEVICE_STATS {
+    BTH_ADDR DeviceAddress;
+    ULONG Count;
+    ULONG Reserved;
+    CHANNEL_STATS Channels[CHANNEL_MAX_PER_DEVICE];
+} CHANNEL_DEVICE_STATS, *PCHANNEL_DEVICE_STATS;
+
+// Called once per SDU, at IRQL <= DISPATCH_LEVEL, outside the mux lock.
+// Status is STATUS_SUCCESS once the transmit path has sent the last PDU.
+typedef VOID
+CHANNEL_SDU_COMPLETE(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Tag,
+    _In_ NTSTATUS Status
+);
+typedef CHANNEL_SDU_COMPLETE *PCHANNEL_SDU_COMPLETE;
+
+// CHANNEL_SDU.Flags
+#define CHANNEL_SDU_CHARGED         0x01    // Producer already accounted the airtime
+#define CHANNEL_SDU_OWNS_DATA       0x02    // Data follows the header, in the same block
+
+typedef struct _CHANNEL_SDU {
+    LIST_ENTRY Link;
+    const UCHAR* Data;
+    ULONG Length;
+    ULONG Offset;               // Next byte to segment
+    LONGLONG Enqueued;          // Interrupt time
+    PCHANNEL_SDU_COMPLETE Complete;
+    PVOID CompleteContext;
+    ULONG Tag;
+    ULONG Flags;
+} CHANNEL_SDU, *PCHANNEL_SDU;
+
+// CHANNEL_TX_PDU.Flags
+#define CHANNEL_PDU_FRAME           0x0001  // Complete ERTM frame, header and FCS included; Sdu is NULL
+
+// One PDU for the transmit path. Data stays valid until the PDU is
+// returned with ChannelMuxCompletePdus.
+typedef struct _CHANNEL_TX_PDU {
+    USHORT Cid;
+    UCHAR Dlci;
+    BOOLEAN LastOfSdu;
+    USHORT Length;
+    USHORT Flags;
+    const UCHAR* Data;
+    PCHANNEL_SDU Sdu;
+} CHANNEL_TX_PDU, *PCHANNEL_TX_PDU;
+
+// Transmit path notification: the device has PDUs ready to dequeue
+typedef VOID
+CHANNEL_TX_NOTIFY(
+    _In_opt_ PVOID Context,
+    _In_ BTH_ADDR DeviceAddress
+);
+typedef CHANNEL_TX_NOTIFY *PCHANNEL_TX_NOTIFY;
+
+// Receive path delivery: an SDU reassembled on an ERTM channel. Called
+// at DISPATCH_LEVEL with the mux lock held; Data is valid only for the
+// call, and the handler must not call back into the mux.
+typedef VOID
+CHANNEL_SDU_RECEIVED(
+    _In_opt_ PVOID Context,
+    _In_ const CHANNEL_KEY* Key,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+);
+typedef CHANNEL_SDU_RECEIVED *PCHANNEL_SDU_RECEIVED;
+
+typedef struct _CHANNEL {
+    CHANNEL_CONFIG Config;      // Weight resolved
+    LIST_ENTRY Queue;
+    ULONG Queued;
+    ULONG Credits;
+    CHANNEL_SCHED_FLOW Sched;   // Quantum CHANNEL_QUANTUM_BYTES times the weight
+    ULONG64 WaitSumUs;
+    PERTM_CHANNEL Ertm;         // NULL in basic mode
+    LIST_ENTRY Acked;           // SDUs ERTM acknowledged; completed once the lock drops
+    struct _CHANNEL_MUX* Mux;
+    CHANNEL_STATS Stats;
+} CHANNEL, *PCHANNEL;
+
+typedef struct _CHANNEL_DEVICE {
+    BTH_ADDR DeviceAddress;     // 0 when unused
+    ULONG Count;
+    CHANNEL_SCHED Sched;
+    PCHANNEL Channels[CHANNEL_MAX_PER_DEVICE];
+} CHANNEL_DEVICE, *PCHANNEL_DEVICE;
+
+// One mux per adapter device context. Everything is under Lock; SDU
+// completions run after it is dropped.
+typedef struct _CHANNEL_MUX {
+    KSPIN_LOCK Lock;
+    CHANNEL_DEVICE Devices[CHANNEL_MAX_DEVICES];
+    struct _DEVICE_CONTEXT* DeviceContext;
+    PCHANNEL_TX_NOTIFY Notify;  // NULL until a transmit path attaches: queues drain inline
+    PVOID NotifyContext;
+    PCHANNEL_SDU_RECEIVED Receive;  // NULL until a receive path attaches: SDUs are dropped
+    PVOID ReceiveContext;
+    PEX_TIMER Timer;            // ERTM retransmission and ack deadlines; allocated with the first ERTM channel
+    ULONG64 TimerDueUs;         // Interrupt time in us; 0 when not armed
+    BOOLEAN ShuttingDown;
+} CHANNEL_MUX, *PCHANNEL_MUX;
+
+VOID ChannelMuxInitialize(
+    _Out_ PCHANNEL_MUX Mux,
+    _In_ struct _DEVICE_CONTEXT* DeviceContext
+);
+
+VOID ChannelMuxCleanup(
+    _Inout_ PCHANNEL_MUX Mux
+);
+
+NTSTATUS ChannelMuxEnqueue(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ const CHANNEL_KEY* Key,
+    _Inout_ PCHANNEL_SDU Sdu
+);
+
+ULONG ChannelMuxDequeue(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ ULONG MaxPdus,
+    _Out_writes_to_(MaxPdus, return) PCHANNEL_TX_PDU Pdus
+);
+
+VOID ChannelMuxCompletePdus(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_reads_(Count) const CHANNEL_TX_PDU* Pdus,
+    _In_ ULONG Count,
+    _In_ NTSTATUS Status
+);
+
+NTSTATUS ChannelMuxReceiveFrame(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ const CHANNEL_KEY* Key,
+    _In_reads_bytes_(Length) const UCHAR* Frame,
+    _In_ ULONG Length
+);
+
+NTSTATUS ChannelMuxGrantCredits(
+    _Inout_ PCHANNEL_MUX Mux,
+    _In_ const CHANNEL_KEY* Key,
+    _In_ ULONG Credits
+);
+
+BULK_PDU_SINK ChannelMuxBulkSink;
+
+#endif // _MULTIDEVICEBTCHANNEL_H_
@@ -0,0 +1,117 @@
+/*++
+
+Module Name:
+    MultiDeviceBTChannelSched.c
+
+Abstract:
+    Weighted deficit round robin across the channels of one device.
+
+    A backlogged channel earns its quantum, CHANNEL_QUANTUM_BYTES times
+    its weight, once per visit. It sends PDUs while its deficit covers
+    them. When the next PDU does not fit, the visit ends and the rest
+    of the deficit carries into the next round, so a channel of large
+    PDUs still gets its share. A channel with nothing queued, or with no
+    credits, is skipped and keeps no deficit. A control channel
+    therefore waits at most one round of the others' quanta, whatever
+    the depth of the bulk queue.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTChannelSched.h"
+
+static __forceinline VOID
+ChannelSchedNext(
+    _Inout_ PCHANNEL_SCHED Sched
+)
+{
+    Sched->Current = (Sched->Current + 1) % Sched->Slots;
+}
+
+/*++
+Routine Description:
+    Finds the next channel with something to send, starting at the
+    current position, and opens its visit
+
+Arguments:
+    Sched - Device's round
+    Probe - Reports each slot's flow and whether it is ready
+    Context - Passed to Probe
+
+Return Value:
+    Slot to serve, or CHANNEL_SCHED_NONE
+--*/
+ULONG
+ChannelSchedSelect(
+    _Inout_ PCHANNEL_SCHED Sched,
+    _In_ PCHANNEL_SCHED_PROBE Probe,
+    _In_opt_ PVOID Context
+)
+{
+    ULONG scanned;
+
+    for (scanned = 0; scanned < Sched->Slots; scanned++) {
+        BOOLEAN ready = FALSE;
+        PCHANNEL_SCHED_FLOW flow = Probe(Context, Sched->Current, &ready);
+
+        if (flow != NULL) {
+            if (ready) {
+                if (!flow->InRound) {
+                    flow->InRound = TRUE;
+                    flow->Deficit += (LONG)flow->QuantumBytes;
+                }
+                return Sched->Current;
+            }
+            flow->Deficit = 0;
+            flow->InRound = FALSE;
+        }
+        ChannelSchedNext(Sched);
+    }
+
+    return CHANNEL_SCHED_NONE;
+}
+
+BOOLEAN
+ChannelSchedAdmit(
+    _Inout_ PCHANNEL_SCHED Sched,
+    _Inout_ PCHANNEL_SCHED_FLOW Flow,
+    _In_ ULONG Length
+)
+{
+    if (Flow->Deficit >= (LONG)Length) {
+        return TRUE;
+    }
+
+    Flow->InRound = FALSE;
+    ChannelSchedNext(Sched);
+    return FALSE;
+}
+
+VOID
+ChannelSchedCharge(
+    _Inout_ PCHANNEL_SCHED Sched,
+    _Inout_ PCHANNEL_SCHED_FLOW Flow,
+    _In_ ULONG Length,
+    _In_ BOOLEAN Drained
+)
+{
+    Flow->Deficit -= (LONG)Length;
+
+    if (Drained) {
+        Flow->Deficit = 0;
+        Flow->InRound = FALSE;
+        ChannelSchedNext(Sched);
+    }
+}
@@ -0,0 +1,71 @@
+/*++
+
+Module Name:
+    MultiDeviceBTChannelSched.h
+
+Abstract:
+    Weighted deficit round robin across the channels of one device.
+    Each visit to a backlogged channel earns it its quantum; it sends
+    while its deficit covers the next PDU, and a channel with nothing it
+    may send keeps no deficit.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the channels' queues and credits, through the probe, and
+    any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTCHANNELSCHED_H_
+#define _MULTIDEVICEBTCHANNELSCHED_H_
+
+#define CHANNEL_SCHED_NONE          MAXULONG
+
+// Scheduling state of one channel
+typedef struct _CHANNEL_SCHED_FLOW {
+    ULONG QuantumBytes;         // Earned per round
+    LONG Deficit;               // Bytes this channel may still send in the current round
+    BOOLEAN InRound;            // Quantum for this visit already added
+} CHANNEL_SCHED_FLOW, *PCHANNEL_SCHED_FLOW;
+
+// One device's round
+typedef struct _CHANNEL_SCHED {
+    ULONG Slots;
+    ULONG Current;              // Round robin position
+} CHANNEL_SCHED, *PCHANNEL_SCHED;
+
+// Returns the flow in Slot, or NULL for an empty slot. Ready receives
+// whether the channel has a PDU it may send now.
+typedef PCHANNEL_SCHED_FLOW
+CHANNEL_SCHED_PROBE(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Slot,
+    _Out_ PBOOLEAN Ready
+);
+typedef CHANNEL_SCHED_PROBE *PCHANNEL_SCHED_PROBE;
+
+// Returns the slot to serve next, with its quantum for this visit
+// added, or CHANNEL_SCHED_NONE when no channel is ready
+ULONG ChannelSchedSelect(
+    _Inout_ PCHANNEL_SCHED Sched,
+    _In_ PCHANNEL_SCHED_PROBE Probe,
+    _In_opt_ PVOID Context
+);
+
+// TRUE if Flow's deficit covers a PDU of Length bytes. If not, its
+// visit ends and the deficit carries into the next round; select again.
+BOOLEAN ChannelSchedAdmit(
+    _Inout_ PCHANNEL_SCHED Sched,
+    _Inout_ PCHANNEL_SCHED_FLOW Flow,
+    _In_ ULONG Length
+);
+
+// Charges a PDU admitted above. Drained: the channel has nothing more
+// it may send, so it gives up its deficit and the round moves on.
+VOID ChannelSchedCharge(
+    _Inout_ PCHANNEL_SCHED Sched,
+    _Inout_ PCHANNEL_SCHED_FLOW Flow,
+    _In_ ULONG Length,
+    _In_ BOOLEAN Drained
+);
+
+#endif // _MULTIDEVICEBTCHANNELSCHED_H_
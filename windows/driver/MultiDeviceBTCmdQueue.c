@@ -0,0 +1,507 @@
+/*++
+
+Module Name:
+    MultiDeviceBTCmdQueue.c
+
+Abstract:
+    HCI command scheduler with credit-based pipelining and merging.
+
+    The controller says how many command packets it will take through
+    Num_HCI_Command_Packets in every Command Complete and Command Status
+    event. The value is absolute, not an increment, and the host may
+    assume one before the first event. Sending one command at a time
+    and waiting for its event leaves the controller idle for a round
+    trip per command. That round trip is dominated by the event
+    transport (a USB interrupt endpoint is polled every millisecond),
+    so it can be much longer than the command itself takes to run.
+
+    Entries live in caller-supplied storage and are linked by index:
+    a free list, one waiting FIFO per priority and an in-flight list in
+    the order sent. CmdQueueNext takes the head of the highest-priority
+    FIFO while credits remain. Once a lower-priority command has waited
+    CMDQ_MAX_WAIT_US, it goes first instead, so a stream of urgent work
+    cannot starve it.
+
+    Commands on one connection handle (connection update, PHY, data
+    length, link policy) or one accept-list address carry a merge key,
+    as do host channel classifications, which have one key each:
+    - A queued command with the same key is overwritten in place by
+      the newer parameters and keeps its place, taking the higher of
+      the two priorities.
+    - A later Add or Remove supersedes a queued Add for the address.
+      A queued Remove is only superseded by another Remove; an Add
+      after it must still run after it.
+    - Commands with the same key go out in submission order, one at a
+      time. A second connection update for a handle would only collide
+      with the one the controller is running.
+
+    An acknowledgement completes the oldest in-flight command with its
+    opcode. Events for commands the scheduler did not send still update
+    the credits. A command unacknowledged for CMDQ_TIMEOUT_US is dropped,
+    and if no credits remain, one is restored.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTCmdQueue.h"
+
+static VOID
+CmdQueueAppend(
+    _Inout_ PCMDQ Queue,
+    _Inout_ PCMDQ_LIST List,
+    _In_ ULONG Index
+)
+{
+    Queue->Entries[Index].Next = CMDQ_NONE;
+
+    if (List->Tail == CMDQ_NONE) {
+        List->Head = Index;
+    } else {
+        Queue->Entries[List->Tail].Next = Index;
+    }
+    List->Tail = Index;
+}
+
+static VOID
+CmdQueueUnlink(
+    _Inout_ PCMDQ Queue,
+    _Inout_ PCMDQ_LIST List,
+    _In_ ULONG Index
+)
+{
+    ULONG previous = CMDQ_NONE;
+    ULONG i;
+
+    for (i = List->Head; i != Index; i = Queue->Entries[i].Next) {
+        previous = i;
+    }
+
+    if (previous == CMDQ_NONE) {
+        List->Head = Queue->Entries[Index].Next;
+    } else {
+        Queue->Entries[previous].Next = Queue->Entries[Index].Next;
+    }
+
+    if (List->Tail == Index) {
+        List->Tail = previous;
+    }
+}
+
+static VOID
+CmdQueueRelease(
+    _Inout_ PCMDQ Queue,
+    _In_ ULONG Index
+)
+{
+    Queue->Entries[Index].State = CMDQ_FREE;
+    Queue->Entries[Index].Next = Queue->Free;
+    Queue->Free = Index;
+}
+
+/*++
+Routine Description:
+    Computes a command's merge key: the opcode above the connection
+    handle or the accept-list address, or the opcode alone. Add and Remove share the Add
+    opcode so that they find each other.
+
+Return Value:
+    The key, or 0 for commands that never merge
+--*/
+static ULONG64
+CmdQueueKey(
+    _In_ USHORT Opcode,
+    _In_reads_bytes_(Length) const UCHAR* Parameters,
+    _In_ ULONG Length
+)
+{
+    ULONG64 address = 0;
+    ULONG i;
+
+    switch (Opcode) {
+    case HCI_OP_WRITE_LINK_POLICY:
+    case HCI_OP_READ_RSSI:
+    case HCI_OP_LE_CONNECTION_UPDATE:
+    case HCI_OP_LE_SET_DATA_LENGTH:
+    case HCI_OP_LE_SET_PHY:
+        if (Length < 2) {
+            return 0;
+        }
+        return ((ULONG64)Opcode << 48) | ((Parameters[0] | (Parameters[1] << 8)) & 0x0FFF);
+
+    case HCI_OP_LE_ADD_ACCEPT_LIST:
+    case HCI_OP_LE_REMOVE_ACCEPT_LIST:
+        if (Length < 7) {
+            return 0;
+        }
+        for (i = 0; i < 6; i++) {
+            address |= (ULONG64)Parameters[1 + i] << (8 * i);
+        }
+        // The address type goes in with the opcode, so a public and a
+        // random address with the same value stay apart
+        return ((ULONG64)HCI_OP_LE_ADD_ACCEPT_LIST << 48) ^ ((ULONG64)Parameters[0] << 48) ^ address;
+
+    case HCI_OP_SET_AFH_CLASSIFICATION:
+    case HCI_OP_LE_SET_HOST_CLASSIFICATION:
+        // Only the newest map matters
+        return (ULONG64)Opcode << 48;
+    }
+
+    return 0;
+}
+
+/*++
+Routine Description:
+    Tells whether a command may be sent: nothing with its key was
+    submitted before it and is still queued or in flight
+--*/
+static BOOLEAN
+CmdQueueEligible(
+    _In_ PCMDQ Queue,
+    _In_ ULONG Index
+)
+{
+    const CMDQ_ENTRY* entry = &Queue->Entries[Index];
+    const CMDQ_ENTRY* other;
+    ULONG i;
+
+    if (entry->Key == 0) {
+        return TRUE;
+    }
+
+    for (i = 0; i < Queue->Capacity; i++) {
+        other = &Queue->Entries[i];
+        if (i != Index && other->State != CMDQ_FREE && other->Key == entry->Key &&
+            (LONG)(other->Id - entry->Id) < 0) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*++
+Routine Description:
+    Initializes an empty scheduler. One credit is assumed until the
+    controller reports otherwise.
+
+Arguments:
+    Queue - Scheduler to initialize
+    Entries - Storage for the commands, queued and in flight
+    Capacity - Number of entries
+--*/
+VOID
+CmdQueueInitialize(
+    _Out_ PCMDQ Queue,
+    _Out_writes_(Capacity) PCMDQ_ENTRY Entries,
+    _In_ ULONG Capacity
+)
+{
+    ULONG i;
+
+    RtlZeroMemory(Queue, sizeof(*Queue));
+    Queue->Entries = Entries;
+    Queue->Capacity = Capacity;
+    Queue->NextId = 1;
+    Queue->Free = CMDQ_NONE;
+    Queue->InFlight.Head = Queue->InFlight.Tail = CMDQ_NONE;
+    Queue->Stats.Credits = 1;
+
+    for (i = 0; i < CMDQ_PRIORITIES; i++) {
+        Queue->Waiting[i].Head = Queue->Waiting[i].Tail = CMDQ_NONE;
+    }
+
+    for (i = Capacity; i-- > 0; ) {
+        Entries[i].State = CMDQ_FREE;
+        Entries[i].Next = Queue->Free;
+        Queue->Free = i;
+    }
+}
+
+/*++
+Routine Description:
+    Queues a command, or folds it into a queued command it makes
+    redundant
+
+Arguments:
+    Queue - Scheduler
+    Opcode - HCI opcode
+    Priority - 0 (most urgent) to CMDQ_PRIORITIES - 1
+    Parameters - Command parameters
+    Length - Parameter bytes
+    NowUs - Current time
+    Id - Receives the command's id; for a merge, the id of the command
+         it was folded into
+    Merged - Optionally receives whether it was folded
+
+Return Value:
+    STATUS_SUCCESS
+    STATUS_INVALID_PARAMETER for a bad priority or length
+    STATUS_INSUFFICIENT_RESOURCES when every entry is in use
+--*/
+NTSTATUS
+CmdQueueSubmit(
+    _Inout_ PCMDQ Queue,
+    _In_ USHORT Opcode,
+    _In_ UCHAR Priority,
+    _In_reads_bytes_opt_(Length) const UCHAR* Parameters,
+    _In_ ULONG Length,
+    _In_ ULONG64 NowUs,
+    _Out_ PULONG Id,
+    _Out_opt_ PBOOLEAN Merged
+)
+{
+    PCMDQ_ENTRY entry = NULL;
+    PCMDQ_ENTRY other;
+    ULONG64 key;
+    ULONG index = CMDQ_NONE;
+    ULONG i;
+
+    *Id = 0;
+    if (Merged != NULL) {
+        *Merged = FALSE;
+    }
+
+    if (Priority >= CMDQ_PRIORITIES || Length > CMDQ_MAX_PARAMETERS ||
+        (Length != 0 && Parameters == NULL)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    key = CmdQueueKey(Opcode, Parameters, Length);
+
+    // The newest queued command with the same key decides
+    if (key != 0) {
+        for (i = 0; i < Queue->Capacity; i++) {
+            other = &Queue->Entries[i];
+            if (other->State == CMDQ_QUEUED && other->Key == key &&
+                (entry == NULL || (LONG)(other->Id - entry->Id) > 0)) {
+                entry = other;
+                index = i;
+            }
+        }
+
+        if (entry != NULL && entry->Opcode == HCI_OP_LE_REMOVE_ACCEPT_LIST &&
+            Opcode == HCI_OP_LE_ADD_ACCEPT_LIST) {
+            entry = NULL;
+        }
+    }
+
+    if (entry != NULL) {
+        if (Priority < entry->Priority) {
+            CmdQueueUnlink(Queue, &Queue->Waiting[entry->Priority], index);
+            CmdQueueAppend(Queue, &Queue->Waiting[Priority], index);
+            entry->Priority = Priority;
+        }
+        Queue->Stats.Merged++;
+        if (Merged != NULL) {
+            *Merged = TRUE;
+        }
+    } else {
+        if (Queue->Free == CMDQ_NONE) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        index = Queue->Free;
+        entry = &Queue->Entries[index];
+        Queue->Free = entry->Next;
+
+        entry->Id = Queue->NextId++;
+        if (Queue->NextId == 0) {
+            Queue->NextId = 1;
+        }
+        entry->State = CMDQ_QUEUED;
+        entry->Priority = Priority;
+        entry->QueuedUs = NowUs;
+        entry->SentUs = 0;
+        entry->Key = key;
+        CmdQueueAppend(Queue, &Queue->Waiting[Priority], index);
+        Queue->Stats.Queued++;
+    }
+
+    entry->Opcode = Opcode;
+    entry->Packet[0] = (UCHAR)Opcode;
+    entry->Packet[1] = (UCHAR)(Opcode >> 8);
+    entry->Packet[2] = (UCHAR)Length;
+    if (Length != 0) {
+        RtlCopyMemory(&entry->Packet[CMDQ_HEADER_BYTES], Parameters, Length);
+    }
+
+    Queue->Stats.Submitted++;
+    *Id = entry->Id;
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Takes the next command to send, if the controller has a credit for
+    it, and moves it in flight. The caller sends Packet, which is
+    CMDQ_HEADER_BYTES + Packet[2] bytes long and stays valid until the
+    command is acknowledged or times out.
+
+Arguments:
+    Queue - Scheduler
+    NowUs - Current time
+
+Return Value:
+    The command to send, or NULL
+--*/
+const CMDQ_ENTRY*
+CmdQueueNext(
+    _Inout_ PCMDQ Queue,
+    _In_ ULONG64 NowUs
+)
+{
+    PCMDQ_ENTRY entry;
+    ULONG candidate[CMDQ_PRIORITIES];
+    ULONG pick = CMDQ_NONE;
+    ULONG aged = CMDQ_NONE;
+    ULONG index;
+    ULONG p;
+
+    // Oldest first: a lost event would otherwise hold back its key forever
+    while ((index = Queue->InFlight.Head) != CMDQ_NONE &&
+           NowUs - Queue->Entries[index].SentUs >= CMDQ_TIMEOUT_US) {
+        CmdQueueUnlink(Queue, &Queue->InFlight, index);
+        CmdQueueRelease(Queue, index);
+        Queue->Stats.InFlight--;
+        Queue->Stats.TimedOut++;
+        if (Queue->Stats.Credits == 0) {
+            Queue->Stats.Credits = 1;
+        }
+    }
+
+    if (Queue->Stats.Credits == 0) {
+        return NULL;
+    }
+
+    for (p = 0; p < CMDQ_PRIORITIES; p++) {
+        candidate[p] = CMDQ_NONE;
+        for (index = Queue->Waiting[p].Head; index != CMDQ_NONE; index = Queue->Entries[index].Next) {
+            if (CmdQueueEligible(Queue, index)) {
+                candidate[p] = index;
+                break;
+            }
+        }
+
+        if (candidate[p] == CMDQ_NONE) {
+            continue;
+        }
+
+        if (pick == CMDQ_NONE) {
+            pick = candidate[p];
+        }
+
+        if (NowUs - Queue->Entries[candidate[p]].QueuedUs >= CMDQ_MAX_WAIT_US &&
+            (aged == CMDQ_NONE || Queue->Entries[candidate[p]].QueuedUs < Queue->Entries[aged].QueuedUs)) {
+            aged = candidate[p];
+        }
+    }
+
+    if (pick == CMDQ_NONE) {
+        return NULL;
+    }
+
+    if (aged != CMDQ_NONE && aged != pick) {
+        pick = aged;
+        Queue->Stats.Aged++;
+    }
+
+    entry = &Queue->Entries[pick];
+    CmdQueueUnlink(Queue, &Queue->Waiting[entry->Priority], pick);
+    CmdQueueAppend(Queue, &Queue->InFlight, pick);
+    entry->State = CMDQ_IN_FLIGHT;
+    entry->SentUs = NowUs;
+
+    Queue->Stats.Credits--;
+    Queue->Stats.Queued--;
+    Queue->Stats.InFlight++;
+    Queue->Stats.Sent++;
+    if (Queue->Stats.InFlight > Queue->Stats.MaxInFlight) {
+        Queue->Stats.MaxInFlight = Queue->Stats.InFlight;
+    }
+
+    return entry;
+}
+
+/*++
+Routine Description:
+    Applies a Command Complete or Command Status event: takes the
+    controller's credit count and completes the oldest in-flight
+    command with the opcode
+
+Arguments:
+    Queue - Scheduler
+    Opcode - Command_Opcode from the event; 0 only updates the credits
+    NumCommandPackets - Num_HCI_Command_Packets from the event
+    Status - Command status, or the first return parameter
+    NowUs - Current time
+    Id - Optionally receives the completed command's id, 0 if none
+
+Return Value:
+    TRUE if an in-flight command was completed
+--*/
+BOOLEAN
+CmdQueueAcknowledge(
+    _Inout_ PCMDQ Queue,
+    _In_ USHORT Opcode,
+    _In_ UCHAR NumCommandPackets,
+    _In_ UCHAR Status,
+    _In_ ULONG64 NowUs,
+    _Out_opt_ PULONG Id
+)
+{
+    PCMDQ_ENTRY entry;
+    ULONG latency;
+    ULONG index;
+
+    Queue->Stats.Credits = NumCommandPackets;
+
+    if (Id != NULL) {
+        *Id = 0;
+    }
+
+    if (Opcode == 0) {
+        return FALSE;
+    }
+
+    for (index = Queue->InFlight.Head; index != CMDQ_NONE; index = Queue->Entries[index].Next) {
+        if (Queue->Entries[index].Opcode == Opcode) {
+            break;
+        }
+    }
+
+    if (index == CMDQ_NONE) {
+        return FALSE;
+    }
+
+    entry = &Queue->Entries[index];
+    latency = (ULONG)(NowUs - entry->QueuedUs);
+
+    Queue->Stats.LastLatencyUs = latency;
+    if (latency > Queue->Stats.MaxLatencyUs) {
+        Queue->Stats.MaxLatencyUs = latency;
+    }
+    Queue->Stats.Completed++;
+    if (Status != 0) {
+        Queue->Stats.Failed++;
+    }
+
+    if (Id != NULL) {
+        *Id = entry->Id;
+    }
+
+    CmdQueueUnlink(Queue, &Queue->InFlight, index);
+    CmdQueueRelease(Queue, index);
+    Queue->Stats.InFlight--;
+
+    return TRUE;
+}
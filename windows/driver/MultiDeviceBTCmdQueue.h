@@ -0,0 +1,120 @@
+/*++
+
+Module Name:
+    MultiDeviceBTCmdQueue.h
+
+Abstract:
+    HCI command scheduler. Commands wait in one FIFO per priority and
+    go to the controller as long as it has command credits: the
+    Num_HCI_Command_Packets of the latest Command Complete or Command
+    Status event, so several can be in flight at once. A queued
+    command that a newer one makes redundant, such as an earlier
+    connection update for the same handle, is overwritten in place
+    instead of being sent twice.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the time, the storage and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTCMDQUEUE_H_
+#define _MULTIDEVICEBTCMDQUEUE_H_
+
+#define CMDQ_HEADER_BYTES           3       // Opcode, parameter length
+#define CMDQ_MAX_PARAMETERS         255
+#define CMDQ_PRIORITIES             4       // Same order as CONNECTION_PRIORITY
+#define CMDQ_MAX_WAIT_US            100000  // A command waiting this long goes next, whatever its priority
+#define CMDQ_TIMEOUT_US             2000000 // Unacknowledged for this long: assume lost
+#define CMDQ_NONE                   0xFFFFFFFF
+
+// Opcodes the scheduler merges (OGF << 10 | OCF)
+#define HCI_OP_WRITE_LINK_POLICY            0x080D
+#define HCI_OP_SET_AFH_CLASSIFICATION       0x0C3F
+#define HCI_OP_READ_RSSI                    0x1405
+#define HCI_OP_LE_SET_HOST_CLASSIFICATION   0x2014
+#define HCI_OP_LE_ADD_ACCEPT_LIST           0x2011
+#define HCI_OP_LE_REMOVE_ACCEPT_LIST        0x2012
+#define HCI_OP_LE_CONNECTION_UPDATE         0x2013
+#define HCI_OP_LE_SET_DATA_LENGTH           0x2022
+#define HCI_OP_LE_SET_PHY                   0x2032
+
+// CMDQ_ENTRY.State
+#define CMDQ_FREE                   0
+#define CMDQ_QUEUED                 1
+#define CMDQ_IN_FLIGHT              2
+
+typedef struct _CMDQ_ENTRY {
+    ULONG Id;
+    ULONG Next;                 // Within its list; CMDQ_NONE at the tail
+    ULONG64 QueuedUs;
+    ULONG64 SentUs;
+    ULONG64 Key;                // Merge key; 0 when the command never merges
+    UCHAR State;                // CMDQ_*
+    UCHAR Priority;
+    USHORT Opcode;
+    UCHAR Packet[CMDQ_HEADER_BYTES + CMDQ_MAX_PARAMETERS];  // As sent
+} CMDQ_ENTRY, *PCMDQ_ENTRY;
+
+typedef struct _CMDQ_STATS {
+    ULONG Queued;
+    ULONG InFlight;
+    ULONG Credits;
+    ULONG MaxInFlight;
+    ULONG64 Submitted;
+    ULONG64 Merged;             // Folded into a queued command
+    ULONG64 Sent;
+    ULONG64 Completed;
+    ULONG64 Failed;             // Acknowledged with a non-zero status
+    ULONG64 TimedOut;
+    ULONG64 Aged;               // Sent ahead of higher priorities after CMDQ_MAX_WAIT_US
+    ULONG LastLatencyUs;        // Queued to acknowledged
+    ULONG MaxLatencyUs;
+} CMDQ_STATS, *PCMDQ_STATS;
+
+typedef struct _CMDQ_LIST {
+    ULONG Head;
+    ULONG Tail;
+} CMDQ_LIST, *PCMDQ_LIST;
+
+typedef struct _CMDQ {
+    PCMDQ_ENTRY Entries;
+    ULONG Capacity;
+    ULONG NextId;
+    ULONG Free;                 // Singly linked through Next
+    CMDQ_LIST Waiting[CMDQ_PRIORITIES];
+    CMDQ_LIST InFlight;         // In the order sent
+    CMDQ_STATS Stats;
+} CMDQ, *PCMDQ;
+
+VOID CmdQueueInitialize(
+    _Out_ PCMDQ Queue,
+    _Out_writes_(Capacity) PCMDQ_ENTRY Entries,
+    _In_ ULONG Capacity
+);
+
+NTSTATUS CmdQueueSubmit(
+    _Inout_ PCMDQ Queue,
+    _In_ USHORT Opcode,
+    _In_ UCHAR Priority,
+    _In_reads_bytes_opt_(Length) const UCHAR* Parameters,
+    _In_ ULONG Length,
+    _In_ ULONG64 NowUs,
+    _Out_ PULONG Id,
+    _Out_opt_ PBOOLEAN Merged
+);
+
+const CMDQ_ENTRY* CmdQueueNext(
+    _Inout_ PCMDQ Queue,
+    _In_ ULONG64 NowUs
+);
+
+BOOLEAN CmdQueueAcknowledge(
+    _Inout_ PCMDQ Queue,
+    _In_ USHORT Opcode,
+    _In_ UCHAR NumCommandPackets,
+    _In_ UCHAR Status,
+    _In_ ULONG64 NowUs,
+    _Out_opt_ PULONG Id
+);
+
+#endif // _MULTIDEVICEBTCMDQUEUE_H_
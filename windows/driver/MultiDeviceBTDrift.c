@@ -0,0 +1,664 @@
+/*++
+
+Module Name:
+    MultiDeviceBTDrift.c
+
+Abstract:
+    Keeps several sinks playing the same stream in step, although each
+    sink's DAC clock runs at its own rate.
+
+    Estimator. Completion reports pair a host timestamp with the sink's
+    count of samples played. A least squares line over a sliding window
+    of those pairs gives:
+    - the slope: the sink's true sample rate on the host clock;
+    - the intercept: where the sink is now, with the report jitter
+      averaged out.
+
+    Resampler. Each sink has an asynchronous polyphase windowed-sinc
+    resampler: 64 taps, 256 phases, linear interpolation between phases.
+    Its ratio is the sink's rate correction plus a proportional term
+    that pulls its playback position onto the reference sink's. Each
+    output tap sum runs as an SSE4.1 or AVX2 dot product.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define DRIFT_X86 1
+#include <immintrin.h>
+#else
+#define DRIFT_X86 0
+#endif
+
+#include "MultiDeviceBTDrift.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define DRIFT_TARGET_SSE41          __attribute__((target("sse4.1")))
+#define DRIFT_TARGET_AVX2           __attribute__((target("avx2")))
+#else
+#define DRIFT_TARGET_SSE41
+#define DRIFT_TARGET_AVX2
+#endif
+
+#define RESAMPLER_CUTOFF            0.90    // Of the input Nyquist frequency
+#define RESAMPLER_KAISER_BETA       8.6     // ~86 dB stopband
+#define RESAMPLER_PHASE_SHIFT       24      // 32.32 fraction bits below the phase index
+#define RESAMPLER_MAX_DEVIATION     0.01    // Ratio clamp, +-1 %
+
+#define DRIFT_MAX_PPM               500.0   // Beyond any real crystal: treat as a bad fit
+#define DRIFT_SKEW_TIME_CONSTANT_S  2.0     // Proportional gain: remove skew over ~2 s
+#define DRIFT_MAX_CORRECTION_PPM    1000.0
+
+#define DRIFT_PI                    3.14159265358979323846
+
+#if defined(_KERNEL_MODE) && DRIFT_X86
+typedef XSTATE_SAVE DRIFT_SIMD_STATE;
+#else
+typedef ULONG DRIFT_SIMD_STATE;
+#endif
+
+//
+// Filter design math. No CRT in the driver, so these are series
+// expansions; they run once, when the shared filter is built.
+//
+
+static double
+DriftSin(
+    _In_ double X
+)
+{
+    double term, sum, x2;
+    LONGLONG turns;
+    ULONG i;
+
+    turns = (LONGLONG)(X / (2.0 * DRIFT_PI) + ((X >= 0) ? 0.5 : -0.5));
+    X -= (double)turns * 2.0 * DRIFT_PI;
+
+    x2 = X * X;
+    term = X;
+    sum = X;
+    for (i = 1; i <= 13; i++) {
+        term *= -x2 / (double)((2 * i) * (2 * i + 1));
+        sum += term;
+    }
+
+    return sum;
+}
+
+static double
+DriftSqrt(
+    _In_ double X
+)
+{
+    double r;
+    ULONG i;
+
+    if (X <= 0.0) {
+        return 0.0;
+    }
+
+    r = (X > 1.0) ? X : 1.0;
+    for (i = 0; i < 64; i++) {
+        r = 0.5 * (r + X / r);
+    }
+
+    return r;
+}
+
+// Zeroth-order modified Bessel function of the first kind
+static double
+DriftBesselI0(
+    _In_ double X
+)
+{
+    double term = 1.0, sum = 1.0;
+    ULONG k;
+
+    for (k = 1; k < 64 && term > 1e-14 * sum; k++) {
+        double half = X / (2.0 * k);
+
+        term *= half * half;
+        sum += term;
+    }
+
+    return sum;
+}
+
+/*++
+Routine Description:
+    Builds the polyphase table. Row p holds the taps for an output
+    p / PHASES of a sample past the window centre; row PHASES closes
+    the interpolation for the last phase. Every row is normalized to
+    unity DC gain.
+--*/
+VOID
+ResamplerBuildFilter(
+    _Out_ PRESAMPLER_FILTER Filter
+)
+{
+    const double half = RESAMPLER_TAPS / 2;
+    double i0Beta = DriftBesselI0(RESAMPLER_KAISER_BETA);
+    ULONG p, j;
+
+    for (p = 0; p <= RESAMPLER_PHASES; p++) {
+        double taps[RESAMPLER_TAPS];
+        double sum = 0.0;
+
+        for (j = 0; j < RESAMPLER_TAPS; j++) {
+            double u = (double)j - (half - 1.0) - (double)p / RESAMPLER_PHASES;
+            double x = RESAMPLER_CUTOFF * u;
+            double sinc = (x == 0.0) ? 1.0 : DriftSin(DRIFT_PI * x) / (DRIFT_PI * x);
+            double r = u / half;
+
+            taps[j] = sinc * DriftBesselI0(RESAMPLER_KAISER_BETA * DriftSqrt(1.0 - r * r)) / i0Beta;
+            sum += taps[j];
+        }
+
+        for (j = 0; j < RESAMPLER_TAPS; j++) {
+            Filter->Coeff[p][j] = (float)(taps[j] / sum);
+        }
+    }
+}
+
+//
+// Dot product kernels: sum over j of x[j] * (h0[j] + f * (h1[j] - h0[j]))
+//
+
+static float
+ResamplerDotScalar(
+    _In_ const float* X,
+    _In_ const float* H0,
+    _In_ const float* H1,
+    _In_ float F
+)
+{
+    float acc = 0.0f;
+    ULONG j;
+
+    for (j = 0; j < RESAMPLER_TAPS; j++) {
+        acc += X[j] * (H0[j] + F * (H1[j] - H0[j]));
+    }
+
+    return acc;
+}
+
+#if DRIFT_X86
+
+DRIFT_TARGET_SSE41
+static float
+ResamplerDotSse41(
+    _In_ const float* X,
+    _In_ const float* H0,
+    _In_ const float* H1,
+    _In_ float F
+)
+{
+    __m128 f = _mm_set1_ps(F);
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    ULONG j;
+
+    for (j = 0; j < RESAMPLER_TAPS; j += 8) {
+        __m128 a0 = _mm_loadu_ps(H0 + j);
+        __m128 a1 = _mm_loadu_ps(H0 + j + 4);
+        __m128 c0 = _mm_add_ps(a0, _mm_mul_ps(f, _mm_sub_ps(_mm_loadu_ps(H1 + j), a0)));
+        __m128 c1 = _mm_add_ps(a1, _mm_mul_ps(f, _mm_sub_ps(_mm_loadu_ps(H1 + j + 4), a1)));
+
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(c0, _mm_loadu_ps(X + j)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(c1, _mm_loadu_ps(X + j + 4)));
+    }
+
+    acc0 = _mm_add_ps(acc0, acc1);
+    acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+    acc0 = _mm_add_ss(acc0, _mm_movehdup_ps(acc0));
+
+    return _mm_cvtss_f32(acc0);
+}
+
+DRIFT_TARGET_AVX2
+static float
+ResamplerDotAvx2(
+    _In_ const float* X,
+    _In_ const float* H0,
+    _In_ const float* H1,
+    _In_ float F
+)
+{
+    __m256 f = _mm256_set1_ps(F);
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m128 sum;
+    ULONG j;
+
+    for (j = 0; j < RESAMPLER_TAPS; j += 16) {
+        __m256 a0 = _mm256_loadu_ps(H0 + j);
+        __m256 a1 = _mm256_loadu_ps(H0 + j + 8);
+        __m256 c0 = _mm256_add_ps(a0, _mm256_mul_ps(f, _mm256_sub_ps(_mm256_loadu_ps(H1 + j), a0)));
+        __m256 c1 = _mm256_add_ps(a1, _mm256_mul_ps(f, _mm256_sub_ps(_mm256_loadu_ps(H1 + j + 8), a1)));
+
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(c0, _mm256_loadu_ps(X + j)));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(c1, _mm256_loadu_ps(X + j + 8)));
+    }
+
+    acc0 = _mm256_add_ps(acc0, acc1);
+    sum = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+
+    return _mm_cvtss_f32(sum);
+}
+
+#endif // DRIFT_X86
+
+/*++
+Routine Description:
+    Initializes a resampler at ratio 1
+
+Arguments:
+    Resampler - Resampler state
+    Filter - Shared polyphase table; must outlive the resampler
+    Channels - 1 or 2
+    Isa - Kernel instruction set, or SimdIsaBest
+
+Return Value:
+    None
+--*/
+VOID
+ResamplerInitialize(
+    _Out_ PRESAMPLER Resampler,
+    _In_ const RESAMPLER_FILTER* Filter,
+    _In_ ULONG Channels,
+    _In_ SIMD_ISA Isa
+)
+{
+    RtlZeroMemory(Resampler, sizeof(*Resampler));
+
+    Resampler->Filter = Filter;
+    Resampler->Channels = min(max(Channels, 1), RESAMPLER_MAX_CHANNELS);
+    Resampler->Isa = (Isa == SimdIsaBest || Isa > SimdDetectIsa()) ? SimdDetectIsa() : Isa;
+    Resampler->Step = 1ULL << 32;
+
+    // Start with a window of silence so the first output is sample 0
+    Resampler->Fill = RESAMPLER_TAPS / 2 - 1;
+    Resampler->InputBase = -(LONGLONG)(RESAMPLER_TAPS / 2 - 1);
+}
+
+VOID
+ResamplerSetRatio(
+    _Inout_ PRESAMPLER Resampler,
+    _In_ double Ratio
+)
+{
+    if (Ratio < 1.0 - RESAMPLER_MAX_DEVIATION) {
+        Ratio = 1.0 - RESAMPLER_MAX_DEVIATION;
+    } else if (Ratio > 1.0 + RESAMPLER_MAX_DEVIATION) {
+        Ratio = 1.0 + RESAMPLER_MAX_DEVIATION;
+    }
+
+    Resampler->Step = (ULONG64)(Ratio * 4294967296.0 + 0.5);
+}
+
+/*++
+Routine Description:
+    Appends input and produces every output whose window is complete
+
+Arguments:
+    Resampler - Resampler state
+    In - Interleaved input
+    Frames - Input frames offered
+    Out - Interleaved output
+    Capacity - Output frames available
+    Accepted - Receives input frames consumed from In
+
+Return Value:
+    Output frames written
+--*/
+ULONG
+ResamplerProcess(
+    _Inout_ PRESAMPLER Resampler,
+    _In_reads_(Frames * Resampler->Channels) const SHORT* In,
+    _In_ ULONG Frames,
+    _Out_writes_(Capacity * Resampler->Channels) SHORT* Out,
+    _In_ ULONG Capacity,
+    _Out_ PULONG Accepted
+)
+{
+    const RESAMPLER_FILTER* filter = Resampler->Filter;
+    ULONG channels = Resampler->Channels;
+    ULONG produced = 0;
+    ULONG n, c, consumed;
+    DRIFT_SIMD_STATE state;
+    BOOLEAN saved = FALSE;
+    SIMD_ISA isa = Resampler->Isa;
+    PRESAMPLER_CHECKPOINT checkpoint;
+
+    UNREFERENCED_PARAMETER(state);
+
+    Frames = min(Frames, RESAMPLER_BUFFER - Resampler->Fill);
+    for (n = 0; n < Frames; n++) {
+        for (c = 0; c < channels; c++) {
+            Resampler->Buffer[c][Resampler->Fill + n] = (float)In[n * channels + c];
+        }
+    }
+    Resampler->Fill += Frames;
+    *Accepted = Frames;
+
+    // The step is fixed for the whole call, so one checkpoint covers it
+    checkpoint = &Resampler->Checkpoints[Resampler->NextCheckpoint++ & (RESAMPLER_CHECKPOINTS - 1)];
+    checkpoint->Output = Resampler->OutputCount;
+    checkpoint->InputFixed = (LONGLONG)((ULONG64)(Resampler->InputBase + RESAMPLER_TAPS / 2 - 1) << 32) +
+        (LONGLONG)Resampler->Position;
+    checkpoint->Step = Resampler->Step;
+
+#if defined(_KERNEL_MODE) && DRIFT_X86
+    if (isa == SimdIsaAvx2) {
+        if (NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &state))) {
+            saved = TRUE;
+        } else {
+            isa = SimdIsaSse41;
+        }
+    }
+#endif
+
+    while (produced < Capacity) {
+        ULONG start = (ULONG)(Resampler->Position >> 32);
+        ULONG fraction = (ULONG)Resampler->Position;
+        ULONG phase = fraction >> RESAMPLER_PHASE_SHIFT;
+        float f = (float)(fraction & ((1UL << RESAMPLER_PHASE_SHIFT) - 1)) *
+            (1.0f / (float)(1UL << RESAMPLER_PHASE_SHIFT));
+
+        if (start + RESAMPLER_TAPS > Resampler->Fill) {
+            break;
+        }
+
+        for (c = 0; c < channels; c++) {
+            const float* x = Resampler->Buffer[c] + start;
+            float v;
+            LONG s;
+
+#if DRIFT_X86
+            if (isa == SimdIsaAvx2) {
+                v = ResamplerDotAvx2(x, filter->Coeff[phase], filter->Coeff[phase + 1], f);
+            } else if (isa == SimdIsaSse41) {
+                v = ResamplerDotSse41(x, filter->Coeff[phase], filter->Coeff[phase + 1], f);
+            } else
+#endif
+            {
+                v = ResamplerDotScalar(x, filter->Coeff[phase], filter->Coeff[phase + 1], f);
+            }
+
+            s = (LONG)(v + ((v >= 0) ? 0.5f : -0.5f));
+            Out[produced * channels + c] = (SHORT)min(max(s, -32768), 32767);
+        }
+
+        Resampler->Position += Resampler->Step;
+        produced++;
+    }
+
+#if defined(_KERNEL_MODE) && DRIFT_X86
+    if (saved) {
+        KeRestoreExtendedProcessorState(&state);
+    }
+#else
+    UNREFERENCED_PARAMETER(saved);
+#endif
+
+    // Drop input no future window can reach
+    consumed = min((ULONG)(Resampler->Position >> 32), Resampler->Fill);
+    if (consumed > 0) {
+        for (c = 0; c < channels; c++) {
+            RtlMoveMemory(Resampler->Buffer[c], Resampler->Buffer[c] + consumed,
+                (Resampler->Fill - consumed) * sizeof(float));
+        }
+        Resampler->Fill -= consumed;
+        Resampler->Position -= (ULONG64)consumed << 32;
+        Resampler->InputBase += consumed;
+    }
+
+    Resampler->OutputCount += produced;
+
+    return produced;
+}
+
+/*++
+Routine Description:
+    Maps an output sample index back to the input position it was
+    interpolated at, from the newest checkpoint at or before it
+--*/
+double
+ResamplerInputPosition(
+    _In_ PRESAMPLER Resampler,
+    _In_ ULONG64 Output
+)
+{
+    PRESAMPLER_CHECKPOINT best = NULL;
+    PRESAMPLER_CHECKPOINT oldest = NULL;
+    ULONG i;
+
+    for (i = 0; i < RESAMPLER_CHECKPOINTS && i < Resampler->NextCheckpoint; i++) {
+        PRESAMPLER_CHECKPOINT cp = &Resampler->Checkpoints[i];
+
+        if (cp->Output <= Output && (best == NULL || cp->Output > best->Output)) {
+            best = cp;
+        }
+        if (oldest == NULL || cp->Output < oldest->Output) {
+            oldest = cp;
+        }
+    }
+
+    if (best == NULL) {
+        best = oldest;
+    }
+    if (best == NULL) {
+        return (double)Output;
+    }
+
+    return ((double)best->InputFixed +
+        ((double)(LONGLONG)(Output - best->Output)) * (double)best->Step) / 4294967296.0;
+}
+
+VOID
+DriftInitialize(
+    _Out_ PDRIFT_ESTIMATOR Estimator,
+    _In_ ULONG NominalRate
+)
+{
+    RtlZeroMemory(Estimator, sizeof(*Estimator));
+    Estimator->NominalRate = NominalRate;
+    Estimator->SamplesPerUs = NominalRate / 1e6;
+}
+
+/*++
+Routine Description:
+    Adds a completion report and refits the line. Reports closer than
+    DRIFT_MIN_SPACING_US to the last accepted one are skipped, so the
+    window covers a long enough span to resolve a few ppm.
+
+Arguments:
+    Estimator - Sink's estimator
+    HostUs - Host time of the report, microseconds
+    SamplesPlayed - Sink's cumulative samples played at that time
+
+Return Value:
+    TRUE if the report entered the window
+--*/
+BOOLEAN
+DriftAddObservation(
+    _Inout_ PDRIFT_ESTIMATOR Estimator,
+    _In_ LONGLONG HostUs,
+    _In_ ULONG64 SamplesPlayed
+)
+{
+    double sumT = 0.0, sumS = 0.0, sumTT = 0.0, sumTS = 0.0;
+    ULONG count, i;
+
+    if (Estimator->Count == 0) {
+        Estimator->OriginUs = HostUs;
+    } else if (HostUs - Estimator->LastUs < DRIFT_MIN_SPACING_US) {
+        return FALSE;
+    }
+
+    Estimator->LastUs = HostUs;
+    Estimator->HostUs[Estimator->Next] = (double)(HostUs - Estimator->OriginUs);
+    Estimator->Samples[Estimator->Next] = (double)SamplesPlayed;
+    Estimator->Next = (Estimator->Next + 1) % DRIFT_WINDOW;
+    if (Estimator->Count < DRIFT_WINDOW) {
+        Estimator->Count++;
+    }
+
+    count = Estimator->Count;
+
+    for (i = 0; i < count; i++) {
+        sumT += Estimator->HostUs[i];
+        sumS += Estimator->Samples[i];
+    }
+
+    Estimator->MeanUs = sumT / count;
+    Estimator->MeanSamples = sumS / count;
+
+    for (i = 0; i < count; i++) {
+        double dt = Estimator->HostUs[i] - Estimator->MeanUs;
+
+        sumTT += dt * dt;
+        sumTS += dt * (Estimator->Samples[i] - Estimator->MeanSamples);
+    }
+
+    if (count >= DRIFT_MIN_OBSERVATIONS && sumTT > 0.0) {
+        double slope = sumTS / sumTT;
+        double nominal = Estimator->NominalRate / 1e6;
+        double ppm = (slope / nominal - 1.0) * 1e6;
+
+        if (ppm > -DRIFT_MAX_PPM && ppm < DRIFT_MAX_PPM) {
+            Estimator->SamplesPerUs = slope;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+DriftIsValid(
+    _In_ PDRIFT_ESTIMATOR Estimator
+)
+{
+    return Estimator->Count >= DRIFT_MIN_OBSERVATIONS;
+}
+
+double
+DriftPredictSamples(
+    _In_ PDRIFT_ESTIMATOR Estimator,
+    _In_ LONGLONG HostUs
+)
+{
+    return Estimator->MeanSamples +
+        Estimator->SamplesPerUs * ((double)(HostUs - Estimator->OriginUs) - Estimator->MeanUs);
+}
+
+VOID
+DriftSinkInitialize(
+    _Out_ PDRIFT_SINK Sink,
+    _In_ const RESAMPLER_FILTER* Filter,
+    _In_ ULONG SampleRate,
+    _In_ ULONG Channels,
+    _In_ SIMD_ISA Isa
+)
+{
+    RtlZeroMemory(Sink, sizeof(*Sink));
+
+    DriftInitialize(&Sink->Estimator, SampleRate);
+    ResamplerInitialize(&Sink->Resampler, Filter, Channels, Isa);
+    Sink->Ratio = 1.0;
+}
+
+/*++
+Routine Description:
+    Sets each sink's ratio from its fitted rate, then corrects
+    non-reference sinks toward the reference's playback position.
+
+    The ratio is input samples consumed per sample played:
+        nominal / fitted * (1 - skew / T)
+    The first factor cancels the sink's clock error. The second closes
+    the remaining position difference over about T seconds. Skew is
+    measured in source samples: each sink's fitted play count is mapped
+    back through its resampler history to the input it came from.
+
+Arguments:
+    Sinks - Sinks of one synchronized group
+    Count - Number of sinks
+    HostUs - Host time to evaluate the fits at
+
+Return Value:
+    None
+--*/
+VOID
+DriftUpdateRatios(
+    _Inout_updates_(Count) PDRIFT_SINK* Sinks,
+    _In_ ULONG Count,
+    _In_ LONGLONG HostUs
+)
+{
+    PDRIFT_SINK reference = NULL;
+    double referencePosition = 0.0;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        if (Sinks[i]->Reference && DriftIsValid(&Sinks[i]->Estimator)) {
+            reference = Sinks[i];
+            break;
+        }
+    }
+
+    if (reference != NULL) {
+        double played = DriftPredictSamples(&reference->Estimator, HostUs);
+
+        referencePosition = ResamplerInputPosition(&reference->Resampler,
+            (ULONG64)((played > 0) ? played : 0));
+    }
+
+    for (i = 0; i < Count; i++) {
+        PDRIFT_SINK sink = Sinks[i];
+        PDRIFT_ESTIMATOR estimator = &sink->Estimator;
+        double nominal = estimator->NominalRate / 1e6;
+        double ratio;
+
+        if (!DriftIsValid(estimator)) {
+            continue;
+        }
+
+        sink->DriftPpm = (estimator->SamplesPerUs / nominal - 1.0) * 1e6;
+        ratio = nominal / estimator->SamplesPerUs;
+        sink->CorrectionPpm = 0.0;
+        sink->SkewUs = 0.0;
+
+        if (reference != NULL && sink != reference) {
+            double played = DriftPredictSamples(estimator, HostUs);
+            double position = ResamplerInputPosition(&sink->Resampler,
+                (ULONG64)((played > 0) ? played : 0));
+            double correction;
+
+            sink->SkewUs = (position - referencePosition) / nominal;
+            correction = -sink->SkewUs / DRIFT_SKEW_TIME_CONSTANT_S;
+            if (correction > DRIFT_MAX_CORRECTION_PPM) {
+                correction = DRIFT_MAX_CORRECTION_PPM;
+            } else if (correction < -DRIFT_MAX_CORRECTION_PPM) {
+                correction = -DRIFT_MAX_CORRECTION_PPM;
+            }
+
+            sink->CorrectionPpm = correction;
+            ratio *= 1.0 + correction * 1e-6;
+        }
+
+        sink->Ratio = ratio;
+        ResamplerSetRatio(&sink->Resampler, ratio);
+    }
+}
@@ -0,0 +1,151 @@
+/*++
+
+Module Name:
+    MultiDeviceBTDrift.h
+
+Abstract:
+    Sink clock drift estimation and asynchronous resampling for
+    synchronized multi-sink playback. Portable C with SSE4.1/AVX2
+    resampler kernels; builds in the driver and in user-mode tools.
+
+--*/
+
+#ifndef _MULTIDEVICEBTDRIFT_H_
+#define _MULTIDEVICEBTDRIFT_H_
+
+#include "MultiDeviceBTSimd.h"
+
+#define DRIFT_WINDOW                128     // Observations in the regression
+#define DRIFT_MIN_SPACING_US        250000  // Window spans >= 32 s of completions
+#define DRIFT_MIN_OBSERVATIONS      8
+
+#define RESAMPLER_TAPS              64
+#define RESAMPLER_PHASES            256     // Power of two; linear interpolation between
+#define RESAMPLER_MAX_CHANNELS      2
+#define RESAMPLER_MAX_INPUT         960     // Frames per call: 20 ms at 48 kHz
+#define RESAMPLER_BUFFER            (2 * RESAMPLER_TAPS + RESAMPLER_MAX_INPUT)
+#define RESAMPLER_CHECKPOINTS       256     // Power of two; ~2.5 s of 10 ms calls
+
+// Windowed-sinc polyphase table, shared by every resampler
+typedef struct _RESAMPLER_FILTER {
+    float Coeff[RESAMPLER_PHASES + 1][RESAMPLER_TAPS];
+} RESAMPLER_FILTER, *PRESAMPLER_FILTER;
+
+// Output sample index to input position, recorded after each call
+typedef struct _RESAMPLER_CHECKPOINT {
+    ULONG64 Output;
+    LONGLONG InputFixed;        // Input position of that output, 32.32
+    ULONG64 Step;
+} RESAMPLER_CHECKPOINT, *PRESAMPLER_CHECKPOINT;
+
+typedef struct _RESAMPLER {
+    const RESAMPLER_FILTER* Filter;
+    SIMD_ISA Isa;
+    ULONG Channels;
+    ULONG64 Step;               // Input samples per output sample, 32.32
+    ULONG64 Position;           // Window start within Buffer, 32.32
+    ULONG Fill;                 // Valid frames in Buffer
+    LONGLONG InputBase;         // Absolute input index of Buffer[0]
+    ULONG64 OutputCount;
+    ULONG NextCheckpoint;
+    RESAMPLER_CHECKPOINT Checkpoints[RESAMPLER_CHECKPOINTS];
+    float Buffer[RESAMPLER_MAX_CHANNELS][RESAMPLER_BUFFER];
+} RESAMPLER, *PRESAMPLER;
+
+// Sliding-window least squares fit of samples played against host time
+typedef struct _DRIFT_ESTIMATOR {
+    ULONG NominalRate;
+    ULONG Count;
+    ULONG Next;
+    LONGLONG OriginUs;          // First observation; keeps the sums well conditioned
+    LONGLONG LastUs;
+    double HostUs[DRIFT_WINDOW];
+    double Samples[DRIFT_WINDOW];
+    double MeanUs;
+    double MeanSamples;
+    double SamplesPerUs;        // Fitted slope: the sink's true rate on the host clock
+} DRIFT_ESTIMATOR, *PDRIFT_ESTIMATOR;
+
+// One synchronized sink: its clock model and its resampler
+typedef struct _DRIFT_SINK {
+    DRIFT_ESTIMATOR Estimator;
+    RESAMPLER Resampler;
+    BOOLEAN Reference;          // Others align to this sink
+    double Ratio;               // Input samples consumed per output sample
+    double DriftPpm;
+    double SkewUs;              // Playback position minus the reference's
+    double CorrectionPpm;
+} DRIFT_SINK, *PDRIFT_SINK;
+
+VOID ResamplerBuildFilter(
+    _Out_ PRESAMPLER_FILTER Filter
+);
+
+VOID ResamplerInitialize(
+    _Out_ PRESAMPLER Resampler,
+    _In_ const RESAMPLER_FILTER* Filter,
+    _In_ ULONG Channels,
+    _In_ SIMD_ISA Isa
+);
+
+VOID ResamplerSetRatio(
+    _Inout_ PRESAMPLER Resampler,
+    _In_ double Ratio
+);
+
+// Accepts up to RESAMPLER_MAX_INPUT frames and writes at most Capacity
+// frames. Input is copied before any output is written, so In and Out
+// may share storage. Returns frames written; *Accepted receives frames
+// taken from In.
+ULONG ResamplerProcess(
+    _Inout_ PRESAMPLER Resampler,
+    _In_reads_(Frames * Resampler->Channels) const SHORT* In,
+    _In_ ULONG Frames,
+    _Out_writes_(Capacity * Resampler->Channels) SHORT* Out,
+    _In_ ULONG Capacity,
+    _Out_ PULONG Accepted
+);
+
+// Input position, in input samples, that produced output sample Output
+double ResamplerInputPosition(
+    _In_ PRESAMPLER Resampler,
+    _In_ ULONG64 Output
+);
+
+VOID DriftInitialize(
+    _Out_ PDRIFT_ESTIMATOR Estimator,
+    _In_ ULONG NominalRate
+);
+
+// Returns TRUE if the observation entered the window
+BOOLEAN DriftAddObservation(
+    _Inout_ PDRIFT_ESTIMATOR Estimator,
+    _In_ LONGLONG HostUs,
+    _In_ ULONG64 SamplesPlayed
+);
+
+BOOLEAN DriftIsValid(
+    _In_ PDRIFT_ESTIMATOR Estimator
+);
+
+double DriftPredictSamples(
+    _In_ PDRIFT_ESTIMATOR Estimator,
+    _In_ LONGLONG HostUs
+);
+
+VOID DriftSinkInitialize(
+    _Out_ PDRIFT_SINK Sink,
+    _In_ const RESAMPLER_FILTER* Filter,
+    _In_ ULONG SampleRate,
+    _In_ ULONG Channels,
+    _In_ SIMD_ISA Isa
+);
+
+// Recomputes every sink's resampling ratio at host time HostUs
+VOID DriftUpdateRatios(
+    _Inout_updates_(Count) PDRIFT_SINK* Sinks,
+    _In_ ULONG Count,
+    _In_ LONGLONG HostUs
+);
+
+#endif // _MULTIDEVICEBTDRIFT_H_
@@ -25,43 +25,11 @@ Environment:
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (INIT, DriverEntry)
 #pragma alloc_text (PAGE, BTDriverEvtDeviceAdd)
+#pragma alloc_text (PAGE, BTDriverEvtDevicePrepareHardware)
 #pragma alloc_text (PAGE, BTDriverEvtDriverContextCleanup)
+#pragma alloc_text (PAGE, BTDriverEvtDeviceContextCleanup)
 #endif
 
-// Maximum number of simultaneous device connections
-#define MAX_BLUETOOTH_CONNECTIONS 7
-
-// Device context structure
-typedef struct _DEVICE_CONTEXT {
-    WDFDEVICE Device;
-    WDFQUEUE DefaultQueue;
-    ULONG ActiveConnections;
-    BTH_DEVICE_INFO ConnectedDevices[MAX_BLUETOOTH_CONNECTIONS];
-    KSPIN_LOCK DeviceListLock;
-    BOOLEAN AIOptimizationEnabled;
-    ULONG TotalPacketsProcessed;
-    LARGE_INTEGER LastConnectionTime;
-} DEVICE_CONTEXT, *PDEVICE_CONTEXT;
-
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
-
-// Connection priority levels
-typedef enum _CONNECTION_PRIORITY {
-    PRIORITY_CRITICAL = 0,    // Audio devices, real-time data
-    PRIORITY_HIGH = 1,        // Input devices, wearables
-    PRIORITY_MEDIUM = 2,      // File transfers, IoT devices
-    PRIORITY_LOW = 3          // Background sync devices
-} CONNECTION_PRIORITY;
-
-// IoT device types
-typedef enum _IOT_DEVICE_TYPE {
-    IOT_AIR_CONDITIONER = 0x01,
-    IOT_REFRIGERATOR = 0x02,
-    IOT_SMART_TV = 0x03,
-    IOT_SMART_SPEAKER = 0x04,
-    IOT_GENERIC = 0xFF
-} IOT_DEVICE_TYPE;
-
 /*++
 Routine Description:
     DriverEntry initializes the driver and its WDF objects
@@ -82,6 +50,7 @@ DriverEntry(
     WDF_DRIVER_CONFIG config;
     NTSTATUS status;
     WDF_OBJECT_ATTRIBUTES attributes;
+    WDFDRIVER driver;
 
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, 
         "MultiDeviceBT: DriverEntry - AI-Enhanced Bluetooth Multi-Device Driver v1.0\n"));
@@ -89,8 +58,8 @@ DriverEntry(
     // Initialize driver configuration
     WDF_DRIVER_CONFIG_INIT(&config, BTDriverEvtDeviceAdd);
 
-    // Register cleanup callback
-    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    // Register cleanup callback and the driver-wide context
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, DRIVER_CONTEXT);
     attributes.EvtCleanupCallback = BTDriverEvtDriverContextCleanup;
 
     // Create the driver object
@@ -99,7 +68,7 @@ DriverEntry(
         RegistryPath,
         &attributes,
         &config,
-        WDF_NO_HANDLE
+        &driver
     );
 
     if (!NT_SUCCESS(status)) {
@@ -108,6 +77,12 @@ DriverEntry(
         return status;
     }
 
+    // Adapters register here as they are added
+    AdapterRegistryInitialize(&DriverGetContext(driver)->AdapterRegistry);
+
+    // Bonds load when the first adapter prepares its hardware
+    BondStoreInitialize(&DriverGetContext(driver)->Bonds);
+
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
         "MultiDeviceBT: Driver initialized successfully\n"));
 
@@ -137,8 +112,8 @@ BTDriverEvtDeviceAdd(
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
     WDF_OBJECT_ATTRIBUTES deviceAttributes;
     WDF_IO_QUEUE_CONFIG queueConfig;
-
-    UNREFERENCED_PARAMETER(Driver);
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_OBJECT_ATTRIBUTES timerAttributes;
 
     PAGED_CODE();
 
@@ -156,6 +131,7 @@ BTDriverEvtDeviceAdd(
 
     // Initialize device attributes
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, DEVICE_CONTEXT);
+    deviceAttributes.EvtCleanupCallback = BTDriverEvtDeviceContextCleanup;
 
     // Create the device object
     status = WdfDeviceCreate(&DeviceInit, &deviceAttributes, &device);
@@ -173,6 +149,28 @@ BTDriverEvtDeviceAdd(
     deviceContext->TotalPacketsProcessed = 0;
     KeInitializeSpinLock(&deviceContext->DeviceListLock);
     KeQuerySystemTime(&deviceContext->LastConnectionTime);
+    IoTTelemetryInitialize(&deviceContext->Telemetry);
+    MeshInitialize(&deviceContext->Mesh);
+    AffinityInitialize(&deviceContext->Affinity, deviceContext);
+    AudioLaneTableInitialize(&deviceContext->AudioLanes);
+    JitterInitialize(&deviceContext->Jitter);
+    SbcFanoutInitialize(&deviceContext->SbcFanout);
+    SyncInitialize(&deviceContext->Sync);
+    IsoSchedulerInitialize(&deviceContext->Iso);
+    HidInputInitialize(&deviceContext->HidInput);
+    BulkInitialize(&deviceContext->Bulk, deviceContext);
+    ChannelMuxInitialize(&deviceContext->Channels, deviceContext);
+    PrivacyInitialize(&deviceContext->Privacy);
+    PairingInitialize(&deviceContext->Pairing);
+    HciEventInitialize(&deviceContext->HciEvents);
+    HciCommandInitialize(&deviceContext->HciCommands);
+    AclInitialize(&deviceContext->Acl);
+    AfhInitialize(&deviceContext->Afh);
+    CaptureInitialize(&deviceContext->Capture);
+
+    // Bulk PDUs reach open channels through their fair queues
+    deviceContext->Bulk.Sink = ChannelMuxBulkSink;
+    deviceContext->Bulk.SinkContext = &deviceContext->Channels;
 
     // Initialize device list
     RtlZeroMemory(deviceContext->ConnectedDevices, 
@@ -197,6 +195,54 @@ BTDriverEvtDeviceAdd(
         return status;
     }
 
+    // Manual queue for HID input reads, completed as batches become ready
+    status = HidInputCreateReadQueue(&deviceContext->HidInput, device);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MultiDeviceBT: HID read queue creation failed - 0x%x\n", status));
+        return status;
+    }
+
+    // Manual queue for HCI command fetches, completed as credits allow
+    status = HciCommandCreateFetchQueue(&deviceContext->HciCommands, device);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MultiDeviceBT: HCI command queue creation failed - 0x%x\n", status));
+        return status;
+    }
+
+    // Manual queue for mesh relay fetches, completed as PDUs are queued
+    status = MeshCreateFetchQueue(&deviceContext->Mesh, device);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MultiDeviceBT: Mesh relay queue creation failed - 0x%x\n", status));
+        return status;
+    }
+
+    // Join the driver-wide adapter registry for cross-radio load balancing
+    status = AdapterRegister(&DriverGetContext(Driver)->AdapterRegistry, deviceContext);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+            "MultiDeviceBT: Adapter registry full, load balancing disabled - 0x%x\n", status));
+    }
+
+    // Periodic load accounting: adapter airtime and CPU affinity rebalance
+    WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, BTDriverEvtAdapterLoadTimer,
+        ADAPTER_LOAD_PERIOD_MS);
+    WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+    timerAttributes.ParentObject = device;
+
+    status = WdfTimerCreate(&timerConfig, &timerAttributes,
+        &deviceContext->Load.LoadTimer);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MultiDeviceBT: WdfTimerCreate failed - 0x%x\n", status));
+        return status;
+    }
+
+    WdfTimerStart(deviceContext->Load.LoadTimer,
+        WDF_REL_TIMEOUT_IN_MS(ADAPTER_LOAD_PERIOD_MS));
+
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
         "MultiDeviceBT: Device added successfully (Max Connections: %d)\n",
         MAX_BLUETOOTH_CONNECTIONS));
@@ -273,6 +319,345 @@ BTDriverEvtIoDeviceControl(
             InputBufferLength, OutputBufferLength, &bytesReturned);
         break;
 
+    case IOCTL_MULTI_BT_ADV_TELEMETRY_CONFIG:
+        status = HandleAdvTelemetryConfig(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_READ_TELEMETRY:
+        status = HandleReadTelemetry(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_SENSOR_SHADOW:
+        status = HandleGetSensorShadow(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_MESH_CONFIG:
+        status = HandleMeshConfig(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_MESH_STATS:
+        status = HandleGetMeshStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_MESH_SUBMIT_PDU:
+        status = HandleMeshSubmitPdu(deviceContext, Request,
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_MESH_FETCH_RELAY:
+        status = HandleMeshFetchRelay(deviceContext, Request,
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_MESH_PROXY_CONNECT:
+        status = HandleMeshProxyConnect(deviceContext, Request,
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_MESH_PROXY_DISCONNECT:
+        status = HandleMeshProxyDisconnect(deviceContext, Request,
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_MESH_PROXY_FILTER:
+        status = HandleMeshProxyFilter(deviceContext, Request,
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_SELECT_ADAPTER:
+        status = HandleSelectAdapter(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_ADAPTER_LOAD:
+        status = HandleGetAdapterLoad(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_MIGRATIONS:
+        status = HandleGetMigrations(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_CPU_AFFINITY:
+        status = HandleGetCpuAffinity(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_AUDIO_LANE_CREATE:
+        status = HandleAudioLaneCreate(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_AUDIO_LANE_DESTROY:
+        status = HandleAudioLaneDestroy(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_AUDIO_SUBMIT:
+        status = HandleAudioSubmit(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_AUDIO_LANE_STATS:
+        status = HandleAudioLaneStats(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_JITTER_CONFIG:
+        status = HandleJitterConfig(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_JITTER_STATS:
+        status = HandleGetJitterStats(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_SBC_FANOUT_ATTACH:
+        status = HandleSbcFanoutAttach(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_SBC_SUBMIT_PCM:
+        status = HandleSbcSubmitPcm(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_SBC_FANOUT_STATS:
+        status = HandleGetSbcFanoutStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_SYNC_CONFIG:
+        status = HandleSyncConfig(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_SYNC_COMPLETION:
+        status = HandleSyncCompletion(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_SYNC_RESAMPLE:
+        status = HandleSyncResample(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_SYNC_STATS:
+        status = HandleGetSyncStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_ISO_STREAM_CREATE:
+        status = HandleIsoStreamCreate(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_ISO_SUBMIT:
+        status = HandleIsoSubmit(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_ISO_STREAM_STATS:
+        status = HandleIsoStreamStats(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_ISO_STREAM_DESTROY:
+        status = HandleIsoStreamDestroy(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HID_SET_DESCRIPTOR:
+        status = HandleHidSetDescriptor(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HID_DECODE_REPORT:
+        status = HandleHidDecodeReport(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HID_GET_LAYOUT:
+        status = HandleHidGetLayout(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HID_COALESCE_CONFIG:
+        status = HandleHidCoalesceConfig(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HID_SUBMIT_REPORT:
+        status = HandleHidSubmitReport(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HID_READ_INPUT:
+        status = HandleHidReadInput(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HID_GET_INPUT_STATS:
+        status = HandleHidGetInputStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_BULK_TRANSFER:
+        status = HandleBulkTransfer(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_BULK_STATS:
+        status = HandleGetBulkStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_CHANNEL_OPEN:
+        status = HandleChannelOpen(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_CHANNEL_CLOSE:
+        status = HandleChannelClose(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_CHANNEL_SEND:
+        status = HandleChannelSend(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_CHANNEL_CREDITS:
+        status = HandleChannelCredits(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_CHANNEL_STATS:
+        status = HandleGetChannelStats(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_RPA_ADD_IRK:
+        status = HandleRpaAddIrk(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_RPA_REMOVE_IRK:
+        status = HandleRpaRemoveIrk(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_RPA_RESOLVE:
+        status = HandleRpaResolve(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_RPA_STATS:
+        status = HandleGetRpaStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_BOND_ADD:
+        status = HandleBondAdd(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_BOND_REMOVE:
+        status = HandleBondRemove(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_BOND_LOOKUP:
+        status = HandleBondLookup(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_BOND_STATS:
+        status = HandleGetBondStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_PAIRING_GET_PUBLIC_KEY:
+        status = HandlePairingGetPublicKey(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_PAIRING_DHKEY:
+        status = HandlePairingComputeDhKey(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_PAIRING_STATS:
+        status = HandleGetPairingStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HCI_SUBMIT_EVENTS:
+        status = HandleHciSubmitEvents(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_HCI_EVENT_STATS:
+        status = HandleGetHciEventStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HCI_QUEUE_COMMAND:
+        status = HandleHciQueueCommand(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_HCI_FETCH_COMMANDS:
+        status = HandleHciFetchCommands(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_HCI_COMMAND_STATS:
+        status = HandleGetHciCommandStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_ACL_ACQUIRE_CREDITS:
+        status = HandleAclAcquireCredits(deviceContext, Request, 
+            InputBufferLength, OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_ACL_CREDITS:
+        status = HandleGetAclCredits(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_AFH_SUBMIT_SAMPLES:
+        status = HandleAfhSubmitSamples(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_AFH_STATE:
+        status = HandleGetAfhState(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_CAPTURE_START:
+        status = HandleCaptureStart(deviceContext, Request, 
+            InputBufferLength, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_CAPTURE_STOP:
+        status = HandleCaptureStop(deviceContext, &bytesReturned);
+        break;
+
+    case IOCTL_MULTI_BT_GET_CAPTURE_STATS:
+        status = HandleGetCaptureStats(deviceContext, Request, 
+            OutputBufferLength, &bytesReturned);
+        break;
+
     default:
         status = STATUS_INVALID_DEVICE_REQUEST;
         KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
@@ -280,7 +665,10 @@ BTDriverEvtIoDeviceControl(
         break;
     }
 
-    WdfRequestCompleteWithInformation(Request, status, bytesReturned);
+    // Pended requests belong to a manual queue or the bulk engine and complete there
+    if (status != STATUS_PENDING) {
+        WdfRequestCompleteWithInformation(Request, status, bytesReturned);
+    }
 }
 
 /*++
@@ -305,6 +693,7 @@ BTDriverEvtIoRead(
     NTSTATUS status;
     PVOID buffer;
     size_t bufferSize;
+    size_t bytesRead = 0;
     PDEVICE_CONTEXT deviceContext;
 
     deviceContext = DeviceGetContext(WdfIoQueueGetDevice(Queue));
@@ -315,15 +704,51 @@ BTDriverEvtIoRead(
     if (NT_SUCCESS(status)) {
         // Process read operation with AI optimization
         if (deviceContext->AIOptimizationEnabled) {
-            status = ProcessOptimizedRead(deviceContext, buffer, bufferSize);
+            status = ProcessOptimizedRead(deviceContext, buffer, bufferSize, &bytesRead);
         } else {
             status = ProcessStandardRead(deviceContext, buffer, bufferSize);
+            bytesRead = bufferSize;
         }
         
         deviceContext->TotalPacketsProcessed++;
+        if (NT_SUCCESS(status)) {
+            AdapterAccountAirtime(deviceContext, bytesRead);
+        }
     }
 
-    WdfRequestCompleteWithInformation(Request, status, NT_SUCCESS(status) ? bufferSize : 0);
+    WdfRequestCompleteWithInformation(Request, status, NT_SUCCESS(status) ? bytesRead : 0);
+}
+
+/*++
+Routine Description:
+    Optimized read path. While a CRITICAL link has inbound audio open,
+    reads are served from its jitter buffer, one playout frame per read
+    (JITTER_PLAYOUT_HEADER followed by the payload).
+
+Arguments:
+    DeviceContext - Device context
+    Buffer - Read buffer
+    BufferSize - Read buffer size
+    BytesRead - Receives the bytes written to Buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+ProcessOptimizedRead(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Out_ PVOID Buffer,
+    _In_ size_t BufferSize,
+    _Out_ size_t* BytesRead
+)
+{
+    if (JitterHasActiveStream(&DeviceContext->Jitter)) {
+        return JitterPlayout(&DeviceContext->Jitter, Buffer, BufferSize, BytesRead);
+    }
+
+    // The standard path fills the whole buffer
+    *BytesRead = BufferSize;
+    return ProcessStandardRead(DeviceContext, Buffer, BufferSize);
 }
 
 /*++
@@ -359,11 +784,67 @@ BTDriverEvtIoWrite(
         // Process write operation with bandwidth optimization
         status = ProcessOptimizedWrite(deviceContext, buffer, bufferSize);
         deviceContext->TotalPacketsProcessed++;
+        if (NT_SUCCESS(status)) {
+            AdapterAccountAirtime(deviceContext, bufferSize);
+        }
     }
 
     WdfRequestCompleteWithInformation(Request, status, NT_SUCCESS(status) ? bufferSize : 0);
 }
 
+/*++
+Routine Description:
+    Prepares an adapter for use. Starts the pairing key generator and
+    loads the driver-wide bond store the first time any adapter gets
+    here, then hands the bonded IRKs to this adapter's address resolver.
+    Neither failing fails the start: pairing falls back to generating
+    keys on demand, and a missing or damaged bond file leaves the
+    adapter running without bonds.
+
+Arguments:
+    Device - Handle to the device object
+    ResourcesRaw - Raw hardware resources
+    ResourcesTranslated - Translated hardware resources
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+BTDriverEvtDevicePrepareHardware(
+    _In_ WDFDEVICE Device,
+    _In_ WDFCMRESLIST ResourcesRaw,
+    _In_ WDFCMRESLIST ResourcesTranslated
+)
+{
+    PDEVICE_CONTEXT deviceContext = DeviceGetContext(Device);
+    PBOND_STORE bonds = &DriverGetContext(WdfGetDriver())->Bonds;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(ResourcesRaw);
+    UNREFERENCED_PARAMETER(ResourcesTranslated);
+
+    PAGED_CODE();
+
+    // Fill the pairing key pool in the background before anyone pairs
+    status = PairingStart(&deviceContext->Pairing);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+            "MultiDeviceBT: Pairing key generator not started (0x%x)\n", status));
+    }
+
+    status = BondStoreLoad(bonds);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+            "MultiDeviceBT: Bond store unavailable (0x%x); starting without bonds\n",
+            status));
+        return STATUS_SUCCESS;
+    }
+
+    BondStoreFeedPrivacy(bonds, &deviceContext->Privacy);
+
+    return STATUS_SUCCESS;
+}
+
 /*++
 Routine Description:
     Cleanup callback for driver context
@@ -379,14 +860,55 @@ BTDriverEvtDriverContextCleanup(
     _In_ WDFOBJECT DriverObject
 )
 {
-    UNREFERENCED_PARAMETER(DriverObject);
-
     PAGED_CODE();
 
+    BondStoreUnload(&DriverGetContext(DriverObject)->Bonds);
+
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
         "MultiDeviceBT: Driver cleanup completed\n"));
 }
 
+/*++
+Routine Description:
+    Cleanup callback for an adapter's device context
+
+Arguments:
+    Device - Handle to the device object
+
+Return Value:
+    None
+--*/
+VOID
+BTDriverEvtDeviceContextCleanup(
+    _In_ WDFOBJECT Device
+)
+{
+    PDEVICE_CONTEXT deviceContext = DeviceGetContext(Device);
+
+    PAGED_CODE();
+
+    if (deviceContext->Load.LoadTimer != NULL) {
+        WdfTimerStop(deviceContext->Load.LoadTimer, TRUE);
+    }
+
+    PairingCleanup(&deviceContext->Pairing);
+    PrivacyCleanup(&deviceContext->Privacy);
+    ChannelMuxCleanup(&deviceContext->Channels);
+    BulkCleanup(&deviceContext->Bulk);
+    HidInputCleanup(&deviceContext->HidInput);
+    IsoSchedulerCleanup(&deviceContext->Iso);
+    SyncCleanup(&deviceContext->Sync);
+    SbcFanoutCleanup(&deviceContext->SbcFanout);
+    AudioLaneTableCleanup(&deviceContext->AudioLanes);
+    JitterCleanup(&deviceContext->Jitter);
+    CaptureCleanup(&deviceContext->Capture);
+
+    AffinityShutdown(&deviceContext->Affinity);
+
+    AdapterUnregister(&DriverGetContext(WdfGetDriver())->AdapterRegistry,
+        deviceContext);
+}
+
 // Additional helper functions will be implemented in separate modules:
 // - MultiDeviceBTConnection.c (Connection management)
 // - MultiDeviceBTAI.c (AI optimization engine)
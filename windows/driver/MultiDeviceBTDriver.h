@@ -16,6 +16,30 @@ Abstract:
 #include <bthdef.h>
 #include <bthioctl.h>
 
+// Maximum number of simultaneous device connections
+#define MAX_BLUETOOTH_CONNECTIONS 7
+
+#include "MultiDeviceBTIoT.h"
+#include "MultiDeviceBTMesh.h"
+#include "MultiDeviceBTBond.h"
+#include "MultiDeviceBTAdapter.h"
+#include "MultiDeviceBTAffinity.h"
+#include "MultiDeviceBTAudio.h"
+#include "MultiDeviceBTJitter.h"
+#include "MultiDeviceBTSbcFanout.h"
+#include "MultiDeviceBTSync.h"
+#include "MultiDeviceBTIso.h"
+#include "MultiDeviceBTHidInput.h"
+#include "MultiDeviceBTBulk.h"
+#include "MultiDeviceBTChannel.h"
+#include "MultiDeviceBTPrivacy.h"
+#include "MultiDeviceBTPairing.h"
+#include "MultiDeviceBTHciEvent.h"
+#include "MultiDeviceBTHciCommand.h"
+#include "MultiDeviceBTAcl.h"
+#include "MultiDeviceBTAfh.h"
+#include "MultiDeviceBTCapture.h"
+
 // Driver version
 #define DRIVER_VERSION_MAJOR 1
 #define DRIVER_VERSION_MINOR 0
@@ -37,6 +61,211 @@ Abstract:
 #define IOCTL_MULTI_BT_GET_STATS \
     CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+#define IOCTL_MULTI_BT_ADV_TELEMETRY_CONFIG \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_READ_TELEMETRY \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_SENSOR_SHADOW \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_MESH_CONFIG \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_MESH_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_SELECT_ADAPTER \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_ADAPTER_LOAD \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_MIGRATIONS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_CPU_AFFINITY \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x80D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_AUDIO_LANE_CREATE \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x80E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_AUDIO_LANE_DESTROY \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x80F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_AUDIO_SUBMIT \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x810, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_AUDIO_LANE_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x811, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_JITTER_CONFIG \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x812, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_JITTER_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x813, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_SBC_FANOUT_ATTACH \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x814, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_SBC_SUBMIT_PCM \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x815, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_SBC_FANOUT_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x816, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_SYNC_CONFIG \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x817, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_SYNC_COMPLETION \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x818, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_SYNC_RESAMPLE \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x819, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_SYNC_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x81A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_ISO_STREAM_CREATE \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x81B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_ISO_SUBMIT \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x81C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_ISO_STREAM_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x81D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_ISO_STREAM_DESTROY \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x81E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HID_SET_DESCRIPTOR \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x81F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HID_DECODE_REPORT \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x820, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HID_GET_LAYOUT \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x821, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HID_COALESCE_CONFIG \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x822, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HID_SUBMIT_REPORT \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x823, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HID_READ_INPUT \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x824, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HID_GET_INPUT_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x825, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Direct I/O: the second buffer is the mapped file region, read in place
+#define IOCTL_MULTI_BT_BULK_TRANSFER \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x826, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_BULK_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x827, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_CHANNEL_OPEN \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x828, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_CHANNEL_CLOSE \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x829, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_CHANNEL_SEND \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x82A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_CHANNEL_CREDITS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x82B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_CHANNEL_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x82C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_RPA_ADD_IRK \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x82D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_RPA_REMOVE_IRK \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x82E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_RPA_RESOLVE \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x82F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_RPA_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x830, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_BOND_ADD \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x831, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_BOND_REMOVE \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x832, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_BOND_LOOKUP \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x833, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_BOND_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x834, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_PAIRING_GET_PUBLIC_KEY \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x835, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_PAIRING_DHKEY \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x836, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_PAIRING_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x837, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HCI_SUBMIT_EVENTS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x838, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_HCI_EVENT_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x839, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HCI_QUEUE_COMMAND \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x83A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_HCI_FETCH_COMMANDS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x83B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_HCI_COMMAND_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x83C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_ACL_ACQUIRE_CREDITS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x83D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_ACL_CREDITS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x83E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_AFH_SUBMIT_SAMPLES \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x83F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_AFH_STATE \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x840, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_CAPTURE_START \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x841, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_CAPTURE_STOP \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x842, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_GET_CAPTURE_STATS \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x843, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_MESH_SUBMIT_PDU \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x844, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_MESH_FETCH_RELAY \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x845, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_MESH_PROXY_CONNECT \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x846, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_MESH_PROXY_DISCONNECT \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x847, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MULTI_BT_MESH_PROXY_FILTER \
+    CTL_CODE(FILE_DEVICE_BLUETOOTH, 0x848, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
 // Device information structure
 typedef struct _BTH_DEVICE_INFO {
     BTH_ADDR DeviceAddress;
@@ -90,12 +319,64 @@ typedef struct _DRIVER_STATS {
     LARGE_INTEGER DriverUptime;
 } DRIVER_STATS, *PDRIVER_STATS;
 
+// Device context structure
+typedef struct _DEVICE_CONTEXT {
+    WDFDEVICE Device;
+    WDFQUEUE DefaultQueue;
+    ULONG ActiveConnections;
+    BTH_DEVICE_INFO ConnectedDevices[MAX_BLUETOOTH_CONNECTIONS];
+    KSPIN_LOCK DeviceListLock;
+    BOOLEAN AIOptimizationEnabled;
+    ULONG TotalPacketsProcessed;
+    LARGE_INTEGER LastConnectionTime;
+    IOT_TELEMETRY_STORE Telemetry;
+    MESH_CONTEXT Mesh;
+    ADAPTER_LOAD Load;
+    AFFINITY_CONTEXT Affinity;
+    AUDIO_LANE_TABLE AudioLanes;
+    JITTER_CONTEXT Jitter;
+    SBC_FANOUT SbcFanout;
+    SYNC_CONTEXT Sync;
+    ISO_SCHEDULER Iso;
+    HID_INPUT_TABLE HidInput;
+    BULK_ENGINE Bulk;
+    CHANNEL_MUX Channels;
+    PRIVACY_CONTEXT Privacy;
+    PAIRING_CONTEXT Pairing;
+    HCI_EVENT_CONTEXT HciEvents;
+    HCI_COMMAND_CONTEXT HciCommands;
+    ACL_CONTEXT Acl;
+    AFH_CONTEXT Afh;
+    CAPTURE_CONTEXT Capture;
+} DEVICE_CONTEXT, *PDEVICE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DRIVER_CONTEXT, DriverGetContext)
+
+// Connection priority levels
+typedef enum _CONNECTION_PRIORITY {
+    PRIORITY_CRITICAL = 0,    // Audio devices, real-time data
+    PRIORITY_HIGH = 1,        // Input devices, wearables
+    PRIORITY_MEDIUM = 2,      // File transfers, IoT devices
+    PRIORITY_LOW = 3          // Background sync devices
+} CONNECTION_PRIORITY;
+
+// IoT device types
+typedef enum _IOT_DEVICE_TYPE {
+    IOT_AIR_CONDITIONER = 0x01,
+    IOT_REFRIGERATOR = 0x02,
+    IOT_SMART_TV = 0x03,
+    IOT_SMART_SPEAKER = 0x04,
+    IOT_GENERIC = 0xFF
+} IOT_DEVICE_TYPE;
+
 // Function prototypes
 
 // Driver entry and cleanup
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD BTDriverEvtDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP BTDriverEvtDriverContextCleanup;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP BTDriverEvtDeviceContextCleanup;
 
 // PnP and Power management
 EVT_WDF_DEVICE_PREPARE_HARDWARE BTDriverEvtDevicePrepareHardware;
@@ -156,7 +437,8 @@ NTSTATUS HandleAIOptimization(
 NTSTATUS ProcessOptimizedRead(
     _In_ PDEVICE_CONTEXT DeviceContext,
     _Out_ PVOID Buffer,
-    _In_ size_t BufferSize
+    _In_ size_t BufferSize,
+    _Out_ size_t* BytesRead
 );
 
 NTSTATUS ProcessStandardRead(
@@ -185,6 +467,527 @@ NTSTATUS SendIoTCommand(
     _In_ PIOT_DEVICE_CONTROL IoTControl
 );
 
+NTSTATUS HandleAdvTelemetryConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleReadTelemetry(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetSensorShadow(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Mesh functions
+NTSTATUS HandleMeshConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetMeshStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleMeshSubmitPdu(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleMeshFetchRelay(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleMeshProxyConnect(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleMeshProxyDisconnect(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleMeshProxyFilter(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Multi-adapter functions
+EVT_WDF_TIMER BTDriverEvtAdapterLoadTimer;
+
+NTSTATUS HandleSelectAdapter(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetAdapterLoad(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetMigrations(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// CPU affinity functions
+NTSTATUS HandleGetCpuAffinity(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Real-time audio lane functions
+NTSTATUS HandleAudioLaneCreate(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleAudioLaneDestroy(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleAudioSubmit(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleAudioLaneStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Inbound jitter buffer functions
+NTSTATUS HandleJitterConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetJitterStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// SBC multi-sink fan-out functions
+NTSTATUS HandleSbcFanoutAttach(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleSbcSubmitPcm(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetSbcFanoutStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Multi-sink synchronization functions
+NTSTATUS HandleSyncConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleSyncCompletion(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleSyncResample(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetSyncStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// LE Audio isochronous scheduler functions
+NTSTATUS HandleIsoStreamCreate(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleIsoSubmit(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleIsoStreamStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleIsoStreamDestroy(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// HID input fast path functions
+NTSTATUS HandleHidSetDescriptor(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleHidDecodeReport(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleHidGetLayout(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleHidCoalesceConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleHidSubmitReport(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleHidReadInput(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleHidGetInputStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Bulk transfer engine functions
+NTSTATUS HandleBulkTransfer(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetBulkStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Channel multiplexer functions
+NTSTATUS HandleChannelOpen(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleChannelClose(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleChannelSend(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleChannelCredits(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetChannelStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// LE privacy functions
+NTSTATUS HandleRpaAddIrk(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleRpaRemoveIrk(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleRpaResolve(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetRpaStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Bond store functions
+VOID BondStoreFeedPrivacy(
+    _Inout_ PBOND_STORE Store,
+    _Inout_ PPRIVACY_CONTEXT Privacy
+);
+
+NTSTATUS HandleBondAdd(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleBondRemove(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleBondLookup(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetBondStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Pairing crypto functions
+NTSTATUS HandlePairingGetPublicKey(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandlePairingComputeDhKey(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetPairingStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// HCI event intake functions
+NTSTATUS HandleHciSubmitEvents(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetHciEventStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// HCI command pipeline functions
+NTSTATUS HandleHciQueueCommand(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleHciFetchCommands(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetHciCommandStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// ACL transmit credit functions
+NTSTATUS HandleAclAcquireCredits(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetAclCredits(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Adaptive frequency hopping functions
+NTSTATUS HandleAfhSubmitSamples(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetAfhState(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+// Packet capture functions
+NTSTATUS HandleCaptureStart(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleCaptureStop(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Out_ size_t* BytesReturned
+);
+
+NTSTATUS HandleGetCaptureStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+);
+
 // Utility functions
 NTSTATUS GetDeviceCapabilities(
     _In_ BTH_ADDR DeviceAddress,
@@ -0,0 +1,821 @@
+/*++
+
+Module Name:
+    MultiDeviceBTErtm.c
+
+Abstract:
+    L2CAP Enhanced Retransmission Mode (Core Vol 3 Part A, 8.6).
+
+    Until now a lost PDU cost the application the whole request: the
+    write failed or timed out, and user mode sent all 4 KB again after
+    a fixed timeout. Here every I-frame carries a 6-bit TxSeq and an
+    FCS. The receiver buffers frames that arrive after a gap and sends
+    one SREJ for each missing frame, so only lost frames are resent.
+    Acknowledgements are cumulative ReqSeq values, piggybacked on
+    I-frames or sent in an RR once a quarter of the window or
+    ERTM_ACK_DELAY_US has gone by.
+
+    The spec has a single retransmission timer with a fixed value from
+    configuration. Here each unacknowledged frame has its own deadline
+    of SentUs + RTO. The RTO is computed as in RFC 6298: a smoothed RTT
+    plus four times its variance. Retransmitted frames give no samples
+    (Karn). The RTO doubles only on a second timeout with no
+    acknowledgement in between: losses on a radio link are bit errors,
+    not congestion, and backing off after each one just idles the link.
+
+    The caller owns time and transport: ErtmBuildFrame produces the
+    next frame to send, ErtmReceiveFrame consumes one from the peer, and
+    ErtmNextDeadline says when to call back if nothing else happens.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTErtm.h"
+
+#define ERTM_SEQ(x)                 ((UCHAR)((x) & (ERTM_SEQ_MODULO - 1)))
+
+static VOID ErtmPut16(PUCHAR p, USHORT v)
+{
+    p[0] = (UCHAR)v;
+    p[1] = (UCHAR)(v >> 8);
+}
+
+static USHORT ErtmGet16(const UCHAR* p)
+{
+    return (USHORT)(p[0] | (p[1] << 8));
+}
+
+/*++
+
+Routine Description:
+    CRC-16 frame check sequence: polynomial x^16 + x^15 + x^2 + 1,
+    initial value 0, bits processed LSB first.
+
+--*/
+USHORT ErtmFcs(
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+)
+{
+    static USHORT table[256];
+    static BOOLEAN ready;
+    USHORT crc = 0;
+    ULONG i;
+
+    if (!ready) {
+        // Idempotent: racing builders write the same values
+        for (i = 0; i < 256; i++) {
+            USHORT c = (USHORT)i;
+            int bit;
+            for (bit = 0; bit < 8; bit++) {
+                c = (c & 1) ? (USHORT)((c >> 1) ^ 0xA001) : (USHORT)(c >> 1);
+            }
+            table[i] = c;
+        }
+        ready = TRUE;
+    }
+
+    for (i = 0; i < Length; i++) {
+        crc = (USHORT)((crc >> 8) ^ table[(crc ^ Data[i]) & 0xFF]);
+    }
+    return crc;
+}
+
+static ULONG ErtmAckThreshold(const ERTM_CHANNEL* Channel)
+{
+    ULONG threshold = Channel->Config.TxWindow / 4;
+    return threshold ? threshold : 1;
+}
+
+static BOOLEAN ErtmAckDue(const ERTM_CHANNEL* Channel, ULONG64 NowUs)
+{
+    return Channel->AckRequired && NowUs >= Channel->AckDueUs;
+}
+
+static BOOLEAN ErtmCanSendNew(const ERTM_CHANNEL* Channel)
+{
+    return !Channel->RemoteBusy &&
+           Channel->Unacked < Channel->Config.TxWindow &&
+           Channel->QueueCount > 0;
+}
+
+static VOID ErtmUpdateRto(PERTM_CHANNEL Channel)
+{
+    ULONG64 rto;
+
+    // The peer may hold an RR for up to ERTM_ACK_DELAY_US, which stands
+    // in for the clock granularity G of the RFC
+    rto = 4 * (ULONG64)Channel->RttVarUs;
+    rto = (ULONG64)Channel->SrttUs + (rto > ERTM_ACK_DELAY_US ? rto : ERTM_ACK_DELAY_US);
+    if (rto < Channel->Config.RtoMinUs) {
+        rto = Channel->Config.RtoMinUs;
+    }
+    if (rto > Channel->Config.RtoMaxUs) {
+        rto = Channel->Config.RtoMaxUs;
+    }
+    Channel->RtoUs = (ULONG)rto;
+    Channel->Stats.RtoUs = Channel->RtoUs;
+}
+
+/*++
+
+Routine Description:
+    Folds one round-trip sample into SRTT and RTTVAR and recomputes the
+    RTO (RFC 6298, section 2).
+
+--*/
+static VOID ErtmSampleRtt(PERTM_CHANNEL Channel, ULONG SampleUs)
+{
+    if (!Channel->RttValid) {
+        Channel->SrttUs = SampleUs;
+        Channel->RttVarUs = SampleUs / 2;
+        Channel->RttValid = TRUE;
+    } else {
+        ULONG delta = SampleUs > Channel->SrttUs ?
+            SampleUs - Channel->SrttUs : Channel->SrttUs - SampleUs;
+        Channel->RttVarUs = (3 * Channel->RttVarUs + delta) / 4;
+        Channel->SrttUs = (7 * Channel->SrttUs + SampleUs) / 8;
+    }
+
+    Channel->Stats.SrttUs = Channel->SrttUs;
+    Channel->Stats.RttVarUs = Channel->RttVarUs;
+    ErtmUpdateRto(Channel);
+}
+
+/*++
+
+Routine Description:
+    Applies a cumulative acknowledgement: every frame before ReqSeq has
+    arrived. Stale or out-of-range values are ignored.
+
+--*/
+static VOID ErtmProcessAck(PERTM_CHANNEL Channel, ULONG64 NowUs, UCHAR ReqSeq)
+{
+    UCHAR acked = ERTM_SEQ(ReqSeq - Channel->ExpectedAckSeq);
+    ULONG64 sampleSentUs = Channel->Tx[Channel->ExpectedAckSeq].SentUs;
+    BOOLEAN sample = TRUE;
+
+    if (acked == 0 || acked > Channel->Unacked) {
+        return;
+    }
+
+    while (acked--) {
+        PERTM_TX_FRAME frame = &Channel->Tx[Channel->ExpectedAckSeq];
+
+        // Karn: a resent frame makes the sample ambiguous, and frames
+        // behind it were held by the receiver until the gap filled
+        if (frame->Transmissions != 1) {
+            sample = FALSE;
+        }
+        if (frame->Sar == ERTM_SAR_UNSEGMENTED || frame->Sar == ERTM_SAR_END) {
+            Channel->Stats.SdusAcked++;
+            if (Channel->Acked != NULL) {
+                Channel->Acked(Channel->Context, frame->Cookie);
+            }
+        }
+        frame->Valid = FALSE;
+        frame->Cookie = NULL;
+        Channel->ExpectedAckSeq = ERTM_SEQ(Channel->ExpectedAckSeq + 1);
+        Channel->Unacked--;
+    }
+
+    // The oldest frame acknowledged waited longest for a delayed RR
+    if (sample && NowUs >= sampleSentUs) {
+        ULONG64 rtt = NowUs - sampleSentUs;
+        ErtmSampleRtt(Channel, rtt > MAXULONG ? MAXULONG : (ULONG)rtt);
+    } else if (Channel->RttValid) {
+        // Losses here are radio errors, not congestion: once the peer
+        // acknowledges again, any backoff is dropped
+        ErtmUpdateRto(Channel);
+    }
+    Channel->AckedSinceTimeout = TRUE;
+}
+
+/*++
+
+Routine Description:
+    Appends one received payload to the SDU being reassembled and hands
+    complete SDUs to the Received callback. Malformed sequences drop the
+    partial SDU; the SAR bits of the next start frame resynchronize.
+
+--*/
+static VOID ErtmReassemble(PERTM_CHANNEL Channel, UCHAR Sar, const UCHAR* Data, ULONG Length)
+{
+    switch (Sar) {
+    case ERTM_SAR_UNSEGMENTED:
+        Channel->Reassembling = FALSE;
+        Channel->Stats.SdusDelivered++;
+        if (Channel->Received != NULL) {
+            Channel->Received(Channel->Context, Data, Length);
+        }
+        return;
+
+    case ERTM_SAR_START:
+        if (Length < ERTM_SDU_LENGTH_BYTES) {
+            Channel->Reassembling = FALSE;
+            return;
+        }
+        Channel->ReassemblyExpected = ErtmGet16(Data);
+        Data += ERTM_SDU_LENGTH_BYTES;
+        Length -= ERTM_SDU_LENGTH_BYTES;
+        if (Channel->ReassemblyExpected > ERTM_SDU_MAX || Length > Channel->ReassemblyExpected) {
+            Channel->Reassembling = FALSE;
+            return;
+        }
+        RtlCopyMemory(Channel->Reassembly, Data, Length);
+        Channel->ReassemblyLength = Length;
+        Channel->Reassembling = TRUE;
+        return;
+
+    default:
+        if (!Channel->Reassembling ||
+            Channel->ReassemblyLength + Length > Channel->ReassemblyExpected) {
+            Channel->Reassembling = FALSE;
+            return;
+        }
+        RtlCopyMemory(Channel->Reassembly + Channel->ReassemblyLength, Data, Length);
+        Channel->ReassemblyLength += Length;
+        if (Sar == ERTM_SAR_END) {
+            Channel->Reassembling = FALSE;
+            if (Channel->ReassemblyLength == Channel->ReassemblyExpected) {
+                Channel->Stats.SdusDelivered++;
+                if (Channel->Received != NULL) {
+                    Channel->Received(Channel->Context, Channel->Reassembly, Channel->ReassemblyLength);
+                }
+            }
+        }
+        return;
+    }
+}
+
+/*++
+
+Routine Description:
+    Sets up a channel. Zero RTO bounds select the defaults.
+
+Return Value:
+    FALSE if the configuration is out of range.
+
+--*/
+BOOLEAN ErtmInitialize(
+    _Out_ PERTM_CHANNEL Channel,
+    _In_ const ERTM_CONFIG* Config,
+    _In_opt_ PERTM_SDU_ACKED Acked,
+    _In_opt_ PERTM_SDU_RECEIVED Received,
+    _In_opt_ PVOID Context
+)
+{
+    RtlZeroMemory(Channel, sizeof(ERTM_CHANNEL));
+
+    if (Config->Mps < ERTM_MPS_MIN || Config->Mps > ERTM_MPS_MAX ||
+        Config->TxWindow == 0 || Config->TxWindow > ERTM_TX_WINDOW_MAX) {
+        return FALSE;
+    }
+
+    Channel->Config = *Config;
+    if (Channel->Config.RtoMinUs == 0) {
+        Channel->Config.RtoMinUs = ERTM_RTO_MIN_US;
+    }
+    if (Channel->Config.RtoMaxUs == 0) {
+        Channel->Config.RtoMaxUs = ERTM_RTO_MAX_US;
+    }
+    if (Channel->Config.RtoMaxUs < Channel->Config.RtoMinUs) {
+        Channel->Config.RtoMaxUs = Channel->Config.RtoMinUs;
+    }
+
+    Channel->Acked = Acked;
+    Channel->Received = Received;
+    Channel->Context = Context;
+    Channel->RtoUs = ERTM_RTO_INITIAL_US;
+    if (Channel->RtoUs < Channel->Config.RtoMinUs) {
+        Channel->RtoUs = Channel->Config.RtoMinUs;
+    }
+    if (Channel->RtoUs > Channel->Config.RtoMaxUs) {
+        Channel->RtoUs = Channel->Config.RtoMaxUs;
+    }
+    Channel->Stats.RtoUs = Channel->RtoUs;
+    Channel->AckedSinceTimeout = TRUE;
+    return TRUE;
+}
+
+/*++
+
+Routine Description:
+    Queues an SDU for segmentation. Data is not copied; it must stay
+    valid until the Acked callback reports Cookie, or ErtmAbort
+    returns it.
+
+Return Value:
+    FALSE if the queue is full, the SDU is empty or too long, or the
+    channel has failed.
+
+--*/
+BOOLEAN ErtmQueueSdu(
+    _Inout_ PERTM_CHANNEL Channel,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length,
+    _In_opt_ PVOID Cookie
+)
+{
+    PERTM_QUEUED_SDU sdu;
+
+    if (Channel->Failed || Length == 0 || Length > ERTM_SDU_MAX ||
+        Channel->QueueCount == ERTM_SDU_QUEUE) {
+        return FALSE;
+    }
+
+    sdu = &Channel->Queue[(Channel->QueueHead + Channel->QueueCount) % ERTM_SDU_QUEUE];
+    sdu->Data = Data;
+    sdu->Length = Length;
+    sdu->Cookie = Cookie;
+    Channel->QueueCount++;
+    return TRUE;
+}
+
+/*++
+
+Routine Description:
+    Reports whether ErtmBuildFrame would produce a frame at NowUs.
+
+--*/
+BOOLEAN ErtmHasWork(
+    _In_ const ERTM_CHANNEL* Channel,
+    _In_ ULONG64 NowUs
+)
+{
+    UCHAR seq;
+    UCHAR i;
+
+    if (Channel->Failed) {
+        return FALSE;
+    }
+    if (Channel->SrejQueueCount > 0 || ErtmAckDue(Channel, NowUs) || ErtmCanSendNew(Channel)) {
+        return TRUE;
+    }
+
+    for (i = 0, seq = Channel->ExpectedAckSeq; i < Channel->Unacked; i++, seq = ERTM_SEQ(seq + 1)) {
+        const ERTM_TX_FRAME* frame = &Channel->Tx[seq];
+        if (frame->Resend || frame->TimerUs + Channel->RtoUs <= NowUs) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*++
+
+Routine Description:
+    Earliest time at which the channel needs ErtmBuildFrame without any
+    new input: a retransmission deadline or a delayed acknowledgement.
+
+Return Value:
+    ERTM_NO_DEADLINE if nothing is pending.
+
+--*/
+ULONG64 ErtmNextDeadline(
+    _In_ const ERTM_CHANNEL* Channel
+)
+{
+    ULONG64 deadline = ERTM_NO_DEADLINE;
+    UCHAR seq;
+    UCHAR i;
+
+    if (Channel->Failed) {
+        return deadline;
+    }
+    if (Channel->AckRequired) {
+        deadline = Channel->AckDueUs;
+    }
+
+    for (i = 0, seq = Channel->ExpectedAckSeq; i < Channel->Unacked; i++, seq = ERTM_SEQ(seq + 1)) {
+        ULONG64 due = Channel->Tx[seq].TimerUs + Channel->RtoUs;
+        if (due < deadline) {
+            deadline = due;
+        }
+    }
+    return deadline;
+}
+
+static ULONG ErtmWriteSFrame(
+    PERTM_CHANNEL Channel,
+    UCHAR Function,
+    UCHAR ReqSeq,
+    PUCHAR Frame,
+    ULONG FrameSize
+)
+{
+    if (FrameSize < ERTM_S_FRAME_BYTES) {
+        return 0;
+    }
+
+    ErtmPut16(Frame, ERTM_S_FRAME_BYTES - 4);
+    ErtmPut16(Frame + 2, Channel->Config.RemoteCid);
+    ErtmPut16(Frame + 4, (USHORT)(ERTM_CTRL_S_FRAME |
+                                  (Function << ERTM_CTRL_S_SHIFT) |
+                                  (ReqSeq << ERTM_CTRL_REQSEQ_SHIFT)));
+    ErtmPut16(Frame + 6, ErtmFcs(Frame, ERTM_S_FRAME_BYTES - ERTM_FCS_BYTES));
+    return ERTM_S_FRAME_BYTES;
+}
+
+static ULONG ErtmWriteIFrame(
+    PERTM_CHANNEL Channel,
+    ULONG64 NowUs,
+    UCHAR TxSeq,
+    PUCHAR Frame,
+    ULONG FrameSize
+)
+{
+    PERTM_TX_FRAME tx = &Channel->Tx[TxSeq];
+    ULONG info = tx->Length + (tx->Sar == ERTM_SAR_START ? ERTM_SDU_LENGTH_BYTES : 0);
+    ULONG total = ERTM_HEADER_BYTES + info + ERTM_FCS_BYTES;
+    PUCHAR p = Frame + ERTM_HEADER_BYTES;
+
+    if (FrameSize < total) {
+        return 0;
+    }
+
+    ErtmPut16(Frame, (USHORT)(total - 4));
+    ErtmPut16(Frame + 2, Channel->Config.RemoteCid);
+    ErtmPut16(Frame + 4, (USHORT)((TxSeq << ERTM_CTRL_TXSEQ_SHIFT) |
+                                  (Channel->ExpectedTxSeq << ERTM_CTRL_REQSEQ_SHIFT) |
+                                  (tx->Sar << ERTM_CTRL_SAR_SHIFT)));
+    if (tx->Sar == ERTM_SAR_START) {
+        ErtmPut16(p, tx->SduLength);
+        p += ERTM_SDU_LENGTH_BYTES;
+    }
+    RtlCopyMemory(p, tx->Data, tx->Length);
+    p += tx->Length;
+    ErtmPut16(p, ErtmFcs(Frame, total - ERTM_FCS_BYTES));
+
+    tx->SentUs = NowUs;
+    tx->TimerUs = NowUs;
+    tx->Resend = FALSE;
+    if (tx->Transmissions < MAXUCHAR) {
+        tx->Transmissions++;
+    }
+
+    // The ReqSeq above acknowledges everything delivered so far
+    Channel->AckRequired = FALSE;
+    Channel->AckPending = 0;
+    return total;
+}
+
+/*++
+
+Routine Description:
+    Cuts the next frame from the SDU at the head of the queue and gives
+    it the next TxSeq.
+
+--*/
+static UCHAR ErtmSegment(PERTM_CHANNEL Channel)
+{
+    PERTM_QUEUED_SDU sdu = &Channel->Queue[Channel->QueueHead];
+    UCHAR seq = Channel->NextTxSeq;
+    PERTM_TX_FRAME tx = &Channel->Tx[seq];
+    ULONG mps = Channel->Config.Mps;
+    ULONG remaining = sdu->Length - Channel->SduOffset;
+
+    RtlZeroMemory(tx, sizeof(ERTM_TX_FRAME));
+    tx->Data = sdu->Data + Channel->SduOffset;
+    tx->Valid = TRUE;
+
+    if (Channel->SduOffset == 0 && sdu->Length <= mps) {
+        tx->Sar = ERTM_SAR_UNSEGMENTED;
+        tx->Length = (USHORT)sdu->Length;
+    } else if (Channel->SduOffset == 0) {
+        tx->Sar = ERTM_SAR_START;
+        tx->Length = (USHORT)(mps - ERTM_SDU_LENGTH_BYTES);
+        tx->SduLength = (USHORT)sdu->Length;
+    } else if (remaining <= mps) {
+        tx->Sar = ERTM_SAR_END;
+        tx->Length = (USHORT)remaining;
+    } else {
+        tx->Sar = ERTM_SAR_CONTINUE;
+        tx->Length = (USHORT)mps;
+    }
+
+    Channel->SduOffset += tx->Length;
+    if (Channel->SduOffset == sdu->Length) {
+        tx->Cookie = sdu->Cookie;
+        Channel->SduOffset = 0;
+        Channel->QueueHead = (Channel->QueueHead + 1) % ERTM_SDU_QUEUE;
+        Channel->QueueCount--;
+    }
+
+    Channel->NextTxSeq = ERTM_SEQ(seq + 1);
+    Channel->Unacked++;
+    return seq;
+}
+
+/*++
+
+Routine Description:
+    Produces the next frame for the peer, in priority order: selective
+    rejects for missing frames, retransmissions, new I-frames, then a
+    receiver-ready acknowledgement if one is due and no I-frame carried
+    it.
+
+Arguments:
+    NowUs - Current time; sets the retransmission deadline of the frame
+    Frame - Receives a complete basic L2CAP frame, FCS included
+    FrameSize - At least ERTM_HEADER_BYTES + MPS + ERTM_FCS_BYTES
+
+Return Value:
+    Frame length, or 0 if there is nothing to send. Once a frame has
+    been sent MaxTransmit times the channel fails and returns 0.
+
+--*/
+ULONG ErtmBuildFrame(
+    _Inout_ PERTM_CHANNEL Channel,
+    _In_ ULONG64 NowUs,
+    _Out_writes_bytes_(FrameSize) PUCHAR Frame,
+    _In_ ULONG FrameSize
+)
+{
+    UCHAR seq;
+    UCHAR i;
+    ULONG length;
+
+    if (Channel->Failed) {
+        return 0;
+    }
+
+    if (Channel->SrejQueueCount > 0) {
+        length = ErtmWriteSFrame(Channel, ERTM_S_SREJ, Channel->SrejQueue[0], Frame, FrameSize);
+        if (length != 0) {
+            Channel->SrejQueueCount--;
+            RtlMoveMemory(Channel->SrejQueue, Channel->SrejQueue + 1, Channel->SrejQueueCount);
+            Channel->Stats.SrejSent++;
+        }
+        return length;
+    }
+
+    // Oldest first: a rejected frame, or one whose timer has run out
+    for (i = 0, seq = Channel->ExpectedAckSeq; i < Channel->Unacked; i++, seq = ERTM_SEQ(seq + 1)) {
+        PERTM_TX_FRAME tx = &Channel->Tx[seq];
+        BOOLEAN expired = tx->TimerUs + Channel->RtoUs <= NowUs;
+
+        if (!tx->Resend && !expired) {
+            continue;
+        }
+        if (Channel->Config.MaxTransmit != 0 && tx->Transmissions >= Channel->Config.MaxTransmit) {
+            Channel->Failed = TRUE;
+            return 0;
+        }
+        if (!tx->Resend) {
+            Channel->Stats.Timeouts++;
+            // Back off only while the peer stays silent, and only on the
+            // oldest frame, so one timeout doubles once and not per frame
+            if (seq == Channel->ExpectedAckSeq) {
+                if (!Channel->AckedSinceTimeout) {
+                    ULONG64 rto = (ULONG64)Channel->RtoUs * 2;
+                    Channel->RtoUs = (ULONG)(rto > Channel->Config.RtoMaxUs ? Channel->Config.RtoMaxUs : rto);
+                    Channel->Stats.RtoUs = Channel->RtoUs;
+                }
+                Channel->AckedSinceTimeout = FALSE;
+            }
+        }
+        length = ErtmWriteIFrame(Channel, NowUs, seq, Frame, FrameSize);
+        if (length != 0) {
+            Channel->Stats.Retransmissions++;
+        }
+        return length;
+    }
+
+    if (ErtmCanSendNew(Channel)) {
+        seq = ErtmSegment(Channel);
+        length = ErtmWriteIFrame(Channel, NowUs, seq, Frame, FrameSize);
+        if (length != 0) {
+            Channel->Stats.IFramesSent++;
+        }
+        return length;
+    }
+
+    if (ErtmAckDue(Channel, NowUs)) {
+        length = ErtmWriteSFrame(Channel, ERTM_S_RR, Channel->ExpectedTxSeq, Frame, FrameSize);
+        if (length != 0) {
+            Channel->AckRequired = FALSE;
+            Channel->AckPending = 0;
+            Channel->Stats.AcksSent++;
+        }
+        return length;
+    }
+
+    return 0;
+}
+
+/*++
+
+Routine Description:
+    Handles one I-frame held in the receive window: buffers it, asks for
+    any frames missing before it, and delivers what is now in sequence.
+
+--*/
+static VOID ErtmReceiveIFrame(
+    PERTM_CHANNEL Channel,
+    ULONG64 NowUs,
+    UCHAR TxSeq,
+    UCHAR Sar,
+    const UCHAR* Info,
+    ULONG InfoLength
+)
+{
+    UCHAR offset = ERTM_SEQ(TxSeq - Channel->ExpectedTxSeq);
+    PERTM_RX_FRAME rx = &Channel->Rx[TxSeq];
+    UCHAR i;
+
+    if (offset >= Channel->Config.TxWindow || rx->Present) {
+        // Already delivered or buffered: the peer may have missed our ack
+        Channel->Stats.Duplicates++;
+        Channel->AckRequired = TRUE;
+        Channel->AckDueUs = NowUs;
+        return;
+    }
+
+    rx->Present = TRUE;
+    rx->Sar = Sar;
+    rx->Length = (USHORT)InfoLength;
+    RtlCopyMemory(rx->Data, Info, InfoLength);
+    Channel->SrejRequested[TxSeq] = FALSE;
+
+    // Request each gap once; the sender's timer covers a lost SREJ
+    for (i = 0; i < offset; i++) {
+        UCHAR missing = ERTM_SEQ(Channel->ExpectedTxSeq + i);
+        if (!Channel->Rx[missing].Present && !Channel->SrejRequested[missing]) {
+            Channel->SrejRequested[missing] = TRUE;
+            Channel->SrejQueue[Channel->SrejQueueCount++] = missing;
+        }
+    }
+
+    while (Channel->Rx[Channel->ExpectedTxSeq].Present) {
+        rx = &Channel->Rx[Channel->ExpectedTxSeq];
+        ErtmReassemble(Channel, rx->Sar, rx->Data, rx->Length);
+        rx->Present = FALSE;
+        Channel->SrejRequested[Channel->ExpectedTxSeq] = FALSE;
+        Channel->ExpectedTxSeq = ERTM_SEQ(Channel->ExpectedTxSeq + 1);
+
+        if (!Channel->AckRequired) {
+            Channel->AckRequired = TRUE;
+            Channel->AckDueUs = NowUs + ERTM_ACK_DELAY_US;
+        }
+        if (++Channel->AckPending >= ErtmAckThreshold(Channel)) {
+            Channel->AckDueUs = NowUs;
+        }
+    }
+}
+
+/*++
+
+Routine Description:
+    Consumes one frame from the peer. Delivered SDUs and acknowledged
+    SDUs are reported through the callbacks before this returns.
+
+Arguments:
+    Frame - Basic L2CAP frame: Length, CID, control field, information
+            and FCS. The CID is not checked; the caller demultiplexes.
+
+Return Value:
+    FALSE if the frame was malformed or failed its FCS and was dropped.
+
+--*/
+BOOLEAN ErtmReceiveFrame(
+    _Inout_ PERTM_CHANNEL Channel,
+    _In_ ULONG64 NowUs,
+    _In_reads_bytes_(Length) const UCHAR* Frame,
+    _In_ ULONG Length
+)
+{
+    USHORT control;
+    UCHAR reqSeq;
+    const UCHAR* info;
+    ULONG infoLength;
+
+    if (Length < ERTM_S_FRAME_BYTES || ErtmGet16(Frame) != Length - 4) {
+        Channel->Stats.FcsErrors++;
+        return FALSE;
+    }
+    if (ErtmFcs(Frame, Length - ERTM_FCS_BYTES) != ErtmGet16(Frame + Length - ERTM_FCS_BYTES)) {
+        Channel->Stats.FcsErrors++;
+        return FALSE;
+    }
+
+    control = ErtmGet16(Frame + 4);
+    reqSeq = ERTM_SEQ(control >> ERTM_CTRL_REQSEQ_SHIFT);
+
+    if (control & ERTM_CTRL_S_FRAME) {
+        switch ((control >> ERTM_CTRL_S_SHIFT) & 3) {
+        case ERTM_S_RR:
+            Channel->RemoteBusy = FALSE;
+            ErtmProcessAck(Channel, NowUs, reqSeq);
+            break;
+
+        case ERTM_S_RNR:
+            Channel->RemoteBusy = TRUE;
+            ErtmProcessAck(Channel, NowUs, reqSeq);
+            break;
+
+        case ERTM_S_REJ:
+            // Go back N: resend everything from ReqSeq on
+            Channel->Stats.RejReceived++;
+            ErtmProcessAck(Channel, NowUs, reqSeq);
+            {
+                UCHAR seq = Channel->ExpectedAckSeq;
+                UCHAR i;
+                for (i = 0; i < Channel->Unacked; i++, seq = ERTM_SEQ(seq + 1)) {
+                    Channel->Tx[seq].Resend = TRUE;
+                }
+            }
+            break;
+
+        case ERTM_S_SREJ:
+            // ReqSeq names the one missing frame and acknowledges nothing.
+            // The peer is buffering what followed it, so those frames'
+            // timers restart rather than expire while the gap is refilled.
+            Channel->Stats.SrejReceived++;
+            if (ERTM_SEQ(reqSeq - Channel->ExpectedAckSeq) < Channel->Unacked &&
+                Channel->Tx[reqSeq].Valid) {
+                UCHAR seq;
+                Channel->Tx[reqSeq].Resend = TRUE;
+                for (seq = ERTM_SEQ(reqSeq + 1); seq != Channel->NextTxSeq; seq = ERTM_SEQ(seq + 1)) {
+                    Channel->Tx[seq].TimerUs = NowUs;
+                }
+            }
+            break;
+        }
+
+        if (control & ERTM_CTRL_POLL) {
+            Channel->AckRequired = TRUE;
+            Channel->AckDueUs = NowUs;
+        }
+        return TRUE;
+    }
+
+    info = Frame + ERTM_HEADER_BYTES;
+    infoLength = Length - ERTM_HEADER_BYTES - ERTM_FCS_BYTES;
+    if (infoLength > ERTM_MPS_MAX) {
+        Channel->Stats.FcsErrors++;
+        return FALSE;
+    }
+
+    ErtmProcessAck(Channel, NowUs, reqSeq);
+    ErtmReceiveIFrame(Channel, NowUs,
+                      ERTM_SEQ(control >> ERTM_CTRL_TXSEQ_SHIFT),
+                      (UCHAR)(control >> ERTM_CTRL_SAR_SHIFT),
+                      info, infoLength);
+    return TRUE;
+}
+
+/*++
+
+Routine Description:
+    Empties the transmit side after the channel failed or is closing.
+
+Arguments:
+    Cookies - Receives the cookie of every SDU that was queued or in
+              flight and will not be acknowledged
+
+Return Value:
+    Number of cookies written.
+
+--*/
+ULONG ErtmAbort(
+    _Inout_ PERTM_CHANNEL Channel,
+    _Out_writes_to_(MaxCookies, return) PVOID* Cookies,
+    _In_ ULONG MaxCookies
+)
+{
+    ULONG count = 0;
+    UCHAR seq;
+    UCHAR i;
+
+    for (i = 0, seq = Channel->ExpectedAckSeq; i < Channel->Unacked; i++, seq = ERTM_SEQ(seq + 1)) {
+        PERTM_TX_FRAME tx = &Channel->Tx[seq];
+        if ((tx->Sar == ERTM_SAR_UNSEGMENTED || tx->Sar == ERTM_SAR_END) && count < MaxCookies) {
+            Cookies[count++] = tx->Cookie;
+        }
+        tx->Valid = FALSE;
+    }
+
+    while (Channel->QueueCount > 0) {
+        if (count < MaxCookies) {
+            Cookies[count++] = Channel->Queue[Channel->QueueHead].Cookie;
+        }
+        Channel->QueueHead = (Channel->QueueHead + 1) % ERTM_SDU_QUEUE;
+        Channel->QueueCount--;
+    }
+
+    Channel->ExpectedAckSeq = Channel->NextTxSeq;
+    Channel->Unacked = 0;
+    Channel->SduOffset = 0;
+    return count;
+}
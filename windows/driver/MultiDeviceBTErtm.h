@@ -0,0 +1,222 @@
+/*++
+
+Module Name:
+    MultiDeviceBTErtm.h
+
+Abstract:
+    L2CAP Enhanced Retransmission Mode. Outgoing SDUs are segmented into
+    sequence-numbered I-frames, and at most TxWindow of them are
+    unacknowledged at a time. The receiver asks for each missing frame
+    with a selective reject (SREJ), buffers what arrives out of order,
+    and delivers SDUs in sequence. Each frame's retransmission timeout
+    comes from a smoothed round-trip time, not a fixed value.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the time and moves the frames; nothing here blocks, locks
+    or allocates.
+
+--*/
+
+#ifndef _MULTIDEVICEBTERTM_H_
+#define _MULTIDEVICEBTERTM_H_
+
+#define ERTM_SEQ_MODULO             64
+#define ERTM_TX_WINDOW_MAX          63
+#define ERTM_MPS_MIN                48
+#define ERTM_MPS_MAX                1010    // 3-DH5 less the L2CAP headers
+#define ERTM_SDU_MAX                4096
+#define ERTM_SDU_QUEUE              16      // SDUs accepted ahead of the window
+#define ERTM_HEADER_BYTES           6       // Length, CID, enhanced control field
+#define ERTM_SDU_LENGTH_BYTES       2       // Start frames only
+#define ERTM_FCS_BYTES              2
+#define ERTM_FRAME_MAX              (ERTM_HEADER_BYTES + ERTM_MPS_MAX + ERTM_FCS_BYTES)
+#define ERTM_S_FRAME_BYTES          (ERTM_HEADER_BYTES + ERTM_FCS_BYTES)
+
+#define ERTM_RTO_INITIAL_US         100000
+#define ERTM_RTO_MIN_US             20000
+#define ERTM_RTO_MAX_US             2000000
+#define ERTM_ACK_DELAY_US           10000   // Longest a received frame goes unacknowledged
+#define ERTM_NO_DEADLINE            ((ULONG64)-1)
+
+// Enhanced control field (Core Vol 3 Part A, 3.3.2)
+#define ERTM_CTRL_S_FRAME           0x0001
+#define ERTM_CTRL_TXSEQ_SHIFT       1
+#define ERTM_CTRL_S_SHIFT           2
+#define ERTM_CTRL_POLL              0x0010
+#define ERTM_CTRL_FINAL             0x0080
+#define ERTM_CTRL_REQSEQ_SHIFT      8
+#define ERTM_CTRL_SAR_SHIFT         14
+
+#define ERTM_S_RR                   0
+#define ERTM_S_REJ                  1
+#define ERTM_S_RNR                  2
+#define ERTM_S_SREJ                 3
+
+#define ERTM_SAR_UNSEGMENTED        0
+#define ERTM_SAR_START              1
+#define ERTM_SAR_END                2
+#define ERTM_SAR_CONTINUE           3
+
+typedef struct _ERTM_CONFIG {
+    USHORT RemoteCid;           // Destination CID written into each frame
+    USHORT Mps;                 // Peer's MPS: I-frame payload, SDU length field included
+    UCHAR TxWindow;             // <= ERTM_TX_WINDOW_MAX
+    UCHAR MaxTransmit;          // Transmissions per frame before the channel fails; 0 = no limit
+    USHORT Reserved;
+    ULONG RtoMinUs;             // 0 selects ERTM_RTO_MIN_US
+    ULONG RtoMaxUs;             // 0 selects ERTM_RTO_MAX_US
+} ERTM_CONFIG, *PERTM_CONFIG;
+
+typedef struct _ERTM_STATS {
+    ULONG IFramesSent;
+    ULONG Retransmissions;
+    ULONG Timeouts;             // Frames resent because their timer expired
+    ULONG SrejSent;
+    ULONG SrejReceived;
+    ULONG RejReceived;
+    ULONG AcksSent;             // RR frames
+    ULONG FcsErrors;
+    ULONG Duplicates;
+    ULONG SdusDelivered;
+    ULONG SdusAcked;
+    ULONG SrttUs;
+    ULONG RttVarUs;
+    ULONG RtoUs;
+} ERTM_STATS, *PERTM_STATS;
+
+// Called when every frame of an SDU has been acknowledged
+typedef VOID
+ERTM_SDU_ACKED(
+    _In_opt_ PVOID Context,
+    _In_opt_ PVOID Cookie
+);
+typedef ERTM_SDU_ACKED *PERTM_SDU_ACKED;
+
+// Called with each SDU reassembled in sequence. Data is valid only for
+// the duration of the call.
+typedef VOID
+ERTM_SDU_RECEIVED(
+    _In_opt_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+);
+typedef ERTM_SDU_RECEIVED *PERTM_SDU_RECEIVED;
+
+typedef struct _ERTM_TX_FRAME {
+    const UCHAR* Data;          // Into the caller's SDU, which stays valid until acknowledged
+    USHORT Length;
+    UCHAR Sar;
+    UCHAR Transmissions;
+    USHORT SduLength;           // Start frames
+    BOOLEAN Resend;             // SREJ, REJ or timeout; goes out before new frames
+    BOOLEAN Valid;
+    ULONG64 SentUs;             // Last transmission
+    ULONG64 TimerUs;            // Retransmission timer start; an SREJ restarts it
+    PVOID Cookie;               // Set on the SDU's last frame
+} ERTM_TX_FRAME, *PERTM_TX_FRAME;
+
+typedef struct _ERTM_RX_FRAME {
+    BOOLEAN Present;
+    UCHAR Sar;
+    USHORT Length;
+    UCHAR Data[ERTM_MPS_MAX];
+} ERTM_RX_FRAME, *PERTM_RX_FRAME;
+
+typedef struct _ERTM_QUEUED_SDU {
+    const UCHAR* Data;
+    ULONG Length;
+    PVOID Cookie;
+} ERTM_QUEUED_SDU, *PERTM_QUEUED_SDU;
+
+typedef struct _ERTM_CHANNEL {
+    ERTM_CONFIG Config;
+    PERTM_SDU_ACKED Acked;
+    PERTM_SDU_RECEIVED Received;
+    PVOID Context;
+    BOOLEAN Failed;             // A frame reached MaxTransmit
+    BOOLEAN RemoteBusy;         // RNR received
+
+    // Transmit: frames [ExpectedAckSeq, NextTxSeq) are unacknowledged
+    UCHAR NextTxSeq;
+    UCHAR ExpectedAckSeq;
+    UCHAR Unacked;
+    ERTM_TX_FRAME Tx[ERTM_SEQ_MODULO];
+    ERTM_QUEUED_SDU Queue[ERTM_SDU_QUEUE];
+    ULONG QueueHead;
+    ULONG QueueCount;
+    ULONG SduOffset;            // Segmented bytes of Queue[QueueHead]
+
+    // Round-trip estimate (RFC 6298, with Karn's rule)
+    ULONG SrttUs;
+    ULONG RttVarUs;
+    ULONG RtoUs;
+    BOOLEAN RttValid;
+    BOOLEAN AckedSinceTimeout;  // A second timeout without one doubles the RTO
+
+    // Receive: frames before ExpectedTxSeq are delivered
+    UCHAR ExpectedTxSeq;
+    UCHAR AckPending;           // Frames delivered since the last acknowledgement
+    BOOLEAN AckRequired;
+    ULONG64 AckDueUs;
+    BOOLEAN SrejRequested[ERTM_SEQ_MODULO];
+    UCHAR SrejQueue[ERTM_SEQ_MODULO];  // Missing frames to request, oldest first
+    ULONG SrejQueueCount;
+    ULONG ReassemblyLength;
+    ULONG ReassemblyExpected;
+    BOOLEAN Reassembling;
+    UCHAR Reassembly[ERTM_SDU_MAX];
+    ERTM_RX_FRAME Rx[ERTM_SEQ_MODULO];
+
+    ERTM_STATS Stats;
+} ERTM_CHANNEL, *PERTM_CHANNEL;
+
+BOOLEAN ErtmInitialize(
+    _Out_ PERTM_CHANNEL Channel,
+    _In_ const ERTM_CONFIG* Config,
+    _In_opt_ PERTM_SDU_ACKED Acked,
+    _In_opt_ PERTM_SDU_RECEIVED Received,
+    _In_opt_ PVOID Context
+);
+
+BOOLEAN ErtmQueueSdu(
+    _Inout_ PERTM_CHANNEL Channel,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length,
+    _In_opt_ PVOID Cookie
+);
+
+BOOLEAN ErtmHasWork(
+    _In_ const ERTM_CHANNEL* Channel,
+    _In_ ULONG64 NowUs
+);
+
+ULONG ErtmBuildFrame(
+    _Inout_ PERTM_CHANNEL Channel,
+    _In_ ULONG64 NowUs,
+    _Out_writes_bytes_(FrameSize) PUCHAR Frame,
+    _In_ ULONG FrameSize
+);
+
+BOOLEAN ErtmReceiveFrame(
+    _Inout_ PERTM_CHANNEL Channel,
+    _In_ ULONG64 NowUs,
+    _In_reads_bytes_(Length) const UCHAR* Frame,
+    _In_ ULONG Length
+);
+
+ULONG64 ErtmNextDeadline(
+    _In_ const ERTM_CHANNEL* Channel
+);
+
+ULONG ErtmAbort(
+    _Inout_ PERTM_CHANNEL Channel,
+    _Out_writes_to_(MaxCookies, return) PVOID* Cookies,
+    _In_ ULONG MaxCookies
+);
+
+USHORT ErtmFcs(
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+);
+
+#endif // _MULTIDEVICEBTERTM_H_
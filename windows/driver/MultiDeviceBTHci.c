@@ -0,0 +1,538 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHci.c
+
+Abstract:
+    Zero-copy HCI event parser with batching.
+
+    The buffer is a run of events as the controller sends them on its
+    event channel: event code, parameter length, parameters. Each event
+    is framed by its own length, so an event whose parameters disagree
+    with what its code requires is skipped and counted, and parsing
+    carries on with the next one. A buffer that ends inside an event
+    stops there. Offset then tells the caller how much was consumed, and
+    the tail can be resubmitted with the rest of the event.
+
+    Parameters are read through a cursor over the event's parameters.
+    Reads past the end return zero and set a sticky overrun flag, which
+    is checked once per event instead of on every field. Items are
+    appended straight into the batch and dropped again if the event
+    turns out to be malformed. Advertising data and command return
+    parameters stay where they are; the items point at them.
+
+    Multi-report events (advertising reports, completed packets) are
+    read one record per report, the layout controllers send and other
+    host stacks parse. A batch ends at the first event of another kind,
+    so items from different kinds keep the controller's order across
+    batches. It also ends when the next event's items might not fit.
+    Events the parser does not decode come back one per batch with
+    their raw parameters.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTHci.h"
+
+#define HCI_LEGACY_ADV_MAX_DATA     31
+#define HCI_LEGACY_ADV_MIN_BYTES    10      // One report with no data
+#define HCI_EXT_ADV_MIN_BYTES       24
+#define HCI_HANDLE_MASK             0x0FFF
+
+typedef struct _HCI_VIEW {
+    const UCHAR* Data;
+    ULONG Length;
+    ULONG Offset;
+    BOOLEAN Overrun;
+} HCI_VIEW, *PHCI_VIEW;
+
+static __forceinline const UCHAR*
+HciViewTake(
+    _Inout_ PHCI_VIEW View,
+    _In_ ULONG Bytes
+)
+{
+    const UCHAR* p;
+
+    if (Bytes > View->Length - View->Offset) {
+        View->Overrun = TRUE;
+        View->Offset = View->Length;
+        return NULL;
+    }
+
+    p = View->Data + View->Offset;
+    View->Offset += Bytes;
+    return p;
+}
+
+static __forceinline UCHAR
+HciViewU8(
+    _Inout_ PHCI_VIEW View
+)
+{
+    const UCHAR* p = HciViewTake(View, 1);
+
+    return (p != NULL) ? p[0] : 0;
+}
+
+static __forceinline USHORT
+HciViewU16(
+    _Inout_ PHCI_VIEW View
+)
+{
+    const UCHAR* p = HciViewTake(View, 2);
+
+    return (p != NULL) ? (USHORT)(p[0] | (p[1] << 8)) : 0;
+}
+
+static __forceinline BTH_ADDR
+HciViewAddress(
+    _Inout_ PHCI_VIEW View
+)
+{
+    const UCHAR* p = HciViewTake(View, 6);
+
+    if (p == NULL) {
+        return 0;
+    }
+
+    return (BTH_ADDR)p[0] | ((BTH_ADDR)p[1] << 8) | ((BTH_ADDR)p[2] << 16) |
+        ((BTH_ADDR)p[3] << 24) | ((BTH_ADDR)p[4] << 32) | ((BTH_ADDR)p[5] << 40);
+}
+
+/*++
+Routine Description:
+    Classifies an event and reports how many items it claims to carry.
+    The count is only a claim until the event has been decoded.
+
+Return Value:
+    The batch kind; *Items is 0 when the event cannot hold any
+--*/
+static HCI_BATCH_KIND
+HciClassify(
+    _In_ UCHAR EventCode,
+    _In_reads_bytes_(Length) const UCHAR* Parameters,
+    _In_ ULONG Length,
+    _Out_ PULONG Items
+)
+{
+    *Items = 1;
+
+    switch (EventCode) {
+    case HCI_EV_CONNECTION_COMPLETE:
+        return HciBatchConnections;
+
+    case HCI_EV_DISCONNECTION_COMPLETE:
+        return HciBatchDisconnections;
+
+    case HCI_EV_COMMAND_COMPLETE:
+    case HCI_EV_COMMAND_STATUS:
+        return HciBatchCommands;
+
+    case HCI_EV_NUMBER_OF_COMPLETED_PACKETS:
+        *Items = (Length >= 1) ? Parameters[0] : 0;
+        return HciBatchCompletedPackets;
+
+    case HCI_EV_LE_META:
+        if (Length < 1) {
+            break;
+        }
+
+        switch (Parameters[0]) {
+        case HCI_LE_CONNECTION_COMPLETE:
+        case HCI_LE_ENHANCED_CONNECTION_COMPLETE:
+            return HciBatchConnections;
+
+        case HCI_LE_CONNECTION_UPDATE_COMPLETE:
+            return HciBatchConnectionUpdates;
+
+        case HCI_LE_ADVERTISING_REPORT:
+        case HCI_LE_EXTENDED_ADVERTISING_REPORT:
+            *Items = (Length >= 2) ? Parameters[1] : 0;
+            return HciBatchAdvertising;
+        }
+        break;
+    }
+
+    return HciBatchOther;
+}
+
+static BOOLEAN
+HciDecodeAdvertising(
+    _Inout_ PHCI_VIEW View,
+    _In_ UCHAR Subevent,
+    _Inout_ PHCI_EVENT_BATCH Batch
+)
+{
+    PHCI_ADV_REPORT report;
+    ULONG reports;
+    ULONG i;
+
+    HciViewU8(View);    // Subevent code
+    reports = HciViewU8(View);
+
+    // Rejects a report count the parameters could not possibly hold
+    // before any item is written
+    if (reports * (Subevent == HCI_LE_ADVERTISING_REPORT ?
+            HCI_LEGACY_ADV_MIN_BYTES : HCI_EXT_ADV_MIN_BYTES) > View->Length - View->Offset) {
+        return FALSE;
+    }
+
+    report = &Batch->u.Advertising[Batch->Count];
+
+    for (i = 0; i < reports; i++, report++) {
+        if (Subevent == HCI_LE_ADVERTISING_REPORT) {
+            report->EventType = HciViewU8(View);
+            report->AddressType = HciViewU8(View);
+            report->Address = HciViewAddress(View);
+            report->DataLength = HciViewU8(View);
+            report->Data = HciViewTake(View, report->DataLength);
+            report->Rssi = (CHAR)HciViewU8(View);
+            report->TxPower = HCI_RSSI_UNAVAILABLE;
+            report->PrimaryPhy = 0;
+            report->Extended = FALSE;
+
+            if (report->DataLength > HCI_LEGACY_ADV_MAX_DATA) {
+                return FALSE;
+            }
+        } else {
+            report->EventType = HciViewU16(View);
+            report->AddressType = HciViewU8(View);
+            report->Address = HciViewAddress(View);
+            report->PrimaryPhy = HciViewU8(View);
+            HciViewU8(View);                // Secondary PHY
+            HciViewU8(View);                // Advertising SID
+            report->TxPower = (CHAR)HciViewU8(View);
+            report->Rssi = (CHAR)HciViewU8(View);
+            HciViewTake(View, 2 + 1 + 6);   // Periodic interval, direct address
+            report->DataLength = HciViewU8(View);
+            report->Data = HciViewTake(View, report->DataLength);
+            report->Extended = TRUE;
+        }
+
+        if (View->Overrun) {
+            return FALSE;
+        }
+    }
+
+    Batch->Count += reports;
+    return TRUE;
+}
+
+static BOOLEAN
+HciDecodeCompletedPackets(
+    _Inout_ PHCI_VIEW View,
+    _Inout_ PHCI_EVENT_BATCH Batch
+)
+{
+    PHCI_COMPLETED_PACKETS completed;
+    ULONG handles;
+    ULONG i;
+
+    handles = HciViewU8(View);
+    if (handles * 4 > View->Length - View->Offset) {
+        return FALSE;
+    }
+
+    completed = &Batch->u.Completed[Batch->Count];
+
+    for (i = 0; i < handles; i++) {
+        completed[i].Handle = HciViewU16(View) & HCI_HANDLE_MASK;
+        completed[i].Packets = HciViewU16(View);
+    }
+
+    Batch->Count += handles;
+    return TRUE;
+}
+
+static BOOLEAN
+HciDecodeConnection(
+    _Inout_ PHCI_VIEW View,
+    _In_ UCHAR EventCode,
+    _Inout_ PHCI_EVENT_BATCH Batch
+)
+{
+    PHCI_CONNECTION_COMPLETE connection = &Batch->u.Connections[Batch->Count];
+    UCHAR subevent;
+
+    RtlZeroMemory(connection, sizeof(*connection));
+
+    if (EventCode == HCI_EV_CONNECTION_COMPLETE) {
+        connection->Status = HciViewU8(View);
+        connection->Handle = HciViewU16(View) & HCI_HANDLE_MASK;
+        connection->PeerAddress = HciViewAddress(View);
+        // SCO links have no ACL traffic; ACL links are BR/EDR
+        connection->LinkType = (HciViewU8(View) == 0x00) ? HCI_LINK_SCO : HCI_LINK_BR_EDR;
+        HciViewU8(View);    // Encryption enabled
+    } else {
+        subevent = HciViewU8(View);
+        connection->Status = HciViewU8(View);
+        connection->Handle = HciViewU16(View) & HCI_HANDLE_MASK;
+        connection->Role = HciViewU8(View);
+        connection->PeerAddressType = HciViewU8(View);
+        connection->PeerAddress = HciViewAddress(View);
+        if (subevent == HCI_LE_ENHANCED_CONNECTION_COMPLETE) {
+            HciViewTake(View, 6 + 6);   // Local and peer resolvable private addresses
+        }
+        connection->Interval = HciViewU16(View);
+        connection->Latency = HciViewU16(View);
+        connection->SupervisionTimeout = HciViewU16(View);
+        HciViewU8(View);    // Central clock accuracy
+        connection->LinkType = HCI_LINK_LE;
+    }
+
+    if (View->Overrun) {
+        return FALSE;
+    }
+
+    Batch->Count++;
+    return TRUE;
+}
+
+static BOOLEAN
+HciDecodeDisconnection(
+    _Inout_ PHCI_VIEW View,
+    _Inout_ PHCI_EVENT_BATCH Batch
+)
+{
+    PHCI_DISCONNECTION disconnection = &Batch->u.Disconnections[Batch->Count];
+
+    disconnection->Status = HciViewU8(View);
+    disconnection->Handle = HciViewU16(View) & HCI_HANDLE_MASK;
+    disconnection->Reason = HciViewU8(View);
+
+    if (View->Overrun) {
+        return FALSE;
+    }
+
+    Batch->Count++;
+    return TRUE;
+}
+
+static BOOLEAN
+HciDecodeConnectionUpdate(
+    _Inout_ PHCI_VIEW View,
+    _Inout_ PHCI_EVENT_BATCH Batch
+)
+{
+    PHCI_CONNECTION_UPDATE update = &Batch->u.Updates[Batch->Count];
+
+    HciViewU8(View);    // Subevent code
+    update->Status = HciViewU8(View);
+    update->Handle = HciViewU16(View) & HCI_HANDLE_MASK;
+    update->Interval = HciViewU16(View);
+    update->Latency = HciViewU16(View);
+    update->SupervisionTimeout = HciViewU16(View);
+    update->Reserved = 0;
+
+    if (View->Overrun) {
+        return FALSE;
+    }
+
+    Batch->Count++;
+    return TRUE;
+}
+
+static BOOLEAN
+HciDecodeCommand(
+    _Inout_ PHCI_VIEW View,
+    _In_ UCHAR EventCode,
+    _Inout_ PHCI_EVENT_BATCH Batch
+)
+{
+    PHCI_COMMAND_EVENT command = &Batch->u.Commands[Batch->Count];
+
+    if (EventCode == HCI_EV_COMMAND_COMPLETE) {
+        command->NumCommandPackets = HciViewU8(View);
+        command->Opcode = HciViewU16(View);
+        command->ReturnLength = (UCHAR)(View->Length - View->Offset);
+        command->ReturnParameters = View->Data + View->Offset;
+        command->Status = (command->ReturnLength != 0) ? command->ReturnParameters[0] : 0;
+        command->Complete = TRUE;
+    } else {
+        command->Status = HciViewU8(View);
+        command->NumCommandPackets = HciViewU8(View);
+        command->Opcode = HciViewU16(View);
+        command->ReturnParameters = NULL;
+        command->ReturnLength = 0;
+        command->Complete = FALSE;
+    }
+
+    if (View->Overrun) {
+        return FALSE;
+    }
+
+    Batch->Count++;
+    return TRUE;
+}
+
+/*++
+Routine Description:
+    Starts a reader at the beginning of Buffer. The buffer must stay
+    valid, and unchanged, for as long as batches read from it are used.
+
+Arguments:
+    Reader - Reader to initialize
+    Buffer - Raw HCI events
+    Length - Bytes in Buffer
+    Stats - Counters the reader adds to; not reset here
+--*/
+VOID
+HciReaderInitialize(
+    _Out_ PHCI_EVENT_READER Reader,
+    _In_reads_bytes_(Length) const UCHAR* Buffer,
+    _In_ ULONG Length,
+    _Inout_ PHCI_PARSE_STATS Stats
+)
+{
+    Reader->Buffer = Buffer;
+    Reader->Length = Length;
+    Reader->Offset = 0;
+    Reader->Stats = Stats;
+}
+
+/*++
+Routine Description:
+    Reads the next batch: every consecutive event of one kind, up to
+    HCI_BATCH_MAX items, or a single event the parser does not decode.
+    Malformed events are skipped and counted.
+
+Arguments:
+    Reader - Reader positioned by the previous call
+    Batch - Receives the batch
+
+Return Value:
+    STATUS_SUCCESS with at least one item in Batch
+    STATUS_NO_MORE_ENTRIES when the buffer is exhausted. Reader->Offset
+    is then short of the original length if the last event was cut off.
+--*/
+NTSTATUS
+HciReadBatch(
+    _Inout_ PHCI_EVENT_READER Reader,
+    _Out_ PHCI_EVENT_BATCH Batch
+)
+{
+    PHCI_PARSE_STATS stats = Reader->Stats;
+    HCI_BATCH_KIND kind;
+    HCI_VIEW view;
+    const UCHAR* event;
+    UCHAR eventCode;
+    ULONG items;
+    ULONG saved;
+    BOOLEAN valid;
+
+    Batch->Kind = HciBatchNone;
+    Batch->Count = 0;
+    Batch->Events = 0;
+
+    while (Reader->Offset < Reader->Length) {
+        event = Reader->Buffer + Reader->Offset;
+
+        if (Reader->Length - Reader->Offset < HCI_EVENT_HEADER_BYTES ||
+            Reader->Length - Reader->Offset < HCI_EVENT_HEADER_BYTES + (ULONG)event[1]) {
+            stats->Truncated++;
+            Reader->Length = Reader->Offset;
+            break;
+        }
+
+        eventCode = event[0];
+        view.Data = event + HCI_EVENT_HEADER_BYTES;
+        view.Length = event[1];
+        view.Offset = 0;
+        view.Overrun = FALSE;
+
+        kind = HciClassify(eventCode, view.Data, view.Length, &items);
+
+        if (Batch->Count != 0 &&
+            (kind != Batch->Kind || kind == HciBatchOther ||
+             Batch->Count + items > HCI_BATCH_MAX)) {
+            break;
+        }
+
+        Reader->Offset += HCI_EVENT_HEADER_BYTES + view.Length;
+        stats->Events++;
+        stats->Bytes += HCI_EVENT_HEADER_BYTES + view.Length;
+
+        if (kind == HciBatchOther) {
+            Batch->Kind = HciBatchOther;
+            Batch->Count = 1;
+            Batch->Events = 1;
+            Batch->EventCode = eventCode;
+            Batch->Parameters = view.Data;
+            Batch->ParameterLength = view.Length;
+            stats->OtherEvents++;
+            stats->Batches++;
+            return STATUS_SUCCESS;
+        }
+
+        saved = Batch->Count;
+
+        if (items == 0 || items > HCI_BATCH_MAX) {
+            valid = FALSE;
+        } else {
+            switch (kind) {
+            case HciBatchAdvertising:
+                valid = HciDecodeAdvertising(&view, view.Data[0], Batch);
+                break;
+            case HciBatchCompletedPackets:
+                valid = HciDecodeCompletedPackets(&view, Batch);
+                break;
+            case HciBatchConnections:
+                valid = HciDecodeConnection(&view, eventCode, Batch);
+                break;
+            case HciBatchDisconnections:
+                valid = HciDecodeDisconnection(&view, Batch);
+                break;
+            case HciBatchConnectionUpdates:
+                valid = HciDecodeConnectionUpdate(&view, Batch);
+                break;
+            default:
+                valid = HciDecodeCommand(&view, eventCode, Batch);
+                break;
+            }
+        }
+
+        if (!valid) {
+            Batch->Count = saved;
+            stats->Malformed++;
+            continue;
+        }
+
+        Batch->Kind = kind;
+        Batch->Events++;
+
+        switch (kind) {
+        case HciBatchAdvertising:
+            stats->AdvertisingReports += items;
+            break;
+        case HciBatchCompletedPackets:
+            stats->CompletedHandles += items;
+            break;
+        case HciBatchCommands:
+            stats->CommandEvents++;
+            break;
+        default:
+            stats->ConnectionEvents++;
+            break;
+        }
+    }
+
+    if (Batch->Count == 0) {
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    stats->Batches++;
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHci.h
+
+Abstract:
+    Zero-copy HCI event parser. A reader walks a buffer of raw
+    controller events (event code, parameter length, parameters) with
+    bounds-checked reads and hands them back in batches: runs of
+    consecutive events of the same kind, such as every advertising
+    report in the buffer, come back together so the caller dispatches
+    them in one call. Batch items are small decoded records.
+    Advertising data and command return parameters are not copied;
+    they point into the caller's buffer and are valid only as long as
+    it is.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the storage and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTHCI_H_
+#define _MULTIDEVICEBTHCI_H_
+
+#define HCI_EVENT_HEADER_BYTES      2
+#define HCI_MAX_EVENT_PARAMETERS    255
+
+// Items per batch. One event never carries more than this many reports
+// or handles, so an event always fits in an empty batch.
+#define HCI_BATCH_MAX               64
+
+// Event codes (Core Vol 4 Part E, 7.7)
+#define HCI_EV_CONNECTION_COMPLETE          0x03
+#define HCI_EV_DISCONNECTION_COMPLETE       0x05
+#define HCI_EV_COMMAND_COMPLETE             0x0E
+#define HCI_EV_COMMAND_STATUS               0x0F
+#define HCI_EV_NUMBER_OF_COMPLETED_PACKETS  0x13
+#define HCI_EV_LE_META                      0x3E
+
+// LE meta subevent codes
+#define HCI_LE_CONNECTION_COMPLETE          0x01
+#define HCI_LE_ADVERTISING_REPORT           0x02
+#define HCI_LE_CONNECTION_UPDATE_COMPLETE   0x03
+#define HCI_LE_ENHANCED_CONNECTION_COMPLETE 0x0A
+#define HCI_LE_EXTENDED_ADVERTISING_REPORT  0x0D
+
+// HCI_CONNECTION_COMPLETE.LinkType
+#define HCI_LINK_SCO                0x00
+#define HCI_LINK_BR_EDR             0x01
+#define HCI_LINK_LE                 0x02
+
+// HCI_ADV_REPORT.Rssi when the controller could not measure it
+#define HCI_RSSI_UNAVAILABLE        127
+
+typedef enum _HCI_BATCH_KIND {
+    HciBatchNone = 0,
+    HciBatchAdvertising,        // Legacy and extended LE advertising reports
+    HciBatchCompletedPackets,   // Number Of Completed Packets, one item per handle
+    HciBatchConnections,        // BR/EDR, LE and LE enhanced connection complete
+    HciBatchDisconnections,
+    HciBatchConnectionUpdates,  // LE connection update complete
+    HciBatchCommands,           // Command complete and command status
+    HciBatchOther               // Any other event, one per batch, undecoded
+} HCI_BATCH_KIND;
+
+typedef struct _HCI_ADV_REPORT {
+    BTH_ADDR Address;
+    const UCHAR* Data;          // Into the event buffer
+    USHORT EventType;           // As sent; legacy and extended types differ
+    UCHAR AddressType;
+    UCHAR DataLength;
+    CHAR Rssi;                  // HCI_RSSI_UNAVAILABLE if not measured
+    CHAR TxPower;               // Extended reports only
+    UCHAR PrimaryPhy;           // Extended reports only
+    BOOLEAN Extended;
+} HCI_ADV_REPORT, *PHCI_ADV_REPORT;
+
+typedef struct _HCI_COMPLETED_PACKETS {
+    USHORT Handle;
+    USHORT Packets;
+} HCI_COMPLETED_PACKETS, *PHCI_COMPLETED_PACKETS;
+
+typedef struct _HCI_CONNECTION_COMPLETE {
+    BTH_ADDR PeerAddress;
+    USHORT Handle;
+    USHORT Interval;            // 1.25 ms units; LE only
+    USHORT Latency;             // LE only
+    USHORT SupervisionTimeout;  // 10 ms units; LE only
+    UCHAR Status;
+    UCHAR LinkType;             // HCI_LINK_*
+    UCHAR Role;                 // LE only
+    UCHAR PeerAddressType;      // LE only
+} HCI_CONNECTION_COMPLETE, *PHCI_CONNECTION_COMPLETE;
+
+typedef struct _HCI_DISCONNECTION {
+    USHORT Handle;
+    UCHAR Status;
+    UCHAR Reason;
+} HCI_DISCONNECTION, *PHCI_DISCONNECTION;
+
+typedef struct _HCI_CONNECTION_UPDATE {
+    USHORT Handle;
+    USHORT Interval;
+    USHORT Latency;
+    USHORT SupervisionTimeout;
+    UCHAR Status;
+    UCHAR Reserved;
+} HCI_CONNECTION_UPDATE, *PHCI_CONNECTION_UPDATE;
+
+typedef struct _HCI_COMMAND_EVENT {
+    const UCHAR* ReturnParameters;  // Into the event buffer; command complete only
+    USHORT Opcode;
+    UCHAR NumCommandPackets;    // Commands the controller will now accept
+    UCHAR Status;               // First return parameter for command complete
+    UCHAR ReturnLength;
+    BOOLEAN Complete;           // FALSE for command status
+} HCI_COMMAND_EVENT, *PHCI_COMMAND_EVENT;
+
+typedef struct _HCI_EVENT_BATCH {
+    HCI_BATCH_KIND Kind;
+    ULONG Count;                // Items below
+    ULONG Events;               // HCI events the items came from
+    UCHAR EventCode;            // HciBatchOther
+    const UCHAR* Parameters;    // HciBatchOther; into the event buffer
+    ULONG ParameterLength;
+    union {
+        HCI_ADV_REPORT Advertising[HCI_BATCH_MAX];
+        HCI_COMPLETED_PACKETS Completed[HCI_BATCH_MAX];
+        HCI_CONNECTION_COMPLETE Connections[HCI_BATCH_MAX];
+        HCI_DISCONNECTION Disconnections[HCI_BATCH_MAX];
+        HCI_CONNECTION_UPDATE Updates[HCI_BATCH_MAX];
+        HCI_COMMAND_EVENT Commands[HCI_BATCH_MAX];
+    } u;
+} HCI_EVENT_BATCH, *PHCI_EVENT_BATCH;
+
+typedef struct _HCI_PARSE_STATS {
+    ULONG64 Bytes;              // In whole events
+    ULONG64 Events;
+    ULONG64 Batches;
+    ULONG64 AdvertisingReports;
+    ULONG64 CompletedHandles;
+    ULONG64 ConnectionEvents;   // Complete, update and disconnection
+    ULONG64 CommandEvents;
+    ULONG64 OtherEvents;
+    ULONG64 Malformed;          // Skipped: parameters disagree with the event length
+    ULONG64 Truncated;          // Buffers ending inside an event
+} HCI_PARSE_STATS, *PHCI_PARSE_STATS;
+
+typedef struct _HCI_EVENT_READER {
+    const UCHAR* Buffer;
+    ULONG Length;               // Shortened to Offset when the last event is cut off
+    ULONG Offset;               // Bytes consumed, always on an event boundary
+    PHCI_PARSE_STATS Stats;
+} HCI_EVENT_READER, *PHCI_EVENT_READER;
+
+VOID HciReaderInitialize(
+    _Out_ PHCI_EVENT_READER Reader,
+    _In_reads_bytes_(Length) const UCHAR* Buffer,
+    _In_ ULONG Length,
+    _Inout_ PHCI_PARSE_STATS Stats
+);
+
+NTSTATUS HciReadBatch(
+    _Inout_ PHCI_EVENT_READER Reader,
+    _Out_ PHCI_EVENT_BATCH Batch
+);
+
+#endif // _MULTIDEVICEBTHCI_H_
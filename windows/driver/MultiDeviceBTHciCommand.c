@@ -0,0 +1,364 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHciCommand.c
+
+Abstract:
+    HCI command pipeline.
+
+    Sent one at a time, each waiting for its Command Complete before the
+    next, configuration changes (connection parameter updates, PHY
+    changes, accept-list edits) cost a full event round trip per
+    command, even when the controller would take several at once.
+
+    Commands are now queued by priority in the command scheduler
+    (MultiDeviceBTCmdQueue.c), which merges redundant ones. The HCI
+    transport agent pends IOCTL_MULTI_BT_HCI_FETCH_COMMANDS on a manual
+    queue. Whenever a command is queued, credits come back or a fetch
+    arrives, pended fetches are completed with as many commands as the
+    controller has credits for, packed back to back. The agent sends
+    them in order and feeds the controller's events back through
+    IOCTL_MULTI_BT_HCI_SUBMIT_EVENTS. Their Command Complete and Command
+    Status events acknowledge the commands and set the credits.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HciCommandCreateFetchQueue)
+#endif
+
+static __forceinline ULONG64
+HciCommandNowUs(VOID)
+{
+    return KeQueryInterruptTime() / 10;
+}
+
+/*++
+Routine Description:
+    Initializes an empty command pipeline
+--*/
+VOID
+HciCommandInitialize(
+    _Out_ PHCI_COMMAND_CONTEXT Commands
+)
+{
+    RtlZeroMemory(Commands, sizeof(*Commands));
+    KeInitializeSpinLock(&Commands->Lock);
+    CmdQueueInitialize(&Commands->Queue, Commands->Entries, HCI_COMMAND_QUEUE_DEPTH);
+}
+
+/*++
+Routine Description:
+    Creates the manual queue that holds pended command fetches
+
+Arguments:
+    Commands - Device's command pipeline
+    Device - Parent device
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HciCommandCreateFetchQueue(
+    _Inout_ PHCI_COMMAND_CONTEXT Commands,
+    _In_ WDFDEVICE Device
+)
+{
+    WDF_IO_QUEUE_CONFIG queueConfig;
+
+    PAGED_CODE();
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+    return WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &Commands->FetchQueue);
+}
+
+/*++
+Routine Description:
+    Completes pended fetches while the controller has credits and
+    commands are waiting. Each fetch carries every command the credits
+    allow that fits in its buffer.
+
+Arguments:
+    Commands - Device's command pipeline
+
+Return Value:
+    None
+--*/
+static VOID
+HciCommandDrain(
+    _Inout_ PHCI_COMMAND_CONTEXT Commands
+)
+{
+    PDEVICE_CONTEXT deviceContext = CONTAINING_RECORD(Commands, DEVICE_CONTEXT, HciCommands);
+
+    for (;;) {
+        WDFREQUEST request;
+        PHCI_COMMAND_FETCH fetch;
+        const CMDQ_ENTRY* entry;
+        NTSTATUS status;
+        size_t size;
+        ULONG capacity, packetBytes;
+        ULONG64 now;
+        KIRQL irql;
+
+        KeAcquireSpinLock(&Commands->Lock, &irql);
+
+        // Timed-out commands are retired by the next call with work waiting
+        if (Commands->Queue.Stats.Queued == 0 || Commands->FetchQueue == NULL ||
+            !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Commands->FetchQueue, &request))) {
+            KeReleaseSpinLock(&Commands->Lock, irql);
+            return;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(request, HCI_COMMAND_FETCH_MIN, (PVOID*)&fetch, &size);
+        if (!NT_SUCCESS(status)) {
+            KeReleaseSpinLock(&Commands->Lock, irql);
+            WdfRequestComplete(request, status);
+            continue;
+        }
+
+        capacity = (ULONG)(size - FIELD_OFFSET(HCI_COMMAND_FETCH, Packets));
+        fetch->Count = 0;
+        fetch->Bytes = 0;
+        now = HciCommandNowUs();
+
+        // The largest command always fits the first time round
+        while (capacity - fetch->Bytes >= CMDQ_HEADER_BYTES + CMDQ_MAX_PARAMETERS &&
+               (entry = CmdQueueNext(&Commands->Queue, now)) != NULL) {
+            packetBytes = CMDQ_HEADER_BYTES + entry->Packet[2];
+            RtlCopyMemory(&fetch->Packets[fetch->Bytes], entry->Packet, packetBytes);
+            fetch->Bytes += packetBytes;
+            fetch->Count++;
+        }
+
+        // No credits, or everything waiting is held back behind a
+        // command with its key
+        if (fetch->Count == 0) {
+            WdfRequestRequeue(request);
+            KeReleaseSpinLock(&Commands->Lock, irql);
+            return;
+        }
+
+        KeReleaseSpinLock(&Commands->Lock, irql);
+
+        if (CaptureEnabled(&deviceContext->Capture)) {
+            CaptureHciPackets(&deviceContext->Capture, SNOOP_TYPE_COMMAND, SNOOP_SENT,
+                fetch->Packets, fetch->Bytes);
+        }
+
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS,
+            FIELD_OFFSET(HCI_COMMAND_FETCH, Packets) + fetch->Bytes);
+    }
+}
+
+/*++
+Routine Description:
+    Applies a batch of Command Complete and Command Status events, then
+    hands any commands the returned credits allow to a pended fetch
+
+Arguments:
+    Commands - Device's command pipeline
+    Events - Command events, in the order received
+    Count - Number of events
+--*/
+VOID
+HciCommandAcknowledge(
+    _Inout_ PHCI_COMMAND_CONTEXT Commands,
+    _In_reads_(Count) const HCI_COMMAND_EVENT* Events,
+    _In_ ULONG Count
+)
+{
+    ULONG64 now = HciCommandNowUs();
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&Commands->Lock, &irql);
+    for (i = 0; i < Count; i++) {
+        CmdQueueAcknowledge(&Commands->Queue, Events[i].Opcode,
+            Events[i].NumCommandPackets, Events[i].Status, now, NULL);
+    }
+    KeReleaseSpinLock(&Commands->Lock, irql);
+
+    HciCommandDrain(Commands);
+}
+
+/*++
+Routine Description:
+    Queues a command from the driver or user mode and hands it to a
+    pended fetch if the credits allow
+
+Arguments:
+    Commands - Device's command pipeline
+    Opcode - HCI opcode
+    Priority - CONNECTION_PRIORITY
+    Parameters - Command parameters
+    Length - Parameter bytes
+    Id - Receives the command's id
+    Merged - Optionally receives whether it was folded into a queued one
+
+Return Value:
+    NTSTATUS from CmdQueueSubmit
+--*/
+NTSTATUS
+HciCommandSubmit(
+    _Inout_ PHCI_COMMAND_CONTEXT Commands,
+    _In_ USHORT Opcode,
+    _In_ UCHAR Priority,
+    _In_reads_bytes_opt_(Length) const UCHAR* Parameters,
+    _In_ ULONG Length,
+    _Out_ PULONG Id,
+    _Out_opt_ PBOOLEAN Merged
+)
+{
+    NTSTATUS status;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Commands->Lock, &irql);
+    status = CmdQueueSubmit(&Commands->Queue, Opcode, Priority,
+        Parameters, Length, HciCommandNowUs(), Id, Merged);
+    KeReleaseSpinLock(&Commands->Lock, irql);
+
+    if (NT_SUCCESS(status)) {
+        HciCommandDrain(Commands);
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HCI_QUEUE_COMMAND. The input and output share
+    the system buffer; the ticket is written once the command is queued.
+--*/
+NTSTATUS
+HandleHciQueueCommand(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PHCI_COMMAND_CONTEXT commands = &DeviceContext->HciCommands;
+    PHCI_COMMAND_REQUEST request;
+    PHCI_COMMAND_TICKET ticket;
+    NTSTATUS status;
+    BOOLEAN merged;
+    ULONG id;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        FIELD_OFFSET(HCI_COMMAND_REQUEST, Parameters), (PVOID*)&request, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (InputBufferLength < FIELD_OFFSET(HCI_COMMAND_REQUEST, Parameters) + request->Length) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(HCI_COMMAND_TICKET), (PVOID*)&ticket, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = HciCommandSubmit(commands, request->Opcode, request->Priority,
+        request->Parameters, request->Length, &id, &merged);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    ticket->Id = id;
+    ticket->Merged = merged;
+    RtlZeroMemory(ticket->Reserved, sizeof(ticket->Reserved));
+
+    *BytesReturned = sizeof(HCI_COMMAND_TICKET);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HCI_FETCH_COMMANDS: pends the request until
+    commands can be sent. The output buffer must hold the largest
+    command.
+--*/
+NTSTATUS
+HandleHciFetchCommands(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PHCI_COMMAND_CONTEXT commands = &DeviceContext->HciCommands;
+    NTSTATUS status;
+
+    *BytesReturned = 0;
+
+    if (OutputBufferLength < HCI_COMMAND_FETCH_MIN) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (commands->FetchQueue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    status = WdfRequestForwardToIoQueue(Request, commands->FetchQueue);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // The request belongs to the fetch queue now; it may complete here
+    HciCommandDrain(commands);
+    return STATUS_PENDING;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_HCI_COMMAND_STATS
+--*/
+NTSTATUS
+HandleGetHciCommandStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PHCI_COMMAND_CONTEXT commands = &DeviceContext->HciCommands;
+    PCMDQ_STATS stats;
+    NTSTATUS status;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(CMDQ_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&commands->Lock, &irql);
+    *stats = commands->Queue.Stats;
+    KeReleaseSpinLock(&commands->Lock, irql);
+
+    *BytesReturned = sizeof(CMDQ_STATS);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,82 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHciCommand.h
+
+Abstract:
+    HCI command pipeline. Configuration commands are queued by priority
+    and merged (MultiDeviceBTCmdQueue.h). The HCI transport agent keeps
+    a fetch request pended, and the driver completes it with as many
+    commands as the controller has credits for. Command Complete and
+    Command Status events submitted through the event intake
+    (MultiDeviceBTHciEvent.h) return the credits.
+
+--*/
+
+#ifndef _MULTIDEVICEBTHCICOMMAND_H_
+#define _MULTIDEVICEBTHCICOMMAND_H_
+
+#include "MultiDeviceBTCmdQueue.h"
+
+#define HCI_COMMAND_QUEUE_DEPTH     256     // A full reconfiguration of 50 devices, several commands each
+
+// IOCTL_MULTI_BT_HCI_QUEUE_COMMAND input; Length parameter bytes follow the header
+typedef struct _HCI_COMMAND_REQUEST {
+    USHORT Opcode;
+    UCHAR Priority;             // CONNECTION_PRIORITY
+    UCHAR Length;
+    UCHAR Parameters[CMDQ_MAX_PARAMETERS];
+} HCI_COMMAND_REQUEST, *PHCI_COMMAND_REQUEST;
+
+// IOCTL_MULTI_BT_HCI_QUEUE_COMMAND output
+typedef struct _HCI_COMMAND_TICKET {
+    ULONG Id;
+    BOOLEAN Merged;             // Folded into the queued command Id
+    UCHAR Reserved[3];
+} HCI_COMMAND_TICKET, *PHCI_COMMAND_TICKET;
+
+// IOCTL_MULTI_BT_HCI_FETCH_COMMANDS output: Count command packets
+// (opcode, parameter length, parameters) back to back, Bytes in all
+typedef struct _HCI_COMMAND_FETCH {
+    ULONG Count;
+    ULONG Bytes;
+    UCHAR Packets[1];
+} HCI_COMMAND_FETCH, *PHCI_COMMAND_FETCH;
+
+// Smallest fetch buffer: room for the largest command
+#define HCI_COMMAND_FETCH_MIN \
+    (FIELD_OFFSET(HCI_COMMAND_FETCH, Packets) + CMDQ_HEADER_BYTES + CMDQ_MAX_PARAMETERS)
+
+typedef struct _HCI_COMMAND_CONTEXT {
+    KSPIN_LOCK Lock;            // Queue and entries
+    WDFQUEUE FetchQueue;        // Pended IOCTL_MULTI_BT_HCI_FETCH_COMMANDS
+    CMDQ Queue;
+    CMDQ_ENTRY Entries[HCI_COMMAND_QUEUE_DEPTH];
+} HCI_COMMAND_CONTEXT, *PHCI_COMMAND_CONTEXT;
+
+VOID HciCommandInitialize(
+    _Out_ PHCI_COMMAND_CONTEXT Commands
+);
+
+NTSTATUS HciCommandCreateFetchQueue(
+    _Inout_ PHCI_COMMAND_CONTEXT Commands,
+    _In_ WDFDEVICE Device
+);
+
+NTSTATUS HciCommandSubmit(
+    _Inout_ PHCI_COMMAND_CONTEXT Commands,
+    _In_ USHORT Opcode,
+    _In_ UCHAR Priority,
+    _In_reads_bytes_opt_(Length) const UCHAR* Parameters,
+    _In_ ULONG Length,
+    _Out_ PULONG Id,
+    _Out_opt_ PBOOLEAN Merged
+);
+
+VOID HciCommandAcknowledge(
+    _Inout_ PHCI_COMMAND_CONTEXT Commands,
+    _In_reads_(Count) const HCI_COMMAND_EVENT* Events,
+    _In_ ULONG Count
+);
+
+#endif // _MULTIDEVICEBTHCICOMMAND_H_
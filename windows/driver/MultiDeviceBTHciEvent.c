@@ -0,0 +1,438 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHciEvent.c
+
+Abstract:
+    Controller event intake.
+
+    In a dense scan nearly every controller event is an advertising
+    report. Handled one at a time, each would be copied into its own
+    structure, resolve its address alone and take the telemetry path
+    alone.
+
+    A submitted buffer is now parsed in the request's system buffer
+    without copying (MultiDeviceBTHci.c), and every batch of same-kind
+    events is dispatched with one call:
+    - Advertising reports: all random resolvable addresses in the batch
+      go through PrivacyResolve together, then each report reaches
+      IoTIngestAdvertisingReport under its identity address, with its
+      data read straight from the buffer. With more than one adapter,
+      the batch's RSSI goes to adapter placement in one call.
+    - Number Of Completed Packets: the counts are summed, and each
+      link's ACL buffers return to the credit allocator
+      (MultiDeviceBTAcl.c) on the processor its device is bound to
+      (MultiDeviceBTAffinity.c).
+    - Connection, disconnection and connection update events are
+      counted, and failed connections are logged. Connections and
+      disconnections open and close the allocator's links and bind
+      and unbind each device's processor.
+    - Command complete and command status acknowledge commands in the
+      command pipeline (MultiDeviceBTHciCommand.c) and return their
+      credits. Buffer size replies size the ACL pool, and Read RSSI
+      replies give adapter placement the RSSI of the link's peer.
+    Other events are counted and dropped.
+
+    Submissions are serialized by a fast mutex, which also owns the
+    batch and resolver scratch, so none of it lives on the stack.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+// Advertising report address types
+#define HCI_ADDRESS_RANDOM          0x01
+
+static __forceinline ULONG64
+HciEventNowUs(VOID)
+{
+    return KeQueryInterruptTime() / 10;
+}
+
+/*++
+Routine Description:
+    Initializes the event intake context
+--*/
+VOID
+HciEventInitialize(
+    _Out_ PHCI_EVENT_CONTEXT Events
+)
+{
+    RtlZeroMemory(Events, sizeof(*Events));
+    ExInitializeFastMutex(&Events->Mutex);
+}
+
+/*++
+Routine Description:
+    Tells whether adapter placement wants RSSI: only when it has more
+    than one adapter to choose between
+--*/
+static __forceinline BOOLEAN
+HciEventPlacementWantsRssi(
+    _In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+    // Unlocked read; a stale count costs one batch of observations
+    return DeviceContext->Load.Registered &&
+        DriverGetContext(WdfGetDriver())->AdapterRegistry.AdapterCount > 1;
+}
+
+/*++
+Routine Description:
+    Dispatches a batch of advertising reports. Resolvable private
+    addresses are resolved together, then each report is offered to
+    advertisement telemetry under the address it resolved to, and its
+    RSSI to adapter placement.
+
+Arguments:
+    DeviceContext - Device context
+    Events - Intake context, mutex held
+    Batch - Advertising batch
+--*/
+static VOID
+HciEventDispatchAdvertising(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Inout_ PHCI_EVENT_CONTEXT Events,
+    _In_ PHCI_EVENT_BATCH Batch
+)
+{
+    const HCI_ADV_REPORT* report;
+    BTH_ADDR address;
+    ULONG resolvable = 0;
+    ULONG observed = 0;
+    ULONG next = 0;
+    BOOLEAN telemetry;
+    BOOLEAN placement;
+    ULONG i;
+
+    // Unlocked read, as IoTIngestAdvertisingReport does
+    telemetry = DeviceContext->Telemetry.AdvConfig.Enable;
+    placement = HciEventPlacementWantsRssi(DeviceContext);
+    if (!telemetry && !placement) {
+        return;
+    }
+
+    for (i = 0; i < Batch->Count; i++) {
+        report = &Batch->u.Advertising[i];
+        if (report->AddressType == HCI_ADDRESS_RANDOM && RPA_IS_RESOLVABLE(report->Address)) {
+            Events->Addresses[resolvable++] = report->Address;
+        }
+    }
+
+    if (resolvable != 0) {
+        Events->Stats.AddressesResolved += PrivacyResolve(&DeviceContext->Privacy,
+            Events->Addresses, resolvable, Events->Resolved);
+    }
+
+    for (i = 0; i < Batch->Count; i++) {
+        report = &Batch->u.Advertising[i];
+        address = report->Address;
+
+        // Results are in the same order as the reports they came from
+        if (report->AddressType == HCI_ADDRESS_RANDOM && RPA_IS_RESOLVABLE(address)) {
+            address = Events->Resolved[next++].Address;
+        }
+
+        if (placement && report->Rssi != HCI_RSSI_UNAVAILABLE) {
+            Events->RssiAddresses[observed] = address;
+            Events->Rssi[observed] = report->Rssi;
+            observed++;
+        }
+
+        if (telemetry && NT_SUCCESS(IoTIngestAdvertisingReport(&DeviceContext->Telemetry, address,
+                report->Rssi, (PUCHAR)report->Data, report->DataLength))) {
+            Events->Stats.TelemetryReadings++;
+        }
+    }
+
+    if (observed != 0) {
+        AdapterRecordRssi(&DriverGetContext(WdfGetDriver())->AdapterRegistry, DeviceContext,
+            Events->RssiAddresses, Events->Rssi, observed);
+        Events->Stats.RssiRecorded += observed;
+    }
+}
+
+/*++
+Routine Description:
+    Gives adapter placement the RSSI from Read RSSI replies, under the
+    address of the peer each link was opened for
+
+Arguments:
+    DeviceContext - Device context
+    Events - Intake context, mutex held
+    Batch - Command event batch
+--*/
+static VOID
+HciEventDispatchLinkRssi(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Inout_ PHCI_EVENT_CONTEXT Events,
+    _In_ PHCI_EVENT_BATCH Batch
+)
+{
+    const HCI_COMMAND_EVENT* event;
+    BTH_ADDR address;
+    ULONG observed = 0;
+    USHORT handle;
+    KIRQL irql;
+    ULONG i;
+
+    for (i = 0; i < Batch->Count; i++) {
+        event = &Batch->u.Commands[i];
+
+        // Status, Handle (2), RSSI
+        if (!event->Complete || event->Opcode != HCI_OP_READ_RSSI ||
+            event->Status != 0 || event->ReturnLength < 4) {
+            continue;
+        }
+
+        handle = (USHORT)((event->ReturnParameters[1] | (event->ReturnParameters[2] << 8)) & 0x0FFF);
+
+        KeAcquireSpinLock(&DeviceContext->Acl.Lock, &irql);
+        address = AclCreditPeerAddress(&DeviceContext->Acl.Pool, handle);
+        KeReleaseSpinLock(&DeviceContext->Acl.Lock, irql);
+
+        if (address != BTH_ADDR_NULL) {
+            Events->RssiAddresses[observed] = address;
+            Events->Rssi[observed] = (CHAR)event->ReturnParameters[3];
+            observed++;
+        }
+    }
+
+    if (observed != 0) {
+        AdapterRecordRssi(&DriverGetContext(WdfGetDriver())->AdapterRegistry, DeviceContext,
+            Events->RssiAddresses, Events->Rssi, observed);
+        Events->Stats.RssiRecorded += observed;
+    }
+}
+
+static AFFINITY_WORK_ROUTINE HciEventLinkPacketsCompleted;
+
+/*++
+Routine Description:
+    Affinity work routine: returns one link's completed buffers. Context
+    packs the handle in the low 16 bits and the packet count above.
+--*/
+static VOID
+HciEventLinkPacketsCompleted(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ ULONG Slot,
+    _In_opt_ PVOID Context
+)
+{
+    HCI_COMPLETED_PACKETS completed;
+
+    UNREFERENCED_PARAMETER(Slot);
+
+    completed.Handle = (USHORT)((ULONG_PTR)Context & 0xFFFF);
+    completed.Packets = (USHORT)((ULONG_PTR)Context >> 16);
+
+    AclPacketsCompleted(&DeviceContext->Acl, &completed, 1);
+}
+
+/*++
+Routine Description:
+    Dispatches one batch by kind
+
+Arguments:
+    DeviceContext - Device context
+    Events - Intake context, mutex held
+    Batch - Batch from HciReadBatch
+--*/
+static VOID
+HciEventDispatch(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Inout_ PHCI_EVENT_CONTEXT Events,
+    _In_ PHCI_EVENT_BATCH Batch
+)
+{
+    PHCI_EVENT_STATS stats = &Events->Stats;
+    const HCI_CONNECTION_COMPLETE* connection;
+    const HCI_COMPLETED_PACKETS* completed;
+    ULONG i;
+
+    switch (Batch->Kind) {
+    case HciBatchAdvertising:
+        HciEventDispatchAdvertising(DeviceContext, Events, Batch);
+        break;
+
+    case HciBatchCompletedPackets:
+        for (i = 0; i < Batch->Count; i++) {
+            completed = &Batch->u.Completed[i];
+            stats->PacketsCompleted += completed->Packets;
+            AffinityQueueWork(&DeviceContext->Affinity,
+                AffinityFindDevice(&DeviceContext->Affinity, completed->Handle),
+                HciEventLinkPacketsCompleted,
+                (PVOID)(ULONG_PTR)(completed->Handle | ((ULONG)completed->Packets << 16)));
+        }
+        break;
+
+    case HciBatchConnections:
+        for (i = 0; i < Batch->Count; i++) {
+            connection = &Batch->u.Connections[i];
+            if (connection->Status == 0) {
+                stats->ConnectionsOpened++;
+            } else {
+                KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+                    "MultiDeviceBT: Connection to %llx failed (HCI status 0x%02x)\n",
+                    connection->PeerAddress, connection->Status));
+            }
+        }
+        AclConnectionsOpened(DeviceContext, Batch->u.Connections, Batch->Count);
+        for (i = 0; i < Batch->Count; i++) {
+            connection = &Batch->u.Connections[i];
+            if (connection->Status == 0 && connection->LinkType != HCI_LINK_SCO) {
+                AffinityAssignDevice(&DeviceContext->Affinity, connection->Handle,
+                    connection->PeerAddress);
+            }
+        }
+        break;
+
+    case HciBatchDisconnections:
+        for (i = 0; i < Batch->Count; i++) {
+            if (Batch->u.Disconnections[i].Status == 0) {
+                stats->ConnectionsClosed++;
+                AffinityReleaseDevice(&DeviceContext->Affinity, Batch->u.Disconnections[i].Handle);
+            }
+        }
+        AclConnectionsClosed(&DeviceContext->Acl, Batch->u.Disconnections, Batch->Count);
+        break;
+
+    case HciBatchCommands:
+        stats->CommandCredits = Batch->u.Commands[Batch->Count - 1].NumCommandPackets;
+        AclCommandsCompleted(&DeviceContext->Acl, Batch->u.Commands, Batch->Count);
+        HciEventDispatchLinkRssi(DeviceContext, Events, Batch);
+        HciCommandAcknowledge(&DeviceContext->HciCommands, Batch->u.Commands, Batch->Count);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HCI_SUBMIT_EVENTS. The input is parsed where
+    it lies in the system buffer; the result is written over its start
+    only after the last batch has been dispatched.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Request whose input is raw HCI events
+    InputBufferLength - Bytes of events
+    OutputBufferLength - Output buffer size
+    BytesReturned - Receives sizeof(HCI_SUBMIT_RESULT)
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleHciSubmitEvents(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PHCI_EVENT_CONTEXT events = &DeviceContext->HciEvents;
+    PHCI_SUBMIT_RESULT result;
+    HCI_EVENT_READER reader;
+    NTSTATUS status;
+    PUCHAR buffer;
+    ULONG batches = 0;
+    ULONG elapsed;
+    ULONG64 start;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    if (InputBufferLength > HCI_EVENT_MAX_SUBMIT) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        HCI_EVENT_HEADER_BYTES, (PVOID*)&buffer, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(HCI_SUBMIT_RESULT), (PVOID*)&result, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    ExAcquireFastMutex(&events->Mutex);
+
+    start = HciEventNowUs();
+    HciReaderInitialize(&reader, buffer, (ULONG)InputBufferLength, &events->Stats.Parse);
+
+    while (HciReadBatch(&reader, &events->Batch) == STATUS_SUCCESS) {
+        HciEventDispatch(DeviceContext, events, &events->Batch);
+        batches++;
+    }
+
+    elapsed = (ULONG)(HciEventNowUs() - start);
+    events->Stats.Submissions++;
+    events->Stats.LastSubmitUs = elapsed;
+    if (elapsed > events->Stats.MaxSubmitUs) {
+        events->Stats.MaxSubmitUs = elapsed;
+    }
+
+    ExReleaseFastMutex(&events->Mutex);
+
+    // Before the result, which shares the system buffer with the events
+    if (CaptureEnabled(&DeviceContext->Capture)) {
+        CaptureHciPackets(&DeviceContext->Capture, SNOOP_TYPE_EVENT, SNOOP_RECEIVED,
+            buffer, reader.Offset);
+    }
+
+    result->Consumed = reader.Offset;
+    result->Batches = batches;
+
+    *BytesReturned = sizeof(HCI_SUBMIT_RESULT);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_HCI_EVENT_STATS
+--*/
+NTSTATUS
+HandleGetHciEventStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PHCI_EVENT_CONTEXT events = &DeviceContext->HciEvents;
+    PHCI_EVENT_STATS stats;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(HCI_EVENT_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    ExAcquireFastMutex(&events->Mutex);
+    *stats = events->Stats;
+    ExReleaseFastMutex(&events->Mutex);
+
+    *BytesReturned = sizeof(HCI_EVENT_STATS);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,59 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHciEvent.h
+
+Abstract:
+    Controller event intake. The HCI transport agent submits raw event
+    buffers, which are parsed in place (MultiDeviceBTHci.h) and
+    dispatched a batch at a time: advertising reports resolve their
+    private addresses in one call and feed advertisement telemetry,
+    completed-packet and command events update the counters the driver
+    schedules against.
+
+--*/
+
+#ifndef _MULTIDEVICEBTHCIEVENT_H_
+#define _MULTIDEVICEBTHCIEVENT_H_
+
+#include "MultiDeviceBTHci.h"
+
+#define HCI_EVENT_MAX_SUBMIT        65536   // Bytes per IOCTL_MULTI_BT_HCI_SUBMIT_EVENTS
+
+// IOCTL_MULTI_BT_HCI_SUBMIT_EVENTS output. Bytes past Consumed belong to
+// an event that was cut off and should lead the next submission.
+typedef struct _HCI_SUBMIT_RESULT {
+    ULONG Consumed;
+    ULONG Batches;
+} HCI_SUBMIT_RESULT, *PHCI_SUBMIT_RESULT;
+
+typedef struct _HCI_EVENT_STATS {
+    HCI_PARSE_STATS Parse;
+    ULONG64 Submissions;
+    ULONG64 AddressesResolved;  // Advertising RPAs mapped to a bonded identity
+    ULONG64 TelemetryReadings;  // Advertising reports ingested as IoT telemetry
+    ULONG64 RssiRecorded;       // Advertising and link RSSI given to adapter placement
+    ULONG64 PacketsCompleted;   // Sum over Number Of Completed Packets events
+    ULONG64 ConnectionsOpened;
+    ULONG64 ConnectionsClosed;
+    ULONG CommandCredits;       // Num_HCI_Command_Packets from the latest command event
+    ULONG LastSubmitUs;
+    ULONG MaxSubmitUs;
+    ULONG Reserved;
+} HCI_EVENT_STATS, *PHCI_EVENT_STATS;
+
+typedef struct _HCI_EVENT_CONTEXT {
+    FAST_MUTEX Mutex;           // One submission at a time; guards everything below
+    HCI_EVENT_BATCH Batch;
+    BTH_ADDR Addresses[HCI_BATCH_MAX];
+    RPA_RESULT Resolved[HCI_BATCH_MAX];
+    BTH_ADDR RssiAddresses[HCI_BATCH_MAX];
+    CHAR Rssi[HCI_BATCH_MAX];
+    HCI_EVENT_STATS Stats;
+} HCI_EVENT_CONTEXT, *PHCI_EVENT_CONTEXT;
+
+VOID HciEventInitialize(
+    _Out_ PHCI_EVENT_CONTEXT Events
+);
+
+#endif // _MULTIDEVICEBTHCIEVENT_H_
@@ -0,0 +1,467 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHid.c
+
+Abstract:
+    Compiles HID report descriptors into flat extraction programs.
+
+    A generic HID interpreter walks the report descriptor's item stream
+    for every report. It tracks global and local state, finds the items
+    for the report ID, and pulls each field out bit by bit. At 1000 Hz
+    from several keyboards, mice and game controllers, most of the input
+    path's CPU time goes to rediscovering the same layout.
+
+    Here the descriptor is walked once, when the device's descriptor is
+    installed. Each input report becomes a table of (byte offset, shift,
+    mask, sign shift, bias) entries, and a 256-entry index maps report
+    IDs to tables. Decoding copies the report into a padded buffer, then
+    runs a branch-free loop of one unaligned 64-bit load, shift, mask,
+    sign extension and add per field.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTHid.h"
+
+// Item types and tags (HID 1.11, section 6.2.2)
+#define HID_ITEM_MAIN               0
+#define HID_ITEM_GLOBAL             1
+#define HID_ITEM_LOCAL              2
+#define HID_ITEM_LONG_PREFIX        0xFE
+
+#define HID_MAIN_INPUT              0x8
+#define HID_MAIN_OUTPUT             0x9
+#define HID_MAIN_COLLECTION         0xA
+#define HID_MAIN_FEATURE            0xB
+#define HID_MAIN_END_COLLECTION     0xC
+
+#define HID_GLOBAL_USAGE_PAGE       0x0
+#define HID_GLOBAL_LOGICAL_MIN      0x1
+#define HID_GLOBAL_LOGICAL_MAX      0x2
+#define HID_GLOBAL_REPORT_SIZE      0x7
+#define HID_GLOBAL_REPORT_ID        0x8
+#define HID_GLOBAL_REPORT_COUNT     0x9
+#define HID_GLOBAL_PUSH             0xA
+#define HID_GLOBAL_POP              0xB
+
+#define HID_LOCAL_USAGE             0x0
+#define HID_LOCAL_USAGE_MIN         0x1
+#define HID_LOCAL_USAGE_MAX         0x2
+
+// Input item data bits
+#define HID_INPUT_CONSTANT          0x01
+#define HID_INPUT_VARIABLE          0x02
+#define HID_INPUT_RELATIVE          0x04
+
+typedef struct _HID_GLOBALS {
+    USHORT UsagePage;
+    ULONG LogicalMinRaw;
+    ULONG LogicalMaxRaw;
+    UCHAR LogicalMinSize;
+    UCHAR LogicalMaxSize;
+    UCHAR ReportId;
+    ULONG ReportSize;
+    ULONG ReportCount;
+} HID_GLOBALS, *PHID_GLOBALS;
+
+typedef struct _HID_LOCALS {
+    ULONG Usages[HID_MAX_USAGES];   // Extended usages keep their page in the high word
+    ULONG UsageCount;
+    ULONG UsageMin;
+    ULONG UsageMax;
+    BOOLEAN HasMin;
+    BOOLEAN HasMax;
+} HID_LOCALS, *PHID_LOCALS;
+
+static LONG
+HidSignedData(
+    _In_ ULONG Data,
+    _In_ ULONG Size
+)
+{
+    switch (Size) {
+    case 1:
+        return (LONG)(CHAR)Data;
+    case 2:
+        return (LONG)(SHORT)Data;
+    case 4:
+        return (LONG)Data;
+    default:
+        return 0;
+    }
+}
+
+/*++
+Routine Description:
+    Finds or creates the program for a report ID. Returns NULL when
+    HID_MAX_REPORTS programs exist already.
+--*/
+static PHID_REPORT_PROGRAM
+HidProgramFor(
+    _Inout_ PHID_COMPILED Compiled,
+    _Inout_updates_(HID_MAX_REPORTS) PULONG Bits,
+    _In_ UCHAR ReportId
+)
+{
+    PHID_REPORT_PROGRAM program;
+    ULONG index = Compiled->Index[ReportId];
+
+    if (index != HID_NO_REPORT) {
+        return &Compiled->Reports[index];
+    }
+
+    if (Compiled->ReportCount == HID_MAX_REPORTS) {
+        return NULL;
+    }
+
+    index = Compiled->ReportCount++;
+    Compiled->Index[ReportId] = (UCHAR)index;
+
+    program = &Compiled->Reports[index];
+    program->ReportId = ReportId;
+    Bits[index] = Compiled->UsesReportIds ? 8 : 0;
+
+    return program;
+}
+
+/*++
+Routine Description:
+    Compiles one Input main item into its report's program
+
+Arguments:
+    Compiled - Compilation in progress
+    Bits - Bit cursor per program
+    Globals - Global state at the item
+    Locals - Local state at the item
+    Flags - Input item data
+
+Return Value:
+    STATUS_SUCCESS or STATUS_INVALID_PARAMETER
+--*/
+static NTSTATUS
+HidCompileInput(
+    _Inout_ PHID_COMPILED Compiled,
+    _Inout_updates_(HID_MAX_REPORTS) PULONG Bits,
+    _In_ PHID_GLOBALS Globals,
+    _In_ PHID_LOCALS Locals,
+    _In_ ULONG Flags
+)
+{
+    PHID_REPORT_PROGRAM program;
+    PULONG bits;
+    ULONG size = Globals->ReportSize;
+    ULONG count = Globals->ReportCount;
+    LONG logicalMin = HidSignedData(Globals->LogicalMinRaw, Globals->LogicalMinSize);
+    LONG logicalMax;
+    ULONG i;
+
+    // A non-negative minimum makes the maximum unsigned, as
+    // descriptors in the field write 0..255 as 15 00 26 FF 00 or 25 FF
+    logicalMax = (logicalMin < 0) ?
+        HidSignedData(Globals->LogicalMaxRaw, Globals->LogicalMaxSize) :
+        (LONG)Globals->LogicalMaxRaw;
+
+    if (size == 0 || count == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    program = HidProgramFor(Compiled, Bits, Globals->ReportId);
+    if (program == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    bits = &Bits[program - Compiled->Reports];
+
+    if (*bits + size * count > HID_MAX_REPORT_BYTES * 8) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Padding, and fields too wide for a LONG, take space but no values
+    if ((Flags & HID_INPUT_CONSTANT) != 0 || size > 32) {
+        *bits += size * count;
+        goto Exit;
+    }
+
+    for (i = 0; i < count; i++) {
+        PHID_EXTRACT extract;
+        PHID_FIELD_INFO field;
+        ULONG usage;
+        UCHAR flags = 0;
+
+        if (program->Count == HID_MAX_FIELDS) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if ((Flags & HID_INPUT_VARIABLE) != 0) {
+            if (Locals->UsageCount > 0) {
+                usage = Locals->Usages[min(i, Locals->UsageCount - 1)];
+            } else if (Locals->HasMin) {
+                usage = Locals->UsageMin + i;
+                if (Locals->HasMax && usage > Locals->UsageMax) {
+                    usage = Locals->UsageMax;
+                }
+            } else {
+                usage = 0;
+            }
+        } else {
+            flags |= HID_FIELD_ARRAY;
+            usage = Locals->HasMin ? Locals->UsageMin :
+                ((Locals->UsageCount > 0) ? Locals->Usages[0] : 0);
+        }
+
+        if ((Flags & HID_INPUT_RELATIVE) != 0) {
+            flags |= HID_FIELD_RELATIVE;
+        }
+        if (logicalMin < 0) {
+            flags |= HID_FIELD_SIGNED;
+        }
+
+        extract = &program->Extract[program->Count];
+        extract->ByteOffset = (USHORT)(*bits / 8);
+        extract->Shift = (UCHAR)(*bits % 8);
+        extract->Mask = (size == 32) ? 0xFFFFFFFF : ((1UL << size) - 1);
+        extract->SignShift = (UCHAR)(((flags & HID_FIELD_SIGNED) != 0) ? 32 - size : 0);
+        extract->Bias = ((flags & HID_FIELD_ARRAY) != 0) ? (LONG)(usage & 0xFFFF) - logicalMin : 0;
+
+        field = &program->Fields[program->Count];
+        field->UsagePage = (USHORT)((usage >> 16) != 0 ? (usage >> 16) : Globals->UsagePage);
+        field->Usage = (USHORT)usage;
+        field->LogicalMinimum = logicalMin;
+        field->LogicalMaximum = logicalMax;
+        field->ReportSize = (UCHAR)size;
+        field->Flags = flags;
+
+        program->Count++;
+        *bits += size;
+    }
+
+Exit:
+    program->Length = (USHORT)((*bits + 7) / 8);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Parses a report descriptor and compiles every input report
+
+Arguments:
+    Descriptor - Report descriptor
+    Length - Descriptor length in bytes
+    Compiled - Receives the programs
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HidCompileDescriptor(
+    _In_reads_bytes_(Length) const UCHAR* Descriptor,
+    _In_ ULONG Length,
+    _Out_ PHID_COMPILED Compiled
+)
+{
+    NTSTATUS status;
+    HID_GLOBALS globals;
+    HID_GLOBALS stack[HID_GLOBAL_STACK_DEPTH];
+    HID_LOCALS locals;
+    ULONG bits[HID_MAX_REPORTS];
+    ULONG depth = 0;
+    ULONG position = 0;
+
+    RtlZeroMemory(Compiled, sizeof(*Compiled));
+    RtlFillMemory(Compiled->Index, sizeof(Compiled->Index), HID_NO_REPORT);
+    RtlZeroMemory(&globals, sizeof(globals));
+    RtlZeroMemory(&locals, sizeof(locals));
+
+    if (Length > HID_MAX_DESCRIPTOR_BYTES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    while (position < Length) {
+        UCHAR prefix = Descriptor[position++];
+        ULONG size, type, tag, data = 0, i;
+
+        if (prefix == HID_ITEM_LONG_PREFIX) {
+            // Long items carry no report layout; skip size and tag bytes and data
+            if (position + 2 > Length) {
+                return STATUS_INVALID_PARAMETER;
+            }
+            position += 2 + Descriptor[position];
+            continue;
+        }
+
+        size = prefix & 0x3;
+        size = (size == 3) ? 4 : size;
+        type = (prefix >> 2) & 0x3;
+        tag = prefix >> 4;
+
+        if (position + size > Length) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        for (i = 0; i < size; i++) {
+            data |= (ULONG)Descriptor[position + i] << (8 * i);
+        }
+        position += size;
+
+        switch (type) {
+        case HID_ITEM_MAIN:
+            if (tag == HID_MAIN_INPUT) {
+                status = HidCompileInput(Compiled, bits, &globals, &locals, data);
+                if (!NT_SUCCESS(status)) {
+                    return status;
+                }
+            }
+            // Output, Feature, Collection and End Collection only reset locals
+            RtlZeroMemory(&locals, sizeof(locals));
+            break;
+
+        case HID_ITEM_GLOBAL:
+            switch (tag) {
+            case HID_GLOBAL_USAGE_PAGE:
+                globals.UsagePage = (USHORT)data;
+                break;
+            case HID_GLOBAL_LOGICAL_MIN:
+                globals.LogicalMinRaw = data;
+                globals.LogicalMinSize = (UCHAR)size;
+                break;
+            case HID_GLOBAL_LOGICAL_MAX:
+                globals.LogicalMaxRaw = data;
+                globals.LogicalMaxSize = (UCHAR)size;
+                break;
+            case HID_GLOBAL_REPORT_SIZE:
+                globals.ReportSize = data;
+                break;
+            case HID_GLOBAL_REPORT_COUNT:
+                globals.ReportCount = data;
+                break;
+            case HID_GLOBAL_REPORT_ID:
+                // IDs are all-or-nothing: none may follow ID-less reports
+                if (data == 0 || data > 0xFF ||
+                    (!Compiled->UsesReportIds && Compiled->ReportCount > 0)) {
+                    return STATUS_INVALID_PARAMETER;
+                }
+                Compiled->UsesReportIds = TRUE;
+                globals.ReportId = (UCHAR)data;
+                break;
+            case HID_GLOBAL_PUSH:
+                if (depth == HID_GLOBAL_STACK_DEPTH) {
+                    return STATUS_INVALID_PARAMETER;
+                }
+                stack[depth++] = globals;
+                break;
+            case HID_GLOBAL_POP:
+                if (depth == 0) {
+                    return STATUS_INVALID_PARAMETER;
+                }
+                globals = stack[--depth];
+                break;
+            default:
+                break;
+            }
+            break;
+
+        case HID_ITEM_LOCAL:
+            switch (tag) {
+            case HID_LOCAL_USAGE:
+                if (locals.UsageCount < HID_MAX_USAGES) {
+                    locals.Usages[locals.UsageCount++] = data;
+                }
+                break;
+            case HID_LOCAL_USAGE_MIN:
+                locals.UsageMin = data;
+                locals.HasMin = TRUE;
+                break;
+            case HID_LOCAL_USAGE_MAX:
+                locals.UsageMax = data;
+                locals.HasMax = TRUE;
+                break;
+            default:
+                break;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return (Compiled->ReportCount > 0) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+/*++
+Routine Description:
+    Runs a report's extraction program. The report is copied into a
+    zero-padded buffer first, so every field is one unconditional
+    64-bit load whatever its offset.
+
+Arguments:
+    Compiled - Programs from HidCompileDescriptor
+    Report - Input report, starting with the report ID byte if IDs are used
+    Length - Report length in bytes
+    Values - Receives one value per field
+    ReportId - Optionally receives the report ID
+
+Return Value:
+    Number of values, or 0 if the report is unknown or short
+--*/
+ULONG
+HidDecodeReport(
+    _In_ const HID_COMPILED* Compiled,
+    _In_reads_bytes_(Length) const UCHAR* Report,
+    _In_ ULONG Length,
+    _Out_writes_(HID_MAX_FIELDS) PLONG Values,
+    _Out_opt_ PUCHAR ReportId
+)
+{
+    UCHAR buffer[HID_MAX_REPORT_BYTES + sizeof(ULONG64)];
+    const HID_REPORT_PROGRAM* program;
+    UCHAR id = 0;
+    ULONG index, i;
+
+    if (Compiled->UsesReportIds) {
+        if (Length == 0) {
+            return 0;
+        }
+        id = Report[0];
+    }
+
+    index = Compiled->Index[id];
+    if (index == HID_NO_REPORT) {
+        return 0;
+    }
+
+    program = &Compiled->Reports[index];
+    if (Length < program->Length) {
+        return 0;
+    }
+
+    RtlCopyMemory(buffer, Report, program->Length);
+    RtlZeroMemory(buffer + program->Length, sizeof(ULONG64));
+
+    for (i = 0; i < program->Count; i++) {
+        const HID_EXTRACT* extract = &program->Extract[i];
+        ULONG64 word;
+        ULONG raw;
+
+        RtlCopyMemory(&word, buffer + extract->ByteOffset, sizeof(word));
+        raw = (ULONG)(word >> extract->Shift) & extract->Mask;
+        Values[i] = ((LONG)(raw << extract->SignShift) >> extract->SignShift) + extract->Bias;
+    }
+
+    if (ReportId != NULL) {
+        *ReportId = id;
+    }
+
+    return program->Count;
+}
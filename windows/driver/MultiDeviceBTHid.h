@@ -0,0 +1,87 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHid.h
+
+Abstract:
+    HID report descriptor compiler. A device's report descriptor is
+    parsed once into a flat extraction program per input report: byte
+    offset, shift, mask, sign and bias for every field. Each incoming
+    report is then decoded by a straight pass over that table, with no
+    descriptor walk. Portable C; builds in the driver and in user-mode
+    tools.
+
+--*/
+
+#ifndef _MULTIDEVICEBTHID_H_
+#define _MULTIDEVICEBTHID_H_
+
+#define HID_MAX_DESCRIPTOR_BYTES    1024
+#define HID_MAX_REPORT_BYTES        64      // Including the report ID byte
+#define HID_MAX_FIELDS              64      // Values per report
+#define HID_MAX_REPORTS             16      // Input reports per descriptor
+#define HID_MAX_USAGES              16      // Local usages per main item
+#define HID_GLOBAL_STACK_DEPTH      4
+#define HID_NO_REPORT               0xFF
+
+// HID_FIELD_INFO.Flags, from the Input item's data bits
+#define HID_FIELD_ARRAY             0x01    // Value is a usage selector, biased to the usage
+#define HID_FIELD_RELATIVE          0x02
+#define HID_FIELD_SIGNED            0x04
+
+// One compiled extraction: value = sign_extend((load64(report + ByteOffset)
+// >> Shift) & Mask) + Bias
+typedef struct _HID_EXTRACT {
+    USHORT ByteOffset;
+    UCHAR Shift;                // 0-7
+    UCHAR SignShift;            // 32 - size for signed fields, else 0
+    ULONG Mask;
+    LONG Bias;                  // Array fields: UsageMinimum - LogicalMinimum
+} HID_EXTRACT, *PHID_EXTRACT;
+
+typedef struct _HID_FIELD_INFO {
+    USHORT UsagePage;
+    USHORT Usage;               // Array fields: first usage of the range
+    LONG LogicalMinimum;
+    LONG LogicalMaximum;
+    UCHAR ReportSize;
+    UCHAR Flags;
+    USHORT Reserved;
+} HID_FIELD_INFO, *PHID_FIELD_INFO;
+
+typedef struct _HID_REPORT_PROGRAM {
+    UCHAR ReportId;             // 0 when the descriptor declares no report IDs
+    UCHAR Reserved;
+    USHORT Length;              // Bytes, including the report ID byte
+    ULONG Count;
+    HID_EXTRACT Extract[HID_MAX_FIELDS];
+    HID_FIELD_INFO Fields[HID_MAX_FIELDS];
+} HID_REPORT_PROGRAM, *PHID_REPORT_PROGRAM;
+
+typedef struct _HID_COMPILED {
+    BOOLEAN UsesReportIds;
+    ULONG ReportCount;
+    UCHAR Index[256];           // Report ID to Reports[] index, or HID_NO_REPORT
+    HID_REPORT_PROGRAM Reports[HID_MAX_REPORTS];
+} HID_COMPILED, *PHID_COMPILED;
+
+// Compiles the input reports of a report descriptor. Fails with
+// STATUS_INVALID_PARAMETER on malformed items or a report beyond the
+// HID_MAX_* limits.
+NTSTATUS HidCompileDescriptor(
+    _In_reads_bytes_(Length) const UCHAR* Descriptor,
+    _In_ ULONG Length,
+    _Out_ PHID_COMPILED Compiled
+);
+
+// Decodes one input report into Values, in descriptor order. Returns
+// the number of values, or 0 for an unknown report ID or a short report.
+ULONG HidDecodeReport(
+    _In_ const HID_COMPILED* Compiled,
+    _In_reads_bytes_(Length) const UCHAR* Report,
+    _In_ ULONG Length,
+    _Out_writes_(HID_MAX_FIELDS) PLONG Values,
+    _Out_opt_ PUCHAR ReportId
+);
+
+#endif // _MULTIDEVICEBTHID_H_
@@ -0,0 +1,233 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHidCoalesce.c
+
+Abstract:
+    HID input report coalescing.
+
+    With one completion per report, a 1 kHz mouse costs a thousand
+    completions a second, and an 8 kHz one eight thousand. Most of those
+    reports are motion deltas that the consumer folds together anyway.
+    So each device queues its reports, each with its own arrival time,
+    and the batch is readied for a read when one of three things
+    happens:
+    - its oldest report reaches its deadline;
+    - the queue fills;
+    - a button, key, hat or array selector changes state, so clicks and
+      key presses are never held back.
+
+    The cap bounds the latency coalescing adds, so the deadline is not
+    the cap itself. Readying is followed by timer expiry lateness and
+    the completion, and HID_COALESCE_SLACK_US of the cap is set aside
+    for their worst case. A cap no larger than that slack cannot hold
+    anything back, and behaves as coalescing off.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTHidCoalesce.h"
+
+static VOID
+HidCoalesceMarkReady(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue
+)
+{
+    if (!Queue->Ready) {
+        Queue->Ready = TRUE;
+        Coalescer->ReadyQueues++;
+    }
+}
+
+// Time a report may wait before its batch is readied, 100 ns units
+static LONGLONG
+HidCoalesceHold(
+    _In_ const HID_COALESCE_QUEUE* Queue
+)
+{
+    if (Queue->MaxLatencyUs <= HID_COALESCE_SLACK_US) {
+        return 0;
+    }
+
+    return (LONGLONG)(Queue->MaxLatencyUs - HID_COALESCE_SLACK_US) * 10;
+}
+
+VOID
+HidCoalesceConfigure(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue,
+    _In_ ULONG MaxLatencyUs,
+    _In_ ULONG MaxReports
+)
+{
+    Queue->MaxLatencyUs = MaxLatencyUs;
+    Queue->MaxReports = MaxReports;
+
+    if (Queue->Pending != 0 && (HidCoalesceHold(Queue) == 0 || Queue->Pending >= MaxReports)) {
+        HidCoalesceMarkReady(Coalescer, Queue);
+    }
+}
+
+/*++
+Routine Description:
+    Queues one decoded report and decides whether its batch is ready
+
+Arguments:
+    Coalescer - Shared state and counters
+    Queue - Reporting device's queue
+    Event - Decoded report; HID_EVENT_STATE_CHANGE readies the batch
+    Now - Arrival time
+    Deadline - Receives the time the latency timer must fire by when
+        this report opened a batch, else 0
+
+Return Value:
+    STATUS_SUCCESS, or STATUS_DEVICE_BUSY when the queue is full
+--*/
+NTSTATUS
+HidCoalescePush(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue,
+    _In_ const HID_INPUT_EVENT* Event,
+    _In_ LONGLONG Now,
+    _Out_ PLONGLONG Deadline
+)
+{
+    LONGLONG hold = HidCoalesceHold(Queue);
+
+    *Deadline = 0;
+
+    if (Queue->Pending == HID_COALESCE_MAX_REPORTS) {
+        Coalescer->Stats.Overruns++;
+        return STATUS_DEVICE_BUSY;
+    }
+
+    Queue->Events[Queue->Pending] = *Event;
+    Queue->Arrival[Queue->Pending++] = Now;
+    Coalescer->Stats.ReportsQueued++;
+
+    if (Queue->Ready) {
+        return STATUS_SUCCESS;
+    }
+
+    if (hold == 0) {
+        HidCoalesceMarkReady(Coalescer, Queue);
+        Coalescer->Stats.ImmediateFlushes++;
+    } else if ((Event->Flags & HID_EVENT_STATE_CHANGE) != 0) {
+        HidCoalesceMarkReady(Coalescer, Queue);
+        Coalescer->Stats.StateFlushes++;
+    } else if (Queue->Pending >= Queue->MaxReports) {
+        HidCoalesceMarkReady(Coalescer, Queue);
+        Coalescer->Stats.FullFlushes++;
+    } else if (Queue->Pending == 1) {
+        Queue->Deadline = Now + hold;
+        *Deadline = Queue->Deadline;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+LONGLONG
+HidCoalesceExpire(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue,
+    _In_ LONGLONG Now
+)
+{
+    if (Queue->Pending == 0 || Queue->Ready) {
+        return MAXLONGLONG;
+    }
+
+    if (Now < Queue->Deadline) {
+        return Queue->Deadline;
+    }
+
+    HidCoalesceMarkReady(Coalescer, Queue);
+    Coalescer->Stats.LatencyFlushes++;
+    return MAXLONGLONG;
+}
+
+/*++
+Routine Description:
+    Moves queued events into a completion. Reports ride along on a
+    completion that goes out anyway, whether or not their own batch is
+    ready.
+
+Arguments:
+    Coalescer - Shared state and counters
+    Queue - Device's queue
+    Events - Receives the events
+    Capacity - Events that fit
+    Now - Completion time, for the latency histogram
+
+Return Value:
+    Events moved
+--*/
+ULONG
+HidCoalesceTake(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue,
+    _Out_writes_to_(Capacity, return) PHID_INPUT_EVENT Events,
+    _In_ ULONG Capacity,
+    _In_ LONGLONG Now
+)
+{
+    PHID_INPUT_STATS stats = &Coalescer->Stats;
+    ULONG take = min(Queue->Pending, Capacity);
+    ULONG e;
+
+    if (take == 0) {
+        return 0;
+    }
+
+    RtlCopyMemory(Events, Queue->Events, take * sizeof(HID_INPUT_EVENT));
+
+    for (e = 0; e < take; e++) {
+        ULONG latencyUs = (ULONG)((Now - Queue->Arrival[e]) / 10);
+
+        stats->LatencyMaxUs = max(stats->LatencyMaxUs, latencyUs);
+        stats->LatencyBuckets[min(latencyUs / HID_LATENCY_BUCKET_US, HID_LATENCY_BUCKETS - 1)]++;
+    }
+
+    Queue->Pending -= take;
+    stats->ReportsCompleted += take;
+
+    if (Queue->Pending == 0) {
+        if (Queue->Ready) {
+            Queue->Ready = FALSE;
+            Coalescer->ReadyQueues--;
+        }
+    } else {
+        // Reader's buffer was short; the rest goes with the next read
+        HidCoalesceMarkReady(Coalescer, Queue);
+        RtlMoveMemory(Queue->Events, &Queue->Events[take], Queue->Pending * sizeof(HID_INPUT_EVENT));
+        RtlMoveMemory(Queue->Arrival, &Queue->Arrival[take], Queue->Pending * sizeof(LONGLONG));
+    }
+
+    return take;
+}
+
+VOID
+HidCoalesceDiscard(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue
+)
+{
+    if (Queue->Ready) {
+        Queue->Ready = FALSE;
+        Coalescer->ReadyQueues--;
+    }
+    Queue->Pending = 0;
+}
@@ -0,0 +1,121 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHidCoalesce.h
+
+Abstract:
+    HID input report coalescing. Each device queues its decoded reports
+    with their arrival times. The queue is readied for delivery when a
+    button or key changes state, when it fills, or before its oldest
+    report would exceed the device's latency cap. One completion carries
+    every device's queued reports.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the time (100 ns units), the timer, the reads and any
+    locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTHIDCOALESCE_H_
+#define _MULTIDEVICEBTHIDCOALESCE_H_
+
+#include "MultiDeviceBTHid.h"
+
+#define HID_COALESCE_MAX_REPORTS    32      // Queued per device
+#define HID_COALESCE_MAX_LATENCY_US 8000
+#define HID_COALESCE_SLACK_US       300     // Worst-case timer expiry and completion, spent inside the cap
+#define HID_LATENCY_BUCKET_US       125
+#define HID_LATENCY_BUCKETS         16      // Last bucket collects the tail
+
+// HID_INPUT_EVENT.Flags
+#define HID_EVENT_STATE_CHANGE      0x01    // A button, key or selector changed
+
+// One decoded report as delivered to user mode
+typedef struct _HID_INPUT_EVENT {
+    LONGLONG Timestamp;
+    BTH_ADDR DeviceAddress;
+    UCHAR ReportId;
+    UCHAR Flags;
+    USHORT Count;
+    ULONG Reserved;
+    LONG Values[HID_MAX_FIELDS];
+} HID_INPUT_EVENT, *PHID_INPUT_EVENT;
+
+// IOCTL_MULTI_BT_HID_GET_INPUT_STATS output. Latency is receipt to
+// completion of each report, including time spent waiting for a read.
+typedef struct _HID_INPUT_STATS {
+    ULONG ReportsQueued;
+    ULONG ReportsCompleted;
+    ULONG Completions;
+    ULONG Overruns;             // Device queue full; report dropped
+    ULONG ImmediateFlushes;     // Coalescing off, or a cap inside the slack
+    ULONG StateFlushes;
+    ULONG LatencyFlushes;
+    ULONG FullFlushes;
+    ULONG LatencyMaxUs;
+    ULONG LatencyBuckets[HID_LATENCY_BUCKETS];
+} HID_INPUT_STATS, *PHID_INPUT_STATS;
+
+// One device's queue
+typedef struct _HID_COALESCE_QUEUE {
+    ULONG MaxLatencyUs;         // 0: every report is readied at once
+    ULONG MaxReports;
+    BOOLEAN Ready;              // Queued events go out with the next read
+    ULONG Pending;
+    LONGLONG Deadline;          // Time the batch must be readied by
+    LONGLONG Arrival[HID_COALESCE_MAX_REPORTS];
+    HID_INPUT_EVENT Events[HID_COALESCE_MAX_REPORTS];
+} HID_COALESCE_QUEUE, *PHID_COALESCE_QUEUE;
+
+// State shared by every device's queue
+typedef struct _HID_COALESCER {
+    ULONG ReadyQueues;
+    HID_INPUT_STATS Stats;
+} HID_COALESCER, *PHID_COALESCER;
+
+// MaxLatencyUs up to HID_COALESCE_MAX_LATENCY_US, MaxReports 1 to
+// HID_COALESCE_MAX_REPORTS; the caller validates them. Readies anything
+// queued that the new settings no longer hold back.
+VOID HidCoalesceConfigure(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue,
+    _In_ ULONG MaxLatencyUs,
+    _In_ ULONG MaxReports
+);
+
+// Appends Event (HID_EVENT_STATE_CHANGE in Flags readies the batch).
+// Deadline receives the time to arm the latency timer for, or 0.
+// Fails with STATUS_DEVICE_BUSY when the queue is full.
+NTSTATUS HidCoalescePush(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue,
+    _In_ const HID_INPUT_EVENT* Event,
+    _In_ LONGLONG Now,
+    _Out_ PLONGLONG Deadline
+);
+
+// Readies the batch if its deadline has passed. Returns the deadline
+// still to wait for, or MAXLONGLONG.
+LONGLONG HidCoalesceExpire(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue,
+    _In_ LONGLONG Now
+);
+
+// Moves up to Capacity queued events, ready or not, into Events and
+// records their latency. Returns the number moved.
+ULONG HidCoalesceTake(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue,
+    _Out_writes_to_(Capacity, return) PHID_INPUT_EVENT Events,
+    _In_ ULONG Capacity,
+    _In_ LONGLONG Now
+);
+
+// Drops the queue's reports
+VOID HidCoalesceDiscard(
+    _Inout_ PHID_COALESCER Coalescer,
+    _Inout_ PHID_COALESCE_QUEUE Queue
+);
+
+#endif // _MULTIDEVICEBTHIDCOALESCE_H_
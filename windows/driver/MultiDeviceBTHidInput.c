@@ -0,0 +1,946 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHidInput.c
+
+Abstract:
+    HID input fast path.
+
+    A generic HID parser walks the report descriptor for every report.
+    It tracks global and local item state, finds the report ID's main
+    items, and pulls each field out bit by bit. With several keyboards,
+    mice and game controllers each reporting at up to 1 kHz, that walk
+    dominates the cost of input handling. The descriptor never changes
+    while the device is connected. So this module compiles it once, via
+    HidCompileDescriptor, into a per-report table of byte offset, shift,
+    mask, sign and bias. Each report then costs one indexed lookup on
+    its ID and a straight-line pass over that table.
+
+    The service passes the descriptor in after SDP (BR/EDR) or the HID
+    Report Map read (HOGP). No HID interrupt channel terminates in this
+    driver yet, so reports are decoded on request or submitted by the
+    service.
+
+    Submitted reports are delivered to user mode through pended reads.
+    With one completion per report, a 1 kHz mouse costs a thousand
+    completions a second, and an 8 kHz one eight thousand. Most of those
+    reports are motion deltas that the consumer folds together anyway.
+    With coalescing on, each device queues its decoded reports, each
+    with its own arrival timestamp (MultiDeviceBTHidCoalesce.c). The
+    batch is handed to a read when one of three things happens:
+    - the oldest report would otherwise exceed the device's latency cap;
+    - the queue fills;
+    - a button, key, hat or array selector changes state, so clicks and
+      key presses are never held back.
+    A completion takes every device's queued reports along, so devices
+    share completions instead of each paying for its own.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+#define HID_USAGE_PAGE_GENERIC_DESKTOP  0x01
+#define HID_USAGE_PAGE_KEYBOARD         0x07
+#define HID_USAGE_PAGE_BUTTON           0x09
+#define HID_USAGE_HAT_SWITCH            0x39
+
+static EXT_CALLBACK HidInputTimerCallback;
+
+VOID
+HidInputInitialize(
+    _Out_ PHID_INPUT_TABLE Table
+)
+{
+    ULONG i;
+
+    RtlZeroMemory(Table, sizeof(*Table));
+    ExInitializeFastMutex(&Table->Mutex);
+    KeInitializeSpinLock(&Table->Lock);
+
+    for (i = 0; i < HID_INPUT_MAX_DEVICES; i++) {
+        ExInitializeRundownProtection(&Table->Slots[i].Rundown);
+    }
+}
+
+/*++
+Routine Description:
+    Creates the manual queue that holds pended input reads
+
+Arguments:
+    Table - Device's HID input table
+    Device - Parent device
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HidInputCreateReadQueue(
+    _Inout_ PHID_INPUT_TABLE Table,
+    _In_ WDFDEVICE Device
+)
+{
+    WDF_IO_QUEUE_CONFIG queueConfig;
+
+    PAGED_CODE();
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+    return WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &Table->ReadQueue);
+}
+
+/*++
+Routine Description:
+    Runs down and frees one slot's program, dropping any reports it
+    still has queued. Caller holds the mutex.
+--*/
+static VOID
+HidInputSlotTeardown(
+    _Inout_ PHID_INPUT_TABLE Table,
+    _Inout_ PHID_INPUT_SLOT Slot
+)
+{
+    PHID_INPUT_DEVICE device = Slot->Device;
+    KIRQL irql;
+
+    if (device == NULL) {
+        return;
+    }
+
+    ExWaitForRundownProtectionRelease(&Slot->Rundown);
+
+    KeAcquireSpinLock(&Table->Lock, &irql);
+    HidCoalesceDiscard(&Table->Coalescer, &device->Queue);
+    KeReleaseSpinLock(&Table->Lock, irql);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: HID program for %llx released (decoded %d, rejected %d)\n",
+        device->DeviceAddress, device->ReportsDecoded, device->ReportsRejected));
+
+    ExFreePoolWithTag(device, HID_INPUT_POOL_TAG);
+    Slot->Device = NULL;
+
+    ExReInitializeRundownProtection(&Slot->Rundown);
+}
+
+VOID
+HidInputCleanup(
+    _Inout_ PHID_INPUT_TABLE Table
+)
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Table->Mutex);
+
+    for (i = 0; i < HID_INPUT_MAX_DEVICES; i++) {
+        HidInputSlotTeardown(Table, &Table->Slots[i]);
+    }
+
+    // No device is left to arm the timer
+    if (Table->Timer != NULL) {
+        ExDeleteTimer(Table->Timer, TRUE, TRUE, NULL);
+        Table->Timer = NULL;
+    }
+
+    ExReleaseFastMutex(&Table->Mutex);
+}
+
+/*++
+Routine Description:
+    Finds the device's slot and takes its rundown reference
+
+Return Value:
+    The slot, referenced, or NULL if the device has no program
+--*/
+static PHID_INPUT_SLOT
+HidInputReferenceDevice(
+    _In_ PHID_INPUT_TABLE Table,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    ULONG i;
+
+    for (i = 0; i < HID_INPUT_MAX_DEVICES; i++) {
+        PHID_INPUT_SLOT slot = &Table->Slots[i];
+
+        if (!ExAcquireRundownProtection(&slot->Rundown)) {
+            continue;
+        }
+
+        if (slot->Device != NULL && slot->Device->DeviceAddress == DeviceAddress) {
+            return slot;
+        }
+
+        ExReleaseRundownProtection(&slot->Rundown);
+    }
+
+    return NULL;
+}
+
+/*++
+Routine Description:
+    Decodes one input report with the device's compiled program
+
+Arguments:
+    Table - Device's HID input table
+    DeviceAddress - Source device
+    Report - Input report, report ID byte first if the device uses IDs
+    Length - Report length in bytes
+    Decoded - Receives the report ID and values
+
+Return Value:
+    STATUS_SUCCESS, STATUS_NOT_FOUND for a device without a descriptor,
+    or STATUS_INVALID_PARAMETER for an unknown or short report
+--*/
+NTSTATUS
+HidInputDecode(
+    _In_ PHID_INPUT_TABLE Table,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_reads_bytes_(Length) const UCHAR* Report,
+    _In_ ULONG Length,
+    _Out_ PHID_DECODED_REPORT Decoded
+)
+{
+    PHID_INPUT_SLOT slot;
+    PHID_INPUT_DEVICE device;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    RtlZeroMemory(Decoded, FIELD_OFFSET(HID_DECODED_REPORT, Values));
+
+    slot = HidInputReferenceDevice(Table, DeviceAddress);
+    if (slot == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    device = slot->Device;
+    Decoded->Count = HidDecodeReport(&device->Compiled, Report, Length,
+        Decoded->Values, &Decoded->ReportId);
+
+    if (Decoded->Count == 0) {
+        InterlockedIncrement(&device->ReportsRejected);
+        status = STATUS_INVALID_PARAMETER;
+    } else {
+        InterlockedIncrement(&device->ReportsDecoded);
+    }
+
+    ExReleaseRundownProtection(&slot->Rundown);
+    return status;
+}
+
+/*++
+Routine Description:
+    Marks the fields whose change flushes a coalesced batch: buttons,
+    keys, hat switches and array selectors
+--*/
+static VOID
+HidInputBuildStateMasks(
+    _Inout_ PHID_INPUT_DEVICE Device
+)
+{
+    ULONG r, f;
+
+    for (r = 0; r < Device->Compiled.ReportCount; r++) {
+        const HID_REPORT_PROGRAM* program = &Device->Compiled.Reports[r];
+        ULONG64 mask = 0;
+
+        for (f = 0; f < program->Count; f++) {
+            const HID_FIELD_INFO* field = &program->Fields[f];
+
+            if ((field->Flags & HID_FIELD_ARRAY) != 0 ||
+                field->UsagePage == HID_USAGE_PAGE_KEYBOARD ||
+                field->UsagePage == HID_USAGE_PAGE_BUTTON ||
+                (field->UsagePage == HID_USAGE_PAGE_GENERIC_DESKTOP && field->Usage == HID_USAGE_HAT_SWITCH)) {
+                mask |= 1ULL << f;
+            }
+        }
+
+        Device->StateMask[r] = mask;
+    }
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HID_SET_DESCRIPTOR. The descriptor is compiled
+    outside the mutex; the slot then swaps to the new program once
+    in-flight decodes of the old one have drained.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    BytesReturned - Receives 0
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleHidSetDescriptor(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PHID_DESCRIPTOR_HEADER header;
+    PHID_INPUT_TABLE table = &DeviceContext->HidInput;
+    PHID_INPUT_DEVICE device = NULL;
+    PHID_INPUT_SLOT target = NULL;
+    size_t length;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(HID_DESCRIPTOR_HEADER), (PVOID*)&header, &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (header->Length > length - sizeof(HID_DESCRIPTOR_HEADER) ||
+        header->Length > HID_MAX_DESCRIPTOR_BYTES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (header->Length != 0) {
+        device = (PHID_INPUT_DEVICE)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            sizeof(HID_INPUT_DEVICE), HID_INPUT_POOL_TAG);
+        if (device == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        status = HidCompileDescriptor((const UCHAR*)(header + 1), header->Length, &device->Compiled);
+        if (!NT_SUCCESS(status)) {
+            KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+                "MultiDeviceBT: HID descriptor for %llx rejected: 0x%x\n",
+                header->DeviceAddress, status));
+            ExFreePoolWithTag(device, HID_INPUT_POOL_TAG);
+            return status;
+        }
+
+        device->DeviceAddress = header->DeviceAddress;
+        HidInputBuildStateMasks(device);
+    }
+
+    ExAcquireFastMutex(&table->Mutex);
+
+    // Replace the device's program if it has one, else take a free slot
+    for (i = 0; i < HID_INPUT_MAX_DEVICES; i++) {
+        PHID_INPUT_SLOT slot = &table->Slots[i];
+
+        if (slot->Device != NULL && slot->Device->DeviceAddress == header->DeviceAddress) {
+            target = slot;
+            break;
+        }
+
+        if (slot->Device == NULL && target == NULL) {
+            target = slot;
+        }
+    }
+
+    if (device == NULL) {
+        if (target != NULL && target->Device != NULL &&
+            target->Device->DeviceAddress == header->DeviceAddress) {
+            HidInputSlotTeardown(table, target);
+        } else {
+            status = STATUS_NOT_FOUND;
+        }
+        goto Exit;
+    }
+
+    if (target == NULL) {
+        ExFreePoolWithTag(device, HID_INPUT_POOL_TAG);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    HidInputSlotTeardown(table, target);
+    target->Device = device;
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: HID descriptor for %llx compiled: %u bytes, %u input reports%s\n",
+        device->DeviceAddress, header->Length, device->Compiled.ReportCount,
+        device->Compiled.UsesReportIds ? " with IDs" : ""));
+
+Exit:
+    ExReleaseFastMutex(&table->Mutex);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HID_DECODE_REPORT: HID_REPORT_HEADER followed
+    by the report; returns HID_DECODED_REPORT. Takes only the slot's
+    rundown reference.
+--*/
+NTSTATUS
+HandleHidDecodeReport(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PHID_REPORT_HEADER header;
+    PHID_DECODED_REPORT decoded;
+    UCHAR report[HID_MAX_REPORT_BYTES];
+    BTH_ADDR deviceAddress;
+    ULONG reportLength;
+    size_t length;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(HID_REPORT_HEADER), (PVOID*)&header, &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (header->Length == 0 ||
+        header->Length > length - sizeof(HID_REPORT_HEADER) ||
+        header->Length > HID_MAX_REPORT_BYTES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Input and output share the system buffer
+    deviceAddress = header->DeviceAddress;
+    reportLength = header->Length;
+    RtlCopyMemory(report, header + 1, reportLength);
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(HID_DECODED_REPORT), (PVOID*)&decoded, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = HidInputDecode(&DeviceContext->HidInput, deviceAddress, report, reportLength, decoded);
+    if (NT_SUCCESS(status)) {
+        *BytesReturned = sizeof(HID_DECODED_REPORT);
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HID_GET_LAYOUT: the fields of one compiled
+    input report, in the order HID_DECODED_REPORT returns their values
+--*/
+NTSTATUS
+HandleHidGetLayout(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PHID_LAYOUT_QUERY query;
+    PHID_REPORT_LAYOUT layout;
+    PHID_INPUT_SLOT slot;
+    PHID_INPUT_DEVICE device;
+    const HID_REPORT_PROGRAM* program;
+    BTH_ADDR deviceAddress;
+    UCHAR reportId, index;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(HID_LAYOUT_QUERY), (PVOID*)&query, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    deviceAddress = query->DeviceAddress;
+    reportId = query->ReportId;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(HID_REPORT_LAYOUT), (PVOID*)&layout, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    slot = HidInputReferenceDevice(&DeviceContext->HidInput, deviceAddress);
+    if (slot == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    device = slot->Device;
+    index = device->Compiled.Index[reportId];
+
+    if (index == HID_NO_REPORT) {
+        status = STATUS_NOT_FOUND;
+    } else {
+        program = &device->Compiled.Reports[index];
+
+        RtlZeroMemory(layout, sizeof(HID_REPORT_LAYOUT));
+        layout->ReportId = program->ReportId;
+        layout->Length = program->Length;
+        layout->Count = program->Count;
+        layout->ReportsDecoded = (ULONG)device->ReportsDecoded;
+        layout->ReportsRejected = (ULONG)device->ReportsRejected;
+        RtlCopyMemory(layout->Fields, program->Fields, program->Count * sizeof(HID_FIELD_INFO));
+        *BytesReturned = sizeof(HID_REPORT_LAYOUT);
+    }
+
+    ExReleaseRundownProtection(&slot->Rundown);
+    return status;
+}
+
+// Interrupt time, 100 ns units, at performance counter resolution
+static LONGLONG
+HidInputNow(
+    VOID
+)
+{
+    ULONG64 qpc;
+
+    return (LONGLONG)KeQueryInterruptTimePrecise(&qpc);
+}
+
+/*++
+Routine Description:
+    Arms the latency timer for Deadline unless it is already due
+    earlier. Caller holds the lock.
+--*/
+static VOID
+HidInputArmTimer(
+    _Inout_ PHID_INPUT_TABLE Table,
+    _In_ LONGLONG Deadline,
+    _In_ LONGLONG Now
+)
+{
+    if (Table->Timer == NULL || (Table->TimerDue != 0 && Table->TimerDue <= Deadline)) {
+        return;
+    }
+
+    Table->TimerDue = Deadline;
+    ExSetTimer(Table->Timer, -max(Deadline - Now, 1), 0, NULL);
+}
+
+/*++
+Routine Description:
+    Completes pended reads while any device is ready. Each completion
+    carries as many queued events as its buffer holds, from every
+    device, ready or not.
+
+Arguments:
+    Table - Device's HID input table
+
+Return Value:
+    None
+--*/
+static VOID
+HidInputDrain(
+    _Inout_ PHID_INPUT_TABLE Table
+)
+{
+    for (;;) {
+        WDFREQUEST request;
+        PHID_INPUT_BATCH batch;
+        NTSTATUS status;
+        size_t size;
+        ULONG capacity, copied = 0, i;
+        LONGLONG now;
+        KIRQL irql;
+
+        KeAcquireSpinLock(&Table->Lock, &irql);
+
+        if (Table->Coalescer.ReadyQueues == 0 || Table->ReadQueue == NULL ||
+            !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Table->ReadQueue, &request))) {
+            KeReleaseSpinLock(&Table->Lock, irql);
+            return;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(request, sizeof(HID_INPUT_BATCH), (PVOID*)&batch, &size);
+        if (!NT_SUCCESS(status)) {
+            KeReleaseSpinLock(&Table->Lock, irql);
+            WdfRequestComplete(request, status);
+            continue;
+        }
+
+        capacity = (ULONG)((size - FIELD_OFFSET(HID_INPUT_BATCH, Events)) / sizeof(HID_INPUT_EVENT));
+        now = HidInputNow();
+
+        for (i = 0; i < HID_INPUT_MAX_DEVICES && copied < capacity; i++) {
+            PHID_INPUT_SLOT slot = &Table->Slots[i];
+
+            if (!ExAcquireRundownProtection(&slot->Rundown)) {
+                continue;
+            }
+
+            if (slot->Device != NULL) {
+                copied += HidCoalesceTake(&Table->Coalescer, &slot->Device->Queue,
+                    &batch->Events[copied], capacity - copied, now);
+            }
+
+            ExReleaseRundownProtection(&slot->Rundown);
+        }
+
+        batch->Count = copied;
+        batch->Reserved = 0;
+        Table->Coalescer.Stats.Completions++;
+
+        KeReleaseSpinLock(&Table->Lock, irql);
+
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS,
+            FIELD_OFFSET(HID_INPUT_BATCH, Events) + (size_t)copied * sizeof(HID_INPUT_EVENT));
+    }
+}
+
+/*++
+Routine Description:
+    Latency cap: readies every batch whose deadline has passed, then
+    re-arms for the earliest remaining one
+--*/
+static VOID
+HidInputTimerCallback(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context
+)
+{
+    PHID_INPUT_TABLE table = (PHID_INPUT_TABLE)Context;
+    LONGLONG now, next = MAXLONGLONG;
+    KIRQL irql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(Timer);
+
+    if (table == NULL) {
+        return;
+    }
+
+    KeAcquireSpinLock(&table->Lock, &irql);
+
+    now = HidInputNow();
+    table->TimerDue = 0;
+
+    for (i = 0; i < HID_INPUT_MAX_DEVICES; i++) {
+        PHID_INPUT_SLOT slot = &table->Slots[i];
+
+        if (!ExAcquireRundownProtection(&slot->Rundown)) {
+            continue;
+        }
+
+        if (slot->Device != NULL) {
+            LONGLONG deadline = HidCoalesceExpire(&table->Coalescer, &slot->Device->Queue, now);
+
+            next = min(next, deadline);
+        }
+
+        ExReleaseRundownProtection(&slot->Rundown);
+    }
+
+    if (next != MAXLONGLONG) {
+        HidInputArmTimer(table, next, now);
+    }
+
+    KeReleaseSpinLock(&table->Lock, irql);
+
+    HidInputDrain(table);
+}
+
+/*++
+Routine Description:
+    Decodes one input report and queues it for delivery. A report that
+    changes a button or key readies its device's batch at once; others
+    wait for the latency cap or a full batch.
+
+Arguments:
+    Table - Device's HID input table
+    DeviceAddress - Source device
+    Report - Input report, report ID byte first if the device uses IDs
+    Length - Report length in bytes
+    Timestamp - Arrival time, 100 ns units; 0 stamps it now
+
+Return Value:
+    STATUS_SUCCESS, STATUS_NOT_FOUND, STATUS_INVALID_PARAMETER for an
+    unknown or short report, or STATUS_DEVICE_BUSY when the device's
+    queue is full
+--*/
+NTSTATUS
+HidInputQueueReport(
+    _In_ PHID_INPUT_TABLE Table,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_reads_bytes_(Length) const UCHAR* Report,
+    _In_ ULONG Length,
+    _In_ LONGLONG Timestamp
+)
+{
+    PHID_INPUT_SLOT slot;
+    PHID_INPUT_DEVICE device;
+    HID_INPUT_EVENT event;
+    NTSTATUS status;
+    BOOLEAN changed = FALSE, ready;
+    ULONG64 stateMask;
+    LONGLONG now, deadline;
+    ULONG count, index, f;
+    UCHAR reportId;
+    KIRQL irql;
+
+    slot = HidInputReferenceDevice(Table, DeviceAddress);
+    if (slot == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    device = slot->Device;
+    count = HidDecodeReport(&device->Compiled, Report, Length, event.Values, &reportId);
+    if (count == 0) {
+        InterlockedIncrement(&device->ReportsRejected);
+        ExReleaseRundownProtection(&slot->Rundown);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    InterlockedIncrement(&device->ReportsDecoded);
+    index = device->Compiled.Index[reportId];
+    stateMask = device->StateMask[index];
+
+    KeAcquireSpinLock(&Table->Lock, &irql);
+
+    now = HidInputNow();
+
+    // Compare buttons and keys with this report ID's previous report
+    for (f = 0; f < count; f++) {
+        if ((stateMask & (1ULL << f)) != 0 && device->LastState[index][f] != event.Values[f]) {
+            changed = TRUE;
+            device->LastState[index][f] = event.Values[f];
+        }
+    }
+    changed = changed || !device->StateValid[index];
+    device->StateValid[index] = TRUE;
+
+    event.Timestamp = (Timestamp != 0) ? Timestamp : now;
+    event.DeviceAddress = DeviceAddress;
+    event.ReportId = reportId;
+    event.Flags = changed ? HID_EVENT_STATE_CHANGE : 0;
+    event.Count = (USHORT)count;
+    event.Reserved = 0;
+
+    status = HidCoalescePush(&Table->Coalescer, &device->Queue, &event, now, &deadline);
+    if (deadline != 0) {
+        HidInputArmTimer(Table, deadline, now);
+    }
+
+    ready = (Table->Coalescer.ReadyQueues != 0);
+    KeReleaseSpinLock(&Table->Lock, irql);
+
+    ExReleaseRundownProtection(&slot->Rundown);
+
+    if (ready) {
+        HidInputDrain(Table);
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HID_SUBMIT_REPORT: HID_SUBMIT_HEADER followed
+    by the report
+--*/
+NTSTATUS
+HandleHidSubmitReport(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PHID_SUBMIT_HEADER header;
+    size_t length;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(HID_SUBMIT_HEADER), (PVOID*)&header, &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (header->Length == 0 ||
+        header->Length > length - sizeof(HID_SUBMIT_HEADER) ||
+        header->Length > HID_MAX_REPORT_BYTES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return HidInputQueueReport(&DeviceContext->HidInput, header->DeviceAddress,
+        (const UCHAR*)(header + 1), header->Length, header->Timestamp);
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HID_COALESCE_CONFIG. Turning coalescing off
+    readies anything the device has queued.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    BytesReturned - Receives 0
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleHidCoalesceConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PHID_COALESCE_CONFIG config;
+    PHID_INPUT_TABLE table = &DeviceContext->HidInput;
+    PHID_INPUT_SLOT slot;
+    PHID_INPUT_DEVICE device;
+    ULONG maxReports;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(HID_COALESCE_CONFIG), (PVOID*)&config, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    maxReports = (config->MaxReports == 0) ? HID_COALESCE_MAX_REPORTS : config->MaxReports;
+
+    if (config->MaxLatencyUs > HID_COALESCE_MAX_LATENCY_US || maxReports > HID_COALESCE_MAX_REPORTS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&table->Mutex);
+
+    if (config->MaxLatencyUs != 0 && table->Timer == NULL) {
+        table->Timer = ExAllocateTimer(HidInputTimerCallback, table, EX_TIMER_HIGH_RESOLUTION);
+        if (table->Timer == NULL) {
+            ExReleaseFastMutex(&table->Mutex);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    ExReleaseFastMutex(&table->Mutex);
+
+    slot = HidInputReferenceDevice(table, config->DeviceAddress);
+    if (slot == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    device = slot->Device;
+
+    KeAcquireSpinLock(&table->Lock, &irql);
+    HidCoalesceConfigure(&table->Coalescer, &device->Queue, config->MaxLatencyUs, maxReports);
+    KeReleaseSpinLock(&table->Lock, irql);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: HID coalescing for %llx: %s (cap %u us, %u reports)\n",
+        config->DeviceAddress, config->MaxLatencyUs ? "on" : "off",
+        config->MaxLatencyUs, maxReports));
+
+    ExReleaseRundownProtection(&slot->Rundown);
+
+    HidInputDrain(table);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HID_READ_INPUT: pends the request until a
+    batch is ready. The output buffer must hold at least one event.
+--*/
+NTSTATUS
+HandleHidReadInput(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PHID_INPUT_TABLE table = &DeviceContext->HidInput;
+
+    *BytesReturned = 0;
+
+    if (OutputBufferLength < sizeof(HID_INPUT_BATCH)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (table->ReadQueue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    status = WdfRequestForwardToIoQueue(Request, table->ReadQueue);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // The request belongs to the read queue now; it may complete here
+    HidInputDrain(table);
+    return STATUS_PENDING;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_HID_GET_INPUT_STATS
+--*/
+NTSTATUS
+HandleHidGetInputStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PHID_INPUT_STATS stats;
+    PHID_INPUT_TABLE table = &DeviceContext->HidInput;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(HID_INPUT_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&table->Lock, &irql);
+    *stats = table->Coalescer.Stats;
+    KeReleaseSpinLock(&table->Lock, irql);
+
+    *BytesReturned = sizeof(HID_INPUT_STATS);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,157 @@
+/*++
+
+Module Name:
+    MultiDeviceBTHidInput.h
+
+Abstract:
+    HID input fast path. Each HID device's report descriptor is compiled
+    once, when the service hands it over, into the extraction program
+    of MultiDeviceBTHid.h. Input reports are decoded against that
+    program without reparsing the descriptor.
+
+    Decoded reports are queued per device and delivered to pended
+    IOCTL_MULTI_BT_HID_READ_INPUT requests. With coalescing enabled, a
+    device's reports are batched into one completion, up to a latency
+    cap. A batch flushes at once when a button or key changes state.
+    The batching is the portable MultiDeviceBTHidCoalesce.h.
+
+--*/
+
+#ifndef _MULTIDEVICEBTHIDINPUT_H_
+#define _MULTIDEVICEBTHIDINPUT_H_
+
+#include "MultiDeviceBTHid.h"
+#include "MultiDeviceBTHidCoalesce.h"
+
+#define HID_INPUT_MAX_DEVICES       MAX_BLUETOOTH_CONNECTIONS
+#define HID_INPUT_POOL_TAG          'HDBM'
+
+// IOCTL_MULTI_BT_HID_SET_DESCRIPTOR input, followed by the report
+// descriptor. Length 0 forgets the device.
+typedef struct _HID_DESCRIPTOR_HEADER {
+    BTH_ADDR DeviceAddress;
+    ULONG Length;
+    ULONG Reserved;
+} HID_DESCRIPTOR_HEADER, *PHID_DESCRIPTOR_HEADER;
+
+// IOCTL_MULTI_BT_HID_DECODE_REPORT input, followed by the input report
+// as received on the interrupt channel (report ID byte first, if any)
+typedef struct _HID_REPORT_HEADER {
+    BTH_ADDR DeviceAddress;
+    ULONG Length;
+    ULONG Reserved;
+} HID_REPORT_HEADER, *PHID_REPORT_HEADER;
+
+// IOCTL_MULTI_BT_HID_DECODE_REPORT output: values in descriptor order,
+// matching the Fields of the report's layout
+typedef struct _HID_DECODED_REPORT {
+    UCHAR ReportId;
+    UCHAR Reserved[3];
+    ULONG Count;
+    LONG Values[HID_MAX_FIELDS];
+} HID_DECODED_REPORT, *PHID_DECODED_REPORT;
+
+// IOCTL_MULTI_BT_HID_GET_LAYOUT input
+typedef struct _HID_LAYOUT_QUERY {
+    BTH_ADDR DeviceAddress;
+    UCHAR ReportId;             // 0 when the device declares no report IDs
+    UCHAR Reserved[7];
+} HID_LAYOUT_QUERY, *PHID_LAYOUT_QUERY;
+
+// IOCTL_MULTI_BT_HID_GET_LAYOUT output
+typedef struct _HID_REPORT_LAYOUT {
+    UCHAR ReportId;
+    UCHAR Reserved;
+    USHORT Length;
+    ULONG Count;
+    ULONG ReportsDecoded;       // Device totals
+    ULONG ReportsRejected;      // Unknown report ID or short report
+    HID_FIELD_INFO Fields[HID_MAX_FIELDS];
+} HID_REPORT_LAYOUT, *PHID_REPORT_LAYOUT;
+
+// IOCTL_MULTI_BT_HID_SUBMIT_REPORT input, followed by the report
+typedef struct _HID_SUBMIT_HEADER {
+    BTH_ADDR DeviceAddress;
+    ULONG Length;
+    ULONG Reserved;
+    LONGLONG Timestamp;         // Arrival, 100 ns units; 0 stamps it on receipt
+} HID_SUBMIT_HEADER, *PHID_SUBMIT_HEADER;
+
+// IOCTL_MULTI_BT_HID_COALESCE_CONFIG input
+typedef struct _HID_COALESCE_CONFIG {
+    BTH_ADDR DeviceAddress;
+    ULONG MaxLatencyUs;         // Bound on added latency; 0 (or up to HID_COALESCE_SLACK_US): no batching
+    ULONG MaxReports;           // Flush at this many; 0 selects HID_COALESCE_MAX_REPORTS
+} HID_COALESCE_CONFIG, *PHID_COALESCE_CONFIG;
+
+// IOCTL_MULTI_BT_HID_READ_INPUT output; the buffer size sets how many
+// events one completion can carry
+typedef struct _HID_INPUT_BATCH {
+    ULONG Count;
+    ULONG Reserved;
+    HID_INPUT_EVENT Events[1];
+} HID_INPUT_BATCH, *PHID_INPUT_BATCH;
+
+typedef struct _HID_INPUT_DEVICE {
+    BTH_ADDR DeviceAddress;
+    volatile LONG ReportsDecoded;
+    volatile LONG ReportsRejected;
+    HID_COMPILED Compiled;
+
+    // Fields whose change flushes a batch, per report, and their last values
+    ULONG64 StateMask[HID_MAX_REPORTS];
+    BOOLEAN StateValid[HID_MAX_REPORTS];
+    LONG LastState[HID_MAX_REPORTS][HID_MAX_FIELDS];
+
+    // Under the table lock; times are interrupt time
+    HID_COALESCE_QUEUE Queue;
+} HID_INPUT_DEVICE, *PHID_INPUT_DEVICE;
+
+typedef struct _HID_INPUT_SLOT {
+    EX_RUNDOWN_REF Rundown;
+    PHID_INPUT_DEVICE Device;
+} HID_INPUT_SLOT, *PHID_INPUT_SLOT;
+
+// Descriptor changes serialize on Mutex; decoders hold a slot's rundown
+// reference while using its program. Lock covers the device queues,
+// the timer due time and Coalescer.
+typedef struct _HID_INPUT_TABLE {
+    FAST_MUTEX Mutex;
+    HID_INPUT_SLOT Slots[HID_INPUT_MAX_DEVICES];
+    KSPIN_LOCK Lock;
+    WDFQUEUE ReadQueue;         // Pended IOCTL_MULTI_BT_HID_READ_INPUT
+    PEX_TIMER Timer;            // Latency cap; allocated with the first coalescing device
+    LONGLONG TimerDue;          // Interrupt time, 0 when idle
+    HID_COALESCER Coalescer;
+} HID_INPUT_TABLE, *PHID_INPUT_TABLE;
+
+VOID HidInputInitialize(
+    _Out_ PHID_INPUT_TABLE Table
+);
+
+NTSTATUS HidInputCreateReadQueue(
+    _Inout_ PHID_INPUT_TABLE Table,
+    _In_ WDFDEVICE Device
+);
+
+VOID HidInputCleanup(
+    _Inout_ PHID_INPUT_TABLE Table
+);
+
+NTSTATUS HidInputDecode(
+    _In_ PHID_INPUT_TABLE Table,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_reads_bytes_(Length) const UCHAR* Report,
+    _In_ ULONG Length,
+    _Out_ PHID_DECODED_REPORT Decoded
+);
+
+NTSTATUS HidInputQueueReport(
+    _In_ PHID_INPUT_TABLE Table,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_reads_bytes_(Length) const UCHAR* Report,
+    _In_ ULONG Length,
+    _In_ LONGLONG Timestamp
+);
+
+#endif // _MULTIDEVICEBTHIDINPUT_H_
@@ -0,0 +1,660 @@
+/*++
+
+Module Name:
+    MultiDeviceBTIoT.c
+
+Abstract:
+    IoT telemetry store and sensor shadow cache.
+    Sensors that only publish readings can broadcast IOT_SPEC sensor
+    packets in advertising data; reports from passive scanning are
+    ingested here directly, so they never occupy a connection slot.
+    Enabling ingestion queues the passive scan through the HCI command
+    pipeline; a new sensor finding the shadow cache full around its
+    hash takes the slot of the sensor heard from least recently.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+// Passive scan defaults: 60 ms interval, 30 ms window
+#define IOT_ADV_DEFAULT_SCAN_INTERVAL   0x0060
+#define IOT_ADV_DEFAULT_SCAN_WINDOW     0x0030
+#define IOT_ADV_MIN_SCAN_PARAMETER      0x0004
+#define IOT_ADV_MAX_SCAN_PARAMETER      0x4000
+#define IOT_ADV_DEFAULT_MINIMUM_RSSI    (-100)
+
+#define HCI_OP_LE_SET_SCAN_PARAMETERS   0x200B
+#define HCI_OP_LE_SET_SCAN_ENABLE       0x200C
+#define HCI_LE_SCAN_PASSIVE             0x00
+
+/*++
+Routine Description:
+    Hashes a device address into the shadow table (Fibonacci hashing)
+--*/
+static __forceinline ULONG
+IoTShadowHash(
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    return (ULONG)((DeviceAddress * 0x9E3779B97F4A7C15ULL) >> 32) &
+        (IOT_SHADOW_CAPACITY - 1);
+}
+
+/*++
+Routine Description:
+    Finds the shadow slot for a device, optionally claiming one. Every
+    sensor lies within IOT_SHADOW_MAX_PROBE slots of its hash, and a
+    slot once claimed is only ever reused in place, so a lookup stops
+    at the first free slot or the end of that reach. An insert that
+    finds no free slot in reach evicts the entry seen least recently.
+    Caller must hold Store->Lock.
+
+Return Value:
+    Shadow entry, or NULL if not present and Insert is FALSE
+--*/
+static PIOT_SHADOW_ENTRY
+IoTFindShadowSlot(
+    _In_ PIOT_TELEMETRY_STORE Store,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ BOOLEAN Insert
+)
+{
+    ULONG index = IoTShadowHash(DeviceAddress);
+    PIOT_SHADOW_ENTRY stalest = NULL;
+    ULONG probe;
+
+    for (probe = 0; probe < IOT_SHADOW_MAX_PROBE; probe++) {
+        PIOT_SHADOW_ENTRY entry = &Store->Shadow[index];
+
+        if (entry->DeviceAddress == DeviceAddress) {
+            return entry;
+        }
+
+        if (entry->DeviceAddress == BTH_ADDR_NULL) {
+            if (!Insert) {
+                return NULL;
+            }
+            entry->DeviceAddress = DeviceAddress;
+            Store->Stats.ShadowEntries++;
+            return entry;
+        }
+
+        if (stalest == NULL || entry->LastSeen.QuadPart < stalest->LastSeen.QuadPart) {
+            stalest = entry;
+        }
+
+        index = (index + 1) & (IOT_SHADOW_CAPACITY - 1);
+    }
+
+    if (!Insert) {
+        return NULL;
+    }
+
+    RtlZeroMemory(stalest, sizeof(*stalest));
+    stalest->DeviceAddress = DeviceAddress;
+    Store->Stats.ShadowEvicted++;
+    return stalest;
+}
+
+/*++
+Routine Description:
+    Initializes the telemetry store and shadow cache
+
+Arguments:
+    Store - Telemetry store embedded in the device context
+
+Return Value:
+    None
+--*/
+VOID
+IoTTelemetryInitialize(
+    _Out_ PIOT_TELEMETRY_STORE Store
+)
+{
+    RtlZeroMemory(Store, sizeof(*Store));
+    KeInitializeSpinLock(&Store->Lock);
+    ExInitializeFastMutex(&Store->ConfigMutex);
+
+    Store->AdvConfig.Enable = FALSE;
+    Store->AdvConfig.MinimumRssi = IOT_ADV_DEFAULT_MINIMUM_RSSI;
+    Store->AdvConfig.ScanInterval = IOT_ADV_DEFAULT_SCAN_INTERVAL;
+    Store->AdvConfig.ScanWindow = IOT_ADV_DEFAULT_SCAN_WINDOW;
+}
+
+/*++
+Routine Description:
+    Decodes an IOT_SPEC section 3.2 sensor data packet (big endian fields)
+
+Arguments:
+    Packet - Raw sensor packet
+    Length - Packet length in bytes
+    Reading - Receives the decoded fields
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+IoTDecodeSensorPacket(
+    _In_reads_bytes_(Length) PUCHAR Packet,
+    _In_ ULONG Length,
+    _Out_ PIOT_SENSOR_READING Reading
+)
+{
+    RtlZeroMemory(Reading, sizeof(*Reading));
+
+    if (Length < IOT_SENSOR_PACKET_SIZE) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    Reading->DeviceType = Packet[0];
+    Reading->Temperature = (SHORT)((Packet[1] << 8) | Packet[2]);
+    Reading->Humidity = (USHORT)((Packet[3] << 8) | Packet[4]);
+    Reading->PowerConsumption = (USHORT)((Packet[5] << 8) | Packet[6]);
+    Reading->FanSpeed = Packet[7];
+    Reading->Mode = Packet[8];
+    Reading->Sequence = Packet[9];
+
+    if (Reading->FanSpeed > 100) {
+        return STATUS_DATA_ERROR;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Records a reading in the shadow cache and appends it to the telemetry
+    ring. Advertising sensors repeat each reading many times per interval;
+    repeats with the same sequence number are dropped here.
+
+Arguments:
+    Store - Telemetry store
+    Reading - Decoded reading (DeviceAddress, Timestamp and Source set)
+
+Return Value:
+    STATUS_SUCCESS, or STATUS_DUPLICATE_OBJECTID for a repeated advertisement
+--*/
+NTSTATUS
+IoTStoreSensorReading(
+    _Inout_ PIOT_TELEMETRY_STORE Store,
+    _In_ PIOT_SENSOR_READING Reading
+)
+{
+    KIRQL oldIrql;
+    PIOT_SHADOW_ENTRY entry;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    KeAcquireSpinLock(&Store->Lock, &oldIrql);
+
+    entry = IoTFindShadowSlot(Store, Reading->DeviceAddress, TRUE);
+    entry->LastSeen = Reading->Timestamp;
+
+    if (Reading->Source == IOT_READING_SOURCE_ADVERTISING &&
+        entry->UpdateCount != 0 &&
+        entry->Reading.Source == IOT_READING_SOURCE_ADVERTISING &&
+        entry->Reading.Sequence == Reading->Sequence) {
+        entry->DuplicatesDropped++;
+        Store->Stats.AdvDuplicatesDropped++;
+        status = STATUS_DUPLICATE_OBJECTID;
+        goto Exit;
+    }
+
+    entry->Reading = *Reading;
+    entry->UpdateCount++;
+
+    Store->Ring[Store->RingWriteCount & (IOT_TELEMETRY_RING_SIZE - 1)] = *Reading;
+    Store->RingWriteCount++;
+
+Exit:
+    KeReleaseSpinLock(&Store->Lock, oldIrql);
+    return status;
+}
+
+/*++
+Routine Description:
+    Ingests one advertising report from passive scanning. The advertising
+    data is walked as AD structures; each 16-bit Service Data element for
+    the Core IoT Service carries one sensor packet.
+
+Arguments:
+    Store - Telemetry store
+    DeviceAddress - Advertiser address
+    Rssi - Report RSSI in dBm
+    AdvData - Advertising data
+    Length - Advertising data length (at most 31 bytes legacy, 254 extended)
+
+Return Value:
+    STATUS_SUCCESS if at least one new reading was stored,
+    STATUS_NOT_FOUND if the report carried no IoT telemetry
+--*/
+NTSTATUS
+IoTIngestAdvertisingReport(
+    _Inout_ PIOT_TELEMETRY_STORE Store,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ CHAR Rssi,
+    _In_reads_bytes_(Length) PUCHAR AdvData,
+    _In_ ULONG Length
+)
+{
+    IOT_SENSOR_READING reading;
+    LARGE_INTEGER now;
+    ULONG offset = 0;
+    NTSTATUS status = STATUS_NOT_FOUND;
+
+    // Unlocked reads: a stale configuration only delays the change by one report
+    if (!Store->AdvConfig.Enable) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    InterlockedIncrement((volatile LONG*)&Store->Stats.AdvReportsSeen);
+
+    if (Rssi < Store->AdvConfig.MinimumRssi) {
+        InterlockedIncrement((volatile LONG*)&Store->Stats.AdvFilteredRssi);
+        return STATUS_NOT_FOUND;
+    }
+
+    KeQuerySystemTime(&now);
+
+    while (offset < Length) {
+        ULONG elementLength = AdvData[offset];
+        PUCHAR element = &AdvData[offset + 1];
+
+        if (elementLength == 0) {
+            break;  // Early termination / zero padding
+        }
+
+        if (offset + 1 + elementLength > Length) {
+            InterlockedIncrement((volatile LONG*)&Store->Stats.AdvMalformed);
+            return STATUS_DATA_ERROR;
+        }
+
+        // element[0] = AD type, element[1..2] = UUID16 (little endian)
+        if (element[0] == IOT_AD_TYPE_SERVICE_DATA_16 &&
+            elementLength >= 3 + IOT_SENSOR_PACKET_SIZE &&
+            (element[1] | (element[2] << 8)) == IOT_CORE_SERVICE_UUID16) {
+
+            if (!NT_SUCCESS(IoTDecodeSensorPacket(&element[3],
+                    elementLength - 3, &reading))) {
+                InterlockedIncrement((volatile LONG*)&Store->Stats.AdvMalformed);
+            } else {
+                reading.DeviceAddress = DeviceAddress;
+                reading.Timestamp = now;
+                reading.Rssi = Rssi;
+                reading.Source = IOT_READING_SOURCE_ADVERTISING;
+
+                if (NT_SUCCESS(IoTStoreSensorReading(Store, &reading))) {
+                    InterlockedIncrement((volatile LONG*)&Store->Stats.AdvReadingsIngested);
+                    status = STATUS_SUCCESS;
+                }
+            }
+        }
+
+        offset += 1 + elementLength;
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Returns the latest reading for a device from the shadow cache
+
+Arguments:
+    Store - Telemetry store
+    DeviceAddress - Sensor address
+    Reading - Receives the cached reading
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+IoTLookupShadow(
+    _In_ PIOT_TELEMETRY_STORE Store,
+    _In_ BTH_ADDR DeviceAddress,
+    _Out_ PIOT_SENSOR_READING Reading
+)
+{
+    KIRQL oldIrql;
+    PIOT_SHADOW_ENTRY entry;
+    NTSTATUS status = STATUS_NOT_FOUND;
+
+    KeAcquireSpinLock(&Store->Lock, &oldIrql);
+
+    entry = IoTFindShadowSlot(Store, DeviceAddress, FALSE);
+    if (entry != NULL && entry->UpdateCount != 0) {
+        *Reading = entry->Reading;
+        status = STATUS_SUCCESS;
+    }
+
+    KeReleaseSpinLock(&Store->Lock, oldIrql);
+    return status;
+}
+
+/*++
+Routine Description:
+    Queues the passive scan a configuration asks for. Scan parameters
+    cannot change while the controller scans, so a running scan is
+    stopped first. Duplicate filtering stays off: sensors repeat the
+    same advertisement until the reading changes, and a controller's
+    filter can hide the change. Caller holds Store->ConfigMutex.
+
+Arguments:
+    DeviceContext - Device context
+    Config - Validated configuration
+
+Return Value:
+    NTSTATUS from HciCommandSubmit
+--*/
+static NTSTATUS
+IoTQueueScan(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ const IOT_ADV_TELEMETRY_CONFIG* Config
+)
+{
+    PIOT_TELEMETRY_STORE store = &DeviceContext->Telemetry;
+    UCHAR parameters[7];
+    UCHAR enable[2] = { 0, 0 };
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG queued = 0;
+    ULONG id;
+
+    if (store->Scanning) {
+        status = HciCommandSubmit(&DeviceContext->HciCommands, HCI_OP_LE_SET_SCAN_ENABLE,
+            PRIORITY_MEDIUM, enable, sizeof(enable), &id, NULL);
+        if (!NT_SUCCESS(status)) {
+            goto Exit;
+        }
+        store->Scanning = FALSE;
+        queued++;
+    }
+
+    if (!Config->Enable) {
+        goto Exit;
+    }
+
+    // Passive scanning sends nothing, so the own address type does not matter
+    parameters[0] = HCI_LE_SCAN_PASSIVE;
+    parameters[1] = (UCHAR)Config->ScanInterval;
+    parameters[2] = (UCHAR)(Config->ScanInterval >> 8);
+    parameters[3] = (UCHAR)Config->ScanWindow;
+    parameters[4] = (UCHAR)(Config->ScanWindow >> 8);
+    parameters[5] = 0;          // Public
+    parameters[6] = 0;          // Every advertiser
+
+    status = HciCommandSubmit(&DeviceContext->HciCommands, HCI_OP_LE_SET_SCAN_PARAMETERS,
+        PRIORITY_MEDIUM, parameters, sizeof(parameters), &id, NULL);
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+    queued++;
+
+    enable[0] = 1;
+    status = HciCommandSubmit(&DeviceContext->HciCommands, HCI_OP_LE_SET_SCAN_ENABLE,
+        PRIORITY_MEDIUM, enable, sizeof(enable), &id, NULL);
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+    store->Scanning = TRUE;
+    queued++;
+
+Exit:
+    // Written only under ConfigMutex
+    store->Stats.ScanCommandsQueued += queued;
+    if (!NT_SUCCESS(status)) {
+        store->Stats.ScanCommandsFailed++;
+    }
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_ADV_TELEMETRY_CONFIG: enables or disables
+    advertisement-based telemetry ingestion and queues the passive scan
+    that feeds it
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Input buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS. If the scan commands cannot be queued, ingestion is left
+    disabled and the call can be retried.
+--*/
+NTSTATUS
+HandleAdvTelemetryConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PIOT_ADV_TELEMETRY_CONFIG input;
+    IOT_ADV_TELEMETRY_CONFIG config;
+    PIOT_TELEMETRY_STORE store = &DeviceContext->Telemetry;
+    KIRQL oldIrql;
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(IOT_ADV_TELEMETRY_CONFIG), (PVOID*)&input, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    config = *input;
+
+    if (config.Enable &&
+        (config.ScanInterval < IOT_ADV_MIN_SCAN_PARAMETER ||
+         config.ScanInterval > IOT_ADV_MAX_SCAN_PARAMETER ||
+         config.ScanWindow < IOT_ADV_MIN_SCAN_PARAMETER ||
+         config.ScanWindow > config.ScanInterval)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&store->ConfigMutex);
+
+    status = IoTQueueScan(DeviceContext, &config);
+    if (!NT_SUCCESS(status)) {
+        config.Enable = FALSE;
+    }
+
+    KeAcquireSpinLock(&store->Lock, &oldIrql);
+    store->AdvConfig = config;
+    KeReleaseSpinLock(&store->Lock, oldIrql);
+
+    ExReleaseFastMutex(&store->ConfigMutex);
+
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+            "MultiDeviceBT: Advertising telemetry scan not queued - 0x%x\n", status));
+        return status;
+    }
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Advertising telemetry %s (interval %u, window %u, min RSSI %d)\n",
+        config.Enable ? "enabled" : "disabled",
+        config.ScanInterval, config.ScanWindow, config.MinimumRssi));
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_READ_TELEMETRY: drains readings from the
+    telemetry ring starting at the caller's cursor
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Input buffer length
+    OutputBufferLength - Output buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleReadTelemetry(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PIOT_TELEMETRY_QUERY query;
+    PIOT_TELEMETRY_BATCH batch;
+    PIOT_TELEMETRY_STORE store = &DeviceContext->Telemetry;
+    ULONG cursor;
+    ULONG available;
+    ULONG capacity;
+    ULONG i;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(IOT_TELEMETRY_QUERY), (PVOID*)&query, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Read the cursor before the output buffer aliases the system buffer
+    cursor = query->Cursor;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        FIELD_OFFSET(IOT_TELEMETRY_BATCH, Readings), (PVOID*)&batch, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    capacity = (ULONG)((OutputBufferLength - FIELD_OFFSET(IOT_TELEMETRY_BATCH, Readings)) /
+        sizeof(IOT_SENSOR_READING));
+
+    KeAcquireSpinLock(&store->Lock, &oldIrql);
+
+    batch->Lost = 0;
+    available = store->RingWriteCount - cursor;
+    if (available > IOT_TELEMETRY_RING_SIZE) {
+        batch->Lost = available - IOT_TELEMETRY_RING_SIZE;
+        cursor += batch->Lost;
+        available = IOT_TELEMETRY_RING_SIZE;
+    }
+
+    batch->Count = min(available, capacity);
+    for (i = 0; i < batch->Count; i++) {
+        batch->Readings[i] =
+            store->Ring[(cursor + i) & (IOT_TELEMETRY_RING_SIZE - 1)];
+    }
+    batch->NextCursor = cursor + batch->Count;
+
+    KeReleaseSpinLock(&store->Lock, oldIrql);
+
+    *BytesReturned = FIELD_OFFSET(IOT_TELEMETRY_BATCH, Readings) +
+        (size_t)batch->Count * sizeof(IOT_SENSOR_READING);
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_SENSOR_SHADOW. With a BTH_ADDR input the
+    single cached reading is returned; with no input every shadow entry
+    that fits in the output buffer is returned.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Input buffer length
+    OutputBufferLength - Output buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS (STATUS_BUFFER_OVERFLOW if more entries exist than fit)
+--*/
+NTSTATUS
+HandleGetSensorShadow(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBTH_ADDR address;
+    PIOT_SENSOR_READING readings;
+    PIOT_TELEMETRY_STORE store = &DeviceContext->Telemetry;
+    BTH_ADDR deviceAddress;
+    ULONG capacity;
+    ULONG count = 0;
+    ULONG i;
+    KIRQL oldIrql;
+
+    *BytesReturned = 0;
+
+    if (InputBufferLength >= sizeof(BTH_ADDR)) {
+        status = WdfRequestRetrieveInputBuffer(Request,
+            sizeof(BTH_ADDR), (PVOID*)&address, NULL);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+        deviceAddress = *address;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(IOT_SENSOR_READING), (PVOID*)&readings, NULL);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = IoTLookupShadow(store, deviceAddress, readings);
+        if (NT_SUCCESS(status)) {
+            *BytesReturned = sizeof(IOT_SENSOR_READING);
+        }
+        return status;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(IOT_SENSOR_READING), (PVOID*)&readings, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    capacity = (ULONG)(OutputBufferLength / sizeof(IOT_SENSOR_READING));
+
+    KeAcquireSpinLock(&store->Lock, &oldIrql);
+
+    for (i = 0; i < IOT_SHADOW_CAPACITY; i++) {
+        PIOT_SHADOW_ENTRY entry = &store->Shadow[i];
+
+        if (entry->DeviceAddress == BTH_ADDR_NULL || entry->UpdateCount == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+        readings[count++] = entry->Reading;
+    }
+
+    KeReleaseSpinLock(&store->Lock, oldIrql);
+
+    *BytesReturned = (size_t)count * sizeof(IOT_SENSOR_READING);
+    return status;
+}
@@ -0,0 +1,127 @@
+/*++
+
+Module Name:
+    MultiDeviceBTIoT.h
+
+Abstract:
+    IoT telemetry store, sensor shadow cache and connectionless
+    (advertisement-based) telemetry ingestion
+
+--*/
+
+#ifndef _MULTIDEVICEBTIOT_H_
+#define _MULTIDEVICEBTIOT_H_
+
+// Shadow cache and telemetry ring sizes (must be powers of two)
+#define IOT_SHADOW_CAPACITY             512
+#define IOT_TELEMETRY_RING_SIZE         1024
+#define IOT_SHADOW_MAX_PROBE            16      // A sensor's slot is this close to its hash
+
+// IOT_SPEC section 3.2 sensor packet and advertising encapsulation
+#define IOT_SENSOR_PACKET_SIZE          12
+#define IOT_CORE_SERVICE_UUID16         0xFF00
+#define IOT_AD_TYPE_SERVICE_DATA_16     0x16
+
+// Reading sources
+#define IOT_READING_SOURCE_GATT         0x00
+#define IOT_READING_SOURCE_ADVERTISING  0x01
+
+// Decoded IOT_SPEC sensor data packet
+typedef struct _IOT_SENSOR_READING {
+    BTH_ADDR DeviceAddress;
+    LARGE_INTEGER Timestamp;
+    SHORT Temperature;          // Scaled by 10
+    USHORT Humidity;            // Scaled by 10
+    USHORT PowerConsumption;    // Watts
+    UCHAR DeviceType;
+    UCHAR FanSpeed;
+    UCHAR Mode;
+    UCHAR Sequence;             // Rolling counter (advertising only)
+    CHAR Rssi;
+    UCHAR Source;               // IOT_READING_SOURCE_*
+} IOT_SENSOR_READING, *PIOT_SENSOR_READING;
+
+// Latest known reading per sensor
+typedef struct _IOT_SHADOW_ENTRY {
+    BTH_ADDR DeviceAddress;     // BTH_ADDR_NULL marks a free slot
+    IOT_SENSOR_READING Reading;
+    LARGE_INTEGER LastSeen;     // Last report, repeats included; the stalest is evicted
+    ULONG UpdateCount;
+    ULONG DuplicatesDropped;
+} IOT_SHADOW_ENTRY, *PIOT_SHADOW_ENTRY;
+
+// Advertisement ingestion configuration (IOCTL_MULTI_BT_ADV_TELEMETRY_CONFIG)
+typedef struct _IOT_ADV_TELEMETRY_CONFIG {
+    BOOLEAN Enable;
+    CHAR MinimumRssi;           // Reports weaker than this are ignored
+    USHORT ScanInterval;        // 0.625 ms units; LE Set Scan Parameters
+    USHORT ScanWindow;          // 0.625 ms units
+} IOT_ADV_TELEMETRY_CONFIG, *PIOT_ADV_TELEMETRY_CONFIG;
+
+// Telemetry drain request/response (IOCTL_MULTI_BT_READ_TELEMETRY)
+typedef struct _IOT_TELEMETRY_QUERY {
+    ULONG Cursor;               // NextCursor from the previous call, 0 to start
+} IOT_TELEMETRY_QUERY, *PIOT_TELEMETRY_QUERY;
+
+typedef struct _IOT_TELEMETRY_BATCH {
+    ULONG NextCursor;
+    ULONG Count;
+    ULONG Lost;                 // Readings overwritten before they were drained
+    IOT_SENSOR_READING Readings[1];
+} IOT_TELEMETRY_BATCH, *PIOT_TELEMETRY_BATCH;
+
+// Ingestion counters
+typedef struct _IOT_TELEMETRY_STATS {
+    ULONG AdvReportsSeen;
+    ULONG AdvReadingsIngested;
+    ULONG AdvDuplicatesDropped;
+    ULONG AdvMalformed;
+    ULONG AdvFilteredRssi;
+    ULONG ShadowEntries;
+    ULONG ShadowEvicted;        // Stalest sensor in reach replaced by a new one
+    ULONG ScanCommandsQueued;
+    ULONG ScanCommandsFailed;
+} IOT_TELEMETRY_STATS, *PIOT_TELEMETRY_STATS;
+
+// Telemetry store: open-addressed shadow cache plus a ring of every reading
+typedef struct _IOT_TELEMETRY_STORE {
+    KSPIN_LOCK Lock;
+    FAST_MUTEX ConfigMutex;     // Configuration changes and the scan commands they queue
+    BOOLEAN Scanning;           // Passive scan last queued on; ConfigMutex
+    IOT_ADV_TELEMETRY_CONFIG AdvConfig;
+    IOT_TELEMETRY_STATS Stats;
+    ULONG RingWriteCount;
+    IOT_SHADOW_ENTRY Shadow[IOT_SHADOW_CAPACITY];
+    IOT_SENSOR_READING Ring[IOT_TELEMETRY_RING_SIZE];
+} IOT_TELEMETRY_STORE, *PIOT_TELEMETRY_STORE;
+
+VOID IoTTelemetryInitialize(
+    _Out_ PIOT_TELEMETRY_STORE Store
+);
+
+NTSTATUS IoTDecodeSensorPacket(
+    _In_reads_bytes_(Length) PUCHAR Packet,
+    _In_ ULONG Length,
+    _Out_ PIOT_SENSOR_READING Reading
+);
+
+NTSTATUS IoTStoreSensorReading(
+    _Inout_ PIOT_TELEMETRY_STORE Store,
+    _In_ PIOT_SENSOR_READING Reading
+);
+
+NTSTATUS IoTIngestAdvertisingReport(
+    _Inout_ PIOT_TELEMETRY_STORE Store,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ CHAR Rssi,
+    _In_reads_bytes_(Length) PUCHAR AdvData,
+    _In_ ULONG Length
+);
+
+NTSTATUS IoTLookupShadow(
+    _In_ PIOT_TELEMETRY_STORE Store,
+    _In_ BTH_ADDR DeviceAddress,
+    _Out_ PIOT_SENSOR_READING Reading
+);
+
+#endif // _MULTIDEVICEBTIOT_H_
@@ -0,0 +1,646 @@
+/*++
+
+Module Name:
+    MultiDeviceBTIso.c
+
+Abstract:
+    LE Audio isochronous channel scheduler.
+
+    Isochronous payloads are scheduled against a timeline, unlike ACL
+    traffic. SDU k of a stream belongs to one ISO event. It has to reach
+    the controller before that event's anchor, less the controller's
+    lead time. Until the flush timeout expires it can still go out, but
+    with fewer retransmission opportunities. After that the controller
+    drops it. When LE Audio shares the best-effort path, an SDU that
+    queues behind ACL bulk traffic or a slow producer wake-up misses its
+    event. The sink hears that as a gap.
+
+    Each stream's parameters map onto a timeline of release times, one
+    per SDU interval (MultiDeviceBTIsoTimeline.c). Each release sits
+    ScheduleMarginUs ahead of the controller deadline of the SDU's
+    event. The producer pre-fills a
+    lock-free ring (the audio lane's SPSC ring). One real-time thread
+    per device sleeps on a high resolution one-shot timer until the
+    earliest release across all streams, then sends each due SDU. Every
+    slot is classified as on time, late, flushed or missed.
+
+    The controller owns the real anchor points and reports them when the
+    CIS or BIG is established. No HCI ISO path is wired up yet, so a
+    timeline anchors itself when its prefill is reached.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+// Same band as the audio lanes
+#define ISO_THREAD_PRIORITY         (LOW_REALTIME_PRIORITY + 8)
+
+static EXT_CALLBACK IsoTimerCallback;
+static KSTART_ROUTINE IsoSchedulerThread;
+
+/*++
+Routine Description:
+    Releases every slot of the stream that is due
+
+Return Value:
+    Release time of the next slot, or MAXLONGLONG while the stream
+    waits for its prefill
+--*/
+static LONGLONG
+IsoStreamService(
+    _Inout_ PISO_STREAM Stream,
+    _In_ LONGLONG Now
+)
+{
+    ISO_SLOT_ACTION action;
+    ULONG64 event;
+    LONGLONG next;
+
+    for (;;) {
+        action = IsoTimelineStep(&Stream->Timeline, Now,
+            AudioRingDepth(&Stream->Ring), &event, &next);
+
+        switch (action) {
+        case IsoSlotIdle:
+            return next;
+
+        case IsoSlotSend:
+            if (Stream->Sink != NULL) {
+                Stream->Sink(Stream, AudioRingPeek(&Stream->Ring), event);
+            }
+            AudioRingRelease(&Stream->Ring);
+            break;
+
+        case IsoSlotFlush:
+            AudioRingRelease(&Stream->Ring);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+static VOID
+IsoTimerCallback(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context
+)
+{
+    PISO_SCHEDULER scheduler = (PISO_SCHEDULER)Context;
+
+    UNREFERENCED_PARAMETER(Timer);
+
+    if (scheduler != NULL) {
+        KeSetEvent(&scheduler->TickEvent, IO_SOUND_INCREMENT, FALSE);
+    }
+}
+
+/*++
+Routine Description:
+    Scheduler thread. Services every stream, then arms the one-shot
+    timer for the earliest next release, so it wakes once per distinct
+    release time rather than on a fixed tick.
+
+Arguments:
+    StartContext - The scheduler
+
+Return Value:
+    None
+--*/
+static VOID
+IsoSchedulerThread(
+    _In_ PVOID StartContext
+)
+{
+    PISO_SCHEDULER scheduler = (PISO_SCHEDULER)StartContext;
+    PVOID waitObjects[2];
+    NTSTATUS status;
+
+    KeSetPriorityThread(KeGetCurrentThread(), ISO_THREAD_PRIORITY);
+
+    waitObjects[0] = &scheduler->TickEvent;
+    waitObjects[1] = &scheduler->StopEvent;
+
+    for (;;) {
+        LONGLONG now = KeQueryPerformanceCounter(NULL).QuadPart;
+        LONGLONG next = MAXLONGLONG;
+        ULONG i;
+
+        for (i = 0; i < ISO_MAX_STREAMS; i++) {
+            PISO_STREAM_SLOT slot = &scheduler->Slots[i];
+
+            if (!ExAcquireRundownProtection(&slot->Rundown)) {
+                continue;
+            }
+
+            if (slot->Stream != NULL) {
+                LONGLONG release = IsoStreamService(slot->Stream, now);
+
+                next = min(next, release);
+            }
+
+            ExReleaseRundownProtection(&slot->Rundown);
+        }
+
+        if (next != MAXLONGLONG) {
+            LONGLONG dueTicks = next - KeQueryPerformanceCounter(NULL).QuadPart;
+            LONGLONG dueHns = (dueTicks > 0) ? (dueTicks * 10000000) / scheduler->FrequencyHz : 0;
+
+            ExSetTimer(scheduler->Timer, -max(dueHns, 1), 0, NULL);
+        }
+
+        status = KeWaitForMultipleObjects(2, waitObjects, WaitAny,
+            Executive, KernelMode, FALSE, NULL, NULL);
+
+        if (status != STATUS_WAIT_0 || scheduler->Stopping) {
+            break;
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/*++
+Routine Description:
+    Creates the scheduler thread and timer. Caller holds the scheduler lock.
+--*/
+static NTSTATUS
+IsoSchedulerStart(
+    _Inout_ PISO_SCHEDULER Scheduler
+)
+{
+    NTSTATUS status;
+    HANDLE threadHandle;
+
+    // An earlier start lost its thread reference; that thread has been
+    // told to stop and the scheduler cannot be restarted
+    if (Scheduler->Stopping) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    Scheduler->Timer = ExAllocateTimer(IsoTimerCallback, Scheduler, EX_TIMER_HIGH_RESOLUTION);
+    if (Scheduler->Timer == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL,
+        NULL, NULL, IsoSchedulerThread, Scheduler);
+    if (!NT_SUCCESS(status)) {
+        ExDeleteTimer(Scheduler->Timer, TRUE, FALSE, NULL);
+        Scheduler->Timer = NULL;
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, *PsThreadType,
+        KernelMode, (PVOID*)&Scheduler->Thread, NULL);
+    ZwClose(threadHandle);
+
+    if (!NT_SUCCESS(status)) {
+        // Without a reference we cannot wait for exit. No stream exists
+        // yet, so the thread never arms the timer; it sees the stop
+        // event on its first wait. The scheduler lives in the device
+        // context, which outlasts that.
+        InterlockedExchange(&Scheduler->Stopping, 1);
+        KeSetEvent(&Scheduler->StopEvent, IO_NO_INCREMENT, FALSE);
+        ExDeleteTimer(Scheduler->Timer, TRUE, TRUE, NULL);
+        Scheduler->Timer = NULL;
+        Scheduler->Thread = NULL;
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Initializes the device's isochronous scheduler; the thread starts
+    with the first stream
+--*/
+VOID
+IsoSchedulerInitialize(
+    _Out_ PISO_SCHEDULER Scheduler
+)
+{
+    LARGE_INTEGER frequency;
+    ULONG i;
+
+    RtlZeroMemory(Scheduler, sizeof(*Scheduler));
+    ExInitializePushLock(&Scheduler->Lock);
+    KeInitializeEvent(&Scheduler->TickEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&Scheduler->StopEvent, NotificationEvent, FALSE);
+
+    KeQueryPerformanceCounter(&frequency);
+    Scheduler->FrequencyHz = frequency.QuadPart;
+
+    for (i = 0; i < ISO_MAX_STREAMS; i++) {
+        ExInitializeRundownProtection(&Scheduler->Slots[i].Rundown);
+    }
+}
+
+/*++
+Routine Description:
+    Runs down and frees one slot's stream. Caller holds the scheduler lock.
+--*/
+static VOID
+IsoStreamSlotTeardown(
+    _Inout_ PISO_STREAM_SLOT Slot
+)
+{
+    PISO_STREAM stream = Slot->Stream;
+
+    if (stream == NULL) {
+        return;
+    }
+
+    ExWaitForRundownProtectionRelease(&Slot->Rundown);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: ISO stream %u destroyed (slots %u, on time %u, late %u, flushed %u, missed %u)\n",
+        stream->StreamId, stream->Timeline.Stats.Slots, stream->Timeline.Stats.SdusOnTime,
+        stream->Timeline.Stats.SdusLate, stream->Timeline.Stats.SdusFlushed,
+        stream->Timeline.Stats.SdusMissed));
+
+    ExFreePoolWithTag(stream, ISO_POOL_TAG);
+    Slot->Stream = NULL;
+
+    ExReInitializeRundownProtection(&Slot->Rundown);
+}
+
+/*++
+Routine Description:
+    Destroys every stream and stops the thread; called from device cleanup
+--*/
+VOID
+IsoSchedulerCleanup(
+    _Inout_ PISO_SCHEDULER Scheduler
+)
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Scheduler->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    for (i = 0; i < ISO_MAX_STREAMS; i++) {
+        IsoStreamSlotTeardown(&Scheduler->Slots[i]);
+    }
+
+    // Stop the thread first: it is the only one that arms the timer
+    if (Scheduler->Thread != NULL) {
+        InterlockedExchange(&Scheduler->Stopping, 1);
+        KeSetEvent(&Scheduler->StopEvent, IO_NO_INCREMENT, FALSE);
+
+        KeWaitForSingleObject(Scheduler->Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(Scheduler->Thread);
+        Scheduler->Thread = NULL;
+    }
+
+    if (Scheduler->Timer != NULL) {
+        ExDeleteTimer(Scheduler->Timer, TRUE, TRUE, NULL);
+        Scheduler->Timer = NULL;
+    }
+
+    ExReleasePushLockExclusiveEx(&Scheduler->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_ISO_STREAM_CREATE
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    OutputBufferLength - Length of output buffer
+    BytesReturned - Receives the stream identifier size
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleIsoStreamCreate(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PISO_STREAM_CONFIG config;
+    PULONG streamId;
+    PISO_SCHEDULER scheduler = &DeviceContext->Iso;
+    PISO_STREAM stream;
+    ISO_STREAM_CONFIG params;
+    ISO_TIMELINE timeline;
+    ULONG ringSdus, i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(ISO_STREAM_CONFIG), (PVOID*)&config, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Input and output share the system buffer
+    params = *config;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(ULONG), (PVOID*)&streamId, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (params.MaxSdu == 0 || params.MaxSdu > AUDIO_FRAME_MAX_BYTES ||
+        params.RingSdus < AUDIO_RING_MIN_FRAMES || params.RingSdus > AUDIO_RING_MAX_FRAMES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = IsoTimelineInitialize(&timeline, &params, scheduler->FrequencyHz);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    params.ScheduleMarginUs = timeline.MarginUs;
+
+    ringSdus = AUDIO_RING_MIN_FRAMES;
+    while (ringSdus < params.RingSdus) {
+        ringSdus <<= 1;
+    }
+
+    if (params.PrefillSdus >= ringSdus) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    params.RingSdus = ringSdus;
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&scheduler->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    for (i = 0; i < ISO_MAX_STREAMS; i++) {
+        if (scheduler->Slots[i].Stream == NULL) {
+            break;
+        }
+    }
+
+    if (i == ISO_MAX_STREAMS) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    if (scheduler->Thread == NULL) {
+        status = IsoSchedulerStart(scheduler);
+        if (!NT_SUCCESS(status)) {
+            goto Exit;
+        }
+    }
+
+    // Stream and SDU ring in one non-paged block
+    stream = (PISO_STREAM)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        sizeof(ISO_STREAM) + (SIZE_T)ringSdus * sizeof(AUDIO_FRAME), ISO_POOL_TAG);
+    if (stream == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    stream->Ring.Mask = ringSdus - 1;
+    stream->Ring.Frames = (PAUDIO_FRAME)(stream + 1);
+    stream->StreamId = i;
+    stream->Config = params;
+    stream->Scheduler = scheduler;
+    stream->Timeline = timeline;
+    stream->Timeline.Stats.StreamId = i;
+
+    scheduler->Slots[i].Stream = stream;
+    *streamId = i;
+    *BytesReturned = sizeof(ULONG);
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: ISO %s stream %u for %llx: SDU %u us, ISO %u us, %s, FT %u, %u SDUs (prefill %u), latency %u us\n",
+        (params.Type == IsoStreamCis) ? "CIS" : "BIS", i, params.DeviceAddress,
+        params.SduIntervalUs, timeline.IsoIntervalUs, params.Framed ? "framed" : "unframed",
+        timeline.FlushTimeout, ringSdus, params.PrefillSdus, timeline.Stats.PresentationLatencyUs));
+
+Exit:
+    ExReleasePushLockExclusiveEx(&scheduler->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_ISO_STREAM_DESTROY; input is the stream identifier
+--*/
+NTSTATUS
+HandleIsoStreamDestroy(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PULONG streamId;
+    PISO_SCHEDULER scheduler = &DeviceContext->Iso;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(ULONG), (PVOID*)&streamId, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (*streamId >= ISO_MAX_STREAMS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&scheduler->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    if (scheduler->Slots[*streamId].Stream == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else {
+        IsoStreamSlotTeardown(&scheduler->Slots[*streamId]);
+    }
+
+    ExReleasePushLockExclusiveEx(&scheduler->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+    return status;
+}
+
+/*++
+Routine Description:
+    Queues one SDU. Never blocks; a concurrent producer or a full ring
+    is turned away. Wakes the scheduler when this SDU completes the
+    prefill of a stream whose timeline has not started.
+
+Arguments:
+    Stream - Target stream
+    Data - SDU
+    Length - SDU length in bytes, at most the stream's MaxSdu
+    Timestamp - Producer timestamp
+
+Return Value:
+    STATUS_SUCCESS, STATUS_DEVICE_BUSY or STATUS_INVALID_BUFFER_SIZE
+--*/
+NTSTATUS
+IsoStreamSubmit(
+    _Inout_ PISO_STREAM Stream,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length,
+    _In_ LONGLONG Timestamp
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (Length == 0 || Length > Stream->Config.MaxSdu) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    if (InterlockedCompareExchange(&Stream->ProducerBusy, 1, 0) != 0) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    if (AudioRingPush(&Stream->Ring, Data, Length, Stream->Timeline.Stats.SdusSubmitted, Timestamp)) {
+        Stream->Timeline.Stats.SdusSubmitted++;
+
+        if (!Stream->Timeline.Anchored &&
+            AudioRingDepth(&Stream->Ring) >= max(Stream->Timeline.PrefillSdus, 1)) {
+            KeSetEvent(&Stream->Scheduler->TickEvent, IO_SOUND_INCREMENT, FALSE);
+        }
+    } else {
+        Stream->Timeline.Stats.Overruns++;
+        status = STATUS_DEVICE_BUSY;
+    }
+
+    InterlockedExchange(&Stream->ProducerBusy, 0);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_ISO_SUBMIT: ISO_SUBMIT_HEADER followed by the
+    SDU. Takes only the slot's rundown reference.
+--*/
+NTSTATUS
+HandleIsoSubmit(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PISO_SUBMIT_HEADER header;
+    PISO_STREAM_SLOT slot;
+    size_t length;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(ISO_SUBMIT_HEADER), (PVOID*)&header, &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (header->StreamId >= ISO_MAX_STREAMS ||
+        header->Length > length - sizeof(ISO_SUBMIT_HEADER)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    slot = &DeviceContext->Iso.Slots[header->StreamId];
+
+    if (!ExAcquireRundownProtection(&slot->Rundown)) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (slot->Stream == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else {
+        status = IsoStreamSubmit(slot->Stream, header + 1, header->Length, header->Timestamp);
+    }
+
+    ExReleaseRundownProtection(&slot->Rundown);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_ISO_STREAM_STATS; input is the stream identifier
+--*/
+NTSTATUS
+HandleIsoStreamStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PULONG streamId;
+    PISO_STREAM_STATS stats;
+    PISO_STREAM_SLOT slot;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(ULONG), (PVOID*)&streamId, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (*streamId >= ISO_MAX_STREAMS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    slot = &DeviceContext->Iso.Slots[*streamId];
+
+    // Read the stream id before retrieving the output buffer; for
+    // METHOD_BUFFERED they share storage
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(ISO_STREAM_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (!ExAcquireRundownProtection(&slot->Rundown)) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (slot->Stream == NULL) {
+        status = STATUS_NOT_FOUND;
+    } else {
+        *stats = slot->Stream->Timeline.Stats;
+        *BytesReturned = sizeof(ISO_STREAM_STATS);
+    }
+
+    ExReleaseRundownProtection(&slot->Rundown);
+    return status;
+}
@@ -0,0 +1,91 @@
+/*++
+
+Module Name:
+    MultiDeviceBTIso.h
+
+Abstract:
+    LE Audio isochronous scheduling. Each connected (CIS) or broadcast
+    (BIS) isochronous stream gets a timeline. The timeline is derived
+    from its SDU interval, ISO interval, flush timeout (or retransmission
+    number) and presentation delay. One real-time scheduler thread per
+    device feeds every stream's SDUs from a pre-filled ring exactly at
+    their release times. The timeline itself is the portable
+    MultiDeviceBTIsoTimeline.h.
+
+--*/
+
+#ifndef _MULTIDEVICEBTISO_H_
+#define _MULTIDEVICEBTISO_H_
+
+#include "MultiDeviceBTIsoTimeline.h"
+
+#define ISO_MAX_STREAMS             4       // Two CIS per CIG, or a stereo BIG, per sink pair
+#define ISO_POOL_TAG                'IDBM'
+
+// SDU submission header (IOCTL_MULTI_BT_ISO_SUBMIT), followed by the SDU
+typedef struct _ISO_SUBMIT_HEADER {
+    ULONG StreamId;
+    ULONG Length;
+    LONGLONG Timestamp;         // Producer timestamp, 100 ns units
+} ISO_SUBMIT_HEADER, *PISO_SUBMIT_HEADER;
+
+struct _ISO_STREAM;
+
+// Transmit hook, called on the scheduler thread for each released SDU
+typedef VOID
+ISO_STREAM_SINK(
+    _In_ struct _ISO_STREAM* Stream,
+    _In_ PAUDIO_FRAME Sdu,
+    _In_ ULONG64 EventCounter
+);
+typedef ISO_STREAM_SINK *PISO_STREAM_SINK;
+
+typedef struct _ISO_STREAM {
+    AUDIO_SPSC_RING Ring;
+    DECLSPEC_CACHEALIGN volatile LONG ProducerBusy;
+    ULONG StreamId;
+    ISO_STREAM_CONFIG Config;
+    PISO_STREAM_SINK Sink;
+    PVOID SinkContext;
+    struct _ISO_SCHEDULER* Scheduler;
+
+    // Touched only by the scheduler thread once Timeline.Anchored is set
+    DECLSPEC_CACHEALIGN ISO_TIMELINE Timeline;
+} ISO_STREAM, *PISO_STREAM;
+
+typedef struct _ISO_STREAM_SLOT {
+    EX_RUNDOWN_REF Rundown;
+    PISO_STREAM Stream;
+} ISO_STREAM_SLOT, *PISO_STREAM_SLOT;
+
+// One scheduler per device. Create/destroy serialize on Lock, a push
+// lock held at PASSIVE_LEVEL since creation may start the thread; the
+// thread and submitters hold a slot's rundown reference while using
+// its stream. The thread starts with the first stream.
+typedef struct _ISO_SCHEDULER {
+    EX_PUSH_LOCK Lock;
+    ISO_STREAM_SLOT Slots[ISO_MAX_STREAMS];
+    PEX_TIMER Timer;
+    KEVENT TickEvent;           // Timer expiry, new stream, or prefill reached
+    KEVENT StopEvent;
+    PKTHREAD Thread;
+    volatile LONG Stopping;
+    LONGLONG FrequencyHz;
+} ISO_SCHEDULER, *PISO_SCHEDULER;
+
+VOID IsoSchedulerInitialize(
+    _Out_ PISO_SCHEDULER Scheduler
+);
+
+VOID IsoSchedulerCleanup(
+    _Inout_ PISO_SCHEDULER Scheduler
+);
+
+NTSTATUS IsoStreamSubmit(
+    _Inout_ PISO_STREAM Stream,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length,
+    _In_ LONGLONG Timestamp
+);
+
+#endif // _MULTIDEVICEBTISO_H_
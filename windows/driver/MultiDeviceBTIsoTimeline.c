@@ -0,0 +1,268 @@
+/*++
+
+Module Name:
+    MultiDeviceBTIsoTimeline.c
+
+Abstract:
+    Release timeline of one LE Audio isochronous stream.
+
+    SDU k of a stream belongs to one ISO event. It has to reach the
+    controller before that event's anchor, less the controller's lead
+    time. Until the flush timeout expires it can still go out, but with
+    fewer retransmission opportunities. After that the controller drops
+    it.
+
+    Release times fall one per SDU interval. Each sits the schedule
+    margin ahead of the controller deadline of the SDU's event, which
+    absorbs the wake-up latency of whoever services the timeline. The
+    caller owns the SDU ring: each step reports the ring depth and gets
+    back what to do with the ring head.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTIsoTimeline.h"
+
+static LONGLONG
+IsoUsToTicks(
+    _In_ LONGLONG FrequencyHz,
+    _In_ ULONG64 Us
+)
+{
+    // Split so long timelines cannot overflow Us * FrequencyHz
+    return (LONGLONG)(Us / 1000000) * FrequencyHz +
+        (LONGLONG)((Us % 1000000) * (ULONG64)FrequencyHz / 1000000);
+}
+
+// ISO event that carries SDU Sdu
+static ULONG64
+IsoEventOfSdu(
+    _In_ const ISO_TIMELINE* Timeline,
+    _In_ ULONG64 Sdu
+)
+{
+    if (!Timeline->Framed) {
+        return Sdu / Timeline->SdusPerEvent;
+    }
+
+    // Framed: segmented into the first event whose deadline follows release
+    return (Sdu * Timeline->SduIntervalUs + Timeline->IsoIntervalUs - 1) / Timeline->IsoIntervalUs;
+}
+
+/*++
+Routine Description:
+    Validates the timing parameters and derives the timeline constants
+
+Arguments:
+    Timeline - Timeline to initialize
+    Config - Negotiated stream parameters
+    FrequencyHz - Ticks per second of the clock passed to the other calls
+
+Return Value:
+    STATUS_SUCCESS or STATUS_INVALID_PARAMETER
+--*/
+NTSTATUS
+IsoTimelineInitialize(
+    _Out_ PISO_TIMELINE Timeline,
+    _In_ const ISO_STREAM_CONFIG* Config,
+    _In_ LONGLONG FrequencyHz
+)
+{
+    ULONG isoIntervalUs = (ULONG)Config->IsoInterval * ISO_INTERVAL_UNIT_US;
+    ULONG sdusPerEvent = 1;
+    ULONG flushTimeout = Config->FlushTimeout;
+
+    if (Config->SduIntervalUs < ISO_SDU_INTERVAL_MIN_US ||
+        Config->SduIntervalUs > ISO_SDU_INTERVAL_MAX_US ||
+        Config->IsoInterval < ISO_INTERVAL_MIN || Config->IsoInterval > ISO_INTERVAL_MAX ||
+        Config->BurstNumber == 0 || Config->BurstNumber > 15 ||
+        Config->Type > IsoStreamBis || FrequencyHz <= 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!Config->Framed) {
+        // Unframed: each event carries a whole number of SDUs, one per payload
+        if ((isoIntervalUs % Config->SduIntervalUs) != 0 ||
+            isoIntervalUs / Config->SduIntervalUs > Config->BurstNumber) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        sdusPerEvent = isoIntervalUs / Config->SduIntervalUs;
+    }
+
+    if (flushTimeout == 0) {
+        // Before the controller reports FT, assume each retransmission a
+        // CIS asks for needs an event of its own. BIS repetitions stay
+        // inside one event.
+        flushTimeout = (Config->Type == IsoStreamCis) ?
+            min((ULONG)Config->RetransmissionNumber + 1, 255) : 1;
+    }
+
+    RtlZeroMemory(Timeline, sizeof(*Timeline));
+
+    Timeline->Framed = Config->Framed ? TRUE : FALSE;
+    Timeline->SduIntervalUs = Config->SduIntervalUs;
+    Timeline->SdusPerEvent = sdusPerEvent;
+    Timeline->IsoIntervalUs = isoIntervalUs;
+    Timeline->FlushTimeout = flushTimeout;
+    Timeline->MarginUs = (Config->ScheduleMarginUs != 0) ?
+        Config->ScheduleMarginUs : ISO_DEFAULT_MARGIN_US;
+    Timeline->PrefillSdus = Config->PrefillSdus;
+    Timeline->FrequencyHz = FrequencyHz;
+
+    Timeline->Stats.FlushTimeout = flushTimeout;
+    Timeline->Stats.PresentationLatencyUs = Timeline->MarginUs + ISO_CONTROLLER_LEAD_US +
+        (Timeline->Framed ? isoIntervalUs : (sdusPerEvent - 1) * Config->SduIntervalUs) +
+        Config->SyncDelayUs + Config->PresentationDelayUs;
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Starts the timeline: SDU 0 is released now. The anchor of event 0
+    follows by the margin plus the controller lead. For unframed streams
+    it also waits for the event's remaining SDU intervals, so every SDU
+    of an event is released before that event's deadline.
+--*/
+VOID
+IsoTimelineAnchor(
+    _Inout_ PISO_TIMELINE Timeline,
+    _In_ LONGLONG Now
+)
+{
+    ULONG64 aheadUs = (ULONG64)Timeline->MarginUs + ISO_CONTROLLER_LEAD_US;
+
+    if (!Timeline->Framed) {
+        aheadUs += (ULONG64)(Timeline->SdusPerEvent - 1) * Timeline->SduIntervalUs;
+    }
+
+    Timeline->StartTicks = Now;
+    Timeline->AnchorTicks = Now + IsoUsToTicks(Timeline->FrequencyHz, aheadUs);
+    Timeline->LeadTicks = IsoUsToTicks(Timeline->FrequencyHz, ISO_CONTROLLER_LEAD_US);
+    Timeline->NextSdu = 0;
+    Timeline->Started = TRUE;
+    Timeline->Anchored = TRUE;
+}
+
+/*++
+Routine Description:
+    Latest time the controller can take SDU Sdu, counting Events ISO
+    events from the one that carries it
+--*/
+LONGLONG
+IsoTimelineDeadline(
+    _In_ const ISO_TIMELINE* Timeline,
+    _In_ ULONG64 Sdu,
+    _In_ ULONG Events
+)
+{
+    ULONG64 event = IsoEventOfSdu(Timeline, Sdu) + Events - 1;
+
+    return Timeline->AnchorTicks - Timeline->LeadTicks +
+        IsoUsToTicks(Timeline->FrequencyHz, event * Timeline->IsoIntervalUs);
+}
+
+/*++
+Routine Description:
+    Handles the next release slot if it is due: decides what happens to
+    the ring head and classifies the slot. Anchors the timeline once the
+    ring holds the prefill.
+
+Arguments:
+    Timeline - Stream's timeline
+    Now - Current time, in the timeline's ticks
+    Depth - SDUs in the ring
+    Event - Receives the ISO event for IsoSlotSend
+    NextRelease - Receives the next release time for IsoSlotIdle, or
+        MAXLONGLONG while the timeline waits for its prefill
+
+Return Value:
+    ISO_SLOT_ACTION
+--*/
+ISO_SLOT_ACTION
+IsoTimelineStep(
+    _Inout_ PISO_TIMELINE Timeline,
+    _In_ LONGLONG Now,
+    _In_ ULONG Depth,
+    _Out_ PULONG64 Event,
+    _Out_ PLONGLONG NextRelease
+)
+{
+    PISO_STREAM_STATS stats = &Timeline->Stats;
+    ULONG64 sdu = Timeline->NextSdu;
+    ISO_SLOT_ACTION action;
+    LONGLONG release;
+    ULONG lateUs;
+
+    *Event = 0;
+    *NextRelease = MAXLONGLONG;
+
+    if (!Timeline->Anchored) {
+        if (Depth < max(Timeline->PrefillSdus, 1)) {
+            return IsoSlotIdle;
+        }
+        IsoTimelineAnchor(Timeline, Now);
+    }
+
+    release = Timeline->StartTicks +
+        IsoUsToTicks(Timeline->FrequencyHz, sdu * Timeline->SduIntervalUs);
+    if (release > Now) {
+        *NextRelease = release;
+        return IsoSlotIdle;
+    }
+
+    Timeline->NextSdu++;
+
+    lateUs = (ULONG)min(((Now - release) * 1000000) / Timeline->FrequencyHz, MAXULONG);
+    stats->Slots++;
+    stats->LatenessMaxUs = max(stats->LatenessMaxUs, lateUs);
+    Timeline->LatenessSumUs += lateUs;
+    stats->LatenessAvgUs = (ULONG)(Timeline->LatenessSumUs / stats->Slots);
+
+    if (!Timeline->Started) {
+        if (Depth < Timeline->PrefillSdus) {
+            stats->SdusMissed++;
+            action = IsoSlotMissed;
+            goto Exit;
+        }
+        Timeline->Started = TRUE;
+    }
+
+    if (Depth == 0) {
+        // Starved: keep the controller's timeline, rebuild the cushion
+        stats->Underruns++;
+        stats->SdusMissed++;
+        Timeline->Started = (Timeline->PrefillSdus == 0);
+        action = IsoSlotMissed;
+        goto Exit;
+    }
+
+    if (Now > IsoTimelineDeadline(Timeline, sdu, Timeline->FlushTimeout)) {
+        stats->SdusFlushed++;
+        action = IsoSlotFlush;
+    } else {
+        if (Now <= IsoTimelineDeadline(Timeline, sdu, 1)) {
+            stats->SdusOnTime++;
+        } else {
+            stats->SdusLate++;
+        }
+        *Event = IsoEventOfSdu(Timeline, sdu);
+        action = IsoSlotSend;
+    }
+
+Exit:
+    stats->OnTimePermille = (ULONG)(((ULONG64)stats->SdusOnTime * 1000) / stats->Slots);
+    return action;
+}
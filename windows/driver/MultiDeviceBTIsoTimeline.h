@@ -0,0 +1,134 @@
+/*++
+
+Module Name:
+    MultiDeviceBTIsoTimeline.h
+
+Abstract:
+    Release timeline of one LE Audio isochronous stream. The stream's SDU
+    interval, ISO interval, flush timeout and schedule margin give every
+    SDU a release time and the controller deadline of the ISO event that
+    carries it. Each release slot is classified as on time, late,
+    flushed or missed.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the clock, the SDU ring and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTISOTIMELINE_H_
+#define _MULTIDEVICEBTISOTIMELINE_H_
+
+#define ISO_SDU_INTERVAL_MIN_US     0xFF
+#define ISO_SDU_INTERVAL_MAX_US     0xFFFFF
+#define ISO_INTERVAL_MIN            4       // 1.25 ms units: 5 ms
+#define ISO_INTERVAL_MAX            3200    // 4 s
+#define ISO_INTERVAL_UNIT_US        1250
+#define ISO_CONTROLLER_LEAD_US      1000    // An SDU must reach the controller this long before its anchor
+#define ISO_DEFAULT_MARGIN_US       2000    // Release this much earlier again, for wake-up latency
+
+typedef enum _ISO_STREAM_TYPE {
+    IsoStreamCis = 0,
+    IsoStreamBis = 1
+} ISO_STREAM_TYPE;
+
+// Stream parameters (IOCTL_MULTI_BT_ISO_STREAM_CREATE), as negotiated in
+// the CIG/BIG configuration
+typedef struct _ISO_STREAM_CONFIG {
+    BTH_ADDR DeviceAddress;
+    USHORT Handle;              // CIS or BIS connection handle
+    UCHAR Type;                 // ISO_STREAM_TYPE
+    UCHAR Framed;               // FALSE: unframed, SDU interval divides the ISO interval
+    ULONG SduIntervalUs;
+    USHORT IsoInterval;         // 1.25 ms units
+    USHORT MaxSdu;              // <= AUDIO_FRAME_MAX_BYTES
+    UCHAR BurstNumber;
+    UCHAR FlushTimeout;         // ISO events; 0 derives it from RetransmissionNumber
+    UCHAR RetransmissionNumber;
+    UCHAR Reserved;
+    ULONG SyncDelayUs;          // CIG/BIG sync delay reported by the controller
+    ULONG PresentationDelayUs;
+    ULONG ScheduleMarginUs;     // 0 selects ISO_DEFAULT_MARGIN_US
+    ULONG RingSdus;             // Rounded up to a power of two
+    ULONG PrefillSdus;          // SDUs buffered before the timeline starts
+} ISO_STREAM_CONFIG, *PISO_STREAM_CONFIG;
+
+// Stream counters (IOCTL_MULTI_BT_ISO_STREAM_STATS). Every SDU interval
+// after the timeline starts is one slot. A slot ends as exactly one of:
+// on time, late, flushed or missed. The caller fills StreamId,
+// SdusSubmitted and Overruns.
+typedef struct _ISO_STREAM_STATS {
+    ULONG StreamId;
+    ULONG SdusSubmitted;
+    ULONG Overruns;             // Ring full on submit
+    ULONG Slots;
+    ULONG SdusOnTime;           // Released before the controller deadline of its event
+    ULONG SdusLate;             // After it, but inside the flush timeout
+    ULONG SdusFlushed;          // Past the flush point; dropped unsent
+    ULONG SdusMissed;           // Ring empty at release
+    ULONG Underruns;            // Times the ring ran dry
+    ULONG OnTimePermille;       // SdusOnTime per 1000 slots
+    ULONG FlushTimeout;         // Effective, in ISO events
+    ULONG PresentationLatencyUs;// Release to presentation, worst case SDU
+    ULONG LatenessMaxUs;        // Release time to actual wake-up
+    ULONG LatenessAvgUs;
+} ISO_STREAM_STATS, *PISO_STREAM_STATS;
+
+// What the caller does with the ring head for one slot
+typedef enum _ISO_SLOT_ACTION {
+    IsoSlotIdle = 0,            // Nothing due before NextRelease
+    IsoSlotSend = 1,            // Send the head in Event, then consume it
+    IsoSlotFlush = 2,           // Consume the head unsent
+    IsoSlotMissed = 3           // Ring empty or still prefilling; consume nothing
+} ISO_SLOT_ACTION;
+
+typedef struct _ISO_TIMELINE {
+    volatile BOOLEAN Anchored;  // Read by the producer before the timeline starts
+    BOOLEAN Started;            // Prefill reached since the last underrun
+    BOOLEAN Framed;
+    ULONG SduIntervalUs;
+    ULONG SdusPerEvent;         // Unframed only
+    ULONG IsoIntervalUs;
+    ULONG FlushTimeout;
+    ULONG MarginUs;
+    ULONG PrefillSdus;
+    LONGLONG FrequencyHz;       // Clock the caller passes as Now
+    ULONG64 NextSdu;
+    LONGLONG StartTicks;        // Release time of SDU 0
+    LONGLONG AnchorTicks;       // Anchor of ISO event 0
+    LONGLONG LeadTicks;         // ISO_CONTROLLER_LEAD_US
+    ULONG64 LatenessSumUs;
+    ISO_STREAM_STATS Stats;
+} ISO_TIMELINE, *PISO_TIMELINE;
+
+// Validates the timing fields of Config (not MaxSdu or the ring, which
+// belong to the caller) and derives the timeline. Fails with
+// STATUS_INVALID_PARAMETER.
+NTSTATUS IsoTimelineInitialize(
+    _Out_ PISO_TIMELINE Timeline,
+    _In_ const ISO_STREAM_CONFIG* Config,
+    _In_ LONGLONG FrequencyHz
+);
+
+VOID IsoTimelineAnchor(
+    _Inout_ PISO_TIMELINE Timeline,
+    _In_ LONGLONG Now
+);
+
+// Deadline of the ISO event that carries Sdu, offset by Events - 1 more
+// events: 1 is the on-time deadline, FlushTimeout the flush point
+LONGLONG IsoTimelineDeadline(
+    _In_ const ISO_TIMELINE* Timeline,
+    _In_ ULONG64 Sdu,
+    _In_ ULONG Events
+);
+
+// Call until it returns IsoSlotIdle; Depth is the ring's current depth
+ISO_SLOT_ACTION IsoTimelineStep(
+    _Inout_ PISO_TIMELINE Timeline,
+    _In_ LONGLONG Now,
+    _In_ ULONG Depth,
+    _Out_ PULONG64 Event,
+    _Out_ PLONGLONG NextRelease
+);
+
+#endif // _MULTIDEVICEBTISOTIMELINE_H_
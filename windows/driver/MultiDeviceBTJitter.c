@@ -0,0 +1,448 @@
+/*++
+
+Module Name:
+    MultiDeviceBTJitter.c
+
+Abstract:
+    Adaptive jitter buffer for inbound audio (headset microphones) on
+    CRITICAL links. Each open stream wraps a JITTER_BUFFER
+    (MultiDeviceBTJitterBuffer.c) with a spin lock: the receive path
+    inserts frames and the optimized read path plays them out, one
+    frame period per read, round robin across streams.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+static PJITTER_STREAM
+JitterFindStream(
+    _In_ PJITTER_CONTEXT Jitter,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    ULONG i;
+
+    for (i = 0; i < JITTER_MAX_STREAMS; i++) {
+        if (Jitter->Streams[i].Active &&
+            Jitter->Streams[i].Config.DeviceAddress == DeviceAddress) {
+            return &Jitter->Streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*++
+Routine Description:
+    Initializes the per-device jitter buffers (all closed)
+--*/
+VOID
+JitterInitialize(
+    _Out_ PJITTER_CONTEXT Jitter
+)
+{
+    ULONG i;
+
+    RtlZeroMemory(Jitter, sizeof(*Jitter));
+    ExInitializeFastMutex(&Jitter->ConfigMutex);
+
+    for (i = 0; i < JITTER_MAX_STREAMS; i++) {
+        KeInitializeSpinLock(&Jitter->Streams[i].Lock);
+    }
+}
+
+/*++
+Routine Description:
+    Opens a jitter buffer for a CRITICAL link's inbound audio
+
+Arguments:
+    Jitter - Jitter context
+    Config - Stream parameters
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+JitterOpenStream(
+    _Inout_ PJITTER_CONTEXT Jitter,
+    _In_ PJITTER_STREAM_CONFIG Config
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PJITTER_STREAM stream = NULL;
+    PJITTER_SLOT slots;
+    KIRQL oldIrql;
+    ULONG i;
+
+    PAGED_CODE();
+
+    slots = (PJITTER_SLOT)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        JITTER_SLOTS * sizeof(JITTER_SLOT), JITTER_POOL_TAG);
+    if (slots == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExAcquireFastMutex(&Jitter->ConfigMutex);
+
+    if (JitterFindStream(Jitter, Config->DeviceAddress) != NULL) {
+        status = STATUS_OBJECT_NAME_COLLISION;
+        goto Exit;
+    }
+
+    for (i = 0; i < JITTER_MAX_STREAMS; i++) {
+        if (!Jitter->Streams[i].Active) {
+            stream = &Jitter->Streams[i];
+            break;
+        }
+    }
+
+    if (stream == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    KeAcquireSpinLock(&stream->Lock, &oldIrql);
+
+    status = JitterBufferInitialize(&stream->Buffer, Config->FrameDurationUs,
+        Config->MinDelayUs, Config->MaxDelayUs, slots);
+    if (NT_SUCCESS(status)) {
+        stream->Config = *Config;
+        stream->Buffer.Stats.DeviceAddress = Config->DeviceAddress;
+        stream->Active = TRUE;
+        slots = NULL;
+    }
+
+    KeReleaseSpinLock(&stream->Lock, oldIrql);
+
+    if (NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: Jitter buffer opened for %llx (%u us frames, %u-%u frames)\n",
+            Config->DeviceAddress, Config->FrameDurationUs,
+            stream->Buffer.MinFrames, stream->Buffer.MaxFrames));
+    }
+
+Exit:
+    ExReleaseFastMutex(&Jitter->ConfigMutex);
+
+    if (slots != NULL) {
+        ExFreePoolWithTag(slots, JITTER_POOL_TAG);
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Closes a device's jitter buffer and frees its slots
+
+Arguments:
+    Jitter - Jitter context
+    DeviceAddress - Stream source
+
+Return Value:
+    STATUS_NOT_FOUND if no stream is open for the address
+--*/
+NTSTATUS
+JitterCloseStream(
+    _Inout_ PJITTER_CONTEXT Jitter,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    PJITTER_STREAM stream;
+    PJITTER_SLOT slots = NULL;
+    KIRQL oldIrql;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Jitter->ConfigMutex);
+
+    stream = JitterFindStream(Jitter, DeviceAddress);
+    if (stream != NULL) {
+        // Inserters and readers check Active under the lock, so the
+        // slots are unreachable once it is cleared
+        KeAcquireSpinLock(&stream->Lock, &oldIrql);
+        stream->Active = FALSE;
+        slots = stream->Buffer.Slots;
+        stream->Buffer.Slots = NULL;
+        KeReleaseSpinLock(&stream->Lock, oldIrql);
+    }
+
+    ExReleaseFastMutex(&Jitter->ConfigMutex);
+
+    if (slots == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    ExFreePoolWithTag(slots, JITTER_POOL_TAG);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Closes every stream; called from device cleanup
+--*/
+VOID
+JitterCleanup(
+    _Inout_ PJITTER_CONTEXT Jitter
+)
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < JITTER_MAX_STREAMS; i++) {
+        if (Jitter->Streams[i].Active) {
+            JitterCloseStream(Jitter, Jitter->Streams[i].Config.DeviceAddress);
+        }
+    }
+}
+
+BOOLEAN
+JitterHasActiveStream(
+    _In_ PJITTER_CONTEXT Jitter
+)
+{
+    ULONG i;
+
+    for (i = 0; i < JITTER_MAX_STREAMS; i++) {
+        if (Jitter->Streams[i].Active) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*++
+Routine Description:
+    Accepts one inbound audio frame from the link's receive path
+
+Arguments:
+    Jitter - Jitter context
+    DeviceAddress - Source device
+    TimestampUs - Media timestamp carried by the packet
+    ArrivalUs - Local receive time (interrupt time, microseconds)
+    Data - Encoded frame
+    Length - Frame length
+
+Return Value:
+    STATUS_NOT_FOUND if no stream is open for the device,
+    STATUS_INVALID_BUFFER_SIZE if the frame is over JITTER_FRAME_MAX_BYTES
+--*/
+NTSTATUS
+JitterInsert(
+    _Inout_ PJITTER_CONTEXT Jitter,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ LONGLONG TimestampUs,
+    _In_ LONGLONG ArrivalUs,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length
+)
+{
+    NTSTATUS status;
+    PJITTER_STREAM stream;
+    KIRQL oldIrql;
+
+    stream = JitterFindStream(Jitter, DeviceAddress);
+    if (stream == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    KeAcquireSpinLock(&stream->Lock, &oldIrql);
+
+    if (!stream->Active || stream->Config.DeviceAddress != DeviceAddress) {
+        KeReleaseSpinLock(&stream->Lock, oldIrql);
+        return STATUS_NOT_FOUND;
+    }
+
+    status = JitterBufferInsert(&stream->Buffer, TimestampUs, ArrivalUs, Data, Length);
+
+    KeReleaseSpinLock(&stream->Lock, oldIrql);
+    return status;
+}
+
+/*++
+Routine Description:
+    Returns the next playout frame from the open streams, round robin.
+    The caller's buffer must hold a JITTER_PLAYOUT_HEADER plus
+    JITTER_FRAME_MAX_BYTES.
+
+Arguments:
+    Jitter - Jitter context
+    Buffer - Read buffer
+    BufferSize - Read buffer size
+    BytesWritten - Receives the header size plus the payload length
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+JitterPlayout(
+    _Inout_ PJITTER_CONTEXT Jitter,
+    _Out_writes_bytes_(BufferSize) PVOID Buffer,
+    _In_ size_t BufferSize,
+    _Out_ size_t* BytesWritten
+)
+{
+    PJITTER_PLAYOUT_HEADER header = (PJITTER_PLAYOUT_HEADER)Buffer;
+    KIRQL oldIrql;
+    ULONG start;
+    ULONG i;
+
+    *BytesWritten = 0;
+
+    if (BufferSize < sizeof(JITTER_PLAYOUT_HEADER) + JITTER_FRAME_MAX_BYTES) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    start = (ULONG)InterlockedIncrement(&Jitter->NextStream);
+
+    for (i = 0; i < JITTER_MAX_STREAMS; i++) {
+        PJITTER_STREAM stream = &Jitter->Streams[(start + i) % JITTER_MAX_STREAMS];
+
+        KeAcquireSpinLock(&stream->Lock, &oldIrql);
+
+        if (stream->Active) {
+            JitterBufferPlayout(&stream->Buffer, header, (PUCHAR)(header + 1));
+            header->DeviceAddress = stream->Config.DeviceAddress;
+            KeReleaseSpinLock(&stream->Lock, oldIrql);
+            *BytesWritten = sizeof(JITTER_PLAYOUT_HEADER) + header->Length;
+            return STATUS_SUCCESS;
+        }
+
+        KeReleaseSpinLock(&stream->Lock, oldIrql);
+    }
+
+    return STATUS_DEVICE_NOT_READY;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_JITTER_CONFIG: opens or closes a device's
+    inbound jitter buffer. Only CRITICAL links qualify.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    BytesReturned - Number of bytes returned
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleJitterConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PJITTER_STREAM_CONFIG config;
+    BOOLEAN critical = FALSE;
+    KIRQL oldIrql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(JITTER_STREAM_CONFIG), (PVOID*)&config, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (!config->Enable) {
+        return JitterCloseStream(&DeviceContext->Jitter, config->DeviceAddress);
+    }
+
+    KeAcquireSpinLock(&DeviceContext->DeviceListLock, &oldIrql);
+
+    for (i = 0; i < MAX_BLUETOOTH_CONNECTIONS; i++) {
+        if (DeviceContext->ConnectedDevices[i].IsConnected &&
+            DeviceContext->ConnectedDevices[i].DeviceAddress == config->DeviceAddress) {
+            critical = (DeviceContext->ConnectedDevices[i].ConnectionPriority == PRIORITY_CRITICAL);
+            break;
+        }
+    }
+
+    KeReleaseSpinLock(&DeviceContext->DeviceListLock, oldIrql);
+
+    if (!critical) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    return JitterOpenStream(&DeviceContext->Jitter, config);
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_JITTER_STATS; input is the device address
+--*/
+NTSTATUS
+HandleGetJitterStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBTH_ADDR address;
+    BTH_ADDR deviceAddress;
+    PJITTER_STREAM_STATS stats;
+    PJITTER_STREAM stream;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(BTH_ADDR), (PVOID*)&address, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Input and output share the system buffer
+    deviceAddress = *address;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(JITTER_STREAM_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    stream = JitterFindStream(&DeviceContext->Jitter, deviceAddress);
+    if (stream == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    KeAcquireSpinLock(&stream->Lock, &oldIrql);
+
+    if (!stream->Active || stream->Config.DeviceAddress != deviceAddress) {
+        KeReleaseSpinLock(&stream->Lock, oldIrql);
+        return STATUS_NOT_FOUND;
+    }
+
+    JitterBufferGetStats(&stream->Buffer, stats);
+
+    KeReleaseSpinLock(&stream->Lock, oldIrql);
+
+    *BytesReturned = sizeof(JITTER_STREAM_STATS);
+    return STATUS_SUCCESS;
+}
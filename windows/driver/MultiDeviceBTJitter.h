@@ -0,0 +1,81 @@
+/*++
+
+Module Name:
+    MultiDeviceBTJitter.h
+
+Abstract:
+    Adaptive jitter buffer for inbound audio on CRITICAL links. The
+    playout logic is in MultiDeviceBTJitterBuffer.c; this module owns
+    the streams, their locks and the IOCTLs.
+
+--*/
+
+#ifndef _MULTIDEVICEBTJITTER_H_
+#define _MULTIDEVICEBTJITTER_H_
+
+#include "MultiDeviceBTJitterBuffer.h"
+
+#define JITTER_MAX_STREAMS          2
+#define JITTER_POOL_TAG             'JDBM'
+
+// Stream setup (IOCTL_MULTI_BT_JITTER_CONFIG)
+typedef struct _JITTER_STREAM_CONFIG {
+    BTH_ADDR DeviceAddress;
+    BOOLEAN Enable;
+    ULONG FrameDurationUs;
+    ULONG MinDelayUs;
+    ULONG MaxDelayUs;
+} JITTER_STREAM_CONFIG, *PJITTER_STREAM_CONFIG;
+
+typedef struct _JITTER_STREAM {
+    KSPIN_LOCK Lock;
+    BOOLEAN Active;
+    JITTER_STREAM_CONFIG Config;
+    JITTER_BUFFER Buffer;       // Slots are non-paged
+} JITTER_STREAM, *PJITTER_STREAM;
+
+typedef struct _JITTER_CONTEXT {
+    FAST_MUTEX ConfigMutex;     // Serializes open/close
+    JITTER_STREAM Streams[JITTER_MAX_STREAMS];
+    volatile LONG NextStream;   // Round-robin cursor for reads
+} JITTER_CONTEXT, *PJITTER_CONTEXT;
+
+VOID JitterInitialize(
+    _Out_ PJITTER_CONTEXT Jitter
+);
+
+NTSTATUS JitterOpenStream(
+    _Inout_ PJITTER_CONTEXT Jitter,
+    _In_ PJITTER_STREAM_CONFIG Config
+);
+
+NTSTATUS JitterCloseStream(
+    _Inout_ PJITTER_CONTEXT Jitter,
+    _In_ BTH_ADDR DeviceAddress
+);
+
+VOID JitterCleanup(
+    _Inout_ PJITTER_CONTEXT Jitter
+);
+
+BOOLEAN JitterHasActiveStream(
+    _In_ PJITTER_CONTEXT Jitter
+);
+
+NTSTATUS JitterInsert(
+    _Inout_ PJITTER_CONTEXT Jitter,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ LONGLONG TimestampUs,
+    _In_ LONGLONG ArrivalUs,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length
+);
+
+NTSTATUS JitterPlayout(
+    _Inout_ PJITTER_CONTEXT Jitter,
+    _Out_writes_bytes_(BufferSize) PVOID Buffer,
+    _In_ size_t BufferSize,
+    _Out_ size_t* BytesWritten
+);
+
+#endif // _MULTIDEVICEBTJITTER_H_
@@ -0,0 +1,331 @@
+/*++
+
+Module Name:
+    MultiDeviceBTJitterBuffer.c
+
+Abstract:
+    Adaptive playout buffer for one inbound audio stream.
+
+    Frames are slotted by media timestamp, so reordered packets play in
+    order. Playout depth follows the smoothed inter-arrival jitter (RFC
+    3550 estimator). Late arrivals grow the depth at once; it shrinks
+    back only after a sustained calm period. Losses are concealed by
+    repeating the last good frame, flagged so the codec can run its own
+    concealment instead. Excess depth is trimmed one frame at a time,
+    which keeps latency near the target.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTJitterBuffer.h"
+
+#define JITTER_SAFETY_FACTOR        4       // Target = 4 x jitter + one frame
+#define JITTER_SHRINK_FRAMES        256     // Calm frames before dropping one frame of depth
+#define JITTER_TRIM_SLACK           2       // Depth above target tolerated before trimming
+#define JITTER_MAX_REPEAT           3       // Concealment repeats before going silent
+#define JITTER_TRANSIT_CAP_US       1000000
+
+/*++
+Routine Description:
+    Playout depth, in frames, that the current jitter estimate calls for
+--*/
+static ULONG
+JitterDesiredFrames(
+    _In_ const JITTER_BUFFER* Buffer
+)
+{
+    ULONG frameUs = Buffer->FrameDurationUs;
+    ULONG jitterUs = Buffer->JitterQ4 >> 4;
+    ULONG frames = 1 + (JITTER_SAFETY_FACTOR * jitterUs + frameUs - 1) / frameUs;
+
+    return min(max(frames, Buffer->MinFrames), Buffer->MaxFrames);
+}
+
+/*++
+Routine Description:
+    Initializes an empty buffer over caller-supplied slots
+
+Arguments:
+    Buffer - Buffer to initialize
+    FrameDurationUs - Media time per frame
+    MinDelayUs - Lowest playout delay the buffer adapts down to
+    MaxDelayUs - Highest playout delay, capped at half the slots
+    Slots - JITTER_SLOTS entries of storage
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+JitterBufferInitialize(
+    _Out_ PJITTER_BUFFER Buffer,
+    _In_ ULONG FrameDurationUs,
+    _In_ ULONG MinDelayUs,
+    _In_ ULONG MaxDelayUs,
+    _Out_writes_(JITTER_SLOTS) PJITTER_SLOT Slots
+)
+{
+    ULONG frameUs = FrameDurationUs;
+
+    if (frameUs < JITTER_MIN_FRAME_US || frameUs > JITTER_MAX_FRAME_US ||
+        MinDelayUs > MaxDelayUs) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory(Buffer, sizeof(*Buffer));
+    RtlZeroMemory(Slots, JITTER_SLOTS * sizeof(JITTER_SLOT));
+
+    Buffer->FrameDurationUs = frameUs;
+    Buffer->Slots = Slots;
+    Buffer->MinFrames = max(1, (MinDelayUs + frameUs - 1) / frameUs);
+    Buffer->MaxFrames = min(JITTER_SLOTS / 2,
+        max(Buffer->MinFrames, (MaxDelayUs + frameUs - 1) / frameUs));
+    Buffer->TargetFrames = Buffer->MinFrames;
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Drops buffered frames that fall behind a new playout index
+--*/
+static VOID
+JitterAdvancePlayout(
+    _Inout_ PJITTER_BUFFER Buffer,
+    _In_ ULONG NewIndex
+)
+{
+    ULONG i;
+
+    for (i = 0; i < JITTER_SLOTS; i++) {
+        PJITTER_SLOT slot = &Buffer->Slots[i];
+
+        if (slot->Valid && (LONG)(slot->FrameIndex - NewIndex) < 0) {
+            slot->Valid = FALSE;
+            Buffer->Stats.FramesTrimmed++;
+        }
+    }
+
+    Buffer->PlayoutIndex = NewIndex;
+}
+
+/*++
+Routine Description:
+    Accepts one inbound audio frame
+
+Arguments:
+    Buffer - Stream's buffer
+    TimestampUs - Media timestamp carried by the packet
+    ArrivalUs - Local receive time, microseconds
+    Data - Encoded frame
+    Length - Frame length
+
+Return Value:
+    STATUS_INVALID_BUFFER_SIZE if the frame exceeds JITTER_FRAME_MAX_BYTES.
+    Late, duplicate and overrunning frames are counted, not failed.
+--*/
+NTSTATUS
+JitterBufferInsert(
+    _Inout_ PJITTER_BUFFER Buffer,
+    _In_ LONGLONG TimestampUs,
+    _In_ LONGLONG ArrivalUs,
+    _In_reads_bytes_(Length) const VOID* Data,
+    _In_ ULONG Length
+)
+{
+    PJITTER_SLOT slot;
+    LONGLONG offset;
+    LONGLONG transit;
+    ULONG delta;
+    ULONG index;
+    ULONG frameUs = Buffer->FrameDurationUs;
+    LONG ahead;
+
+    if (Length > JITTER_FRAME_MAX_BYTES) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    // RFC 3550 interarrival jitter: J += (|D| - J) / 16
+    transit = ArrivalUs - TimestampUs;
+    if (Buffer->HaveTransit) {
+        LONGLONG d = transit - Buffer->LastTransitUs;
+
+        delta = (ULONG)min(d < 0 ? -d : d, JITTER_TRANSIT_CAP_US);
+        Buffer->JitterQ4 += delta - ((Buffer->JitterQ4 + 8) >> 4);
+    }
+    Buffer->LastTransitUs = transit;
+    Buffer->HaveTransit = TRUE;
+
+    if (!Buffer->HaveBase) {
+        Buffer->BaseTimestamp = TimestampUs;
+        Buffer->PlayoutIndex = 0;
+        Buffer->HighestIndex = 0;
+        Buffer->HaveBase = TRUE;
+    }
+
+    // Slot by media time so reordered packets land in sequence
+    offset = TimestampUs - Buffer->BaseTimestamp + frameUs / 2;
+    if (offset < 0) {
+        Buffer->Stats.FramesLate++;
+        return STATUS_SUCCESS;
+    }
+
+    index = (ULONG)(offset / frameUs);
+    ahead = (LONG)(index - Buffer->PlayoutIndex);
+
+    if (ahead < 0) {
+        // Its slot has already been concealed: the buffer was too shallow
+        Buffer->Stats.FramesLate++;
+        Buffer->TargetFrames = max(Buffer->TargetFrames, min(Buffer->MaxFrames,
+            JitterDesiredFrames(Buffer) + (ULONG)min(-ahead, JITTER_SLOTS)));
+        Buffer->ShrinkVotes = 0;
+        return STATUS_SUCCESS;
+    }
+
+    if (ahead >= JITTER_SLOTS) {
+        Buffer->Stats.Overruns++;
+        JitterAdvancePlayout(Buffer, index - (JITTER_SLOTS - 1));
+    }
+
+    slot = &Buffer->Slots[index & (JITTER_SLOTS - 1)];
+    if (slot->Valid && slot->FrameIndex == index) {
+        Buffer->Stats.FramesDuplicate++;
+        return STATUS_SUCCESS;
+    }
+
+    slot->Valid = TRUE;
+    slot->FrameIndex = index;
+    slot->Timestamp = TimestampUs;
+    slot->Length = Length;
+    RtlCopyMemory(slot->Data, Data, Length);
+
+    if ((LONG)(index - Buffer->HighestIndex) > 0) {
+        Buffer->HighestIndex = index;
+    }
+
+    Buffer->Stats.FramesReceived++;
+    Buffer->TargetFrames = max(Buffer->TargetFrames, JitterDesiredFrames(Buffer));
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Produces one frame period of output
+
+Arguments:
+    Buffer - Stream's buffer
+    Header - Receives the frame's index, flags, timestamp and length
+    Payload - Receives the frame, or the repeated last good one
+--*/
+VOID
+JitterBufferPlayout(
+    _Inout_ PJITTER_BUFFER Buffer,
+    _Out_ PJITTER_PLAYOUT_HEADER Header,
+    _Out_writes_bytes_(JITTER_FRAME_MAX_BYTES) PUCHAR Payload
+)
+{
+    PJITTER_SLOT slot;
+    LONG depth = 0;
+    BOOLEAN advance = TRUE;
+
+    RtlZeroMemory(Header, sizeof(*Header));
+    Header->FrameIndex = Buffer->PlayoutIndex;
+
+    if (Buffer->HaveBase) {
+        depth = max((LONG)(Buffer->HighestIndex - Buffer->PlayoutIndex) + 1, 0);
+    }
+
+    if (!Buffer->Playing) {
+        if (depth == 0 || (ULONG)depth < Buffer->TargetFrames) {
+            Header->Flags = JITTER_FRAME_SILENCE;
+            goto Exit;
+        }
+        Buffer->Playing = TRUE;
+    }
+
+    // Pull latency back toward the target one frame per period
+    if ((ULONG)depth > Buffer->TargetFrames + JITTER_TRIM_SLACK) {
+        JitterAdvancePlayout(Buffer, Buffer->PlayoutIndex + 1);
+        Header->FrameIndex = Buffer->PlayoutIndex;
+        depth--;
+    }
+
+    slot = &Buffer->Slots[Buffer->PlayoutIndex & (JITTER_SLOTS - 1)];
+
+    if (slot->Valid && slot->FrameIndex == Buffer->PlayoutIndex) {
+        Header->Timestamp = slot->Timestamp;
+        Header->Length = slot->Length;
+        Header->Flags = Buffer->ConcealRun ? JITTER_FRAME_AFTER_GAP : 0;
+        RtlCopyMemory(Payload, slot->Data, slot->Length);
+
+        Buffer->LastGood = *slot;
+        Buffer->ConcealRun = 0;
+        slot->Valid = FALSE;
+        Buffer->Stats.FramesPlayed++;
+
+        // Give back depth only after a sustained calm stretch
+        if (JitterDesiredFrames(Buffer) < Buffer->TargetFrames) {
+            if (++Buffer->ShrinkVotes >= JITTER_SHRINK_FRAMES) {
+                Buffer->TargetFrames--;
+                Buffer->ShrinkVotes = 0;
+            }
+        } else {
+            Buffer->ShrinkVotes = 0;
+        }
+    } else {
+        if (depth <= 1) {
+            // Nothing buffered beyond this slot: rebuffer without
+            // advancing so the frame is still playable if it turns up
+            Buffer->Stats.Underruns++;
+            Buffer->Playing = FALSE;
+            advance = FALSE;
+        }
+
+        Buffer->Stats.FramesConcealed++;
+        Header->Flags = JITTER_FRAME_CONCEALED;
+        Header->Timestamp = Buffer->BaseTimestamp +
+            (LONGLONG)Buffer->PlayoutIndex * Buffer->FrameDurationUs;
+
+        if (++Buffer->ConcealRun <= JITTER_MAX_REPEAT && Buffer->LastGood.Valid) {
+            Header->Length = Buffer->LastGood.Length;
+            RtlCopyMemory(Payload, Buffer->LastGood.Data, Buffer->LastGood.Length);
+        } else {
+            Header->Flags |= JITTER_FRAME_SILENCE;
+        }
+    }
+
+    if (advance) {
+        Buffer->PlayoutIndex++;
+        depth = max(depth - 1, 0);
+    }
+
+Exit:
+    Buffer->Stats.DepthFrames = (ULONG)depth;
+}
+
+/*++
+Routine Description:
+    Copies the counters with the current jitter and target delay
+--*/
+VOID
+JitterBufferGetStats(
+    _In_ const JITTER_BUFFER* Buffer,
+    _Out_ PJITTER_STREAM_STATS Stats
+)
+{
+    *Stats = Buffer->Stats;
+    Stats->JitterUs = Buffer->JitterQ4 >> 4;
+    Stats->TargetDelayUs = Buffer->TargetFrames * Buffer->FrameDurationUs;
+}
@@ -0,0 +1,115 @@
+/*++
+
+Module Name:
+    MultiDeviceBTJitterBuffer.h
+
+Abstract:
+    Adaptive playout buffer for one inbound audio stream. Frames are
+    slotted by media timestamp, the playout depth follows the smoothed
+    inter-arrival jitter, and losses are concealed by repeating the last
+    good frame.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the slot storage, the arrival times and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTJITTERBUFFER_H_
+#define _MULTIDEVICEBTJITTERBUFFER_H_
+
+#define JITTER_SLOTS                64      // Power of two
+#define JITTER_FRAME_MAX_BYTES      512
+#define JITTER_MIN_FRAME_US         2500
+#define JITTER_MAX_FRAME_US         60000
+
+// JITTER_PLAYOUT_HEADER.Flags
+#define JITTER_FRAME_CONCEALED      0x01    // Lost frame; payload repeats the last good one
+#define JITTER_FRAME_SILENCE        0x02    // Nothing to play (buffering or long gap)
+#define JITTER_FRAME_AFTER_GAP      0x04    // First good frame after concealment
+
+// Counters (IOCTL_MULTI_BT_GET_JITTER_STATS); the caller fills DeviceAddress
+typedef struct _JITTER_STREAM_STATS {
+    BTH_ADDR DeviceAddress;
+    ULONG FramesReceived;
+    ULONG FramesPlayed;
+    ULONG FramesConcealed;
+    ULONG FramesLate;           // Arrived after their playout slot
+    ULONG FramesDuplicate;
+    ULONG FramesTrimmed;        // Dropped to pull latency back to target
+    ULONG Underruns;            // Buffer ran dry while playing
+    ULONG Overruns;             // Arrival too far ahead of playout
+    ULONG JitterUs;             // Smoothed inter-arrival jitter
+    ULONG TargetDelayUs;
+    ULONG DepthFrames;
+} JITTER_STREAM_STATS, *PJITTER_STREAM_STATS;
+
+// Prefix of every frame returned by the optimized read path; the
+// caller fills DeviceAddress
+typedef struct _JITTER_PLAYOUT_HEADER {
+    BTH_ADDR DeviceAddress;
+    ULONG FrameIndex;
+    ULONG Flags;
+    LONGLONG Timestamp;         // Media timestamp, microseconds
+    ULONG Length;               // Payload bytes following the header
+} JITTER_PLAYOUT_HEADER, *PJITTER_PLAYOUT_HEADER;
+
+typedef struct _JITTER_SLOT {
+    BOOLEAN Valid;
+    ULONG FrameIndex;
+    LONGLONG Timestamp;
+    ULONG Length;
+    UCHAR Data[JITTER_FRAME_MAX_BYTES];
+} JITTER_SLOT, *PJITTER_SLOT;
+
+typedef struct _JITTER_BUFFER {
+    BOOLEAN Playing;
+    BOOLEAN HaveBase;
+    BOOLEAN HaveTransit;
+    ULONG FrameDurationUs;
+    LONGLONG BaseTimestamp;     // Media timestamp of frame index 0
+    LONGLONG LastTransitUs;
+    ULONG JitterQ4;             // Jitter estimate, microseconds * 16
+    ULONG PlayoutIndex;         // Next frame index to play
+    ULONG HighestIndex;
+    ULONG TargetFrames;
+    ULONG MinFrames;
+    ULONG MaxFrames;
+    ULONG ShrinkVotes;
+    ULONG ConcealRun;
+    PJITTER_SLOT Slots;         // JITTER_SLOTS entries
+    JITTER_SLOT LastGood;
+    JITTER_STREAM_STATS Stats;
+} JITTER_BUFFER, *PJITTER_BUFFER;
+
+// Fails with STATUS_INVALID_PARAMETER for a frame duration outside
+// JITTER_MIN_FRAME_US..JITTER_MAX_FRAME_US or MinDelayUs > MaxDelayUs.
+// Equal delays pin the depth.
+NTSTATUS JitterBufferInitialize(
+    _Out_ PJITTER_BUFFER Buffer,
+    _In_ ULONG FrameDurationUs,
+    _In_ ULONG MinDelayUs,
+    _In_ ULONG MaxDelayUs,
+    _Out_writes_(JITTER_SLOTS) PJITTER_SLOT Slots
+);
+
+NTSTATUS JitterBufferInsert(
+    _Inout_ PJITTER_BUFFER Buffer,
+    _In_ LONGLONG TimestampUs,
+    _In_ LONGLONG ArrivalUs,
+    _In_reads_bytes_(Length) const VOID* Data,
+    _In_ ULONG Length
+);
+
+// One frame period of output; Header->DeviceAddress is left zero
+VOID JitterBufferPlayout(
+    _Inout_ PJITTER_BUFFER Buffer,
+    _Out_ PJITTER_PLAYOUT_HEADER Header,
+    _Out_writes_bytes_(JITTER_FRAME_MAX_BYTES) PUCHAR Payload
+);
+
+VOID JitterBufferGetStats(
+    _In_ const JITTER_BUFFER* Buffer,
+    _Out_ PJITTER_STREAM_STATS Stats
+);
+
+#endif // _MULTIDEVICEBTJITTERBUFFER_H_
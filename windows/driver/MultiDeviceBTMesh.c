@@ -0,0 +1,544 @@
+/*++
+
+Module Name:
+    MultiDeviceBTMesh.c
+
+Abstract:
+    Bluetooth Mesh bearer for large IoT deployments. Appliances out of
+    range of the gateway are reached through relay nodes instead of
+    direct connections.
+
+    The network security layer submits each PDU it receives, with the
+    header de-obfuscated, through IOCTL_MULTI_BT_MESH_SUBMIT_PDU and
+    learns whether it was for this node. The network layer
+    (MultiDeviceBTMeshNet.c) runs under the context's spin lock. Relayed
+    and proxied copies wait in its queue; the bearer agent pends
+    IOCTL_MULTI_BT_MESH_FETCH_RELAY on a manual queue, and each
+    submission that queues PDUs completes pended fetches with as many
+    as fit. GATT proxy clients are registered with their accept lists
+    through the proxy IOCTLs.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MeshCreateFetchQueue)
+#endif
+
+static __forceinline ULONG64
+MeshNowUs(VOID)
+{
+    return KeQueryInterruptTime() / 10;
+}
+
+/*++
+Routine Description:
+    Initializes mesh state (disabled until configured)
+
+Arguments:
+    Mesh - Mesh context embedded in the device context
+
+Return Value:
+    None
+--*/
+VOID
+MeshInitialize(
+    _Out_ PMESH_CONTEXT Mesh
+)
+{
+    RtlZeroMemory(Mesh, sizeof(*Mesh));
+    KeInitializeSpinLock(&Mesh->Lock);
+    MeshNetInitialize(&Mesh->Net);
+}
+
+/*++
+Routine Description:
+    Creates the manual queue that holds pended relay fetches
+
+Arguments:
+    Mesh - Mesh context
+    Device - Parent device
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+MeshCreateFetchQueue(
+    _Inout_ PMESH_CONTEXT Mesh,
+    _In_ WDFDEVICE Device
+)
+{
+    WDF_IO_QUEUE_CONFIG queueConfig;
+
+    PAGED_CODE();
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+    return WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &Mesh->FetchQueue);
+}
+
+/*++
+Routine Description:
+    Completes pended fetches while PDUs are waiting, each with as many
+    as its buffer holds
+
+Arguments:
+    Mesh - Mesh context
+
+Return Value:
+    None
+--*/
+static VOID
+MeshDrain(
+    _Inout_ PMESH_CONTEXT Mesh
+)
+{
+    for (;;) {
+        WDFREQUEST request;
+        PMESH_RELAY_FETCH fetch;
+        NTSTATUS status;
+        size_t size;
+        ULONG capacity;
+        KIRQL irql;
+
+        KeAcquireSpinLock(&Mesh->Lock, &irql);
+
+        if (Mesh->Net.RelayHead == Mesh->Net.RelayTail || Mesh->FetchQueue == NULL ||
+            !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Mesh->FetchQueue, &request))) {
+            KeReleaseSpinLock(&Mesh->Lock, irql);
+            return;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(request, MESH_RELAY_FETCH_MIN, (PVOID*)&fetch, &size);
+        if (!NT_SUCCESS(status)) {
+            KeReleaseSpinLock(&Mesh->Lock, irql);
+            WdfRequestComplete(request, status);
+            continue;
+        }
+
+        capacity = (ULONG)((size - FIELD_OFFSET(MESH_RELAY_FETCH, Items)) / sizeof(MESH_RELAY_ITEM));
+        fetch->Count = 0;
+        fetch->Reserved = 0;
+
+        while (fetch->Count < capacity && MeshNetDequeue(&Mesh->Net, &fetch->Items[fetch->Count])) {
+            fetch->Count++;
+        }
+
+        // Only PDUs for disconnected proxy clients were left
+        if (fetch->Count == 0) {
+            WdfRequestRequeue(request);
+            KeReleaseSpinLock(&Mesh->Lock, irql);
+            return;
+        }
+
+        KeReleaseSpinLock(&Mesh->Lock, irql);
+
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS,
+            FIELD_OFFSET(MESH_RELAY_FETCH, Items) + (size_t)fetch->Count * sizeof(MESH_RELAY_ITEM));
+    }
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_MESH_CONFIG
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Input buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleMeshConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PMESH_CONFIG config;
+    MESH_CONFIG copy;
+    PMESH_CONTEXT mesh = &DeviceContext->Mesh;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(MESH_CONFIG), (PVOID*)&config, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    copy = *config;
+
+    KeAcquireSpinLock(&mesh->Lock, &oldIrql);
+    status = MeshNetConfigure(&mesh->Net, &copy);
+    KeReleaseSpinLock(&mesh->Lock, oldIrql);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Mesh %s (addr 0x%04x, relay %d, proxy %d)\n",
+        copy.Enable ? "enabled" : "disabled", copy.PrimaryAddress,
+        copy.RelayEnabled, copy.ProxyEnabled));
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_MESH_STATS
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    OutputBufferLength - Output buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleGetMeshStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PMESH_STATS stats;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(MESH_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&DeviceContext->Mesh.Lock, &oldIrql);
+    *stats = DeviceContext->Mesh.Net.Stats;
+    KeReleaseSpinLock(&DeviceContext->Mesh.Lock, oldIrql);
+
+    *BytesReturned = sizeof(MESH_STATS);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_MESH_SUBMIT_PDU: runs one received network
+    PDU through the network layer and hands any copies it queues to a
+    pended fetch. The input and output share the system buffer.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Request with a MESH_PDU_SUBMIT
+    InputBufferLength - Input buffer length
+    OutputBufferLength - Output buffer length
+    BytesReturned - Receives sizeof(MESH_PDU_RESULT)
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleMeshSubmitPdu(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PMESH_CONTEXT mesh = &DeviceContext->Mesh;
+    PMESH_PDU_SUBMIT submit;
+    PMESH_PDU_RESULT output;
+    MESH_PDU_RESULT result;
+    UCHAR pdu[MESH_NETWORK_PDU_MAX];
+    MESH_BEARER bearer;
+    ULONG proxyIndex;
+    ULONG length;
+    NTSTATUS status;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(MESH_PDU_SUBMIT), (PVOID*)&submit, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if ((submit->Bearer != MeshBearerAdvertising && submit->Bearer != MeshBearerProxy) ||
+        submit->Length > MESH_NETWORK_PDU_MAX ||
+        (submit->Bearer == MeshBearerProxy && submit->ProxyIndex >= MESH_MAX_PROXY_CONNECTIONS)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Before the output buffer aliases the system buffer
+    bearer = submit->Bearer;
+    proxyIndex = submit->ProxyIndex;
+    length = submit->Length;
+    RtlCopyMemory(pdu, submit->Pdu, length);
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(MESH_PDU_RESULT), (PVOID*)&output, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&mesh->Lock, &irql);
+    result.Result = MeshNetProcess(&mesh->Net, bearer, proxyIndex, pdu, length, MeshNowUs());
+    result.Queued = mesh->Net.RelayTail - mesh->Net.RelayHead;
+    KeReleaseSpinLock(&mesh->Lock, irql);
+
+    if (result.Result & (MESH_RESULT_RELAYED | MESH_RESULT_PROXIED)) {
+        MeshDrain(mesh);
+    }
+
+    *output = result;
+    *BytesReturned = sizeof(MESH_PDU_RESULT);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_MESH_FETCH_RELAY: pends the request until
+    relayed or proxied PDUs are waiting. The output buffer must hold
+    at least one.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Fetch request
+    OutputBufferLength - Output buffer length
+    BytesReturned - Unused; the request completes from the queue
+
+Return Value:
+    STATUS_PENDING, or why the request cannot be pended
+--*/
+NTSTATUS
+HandleMeshFetchRelay(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PMESH_CONTEXT mesh = &DeviceContext->Mesh;
+    NTSTATUS status;
+
+    *BytesReturned = 0;
+
+    if (OutputBufferLength < MESH_RELAY_FETCH_MIN) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (mesh->FetchQueue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    status = WdfRequestForwardToIoQueue(Request, mesh->FetchQueue);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // The request belongs to the fetch queue now; it may complete here
+    MeshDrain(mesh);
+    return STATUS_PENDING;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_MESH_PROXY_CONNECT: registers a GATT proxy
+    client with its initial accept list
+
+Arguments:
+    DeviceContext - Device context
+    Request - Request with a MESH_PROXY_CONNECT
+    InputBufferLength - Input buffer length
+    OutputBufferLength - Output buffer length
+    BytesReturned - Receives sizeof(ULONG)
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleMeshProxyConnect(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PMESH_CONTEXT mesh = &DeviceContext->Mesh;
+    PMESH_PROXY_CONNECT input;
+    MESH_PROXY_CONNECT connect;
+    PULONG output;
+    ULONG proxyIndex;
+    NTSTATUS status;
+    KIRQL irql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(MESH_PROXY_CONNECT), (PVOID*)&input, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    connect = *input;
+    if (connect.FilterCount > MESH_PROXY_FILTER_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), (PVOID*)&output, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&mesh->Lock, &irql);
+
+    status = MeshNetProxyConnect(&mesh->Net, connect.DeviceAddress, &proxyIndex);
+    for (i = 0; NT_SUCCESS(status) && i < connect.FilterCount; i++) {
+        status = MeshNetProxyAddFilter(&mesh->Net, proxyIndex, connect.Filter[i]);
+        if (!NT_SUCCESS(status)) {
+            MeshNetProxyDisconnect(&mesh->Net, proxyIndex);
+        }
+    }
+
+    KeReleaseSpinLock(&mesh->Lock, irql);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Mesh proxy client %llx connected in slot %u\n",
+        connect.DeviceAddress, proxyIndex));
+
+    *output = proxyIndex;
+    *BytesReturned = sizeof(ULONG);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_MESH_PROXY_DISCONNECT: releases a proxy
+    client's slot, dropping PDUs still queued for it
+
+Arguments:
+    DeviceContext - Device context
+    Request - Request with the ULONG slot
+    InputBufferLength - Input buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleMeshProxyDisconnect(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PMESH_CONTEXT mesh = &DeviceContext->Mesh;
+    PULONG proxyIndex;
+    NTSTATUS status;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), (PVOID*)&proxyIndex, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&mesh->Lock, &irql);
+    status = MeshNetProxyDisconnect(&mesh->Net, *proxyIndex);
+    KeReleaseSpinLock(&mesh->Lock, irql);
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_MESH_PROXY_FILTER: adds addresses to a proxy
+    client's accept list, as its Add Addresses To Filter message asks
+
+Arguments:
+    DeviceContext - Device context
+    Request - Request with a MESH_PROXY_FILTER
+    InputBufferLength - Input buffer length
+    BytesReturned - Bytes written to the output buffer
+
+Return Value:
+    NTSTATUS; addresses before a failing one stay added
+--*/
+NTSTATUS
+HandleMeshProxyFilter(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PMESH_CONTEXT mesh = &DeviceContext->Mesh;
+    PMESH_PROXY_FILTER filter;
+    NTSTATUS status;
+    KIRQL irql;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(MESH_PROXY_FILTER), (PVOID*)&filter, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (filter->Count > MESH_PROXY_FILTER_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeAcquireSpinLock(&mesh->Lock, &irql);
+    for (i = 0; NT_SUCCESS(status) && i < filter->Count; i++) {
+        status = MeshNetProxyAddFilter(&mesh->Net, filter->ProxyIndex, filter->Addresses[i]);
+    }
+    KeReleaseSpinLock(&mesh->Lock, irql);
+
+    return status;
+}
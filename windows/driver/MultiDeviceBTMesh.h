@@ -0,0 +1,75 @@
+/*++
+
+Module Name:
+    MultiDeviceBTMesh.h
+
+Abstract:
+    Bluetooth Mesh bearer. The network security layer in user mode,
+    which holds the network keys, submits each PDU it has
+    de-obfuscated and authenticated. The network layer
+    (MultiDeviceBTMeshNet.h) checks it against the message cache,
+    delivers it locally and queues relayed copies; the bearer agent
+    pends a fetch for them, obfuscates each again and sends it on the
+    advertising bearer or to its GATT proxy client.
+
+--*/
+
+#ifndef _MULTIDEVICEBTMESH_H_
+#define _MULTIDEVICEBTMESH_H_
+
+#include "MultiDeviceBTMeshNet.h"
+
+// IOCTL_MULTI_BT_MESH_SUBMIT_PDU input
+typedef struct _MESH_PDU_SUBMIT {
+    MESH_BEARER Bearer;         // Bearer the PDU arrived on
+    ULONG ProxyIndex;           // MeshBearerProxy: the client's connection slot
+    ULONG Length;
+    UCHAR Pdu[MESH_NETWORK_PDU_MAX];
+    UCHAR Reserved[3];
+} MESH_PDU_SUBMIT, *PMESH_PDU_SUBMIT;
+
+// IOCTL_MULTI_BT_MESH_SUBMIT_PDU output
+typedef struct _MESH_PDU_RESULT {
+    ULONG Result;               // MESH_RESULT_*
+    ULONG Queued;               // PDUs waiting for the bearer agent
+} MESH_PDU_RESULT, *PMESH_PDU_RESULT;
+
+// IOCTL_MULTI_BT_MESH_FETCH_RELAY output: completed once PDUs are waiting
+typedef struct _MESH_RELAY_FETCH {
+    ULONG Count;
+    ULONG Reserved;
+    MESH_RELAY_ITEM Items[1];
+} MESH_RELAY_FETCH, *PMESH_RELAY_FETCH;
+
+#define MESH_RELAY_FETCH_MIN        sizeof(MESH_RELAY_FETCH)
+
+// IOCTL_MULTI_BT_MESH_PROXY_CONNECT input; the output is the ULONG slot
+typedef struct _MESH_PROXY_CONNECT {
+    BTH_ADDR DeviceAddress;
+    ULONG FilterCount;          // Initial accept list
+    USHORT Filter[MESH_PROXY_FILTER_SIZE];
+} MESH_PROXY_CONNECT, *PMESH_PROXY_CONNECT;
+
+// IOCTL_MULTI_BT_MESH_PROXY_FILTER input: addresses the client adds
+typedef struct _MESH_PROXY_FILTER {
+    ULONG ProxyIndex;
+    ULONG Count;
+    USHORT Addresses[MESH_PROXY_FILTER_SIZE];
+} MESH_PROXY_FILTER, *PMESH_PROXY_FILTER;
+
+typedef struct _MESH_CONTEXT {
+    KSPIN_LOCK Lock;            // Network layer state
+    WDFQUEUE FetchQueue;        // Pended IOCTL_MULTI_BT_MESH_FETCH_RELAY
+    MESH_NETWORK Net;
+} MESH_CONTEXT, *PMESH_CONTEXT;
+
+VOID MeshInitialize(
+    _Out_ PMESH_CONTEXT Mesh
+);
+
+NTSTATUS MeshCreateFetchQueue(
+    _Inout_ PMESH_CONTEXT Mesh,
+    _In_ WDFDEVICE Device
+);
+
+#endif // _MULTIDEVICEBTMESH_H_
@@ -0,0 +1,545 @@
+/*++
+
+Module Name:
+    MultiDeviceBTMeshNet.c
+
+Abstract:
+    Bluetooth Mesh network layer for large IoT deployments.
+    Appliances out of range of the gateway are reached through relay
+    nodes instead of direct connections. Every network PDU passes the
+    message cache (per-source highest IV index/SEQ, one hashed lookup),
+    is delivered locally when addressed to us, and is relayed with a
+    decremented TTL on the advertising bearer and to proxy clients.
+
+    PDUs handled here carry a cleartext network header; obfuscation and
+    NetMIC checks belong to the network security layer that feeds us,
+    which also obfuscates the relayed copies again before they are sent.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTMeshNet.h"
+
+#define MESH_CACHE_MAX_PROBE        8
+#define MESH_DEFAULT_TTL            7
+#define MESH_DEFAULT_RETRANSMIT     1
+
+/*++
+Routine Description:
+    Initializes mesh state (disabled until configured)
+
+Arguments:
+    Net - Network layer state
+
+Return Value:
+    None
+--*/
+VOID
+MeshNetInitialize(
+    _Out_ PMESH_NETWORK Net
+)
+{
+    RtlZeroMemory(Net, sizeof(*Net));
+
+    Net->Config.DefaultTtl = MESH_DEFAULT_TTL;
+    Net->Config.RelayRetransmitCount = MESH_DEFAULT_RETRANSMIT;
+    Net->Config.ElementCount = 1;
+}
+
+/*++
+Routine Description:
+    Decodes the network header: IVI|NID, CTL|TTL, SEQ (24 bit), SRC, DST
+
+Arguments:
+    Pdu - Network PDU
+    Length - PDU length
+    Header - Receives the decoded header
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+MeshNetParseHeader(
+    _In_reads_bytes_(Length) const UCHAR* Pdu,
+    _In_ ULONG Length,
+    _Out_ PMESH_NETWORK_HEADER Header
+)
+{
+    if (Length < MESH_NETWORK_HEADER_SIZE || Length > MESH_NETWORK_PDU_MAX) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    Header->Ivi = Pdu[0] >> 7;
+    Header->Nid = Pdu[0] & 0x7F;
+    Header->Ctl = (Pdu[1] >> 7) != 0;
+    Header->Ttl = Pdu[1] & 0x7F;
+    Header->Seq = ((ULONG)Pdu[2] << 16) | ((ULONG)Pdu[3] << 8) | Pdu[4];
+    Header->Src = (USHORT)((Pdu[5] << 8) | Pdu[6]);
+    Header->Dst = (USHORT)((Pdu[7] << 8) | Pdu[8]);
+
+    if (!MESH_ADDR_IS_UNICAST(Header->Src) ||
+        Header->Dst == MESH_ADDR_UNASSIGNED) {
+        return STATUS_DATA_ERROR;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Checks the message cache and records the PDU. A source's SEQ only
+    grows within an IV index, so keeping the highest (IV, SEQ) per source
+    rejects every replay with a single hashed lookup.
+
+Return Value:
+    TRUE if the PDU was already seen
+--*/
+static BOOLEAN
+MeshNetCacheCheckAndUpdate(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ USHORT Src,
+    _In_ ULONG IvIndex,
+    _In_ ULONG Seq
+)
+{
+    ULONG home = ((ULONG)Src * 0x9E3779B1u) >> (32 - MESH_MESSAGE_CACHE_BITS);
+    ULONG index = home;
+    ULONG probe;
+    PMESH_CACHE_ENTRY entry;
+
+    for (probe = 0; probe < MESH_CACHE_MAX_PROBE; probe++) {
+        entry = &Net->Cache[index];
+
+        if (entry->Src == Src) {
+            if (IvIndex < entry->IvIndex ||
+                (IvIndex == entry->IvIndex && Seq <= entry->Seq)) {
+                return TRUE;
+            }
+            entry->IvIndex = IvIndex;
+            entry->Seq = Seq;
+            return FALSE;
+        }
+
+        if (entry->Src == MESH_ADDR_UNASSIGNED) {
+            break;
+        }
+
+        index = (index + 1) & (MESH_MESSAGE_CACHE_SIZE - 1);
+    }
+
+    // Every slot in reach is taken: the home slot gives way. Slots stay
+    // occupied, so no other source's probe is cut short. The source
+    // evicted loses its replay state: its next PDU is accepted whatever
+    // its SEQ, and older PDUs replayed in rising SEQ order pass too
+    // until a current one from it is cached again.
+    if (probe == MESH_CACHE_MAX_PROBE) {
+        index = home;
+        Net->Stats.CacheEvictions++;
+    }
+
+    entry = &Net->Cache[index];
+    entry->Src = Src;
+    entry->IvIndex = IvIndex;
+    entry->Seq = Seq;
+    return FALSE;
+}
+
+/*++
+Routine Description:
+    Determines whether a destination address is served by this node
+--*/
+static BOOLEAN
+MeshNetIsLocalDestination(
+    _In_ PMESH_NETWORK Net,
+    _In_ USHORT Dst
+)
+{
+    ULONG i;
+
+    if (MESH_ADDR_IS_UNICAST(Dst)) {
+        return Dst >= Net->Config.PrimaryAddress &&
+            Dst < (ULONG)Net->Config.PrimaryAddress + Net->Config.ElementCount;
+    }
+
+    switch (Dst) {
+    case MESH_ADDR_ALL_NODES:
+        return TRUE;
+    case MESH_ADDR_ALL_RELAYS:
+        return Net->Config.RelayEnabled;
+    case MESH_ADDR_ALL_PROXIES:
+        return Net->Config.ProxyEnabled;
+    default:
+        break;
+    }
+
+    for (i = 0; i < Net->Config.SubscriptionCount; i++) {
+        if (Net->Config.Subscriptions[i] == Dst) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*++
+Routine Description:
+    Appends a PDU to the outbound queue
+--*/
+static BOOLEAN
+MeshNetEnqueue(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ MESH_BEARER Bearer,
+    _In_ ULONG ProxyIndex,
+    _In_reads_bytes_(Length) const UCHAR* Pdu,
+    _In_ ULONG Length,
+    _In_ ULONG Transmissions,
+    _In_ ULONG64 NowUs
+)
+{
+    PMESH_RELAY_ITEM item;
+
+    if (Net->RelayTail - Net->RelayHead >= MESH_RELAY_QUEUE_SIZE) {
+        Net->Stats.RelayQueueFull++;
+        return FALSE;
+    }
+
+    item = &Net->RelayQueue[Net->RelayTail & (MESH_RELAY_QUEUE_SIZE - 1)];
+    item->Bearer = Bearer;
+    item->ProxyIndex = ProxyIndex;
+    item->Length = Length;
+    item->Transmissions = Transmissions;
+    item->EnqueueUs = NowUs;
+    RtlCopyMemory(item->Pdu, Pdu, Length);
+
+    Net->RelayTail++;
+    return TRUE;
+}
+
+/*++
+Routine Description:
+    Applies a configuration. The IV index only moves forward; a jump of
+    more than one invalidates the replay state.
+
+Arguments:
+    Net - Network layer state
+    Config - New configuration
+
+Return Value:
+    STATUS_SUCCESS, or STATUS_INVALID_PARAMETER
+--*/
+NTSTATUS
+MeshNetConfigure(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ const MESH_CONFIG* Config
+)
+{
+    if (Config->Enable &&
+        (!MESH_ADDR_IS_UNICAST(Config->PrimaryAddress) ||
+         Config->ElementCount == 0 ||
+         (ULONG)Config->PrimaryAddress + Config->ElementCount > 0x8000 ||
+         Config->DefaultTtl == 1 || Config->DefaultTtl > MESH_TTL_MAX ||
+         Config->RelayRetransmitCount > 7 ||
+         Config->SubscriptionCount > ARRAYSIZE(Config->Subscriptions))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Config->IvIndex < Net->Config.IvIndex) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (Config->IvIndex > Net->Config.IvIndex + 1) {
+        RtlZeroMemory(Net->Cache, sizeof(Net->Cache));
+    }
+
+    Net->Config = *Config;
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Processes one network PDU from the advertising bearer or a proxy
+    connection: replay/duplicate check, local delivery, relay and proxy
+    forwarding.
+
+Arguments:
+    Net - Network layer state
+    Bearer - Bearer the PDU arrived on
+    ProxyIndex - Source proxy connection (MeshBearerProxy only)
+    Pdu - Network PDU with cleartext header
+    Length - PDU length
+    NowUs - Current time, stamped on queued PDUs
+
+Return Value:
+    MESH_RESULT_* flags
+--*/
+ULONG
+MeshNetProcess(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ MESH_BEARER Bearer,
+    _In_ ULONG ProxyIndex,
+    _In_reads_bytes_(Length) const UCHAR* Pdu,
+    _In_ ULONG Length,
+    _In_ ULONG64 NowUs
+)
+{
+    MESH_NETWORK_HEADER header;
+    UCHAR relayPdu[MESH_NETWORK_PDU_MAX];
+    ULONG ivIndex;
+    ULONG result = 0;
+    ULONG i;
+
+    if (!Net->Config.Enable) {
+        return MESH_RESULT_DROPPED;
+    }
+
+    if (!NT_SUCCESS(MeshNetParseHeader(Pdu, Length, &header))) {
+        Net->Stats.DroppedMalformed++;
+        return MESH_RESULT_DROPPED;
+    }
+
+    Net->Stats.PdusReceived++;
+    if (Bearer == MeshBearerProxy) {
+        Net->Stats.ProxiedIn++;
+    }
+
+    // IVI selects the current IV index or, during an IV update, the previous one
+    ivIndex = Net->Config.IvIndex;
+    if (header.Ivi != (ivIndex & 1)) {
+        if (ivIndex == 0) {
+            Net->Stats.DroppedIvIndex++;
+            return MESH_RESULT_DROPPED;
+        }
+        ivIndex--;
+    }
+
+    // Our own PDUs echoed back by neighbouring relays
+    if (header.Src >= Net->Config.PrimaryAddress &&
+        header.Src < (ULONG)Net->Config.PrimaryAddress + Net->Config.ElementCount) {
+        Net->Stats.Duplicates++;
+        return MESH_RESULT_DUPLICATE;
+    }
+
+    if (MeshNetCacheCheckAndUpdate(Net, header.Src, ivIndex, header.Seq)) {
+        Net->Stats.Duplicates++;
+        return MESH_RESULT_DUPLICATE;
+    }
+
+    if (MeshNetIsLocalDestination(Net, header.Dst)) {
+        Net->Stats.Delivered++;
+        result |= MESH_RESULT_DELIVERED;
+
+        // A unicast PDU for one of our elements goes no further
+        if (MESH_ADDR_IS_UNICAST(header.Dst)) {
+            return result;
+        }
+    }
+
+    // TTL 0 and 1 are never relayed
+    if (header.Ttl < 2) {
+        if ((result & MESH_RESULT_DELIVERED) == 0) {
+            Net->Stats.DroppedTtl++;
+            result |= MESH_RESULT_DROPPED;
+        }
+        return result;
+    }
+
+    RtlCopyMemory(relayPdu, Pdu, Length);
+    relayPdu[1] = (UCHAR)((header.Ctl ? 0x80 : 0x00) | (header.Ttl - 1));
+
+    // Relay feature covers the advertising bearer; PDUs from proxy clients
+    // are bridged onto it by the proxy feature
+    if ((Bearer == MeshBearerAdvertising && Net->Config.RelayEnabled) ||
+        (Bearer == MeshBearerProxy && Net->Config.ProxyEnabled)) {
+        if (MeshNetEnqueue(Net, MeshBearerAdvertising, 0, relayPdu, Length,
+                (ULONG)Net->Config.RelayRetransmitCount + 1, NowUs)) {
+            Net->Stats.Relayed++;
+            result |= MESH_RESULT_RELAYED;
+        }
+    }
+
+    if (Net->Config.ProxyEnabled) {
+        for (i = 0; i < MESH_MAX_PROXY_CONNECTIONS; i++) {
+            PMESH_PROXY_CONNECTION proxy = &Net->Proxies[i];
+            ULONG f;
+
+            if (!proxy->InUse || (Bearer == MeshBearerProxy && i == ProxyIndex)) {
+                continue;
+            }
+
+            for (f = 0; f < proxy->FilterCount; f++) {
+                if (proxy->Filter[f] == header.Dst) {
+                    break;
+                }
+            }
+
+            if (f < proxy->FilterCount &&
+                MeshNetEnqueue(Net, MeshBearerProxy, i, relayPdu, Length, 1, NowUs)) {
+                Net->Stats.ProxiedOut++;
+                result |= MESH_RESULT_PROXIED;
+            }
+        }
+    }
+
+    return result;
+}
+
+/*++
+Routine Description:
+    Removes the oldest outbound PDU for transmission by its bearer.
+    PDUs for a proxy client that has since disconnected are skipped.
+
+Arguments:
+    Net - Network layer state
+    Item - Receives the PDU and its target bearer
+
+Return Value:
+    TRUE if a PDU was dequeued
+--*/
+BOOLEAN
+MeshNetDequeue(
+    _Inout_ PMESH_NETWORK Net,
+    _Out_ PMESH_RELAY_ITEM Item
+)
+{
+    while (Net->RelayHead != Net->RelayTail) {
+        PMESH_RELAY_ITEM item = &Net->RelayQueue[Net->RelayHead & (MESH_RELAY_QUEUE_SIZE - 1)];
+
+        Net->RelayHead++;
+        if (item->Length != 0) {
+            *Item = *item;
+            Net->Stats.RelayDequeued++;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*++
+Routine Description:
+    Registers a GATT proxy client connection
+
+Arguments:
+    Net - Network layer state
+    DeviceAddress - Proxy client address
+    ProxyIndex - Receives the connection slot
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+MeshNetProxyConnect(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ BTH_ADDR DeviceAddress,
+    _Out_ PULONG ProxyIndex
+)
+{
+    ULONG i;
+
+    for (i = 0; i < MESH_MAX_PROXY_CONNECTIONS; i++) {
+        if (!Net->Proxies[i].InUse) {
+            RtlZeroMemory(&Net->Proxies[i], sizeof(Net->Proxies[i]));
+            Net->Proxies[i].InUse = TRUE;
+            Net->Proxies[i].DeviceAddress = DeviceAddress;
+            *ProxyIndex = i;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+/*++
+Routine Description:
+    Releases a proxy connection slot. PDUs still queued for it are
+    dropped, so a client taking the slot next never sees them.
+
+Arguments:
+    Net - Network layer state
+    ProxyIndex - Connection slot
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+MeshNetProxyDisconnect(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ ULONG ProxyIndex
+)
+{
+    ULONG i;
+
+    if (ProxyIndex >= MESH_MAX_PROXY_CONNECTIONS || !Net->Proxies[ProxyIndex].InUse) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Net->Proxies[ProxyIndex].InUse = FALSE;
+    Net->Proxies[ProxyIndex].FilterCount = 0;
+
+    for (i = Net->RelayHead; i != Net->RelayTail; i++) {
+        PMESH_RELAY_ITEM item = &Net->RelayQueue[i & (MESH_RELAY_QUEUE_SIZE - 1)];
+
+        if (item->Bearer == MeshBearerProxy && item->ProxyIndex == ProxyIndex) {
+            item->Length = 0;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Adds a destination to a proxy client's accept list. Clients add
+    their own unicast address and the groups they subscribe to.
+
+Arguments:
+    Net - Network layer state
+    ProxyIndex - Connection slot
+    Address - Destination address to forward
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+MeshNetProxyAddFilter(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ ULONG ProxyIndex,
+    _In_ USHORT Address
+)
+{
+    PMESH_PROXY_CONNECTION proxy;
+    ULONG i;
+
+    if (ProxyIndex >= MESH_MAX_PROXY_CONNECTIONS || Address == MESH_ADDR_UNASSIGNED) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    proxy = &Net->Proxies[ProxyIndex];
+    if (!proxy->InUse) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    for (i = 0; i < proxy->FilterCount; i++) {
+        if (proxy->Filter[i] == Address) {
+            return STATUS_SUCCESS;
+        }
+    }
+
+    if (proxy->FilterCount == MESH_PROXY_FILTER_SIZE) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    proxy->Filter[proxy->FilterCount++] = Address;
+    return STATUS_SUCCESS;
+}
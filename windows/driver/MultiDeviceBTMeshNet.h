@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+    MultiDeviceBTMeshNet.h
+
+Abstract:
+    Bluetooth Mesh network layer: message cache, local delivery,
+    TTL-based relaying and forwarding to GATT proxy clients. A network
+    PDU goes in with its header in the clear; PDUs to send come out of
+    one queue, tagged with the bearer they go to.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the time, the storage and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTMESHNET_H_
+#define _MULTIDEVICEBTMESHNET_H_
+
+// Table sizes (must be powers of two)
+#define MESH_MESSAGE_CACHE_BITS     10
+#define MESH_MESSAGE_CACHE_SIZE     (1 << MESH_MESSAGE_CACHE_BITS)
+#define MESH_RELAY_QUEUE_SIZE       64
+
+#define MESH_MAX_PROXY_CONNECTIONS  4
+#define MESH_PROXY_FILTER_SIZE      16
+
+// Network PDU layout (cleartext header after de-obfuscation)
+#define MESH_NETWORK_HEADER_SIZE    9
+#define MESH_NETWORK_PDU_MAX        29
+#define MESH_TTL_MAX                0x7F
+
+// Addresses
+#define MESH_ADDR_UNASSIGNED        0x0000
+#define MESH_ADDR_ALL_PROXIES       0xFFFC
+#define MESH_ADDR_ALL_FRIENDS       0xFFFD
+#define MESH_ADDR_ALL_RELAYS        0xFFFE
+#define MESH_ADDR_ALL_NODES         0xFFFF
+#define MESH_ADDR_IS_UNICAST(a)     ((a) != 0 && ((a) & 0x8000) == 0)
+#define MESH_ADDR_IS_GROUP(a)       (((a) & 0xC000) == 0xC000)
+
+// Bearers a PDU can arrive on or be sent to
+typedef enum _MESH_BEARER {
+    MeshBearerAdvertising = 0,
+    MeshBearerProxy = 1
+} MESH_BEARER;
+
+// Result flags from MeshNetProcess
+#define MESH_RESULT_DELIVERED       0x01
+#define MESH_RESULT_RELAYED         0x02
+#define MESH_RESULT_PROXIED         0x04
+#define MESH_RESULT_DUPLICATE       0x08
+#define MESH_RESULT_DROPPED         0x10
+
+// Decoded network header
+typedef struct _MESH_NETWORK_HEADER {
+    UCHAR Ivi;
+    UCHAR Nid;
+    BOOLEAN Ctl;
+    UCHAR Ttl;
+    ULONG Seq;
+    USHORT Src;
+    USHORT Dst;
+} MESH_NETWORK_HEADER, *PMESH_NETWORK_HEADER;
+
+// Per-source replay state: highest (IV index, SEQ) seen
+typedef struct _MESH_CACHE_ENTRY {
+    USHORT Src;                 // MESH_ADDR_UNASSIGNED marks a free slot
+    USHORT Reserved;
+    ULONG IvIndex;
+    ULONG Seq;
+} MESH_CACHE_ENTRY, *PMESH_CACHE_ENTRY;
+
+// PDU waiting for the advertising bearer or a proxy connection, TTL
+// already decremented
+typedef struct _MESH_RELAY_ITEM {
+    MESH_BEARER Bearer;
+    ULONG ProxyIndex;
+    ULONG Length;               // 0: dropped, its proxy client disconnected
+    ULONG Transmissions;        // Copies to send (relay retransmit count + 1)
+    ULONG64 EnqueueUs;
+    UCHAR Pdu[MESH_NETWORK_PDU_MAX];
+    UCHAR Reserved[3];
+} MESH_RELAY_ITEM, *PMESH_RELAY_ITEM;
+
+// GATT proxy connection with its accept-list filter
+typedef struct _MESH_PROXY_CONNECTION {
+    BOOLEAN InUse;
+    BTH_ADDR DeviceAddress;
+    ULONG FilterCount;
+    USHORT Filter[MESH_PROXY_FILTER_SIZE];
+} MESH_PROXY_CONNECTION, *PMESH_PROXY_CONNECTION;
+
+// Configuration (IOCTL_MULTI_BT_MESH_CONFIG)
+typedef struct _MESH_CONFIG {
+    BOOLEAN Enable;
+    BOOLEAN RelayEnabled;
+    BOOLEAN ProxyEnabled;
+    UCHAR DefaultTtl;
+    USHORT PrimaryAddress;
+    UCHAR ElementCount;
+    UCHAR RelayRetransmitCount;
+    ULONG IvIndex;
+    ULONG SubscriptionCount;
+    USHORT Subscriptions[8];
+} MESH_CONFIG, *PMESH_CONFIG;
+
+// Counters (IOCTL_MULTI_BT_MESH_STATS)
+typedef struct _MESH_STATS {
+    ULONG PdusReceived;
+    ULONG Delivered;
+    ULONG Duplicates;
+    ULONG Relayed;
+    ULONG ProxiedOut;
+    ULONG ProxiedIn;
+    ULONG DroppedTtl;
+    ULONG DroppedMalformed;
+    ULONG DroppedIvIndex;
+    ULONG RelayQueueFull;
+    ULONG CacheEvictions;
+    ULONG RelayDequeued;
+} MESH_STATS, *PMESH_STATS;
+
+typedef struct _MESH_NETWORK {
+    MESH_CONFIG Config;
+    MESH_STATS Stats;
+    ULONG RelayHead;
+    ULONG RelayTail;
+    MESH_RELAY_ITEM RelayQueue[MESH_RELAY_QUEUE_SIZE];
+    MESH_PROXY_CONNECTION Proxies[MESH_MAX_PROXY_CONNECTIONS];
+    MESH_CACHE_ENTRY Cache[MESH_MESSAGE_CACHE_SIZE];
+} MESH_NETWORK, *PMESH_NETWORK;
+
+VOID MeshNetInitialize(
+    _Out_ PMESH_NETWORK Net
+);
+
+NTSTATUS MeshNetParseHeader(
+    _In_reads_bytes_(Length) const UCHAR* Pdu,
+    _In_ ULONG Length,
+    _Out_ PMESH_NETWORK_HEADER Header
+);
+
+NTSTATUS MeshNetConfigure(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ const MESH_CONFIG* Config
+);
+
+ULONG MeshNetProcess(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ MESH_BEARER Bearer,
+    _In_ ULONG ProxyIndex,
+    _In_reads_bytes_(Length) const UCHAR* Pdu,
+    _In_ ULONG Length,
+    _In_ ULONG64 NowUs
+);
+
+BOOLEAN MeshNetDequeue(
+    _Inout_ PMESH_NETWORK Net,
+    _Out_ PMESH_RELAY_ITEM Item
+);
+
+NTSTATUS MeshNetProxyConnect(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ BTH_ADDR DeviceAddress,
+    _Out_ PULONG ProxyIndex
+);
+
+NTSTATUS MeshNetProxyDisconnect(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ ULONG ProxyIndex
+);
+
+NTSTATUS MeshNetProxyAddFilter(
+    _Inout_ PMESH_NETWORK Net,
+    _In_ ULONG ProxyIndex,
+    _In_ USHORT Address
+);
+
+#endif // _MULTIDEVICEBTMESHNET_H_
@@ -0,0 +1,997 @@
+/*++
+
+Module Name:
+    MultiDeviceBTP256.c
+
+Abstract:
+    NIST P-256 (FIPS 186-4, D.1.2.3) for LE Secure Connections.
+
+    Field elements are eight 32-bit limbs in Montgomery form. On 64-bit
+    targets, multiplication regroups them into four 64-bit limbs and
+    uses 128-bit products, a quarter of the multiplies. 32-bit kernels
+    multiply the 32-bit limbs directly; there the prime's sparse form
+    makes the reduction multiplication-free, each step adding and
+    subtracting the low limb at four fixed positions. Either way,
+    reduction ends in a masked subtraction, never a branch.
+
+    Points are homogeneous projective and use the complete addition and
+    doubling formulas for a = -3 of Renes, Costello and Batina (2016,
+    algorithms 4 to 6). They have no special cases: the point at
+    infinity, doubling through the addition formula and adding a point
+    to itself all come out right, so no branch depends on a secret.
+
+    A public key is d * G. The base table holds j * 16^i * G for every
+    4-bit window i, in affine form, so d * G is 64 mixed additions and
+    no doublings. The table entry is read with a masked scan of the
+    whole window, and a zero window is handled by a masked select, so
+    neither the memory access pattern nor the timing depends on d.
+
+    The Diffie-Hellman key is d * Q for the peer's Q: a 4-bit fixed
+    window over 16 multiples of Q, 256 doublings and 64 additions, with
+    the same masked table scan. The peer's key is checked to be on the
+    curve first. Accepting an off-curve point would leak bits of d to an
+    active attacker (the invalid-curve attack on pairing).
+
+    Converting a result to affine form needs one field inversion, a
+    fixed addition chain of 255 squarings. A batch of key pairs shares a
+    single inversion with Montgomery's trick.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_ARM64) || defined(__aarch64__)
+#define P256_WIDE 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define P256_WIDE 0
+#endif
+
+#include "MultiDeviceBTP256.h"
+
+typedef ULONG P256_FE[P256_LIMBS];
+
+typedef struct _P256_POINT {
+    P256_FE X;
+    P256_FE Y;
+    P256_FE Z;
+} P256_POINT, *PP256_POINT;
+
+static const P256_FE P256Prime = {
+    0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x00000000,
+    0x00000000, 0x00000000, 0x00000001, 0xFFFFFFFF
+};
+
+static const P256_FE P256Order = {
+    0xFC632551, 0xF3B9CAC2, 0xA7179E84, 0xBCE6FAAD,
+    0xFFFFFFFF, 0xFFFFFFFF, 0x00000000, 0xFFFFFFFF
+};
+
+// 2^512 mod p, to enter Montgomery form
+static const P256_FE P256R2 = {
+    0x00000003, 0x00000000, 0xFFFFFFFF, 0xFFFFFFFB,
+    0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFD, 0x00000004
+};
+
+// Curve constant b, base point and 1, all in Montgomery form
+static const P256_FE P256B = {
+    0x29C4BDDF, 0xD89CDF62, 0x78843090, 0xACF005CD,
+    0xF7212ED6, 0xE5A220AB, 0x04874834, 0xDC30061D
+};
+
+static const P256_FE P256Gx = {
+    0x18A9143C, 0x79E730D4, 0x5FEDB601, 0x75BA95FC,
+    0x77622510, 0x79FB732B, 0xA53755C6, 0x18905F76
+};
+
+static const P256_FE P256Gy = {
+    0xCE95560A, 0xDDF25357, 0xBA19E45C, 0x8B4AB8E4,
+    0xDD21F325, 0xD2E88688, 0x25885D85, 0x8571FF18
+};
+
+static const P256_FE P256One = {
+    0x00000001, 0x00000000, 0x00000000, 0xFFFFFFFF,
+    0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFE, 0x00000000
+};
+
+//
+// Field arithmetic modulo p
+//
+
+// R = T - p when T (with a carry limb Hi) is at least p, else T
+static __forceinline VOID
+P256FeReduce(
+    _Out_ PULONG R,
+    _In_ const ULONG* T,
+    _In_ ULONG Hi
+)
+{
+    ULONG s[P256_LIMBS];
+    ULONG64 borrow = 0;
+    ULONG take, i;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        ULONG64 d = (ULONG64)T[i] - P256Prime[i] - borrow;
+        s[i] = (ULONG)d;
+        borrow = (d >> 32) & 1;
+    }
+
+    take = 0 - (Hi | (ULONG)(borrow ^ 1));
+    for (i = 0; i < P256_LIMBS; i++) {
+        R[i] = (s[i] & take) | (T[i] & ~take);
+    }
+}
+
+#if P256_WIDE
+
+static __forceinline ULONG64
+P256MulWide(
+    _In_ ULONG64 A,
+    _In_ ULONG64 B,
+    _Out_ PULONG64 High
+)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return _umul128(A, B, High);
+#elif defined(_MSC_VER)
+    *High = __umulh(A, B);
+    return A * B;
+#else
+    unsigned __int128 product = (unsigned __int128)A * B;
+
+    *High = (ULONG64)(product >> 64);
+    return (ULONG64)product;
+#endif
+}
+
+// Montgomery multiplication on four 64-bit limbs. -p^-1 mod 2^64 is 1,
+// so each step's multiplier is the low limb, and m * p0 + t0 is m * 2^64.
+static VOID
+P256FeMul(
+    _Out_ PULONG R,
+    _In_ const ULONG* A,
+    _In_ const ULONG* B
+)
+{
+    static const ULONG64 prime[4] = {
+        0xFFFFFFFFFFFFFFFFULL, 0x00000000FFFFFFFFULL, 0, 0xFFFFFFFF00000001ULL
+    };
+    ULONG64 a[4], b[4], t[6] = { 0 };
+    ULONG result[P256_LIMBS];
+    ULONG i, j;
+
+    for (i = 0; i < 4; i++) {
+        a[i] = A[2 * i] | ((ULONG64)A[2 * i + 1] << 32);
+        b[i] = B[2 * i] | ((ULONG64)B[2 * i + 1] << 32);
+    }
+
+    for (i = 0; i < 4; i++) {
+        ULONG64 c = 0, lo, hi, m;
+
+        for (j = 0; j < 4; j++) {
+            lo = P256MulWide(a[j], b[i], &hi);
+            lo += c;
+            hi += lo < c;
+            lo += t[j];
+            hi += lo < t[j];
+            t[j] = lo;
+            c = hi;
+        }
+        t[4] += c;
+        t[5] = t[4] < c;
+
+        m = t[0];
+        c = m;
+        for (j = 1; j < 4; j++) {
+            lo = P256MulWide(m, prime[j], &hi);
+            lo += c;
+            hi += lo < c;
+            lo += t[j];
+            hi += lo < t[j];
+            t[j - 1] = lo;
+            c = hi;
+        }
+        t[3] = t[4] + c;
+        t[4] = t[5] + (t[3] < c);
+    }
+
+    for (i = 0; i < 4; i++) {
+        result[2 * i] = (ULONG)t[i];
+        result[2 * i + 1] = (ULONG)(t[i] >> 32);
+    }
+
+    P256FeReduce(R, result, (ULONG)t[4]);
+}
+
+#else
+
+static VOID
+P256FeMul(
+    _Out_ PULONG R,
+    _In_ const ULONG* A,
+    _In_ const ULONG* B
+)
+{
+    ULONG t[2 * P256_LIMBS];
+    LONG64 acc[2 * P256_LIMBS + 1];
+    ULONG i, j;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        t[i] = 0;
+    }
+    for (i = 0; i < P256_LIMBS; i++) {
+        ULONG64 c = 0;
+
+        for (j = 0; j < P256_LIMBS; j++) {
+            c += (ULONG64)A[j] * B[i] + t[i + j];
+            t[i + j] = (ULONG)c;
+            c >>= 32;
+        }
+        t[i + P256_LIMBS] = (ULONG)c;
+    }
+
+    for (i = 0; i < 2 * P256_LIMBS; i++) {
+        acc[i] = t[i];
+    }
+    acc[2 * P256_LIMBS] = 0;
+
+    // Montgomery reduction, a limb at a time. -p^-1 mod 2^32 is 1, so
+    // the multiplier is the low limb m itself, and adding m * p is
+    // adding m at 2^96, 2^192 and 2^256 and taking it away at 1 and
+    // 2^224. The low limb then cancels and carries up exactly.
+    for (i = 0; i < P256_LIMBS; i++) {
+        ULONG m = (ULONG)acc[i];
+
+        acc[i + 3] += m;
+        acc[i + 6] += m;
+        acc[i + 7] -= m;
+        acc[i + 8] += m;
+        acc[i + 1] += (acc[i] - m) >> 32;
+    }
+
+    for (i = P256_LIMBS; i < 2 * P256_LIMBS; i++) {
+        acc[i + 1] += acc[i] >> 32;
+        t[i - P256_LIMBS] = (ULONG)acc[i];
+    }
+
+    P256FeReduce(R, t, (ULONG)acc[2 * P256_LIMBS]);
+}
+
+#endif
+
+static __forceinline VOID
+P256FeSquare(
+    _Out_ PULONG R,
+    _In_ const ULONG* A
+)
+{
+    P256FeMul(R, A, A);
+}
+
+static VOID
+P256FeAdd(
+    _Out_ PULONG R,
+    _In_ const ULONG* A,
+    _In_ const ULONG* B
+)
+{
+    ULONG t[P256_LIMBS];
+    ULONG64 c = 0;
+    ULONG i;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        c += (ULONG64)A[i] + B[i];
+        t[i] = (ULONG)c;
+        c >>= 32;
+    }
+
+    P256FeReduce(R, t, (ULONG)c);
+}
+
+static VOID
+P256FeSub(
+    _Out_ PULONG R,
+    _In_ const ULONG* A,
+    _In_ const ULONG* B
+)
+{
+    ULONG t[P256_LIMBS];
+    ULONG64 borrow = 0, c = 0;
+    ULONG mask, i;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        ULONG64 d = (ULONG64)A[i] - B[i] - borrow;
+        t[i] = (ULONG)d;
+        borrow = (d >> 32) & 1;
+    }
+
+    // Add p back when the difference went negative
+    mask = 0 - (ULONG)borrow;
+    for (i = 0; i < P256_LIMBS; i++) {
+        c += (ULONG64)t[i] + (P256Prime[i] & mask);
+        R[i] = (ULONG)c;
+        c >>= 32;
+    }
+}
+
+// R = A where Mask is all ones; R unchanged where it is zero
+static __forceinline VOID
+P256FeSelect(
+    _Inout_ PULONG R,
+    _In_ const ULONG* A,
+    _In_ ULONG Mask
+)
+{
+    ULONG i;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        R[i] ^= (R[i] ^ A[i]) & Mask;
+    }
+}
+
+static BOOLEAN
+P256FeIsZero(
+    _In_ const ULONG* A
+)
+{
+    ULONG bits = 0, i;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        bits |= A[i];
+    }
+
+    return bits == 0;
+}
+
+// TRUE when A, as a plain integer, is below Modulus
+static BOOLEAN
+P256Below(
+    _In_ const ULONG* A,
+    _In_ const ULONG* Modulus
+)
+{
+    ULONG64 borrow = 0;
+    ULONG i;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        borrow = (((ULONG64)A[i] - Modulus[i] - borrow) >> 32) & 1;
+    }
+
+    return borrow != 0;
+}
+
+static VOID
+P256FeFromBytes(
+    _Out_ PULONG R,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* Bytes
+)
+{
+    ULONG i;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        R[i] = (ULONG)Bytes[4 * i] | ((ULONG)Bytes[4 * i + 1] << 8) |
+            ((ULONG)Bytes[4 * i + 2] << 16) | ((ULONG)Bytes[4 * i + 3] << 24);
+    }
+}
+
+static VOID
+P256FeToBytes(
+    _Out_writes_bytes_(P256_BYTES) PUCHAR Bytes,
+    _In_ const ULONG* A
+)
+{
+    ULONG i;
+
+    for (i = 0; i < P256_LIMBS; i++) {
+        Bytes[4 * i] = (UCHAR)A[i];
+        Bytes[4 * i + 1] = (UCHAR)(A[i] >> 8);
+        Bytes[4 * i + 2] = (UCHAR)(A[i] >> 16);
+        Bytes[4 * i + 3] = (UCHAR)(A[i] >> 24);
+    }
+}
+
+static VOID
+P256FeFromMont(
+    _Out_ PULONG R,
+    _In_ const ULONG* A
+)
+{
+    static const P256_FE one = { 1 };
+
+    P256FeMul(R, A, one);
+}
+
+static VOID
+P256FeSquareN(
+    _Inout_ PULONG R,
+    _In_ ULONG Count
+)
+{
+    while (Count-- != 0) {
+        P256FeSquare(R, R);
+    }
+}
+
+// A^(p - 2). p - 2 is, from the top: 32 ones, 31 zeros and a one, 96
+// zeros, 64 ones, then 30 ones, a zero and a one.
+static VOID
+P256FeInvert(
+    _Out_ PULONG R,
+    _In_ const ULONG* A
+)
+{
+    P256_FE x2, x4, x6, x12, x24, x30, x32, t;
+
+    P256FeSquare(x2, A);
+    P256FeMul(x2, x2, A);
+    RtlCopyMemory(x4, x2, sizeof(x4));
+    P256FeSquareN(x4, 2);
+    P256FeMul(x4, x4, x2);
+    RtlCopyMemory(x6, x4, sizeof(x6));
+    P256FeSquareN(x6, 2);
+    P256FeMul(x6, x6, x2);
+    RtlCopyMemory(x12, x6, sizeof(x12));
+    P256FeSquareN(x12, 6);
+    P256FeMul(x12, x12, x6);
+    RtlCopyMemory(x24, x12, sizeof(x24));
+    P256FeSquareN(x24, 12);
+    P256FeMul(x24, x24, x12);
+    RtlCopyMemory(x30, x24, sizeof(x30));
+    P256FeSquareN(x30, 6);
+    P256FeMul(x30, x30, x6);
+    RtlCopyMemory(x32, x30, sizeof(x32));
+    P256FeSquareN(x32, 2);
+    P256FeMul(x32, x32, x2);
+
+    RtlCopyMemory(t, x32, sizeof(t));
+    P256FeSquareN(t, 32);
+    P256FeMul(t, t, A);
+    P256FeSquareN(t, 96 + 32);
+    P256FeMul(t, t, x32);
+    P256FeSquareN(t, 32);
+    P256FeMul(t, t, x32);
+    P256FeSquareN(t, 30);
+    P256FeMul(t, t, x30);
+    P256FeSquareN(t, 2);
+    P256FeMul(R, t, A);
+}
+
+//
+// Point arithmetic, complete formulas for a = -3
+//
+
+static VOID
+P256PointAdd(
+    _Out_ PP256_POINT R,
+    _In_ const P256_POINT* P,
+    _In_ const P256_POINT* Q
+)
+{
+    P256_FE t0, t1, t2, t3, t4, x3, y3, z3;
+
+    P256FeMul(t0, P->X, Q->X);
+    P256FeMul(t1, P->Y, Q->Y);
+    P256FeMul(t2, P->Z, Q->Z);
+    P256FeAdd(t3, P->X, P->Y);
+    P256FeAdd(t4, Q->X, Q->Y);
+    P256FeMul(t3, t3, t4);
+    P256FeAdd(t4, t0, t1);
+    P256FeSub(t3, t3, t4);
+    P256FeAdd(t4, P->Y, P->Z);
+    P256FeAdd(x3, Q->Y, Q->Z);
+    P256FeMul(t4, t4, x3);
+    P256FeAdd(x3, t1, t2);
+    P256FeSub(t4, t4, x3);
+    P256FeAdd(x3, P->X, P->Z);
+    P256FeAdd(y3, Q->X, Q->Z);
+    P256FeMul(x3, x3, y3);
+    P256FeAdd(y3, t0, t2);
+    P256FeSub(y3, x3, y3);
+    P256FeMul(z3, P256B, t2);
+    P256FeSub(x3, y3, z3);
+    P256FeAdd(z3, x3, x3);
+    P256FeAdd(x3, x3, z3);
+    P256FeSub(z3, t1, x3);
+    P256FeAdd(x3, t1, x3);
+    P256FeMul(y3, P256B, y3);
+    P256FeAdd(t1, t2, t2);
+    P256FeAdd(t2, t1, t2);
+    P256FeSub(y3, y3, t2);
+    P256FeSub(y3, y3, t0);
+    P256FeAdd(t1, y3, y3);
+    P256FeAdd(y3, t1, y3);
+    P256FeAdd(t1, t0, t0);
+    P256FeAdd(t0, t1, t0);
+    P256FeSub(t0, t0, t2);
+    P256FeMul(t1, t4, y3);
+    P256FeMul(t2, t0, y3);
+    P256FeMul(y3, x3, z3);
+    P256FeAdd(y3, y3, t2);
+    P256FeMul(x3, t3, x3);
+    P256FeSub(x3, x3, t1);
+    P256FeMul(z3, t4, z3);
+    P256FeMul(t1, t3, t0);
+    P256FeAdd(z3, z3, t1);
+
+    RtlCopyMemory(R->X, x3, sizeof(x3));
+    RtlCopyMemory(R->Y, y3, sizeof(y3));
+    RtlCopyMemory(R->Z, z3, sizeof(z3));
+}
+
+// Q is affine, so it cannot be the point at infinity
+static VOID
+P256PointAddMixed(
+    _Out_ PP256_POINT R,
+    _In_ const P256_POINT* P,
+    _In_ const P256_AFFINE* Q
+)
+{
+    P256_FE t0, t1, t2, t3, t4, x3, y3, z3;
+
+    P256FeMul(t0, P->X, Q->X);
+    P256FeMul(t1, P->Y, Q->Y);
+    P256FeAdd(t3, Q->X, Q->Y);
+    P256FeAdd(t4, P->X, P->Y);
+    P256FeMul(t3, t3, t4);
+    P256FeAdd(t4, t0, t1);
+    P256FeSub(t3, t3, t4);
+    P256FeMul(t4, Q->Y, P->Z);
+    P256FeAdd(t4, t4, P->Y);
+    P256FeMul(y3, Q->X, P->Z);
+    P256FeAdd(y3, y3, P->X);
+    P256FeMul(z3, P256B, P->Z);
+    P256FeSub(x3, y3, z3);
+    P256FeAdd(z3, x3, x3);
+    P256FeAdd(x3, x3, z3);
+    P256FeSub(z3, t1, x3);
+    P256FeAdd(x3, t1, x3);
+    P256FeMul(y3, P256B, y3);
+    P256FeAdd(t1, P->Z, P->Z);
+    P256FeAdd(t2, t1, P->Z);
+    P256FeSub(y3, y3, t2);
+    P256FeSub(y3, y3, t0);
+    P256FeAdd(t1, y3, y3);
+    P256FeAdd(y3, t1, y3);
+    P256FeAdd(t1, t0, t0);
+    P256FeAdd(t0, t1, t0);
+    P256FeSub(t0, t0, t2);
+    P256FeMul(t1, t4, y3);
+    P256FeMul(t2, t0, y3);
+    P256FeMul(y3, x3, z3);
+    P256FeAdd(y3, y3, t2);
+    P256FeMul(x3, t3, x3);
+    P256FeSub(x3, x3, t1);
+    P256FeMul(z3, t4, z3);
+    P256FeMul(t1, t3, t0);
+    P256FeAdd(z3, z3, t1);
+
+    RtlCopyMemory(R->X, x3, sizeof(x3));
+    RtlCopyMemory(R->Y, y3, sizeof(y3));
+    RtlCopyMemory(R->Z, z3, sizeof(z3));
+}
+
+static VOID
+P256PointDouble(
+    _Out_ PP256_POINT R,
+    _In_ const P256_POINT* P
+)
+{
+    P256_FE t0, t1, t2, t3, x3, y3, z3;
+
+    P256FeSquare(t0, P->X);
+    P256FeSquare(t1, P->Y);
+    P256FeSquare(t2, P->Z);
+    P256FeMul(t3, P->X, P->Y);
+    P256FeAdd(t3, t3, t3);
+    P256FeMul(z3, P->X, P->Z);
+    P256FeAdd(z3, z3, z3);
+    P256FeMul(y3, P256B, t2);
+    P256FeSub(y3, y3, z3);
+    P256FeAdd(x3, y3, y3);
+    P256FeAdd(y3, x3, y3);
+    P256FeSub(x3, t1, y3);
+    P256FeAdd(y3, t1, y3);
+    P256FeMul(y3, x3, y3);
+    P256FeMul(x3, x3, t3);
+    P256FeAdd(t3, t2, t2);
+    P256FeAdd(t2, t2, t3);
+    P256FeMul(z3, P256B, z3);
+    P256FeSub(z3, z3, t2);
+    P256FeSub(z3, z3, t0);
+    P256FeAdd(t3, z3, z3);
+    P256FeAdd(z3, z3, t3);
+    P256FeAdd(t3, t0, t0);
+    P256FeAdd(t0, t3, t0);
+    P256FeSub(t0, t0, t2);
+    P256FeMul(t0, t0, z3);
+    P256FeAdd(y3, y3, t0);
+    P256FeMul(t0, P->Y, P->Z);
+    P256FeAdd(t0, t0, t0);
+    P256FeMul(z3, t0, z3);
+    P256FeSub(x3, x3, z3);
+    P256FeMul(t0, t0, t1);
+    P256FeAdd(t0, t0, t0);
+    P256FeAdd(z3, t0, t0);
+
+    RtlCopyMemory(R->X, x3, sizeof(x3));
+    RtlCopyMemory(R->Y, y3, sizeof(y3));
+    RtlCopyMemory(R->Z, z3, sizeof(z3));
+}
+
+static VOID
+P256PointInfinity(
+    _Out_ PP256_POINT R
+)
+{
+    RtlZeroMemory(R, sizeof(*R));
+    RtlCopyMemory(R->Y, P256One, sizeof(P256_FE));
+}
+
+static VOID
+P256PointFromAffine(
+    _Out_ PP256_POINT R,
+    _In_ const P256_AFFINE* A
+)
+{
+    RtlCopyMemory(R->X, A->X, sizeof(P256_FE));
+    RtlCopyMemory(R->Y, A->Y, sizeof(P256_FE));
+    RtlCopyMemory(R->Z, P256One, sizeof(P256_FE));
+}
+
+// All ones when A == B, else zero; both below 16
+static __forceinline ULONG
+P256Equal(
+    _In_ ULONG A,
+    _In_ ULONG B
+)
+{
+    return 0 - (((A ^ B) - 1) >> 31);
+}
+
+static __forceinline ULONG
+P256Window(
+    _In_reads_bytes_(P256_BYTES) const UCHAR* Scalar,
+    _In_ ULONG Window
+)
+{
+    return (Scalar[Window / 2] >> (4 * (Window & 1))) & 0xF;
+}
+
+/*++
+Routine Description:
+    Converts Count projective points to affine with one inversion.
+    Scratch holds Count field elements.
+--*/
+static VOID
+P256Normalize(
+    _In_reads_(Count) const P256_POINT* Points,
+    _Out_writes_(Count) PP256_AFFINE Affine,
+    _In_ ULONG Count,
+    _Out_writes_(Count) P256_FE* Scratch
+)
+{
+    P256_FE inverse, zInverse;
+    ULONG i;
+
+    // Scratch[i] = Z0 * ... * Zi
+    RtlCopyMemory(Scratch[0], Points[0].Z, sizeof(P256_FE));
+    for (i = 1; i < Count; i++) {
+        P256FeMul(Scratch[i], Scratch[i - 1], Points[i].Z);
+    }
+
+    P256FeInvert(inverse, Scratch[Count - 1]);
+
+    for (i = Count; i-- != 0; ) {
+        if (i != 0) {
+            P256FeMul(zInverse, inverse, Scratch[i - 1]);
+            P256FeMul(inverse, inverse, Points[i].Z);
+        } else {
+            RtlCopyMemory(zInverse, inverse, sizeof(P256_FE));
+        }
+        P256FeMul(Affine[i].X, Points[i].X, zInverse);
+        P256FeMul(Affine[i].Y, Points[i].Y, zInverse);
+    }
+
+    RtlSecureZeroMemory(inverse, sizeof(inverse));
+    RtlSecureZeroMemory(zInverse, sizeof(zInverse));
+}
+
+// R = Scalar * G through the base table
+static VOID
+P256MulBase(
+    _Out_ PP256_POINT R,
+    _In_ const P256_BASE_TABLE* Table,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* Scalar
+)
+{
+    P256_AFFINE entry;
+    P256_POINT sum;
+    ULONG window, j, digit, mask;
+
+    P256PointInfinity(R);
+
+    for (window = 0; window < P256_WINDOWS; window++) {
+        digit = P256Window(Scalar, window);
+
+        RtlZeroMemory(&entry, sizeof(entry));
+        for (j = 0; j < P256_WINDOW_POINTS; j++) {
+            mask = P256Equal(j + 1, digit);
+            P256FeSelect(entry.X, Table->Points[window][j].X, mask);
+            P256FeSelect(entry.Y, Table->Points[window][j].Y, mask);
+        }
+
+        // A zero digit computes a sum with nothing and keeps R
+        P256PointAddMixed(&sum, R, &entry);
+        mask = ~P256Equal(0, digit);
+        P256FeSelect(R->X, sum.X, mask);
+        P256FeSelect(R->Y, sum.Y, mask);
+        P256FeSelect(R->Z, sum.Z, mask);
+    }
+
+    RtlSecureZeroMemory(&entry, sizeof(entry));
+    RtlSecureZeroMemory(&sum, sizeof(sum));
+}
+
+// R = Scalar * Q, 4-bit fixed window from the top
+static VOID
+P256Mul(
+    _Out_ PP256_POINT R,
+    _In_ const P256_AFFINE* Q,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* Scalar
+)
+{
+    P256_POINT multiples[1 << P256_WINDOW_BITS];
+    P256_POINT entry;
+    ULONG window, j, digit, mask;
+
+    P256PointInfinity(&multiples[0]);
+    P256PointFromAffine(&multiples[1], Q);
+    for (j = 2; j < ARRAYSIZE(multiples); j++) {
+        if ((j & 1) == 0) {
+            P256PointDouble(&multiples[j], &multiples[j / 2]);
+        } else {
+            P256PointAddMixed(&multiples[j], &multiples[j - 1], Q);
+        }
+    }
+
+    P256PointInfinity(R);
+
+    for (window = P256_WINDOWS; window-- != 0; ) {
+        P256PointDouble(R, R);
+        P256PointDouble(R, R);
+        P256PointDouble(R, R);
+        P256PointDouble(R, R);
+
+        digit = P256Window(Scalar, window);
+        RtlZeroMemory(&entry, sizeof(entry));
+        for (j = 0; j < ARRAYSIZE(multiples); j++) {
+            mask = P256Equal(j, digit);
+            P256FeSelect(entry.X, multiples[j].X, mask);
+            P256FeSelect(entry.Y, multiples[j].Y, mask);
+            P256FeSelect(entry.Z, multiples[j].Z, mask);
+        }
+        P256PointAdd(R, R, &entry);
+    }
+
+    RtlSecureZeroMemory(&entry, sizeof(entry));
+}
+
+/*++
+Routine Description:
+    Fills the base table. About a thousand point additions and 64
+    inversions; run it once and share the table.
+--*/
+VOID
+P256BuildBaseTable(
+    _Out_ PP256_BASE_TABLE Table
+)
+{
+    P256_POINT points[P256_WINDOW_POINTS];
+    P256_FE scratch[P256_WINDOW_POINTS];
+    P256_POINT base;
+    ULONG window, j;
+
+    RtlCopyMemory(base.X, P256Gx, sizeof(P256_FE));
+    RtlCopyMemory(base.Y, P256Gy, sizeof(P256_FE));
+    RtlCopyMemory(base.Z, P256One, sizeof(P256_FE));
+
+    for (window = 0; window < P256_WINDOWS; window++) {
+        points[0] = base;
+        for (j = 1; j < P256_WINDOW_POINTS; j++) {
+            P256PointAdd(&points[j], &points[j - 1], &base);
+        }
+        P256Normalize(points, Table->Points[window], P256_WINDOW_POINTS, scratch);
+
+        for (j = 0; j < P256_WINDOW_BITS; j++) {
+            P256PointDouble(&base, &base);
+        }
+    }
+}
+
+/*++
+Routine Description:
+    Checks that a private key is in [1, n - 1]
+--*/
+BOOLEAN
+P256PrivateKeyValid(
+    _In_reads_bytes_(P256_BYTES) const UCHAR* PrivateKey
+)
+{
+    P256_FE d;
+    BOOLEAN valid;
+
+    P256FeFromBytes(d, PrivateKey);
+    valid = !P256FeIsZero(d) && P256Below(d, P256Order);
+    RtlSecureZeroMemory(d, sizeof(d));
+
+    return valid;
+}
+
+// Checks a public key and returns it in Montgomery form
+static BOOLEAN
+P256LoadPublicKey(
+    _Out_ PP256_AFFINE Point,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* X,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* Y
+)
+{
+    P256_FE lhs, rhs, t;
+
+    P256FeFromBytes(Point->X, X);
+    P256FeFromBytes(Point->Y, Y);
+    if (!P256Below(Point->X, P256Prime) || !P256Below(Point->Y, P256Prime)) {
+        return FALSE;
+    }
+
+    P256FeMul(Point->X, Point->X, P256R2);
+    P256FeMul(Point->Y, Point->Y, P256R2);
+
+    // y^2 == x^3 - 3x + b
+    P256FeSquare(lhs, Point->Y);
+    P256FeSquare(rhs, Point->X);
+    P256FeMul(rhs, rhs, Point->X);
+    P256FeAdd(t, Point->X, Point->X);
+    P256FeAdd(t, t, Point->X);
+    P256FeSub(rhs, rhs, t);
+    P256FeAdd(rhs, rhs, P256B);
+
+    return RtlCompareMemory(lhs, rhs, sizeof(P256_FE)) == sizeof(P256_FE);
+}
+
+/*++
+Routine Description:
+    Checks that a peer's public key is a point on the curve
+--*/
+BOOLEAN
+P256PublicKeyValid(
+    _In_reads_bytes_(P256_BYTES) const UCHAR* X,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* Y
+)
+{
+    P256_AFFINE point;
+
+    return P256LoadPublicKey(&point, X, Y);
+}
+
+/*++
+Routine Description:
+    Computes public keys for private keys the caller has chosen. Key
+    pairs are processed P256_BATCH at a time, each batch sharing one
+    inversion.
+
+Arguments:
+    Table - Base table; NULL multiplies G without one, several times
+        slower
+
+    KeyPairs - PrivateKey set and valid (P256PrivateKeyValid) on entry;
+        PublicX and PublicY filled on return
+
+    Count - Key pairs
+
+Return Value:
+    None
+--*/
+VOID
+P256GenerateKeyPairs(
+    _In_opt_ const P256_BASE_TABLE* Table,
+    _Inout_updates_(Count) PP256_KEYPAIR KeyPairs,
+    _In_ ULONG Count
+)
+{
+    P256_POINT points[P256_BATCH];
+    P256_AFFINE affine[P256_BATCH];
+    P256_FE scratch[P256_BATCH];
+    P256_AFFINE base;
+    ULONG first, batch, i;
+
+    RtlCopyMemory(base.X, P256Gx, sizeof(P256_FE));
+    RtlCopyMemory(base.Y, P256Gy, sizeof(P256_FE));
+
+    for (first = 0; first < Count; first += batch) {
+        batch = min(Count - first, P256_BATCH);
+
+        for (i = 0; i < batch; i++) {
+            if (Table != NULL) {
+                P256MulBase(&points[i], Table, KeyPairs[first + i].PrivateKey);
+            } else {
+                P256Mul(&points[i], &base, KeyPairs[first + i].PrivateKey);
+            }
+        }
+
+        P256Normalize(points, affine, batch, scratch);
+
+        for (i = 0; i < batch; i++) {
+            P256FeFromMont(affine[i].X, affine[i].X);
+            P256FeFromMont(affine[i].Y, affine[i].Y);
+            P256FeToBytes(KeyPairs[first + i].PublicX, affine[i].X);
+            P256FeToBytes(KeyPairs[first + i].PublicY, affine[i].Y);
+        }
+    }
+
+    RtlSecureZeroMemory(points, sizeof(points));
+    RtlSecureZeroMemory(scratch, sizeof(scratch));
+}
+
+/*++
+Routine Description:
+    Computes the LE Secure Connections DHKey: the x coordinate of
+    PrivateKey times the peer's public key
+
+Arguments:
+    PrivateKey - Valid private key (P256PrivateKeyValid)
+
+    PeerX, PeerY - Peer's public key as received
+
+    DhKey - Receives the DHKey, least significant octet first
+
+Return Value:
+    STATUS_INVALID_PARAMETER when the peer's key is not on the curve;
+    DhKey is then zeroed
+--*/
+NTSTATUS
+P256ComputeDhKey(
+    _In_reads_bytes_(P256_BYTES) const UCHAR* PrivateKey,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* PeerX,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* PeerY,
+    _Out_writes_bytes_(P256_BYTES) PUCHAR DhKey
+)
+{
+    P256_AFFINE peer;
+    P256_POINT shared;
+    P256_FE zInverse;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    RtlZeroMemory(DhKey, P256_BYTES);
+
+    if (!P256LoadPublicKey(&peer, PeerX, PeerY)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    P256Mul(&shared, &peer, PrivateKey);
+
+    // Only a private key of 0 or n lands here; callers check for those
+    if (P256FeIsZero(shared.Z)) {
+        status = STATUS_INVALID_PARAMETER;
+    } else {
+        P256FeInvert(zInverse, shared.Z);
+        P256FeMul(shared.X, shared.X, zInverse);
+        P256FeFromMont(shared.X, shared.X);
+        P256FeToBytes(DhKey, shared.X);
+    }
+
+    RtlSecureZeroMemory(&shared, sizeof(shared));
+    RtlSecureZeroMemory(zInverse, sizeof(zInverse));
+
+    return status;
+}
@@ -0,0 +1,72 @@
+/*++
+
+Module Name:
+    MultiDeviceBTP256.h
+
+Abstract:
+    NIST P-256 key generation and Diffie-Hellman for LE Secure
+    Connections pairing (Core Vol 3 Part H, 2.3.5.6). Key generation
+    multiplies the base point through a precomputed table and can run
+    in batches that share the final field inversion. Every operation on
+    a private key runs in constant time.
+
+    Keys and coordinates are 32 octets, least significant octet first,
+    as SMP carries them.
+
+    Portable C; builds in the driver and in user-mode tools.
+
+--*/
+
+#ifndef _MULTIDEVICEBTP256_H_
+#define _MULTIDEVICEBTP256_H_
+
+#define P256_BYTES                  32
+#define P256_LIMBS                  8           // 32-bit limbs per field element
+#define P256_WINDOW_BITS            4
+#define P256_WINDOWS                (256 / P256_WINDOW_BITS)
+#define P256_WINDOW_POINTS          ((1 << P256_WINDOW_BITS) - 1)
+#define P256_BATCH                  16          // Key pairs per shared inversion
+
+typedef struct _P256_AFFINE {
+    ULONG X[P256_LIMBS];        // Montgomery form
+    ULONG Y[P256_LIMBS];
+} P256_AFFINE, *PP256_AFFINE;
+
+// Points[i][j - 1] = j * 16^i * G; 60 KB
+typedef struct _P256_BASE_TABLE {
+    P256_AFFINE Points[P256_WINDOWS][P256_WINDOW_POINTS];
+} P256_BASE_TABLE, *PP256_BASE_TABLE;
+
+typedef struct _P256_KEYPAIR {
+    UCHAR PrivateKey[P256_BYTES];
+    UCHAR PublicX[P256_BYTES];
+    UCHAR PublicY[P256_BYTES];
+} P256_KEYPAIR, *PP256_KEYPAIR;
+
+VOID P256BuildBaseTable(
+    _Out_ PP256_BASE_TABLE Table
+);
+
+BOOLEAN P256PrivateKeyValid(
+    _In_reads_bytes_(P256_BYTES) const UCHAR* PrivateKey
+);
+
+BOOLEAN P256PublicKeyValid(
+    _In_reads_bytes_(P256_BYTES) const UCHAR* X,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* Y
+);
+
+VOID P256GenerateKeyPairs(
+    _In_opt_ const P256_BASE_TABLE* Table,
+    _Inout_updates_(Count) PP256_KEYPAIR KeyPairs,
+    _In_ ULONG Count
+);
+
+NTSTATUS P256ComputeDhKey(
+    _In_reads_bytes_(P256_BYTES) const UCHAR* PrivateKey,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* PeerX,
+    _In_reads_bytes_(P256_BYTES) const UCHAR* PeerY,
+    _Out_writes_bytes_(P256_BYTES) PUCHAR DhKey
+);
+
+#endif // _MULTIDEVICEBTP256_H_
@@ -0,0 +1,514 @@
+/*++
+
+Module Name:
+    MultiDeviceBTPairing.c
+
+Abstract:
+    LE Secure Connections pairing crypto.
+
+    Each pairing needs a fresh P-256 key pair and then one
+    Diffie-Hellman step with the peer's public key. Done on demand, key
+    generation costs as much as the DHKey again. When an installer
+    pairs dozens of appliances back to back, that doubles the CPU time
+    every pairing waits for.
+
+    Key generation is now off the pairing path. A generator thread
+    runs at low priority, so it takes CPU time nothing else wants. It
+    builds the P-256 base table once, then keeps PAIRING_POOL_KEYS key
+    pairs ready. It generates them P256_BATCH at a time, so each batch
+    shares one field inversion. Handing out a public key is a pop from
+    the pool; only an empty pool makes the caller wait for a key pair.
+
+    The private key stays in the driver under a key id until the
+    peer's public key arrives. The DHKey request consumes it, so each
+    key pair serves one pairing. The peer's key is checked to be on the
+    curve before use.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+#include <bcrypt.h>
+
+#include "MultiDeviceBTDriver.h"
+
+#define PAIRING_THREAD_PRIORITY     (LOW_PRIORITY + 1)
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, PairingStart)
+#pragma alloc_text (PAGE, PairingCleanup)
+#endif
+
+static __forceinline ULONG64
+PairingNowUs(VOID)
+{
+    return KeQueryInterruptTime() / 10;
+}
+
+// A uniformly random private key in [1, n - 1]
+static NTSTATUS
+PairingRandomKey(
+    _Out_writes_bytes_(P256_BYTES) PUCHAR PrivateKey
+)
+{
+    NTSTATUS status;
+
+    do {
+        status = BCryptGenRandom(NULL, PrivateKey, P256_BYTES, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    } while (NT_SUCCESS(status) && !P256PrivateKeyValid(PrivateKey));
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Initializes an empty pairing context. The generator starts with
+    PairingStart.
+--*/
+VOID
+PairingInitialize(
+    _Out_ PPAIRING_CONTEXT Pairing
+)
+{
+    RtlZeroMemory(Pairing, sizeof(*Pairing));
+    ExInitializePushLock(&Pairing->StartLock);
+    KeInitializeSpinLock(&Pairing->Lock);
+    KeInitializeEvent(&Pairing->WakeEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&Pairing->StopEvent, NotificationEvent, FALSE);
+}
+
+/*++
+Routine Description:
+    Generator thread. Builds the base table, then refills the key pair
+    pool whenever it drops below PAIRING_REFILL_BELOW, until stopped.
+
+Arguments:
+    StartContext - The pairing context
+
+Return Value:
+    None
+--*/
+static VOID
+PairingGeneratorThread(
+    _In_ PVOID StartContext
+)
+{
+    PPAIRING_CONTEXT pairing = (PPAIRING_CONTEXT)StartContext;
+    P256_KEYPAIR batch[P256_BATCH];
+    PP256_BASE_TABLE table;
+    PVOID waitObjects[2];
+    NTSTATUS status;
+    ULONG64 start;
+    ULONG count, i;
+    KIRQL irql;
+
+    KeSetPriorityThread(KeGetCurrentThread(), PAIRING_THREAD_PRIORITY);
+
+    // Without a table the pool still fills, only more slowly
+    start = PairingNowUs();
+    table = (PP256_BASE_TABLE)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        sizeof(P256_BASE_TABLE), PAIRING_POOL_TAG);
+    if (table != NULL) {
+        P256BuildBaseTable(table);
+
+        KeAcquireSpinLock(&pairing->Lock, &irql);
+        pairing->Table = table;
+        pairing->Stats.TableReady = TRUE;
+        pairing->Stats.TableBuildUs = (ULONG)(PairingNowUs() - start);
+        KeReleaseSpinLock(&pairing->Lock, irql);
+    }
+
+    waitObjects[0] = &pairing->WakeEvent;
+    waitObjects[1] = &pairing->StopEvent;
+
+    while (!pairing->Stopping) {
+        KeAcquireSpinLock(&pairing->Lock, &irql);
+        count = min(PAIRING_POOL_KEYS - pairing->Ready, P256_BATCH);
+        KeReleaseSpinLock(&pairing->Lock, irql);
+
+        if (count == 0) {
+            status = KeWaitForMultipleObjects(2, waitObjects, WaitAny,
+                Executive, KernelMode, FALSE, NULL, NULL);
+            if (status == STATUS_WAIT_1) {
+                break;
+            }
+            continue;
+        }
+
+        start = PairingNowUs();
+        for (i = 0; i < count; i++) {
+            status = PairingRandomKey(batch[i].PrivateKey);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+        }
+        if (i < count) {
+            KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+                "MultiDeviceBT: Pairing key generator stopped, no random numbers - 0x%x\n",
+                status));
+            KeWaitForSingleObject(&pairing->StopEvent, Executive, KernelMode, FALSE, NULL);
+            break;
+        }
+
+        P256GenerateKeyPairs(table, batch, count);
+
+        // Handlers only take from the pool, so the room counted above is still there
+        KeAcquireSpinLock(&pairing->Lock, &irql);
+        for (i = 0; i < count; i++) {
+            pairing->Pool[pairing->Ready++] = batch[i];
+        }
+        pairing->Stats.KeysGenerated += count;
+        pairing->Stats.LastBatchUs = (ULONG)(PairingNowUs() - start);
+        KeReleaseSpinLock(&pairing->Lock, irql);
+
+        RtlSecureZeroMemory(batch, sizeof(batch));
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/*++
+Routine Description:
+    Starts the generator thread if it is not running. Called as the
+    adapter starts, so the pool is full before the first pairing.
+
+Arguments:
+    Pairing - Pairing context
+
+Return Value:
+    NTSTATUS. Pairing still works without the thread, generating each
+    key pair on demand.
+--*/
+NTSTATUS
+PairingStart(
+    _Inout_ PPAIRING_CONTEXT Pairing
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    HANDLE threadHandle;
+
+    PAGED_CODE();
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Pairing->StartLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    if (Pairing->Thread != NULL || Pairing->Stopping) {
+        goto Exit;
+    }
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL,
+        NULL, NULL, PairingGeneratorThread, Pairing);
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, *PsThreadType,
+        KernelMode, (PVOID*)&Pairing->Thread, NULL);
+    ZwClose(threadHandle);
+
+    if (!NT_SUCCESS(status)) {
+        // The thread sees the stop event at its first wait and exits
+        InterlockedExchange(&Pairing->Stopping, 1);
+        KeSetEvent(&Pairing->StopEvent, IO_NO_INCREMENT, FALSE);
+        Pairing->Thread = NULL;
+    }
+
+Exit:
+    ExReleasePushLockExclusiveEx(&Pairing->StartLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+    return status;
+}
+
+/*++
+Routine Description:
+    Stops the generator thread and wipes every private key; called from
+    device cleanup
+--*/
+VOID
+PairingCleanup(
+    _Inout_ PPAIRING_CONTEXT Pairing
+)
+{
+    PAGED_CODE();
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Pairing->StartLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    InterlockedExchange(&Pairing->Stopping, 1);
+    KeSetEvent(&Pairing->StopEvent, IO_NO_INCREMENT, FALSE);
+
+    if (Pairing->Thread != NULL) {
+        KeWaitForSingleObject(Pairing->Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(Pairing->Thread);
+        Pairing->Thread = NULL;
+    }
+
+    ExReleasePushLockExclusiveEx(&Pairing->StartLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+
+    if (Pairing->Table != NULL) {
+        ExFreePoolWithTag(Pairing->Table, PAIRING_POOL_TAG);
+        Pairing->Table = NULL;
+    }
+
+    RtlSecureZeroMemory(Pairing->Pool, sizeof(Pairing->Pool));
+    RtlSecureZeroMemory(Pairing->Sessions, sizeof(Pairing->Sessions));
+    Pairing->Ready = 0;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_PAIRING_GET_PUBLIC_KEY: hands out a key pair
+    for one pairing. The public key goes to the caller; the private key
+    stays here under the returned key id.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    OutputBufferLength - Length of output buffer
+    BytesReturned - Receives sizeof(PAIRING_PUBLIC_KEY)
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandlePairingGetPublicKey(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PPAIRING_CONTEXT pairing = &DeviceContext->Pairing;
+    PPAIRING_PUBLIC_KEY output;
+    PPAIRING_SESSION session;
+    const P256_BASE_TABLE* table;
+    P256_KEYPAIR keyPair;
+    BOOLEAN pooled, refill;
+    NTSTATUS status;
+    ULONG keyId, i;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(PAIRING_PUBLIC_KEY), (PVOID*)&output, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&pairing->Lock, &irql);
+    pooled = pairing->Ready != 0;
+    if (pooled) {
+        pairing->Ready--;
+        keyPair = pairing->Pool[pairing->Ready];
+        RtlSecureZeroMemory(&pairing->Pool[pairing->Ready], sizeof(P256_KEYPAIR));
+        pairing->Stats.PoolHits++;
+    } else {
+        pairing->Stats.PoolMisses++;
+    }
+    refill = pairing->Ready < PAIRING_REFILL_BELOW;
+    table = pairing->Table;
+    KeReleaseSpinLock(&pairing->Lock, irql);
+
+    if (refill) {
+        KeSetEvent(&pairing->WakeEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    if (!pooled) {
+        status = PairingRandomKey(keyPair.PrivateKey);
+        if (!NT_SUCCESS(status)) {
+            RtlSecureZeroMemory(&keyPair, sizeof(keyPair));
+            return status;
+        }
+        P256GenerateKeyPairs(table, &keyPair, 1);
+    }
+
+    // A free slot, or else the longest-waiting pairing, which has most
+    // likely been abandoned
+    KeAcquireSpinLock(&pairing->Lock, &irql);
+    session = &pairing->Sessions[0];
+    for (i = 0; i < PAIRING_MAX_SESSIONS; i++) {
+        if (pairing->Sessions[i].KeyId == 0) {
+            session = &pairing->Sessions[i];
+            break;
+        }
+        if (pairing->Sessions[i].IssuedUs < session->IssuedUs) {
+            session = &pairing->Sessions[i];
+        }
+    }
+    if (session->KeyId != 0) {
+        pairing->Stats.SessionsEvicted++;
+    } else {
+        pairing->Stats.SessionsOpen++;
+    }
+
+    if (++pairing->NextKeyId == 0) {
+        pairing->NextKeyId = 1;
+    }
+    keyId = pairing->NextKeyId;
+    session->KeyId = keyId;
+    session->IssuedUs = PairingNowUs();
+    RtlCopyMemory(session->PrivateKey, keyPair.PrivateKey, P256_BYTES);
+    pairing->Stats.KeysIssued++;
+    KeReleaseSpinLock(&pairing->Lock, irql);
+
+    output->KeyId = keyId;
+    output->Reserved = 0;
+    RtlCopyMemory(output->X, keyPair.PublicX, P256_BYTES);
+    RtlCopyMemory(output->Y, keyPair.PublicY, P256_BYTES);
+
+    RtlSecureZeroMemory(&keyPair, sizeof(keyPair));
+
+    *BytesReturned = sizeof(PAIRING_PUBLIC_KEY);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_PAIRING_DHKEY: computes the DHKey from the
+    peer's public key and the private key named by KeyId, which is then
+    wiped
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    OutputBufferLength - Length of output buffer
+    BytesReturned - Receives P256_BYTES
+
+Return Value:
+    STATUS_NOT_FOUND for an unknown or already used key id;
+    STATUS_INVALID_PARAMETER when the peer's key is not on the curve,
+    which fails the pairing
+--*/
+NTSTATUS
+HandlePairingComputeDhKey(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PPAIRING_CONTEXT pairing = &DeviceContext->Pairing;
+    PPAIRING_DHKEY_REQUEST input;
+    PAIRING_DHKEY_REQUEST request;
+    UCHAR privateKey[P256_BYTES];
+    UCHAR dhKey[P256_BYTES];
+    BOOLEAN found = FALSE;
+    PUCHAR output;
+    NTSTATUS status;
+    ULONG64 start;
+    ULONG elapsed, i;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(PAIRING_DHKEY_REQUEST), (PVOID*)&input, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // The output shares the system buffer with the input
+    request = *input;
+
+    status = WdfRequestRetrieveOutputBuffer(Request, P256_BYTES, (PVOID*)&output, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&pairing->Lock, &irql);
+    for (i = 0; i < PAIRING_MAX_SESSIONS && request.KeyId != 0; i++) {
+        PPAIRING_SESSION session = &pairing->Sessions[i];
+
+        if (session->KeyId == request.KeyId) {
+            RtlCopyMemory(privateKey, session->PrivateKey, P256_BYTES);
+            RtlSecureZeroMemory(session, sizeof(*session));
+            pairing->Stats.SessionsOpen--;
+            found = TRUE;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&pairing->Lock, irql);
+
+    if (!found) {
+        return STATUS_NOT_FOUND;
+    }
+
+    start = PairingNowUs();
+    status = P256ComputeDhKey(privateKey, request.PeerX, request.PeerY, dhKey);
+    elapsed = (ULONG)(PairingNowUs() - start);
+    RtlSecureZeroMemory(privateKey, sizeof(privateKey));
+
+    KeAcquireSpinLock(&pairing->Lock, &irql);
+    if (NT_SUCCESS(status)) {
+        pairing->Stats.DhKeys++;
+        pairing->Stats.LastDhUs = elapsed;
+        pairing->Stats.MaxDhUs = max(pairing->Stats.MaxDhUs, elapsed);
+    } else {
+        pairing->Stats.InvalidPeerKeys++;
+    }
+    KeReleaseSpinLock(&pairing->Lock, irql);
+
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_WARNING_LEVEL,
+            "MultiDeviceBT: Pairing key %u: peer public key is not on the curve\n",
+            request.KeyId));
+        return status;
+    }
+
+    RtlCopyMemory(output, dhKey, P256_BYTES);
+    RtlSecureZeroMemory(dhKey, sizeof(dhKey));
+
+    *BytesReturned = P256_BYTES;
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_PAIRING_STATS
+--*/
+NTSTATUS
+HandleGetPairingStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    PPAIRING_CONTEXT pairing = &DeviceContext->Pairing;
+    NTSTATUS status;
+    PPAIRING_STATS stats;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(PAIRING_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&pairing->Lock, &irql);
+    *stats = pairing->Stats;
+    stats->PoolReady = pairing->Ready;
+    stats->PoolSize = PAIRING_POOL_KEYS;
+    KeReleaseSpinLock(&pairing->Lock, irql);
+
+    *BytesReturned = sizeof(PAIRING_STATS);
+    return STATUS_SUCCESS;
+}
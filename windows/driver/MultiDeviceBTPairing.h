@@ -0,0 +1,94 @@
+/*++
+
+Module Name:
+    MultiDeviceBTPairing.h
+
+Abstract:
+    LE Secure Connections pairing crypto: the local P-256 key pair for
+    each pairing and the DHKey (MultiDeviceBTP256.h). A low-priority
+    thread builds the base table and keeps a pool of key pairs ready,
+    so a pairing spends only the Diffie-Hellman step on the CPU. The
+    pairing agent in user mode runs f5 and f6 over the DHKey and stores
+    the resulting keys through the bond store.
+
+--*/
+
+#ifndef _MULTIDEVICEBTPAIRING_H_
+#define _MULTIDEVICEBTPAIRING_H_
+
+#include "MultiDeviceBTP256.h"
+
+#define PAIRING_POOL_TAG            'EDBM'
+#define PAIRING_POOL_KEYS           64      // Covers an installation burst of 50 devices
+#define PAIRING_REFILL_BELOW        48      // Wake the generator when fewer are ready
+#define PAIRING_MAX_SESSIONS        64      // Key pairs handed out, awaiting the peer's key
+
+// IOCTL_MULTI_BT_PAIRING_GET_PUBLIC_KEY output
+typedef struct _PAIRING_PUBLIC_KEY {
+    ULONG KeyId;                // Names the private key to IOCTL_MULTI_BT_PAIRING_DHKEY
+    ULONG Reserved;
+    UCHAR X[P256_BYTES];        // Least significant octet first, as SMP sends it
+    UCHAR Y[P256_BYTES];
+} PAIRING_PUBLIC_KEY, *PPAIRING_PUBLIC_KEY;
+
+// IOCTL_MULTI_BT_PAIRING_DHKEY input; the output is the DHKey, P256_BYTES
+typedef struct _PAIRING_DHKEY_REQUEST {
+    ULONG KeyId;
+    ULONG Reserved;
+    UCHAR PeerX[P256_BYTES];
+    UCHAR PeerY[P256_BYTES];
+} PAIRING_DHKEY_REQUEST, *PPAIRING_DHKEY_REQUEST;
+
+typedef struct _PAIRING_STATS {
+    ULONG PoolReady;
+    ULONG PoolSize;
+    ULONG SessionsOpen;
+    BOOLEAN TableReady;
+    UCHAR Reserved[3];
+    ULONG64 KeysIssued;
+    ULONG64 PoolHits;
+    ULONG64 PoolMisses;         // Generated while the caller waited
+    ULONG64 KeysGenerated;      // By the generator thread
+    ULONG64 DhKeys;
+    ULONG64 InvalidPeerKeys;    // Not on the curve
+    ULONG64 SessionsEvicted;    // Oldest unfinished pairing dropped for a new one
+    ULONG TableBuildUs;
+    ULONG LastBatchUs;          // Generator, per P256_BATCH key pairs
+    ULONG LastDhUs;
+    ULONG MaxDhUs;
+} PAIRING_STATS, *PPAIRING_STATS;
+
+typedef struct _PAIRING_SESSION {
+    ULONG KeyId;                // 0 when the slot is free
+    ULONG64 IssuedUs;
+    UCHAR PrivateKey[P256_BYTES];
+} PAIRING_SESSION, *PPAIRING_SESSION;
+
+typedef struct _PAIRING_CONTEXT {
+    EX_PUSH_LOCK StartLock;     // Thread start and stop, at PASSIVE_LEVEL
+    KSPIN_LOCK Lock;            // Pool, sessions and stats
+    KEVENT WakeEvent;           // Pool below PAIRING_REFILL_BELOW
+    KEVENT StopEvent;
+    PKTHREAD Thread;
+    volatile LONG Stopping;
+    PP256_BASE_TABLE Table;     // Set once by the generator thread; NULL until then
+    ULONG Ready;                // Key pairs in Pool
+    ULONG NextKeyId;
+    P256_KEYPAIR Pool[PAIRING_POOL_KEYS];
+    PAIRING_SESSION Sessions[PAIRING_MAX_SESSIONS];
+    PAIRING_STATS Stats;
+} PAIRING_CONTEXT, *PPAIRING_CONTEXT;
+
+VOID PairingInitialize(
+    _Out_ PPAIRING_CONTEXT Pairing
+);
+
+NTSTATUS PairingStart(
+    _Inout_ PPAIRING_CONTEXT Pairing
+);
+
+VOID PairingCleanup(
+    _Inout_ PPAIRING_CONTEXT Pairing
+);
+
+#endif // _MULTIDEVICEBTPAIRING_H_
@@ -0,0 +1,303 @@
+/*++
+
+Module Name:
+    MultiDeviceBTPlacement.c
+
+Abstract:
+    Adapter placement policy for hosts with several radios. New
+    connections go to the adapter with the lowest combined connection
+    count, airtime and RSSI penalty. A LOW priority link on a congested
+    adapter moves only to a quiet adapter known to hear the device well
+    enough.
+
+    RSSI comes from advertising reports and from reads on connected
+    links, kept per device in a direct-mapped cache.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTPlacement.h"
+
+// Placement score weights (score is lower-is-better, in permille units)
+#define ADAPTER_WEIGHT_CONNECTIONS      2
+#define ADAPTER_WEIGHT_AIRTIME          1
+#define ADAPTER_RSSI_GOOD_DBM           (-50)
+#define ADAPTER_RSSI_PENALTY_PER_DB     10
+#define ADAPTER_RSSI_UNKNOWN_PENALTY    200
+#define ADAPTER_RSSI_MIGRATE_MIN_DBM    (-85)
+
+// CONNECTION_PRIORITY values at or below this weigh RSSI double
+#define ADAPTER_PRIORITY_HIGH           1
+#define ADAPTER_PRIORITY_LOW            3
+
+static __forceinline ULONG
+AdapterRssiIndex(
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    return (ULONG)((DeviceAddress * 0x9E3779B97F4A7C15ULL) >> 32) & (ADAPTER_RSSI_CACHE_SIZE - 1);
+}
+
+/*++
+Routine Description:
+    Marks every cache entry unknown on every adapter
+
+Arguments:
+    Cache - ADAPTER_RSSI_CACHE_SIZE entries
+
+Return Value:
+    None
+--*/
+VOID
+AdapterRssiInitialize(
+    _Out_writes_(ADAPTER_RSSI_CACHE_SIZE) PADAPTER_RSSI_ENTRY Cache
+)
+{
+    ULONG i;
+
+    for (i = 0; i < ADAPTER_RSSI_CACHE_SIZE; i++) {
+        Cache[i].DeviceAddress = BTH_ADDR_NULL;
+        RtlFillMemory(Cache[i].Rssi, sizeof(Cache[i].Rssi), (UCHAR)ADAPTER_RSSI_UNKNOWN);
+    }
+}
+
+/*++
+Routine Description:
+    Records the RSSI at which an adapter hears a device. A colliding
+    device replaces the previous entry.
+
+Arguments:
+    Cache - RSSI cache
+    Adapter - Adapter index
+    DeviceAddress - Observed device (identity address)
+    Rssi - Signal strength in dBm
+
+Return Value:
+    None
+--*/
+VOID
+AdapterRssiRecord(
+    _Inout_updates_(ADAPTER_RSSI_CACHE_SIZE) PADAPTER_RSSI_ENTRY Cache,
+    _In_ ULONG Adapter,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ CHAR Rssi
+)
+{
+    PADAPTER_RSSI_ENTRY entry = &Cache[AdapterRssiIndex(DeviceAddress)];
+
+    if (Adapter >= MAX_BLUETOOTH_ADAPTERS) {
+        return;
+    }
+
+    if (entry->DeviceAddress != DeviceAddress) {
+        entry->DeviceAddress = DeviceAddress;
+        RtlFillMemory(entry->Rssi, sizeof(entry->Rssi), (UCHAR)ADAPTER_RSSI_UNKNOWN);
+    }
+    entry->Rssi[Adapter] = Rssi;
+}
+
+/*++
+Routine Description:
+    Forgets everything an adapter has heard, as when it goes away
+
+Arguments:
+    Cache - RSSI cache
+    Adapter - Adapter index
+
+Return Value:
+    None
+--*/
+VOID
+AdapterRssiForget(
+    _Inout_updates_(ADAPTER_RSSI_CACHE_SIZE) PADAPTER_RSSI_ENTRY Cache,
+    _In_ ULONG Adapter
+)
+{
+    ULONG i;
+
+    if (Adapter >= MAX_BLUETOOTH_ADAPTERS) {
+        return;
+    }
+
+    for (i = 0; i < ADAPTER_RSSI_CACHE_SIZE; i++) {
+        Cache[i].Rssi[Adapter] = ADAPTER_RSSI_UNKNOWN;
+    }
+}
+
+/*++
+Routine Description:
+    Returns the RSSI at which an adapter last heard a device
+
+Return Value:
+    RSSI in dBm, or ADAPTER_RSSI_UNKNOWN
+--*/
+CHAR
+AdapterRssiLookup(
+    _In_reads_(ADAPTER_RSSI_CACHE_SIZE) const ADAPTER_RSSI_ENTRY* Cache,
+    _In_ ULONG Adapter,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    const ADAPTER_RSSI_ENTRY* entry = &Cache[AdapterRssiIndex(DeviceAddress)];
+
+    if (Adapter >= MAX_BLUETOOTH_ADAPTERS || entry->DeviceAddress != DeviceAddress) {
+        return ADAPTER_RSSI_UNKNOWN;
+    }
+    return entry->Rssi[Adapter];
+}
+
+/*++
+Routine Description:
+    Scores an adapter for a device
+
+Arguments:
+    Cache - RSSI cache
+    Adapters - MAX_BLUETOOTH_ADAPTERS adapter states
+    Adapter - Adapter to score
+    DeviceAddress - Device to place
+    Priority - CONNECTION_PRIORITY of the link
+
+Return Value:
+    Score (lower is better), or MAXULONG if the adapter is absent or full
+--*/
+ULONG
+AdapterPlacementScore(
+    _In_reads_(ADAPTER_RSSI_CACHE_SIZE) const ADAPTER_RSSI_ENTRY* Cache,
+    _In_reads_(MAX_BLUETOOTH_ADAPTERS) const ADAPTER_STATE* Adapters,
+    _In_ ULONG Adapter,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ ULONG Priority
+)
+{
+    const ADAPTER_STATE* state = &Adapters[Adapter];
+    ULONG rssiPenalty = ADAPTER_RSSI_UNKNOWN_PENALTY;
+    CHAR rssi;
+
+    if (!state->Present || state->MaxConnections == 0 ||
+        state->Connections >= state->MaxConnections) {
+        return MAXULONG;
+    }
+
+    rssi = AdapterRssiLookup(Cache, Adapter, DeviceAddress);
+    if (rssi != ADAPTER_RSSI_UNKNOWN) {
+        rssiPenalty = rssi >= ADAPTER_RSSI_GOOD_DBM ? 0 :
+            (ULONG)(ADAPTER_RSSI_GOOD_DBM - rssi) * ADAPTER_RSSI_PENALTY_PER_DB;
+    }
+
+    // Latency-sensitive links care more about a clean signal than about load
+    if (Priority <= ADAPTER_PRIORITY_HIGH) {
+        rssiPenalty *= 2;
+    }
+
+    return ADAPTER_WEIGHT_CONNECTIONS * (state->Connections * 1000 / state->MaxConnections) +
+        ADAPTER_WEIGHT_AIRTIME * state->AirtimePermille +
+        rssiPenalty;
+}
+
+/*++
+Routine Description:
+    Chooses the adapter a new connection should be placed on
+
+Arguments:
+    Cache - RSSI cache
+    Adapters - MAX_BLUETOOTH_ADAPTERS adapter states
+    DeviceAddress - Device about to be connected
+    Priority - Requested CONNECTION_PRIORITY
+    Score - Optionally receives the winning score
+
+Return Value:
+    Adapter index, or ADAPTER_NONE if every adapter is full
+--*/
+ULONG
+AdapterPlacementSelect(
+    _In_reads_(ADAPTER_RSSI_CACHE_SIZE) const ADAPTER_RSSI_ENTRY* Cache,
+    _In_reads_(MAX_BLUETOOTH_ADAPTERS) const ADAPTER_STATE* Adapters,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ ULONG Priority,
+    _Out_opt_ PULONG Score
+)
+{
+    ULONG best = ADAPTER_NONE;
+    ULONG bestScore = MAXULONG;
+    ULONG i;
+
+    for (i = 0; i < MAX_BLUETOOTH_ADAPTERS; i++) {
+        ULONG score = AdapterPlacementScore(Cache, Adapters, i, DeviceAddress, Priority);
+
+        if (score < bestScore) {
+            bestScore = score;
+            best = i;
+        }
+    }
+
+    if (Score != NULL) {
+        *Score = bestScore;
+    }
+
+    return best;
+}
+
+/*++
+Routine Description:
+    Chooses where a LOW priority link on a congested adapter should
+    move: the best scoring adapter that is quiet and hears the device
+    at a usable RSSI. An adapter that has never heard the device is
+    never chosen.
+
+Arguments:
+    Cache - RSSI cache
+    Adapters - MAX_BLUETOOTH_ADAPTERS adapter states
+    Source - Adapter the link is on
+    DeviceAddress - Linked device
+
+Return Value:
+    Target adapter index, or ADAPTER_NONE to leave the link where it is
+--*/
+ULONG
+AdapterPlacementMigrationTarget(
+    _In_reads_(ADAPTER_RSSI_CACHE_SIZE) const ADAPTER_RSSI_ENTRY* Cache,
+    _In_reads_(MAX_BLUETOOTH_ADAPTERS) const ADAPTER_STATE* Adapters,
+    _In_ ULONG Source,
+    _In_ BTH_ADDR DeviceAddress
+)
+{
+    ULONG target = ADAPTER_NONE;
+    ULONG targetScore = MAXULONG;
+    ULONG t;
+
+    for (t = 0; t < MAX_BLUETOOTH_ADAPTERS; t++) {
+        const ADAPTER_STATE* candidate = &Adapters[t];
+        CHAR rssi;
+        ULONG score;
+
+        if (t == Source || !candidate->Present || candidate->Congested ||
+            candidate->AirtimePermille >= ADAPTER_TARGET_MAX_PERMILLE) {
+            continue;
+        }
+
+        rssi = AdapterRssiLookup(Cache, t, DeviceAddress);
+        if (rssi == ADAPTER_RSSI_UNKNOWN || rssi < ADAPTER_RSSI_MIGRATE_MIN_DBM) {
+            continue;
+        }
+
+        score = AdapterPlacementScore(Cache, Adapters, t, DeviceAddress, ADAPTER_PRIORITY_LOW);
+        if (score < targetScore) {
+            targetScore = score;
+            target = t;
+        }
+    }
+
+    return target;
+}
@@ -0,0 +1,86 @@
+/*++
+
+Module Name:
+    MultiDeviceBTPlacement.h
+
+Abstract:
+    Adapter placement policy: the RSSI at which each adapter hears a
+    device, the score a new connection is placed by, and the adapter a
+    LOW priority link on a congested radio migrates to.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the time, the storage and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTPLACEMENT_H_
+#define _MULTIDEVICEBTPLACEMENT_H_
+
+#define MAX_BLUETOOTH_ADAPTERS          4
+#define ADAPTER_RSSI_CACHE_SIZE         256     // Power of two
+#define ADAPTER_RSSI_UNKNOWN            ((CHAR)-128)
+#define ADAPTER_TARGET_MAX_PERMILLE     500     // Migration target must be below
+#define ADAPTER_NONE                    0xFFFFFFFF
+
+// Last RSSI observed for a device on each adapter
+typedef struct _ADAPTER_RSSI_ENTRY {
+    BTH_ADDR DeviceAddress;
+    CHAR Rssi[MAX_BLUETOOTH_ADAPTERS];
+} ADAPTER_RSSI_ENTRY, *PADAPTER_RSSI_ENTRY;
+
+// One adapter as the policy sees it, filled in by the caller
+typedef struct _ADAPTER_STATE {
+    BOOLEAN Present;
+    BOOLEAN Congested;
+    UCHAR Reserved[2];
+    ULONG Connections;
+    ULONG MaxConnections;
+    ULONG AirtimePermille;
+} ADAPTER_STATE, *PADAPTER_STATE;
+
+VOID AdapterRssiInitialize(
+    _Out_writes_(ADAPTER_RSSI_CACHE_SIZE) PADAPTER_RSSI_ENTRY Cache
+);
+
+VOID AdapterRssiRecord(
+    _Inout_updates_(ADAPTER_RSSI_CACHE_SIZE) PADAPTER_RSSI_ENTRY Cache,
+    _In_ ULONG Adapter,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ CHAR Rssi
+);
+
+VOID AdapterRssiForget(
+    _Inout_updates_(ADAPTER_RSSI_CACHE_SIZE) PADAPTER_RSSI_ENTRY Cache,
+    _In_ ULONG Adapter
+);
+
+CHAR AdapterRssiLookup(
+    _In_reads_(ADAPTER_RSSI_CACHE_SIZE) const ADAPTER_RSSI_ENTRY* Cache,
+    _In_ ULONG Adapter,
+    _In_ BTH_ADDR DeviceAddress
+);
+
+ULONG AdapterPlacementScore(
+    _In_reads_(ADAPTER_RSSI_CACHE_SIZE) const ADAPTER_RSSI_ENTRY* Cache,
+    _In_reads_(MAX_BLUETOOTH_ADAPTERS) const ADAPTER_STATE* Adapters,
+    _In_ ULONG Adapter,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ ULONG Priority
+);
+
+ULONG AdapterPlacementSelect(
+    _In_reads_(ADAPTER_RSSI_CACHE_SIZE) const ADAPTER_RSSI_ENTRY* Cache,
+    _In_reads_(MAX_BLUETOOTH_ADAPTERS) const ADAPTER_STATE* Adapters,
+    _In_ BTH_ADDR DeviceAddress,
+    _In_ ULONG Priority,
+    _Out_opt_ PULONG Score
+);
+
+ULONG AdapterPlacementMigrationTarget(
+    _In_reads_(ADAPTER_RSSI_CACHE_SIZE) const ADAPTER_RSSI_ENTRY* Cache,
+    _In_reads_(MAX_BLUETOOTH_ADAPTERS) const ADAPTER_STATE* Adapters,
+    _In_ ULONG Source,
+    _In_ BTH_ADDR DeviceAddress
+);
+
+#endif // _MULTIDEVICEBTPLACEMENT_H_
@@ -0,0 +1,145 @@
+/*++
+
+Module Name:
+    MultiDeviceBTPortable.h
+
+Abstract:
+    The Windows types, status codes, Rtl helpers and annotations the
+    portable modules and their benchmarks use, for building them with a
+    non-Windows compiler (the user-mode benchmarks on Linux). Included
+    only when neither _KERNEL_MODE nor _WIN32 is defined; sizes match
+    the Windows ABI.
+
+--*/
+
+#ifndef _MULTIDEVICEBTPORTABLE_H_
+#define _MULTIDEVICEBTPORTABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VOID void
+
+typedef char CHAR;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint8_t BOOLEAN, *PBOOLEAN;
+typedef int16_t SHORT;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG, LONG64, *PLONGLONG;
+typedef uint64_t ULONGLONG, ULONG64, *PULONG64;
+typedef size_t SIZE_T;
+typedef void* PVOID;
+typedef LONG NTSTATUS;
+
+typedef ULONGLONG BTH_ADDR;
+
+#define TRUE    1
+#define FALSE   0
+
+#define MAXUCHAR    0xFF
+#define MAXULONG    0xFFFFFFFFU
+#define MAXLONGLONG 0x7FFFFFFFFFFFFFFFLL
+
+#define BTH_ADDR_NULL   0ULL
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_DEVICE_BUSY              ((NTSTATUS)0x80000011L)
+#define STATUS_NO_MORE_ENTRIES          ((NTSTATUS)0x8000001AL)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_DATA_ERROR               ((NTSTATUS)0xC000003EL)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_FILE_CORRUPT_ERROR       ((NTSTATUS)0xC0000102L)
+#define STATUS_INVALID_DEVICE_STATE     ((NTSTATUS)0xC0000184L)
+#define STATUS_INVALID_BUFFER_SIZE      ((NTSTATUS)0xC0000206L)
+#define STATUS_NOT_FOUND                ((NTSTATUS)0xC0000225L)
+
+#define NT_SUCCESS(Status)  (((NTSTATUS)(Status)) >= 0)
+
+#define RtlZeroMemory(Destination, Length)  memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length)  memcpy((Destination), (Source), (Length))
+#define RtlMoveMemory(Destination, Source, Length)  memmove((Destination), (Source), (Length))
+#define RtlFillMemory(Destination, Length, Fill)    memset((Destination), (Fill), (Length))
+#define RtlEqualMemory(Source1, Source2, Length)    (memcmp((Source1), (Source2), (Length)) == 0)
+
+#define FIELD_OFFSET(Type, Field)   ((LONG)offsetof(Type, Field))
+#define ARRAYSIZE(Array)            (sizeof(Array) / sizeof((Array)[0]))
+#define UNREFERENCED_PARAMETER(P)   ((void)(P))
+#define C_ASSERT(Expression)        _Static_assert(Expression, #Expression)
+
+#ifndef max
+#define max(a, b)   (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef min
+#define min(a, b)   (((a) < (b)) ? (a) : (b))
+#endif
+
+#define __forceinline           inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(Bytes)   __attribute__((aligned(Bytes)))
+#define DECLSPEC_CACHEALIGN     DECLSPEC_ALIGN(64)
+
+// Bytes that match before the first difference
+static inline SIZE_T
+RtlCompareMemory(const VOID* Source1, const VOID* Source2, SIZE_T Length)
+{
+    const UCHAR* a = (const UCHAR*)Source1;
+    const UCHAR* b = (const UCHAR*)Source2;
+    SIZE_T i;
+
+    for (i = 0; i < Length && a[i] == b[i]; i++) {
+    }
+    return i;
+}
+
+// Zeroing the compiler may not drop as a dead store (key material)
+static inline PVOID
+RtlSecureZeroMemory(PVOID Destination, SIZE_T Length)
+{
+    volatile UCHAR* p = (volatile UCHAR*)Destination;
+
+    while (Length-- != 0) {
+        *p++ = 0;
+    }
+    return Destination;
+}
+
+static inline LONG
+ReadNoFence(const volatile LONG* Source)
+{
+    return __atomic_load_n(Source, __ATOMIC_RELAXED);
+}
+
+static inline ULONG
+ReadULongAcquire(const volatile ULONG* Source)
+{
+    return __atomic_load_n(Source, __ATOMIC_ACQUIRE);
+}
+
+static inline VOID
+WriteULongRelease(volatile ULONG* Destination, ULONG Value)
+{
+    __atomic_store_n(Destination, Value, __ATOMIC_RELEASE);
+}
+
+//
+// SAL annotations carry no meaning to these compilers
+//
+#define _In_
+#define _In_opt_
+#define _In_reads_(Count)
+#define _In_reads_bytes_(Size)
+#define _In_reads_bytes_opt_(Size)
+#define _In_reads_opt_(Count)
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_(Count)
+#define _Out_writes_bytes_(Size)
+#define _Out_writes_to_(Size, Count)
+#define _Inout_
+#define _Inout_updates_(Count)
+#define _Inout_updates_bytes_(Size)
+
+#endif // _MULTIDEVICEBTPORTABLE_H_
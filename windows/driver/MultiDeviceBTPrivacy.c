@@ -0,0 +1,378 @@
+/*++
+
+Module Name:
+    MultiDeviceBTPrivacy.c
+
+Abstract:
+    LE privacy. Holds the IRKs of bonded devices and resolves resolvable
+    private addresses against them.
+
+    Before this, nothing in the driver could tell that two RPAs belonged
+    to the same bonded device. Resolving one means an AES operation per
+    bonded IRK. Every advertisement from a privacy-enabled device would
+    pay that, bonded or not.
+
+    The resolver (MultiDeviceBTRpa.c) caches each RPA's outcome until
+    the address would have rotated, so a device costs AES only on the
+    first advertisement after each rotation. The misses batch their AES
+    across chunks of IRKs. The IRK table is pool memory that starts at
+    PRIVACY_INITIAL_IRKS entries and doubles as bonds are added. It is
+    allocated outside the lock and swapped in under it. Expanded keys
+    are wiped when they are removed or freed.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+static __forceinline ULONG64
+PrivacyNowUs(VOID)
+{
+    return KeQueryInterruptTime() / 10;
+}
+
+/*++
+Routine Description:
+    Initializes the privacy context with an empty IRK table
+--*/
+VOID
+PrivacyInitialize(
+    _Out_ PPRIVACY_CONTEXT Privacy
+)
+{
+    KeInitializeSpinLock(&Privacy->Lock);
+    RpaInitialize(&Privacy->Resolver, AesIsaBest, NULL, 0,
+        Privacy->Cache, PRIVACY_CACHE_SIZE);
+}
+
+/*++
+Routine Description:
+    Wipes and frees the IRK table
+--*/
+VOID
+PrivacyCleanup(
+    _Inout_ PPRIVACY_CONTEXT Privacy
+)
+{
+    PRPA_IRK irks = Privacy->Resolver.Irks;
+
+    if (irks != NULL) {
+        RtlSecureZeroMemory(irks, (SIZE_T)Privacy->Resolver.IrkCapacity * sizeof(RPA_IRK));
+        ExFreePoolWithTag(irks, PRIVACY_POOL_TAG);
+    }
+
+    Privacy->Resolver.Irks = NULL;
+    Privacy->Resolver.IrkCount = 0;
+    Privacy->Resolver.IrkCapacity = 0;
+}
+
+/*++
+Routine Description:
+    Adds or replaces a bonded device's IRK, growing the table if needed
+
+Arguments:
+    Privacy - Privacy context
+
+    IdentityAddress - Public or static random identity address
+
+    AddressType - RPA_IDENTITY_*
+
+    Irk - Identity resolving key, least significant octet first
+
+Return Value:
+    STATUS_INSUFFICIENT_RESOURCES when the table is at PRIVACY_MAX_IRKS
+    or cannot grow
+--*/
+NTSTATUS
+PrivacyAddIrk(
+    _Inout_ PPRIVACY_CONTEXT Privacy,
+    _In_ BTH_ADDR IdentityAddress,
+    _In_ UCHAR AddressType,
+    _In_reads_bytes_(RPA_IRK_BYTES) const UCHAR* Irk
+)
+{
+    PRPA_RESOLVER resolver = &Privacy->Resolver;
+    PRPA_IRK grown, old;
+    ULONG capacity, oldCapacity;
+    BOOLEAN added;
+    KIRQL irql;
+
+    for (;;) {
+        KeAcquireSpinLock(&Privacy->Lock, &irql);
+        added = RpaAddIrk(resolver, IdentityAddress, AddressType, Irk);
+        capacity = resolver->IrkCapacity;
+        KeReleaseSpinLock(&Privacy->Lock, irql);
+
+        if (added) {
+            return STATUS_SUCCESS;
+        }
+        if (capacity >= PRIVACY_MAX_IRKS) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        capacity = (capacity == 0) ? PRIVACY_INITIAL_IRKS : min(capacity * 2, PRIVACY_MAX_IRKS);
+        grown = (PRPA_IRK)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            (SIZE_T)capacity * sizeof(RPA_IRK), PRIVACY_POOL_TAG);
+        if (grown == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        // Another add may have grown the table meanwhile
+        KeAcquireSpinLock(&Privacy->Lock, &irql);
+        old = NULL;
+        oldCapacity = resolver->IrkCapacity;
+        if (oldCapacity < capacity) {
+            old = resolver->Irks;
+            RpaSetIrkStorage(resolver, grown, capacity);
+            grown = NULL;
+        }
+        KeReleaseSpinLock(&Privacy->Lock, irql);
+
+        if (old != NULL) {
+            RtlSecureZeroMemory(old, (SIZE_T)oldCapacity * sizeof(RPA_IRK));
+            ExFreePoolWithTag(old, PRIVACY_POOL_TAG);
+        }
+        if (grown != NULL) {
+            ExFreePoolWithTag(grown, PRIVACY_POOL_TAG);
+        }
+    }
+}
+
+/*++
+Routine Description:
+    Forgets an identity's IRK
+--*/
+NTSTATUS
+PrivacyRemoveIrk(
+    _Inout_ PPRIVACY_CONTEXT Privacy,
+    _In_ BTH_ADDR IdentityAddress
+)
+{
+    BOOLEAN removed;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Privacy->Lock, &irql);
+    removed = RpaRemoveIrk(&Privacy->Resolver, IdentityAddress);
+    KeReleaseSpinLock(&Privacy->Lock, irql);
+
+    return removed ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+/*++
+Routine Description:
+    Resolves random device addresses to identity addresses. Callable
+    at DISPATCH_LEVEL.
+
+Arguments:
+    Privacy - Privacy context
+
+    Addresses - Random device addresses
+
+    Count - Number of addresses
+
+    Results - One result per address
+
+Return Value:
+    Number of addresses resolved to an identity
+--*/
+ULONG
+PrivacyResolve(
+    _Inout_ PPRIVACY_CONTEXT Privacy,
+    _In_reads_(Count) const BTH_ADDR* Addresses,
+    _In_ ULONG Count,
+    _Out_writes_(Count) PRPA_RESULT Results
+)
+{
+    ULONG resolved;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Privacy->Lock, &irql);
+    resolved = RpaResolve(&Privacy->Resolver, PrivacyNowUs(), Addresses, Count, Results);
+    KeReleaseSpinLock(&Privacy->Lock, irql);
+
+    return resolved;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_RPA_ADD_IRK
+--*/
+NTSTATUS
+HandleRpaAddIrk(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PPRIVACY_IRK_ENTRY entry;
+    UCHAR any = 0;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(PRIVACY_IRK_ENTRY), (PVOID*)&entry, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (i = 0; i < RPA_IRK_BYTES; i++) {
+        any |= entry->Irk[i];
+    }
+
+    // A static random identity has its two top bits set; an all-zero IRK means none
+    if (entry->IdentityAddress == BTH_ADDR_NULL || any == 0 ||
+        entry->AddressType > RPA_IDENTITY_RANDOM_STATIC ||
+        (entry->AddressType == RPA_IDENTITY_RANDOM_STATIC &&
+         (entry->IdentityAddress >> 46) != 3)) {
+        status = STATUS_INVALID_PARAMETER;
+    } else {
+        status = PrivacyAddIrk(&DeviceContext->Privacy, entry->IdentityAddress,
+            entry->AddressType, entry->Irk);
+    }
+
+    RtlSecureZeroMemory(entry->Irk, sizeof(entry->Irk));
+
+    if (NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: IRK for %llx added (%u bonded)\n",
+            entry->IdentityAddress, DeviceContext->Privacy.Resolver.IrkCount));
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_RPA_REMOVE_IRK
+--*/
+NTSTATUS
+HandleRpaRemoveIrk(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PBTH_ADDR address;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(BTH_ADDR), (PVOID*)&address, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = PrivacyRemoveIrk(&DeviceContext->Privacy, *address);
+    if (NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: IRK for %llx removed\n", *address));
+    }
+
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_RPA_RESOLVE. The input and output share the
+    system buffer, so the addresses are copied out first.
+--*/
+NTSTATUS
+HandleRpaResolve(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PPRIVACY_RESOLVE_REQUEST request;
+    PRPA_RESULT results;
+    PBTH_ADDR addresses;
+    ULONG count;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        FIELD_OFFSET(PRIVACY_RESOLVE_REQUEST, Addresses), (PVOID*)&request, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    count = request->Count;
+    if (count == 0 || count > PRIVACY_MAX_RESOLVE ||
+        InputBufferLength < FIELD_OFFSET(PRIVACY_RESOLVE_REQUEST, Addresses) + count * sizeof(BTH_ADDR)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        count * sizeof(RPA_RESULT), (PVOID*)&results, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    addresses = (PBTH_ADDR)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        count * sizeof(BTH_ADDR), PRIVACY_POOL_TAG);
+    if (addresses == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(addresses, request->Addresses, count * sizeof(BTH_ADDR));
+    PrivacyResolve(&DeviceContext->Privacy, addresses, count, results);
+    ExFreePoolWithTag(addresses, PRIVACY_POOL_TAG);
+
+    *BytesReturned = count * sizeof(RPA_RESULT);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_RPA_STATS
+--*/
+NTSTATUS
+HandleGetRpaStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PRPA_STATS stats;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(RPA_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&DeviceContext->Privacy.Lock, &irql);
+    *stats = DeviceContext->Privacy.Resolver.Stats;
+    KeReleaseSpinLock(&DeviceContext->Privacy.Lock, irql);
+
+    *BytesReturned = sizeof(RPA_STATS);
+    return STATUS_SUCCESS;
+}
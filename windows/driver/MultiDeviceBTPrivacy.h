@@ -0,0 +1,74 @@
+/*++
+
+Module Name:
+    MultiDeviceBTPrivacy.h
+
+Abstract:
+    LE privacy: bonded devices' IRKs and the resolver that maps their
+    resolvable private addresses back to identity addresses
+    (MultiDeviceBTRpa.h). Scan, connection and bond paths resolve
+    through PrivacyResolve. User mode adds and removes IRKs and can
+    resolve addresses through IOCTLs.
+
+--*/
+
+#ifndef _MULTIDEVICEBTPRIVACY_H_
+#define _MULTIDEVICEBTPRIVACY_H_
+
+#include "MultiDeviceBTRpa.h"
+
+#define PRIVACY_POOL_TAG            'PDBM'
+#define PRIVACY_CACHE_SIZE          2048    // Power of two
+#define PRIVACY_INITIAL_IRKS        64      // The table doubles from here as bonds are added
+#define PRIVACY_MAX_IRKS            8192
+#define PRIVACY_MAX_RESOLVE         256     // Addresses per IOCTL_MULTI_BT_RPA_RESOLVE
+
+// IOCTL_MULTI_BT_RPA_ADD_IRK input
+typedef struct _PRIVACY_IRK_ENTRY {
+    BTH_ADDR IdentityAddress;
+    UCHAR AddressType;          // RPA_IDENTITY_*
+    UCHAR Reserved[7];
+    UCHAR Irk[RPA_IRK_BYTES];   // Least significant octet first, as SMP sends it
+} PRIVACY_IRK_ENTRY, *PPRIVACY_IRK_ENTRY;
+
+// IOCTL_MULTI_BT_RPA_RESOLVE input; the output is one RPA_RESULT per address
+typedef struct _PRIVACY_RESOLVE_REQUEST {
+    ULONG Count;
+    ULONG Reserved;
+    BTH_ADDR Addresses[1];      // Random device addresses only
+} PRIVACY_RESOLVE_REQUEST, *PPRIVACY_RESOLVE_REQUEST;
+
+typedef struct _PRIVACY_CONTEXT {
+    KSPIN_LOCK Lock;
+    RPA_RESOLVER Resolver;      // IRK table from pool, grown under the lock
+    RPA_CACHE_ENTRY Cache[PRIVACY_CACHE_SIZE];
+} PRIVACY_CONTEXT, *PPRIVACY_CONTEXT;
+
+VOID PrivacyInitialize(
+    _Out_ PPRIVACY_CONTEXT Privacy
+);
+
+VOID PrivacyCleanup(
+    _Inout_ PPRIVACY_CONTEXT Privacy
+);
+
+NTSTATUS PrivacyAddIrk(
+    _Inout_ PPRIVACY_CONTEXT Privacy,
+    _In_ BTH_ADDR IdentityAddress,
+    _In_ UCHAR AddressType,
+    _In_reads_bytes_(RPA_IRK_BYTES) const UCHAR* Irk
+);
+
+NTSTATUS PrivacyRemoveIrk(
+    _Inout_ PPRIVACY_CONTEXT Privacy,
+    _In_ BTH_ADDR IdentityAddress
+);
+
+ULONG PrivacyResolve(
+    _Inout_ PPRIVACY_CONTEXT Privacy,
+    _In_reads_(Count) const BTH_ADDR* Addresses,
+    _In_ ULONG Count,
+    _Out_writes_(Count) PRPA_RESULT Results
+);
+
+#endif // _MULTIDEVICEBTPRIVACY_H_
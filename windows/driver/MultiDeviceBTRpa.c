@@ -0,0 +1,460 @@
+/*++
+
+Module Name:
+    MultiDeviceBTRpa.c
+
+Abstract:
+    Resolvable private address resolution with an RPA cache.
+
+    An RPA is prand (upper 24 bits, top two bits 01) followed by hash
+    (lower 24 bits). The hash is ah(IRK, prand), the low 24 bits of
+    e(IRK, 0^104 || prand) (Core Vol 3 Part H, 2.2.2). IRKs arrive least
+    significant octet first, as SMP and HCI carry them. They are
+    reversed once into the big-endian key e expects, then expanded.
+
+    The cache is open-addressed on a hash of the RPA, and a lookup
+    examines RPA_CACHE_PROBE consecutive slots. An entry records either
+    the identity the RPA resolved to or that nothing matched. The
+    negative entries matter most in a dense scan, where most advertisers
+    are not bonded and each would otherwise cost one AES per IRK on
+    every advertisement. Entries live for RPA_CACHE_TTL_US, the default
+    rotation period. Changing the IRK set bumps a generation counter,
+    which turns every entry stale at once. When the probe window is
+    full, the entry closest to expiry is evicted.
+
+    On a miss, the prand block goes through AES under RPA_IRK_CHUNK IRKs
+    per AesEncryptBlocks call, and the search stops at the first chunk
+    with a match.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTRpa.h"
+
+#define RPA_NO_IRK                  0xFFFFFFFF
+
+
+static __forceinline ULONG
+RpaCacheSlot(
+    _In_ const RPA_RESOLVER* Resolver,
+    _In_ BTH_ADDR Rpa
+)
+{
+    return (ULONG)((Rpa * 0x9E3779B97F4A7C15ULL) >> 40) & Resolver->CacheMask;
+}
+
+static VOID
+RpaPrandBlock(
+    _In_ ULONG Prand,
+    _Out_writes_bytes_(AES_BLOCK_BYTES) PUCHAR Block
+)
+{
+    RtlZeroMemory(Block, AES_BLOCK_BYTES);
+    Block[13] = (UCHAR)(Prand >> 16);
+    Block[14] = (UCHAR)(Prand >> 8);
+    Block[15] = (UCHAR)Prand;
+}
+
+static __forceinline ULONG
+RpaBlockHash(
+    _In_reads_bytes_(AES_BLOCK_BYTES) const UCHAR* Block
+)
+{
+    return ((ULONG)Block[13] << 16) | ((ULONG)Block[14] << 8) | Block[15];
+}
+
+static VOID
+RpaExpandIrk(
+    _In_reads_bytes_(RPA_IRK_BYTES) const UCHAR* Irk,
+    _Out_ PAES_KEY Key
+)
+{
+    UCHAR secret[RPA_IRK_BYTES];
+    ULONG i;
+
+    for (i = 0; i < RPA_IRK_BYTES; i++) {
+        secret[i] = Irk[RPA_IRK_BYTES - 1 - i];
+    }
+    AesExpandKey(Key, secret);
+    RtlSecureZeroMemory(secret, sizeof(secret));
+}
+
+static ULONG
+RpaFindIrk(
+    _In_ const RPA_RESOLVER* Resolver,
+    _In_ BTH_ADDR IdentityAddress
+)
+{
+    ULONG i;
+
+    for (i = 0; i < Resolver->IrkCount; i++) {
+        if (Resolver->Irks[i].IdentityAddress == IdentityAddress) {
+            return i;
+        }
+    }
+    return RPA_NO_IRK;
+}
+
+/*++
+Routine Description:
+    Sets up an empty resolver over caller-owned storage
+
+Arguments:
+    Resolver - Resolver to initialize
+
+    Isa - AES instruction set, or AesIsaBest
+
+    Irks - IRK table; may be NULL when IrkCapacity is 0
+
+    IrkCapacity - Entries in Irks
+
+    Cache - RPA cache
+
+    CacheSize - Entries in Cache; a power of two
+
+Return Value:
+    None
+--*/
+VOID
+RpaInitialize(
+    _Out_ PRPA_RESOLVER Resolver,
+    _In_ AES_ISA Isa,
+    _In_reads_opt_(IrkCapacity) PRPA_IRK Irks,
+    _In_ ULONG IrkCapacity,
+    _Inout_updates_(CacheSize) PRPA_CACHE_ENTRY Cache,
+    _In_ ULONG CacheSize
+)
+{
+    RtlZeroMemory(Resolver, sizeof(*Resolver));
+    RtlZeroMemory(Cache, (SIZE_T)CacheSize * sizeof(RPA_CACHE_ENTRY));
+
+    Resolver->Isa = (Isa == AesIsaBest || Isa > AesDetectIsa()) ? AesDetectIsa() : Isa;
+    Resolver->Irks = Irks;
+    Resolver->IrkCapacity = IrkCapacity;
+    Resolver->Cache = Cache;
+    Resolver->CacheMask = CacheSize - 1;
+    Resolver->Generation = 1;   // Zeroed slots carry generation 0
+}
+
+/*++
+Routine Description:
+    Moves the IRK table to new storage of at least IrkCount entries. The
+    caller frees the old table.
+--*/
+VOID
+RpaSetIrkStorage(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_reads_(IrkCapacity) PRPA_IRK Irks,
+    _In_ ULONG IrkCapacity
+)
+{
+    if (Resolver->IrkCount != 0) {
+        RtlCopyMemory(Irks, Resolver->Irks, (SIZE_T)Resolver->IrkCount * sizeof(RPA_IRK));
+    }
+    Resolver->Irks = Irks;
+    Resolver->IrkCapacity = IrkCapacity;
+}
+
+/*++
+Routine Description:
+    Adds a bonded device's IRK, or replaces the IRK of an identity
+    already present
+
+Arguments:
+    Resolver - Resolver
+
+    IdentityAddress - Public or static random identity address
+
+    AddressType - RPA_IDENTITY_*
+
+    Irk - Identity resolving key, least significant octet first
+
+Return Value:
+    FALSE when the table is full
+--*/
+BOOLEAN
+RpaAddIrk(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_ BTH_ADDR IdentityAddress,
+    _In_ UCHAR AddressType,
+    _In_reads_bytes_(RPA_IRK_BYTES) const UCHAR* Irk
+)
+{
+    ULONG index = RpaFindIrk(Resolver, IdentityAddress);
+    PRPA_IRK entry;
+
+    if (index == RPA_NO_IRK) {
+        if (Resolver->IrkCount == Resolver->IrkCapacity) {
+            return FALSE;
+        }
+        index = Resolver->IrkCount++;
+    }
+
+    entry = &Resolver->Irks[index];
+    RtlZeroMemory(entry, sizeof(*entry));
+    entry->IdentityAddress = IdentityAddress;
+    entry->AddressType = AddressType;
+    RpaExpandIrk(Irk, &entry->Key);
+
+    Resolver->Generation++;
+    Resolver->Stats.Irks = Resolver->IrkCount;
+
+    return TRUE;
+}
+
+/*++
+Routine Description:
+    Forgets an identity's IRK
+
+Return Value:
+    FALSE when the identity had none
+--*/
+BOOLEAN
+RpaRemoveIrk(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_ BTH_ADDR IdentityAddress
+)
+{
+    ULONG index = RpaFindIrk(Resolver, IdentityAddress);
+    ULONG last;
+
+    if (index == RPA_NO_IRK) {
+        return FALSE;
+    }
+
+    last = --Resolver->IrkCount;
+    if (index != last) {
+        Resolver->Irks[index] = Resolver->Irks[last];
+    }
+    RtlSecureZeroMemory(&Resolver->Irks[last], sizeof(RPA_IRK));
+
+    Resolver->Generation++;
+    Resolver->Stats.Irks = Resolver->IrkCount;
+
+    return TRUE;
+}
+
+static PRPA_CACHE_ENTRY
+RpaCacheLookup(
+    _In_ PRPA_RESOLVER Resolver,
+    _In_ ULONG64 NowUs,
+    _In_ BTH_ADDR Rpa
+)
+{
+    ULONG slot = RpaCacheSlot(Resolver, Rpa);
+    ULONG probe;
+
+    for (probe = 0; probe < RPA_CACHE_PROBE; probe++) {
+        PRPA_CACHE_ENTRY entry = &Resolver->Cache[(slot + probe) & Resolver->CacheMask];
+
+        if (entry->Rpa == Rpa && entry->Generation == Resolver->Generation &&
+            entry->ExpiresUs > NowUs) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static VOID
+RpaCacheInsert(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_ ULONG64 NowUs,
+    _In_ BTH_ADDR Rpa,
+    _In_opt_ const RPA_IRK* Irk
+)
+{
+    ULONG slot = RpaCacheSlot(Resolver, Rpa);
+    PRPA_CACHE_ENTRY victim = NULL;
+    ULONG probe;
+
+    for (probe = 0; probe < RPA_CACHE_PROBE; probe++) {
+        PRPA_CACHE_ENTRY entry = &Resolver->Cache[(slot + probe) & Resolver->CacheMask];
+
+        if (entry->Rpa == 0 || entry->Rpa == Rpa ||
+            entry->Generation != Resolver->Generation || entry->ExpiresUs <= NowUs) {
+            victim = entry;
+            break;
+        }
+        if (victim == NULL || entry->ExpiresUs < victim->ExpiresUs) {
+            victim = entry;
+        }
+    }
+
+    if (probe == RPA_CACHE_PROBE) {
+        Resolver->Stats.CacheEvictions++;
+    }
+
+    victim->Rpa = Rpa;
+    victim->ExpiresUs = NowUs + RPA_CACHE_TTL_US;
+    victim->Generation = Resolver->Generation;
+    victim->Resolved = (Irk != NULL);
+    victim->IdentityAddress = (Irk != NULL) ? Irk->IdentityAddress : 0;
+    victim->AddressType = (Irk != NULL) ? Irk->AddressType : 0;
+}
+
+/*++
+Routine Description:
+    Runs ah under every IRK, a chunk per AES call, until one matches
+
+Return Value:
+    Index of the matching IRK, or RPA_NO_IRK
+--*/
+static ULONG
+RpaSearch(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_ BTH_ADDR Rpa
+)
+{
+    const AES_KEY* keys[RPA_IRK_CHUNK];
+    UCHAR blocks[RPA_IRK_CHUNK][AES_BLOCK_BYTES];
+    UCHAR plain[AES_BLOCK_BYTES];
+    ULONG prand = (ULONG)(Rpa >> 24) & 0xFFFFFF;
+    ULONG hash = (ULONG)Rpa & 0xFFFFFF;
+    ULONG base, n, i;
+
+    RpaPrandBlock(prand, plain);
+
+    for (base = 0; base < Resolver->IrkCount; base += n) {
+        n = min(Resolver->IrkCount - base, RPA_IRK_CHUNK);
+
+        for (i = 0; i < n; i++) {
+            keys[i] = &Resolver->Irks[base + i].Key;
+            RtlCopyMemory(blocks[i], plain, AES_BLOCK_BYTES);
+        }
+
+        AesEncryptBlocks(Resolver->Isa, keys, blocks[0], blocks[0], n);
+        Resolver->Stats.AesBlocks += n;
+
+        for (i = 0; i < n; i++) {
+            if (RpaBlockHash(blocks[i]) == hash) {
+                return base + i;
+            }
+        }
+    }
+
+    return RPA_NO_IRK;
+}
+
+/*++
+Routine Description:
+    Resolves a batch of random device addresses to identity addresses.
+    Pass only addresses whose type is random; a public address with the
+    RPA bit pattern would be looked up as an RPA.
+
+Arguments:
+    Resolver - Resolver
+
+    NowUs - Current time, microseconds
+
+    Addresses - Random device addresses
+
+    Count - Number of addresses
+
+    Results - One result per address
+
+Return Value:
+    Number of addresses resolved to an identity
+--*/
+ULONG
+RpaResolve(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_ ULONG64 NowUs,
+    _In_reads_(Count) const BTH_ADDR* Addresses,
+    _In_ ULONG Count,
+    _Out_writes_(Count) PRPA_RESULT Results
+)
+{
+    ULONG resolved = 0, i;
+
+    for (i = 0; i < Count; i++) {
+        BTH_ADDR address = Addresses[i];
+        PRPA_RESULT result = &Results[i];
+        PRPA_CACHE_ENTRY entry;
+        ULONG index;
+
+        RtlZeroMemory(result, sizeof(*result));
+        result->Address = address;
+        Resolver->Stats.Lookups++;
+
+        if (!RPA_IS_RESOLVABLE(address)) {
+            result->Outcome = RPA_OUTCOME_NOT_RPA;
+            Resolver->Stats.NotResolvable++;
+            continue;
+        }
+
+        // A repeat within the batch hits the entry its first sighting made
+        entry = RpaCacheLookup(Resolver, NowUs, address);
+        if (entry != NULL) {
+            result->Cached = TRUE;
+            Resolver->Stats.CacheHits++;
+            if (entry->Resolved) {
+                result->Address = entry->IdentityAddress;
+                result->AddressType = entry->AddressType;
+                result->Outcome = RPA_OUTCOME_RESOLVED;
+                resolved++;
+            } else {
+                result->Outcome = RPA_OUTCOME_UNRESOLVED;
+            }
+            continue;
+        }
+
+        index = RpaSearch(Resolver, address);
+        if (index != RPA_NO_IRK) {
+            const RPA_IRK* irk = &Resolver->Irks[index];
+
+            RpaCacheInsert(Resolver, NowUs, address, irk);
+            result->Address = irk->IdentityAddress;
+            result->AddressType = irk->AddressType;
+            result->Outcome = RPA_OUTCOME_RESOLVED;
+            Resolver->Stats.Resolved++;
+            resolved++;
+        } else {
+            RpaCacheInsert(Resolver, NowUs, address, NULL);
+            result->Outcome = RPA_OUTCOME_UNRESOLVED;
+            Resolver->Stats.Unresolved++;
+        }
+    }
+
+    return resolved;
+}
+
+/*++
+Routine Description:
+    Builds the RPA an IRK yields for a prand. Only the low 22 bits of
+    Prand are used; the top two become 01.
+--*/
+BTH_ADDR
+RpaGenerate(
+    _In_ AES_ISA Isa,
+    _In_reads_bytes_(RPA_IRK_BYTES) const UCHAR* Irk,
+    _In_ ULONG Prand
+)
+{
+    AES_KEY key;
+    const AES_KEY* keys[1] = { &key };
+    UCHAR block[AES_BLOCK_BYTES];
+    ULONG prand = (Prand & 0x3FFFFF) | 0x400000;
+    BTH_ADDR rpa;
+
+    RpaExpandIrk(Irk, &key);
+    RpaPrandBlock(prand, block);
+    AesEncryptBlocks(Isa, keys, block, block, 1);
+    rpa = ((BTH_ADDR)prand << 24) | RpaBlockHash(block);
+
+    RtlSecureZeroMemory(&key, sizeof(key));
+
+    return rpa;
+}
@@ -0,0 +1,133 @@
+/*++
+
+Module Name:
+    MultiDeviceBTRpa.h
+
+Abstract:
+    Resolvable private address (RPA) resolution. An RPA carries a
+    24-bit prand and a 24-bit hash, ah(IRK, prand). Finding the device
+    behind it means computing ah under every bonded IRK until one
+    matches.
+
+    Recently seen RPAs are cached with the identity they resolved to, or
+    with the fact that nothing matched, until the address would have
+    rotated. A miss runs AES under a whole chunk of IRKs in one batched
+    call (MultiDeviceBTAes.h). Adding or removing an IRK flushes the
+    cache.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the time, the storage and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTRPA_H_
+#define _MULTIDEVICEBTRPA_H_
+
+#include "MultiDeviceBTAes.h"
+
+#define RPA_IRK_BYTES               16
+#define RPA_IRK_CHUNK               64      // IRKs per batched AES call
+#define RPA_CACHE_PROBE             16      // Slots examined per lookup
+#define RPA_CACHE_TTL_US            (15ULL * 60 * 1000000)  // Default RPA rotation period
+
+// An address is an RPA when its two most significant bits are 01
+#define RPA_IS_RESOLVABLE(a)        (((a) >> 46) == 1)
+
+// Identity address types, as in HCI
+#define RPA_IDENTITY_PUBLIC         0x00
+#define RPA_IDENTITY_RANDOM_STATIC  0x01
+
+// RPA_RESULT.Outcome
+#define RPA_OUTCOME_NOT_RPA         0       // Not resolvable; Address is unchanged
+#define RPA_OUTCOME_RESOLVED        1       // Address is the identity address
+#define RPA_OUTCOME_UNRESOLVED      2       // No IRK matched; Address is unchanged
+
+typedef struct _RPA_IRK {
+    BTH_ADDR IdentityAddress;
+    UCHAR AddressType;          // RPA_IDENTITY_*
+    UCHAR Reserved[7];
+    AES_KEY Key;
+} RPA_IRK, *PRPA_IRK;
+
+typedef struct _RPA_CACHE_ENTRY {
+    BTH_ADDR Rpa;               // 0 marks a free slot
+    BTH_ADDR IdentityAddress;
+    ULONG64 ExpiresUs;
+    ULONG Generation;           // Entries from an older IRK set are stale
+    UCHAR AddressType;
+    BOOLEAN Resolved;           // FALSE: no IRK matched
+    USHORT Reserved;
+} RPA_CACHE_ENTRY, *PRPA_CACHE_ENTRY;
+
+typedef struct _RPA_RESULT {
+    BTH_ADDR Address;
+    UCHAR AddressType;          // RPA_IDENTITY_* when resolved
+    UCHAR Outcome;              // RPA_OUTCOME_*
+    BOOLEAN Cached;
+    UCHAR Reserved[5];
+} RPA_RESULT, *PRPA_RESULT;
+
+typedef struct _RPA_STATS {
+    ULONG64 Lookups;
+    ULONG64 NotResolvable;
+    ULONG64 CacheHits;          // Positive and negative
+    ULONG64 Resolved;           // By AES, after a cache miss
+    ULONG64 Unresolved;
+    ULONG64 AesBlocks;
+    ULONG CacheEvictions;
+    ULONG Irks;
+} RPA_STATS, *PRPA_STATS;
+
+typedef struct _RPA_RESOLVER {
+    AES_ISA Isa;
+    PRPA_IRK Irks;
+    ULONG IrkCount;
+    ULONG IrkCapacity;
+    PRPA_CACHE_ENTRY Cache;
+    ULONG CacheMask;            // Cache slots - 1; the count is a power of two
+    ULONG Generation;
+    RPA_STATS Stats;
+} RPA_RESOLVER, *PRPA_RESOLVER;
+
+VOID RpaInitialize(
+    _Out_ PRPA_RESOLVER Resolver,
+    _In_ AES_ISA Isa,
+    _In_reads_opt_(IrkCapacity) PRPA_IRK Irks,
+    _In_ ULONG IrkCapacity,
+    _Inout_updates_(CacheSize) PRPA_CACHE_ENTRY Cache,
+    _In_ ULONG CacheSize
+);
+
+VOID RpaSetIrkStorage(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_reads_(IrkCapacity) PRPA_IRK Irks,
+    _In_ ULONG IrkCapacity
+);
+
+BOOLEAN RpaAddIrk(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_ BTH_ADDR IdentityAddress,
+    _In_ UCHAR AddressType,
+    _In_reads_bytes_(RPA_IRK_BYTES) const UCHAR* Irk
+);
+
+BOOLEAN RpaRemoveIrk(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_ BTH_ADDR IdentityAddress
+);
+
+ULONG RpaResolve(
+    _Inout_ PRPA_RESOLVER Resolver,
+    _In_ ULONG64 NowUs,
+    _In_reads_(Count) const BTH_ADDR* Addresses,
+    _In_ ULONG Count,
+    _Out_writes_(Count) PRPA_RESULT Results
+);
+
+BTH_ADDR RpaGenerate(
+    _In_ AES_ISA Isa,
+    _In_reads_bytes_(RPA_IRK_BYTES) const UCHAR* Irk,
+    _In_ ULONG Prand
+);
+
+#endif // _MULTIDEVICEBTRPA_H_
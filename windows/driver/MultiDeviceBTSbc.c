@@ -0,0 +1,812 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSbc.c
+
+Abstract:
+    SBC encoder (A2DP specification, Appendix B). It implements:
+    - the polyphase analysis filterbank (4 or 8 subbands);
+    - scale factors;
+    - joint stereo decisions;
+    - loudness and SNR bit allocation;
+    - quantization;
+    - frame packing with the header CRC.
+
+    The filterbank is the hot loop. Each block needs five window taps
+    over 2M samples plus a 2M x M cosine matrix, and it runs in SSE4.1
+    or AVX2 across subbands. The vector kernels keep the scalar
+    operation order, so every path emits identical frames.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SBC_X86 1
+#include <immintrin.h>
+#else
+#define SBC_X86 0
+#endif
+
+#include "MultiDeviceBTSimd.h"
+#include "MultiDeviceBTSbc.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SBC_TARGET_SSE41            __attribute__((target("sse4.1")))
+#define SBC_TARGET_AVX2             __attribute__((target("avx2")))
+#else
+#define SBC_TARGET_SSE41
+#define SBC_TARGET_AVX2
+#endif
+
+#define SBC_CRC_INIT                0x0F
+#define SBC_CRC_POLY                0x1D        // x^8 + x^4 + x^3 + x^2 + 1
+#define SBC_MAX_SCALE_FACTOR        15
+#define SBC_MAX_BITS                16
+
+#if defined(_KERNEL_MODE) && SBC_X86
+typedef XSTATE_SAVE SBC_SIMD_STATE;
+#else
+typedef ULONG SBC_SIMD_STATE;
+#endif
+
+static const ULONG SbcFrequencies[] = { 16000, 32000, 44100, 48000 };
+
+// Analysis window C[i], Proto_4_40 / Proto_8_80 with the sign pattern applied
+static const float SbcProto4[40] = {
+     0.00000000e+00f,  5.36548976e-04f,  1.49188357e-03f,  2.73370904e-03f,
+     3.83720193e-03f,  3.89205149e-03f,  1.86581691e-03f, -3.06012286e-03f,
+     1.09137620e-02f,  2.04385087e-02f,  2.88757392e-02f,  3.21939290e-02f,
+     2.58767811e-02f,  6.13245186e-03f, -2.88217274e-02f, -7.76463494e-02f,
+     1.35593274e-01f,  1.94987841e-01f,  2.46636662e-01f,  2.81828203e-01f,
+     2.94315332e-01f,  2.81828203e-01f,  2.46636662e-01f,  1.94987841e-01f,
+    -1.35593274e-01f, -7.76463494e-02f, -2.88217274e-02f,  6.13245186e-03f,
+     2.58767811e-02f,  3.21939290e-02f,  2.88757392e-02f,  2.04385087e-02f,
+    -1.09137620e-02f, -3.06012286e-03f,  1.86581691e-03f,  3.89205149e-03f,
+     3.83720193e-03f,  2.73370904e-03f,  1.49188357e-03f,  5.36548976e-04f
+};
+
+static const float SbcProto8[80] = {
+     0.00000000e+00f,  1.56575398e-04f,  3.43256425e-04f,  5.54620202e-04f,
+     8.23919506e-04f,  1.13992507e-03f,  1.47640169e-03f,  1.78371725e-03f,
+     2.01182542e-03f,  2.10371989e-03f,  1.99454554e-03f,  1.61656283e-03f,
+     9.02154502e-04f, -1.78805361e-04f, -1.64973098e-03f, -3.49717454e-03f,
+     5.65949473e-03f,  8.02941163e-03f,  1.04584443e-02f,  1.27472335e-02f,
+     1.46525263e-02f,  1.59045603e-02f,  1.62208471e-02f,  1.53184106e-02f,
+     1.29371806e-02f,  8.85757540e-03f,  2.92408442e-03f, -4.91578024e-03f,
+    -1.46404076e-02f, -2.61098752e-02f, -3.90751381e-02f, -5.31873032e-02f,
+     6.79989431e-02f,  8.29847578e-02f,  9.75753918e-02f,  1.11196689e-01f,
+     1.23264548e-01f,  1.33264415e-01f,  1.40753505e-01f,  1.45389847e-01f,
+     1.46955068e-01f,  1.45389847e-01f,  1.40753505e-01f,  1.33264415e-01f,
+     1.23264548e-01f,  1.11196689e-01f,  9.75753918e-02f,  8.29847578e-02f,
+    -6.79989431e-02f, -5.31873032e-02f, -3.90751381e-02f, -2.61098752e-02f,
+    -1.46404076e-02f, -4.91578024e-03f,  2.92408442e-03f,  8.85757540e-03f,
+     1.29371806e-02f,  1.53184106e-02f,  1.62208471e-02f,  1.59045603e-02f,
+     1.46525263e-02f,  1.27472335e-02f,  1.04584443e-02f,  8.02941163e-03f,
+    -5.65949473e-03f, -3.49717454e-03f, -1.64973098e-03f, -1.78805361e-04f,
+     9.02154502e-04f,  1.61656283e-03f,  1.99454554e-03f,  2.10371989e-03f,
+     2.01182542e-03f,  1.78371725e-03f,  1.47640169e-03f,  1.13992507e-03f,
+     8.23919506e-04f,  5.54620202e-04f,  3.43256425e-04f,  1.56575398e-04f
+};
+
+// Analysis matrix cos((sb + 0.5)(i - M/2) pi / M), stored [2M - 1 - i][sb]
+// to match the regrouped window
+static const float SbcMatrix4[8 * 4] = {
+    -3.82683432e-01f,  9.23879533e-01f, -9.23879533e-01f,  3.82683432e-01f,
+     0.00000000e+00f,  0.00000000e+00f,  0.00000000e+00f,  0.00000000e+00f,
+     3.82683432e-01f, -9.23879533e-01f,  9.23879533e-01f, -3.82683432e-01f,
+     7.07106781e-01f, -7.07106781e-01f, -7.07106781e-01f,  7.07106781e-01f,
+     9.23879533e-01f,  3.82683432e-01f, -3.82683432e-01f, -9.23879533e-01f,
+     1.00000000e+00f,  1.00000000e+00f,  1.00000000e+00f,  1.00000000e+00f,
+     9.23879533e-01f,  3.82683432e-01f, -3.82683432e-01f, -9.23879533e-01f,
+     7.07106781e-01f, -7.07106781e-01f, -7.07106781e-01f,  7.07106781e-01f
+};
+
+static const float SbcMatrix8[16 * 8] = {
+    -5.55570233e-01f,  9.80785280e-01f, -1.95090322e-01f, -8.31469612e-01f,
+     8.31469612e-01f,  1.95090322e-01f, -9.80785280e-01f,  5.55570233e-01f,
+    -3.82683432e-01f,  9.23879533e-01f, -9.23879533e-01f,  3.82683432e-01f,
+     3.82683432e-01f, -9.23879533e-01f,  9.23879533e-01f, -3.82683432e-01f,
+    -1.95090322e-01f,  5.55570233e-01f, -8.31469612e-01f,  9.80785280e-01f,
+    -9.80785280e-01f,  8.31469612e-01f, -5.55570233e-01f,  1.95090322e-01f,
+     0.00000000e+00f,  0.00000000e+00f,  0.00000000e+00f,  0.00000000e+00f,
+     0.00000000e+00f,  0.00000000e+00f,  0.00000000e+00f,  0.00000000e+00f,
+     1.95090322e-01f, -5.55570233e-01f,  8.31469612e-01f, -9.80785280e-01f,
+     9.80785280e-01f, -8.31469612e-01f,  5.55570233e-01f, -1.95090322e-01f,
+     3.82683432e-01f, -9.23879533e-01f,  9.23879533e-01f, -3.82683432e-01f,
+    -3.82683432e-01f,  9.23879533e-01f, -9.23879533e-01f,  3.82683432e-01f,
+     5.55570233e-01f, -9.80785280e-01f,  1.95090322e-01f,  8.31469612e-01f,
+    -8.31469612e-01f, -1.95090322e-01f,  9.80785280e-01f, -5.55570233e-01f,
+     7.07106781e-01f, -7.07106781e-01f, -7.07106781e-01f,  7.07106781e-01f,
+     7.07106781e-01f, -7.07106781e-01f, -7.07106781e-01f,  7.07106781e-01f,
+     8.31469612e-01f, -1.95090322e-01f, -9.80785280e-01f, -5.55570233e-01f,
+     5.55570233e-01f,  9.80785280e-01f,  1.95090322e-01f, -8.31469612e-01f,
+     9.23879533e-01f,  3.82683432e-01f, -3.82683432e-01f, -9.23879533e-01f,
+    -9.23879533e-01f, -3.82683432e-01f,  3.82683432e-01f,  9.23879533e-01f,
+     9.80785280e-01f,  8.31469612e-01f,  5.55570233e-01f,  1.95090322e-01f,
+    -1.95090322e-01f, -5.55570233e-01f, -8.31469612e-01f, -9.80785280e-01f,
+     1.00000000e+00f,  1.00000000e+00f,  1.00000000e+00f,  1.00000000e+00f,
+     1.00000000e+00f,  1.00000000e+00f,  1.00000000e+00f,  1.00000000e+00f,
+     9.80785280e-01f,  8.31469612e-01f,  5.55570233e-01f,  1.95090322e-01f,
+    -1.95090322e-01f, -5.55570233e-01f, -8.31469612e-01f, -9.80785280e-01f,
+     9.23879533e-01f,  3.82683432e-01f, -3.82683432e-01f, -9.23879533e-01f,
+    -9.23879533e-01f, -3.82683432e-01f,  3.82683432e-01f,  9.23879533e-01f,
+     8.31469612e-01f, -1.95090322e-01f, -9.80785280e-01f, -5.55570233e-01f,
+     5.55570233e-01f,  9.80785280e-01f,  1.95090322e-01f, -8.31469612e-01f,
+     7.07106781e-01f, -7.07106781e-01f, -7.07106781e-01f,  7.07106781e-01f,
+     7.07106781e-01f, -7.07106781e-01f, -7.07106781e-01f,  7.07106781e-01f
+};
+
+// Loudness allocation offsets, [frequency][subband]
+static const LONG SbcOffset4[4][4] = {
+    { -1, 0, 0, 0 },
+    { -2, 0, 0, 1 },
+    { -2, 0, 0, 1 },
+    { -2, 0, 0, 1 }
+};
+
+static const LONG SbcOffset8[4][8] = {
+    { -2, 0, 0, 0, 0, 0, 0, 1 },
+    { -3, 0, 0, 0, 0, 0, 1, 2 },
+    { -4, 0, 0, 0, 0, 0, 1, 2 },
+    { -4, 0, 0, 0, 0, 0, 1, 2 }
+};
+
+/*++
+Routine Description:
+    Returns the widest instruction set usable by the SBC kernels; the
+    feature checks are shared with the drift resampler
+--*/
+SBC_ISA
+SbcDetectIsa(
+    VOID
+)
+{
+    switch (SimdDetectIsa()) {
+    case SimdIsaAvx2:
+        return SbcIsaAvx2;
+    case SimdIsaSse41:
+        return SbcIsaSse41;
+    default:
+        return SbcIsaScalar;
+    }
+}
+
+//
+// Analysis kernels. One call filters one block of one channel:
+//   Y[m]  = sum over k of Window[k][m] * Buffer[(Block + 8 - 2k) M + m]
+//   S[sb] = sum over m of Matrix[m][sb] * Y[m]
+//
+
+static VOID
+SbcAnalyzeScalar(
+    _In_ PSBC_ENCODER Encoder,
+    _In_ const float* Input,
+    _Out_writes_(Encoder->Config.Subbands) float* Output
+)
+{
+    ULONG M = Encoder->Config.Subbands;
+    const float* matrix = (M == 8) ? SbcMatrix8 : SbcMatrix4;
+    float y[2 * SBC_MAX_SUBBANDS];
+    ULONG m, k, sb;
+
+    for (m = 0; m < 2 * M; m++) {
+        float v = Encoder->Window[0][m] * Input[m];
+
+        for (k = 1; k < 5; k++) {
+            v = v + Encoder->Window[k][m] * (Input - 2 * M * k)[m];
+        }
+        y[m] = v;
+    }
+
+    for (sb = 0; sb < M; sb++) {
+        float s = matrix[sb] * y[0];
+
+        for (m = 1; m < 2 * M; m++) {
+            s = s + matrix[m * M + sb] * y[m];
+        }
+        Output[sb] = s;
+    }
+}
+
+#if SBC_X86
+
+SBC_TARGET_SSE41
+static VOID
+SbcAnalyzeSse41(
+    _In_ PSBC_ENCODER Encoder,
+    _In_ const float* Input,
+    _Out_writes_(Encoder->Config.Subbands) float* Output
+)
+{
+    ULONG M = Encoder->Config.Subbands;
+    const float* matrix = (M == 8) ? SbcMatrix8 : SbcMatrix4;
+    DECLSPEC_ALIGN(16) float y[2 * SBC_MAX_SUBBANDS];
+    ULONG m, k, sb;
+
+    for (m = 0; m < 2 * M; m += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(&Encoder->Window[0][m]), _mm_loadu_ps(Input + m));
+
+        for (k = 1; k < 5; k++) {
+            v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(&Encoder->Window[k][m]),
+                _mm_loadu_ps(Input - 2 * M * k + m)));
+        }
+        _mm_store_ps(y + m, v);
+    }
+
+    for (sb = 0; sb < M; sb += 4) {
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(matrix + sb), _mm_set1_ps(y[0]));
+
+        for (m = 1; m < 2 * M; m++) {
+            s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(matrix + m * M + sb), _mm_set1_ps(y[m])));
+        }
+        _mm_storeu_ps(Output + sb, s);
+    }
+}
+
+SBC_TARGET_AVX2
+static VOID
+SbcAnalyzeAvx2(
+    _In_ PSBC_ENCODER Encoder,
+    _In_ const float* Input,
+    _Out_writes_(Encoder->Config.Subbands) float* Output
+)
+{
+    ULONG M = Encoder->Config.Subbands;
+    DECLSPEC_ALIGN(32) float y[2 * SBC_MAX_SUBBANDS];
+    ULONG m, k;
+
+    for (m = 0; m < 2 * M; m += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(&Encoder->Window[0][m]), _mm256_loadu_ps(Input + m));
+
+        for (k = 1; k < 5; k++) {
+            v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_loadu_ps(&Encoder->Window[k][m]),
+                _mm256_loadu_ps(Input - 2 * M * k + m)));
+        }
+        _mm256_store_ps(y + m, v);
+    }
+
+    if (M == 8) {
+        __m256 s = _mm256_mul_ps(_mm256_loadu_ps(SbcMatrix8), _mm256_set1_ps(y[0]));
+
+        for (m = 1; m < 16; m++) {
+            s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_loadu_ps(SbcMatrix8 + m * 8),
+                _mm256_set1_ps(y[m])));
+        }
+        _mm256_storeu_ps(Output, s);
+    } else {
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(SbcMatrix4), _mm_set1_ps(y[0]));
+
+        for (m = 1; m < 8; m++) {
+            s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(SbcMatrix4 + m * 4), _mm_set1_ps(y[m])));
+        }
+        _mm_storeu_ps(Output, s);
+    }
+}
+
+#endif // SBC_X86
+
+/*++
+Routine Description:
+    Validates a configuration against the A2DP SBC limits
+
+Arguments:
+    Config - Configuration to check
+
+Return Value:
+    Frame length in bytes, or 0 if the configuration is invalid
+--*/
+ULONG
+SbcFrameLength(
+    _In_ PSBC_CONFIG Config
+)
+{
+    ULONG channels, M, dataBits, i;
+
+    for (i = 0; i < ARRAYSIZE(SbcFrequencies); i++) {
+        if (SbcFrequencies[i] == Config->SampleRate) {
+            break;
+        }
+    }
+
+    if (i == ARRAYSIZE(SbcFrequencies) ||
+        Config->ChannelMode > SbcModeJointStereo ||
+        Config->Allocation > SbcAllocationSnr ||
+        (Config->Subbands != 4 && Config->Subbands != 8) ||
+        Config->Blocks == 0 || Config->Blocks > SBC_MAX_BLOCKS || (Config->Blocks % 4) != 0) {
+        return 0;
+    }
+
+    M = Config->Subbands;
+    channels = (Config->ChannelMode == SbcModeMono) ? 1 : 2;
+
+    // Bitpool limits: 16 M per channel, 32 M shared by stereo modes
+    if (Config->Bitpool < SBC_MIN_BITPOOL || Config->Bitpool > SBC_MAX_BITPOOL ||
+        Config->Bitpool > ((Config->ChannelMode >= SbcModeStereo) ? 32 : 16) * M) {
+        return 0;
+    }
+
+    if (Config->ChannelMode <= SbcModeDualChannel) {
+        dataBits = Config->Blocks * channels * Config->Bitpool;
+    } else {
+        dataBits = Config->Blocks * Config->Bitpool;
+        if (Config->ChannelMode == SbcModeJointStereo) {
+            dataBits += M;
+        }
+    }
+
+    return 4 + (4 * M * channels) / 8 + (dataBits + 7) / 8;
+}
+
+/*++
+Routine Description:
+    Initializes an encoder for one negotiated configuration
+
+Arguments:
+    Encoder - Caller-allocated encoder state
+    Config - SBC configuration
+    Isa - Kernel instruction set, or SbcIsaBest
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+SbcEncoderInitialize(
+    _Out_ PSBC_ENCODER Encoder,
+    _In_ PSBC_CONFIG Config,
+    _In_ SBC_ISA Isa
+)
+{
+    const float* proto;
+    ULONG M, frameBytes, m, k;
+
+    frameBytes = SbcFrameLength(Config);
+    if (frameBytes == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory(Encoder, sizeof(*Encoder));
+
+    Encoder->Config = *Config;
+    Encoder->Channels = (Config->ChannelMode == SbcModeMono) ? 1 : 2;
+    Encoder->FrameBytes = frameBytes;
+    Encoder->Isa = (Isa == SbcIsaBest || Isa > SbcDetectIsa()) ? SbcDetectIsa() : Isa;
+
+    for (k = 0; k < ARRAYSIZE(SbcFrequencies); k++) {
+        if (SbcFrequencies[k] == Config->SampleRate) {
+            Encoder->FrequencyIndex = k;
+        }
+    }
+
+    M = Config->Subbands;
+    proto = (M == 8) ? SbcProto8 : SbcProto4;
+
+    for (k = 0; k < 5; k++) {
+        for (m = 0; m < 2 * M; m++) {
+            Encoder->Window[k][m] = proto[2 * M - 1 - m + 2 * M * k];
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Smallest index with |x| < 2^(index + 1)
+static LONG
+SbcScaleFactor(
+    _In_ float Peak
+)
+{
+    LONG index = 0;
+
+    while (index < SBC_MAX_SCALE_FACTOR && Peak >= (float)(2 << index)) {
+        index++;
+    }
+
+    return index;
+}
+
+static float
+SbcPeak(
+    _In_ PSBC_ENCODER Encoder,
+    _In_ ULONG Channel,
+    _In_ ULONG Subband
+)
+{
+    float peak = 0.0f;
+    ULONG blk;
+
+    for (blk = 0; blk < Encoder->Config.Blocks; blk++) {
+        float v = Encoder->Samples[blk][Channel][Subband];
+
+        v = (v < 0) ? -v : v;
+        peak = (v > peak) ? v : peak;
+    }
+
+    return peak;
+}
+
+/*++
+Routine Description:
+    Codes a subband as mid/side when that lowers the combined scale
+    factors. The last subband is never joined.
+--*/
+static VOID
+SbcJointStereo(
+    _Inout_ PSBC_ENCODER Encoder
+)
+{
+    ULONG M = Encoder->Config.Subbands;
+    ULONG blocks = Encoder->Config.Blocks;
+    ULONG sb, blk;
+
+    Encoder->Join = 0;
+
+    for (sb = 0; sb < M - 1; sb++) {
+        float peakMid = 0.0f, peakSide = 0.0f;
+        LONG mid, side;
+
+        for (blk = 0; blk < blocks; blk++) {
+            float l = Encoder->Samples[blk][0][sb];
+            float r = Encoder->Samples[blk][1][sb];
+            float a = (l + r) * 0.5f;
+            float b = (l - r) * 0.5f;
+
+            a = (a < 0) ? -a : a;
+            b = (b < 0) ? -b : b;
+            peakMid = (a > peakMid) ? a : peakMid;
+            peakSide = (b > peakSide) ? b : peakSide;
+        }
+
+        mid = SbcScaleFactor(peakMid);
+        side = SbcScaleFactor(peakSide);
+
+        if (mid + side < Encoder->ScaleFactor[0][sb] + Encoder->ScaleFactor[1][sb]) {
+            Encoder->Join |= (UCHAR)(1 << (M - 1 - sb));
+            Encoder->ScaleFactor[0][sb] = mid;
+            Encoder->ScaleFactor[1][sb] = side;
+
+            for (blk = 0; blk < blocks; blk++) {
+                float l = Encoder->Samples[blk][0][sb];
+                float r = Encoder->Samples[blk][1][sb];
+
+                Encoder->Samples[blk][0][sb] = (l + r) * 0.5f;
+                Encoder->Samples[blk][1][sb] = (l - r) * 0.5f;
+            }
+        }
+    }
+}
+
+/*++
+Routine Description:
+    A2DP bit allocation. Mono and dual channel allocate each channel
+    from its own bitpool; stereo modes share one bitpool across both.
+
+Arguments:
+    Encoder - Encoder with scale factors set
+    First - First channel to allocate
+    Count - Channels sharing the bitpool
+
+Return Value:
+    None
+--*/
+static VOID
+SbcAllocate(
+    _Inout_ PSBC_ENCODER Encoder,
+    _In_ ULONG First,
+    _In_ ULONG Count
+)
+{
+    ULONG M = Encoder->Config.Subbands;
+    LONG bitpool = (LONG)Encoder->Config.Bitpool;
+    LONG bitneed[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+    LONG maxBitneed = 0, bitcount = 0, slicecount = 0, bitslice;
+    ULONG ch, sb;
+
+    for (ch = First; ch < First + Count; ch++) {
+        for (sb = 0; sb < M; sb++) {
+            LONG sf = Encoder->ScaleFactor[ch][sb];
+
+            if (Encoder->Config.Allocation == SbcAllocationSnr) {
+                bitneed[ch][sb] = sf;
+            } else if (sf == 0) {
+                bitneed[ch][sb] = -5;
+            } else {
+                LONG loudness = sf - ((M == 4) ?
+                    SbcOffset4[Encoder->FrequencyIndex][sb] :
+                    SbcOffset8[Encoder->FrequencyIndex][sb]);
+
+                bitneed[ch][sb] = (loudness > 0) ? loudness / 2 : loudness;
+            }
+
+            maxBitneed = max(maxBitneed, bitneed[ch][sb]);
+        }
+    }
+
+    // Lower the slice until the next one would overflow the bitpool
+    bitslice = maxBitneed + 1;
+    do {
+        bitslice--;
+        bitcount += slicecount;
+        slicecount = 0;
+
+        for (ch = First; ch < First + Count; ch++) {
+            for (sb = 0; sb < M; sb++) {
+                if (bitneed[ch][sb] > bitslice + 1 && bitneed[ch][sb] < bitslice + 16) {
+                    slicecount++;
+                } else if (bitneed[ch][sb] == bitslice + 1) {
+                    slicecount += 2;
+                }
+            }
+        }
+    } while (bitcount + slicecount < bitpool);
+
+    if (bitcount + slicecount == bitpool) {
+        bitcount += slicecount;
+        bitslice--;
+    }
+
+    for (ch = First; ch < First + Count; ch++) {
+        for (sb = 0; sb < M; sb++) {
+            Encoder->Bits[ch][sb] = (bitneed[ch][sb] < bitslice + 2) ? 0 :
+                min(bitneed[ch][sb] - bitslice, SBC_MAX_BITS);
+        }
+    }
+
+    // Spend the remainder, interleaving channels within each subband
+    ch = First;
+    sb = 0;
+    while (bitcount < bitpool && sb < M) {
+        if (Encoder->Bits[ch][sb] >= 2 && Encoder->Bits[ch][sb] < SBC_MAX_BITS) {
+            Encoder->Bits[ch][sb]++;
+            bitcount++;
+        } else if (bitneed[ch][sb] == bitslice + 1 && bitpool > bitcount + 1) {
+            Encoder->Bits[ch][sb] = 2;
+            bitcount += 2;
+        }
+        if (++ch == First + Count) {
+            ch = First;
+            sb++;
+        }
+    }
+
+    ch = First;
+    sb = 0;
+    while (bitcount < bitpool && sb < M) {
+        if (Encoder->Bits[ch][sb] < SBC_MAX_BITS) {
+            Encoder->Bits[ch][sb]++;
+            bitcount++;
+        }
+        if (++ch == First + Count) {
+            ch = First;
+            sb++;
+        }
+    }
+}
+
+//
+// Frame packing
+//
+
+typedef struct _SBC_WRITER {
+    PUCHAR Buffer;
+    ULONG Position;             // In bytes
+    ULONG64 Accumulator;
+    ULONG Pending;              // Bits held in Accumulator
+} SBC_WRITER, *PSBC_WRITER;
+
+static __forceinline VOID
+SbcPut(
+    _Inout_ PSBC_WRITER Writer,
+    _In_ ULONG Value,
+    _In_ ULONG Count
+)
+{
+    Writer->Accumulator = (Writer->Accumulator << Count) | Value;
+    Writer->Pending += Count;
+
+    while (Writer->Pending >= 8) {
+        Writer->Pending -= 8;
+        Writer->Buffer[Writer->Position++] = (UCHAR)(Writer->Accumulator >> Writer->Pending);
+    }
+}
+
+static VOID
+SbcFlush(
+    _Inout_ PSBC_WRITER Writer
+)
+{
+    if (Writer->Pending > 0) {
+        Writer->Buffer[Writer->Position++] =
+            (UCHAR)(Writer->Accumulator << (8 - Writer->Pending));
+        Writer->Pending = 0;
+    }
+}
+
+static UCHAR
+SbcCrc8(
+    _In_ UCHAR Crc,
+    _In_ ULONG Value,
+    _In_ ULONG Count
+)
+{
+    while (Count-- > 0) {
+        ULONG bit = ((Value >> Count) & 1) ^ (Crc >> 7);
+
+        Crc = (UCHAR)(Crc << 1);
+        if (bit) {
+            Crc ^= SBC_CRC_POLY;
+        }
+    }
+
+    return Crc;
+}
+
+/*++
+Routine Description:
+    Encodes one frame
+
+Arguments:
+    Encoder - Encoder state
+    Pcm - Blocks * Subbands samples per channel, channel-interleaved
+    Frame - Receives the frame
+
+Return Value:
+    Frame length in bytes
+--*/
+ULONG
+SbcEncodeFrame(
+    _Inout_ PSBC_ENCODER Encoder,
+    _In_ const SHORT* Pcm,
+    _Out_writes_bytes_(SBC_MAX_FRAME_BYTES) PUCHAR Frame
+)
+{
+    PSBC_CONFIG config = &Encoder->Config;
+    ULONG M = config->Subbands;
+    ULONG blocks = config->Blocks;
+    ULONG channels = Encoder->Channels;
+    ULONG samples = blocks * M;
+    SBC_SIMD_STATE state;
+    SBC_WRITER writer;
+    SBC_ISA isa = Encoder->Isa;
+    BOOLEAN saved = FALSE;
+    UCHAR crc;
+    ULONG ch, sb, blk, n;
+
+    UNREFERENCED_PARAMETER(state);
+
+    for (ch = 0; ch < channels; ch++) {
+        float* buffer = Encoder->Buffer[ch] + 9 * M;
+
+        for (n = 0; n < samples; n++) {
+            buffer[n] = (float)Pcm[n * channels + ch];
+        }
+    }
+
+#if defined(_KERNEL_MODE) && SBC_X86
+    if (isa == SbcIsaAvx2) {
+        if (NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &state))) {
+            saved = TRUE;
+        } else {
+            isa = SbcIsaSse41;
+        }
+    }
+#endif
+
+    for (blk = 0; blk < blocks; blk++) {
+        for (ch = 0; ch < channels; ch++) {
+            const float* input = Encoder->Buffer[ch] + (blk + 8) * M;
+            float* output = Encoder->Samples[blk][ch];
+
+#if SBC_X86
+            if (isa == SbcIsaAvx2) {
+                SbcAnalyzeAvx2(Encoder, input, output);
+                continue;
+            }
+            if (isa == SbcIsaSse41) {
+                SbcAnalyzeSse41(Encoder, input, output);
+                continue;
+            }
+#endif
+            SbcAnalyzeScalar(Encoder, input, output);
+        }
+    }
+
+#if defined(_KERNEL_MODE) && SBC_X86
+    if (saved) {
+        KeRestoreExtendedProcessorState(&state);
+    }
+#else
+    UNREFERENCED_PARAMETER(saved);
+#endif
+
+    // Keep nine blocks of look-back for the next frame
+    for (ch = 0; ch < channels; ch++) {
+        RtlMoveMemory(Encoder->Buffer[ch], Encoder->Buffer[ch] + samples, 9 * M * sizeof(float));
+    }
+
+    for (ch = 0; ch < channels; ch++) {
+        for (sb = 0; sb < M; sb++) {
+            Encoder->ScaleFactor[ch][sb] = SbcScaleFactor(SbcPeak(Encoder, ch, sb));
+        }
+    }
+
+    Encoder->Join = 0;
+    if (config->ChannelMode == SbcModeJointStereo) {
+        SbcJointStereo(Encoder);
+    }
+
+    if (config->ChannelMode >= SbcModeStereo) {
+        SbcAllocate(Encoder, 0, 2);
+    } else {
+        for (ch = 0; ch < channels; ch++) {
+            SbcAllocate(Encoder, ch, 1);
+        }
+    }
+
+    Frame[0] = SBC_SYNCWORD;
+    Frame[1] = (UCHAR)((Encoder->FrequencyIndex << 6) | ((blocks / 4 - 1) << 4) |
+        (config->ChannelMode << 2) | (config->Allocation << 1) | ((M == 8) ? 1 : 0));
+    Frame[2] = (UCHAR)config->Bitpool;
+
+    crc = SbcCrc8(SBC_CRC_INIT, Frame[1], 8);
+    crc = SbcCrc8(crc, Frame[2], 8);
+
+    writer.Buffer = Frame;
+    writer.Position = 4;
+    writer.Accumulator = 0;
+    writer.Pending = 0;
+
+    if (config->ChannelMode == SbcModeJointStereo) {
+        SbcPut(&writer, Encoder->Join, M);
+        crc = SbcCrc8(crc, Encoder->Join, M);
+    }
+
+    for (ch = 0; ch < channels; ch++) {
+        for (sb = 0; sb < M; sb++) {
+            SbcPut(&writer, (ULONG)Encoder->ScaleFactor[ch][sb], 4);
+            crc = SbcCrc8(crc, (ULONG)Encoder->ScaleFactor[ch][sb], 4);
+        }
+    }
+
+    Frame[3] = crc;
+
+    // audio_sample = floor((sample / 2^(sf + 1) + 1) * levels / 2)
+    for (blk = 0; blk < blocks; blk++) {
+        for (ch = 0; ch < channels; ch++) {
+            for (sb = 0; sb < M; sb++) {
+                LONG bits = Encoder->Bits[ch][sb];
+                ULONG levels, q;
+                union { float f; ULONG u; } scale;
+                float t;
+
+                if (bits == 0) {
+                    continue;
+                }
+
+                levels = (1UL << bits) - 1;
+                scale.u = (ULONG)(126 - Encoder->ScaleFactor[ch][sb]) << 23;
+                t = (Encoder->Samples[blk][ch][sb] * scale.f + 1.0f) * ((float)levels * 0.5f);
+
+                q = (t <= 0.0f) ? 0 : (ULONG)t;
+                SbcPut(&writer, min(q, levels), (ULONG)bits);
+            }
+        }
+    }
+
+    SbcFlush(&writer);
+
+    for (n = writer.Position; n < Encoder->FrameBytes; n++) {
+        Frame[n] = 0;
+    }
+
+    return Encoder->FrameBytes;
+}
@@ -0,0 +1,100 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSbc.h
+
+Abstract:
+    SBC encoder for classic A2DP sinks. Portable C with SSE4.1/AVX2
+    analysis filterbank kernels; builds in the driver and in user-mode
+    tools.
+
+--*/
+
+#ifndef _MULTIDEVICEBTSBC_H_
+#define _MULTIDEVICEBTSBC_H_
+
+#define SBC_SYNCWORD            0x9C
+#define SBC_MAX_CHANNELS        2
+#define SBC_MAX_SUBBANDS        8
+#define SBC_MAX_BLOCKS          16
+#define SBC_MIN_BITPOOL         2
+#define SBC_MAX_BITPOOL         250
+#define SBC_MAX_FRAME_BYTES     524     // Dual channel, 8 subbands, 16 blocks, bitpool 128
+#define SBC_MAX_FRAME_SAMPLES   (SBC_MAX_BLOCKS * SBC_MAX_SUBBANDS)
+
+// History plus one frame of input per channel: 9 blocks of look-back
+#define SBC_BUFFER_SAMPLES      (9 * SBC_MAX_SUBBANDS + SBC_MAX_FRAME_SAMPLES)
+
+typedef enum _SBC_CHANNEL_MODE {
+    SbcModeMono = 0,
+    SbcModeDualChannel = 1,
+    SbcModeStereo = 2,
+    SbcModeJointStereo = 3
+} SBC_CHANNEL_MODE;
+
+typedef enum _SBC_ALLOCATION {
+    SbcAllocationLoudness = 0,
+    SbcAllocationSnr = 1
+} SBC_ALLOCATION;
+
+typedef enum _SBC_ISA {
+    SbcIsaScalar = 0,
+    SbcIsaSse41 = 1,
+    SbcIsaAvx2 = 2,
+    SbcIsaBest = 0xFF           // SbcEncoderInitialize: pick the best the CPU supports
+} SBC_ISA;
+
+// Codec configuration, as negotiated in the A2DP SBC codec capabilities
+typedef struct _SBC_CONFIG {
+    ULONG SampleRate;           // 16000, 32000, 44100 or 48000
+    ULONG ChannelMode;          // SBC_CHANNEL_MODE
+    ULONG Blocks;               // 4, 8, 12 or 16
+    ULONG Subbands;             // 4 or 8
+    ULONG Allocation;           // SBC_ALLOCATION
+    ULONG Bitpool;
+} SBC_CONFIG, *PSBC_CONFIG;
+
+typedef struct _SBC_ENCODER {
+    SBC_CONFIG Config;
+    SBC_ISA Isa;
+    ULONG Channels;
+    ULONG FrequencyIndex;
+    ULONG FrameBytes;
+
+    // Analysis window regrouped for the kernels: Window[k][m] holds
+    // C[2M - 1 - m + 2Mk], so each of the five taps reads input and
+    // coefficients at ascending addresses
+    float Window[5][2 * SBC_MAX_SUBBANDS];
+    float Buffer[SBC_MAX_CHANNELS][SBC_BUFFER_SAMPLES];
+
+    // Per-frame working state, [block][channel][subband]
+    float Samples[SBC_MAX_BLOCKS][SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+    LONG ScaleFactor[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+    LONG Bits[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+    UCHAR Join;                 // Bit (M - 1 - sb) set: subband sb coded mid/side
+} SBC_ENCODER, *PSBC_ENCODER;
+
+SBC_ISA SbcDetectIsa(
+    VOID
+);
+
+// Validates a configuration and returns its frame length, or 0 if invalid
+ULONG SbcFrameLength(
+    _In_ PSBC_CONFIG Config
+);
+
+NTSTATUS SbcEncoderInitialize(
+    _Out_ PSBC_ENCODER Encoder,
+    _In_ PSBC_CONFIG Config,
+    _In_ SBC_ISA Isa
+);
+
+// Pcm holds Blocks * Subbands interleaved samples per channel; Frame
+// receives FrameBytes. Returns the frame length.
+ULONG SbcEncodeFrame(
+    _Inout_ PSBC_ENCODER Encoder,
+    _In_ const SHORT* Pcm,
+    _Out_writes_bytes_(SBC_MAX_FRAME_BYTES) PUCHAR Frame
+);
+
+#endif // _MULTIDEVICEBTSBC_H_
@@ -0,0 +1,405 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSbcFanout.c
+
+Abstract:
+    Encode-once SBC fan-out for classic A2DP multi-sink output.
+
+    Each audio lane carrying SBC is attached with the configuration its
+    sink negotiated. Lanes with identical configurations join one group,
+    which owns the only encoder for them. Submitted PCM is encoded once
+    per group and the frame is queued on every member lane. Without
+    groups, N headsets on the same settings would cost N encodes of the
+    same audio.
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+/*++
+Routine Description:
+    Initializes the device's fan-out groups
+--*/
+VOID
+SbcFanoutInitialize(
+    _Out_ PSBC_FANOUT Fanout
+)
+{
+    RtlZeroMemory(Fanout, sizeof(*Fanout));
+    ExInitializeFastMutex(&Fanout->Mutex);
+}
+
+static VOID
+SbcFanoutFreeGroup(
+    _Inout_ PSBC_FANOUT_GROUP Group
+)
+{
+    if (Group->Encoder != NULL) {
+        ExFreePoolWithTag(Group->Encoder, SBC_FANOUT_POOL_TAG);
+    }
+
+    RtlZeroMemory(Group, sizeof(*Group));
+}
+
+/*++
+Routine Description:
+    Releases every group's encoder; called from device cleanup
+--*/
+VOID
+SbcFanoutCleanup(
+    _Inout_ PSBC_FANOUT Fanout
+)
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Fanout->Mutex);
+
+    for (i = 0; i < SBC_FANOUT_MAX_GROUPS; i++) {
+        SbcFanoutFreeGroup(&Fanout->Groups[i]);
+    }
+
+    ExReleaseFastMutex(&Fanout->Mutex);
+}
+
+/*++
+Routine Description:
+    Queues the group's current frame on every member lane. Lanes are
+    reached through their slot rundown references, as in
+    HandleAudioSubmit, so a lane being destroyed is skipped rather than
+    waited for.
+--*/
+static VOID
+SbcFanoutDeliver(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Inout_ PSBC_FANOUT_GROUP Group,
+    _In_ ULONG Length
+)
+{
+    ULONG lane;
+
+    for (lane = 0; lane < AUDIO_MAX_LANES; lane++) {
+        PAUDIO_LANE_SLOT slot = &DeviceContext->AudioLanes.Slots[lane];
+        NTSTATUS status = STATUS_NOT_FOUND;
+
+        if ((Group->Stats.LaneMask & (1UL << lane)) == 0) {
+            continue;
+        }
+
+        if (ExAcquireRundownProtection(&slot->Rundown)) {
+            if (slot->Lane != NULL) {
+                status = AudioLaneSubmit(slot->Lane, Group->Frame, Length,
+                    Group->PendingTimestamp);
+            }
+            ExReleaseRundownProtection(&slot->Rundown);
+        }
+
+        if (NT_SUCCESS(status)) {
+            Group->Stats.FramesDelivered++;
+        } else {
+            Group->Stats.FramesDropped++;
+        }
+    }
+}
+
+/*++
+Routine Description:
+    Appends PCM to a group's pending frame, converting the channel
+    count, and encodes and delivers each frame as it completes
+
+Arguments:
+    DeviceContext - Device context
+    Group - Group to feed
+    Header - Submission header
+    Pcm - Interleaved samples, Header->Channels per sample frame
+    Samples - Sample frames in Pcm
+
+Return Value:
+    None
+--*/
+static VOID
+SbcFanoutFeed(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Inout_ PSBC_FANOUT_GROUP Group,
+    _In_ PSBC_PCM_HEADER Header,
+    _In_reads_(Samples * Header->Channels) const SHORT* Pcm,
+    _In_ ULONG Samples
+)
+{
+    PSBC_ENCODER encoder = Group->Encoder;
+    ULONG channels = encoder->Channels;
+    ULONG n;
+
+    for (n = 0; n < Samples; n++) {
+        const SHORT* in = Pcm + (SIZE_T)n * Header->Channels;
+        PSHORT out = Group->Pending + Group->PendingSamples * channels;
+
+        if (Group->PendingSamples == 0) {
+            Group->PendingTimestamp = Header->Timestamp +
+                (LONGLONG)n * 10000000 / Header->SampleRate;
+        }
+
+        if (channels == Header->Channels) {
+            out[0] = in[0];
+            if (channels == 2) {
+                out[1] = in[1];
+            }
+        } else if (channels == 1) {
+            out[0] = (SHORT)(((LONG)in[0] + in[1]) / 2);
+        } else {
+            out[0] = in[0];
+            out[1] = in[0];
+        }
+
+        if (++Group->PendingSamples == Group->FrameSamples) {
+            ULONG length = SbcEncodeFrame(encoder, Group->Pending, Group->Frame);
+
+            Group->Stats.FramesEncoded++;
+            Group->PendingSamples = 0;
+            SbcFanoutDeliver(DeviceContext, Group, length);
+        }
+    }
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_SBC_FANOUT_ATTACH. A lane belongs to at most
+    one group: attaching moves it to the group for its configuration,
+    creating the group and its encoder if none matches. A group whose
+    last lane leaves is freed.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    BytesReturned - Receives zero
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleSbcFanoutAttach(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PSBC_FANOUT_ATTACH attach;
+    PSBC_FANOUT fanout = &DeviceContext->SbcFanout;
+    PSBC_FANOUT_GROUP group = NULL;
+    ULONG laneBit, frameBytes, i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(SBC_FANOUT_ATTACH), (PVOID*)&attach, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (attach->LaneId >= AUDIO_MAX_LANES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    laneBit = 1UL << attach->LaneId;
+
+    if (attach->Attach) {
+        frameBytes = SbcFrameLength(&attach->Config);
+        if (frameBytes == 0 || frameBytes > AUDIO_FRAME_MAX_BYTES) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    ExAcquireFastMutex(&fanout->Mutex);
+
+    for (i = 0; i < SBC_FANOUT_MAX_GROUPS; i++) {
+        PSBC_FANOUT_GROUP member = &fanout->Groups[i];
+
+        if (member->Encoder == NULL || (member->Stats.LaneMask & laneBit) == 0) {
+            continue;
+        }
+
+        member->Stats.LaneMask &= ~laneBit;
+        if (member->Stats.LaneMask == 0) {
+            SbcFanoutFreeGroup(member);
+        }
+    }
+
+    if (!attach->Attach) {
+        goto Exit;
+    }
+
+    for (i = 0; i < SBC_FANOUT_MAX_GROUPS; i++) {
+        if (fanout->Groups[i].Encoder != NULL &&
+            RtlEqualMemory(&fanout->Groups[i].Stats.Config, &attach->Config, sizeof(SBC_CONFIG))) {
+            group = &fanout->Groups[i];
+            break;
+        }
+    }
+
+    if (group == NULL) {
+        for (i = 0; i < SBC_FANOUT_MAX_GROUPS; i++) {
+            if (fanout->Groups[i].Encoder == NULL) {
+                group = &fanout->Groups[i];
+                break;
+            }
+        }
+
+        // Unreachable while groups >= lanes, but keep the table honest
+        if (group == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        group->Encoder = (PSBC_ENCODER)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            sizeof(SBC_ENCODER), SBC_FANOUT_POOL_TAG);
+        if (group->Encoder == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        status = SbcEncoderInitialize(group->Encoder, &attach->Config, SbcIsaBest);
+        if (!NT_SUCCESS(status)) {
+            SbcFanoutFreeGroup(group);
+            goto Exit;
+        }
+
+        group->FrameSamples = attach->Config.Blocks * attach->Config.Subbands;
+        group->Stats.Config = attach->Config;
+        group->Stats.FrameBytes = group->Encoder->FrameBytes;
+
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MultiDeviceBT: SBC group %u: %u Hz, mode %u, %u/%u, bitpool %u, %u byte frames, ISA %u\n",
+            i, attach->Config.SampleRate, attach->Config.ChannelMode, attach->Config.Blocks,
+            attach->Config.Subbands, attach->Config.Bitpool, group->Encoder->FrameBytes,
+            group->Encoder->Isa));
+    }
+
+    group->Stats.LaneMask |= laneBit;
+
+Exit:
+    ExReleaseFastMutex(&fanout->Mutex);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_SBC_SUBMIT_PCM: SBC_PCM_HEADER followed by
+    interleaved PCM. Any length is accepted; partial frames are carried
+    in each group until the next submission completes them.
+--*/
+NTSTATUS
+HandleSbcSubmitPcm(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PSBC_PCM_HEADER header;
+    PSBC_FANOUT fanout = &DeviceContext->SbcFanout;
+    size_t length;
+    ULONG samples, i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(SBC_PCM_HEADER), (PVOID*)&header, &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if ((header->Channels != 1 && header->Channels != 2) || header->SampleRate == 0 ||
+        header->Length > length - sizeof(SBC_PCM_HEADER) ||
+        (header->Length % (header->Channels * sizeof(SHORT))) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    samples = header->Length / (header->Channels * sizeof(SHORT));
+
+    ExAcquireFastMutex(&fanout->Mutex);
+
+    for (i = 0; i < SBC_FANOUT_MAX_GROUPS; i++) {
+        PSBC_FANOUT_GROUP group = &fanout->Groups[i];
+
+        if (group->Encoder == NULL) {
+            continue;
+        }
+
+        if (group->Stats.Config.SampleRate != header->SampleRate) {
+            group->Stats.RateMismatches++;
+            continue;
+        }
+
+        SbcFanoutFeed(DeviceContext, group, header, (const SHORT*)(header + 1), samples);
+    }
+
+    ExReleaseFastMutex(&fanout->Mutex);
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_SBC_FANOUT_STATS
+--*/
+NTSTATUS
+HandleGetSbcFanoutStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PSBC_FANOUT_STATS stats;
+    PSBC_FANOUT fanout = &DeviceContext->SbcFanout;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(SBC_FANOUT_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlZeroMemory(stats, sizeof(*stats));
+
+    ExAcquireFastMutex(&fanout->Mutex);
+
+    for (i = 0; i < SBC_FANOUT_MAX_GROUPS; i++) {
+        if (fanout->Groups[i].Encoder != NULL) {
+            stats->Groups[stats->GroupCount++] = fanout->Groups[i].Stats;
+        }
+    }
+
+    ExReleaseFastMutex(&fanout->Mutex);
+
+    *BytesReturned = sizeof(SBC_FANOUT_STATS);
+    return STATUS_SUCCESS;
+}
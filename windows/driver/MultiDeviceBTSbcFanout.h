@@ -0,0 +1,77 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSbcFanout.h
+
+Abstract:
+    Encode-once SBC fan-out to classic A2DP sinks. Audio lanes that
+    negotiated the same SBC configuration share one encoder; each frame
+    is encoded once and queued on every lane in the group.
+
+--*/
+
+#ifndef _MULTIDEVICEBTSBCFANOUT_H_
+#define _MULTIDEVICEBTSBCFANOUT_H_
+
+#include "MultiDeviceBTSbc.h"
+
+#define SBC_FANOUT_MAX_GROUPS       AUDIO_MAX_LANES     // Each group holds at least one lane
+#define SBC_FANOUT_POOL_TAG         'SDBM'
+
+// Attach or detach a lane (IOCTL_MULTI_BT_SBC_FANOUT_ATTACH)
+typedef struct _SBC_FANOUT_ATTACH {
+    ULONG LaneId;
+    BOOLEAN Attach;             // FALSE removes the lane from its group
+    SBC_CONFIG Config;
+} SBC_FANOUT_ATTACH, *PSBC_FANOUT_ATTACH;
+
+// PCM submission header (IOCTL_MULTI_BT_SBC_SUBMIT_PCM), followed by
+// interleaved 16-bit samples
+typedef struct _SBC_PCM_HEADER {
+    ULONG SampleRate;
+    ULONG Channels;             // 1 or 2; converted per group as needed
+    ULONG Length;               // Bytes of PCM following the header
+    LONGLONG Timestamp;         // Of the first sample, 100 ns units
+} SBC_PCM_HEADER, *PSBC_PCM_HEADER;
+
+typedef struct _SBC_FANOUT_GROUP_STATS {
+    SBC_CONFIG Config;
+    ULONG LaneMask;             // Bit n set: lane n receives this group's frames
+    ULONG FrameBytes;
+    ULONG FramesEncoded;
+    ULONG FramesDelivered;      // Exceeds FramesEncoded by the encodes saved
+    ULONG FramesDropped;        // Lane ring full, busy or destroyed
+    ULONG RateMismatches;       // PCM submissions at another sample rate
+} SBC_FANOUT_GROUP_STATS, *PSBC_FANOUT_GROUP_STATS;
+
+// Counters (IOCTL_MULTI_BT_GET_SBC_FANOUT_STATS)
+typedef struct _SBC_FANOUT_STATS {
+    ULONG GroupCount;
+    SBC_FANOUT_GROUP_STATS Groups[SBC_FANOUT_MAX_GROUPS];
+} SBC_FANOUT_STATS, *PSBC_FANOUT_STATS;
+
+typedef struct _SBC_FANOUT_GROUP {
+    PSBC_ENCODER Encoder;       // NULL when the group is unused
+    ULONG FrameSamples;         // Blocks * Subbands
+    ULONG PendingSamples;       // Per channel, buffered toward the next frame
+    LONGLONG PendingTimestamp;
+    SHORT Pending[SBC_MAX_FRAME_SAMPLES * SBC_MAX_CHANNELS];
+    UCHAR Frame[SBC_MAX_FRAME_BYTES];
+    SBC_FANOUT_GROUP_STATS Stats;
+} SBC_FANOUT_GROUP, *PSBC_FANOUT_GROUP;
+
+// Attach, detach, submission and stats all serialize on Mutex
+typedef struct _SBC_FANOUT {
+    FAST_MUTEX Mutex;
+    SBC_FANOUT_GROUP Groups[SBC_FANOUT_MAX_GROUPS];
+} SBC_FANOUT, *PSBC_FANOUT;
+
+VOID SbcFanoutInitialize(
+    _Out_ PSBC_FANOUT Fanout
+);
+
+VOID SbcFanoutCleanup(
+    _Inout_ PSBC_FANOUT Fanout
+);
+
+#endif // _MULTIDEVICEBTSBCFANOUT_H_
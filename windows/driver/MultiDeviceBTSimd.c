@@ -0,0 +1,90 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSimd.c
+
+Abstract:
+    Detects the widest SIMD instruction set the CPU and OS support, for
+    the kernels that pick a scalar, SSE4.1 or AVX2 path at
+    initialization. AVX2 also needs the OS to save the YMM state, which
+    XGETBV reports.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+#include "MultiDeviceBTSimd.h"
+
+/*++
+Routine Description:
+    Returns the widest instruction set this CPU and OS support
+--*/
+SIMD_ISA
+SimdDetectIsa(
+    VOID
+)
+{
+#if SIMD_X86
+    int regs[4];
+    unsigned long long xcr0;
+    BOOLEAN sse41, avx, avx2 = FALSE;
+
+#ifdef _MSC_VER
+    __cpuid(regs, 1);
+#else
+    __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+
+    sse41 = (regs[2] & (1 << 19)) != 0;
+    avx = (regs[2] & (1 << 27)) != 0 && (regs[2] & (1 << 28)) != 0;
+
+    if (avx) {
+#ifdef _MSC_VER
+        xcr0 = _xgetbv(0);
+#else
+        {
+            unsigned int lo, hi;
+            __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            xcr0 = ((unsigned long long)hi << 32) | lo;
+        }
+#endif
+        if ((xcr0 & 6) == 6) {
+#ifdef _MSC_VER
+            __cpuidex(regs, 7, 0);
+#else
+            __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+            avx2 = (regs[1] & (1 << 5)) != 0;
+        }
+    }
+
+    if (avx2) {
+        return SimdIsaAvx2;
+    }
+    if (sse41) {
+        return SimdIsaSse41;
+    }
+#endif
+
+    return SimdIsaScalar;
+}
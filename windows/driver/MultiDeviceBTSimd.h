@@ -0,0 +1,28 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSimd.h
+
+Abstract:
+    CPU instruction set detection shared by the SIMD audio kernels (SBC
+    encoder, drift resampler). Portable C; builds in the driver and in
+    user-mode tools.
+
+--*/
+
+#ifndef _MULTIDEVICEBTSIMD_H_
+#define _MULTIDEVICEBTSIMD_H_
+
+// Instruction set used by the kernels
+typedef enum _SIMD_ISA {
+    SimdIsaScalar = 0,
+    SimdIsaSse41 = 1,
+    SimdIsaAvx2 = 2,
+    SimdIsaBest = 0xFF          // Initializers: pick the best the CPU supports
+} SIMD_ISA;
+
+SIMD_ISA SimdDetectIsa(
+    VOID
+);
+
+#endif // _MULTIDEVICEBTSIMD_H_
@@ -0,0 +1,538 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSnoop.c
+
+Abstract:
+    Packet capture rings and btsnoop formatting.
+
+    A packet path must not format anything: the old way to see traffic
+    was a debug print per packet, which cost more than the packet. A
+    push copies a 32-byte entry and at most the snap length of the
+    packet into the ring, then publishes the new tail. Entries and
+    packet bytes have separate arrays, so a short snap costs only the
+    bytes it keeps. A full ring drops the packet and counts it; the
+    producer never waits.
+
+    The writer pops an entry with its bytes and turns it into a btsnoop
+    record: H4 indicator, ACL and L2CAP headers rebuilt where the path
+    only had the L2CAP frame or payload, big-endian header, timestamp
+    in microseconds since year 0. Key material is zeroed on the way
+    out: link keys and LTKs in commands and events, and the keys SMP
+    distributes. A capture file never holds a key the bond store would
+    not hand out.
+
+    The reader goes the other way for replay tools. Files from the
+    field run to gigabytes, so it reads whatever piece of one the
+    caller has in memory and stops before a record the piece cuts off,
+    as the HCI event reader does with events. Packets are not copied;
+    a record points into the piece.
+
+Environment:
+    Kernel mode and user mode
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <bthdef.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+
+#include "MultiDeviceBTSnoop.h"
+
+// Commands and events that carry a key, and where the key sits in
+// their parameters
+#define SNOOP_OP_LINK_KEY_REPLY     0x040B  // BD_ADDR, link key
+#define SNOOP_OP_LE_ENCRYPT         0x2019  // Handle, Rand, EDIV, LTK
+#define SNOOP_OP_LE_LTK_REPLY       0x201A  // Handle, LTK
+#define SNOOP_EV_LINK_KEY           0x18    // BD_ADDR, link key, key type
+#define SNOOP_KEY_BYTES             16
+
+// SMP key distribution: opcode, then the key
+#define SNOOP_SMP_ENCRYPTION_INFO   0x06
+#define SNOOP_SMP_IDENTITY_INFO     0x08
+#define SNOOP_SMP_SIGNING_INFO      0x0A
+
+static __forceinline VOID
+SnoopPut16(
+    _Out_writes_bytes_(2) PUCHAR Out,
+    _In_ ULONG Value
+)
+{
+    Out[0] = (UCHAR)Value;
+    Out[1] = (UCHAR)(Value >> 8);
+}
+
+static __forceinline VOID
+SnoopPut32Be(
+    _Out_writes_bytes_(4) PUCHAR Out,
+    _In_ ULONG Value
+)
+{
+    Out[0] = (UCHAR)(Value >> 24);
+    Out[1] = (UCHAR)(Value >> 16);
+    Out[2] = (UCHAR)(Value >> 8);
+    Out[3] = (UCHAR)Value;
+}
+
+static __forceinline VOID
+SnoopPut64Be(
+    _Out_writes_bytes_(8) PUCHAR Out,
+    _In_ ULONG64 Value
+)
+{
+    SnoopPut32Be(Out, (ULONG)(Value >> 32));
+    SnoopPut32Be(Out + 4, (ULONG)Value);
+}
+
+static __forceinline ULONG
+SnoopGet32Be(
+    _In_reads_bytes_(4) const UCHAR* In
+)
+{
+    return ((ULONG)In[0] << 24) | ((ULONG)In[1] << 16) | ((ULONG)In[2] << 8) | In[3];
+}
+
+// Zeroes Length bytes at Offset, as far as the capture reaches
+static VOID
+SnoopZero(
+    _Inout_updates_bytes_(Captured) PUCHAR Data,
+    _In_ ULONG Captured,
+    _In_ ULONG Offset,
+    _In_ ULONG Length
+)
+{
+    if (Offset < Captured) {
+        RtlZeroMemory(Data + Offset, min(Length, Captured - Offset));
+    }
+}
+
+static VOID
+SnoopRedact(
+    _In_ const SNOOP_ENTRY* Entry,
+    _Inout_updates_bytes_(Entry->Captured) PUCHAR Data
+)
+{
+    ULONG captured = Entry->Captured;
+    ULONG smp;
+
+    if (Entry->Type == SNOOP_TYPE_COMMAND && captured >= 3) {
+        switch (Data[0] | (Data[1] << 8)) {
+        case SNOOP_OP_LINK_KEY_REPLY:
+            SnoopZero(Data, captured, 3 + 6, SNOOP_KEY_BYTES);
+            break;
+        case SNOOP_OP_LE_ENCRYPT:
+            SnoopZero(Data, captured, 3 + 12, SNOOP_KEY_BYTES);
+            break;
+        case SNOOP_OP_LE_LTK_REPLY:
+            SnoopZero(Data, captured, 3 + 2, SNOOP_KEY_BYTES);
+            break;
+        }
+        return;
+    }
+
+    if (Entry->Type == SNOOP_TYPE_EVENT) {
+        if (captured >= 2 && Data[0] == SNOOP_EV_LINK_KEY) {
+            SnoopZero(Data, captured, 2 + 6, SNOOP_KEY_BYTES);
+        }
+        return;
+    }
+
+    if (Entry->Type != SNOOP_TYPE_ACL || Entry->Cid != SNOOP_CID_SMP) {
+        return;
+    }
+
+    smp = (Entry->Framing == SNOOP_FRAMING_L2CAP_PAYLOAD) ? 0 :
+          (Entry->Framing == SNOOP_FRAMING_L2CAP_FRAME) ? SNOOP_L2CAP_HEADER_BYTES :
+          SNOOP_ACL_HEADER_BYTES + SNOOP_L2CAP_HEADER_BYTES;
+    if (smp < captured &&
+        (Data[smp] == SNOOP_SMP_ENCRYPTION_INFO || Data[smp] == SNOOP_SMP_IDENTITY_INFO ||
+         Data[smp] == SNOOP_SMP_SIGNING_INFO)) {
+        SnoopZero(Data, captured, smp + 1, SNOOP_KEY_BYTES);
+    }
+}
+
+/*++
+Routine Description:
+    Initializes an empty ring
+--*/
+VOID
+SnoopRingInitialize(
+    _Out_ PSNOOP_RING Ring
+)
+{
+    Ring->Tail = 0;
+    Ring->DataTail = 0;
+    Ring->Captured = 0;
+    Ring->Dropped = 0;
+    Ring->Head = 0;
+    Ring->DataHead = 0;
+}
+
+/*++
+Routine Description:
+    Tells whether a filter keeps a packet
+
+Arguments:
+    Filter - Filter
+    Entry - Packet's type, direction and, for data, device and channel
+
+Return Value:
+    TRUE to capture the packet
+--*/
+BOOLEAN
+SnoopFilterMatch(
+    _In_ const SNOOP_FILTER* Filter,
+    _In_ const SNOOP_ENTRY* Entry
+)
+{
+    if (Entry->Type > SNOOP_TYPE_ISO ||
+        (Filter->Types & SNOOP_TYPE_BIT(Entry->Type)) == 0 ||
+        (Filter->Directions & SNOOP_DIRECTION_BIT(Entry->Direction)) == 0) {
+        return FALSE;
+    }
+
+    if (Entry->Type == SNOOP_TYPE_COMMAND || Entry->Type == SNOOP_TYPE_EVENT) {
+        return TRUE;
+    }
+
+    return (Filter->DeviceAddress == 0 || Filter->DeviceAddress == Entry->DeviceAddress) &&
+        (Filter->Cid == 0 || Filter->Cid == Entry->Cid);
+}
+
+/*++
+Routine Description:
+    Producer side: appends an entry and the packet's first SnapLength
+    bytes. Only the ring's one producer may call this.
+
+Arguments:
+    Ring - Ring
+    SnapLength - Bytes to keep; 0 or more than SNOOP_MAX_SNAP keeps SNOOP_MAX_SNAP
+    Entry - Timestamp, lengths and addressing; DataOffset and Captured are set here
+    Data - Packet bytes, as Entry->Framing has them
+    Length - Bytes at Data
+
+Return Value:
+    FALSE if the ring was full and the packet dropped
+--*/
+BOOLEAN
+SnoopRingPush(
+    _Inout_ PSNOOP_RING Ring,
+    _In_ ULONG SnapLength,
+    _In_ const SNOOP_ENTRY* Entry,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+)
+{
+    ULONG tail = Ring->Tail;
+    ULONG keep, offset, first;
+    PSNOOP_ENTRY slot;
+
+    if (SnapLength == 0 || SnapLength > SNOOP_MAX_SNAP) {
+        SnapLength = SNOOP_MAX_SNAP;
+    }
+    keep = min(Length, SnapLength);
+
+    if (tail - ReadULongAcquire(&Ring->Head) >= SNOOP_RING_ENTRIES ||
+        Ring->DataTail - ReadULongAcquire(&Ring->DataHead) > SNOOP_RING_BYTES - keep) {
+        Ring->Dropped++;
+        return FALSE;
+    }
+
+    offset = Ring->DataTail & (SNOOP_RING_BYTES - 1);
+    first = min(keep, SNOOP_RING_BYTES - offset);
+    RtlCopyMemory(&Ring->Data[offset], Data, first);
+    RtlCopyMemory(Ring->Data, Data + first, keep - first);
+
+    slot = &Ring->Entries[tail & (SNOOP_RING_ENTRIES - 1)];
+    *slot = *Entry;
+    slot->DataOffset = Ring->DataTail;
+    slot->Captured = (USHORT)keep;
+
+    Ring->DataTail += keep;
+    Ring->Captured++;
+
+    // Publish the entry and its bytes before the new tail
+    WriteULongRelease(&Ring->Tail, tail + 1);
+    return TRUE;
+}
+
+/*++
+Routine Description:
+    Consumer side: the oldest entry, for its timestamp
+
+Return Value:
+    NULL if the ring is empty
+--*/
+const SNOOP_ENTRY*
+SnoopRingPeek(
+    _In_ PSNOOP_RING Ring
+)
+{
+    ULONG head = Ring->Head;
+
+    if (ReadULongAcquire(&Ring->Tail) == head) {
+        return NULL;
+    }
+
+    return &Ring->Entries[head & (SNOOP_RING_ENTRIES - 1)];
+}
+
+/*++
+Routine Description:
+    Consumer side: removes the oldest entry. The ring must not be empty.
+
+Arguments:
+    Ring - Ring
+    Entry - Receives the entry
+    Data - Receives Entry->Captured bytes
+--*/
+VOID
+SnoopRingPop(
+    _Inout_ PSNOOP_RING Ring,
+    _Out_ PSNOOP_ENTRY Entry,
+    _Out_writes_bytes_(SNOOP_MAX_SNAP) PUCHAR Data
+)
+{
+    ULONG head = Ring->Head;
+    ULONG offset, first;
+
+    *Entry = Ring->Entries[head & (SNOOP_RING_ENTRIES - 1)];
+
+    offset = Entry->DataOffset & (SNOOP_RING_BYTES - 1);
+    first = min((ULONG)Entry->Captured, SNOOP_RING_BYTES - offset);
+    RtlCopyMemory(Data, &Ring->Data[offset], first);
+    RtlCopyMemory(Data + first, Ring->Data, Entry->Captured - first);
+
+    WriteULongRelease(&Ring->DataHead, Entry->DataOffset + Entry->Captured);
+    WriteULongRelease(&Ring->Head, head + 1);
+}
+
+/*++
+Routine Description:
+    Writes the btsnoop file header: identification, version 1, H4
+
+Return Value:
+    SNOOP_FILE_HEADER_BYTES
+--*/
+ULONG
+SnoopFormatFileHeader(
+    _Out_writes_bytes_(SNOOP_FILE_HEADER_BYTES) PUCHAR Out
+)
+{
+    static const UCHAR Identification[8] = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+
+    RtlCopyMemory(Out, Identification, sizeof(Identification));
+    SnoopPut32Be(Out + 8, 1);
+    SnoopPut32Be(Out + 12, SNOOP_DATALINK_H4);
+    return SNOOP_FILE_HEADER_BYTES;
+}
+
+/*++
+Routine Description:
+    Formats one btsnoop record. Keys in Data are zeroed first.
+
+Arguments:
+    Entry - Popped entry
+    Data - Its bytes
+    Handle - Connection handle for rebuilt ACL headers
+    BaseUs - Added to the entry's timestamp to give microseconds since 1970
+    Drops - Packets dropped so far
+    Out - Receives the record
+
+Return Value:
+    Bytes written to Out
+--*/
+ULONG
+SnoopFormatRecord(
+    _In_ const SNOOP_ENTRY* Entry,
+    _Inout_updates_bytes_(Entry->Captured) PUCHAR Data,
+    _In_ USHORT Handle,
+    _In_ ULONG64 BaseUs,
+    _In_ ULONG Drops,
+    _Out_writes_bytes_(SNOOP_MAX_RECORD_BYTES) PUCHAR Out
+)
+{
+    PUCHAR packet = Out + SNOOP_RECORD_HEADER_BYTES;
+    ULONG headers = 1;
+    ULONG flags = 0;
+    ULONG l2cap;
+
+    SnoopRedact(Entry, Data);
+
+    packet[0] = Entry->Type;
+
+    if (Entry->Framing != SNOOP_FRAMING_HCI) {
+        l2cap = Entry->Length;
+        if (Entry->Framing == SNOOP_FRAMING_L2CAP_PAYLOAD) {
+            l2cap += SNOOP_L2CAP_HEADER_BYTES;
+            SnoopPut16(packet + 1 + SNOOP_ACL_HEADER_BYTES, Entry->Length);
+            SnoopPut16(packet + 3 + SNOOP_ACL_HEADER_BYTES, Entry->Cid);
+            headers += SNOOP_L2CAP_HEADER_BYTES;
+        }
+
+        // Start of a PDU: non-flushable from the host, flushable from the controller
+        SnoopPut16(packet + 1, (Handle & 0x0FFF) | (Entry->Direction == SNOOP_RECEIVED ? 0x2000 : 0));
+        SnoopPut16(packet + 3, l2cap);
+        headers += SNOOP_ACL_HEADER_BYTES;
+    }
+
+    RtlCopyMemory(packet + headers, Data, Entry->Captured);
+
+    if (Entry->Direction == SNOOP_RECEIVED) {
+        flags |= 0x01;
+    }
+    if (Entry->Type == SNOOP_TYPE_COMMAND || Entry->Type == SNOOP_TYPE_EVENT) {
+        flags |= 0x02;
+    }
+
+    SnoopPut32Be(Out, headers + Entry->Length);
+    SnoopPut32Be(Out + 4, headers + Entry->Captured);
+    SnoopPut32Be(Out + 8, flags);
+    SnoopPut32Be(Out + 12, Drops);
+    SnoopPut64Be(Out + 16, BaseUs + Entry->TimestampUs + SNOOP_EPOCH_DELTA_US);
+
+    return SNOOP_RECORD_HEADER_BYTES + headers + Entry->Captured;
+}
+
+/*++
+Routine Description:
+    Checks a btsnoop file header
+
+Arguments:
+    Header - Start of the file
+    Length - Bytes at Header
+    Datalink - Receives SNOOP_DATALINK_H1 or SNOOP_DATALINK_H4
+
+Return Value:
+    STATUS_INVALID_PARAMETER if this is not a btsnoop version 1 file,
+    STATUS_NOT_SUPPORTED for datalinks other than H1 and H4
+--*/
+NTSTATUS
+SnoopParseFileHeader(
+    _In_reads_bytes_(Length) const UCHAR* Header,
+    _In_ ULONG Length,
+    _Out_ PULONG Datalink
+)
+{
+    static const UCHAR Identification[8] = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+
+    *Datalink = 0;
+
+    if (Length < SNOOP_FILE_HEADER_BYTES ||
+        RtlCompareMemory(Header, Identification, sizeof(Identification)) != sizeof(Identification) ||
+        SnoopGet32Be(Header + 8) != 1) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    *Datalink = SnoopGet32Be(Header + 12);
+    if (*Datalink != SNOOP_DATALINK_H1 && *Datalink != SNOOP_DATALINK_H4) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+Routine Description:
+    Points the reader at the next piece of a file. Before the first,
+    zero the reader and set Datalink; the counters carry over.
+
+Arguments:
+    Reader - Reader
+    Buffer - Records, starting on a record boundary
+    Length - Bytes at Buffer
+--*/
+VOID
+SnoopReaderReset(
+    _Inout_ PSNOOP_READER Reader,
+    _In_reads_bytes_(Length) const UCHAR* Buffer,
+    _In_ ULONG Length
+)
+{
+    Reader->Buffer = Buffer;
+    Reader->Length = Length;
+    Reader->Offset = 0;
+}
+
+/*++
+Routine Description:
+    Returns the next record of the piece. Records without a packet or
+    with an unknown H4 type are counted and skipped.
+
+Arguments:
+    Reader - Reader
+    Record - Receives the record
+
+Return Value:
+    STATUS_NO_MORE_ENTRIES when the rest of the piece holds no whole
+    record, STATUS_FILE_CORRUPT_ERROR if a record claims more bytes
+    than any packet has
+--*/
+NTSTATUS
+SnoopReadRecord(
+    _Inout_ PSNOOP_READER Reader,
+    _Out_ PSNOOP_RECORD Record
+)
+{
+    const UCHAR* header;
+    const UCHAR* packet;
+    ULONG original, included, flags;
+    ULONG64 timestamp;
+
+    for (;;) {
+        if (Reader->Length - Reader->Offset < SNOOP_RECORD_HEADER_BYTES) {
+            return STATUS_NO_MORE_ENTRIES;
+        }
+
+        header = Reader->Buffer + Reader->Offset;
+        original = SnoopGet32Be(header);
+        included = SnoopGet32Be(header + 4);
+        flags = SnoopGet32Be(header + 8);
+
+        if (included > SNOOP_MAX_READ_BYTES - SNOOP_RECORD_HEADER_BYTES) {
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+        if (included > Reader->Length - Reader->Offset - SNOOP_RECORD_HEADER_BYTES) {
+            return STATUS_NO_MORE_ENTRIES;
+        }
+
+        Reader->Offset += SNOOP_RECORD_HEADER_BYTES + included;
+        packet = header + SNOOP_RECORD_HEADER_BYTES;
+
+        if (Reader->Datalink == SNOOP_DATALINK_H4) {
+            if (included == 0 || packet[0] < SNOOP_TYPE_COMMAND || packet[0] > SNOOP_TYPE_ISO) {
+                Reader->Malformed++;
+                continue;
+            }
+            Record->Type = packet[0];
+            packet++;
+            included--;
+            original = (original != 0) ? original - 1 : 0;
+        } else {
+            if (included == 0) {
+                Reader->Malformed++;
+                continue;
+            }
+            Record->Type = (flags & 0x02) == 0 ? SNOOP_TYPE_ACL :
+                (flags & 0x01) != 0 ? SNOOP_TYPE_EVENT : SNOOP_TYPE_COMMAND;
+        }
+
+        timestamp = ((ULONG64)SnoopGet32Be(header + 16) << 32) | SnoopGet32Be(header + 20);
+
+        Record->TimestampUs = (timestamp > SNOOP_EPOCH_DELTA_US) ? timestamp - SNOOP_EPOCH_DELTA_US : 0;
+        Record->Packet = packet;
+        Record->Length = included;
+        Record->OriginalLength = original;
+        Record->Drops = SnoopGet32Be(header + 12);
+        Record->Direction = (flags & 0x01) ? SNOOP_RECEIVED : SNOOP_SENT;
+        Record->Reserved = 0;
+        Reader->Records++;
+        return STATUS_SUCCESS;
+    }
+}
@@ -0,0 +1,176 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSnoop.h
+
+Abstract:
+    Packet capture in btsnoop format. A packet path pushes a short entry
+    and the packet's first bytes into its processor's ring; a writer
+    pops them and formats btsnoop records (datalink H4) for a file.
+    Each ring has one producer and one consumer, so neither side takes
+    a lock. A reader walks the records of a file, a piece at a time,
+    for tools that replay captures.
+
+    Portable C; builds in the driver and in user-mode tools. The caller
+    supplies the time, the storage and any locking.
+
+--*/
+
+#ifndef _MULTIDEVICEBTSNOOP_H_
+#define _MULTIDEVICEBTSNOOP_H_
+
+#define SNOOP_RING_ENTRIES          1024    // Per ring; power of two
+#define SNOOP_RING_BYTES            65536   // Per ring; power of two
+#define SNOOP_MAX_SNAP              1024    // Bytes kept of one packet
+#define SNOOP_FILE_HEADER_BYTES     16
+#define SNOOP_RECORD_HEADER_BYTES   24
+#define SNOOP_DATALINK_H1           1001    // No indicator; the flags tell commands from events
+#define SNOOP_DATALINK_H4           1002
+#define SNOOP_EPOCH_DELTA_US        0x00DCDDB30F2F8000ULL  // Year 0 to 1970, as btsnoop readers count it
+#define SNOOP_ACL_HEADER_BYTES      4
+#define SNOOP_L2CAP_HEADER_BYTES    4
+#define SNOOP_MAX_RECORD_BYTES      (SNOOP_RECORD_HEADER_BYTES + 1 + \
+                                     SNOOP_ACL_HEADER_BYTES + SNOOP_L2CAP_HEADER_BYTES + SNOOP_MAX_SNAP)
+#define SNOOP_MAX_READ_BYTES        (SNOOP_RECORD_HEADER_BYTES + 1 + 0x10000 + 4)  // Largest packet any H4 type allows
+
+// SNOOP_ENTRY.Type: the H4 packet indicator
+#define SNOOP_TYPE_COMMAND          0x01
+#define SNOOP_TYPE_ACL              0x02
+#define SNOOP_TYPE_SCO              0x03
+#define SNOOP_TYPE_EVENT            0x04
+#define SNOOP_TYPE_ISO              0x05
+#define SNOOP_TYPE_BIT(t)           (1UL << (t))
+#define SNOOP_TYPES_ALL             0x3E
+
+// SNOOP_ENTRY.Direction
+#define SNOOP_SENT                  0       // Host to controller
+#define SNOOP_RECEIVED              1
+#define SNOOP_DIRECTION_BIT(d)      (1 << (d))
+#define SNOOP_DIRECTIONS_ALL        0x03
+
+// SNOOP_ENTRY.Framing: what the bytes are; the writer adds the rest
+#define SNOOP_FRAMING_HCI           0       // Whole HCI packet after the indicator
+#define SNOOP_FRAMING_L2CAP_FRAME   1       // L2CAP frame, basic header included; ACL header added
+#define SNOOP_FRAMING_L2CAP_PAYLOAD 2       // Payload only; ACL and basic L2CAP headers added
+
+#define SNOOP_CID_SMP               0x0006
+
+// What to capture. Commands and events concern the controller, not a
+// device: the device and channel filters apply to data packets only.
+typedef struct _SNOOP_FILTER {
+    ULONG Types;                // SNOOP_TYPE_BIT() of each type kept
+    UCHAR Directions;           // SNOOP_DIRECTION_BIT() of each direction kept
+    UCHAR Reserved;
+    USHORT Cid;                 // 0: every channel
+    BTH_ADDR DeviceAddress;     // 0: every device
+    ULONG SnapLength;           // Bytes kept of each packet; 0 for SNOOP_MAX_SNAP
+    ULONG Reserved2;
+} SNOOP_FILTER, *PSNOOP_FILTER;
+
+typedef struct _SNOOP_ENTRY {
+    ULONG64 TimestampUs;
+    BTH_ADDR DeviceAddress;     // 0 for commands and events
+    ULONG Length;               // Whole packet, as Framing has it
+    ULONG DataOffset;           // Set by SnoopRingPush
+    USHORT Captured;            // Set by SnoopRingPush: bytes kept
+    USHORT Cid;                 // 0 for commands and events
+    UCHAR Type;                 // SNOOP_TYPE_*
+    UCHAR Direction;            // SNOOP_SENT or SNOOP_RECEIVED
+    UCHAR Framing;              // SNOOP_FRAMING_*
+    UCHAR Reserved;
+} SNOOP_ENTRY, *PSNOOP_ENTRY;
+
+// Tail and the data tail belong to the producer, Head and the data
+// head to the consumer; each pair has its own cache line
+typedef struct _SNOOP_RING {
+    DECLSPEC_CACHEALIGN volatile ULONG Tail;
+    ULONG DataTail;
+    ULONG64 Captured;
+    ULONG64 Dropped;            // Ring full
+    DECLSPEC_CACHEALIGN volatile ULONG Head;
+    volatile ULONG DataHead;
+    SNOOP_ENTRY Entries[SNOOP_RING_ENTRIES];
+    UCHAR Data[SNOOP_RING_BYTES];
+} SNOOP_RING, *PSNOOP_RING;
+
+// One record from SnoopReadRecord
+typedef struct _SNOOP_RECORD {
+    ULONG64 TimestampUs;        // Since 1970
+    const UCHAR* Packet;        // Into the reader's buffer, after the H4 indicator
+    ULONG Length;               // Bytes at Packet
+    ULONG OriginalLength;       // Before any snap, indicator excluded
+    ULONG Drops;                // As the capture recorded them, cumulative
+    UCHAR Type;                 // SNOOP_TYPE_*
+    UCHAR Direction;            // SNOOP_SENT or SNOOP_RECEIVED
+    USHORT Reserved;
+} SNOOP_RECORD, *PSNOOP_RECORD;
+
+// Reads records from one piece of a file; the caller moves what is
+// left after Offset to the front of the next piece
+typedef struct _SNOOP_READER {
+    const UCHAR* Buffer;
+    ULONG Length;
+    ULONG Offset;               // Bytes consumed, always on a record boundary
+    ULONG Datalink;             // SNOOP_DATALINK_H1 or SNOOP_DATALINK_H4
+    ULONG64 Records;
+    ULONG64 Malformed;          // Skipped: unknown type, or no packet
+} SNOOP_READER, *PSNOOP_READER;
+
+VOID SnoopRingInitialize(
+    _Out_ PSNOOP_RING Ring
+);
+
+BOOLEAN SnoopFilterMatch(
+    _In_ const SNOOP_FILTER* Filter,
+    _In_ const SNOOP_ENTRY* Entry
+);
+
+BOOLEAN SnoopRingPush(
+    _Inout_ PSNOOP_RING Ring,
+    _In_ ULONG SnapLength,
+    _In_ const SNOOP_ENTRY* Entry,
+    _In_reads_bytes_(Length) const UCHAR* Data,
+    _In_ ULONG Length
+);
+
+const SNOOP_ENTRY* SnoopRingPeek(
+    _In_ PSNOOP_RING Ring
+);
+
+VOID SnoopRingPop(
+    _Inout_ PSNOOP_RING Ring,
+    _Out_ PSNOOP_ENTRY Entry,
+    _Out_writes_bytes_(SNOOP_MAX_SNAP) PUCHAR Data
+);
+
+ULONG SnoopFormatFileHeader(
+    _Out_writes_bytes_(SNOOP_FILE_HEADER_BYTES) PUCHAR Out
+);
+
+ULONG SnoopFormatRecord(
+    _In_ const SNOOP_ENTRY* Entry,
+    _Inout_updates_bytes_(Entry->Captured) PUCHAR Data,
+    _In_ USHORT Handle,
+    _In_ ULONG64 BaseUs,
+    _In_ ULONG Drops,
+    _Out_writes_bytes_(SNOOP_MAX_RECORD_BYTES) PUCHAR Out
+);
+
+NTSTATUS SnoopParseFileHeader(
+    _In_reads_bytes_(Length) const UCHAR* Header,
+    _In_ ULONG Length,
+    _Out_ PULONG Datalink
+);
+
+VOID SnoopReaderReset(
+    _Inout_ PSNOOP_READER Reader,
+    _In_reads_bytes_(Length) const UCHAR* Buffer,
+    _In_ ULONG Length
+);
+
+NTSTATUS SnoopReadRecord(
+    _Inout_ PSNOOP_READER Reader,
+    _Out_ PSNOOP_RECORD Record
+);
+
+#endif // _MULTIDEVICEBTSNOOP_H_
@@ -0,0 +1,407 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSync.c
+
+Abstract:
+    Keeps audio lanes that play the same stream in step.
+
+    Each lane's sink runs on its own crystal, typically tens of ppm off
+    nominal. At 100 ppm, two headsets drift apart by 6 ms a minute.
+    Here, the service sends each source block through
+    IOCTL_MULTI_BT_SYNC_RESAMPLE once per lane and submits the result
+    on that lane. Sinks report playback progress through
+    IOCTL_MULTI_BT_SYNC_COMPLETION. Each report refines the lane's
+    clock estimate and retunes every lane's resampler, so all sinks hold
+    the reference lane's position (MultiDeviceBTDrift.c).
+
+Environment:
+    Kernel mode only
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <bthdef.h>
+#include <bthioctl.h>
+
+#include "MultiDeviceBTDriver.h"
+
+/*++
+Routine Description:
+    Initializes the device's synchronization state
+--*/
+VOID
+SyncInitialize(
+    _Out_ PSYNC_CONTEXT Sync
+)
+{
+    RtlZeroMemory(Sync, sizeof(*Sync));
+    ExInitializeFastMutex(&Sync->Mutex);
+}
+
+/*++
+Routine Description:
+    Frees every sink and the filter; called from device cleanup
+--*/
+VOID
+SyncCleanup(
+    _Inout_ PSYNC_CONTEXT Sync
+)
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Sync->Mutex);
+
+    for (i = 0; i < AUDIO_MAX_LANES; i++) {
+        if (Sync->Sinks[i] != NULL) {
+            ExFreePoolWithTag(Sync->Sinks[i], SYNC_POOL_TAG);
+            Sync->Sinks[i] = NULL;
+        }
+    }
+
+    if (Sync->Filter != NULL) {
+        ExFreePoolWithTag(Sync->Filter, SYNC_POOL_TAG);
+        Sync->Filter = NULL;
+    }
+
+    ExReleaseFastMutex(&Sync->Mutex);
+}
+
+/*++
+Routine Description:
+    Retunes every synchronized lane at host time HostUs. Called with
+    the mutex held.
+--*/
+static VOID
+SyncUpdateGroup(
+    _Inout_ PSYNC_CONTEXT Sync,
+    _In_ LONGLONG HostUs
+)
+{
+    PDRIFT_SINK group[AUDIO_MAX_LANES];
+    ULONG count = 0;
+    ULONG i;
+
+    for (i = 0; i < AUDIO_MAX_LANES; i++) {
+        if (Sync->Sinks[i] != NULL) {
+            group[count++] = Sync->Sinks[i];
+        }
+    }
+
+    DriftUpdateRatios(group, count, HostUs);
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_SYNC_CONFIG. Enabling a lane that is already
+    synchronized restarts its estimate and resampler, as for a new
+    stream. The first lane to join becomes the reference if none is
+    named.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    BytesReturned - Receives zero
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleSyncConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PSYNC_CONFIG config;
+    PSYNC_CONTEXT sync = &DeviceContext->Sync;
+    PDRIFT_SINK sink;
+    BOOLEAN hasReference = FALSE;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(SYNC_CONFIG), (PVOID*)&config, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (config->LaneId >= AUDIO_MAX_LANES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (config->Enable &&
+        (config->SampleRate == 0 || (config->Channels != 1 && config->Channels != 2))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&sync->Mutex);
+
+    if (!config->Enable) {
+        if (sync->Sinks[config->LaneId] != NULL) {
+            ExFreePoolWithTag(sync->Sinks[config->LaneId], SYNC_POOL_TAG);
+            sync->Sinks[config->LaneId] = NULL;
+        }
+        goto Exit;
+    }
+
+    if (sync->Filter == NULL) {
+        sync->Filter = (PRESAMPLER_FILTER)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            sizeof(RESAMPLER_FILTER), SYNC_POOL_TAG);
+        if (sync->Filter == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        ResamplerBuildFilter(sync->Filter);
+    }
+
+    sink = sync->Sinks[config->LaneId];
+    if (sink == NULL) {
+        sink = (PDRIFT_SINK)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+            sizeof(DRIFT_SINK), SYNC_POOL_TAG);
+        if (sink == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        sync->Sinks[config->LaneId] = sink;
+    }
+
+    DriftSinkInitialize(sink, sync->Filter, config->SampleRate, config->Channels, SimdIsaBest);
+    sync->FramesIn[config->LaneId] = 0;
+
+    for (i = 0; i < AUDIO_MAX_LANES; i++) {
+        if (sync->Sinks[i] == NULL || i == config->LaneId) {
+            continue;
+        }
+
+        if (config->Reference) {
+            sync->Sinks[i]->Reference = FALSE;
+        } else if (sync->Sinks[i]->Reference) {
+            hasReference = TRUE;
+        }
+    }
+
+    sink->Reference = config->Reference || !hasReference;
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MultiDeviceBT: Sync lane %u: %u Hz, %u ch%s, ISA %u\n",
+        config->LaneId, config->SampleRate, config->Channels,
+        sink->Reference ? ", reference" : "", sink->Resampler.Isa));
+
+Exit:
+    ExReleaseFastMutex(&sync->Mutex);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_SYNC_COMPLETION: a sink's playback progress.
+    The estimator keeps one report per DRIFT_MIN_SPACING_US. Each kept
+    report retunes the whole group.
+--*/
+NTSTATUS
+HandleSyncCompletion(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PSYNC_COMPLETION completion;
+    PSYNC_CONTEXT sync = &DeviceContext->Sync;
+    LONGLONG hostUs;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(SYNC_COMPLETION), (PVOID*)&completion, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (completion->LaneId >= AUDIO_MAX_LANES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    hostUs = completion->HostTime / 10;
+
+    ExAcquireFastMutex(&sync->Mutex);
+
+    if (sync->Sinks[completion->LaneId] == NULL) {
+        status = STATUS_INVALID_DEVICE_STATE;
+    } else if (DriftAddObservation(&sync->Sinks[completion->LaneId]->Estimator,
+                   hostUs, completion->SamplesPlayed)) {
+        SyncUpdateGroup(sync, hostUs);
+    }
+
+    ExReleaseFastMutex(&sync->Mutex);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_SYNC_RESAMPLE. The lane's resampler takes up
+    to RESAMPLER_MAX_INPUT source frames and writes as many output
+    frames as the output buffer holds. Frames it did not take are
+    reported through FramesAccepted, for the caller to resend.
+
+Arguments:
+    DeviceContext - Device context
+    Request - Handle to I/O request
+    InputBufferLength - Length of input buffer
+    OutputBufferLength - Length of output buffer
+    BytesReturned - Receives the header plus output PCM
+
+Return Value:
+    NTSTATUS
+--*/
+NTSTATUS
+HandleSyncResample(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t InputBufferLength,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PSYNC_PCM_HEADER input;
+    PSYNC_PCM_HEADER output;
+    PSYNC_CONTEXT sync = &DeviceContext->Sync;
+    PDRIFT_SINK sink;
+    size_t inLength, outLength;
+    ULONG laneId, frameBytes, frames, capacity, produced, accepted;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(SYNC_PCM_HEADER), (PVOID*)&input, &inLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Input and output share the system buffer: read the request first
+    laneId = input->LaneId;
+    if (laneId >= AUDIO_MAX_LANES || input->Length > inLength - sizeof(SYNC_PCM_HEADER)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(SYNC_PCM_HEADER), (PVOID*)&output, &outLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    ExAcquireFastMutex(&sync->Mutex);
+
+    sink = sync->Sinks[laneId];
+    if (sink == NULL) {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto Exit;
+    }
+
+    frameBytes = sink->Resampler.Channels * sizeof(SHORT);
+    if ((input->Length % frameBytes) != 0) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    frames = input->Length / frameBytes;
+    capacity = (ULONG)((outLength - sizeof(SYNC_PCM_HEADER)) / frameBytes);
+
+    produced = ResamplerProcess(&sink->Resampler, (const SHORT*)(input + 1), frames,
+        (SHORT*)(output + 1), capacity, &accepted);
+    sync->FramesIn[laneId] += accepted;
+
+    output->LaneId = laneId;
+    output->Length = produced * frameBytes;
+    output->FramesAccepted = accepted;
+
+    *BytesReturned = sizeof(SYNC_PCM_HEADER) + output->Length;
+
+Exit:
+    ExReleaseFastMutex(&sync->Mutex);
+    return status;
+}
+
+/*++
+Routine Description:
+    Handles IOCTL_MULTI_BT_GET_SYNC_STATS
+--*/
+NTSTATUS
+HandleGetSyncStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesReturned
+)
+{
+    NTSTATUS status;
+    PSYNC_STATS stats;
+    PSYNC_CONTEXT sync = &DeviceContext->Sync;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(SYNC_STATS), (PVOID*)&stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlZeroMemory(stats, sizeof(*stats));
+    stats->Isa = SimdDetectIsa();
+
+    ExAcquireFastMutex(&sync->Mutex);
+
+    for (i = 0; i < AUDIO_MAX_LANES; i++) {
+        PDRIFT_SINK sink = sync->Sinks[i];
+        PSYNC_SINK_STATS entry;
+
+        if (sink == NULL) {
+            continue;
+        }
+
+        entry = &stats->Sinks[stats->SinkCount++];
+        entry->LaneId = i;
+        entry->Reference = sink->Reference;
+        entry->Locked = DriftIsValid(&sink->Estimator);
+        entry->Observations = sink->Estimator.Count;
+        entry->DriftPpb = (LONG)(sink->DriftPpm * 1000.0);
+        entry->CorrectionPpb = (LONG)(sink->CorrectionPpm * 1000.0);
+        entry->SkewUs = (LONG)sink->SkewUs;
+        entry->FramesIn = sync->FramesIn[i];
+        entry->FramesOut = sink->Resampler.OutputCount;
+    }
+
+    ExReleaseFastMutex(&sync->Mutex);
+
+    *BytesReturned = sizeof(SYNC_STATS);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,81 @@
+/*++
+
+Module Name:
+    MultiDeviceBTSync.h
+
+Abstract:
+    Synchronized multi-sink playback. Each audio lane in the group gets
+    its own sink clock estimate and resampler, so every sink plays the
+    same source sample at the same moment. The target is within 1 ms.
+
+--*/
+
+#ifndef _MULTIDEVICEBTSYNC_H_
+#define _MULTIDEVICEBTSYNC_H_
+
+#include "MultiDeviceBTDrift.h"
+
+#define SYNC_POOL_TAG               'YDBM'
+
+// Join or leave the synchronized group (IOCTL_MULTI_BT_SYNC_CONFIG)
+typedef struct _SYNC_CONFIG {
+    ULONG LaneId;
+    BOOLEAN Enable;
+    BOOLEAN Reference;          // Others align to this lane; the last lane to set it wins
+    ULONG SampleRate;
+    ULONG Channels;             // 1 or 2
+} SYNC_CONFIG, *PSYNC_CONFIG;
+
+// Playback progress from a sink (IOCTL_MULTI_BT_SYNC_COMPLETION)
+typedef struct _SYNC_COMPLETION {
+    ULONG LaneId;
+    LONGLONG HostTime;          // When SamplesPlayed was observed, 100 ns units
+    ULONG64 SamplesPlayed;      // Cumulative, at the sink's own rate
+} SYNC_COMPLETION, *PSYNC_COMPLETION;
+
+// Resample request and reply (IOCTL_MULTI_BT_SYNC_RESAMPLE). On input
+// it is followed by Length bytes of interleaved 16-bit source PCM. On
+// output, by Length bytes of PCM for the lane.
+typedef struct _SYNC_PCM_HEADER {
+    ULONG LaneId;
+    ULONG Length;
+    ULONG FramesAccepted;       // Output only: source frames consumed
+} SYNC_PCM_HEADER, *PSYNC_PCM_HEADER;
+
+typedef struct _SYNC_SINK_STATS {
+    ULONG LaneId;
+    BOOLEAN Reference;
+    BOOLEAN Locked;             // Enough observations for a clock estimate
+    ULONG Observations;
+    LONG DriftPpb;              // Sink clock error
+    LONG CorrectionPpb;         // Extra ratio applied to close the skew
+    LONG SkewUs;                // Playback position minus the reference's
+    ULONG64 FramesIn;
+    ULONG64 FramesOut;
+} SYNC_SINK_STATS, *PSYNC_SINK_STATS;
+
+// Counters (IOCTL_MULTI_BT_GET_SYNC_STATS)
+typedef struct _SYNC_STATS {
+    ULONG SinkCount;
+    ULONG Isa;                  // SIMD_ISA of the resampler kernels
+    SYNC_SINK_STATS Sinks[AUDIO_MAX_LANES];
+} SYNC_STATS, *PSYNC_STATS;
+
+// All IOCTLs serialize on Mutex. The filter is built when the first
+// sink joins and is kept until cleanup.
+typedef struct _SYNC_CONTEXT {
+    FAST_MUTEX Mutex;
+    PRESAMPLER_FILTER Filter;
+    PDRIFT_SINK Sinks[AUDIO_MAX_LANES];     // Indexed by lane; NULL when not synchronized
+    ULONG64 FramesIn[AUDIO_MAX_LANES];
+} SYNC_CONTEXT, *PSYNC_CONTEXT;
+
+VOID SyncInitialize(
+    _Out_ PSYNC_CONTEXT Sync
+);
+
+VOID SyncCleanup(
+    _Inout_ PSYNC_CONTEXT Sync
+);
+
+#endif // _MULTIDEVICEBTSYNC_H_
@@ -0,0 +1,479 @@
+/*++
+
+Module Name:
+    acl_credit_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's ACL buffer credit allocator
+    (MultiDeviceBTAclCredit.c). A model controller holds outgoing ACL
+    packets in one pool of buffers. Each link sends at its own
+    connection events and frees what it sent. Number Of Completed
+    Packets reaches the host on 1 ms polls, as over USB.
+
+    Seven links share the pool for 20 simulated seconds:
+    - an audio link (CRITICAL), one packet every 7.5 ms
+    - three HID devices (HIGH), random reports about every 10 ms
+    - two sensors (MEDIUM), a reading about every 50 ms
+    - a file transfer (MEDIUM), always backlogged, up to 6 packets per
+      7.5 ms connection event
+
+    Two hosts run it. "on demand" hands free buffers round robin to
+    whichever links have packets ready, which is fair per packet but
+    lets the bulk link refill the pool the moment buffers come back.
+    "allocator" asks the credit allocator. For pools of 8 and 16
+    buffers, the report gives each class's wait for a buffer (p50, p99,
+    max) and the file transfer's throughput. Checks cover pool bounds,
+    weighted sharing, reservations, disconnects and malformed
+    completions. Host CPU per request is measured last.
+
+    Build (MSVC):
+        cl /O2 /I..\driver acl_credit_benchmark.c ..\driver\MultiDeviceBTAclCredit.c
+
+    Build (Linux):
+        cc -O2 -I../driver acl_credit_benchmark.c ../driver/MultiDeviceBTAclCredit.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTAclCredit.h"
+
+#define TICK_US             250
+#define POLL_US             1000        // USB interrupt endpoint interval
+#define RUN_US              20000000ULL
+#define LINKS               7
+#define BULK_LINK           6
+#define HOST_QUEUE          1024        // Per link, power of two
+#define MAX_SAMPLES         8192
+#define CPU_ROUNDS          1000000
+
+typedef enum _HOST_MODE {
+    HostOnDemand,
+    HostAllocator
+} HOST_MODE;
+
+static const char* ModeName[] = { "on demand", "allocator" };
+
+typedef enum _LINK_CLASS {
+    ClassAudio,
+    ClassHid,
+    ClassSensor,
+    ClassBulk,
+    ClassCount
+} LINK_CLASS;
+
+typedef struct _LINK_MODEL {
+    USHORT Handle;
+    UCHAR Priority;
+    LINK_CLASS Class;
+    ULONG IntervalUs;           // Connection interval
+    ULONG PhaseUs;              // First connection event
+    ULONG PerEvent;             // Packets the link can send per event
+    ULONG PeriodUs;             // Mean time between packets; 0 for backlogged
+    BOOLEAN Periodic;
+} LINK_MODEL;
+
+static const LINK_MODEL Model[LINKS] = {
+    { 0x40, 0, ClassAudio,  7500,  250, 2, 7500,  TRUE  },
+    { 0x41, 1, ClassHid,    7500, 1750, 2, 10000, FALSE },
+    { 0x42, 1, ClassHid,    7500, 3250, 2, 10000, FALSE },
+    { 0x43, 1, ClassHid,    7500, 5000, 2, 10000, FALSE },
+    { 0x44, 2, ClassSensor, 30000, 9000, 2, 50000, FALSE },
+    { 0x45, 2, ClassSensor, 30000, 21000, 2, 50000, FALSE },
+    { 0x46, 2, ClassBulk,   7500, 6250, 6, 0,     FALSE },
+};
+
+typedef struct _LINK_STATE {
+    ULONG64 Queue[HOST_QUEUE];  // Host: arrival times of ready packets
+    ULONG Head, Tail;
+    ULONG64 NextArrivalUs;
+    ULONG Buffered;             // In the controller
+    ULONG Held;                 // On demand host: sent, not completed
+    ULONG Completed;            // Controller: sent over the air, not yet reported
+} LINK_STATE;
+
+typedef struct _SAMPLES {
+    ULONG Count;
+    ULONG WaitUs[MAX_SAMPLES];
+} SAMPLES;
+
+typedef struct _RUN_RESULT {
+    SAMPLES Wait[ClassCount];
+    ULONG64 BulkPackets;
+    ULONG MaxBuffered;
+} RUN_RESULT;
+
+static LINK_STATE Links[LINKS];
+static ACL_CREDIT_POOL Pool;
+static RUN_RESULT Results[2];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static int
+CompareUlong(const void* A, const void* B)
+{
+    ULONG a = *(const ULONG*)A, b = *(const ULONG*)B;
+
+    return (a > b) - (a < b);
+}
+
+static ULONG
+Percentile(SAMPLES* Samples, ULONG Percent)
+{
+    if (Samples->Count == 0) {
+        return 0;
+    }
+    qsort(Samples->WaitUs, Samples->Count, sizeof(ULONG), CompareUlong);
+    return Samples->WaitUs[(Samples->Count - 1) * Percent / 100];
+}
+
+// Mean PeriodUs, uniform over half to one and a half periods
+static ULONG64
+NextArrival(const LINK_MODEL* Link, ULONG64 NowUs)
+{
+    if (Link->Periodic) {
+        return NowUs + Link->PeriodUs;
+    }
+    return NowUs + Link->PeriodUs / 2 + Random() % Link->PeriodUs / TICK_US * TICK_US;
+}
+
+//
+// One run
+//
+
+static VOID
+Run(HOST_MODE Mode, ULONG Buffers, RUN_RESULT* Result)
+{
+    ULONG64 now;
+    ULONG roundRobin = 0;
+    ULONG l, buffered;
+
+    memset(Links, 0, sizeof(Links));
+    memset(Result, 0, sizeof(*Result));
+    RandomState = 0x2545F491;
+
+    AclCreditInitialize(&Pool);
+    AclCreditSetBuffers(&Pool, Buffers);
+    for (l = 0; l < LINKS; l++) {
+        AclCreditOpen(&Pool, Model[l].Handle, Model[l].Priority, 0x001122330000ULL + l);
+        Links[l].NextArrivalUs = Model[l].PeriodUs ? Model[l].PhaseUs % Model[l].PeriodUs : 0;
+    }
+
+    for (now = 0; now < RUN_US; now += TICK_US) {
+        // Packets ready at the host
+        for (l = 0; l < LINKS; l++) {
+            LINK_STATE* link = &Links[l];
+
+            if (Model[l].PeriodUs == 0) {
+                // Backlogged: always a full event's worth ready
+                while (link->Tail - link->Head < Model[l].PerEvent * 2) {
+                    link->Queue[link->Tail++ % HOST_QUEUE] = now;
+                }
+                continue;
+            }
+            while (link->NextArrivalUs <= now) {
+                link->Queue[link->Tail++ % HOST_QUEUE] = link->NextArrivalUs;
+                link->NextArrivalUs = NextArrival(&Model[l], link->NextArrivalUs);
+            }
+        }
+
+        // Completions reported since the last poll
+        if (now % POLL_US == 0) {
+            for (l = 0; l < LINKS; l++) {
+                if (Links[l].Completed == 0) {
+                    continue;
+                }
+                if (Mode == HostAllocator) {
+                    AclCreditComplete(&Pool, Model[l].Handle, Links[l].Completed);
+                } else {
+                    Links[l].Held -= Links[l].Completed;
+                }
+                Links[l].Completed = 0;
+            }
+        }
+
+        // Hand out buffers
+        if (Mode == HostAllocator) {
+            ACL_CREDIT_WANT wants[LINKS];
+            ULONG count = 0, i, g;
+
+            for (l = 0; l < LINKS; l++) {
+                if (Links[l].Tail != Links[l].Head) {
+                    wants[count].Handle = Model[l].Handle;
+                    wants[count].Packets = (USHORT)(Links[l].Tail - Links[l].Head);
+                    count++;
+                }
+            }
+            AclCreditAcquireBatch(&Pool, wants, count);
+
+            for (i = 0; i < count; i++) {
+                for (l = 0; Model[l].Handle != wants[i].Handle; l++) {
+                }
+                for (g = 0; g < wants[i].Granted; g++) {
+                    SAMPLES* samples = &Result->Wait[Model[l].Class];
+                    ULONG64 arrival = Links[l].Queue[Links[l].Head++ % HOST_QUEUE];
+
+                    if (samples->Count < MAX_SAMPLES && Model[l].Class != ClassBulk) {
+                        samples->WaitUs[samples->Count++] = (ULONG)(now - arrival);
+                    }
+                    Links[l].Buffered++;
+                }
+            }
+        } else {
+            ULONG held = 0, idle = 0;
+
+            for (l = 0; l < LINKS; l++) {
+                held += Links[l].Held;
+            }
+            while (held < Buffers && idle < LINKS) {
+                l = roundRobin++ % LINKS;
+                if (Links[l].Tail == Links[l].Head) {
+                    idle++;
+                    continue;
+                }
+                idle = 0;
+                if (Model[l].Class != ClassBulk && Result->Wait[Model[l].Class].Count < MAX_SAMPLES) {
+                    SAMPLES* samples = &Result->Wait[Model[l].Class];
+
+                    samples->WaitUs[samples->Count++] =
+                        (ULONG)(now - Links[l].Queue[Links[l].Head % HOST_QUEUE]);
+                }
+                Links[l].Head++;
+                Links[l].Held++;
+                Links[l].Buffered++;
+                held++;
+            }
+        }
+
+        // Controller: pool bound, then connection events
+        buffered = 0;
+        for (l = 0; l < LINKS; l++) {
+            buffered += Links[l].Buffered;
+        }
+        Result->MaxBuffered = max(Result->MaxBuffered, buffered);
+
+        for (l = 0; l < LINKS; l++) {
+            ULONG sent;
+
+            if (now < Model[l].PhaseUs || (now - Model[l].PhaseUs) % Model[l].IntervalUs != 0) {
+                continue;
+            }
+            sent = min(Links[l].Buffered, Model[l].PerEvent);
+            Links[l].Buffered -= sent;
+            Links[l].Completed += sent;
+            if (l == BULK_LINK) {
+                Result->BulkPackets += sent;
+            }
+        }
+    }
+}
+
+//
+// Allocator checks
+//
+
+static VOID
+AllocatorChecks(VOID)
+{
+    ULONG i, grantedHigh = 0, grantedLow = 0;
+    BOOLEAN progress;
+
+    // Two greedy senders, HIGH and LOW, in a 16-buffer pool. Each
+    // round one packet of each completes, then both refill.
+    AclCreditInitialize(&Pool);
+    AclCreditSetBuffers(&Pool, 16);
+    AclCreditOpen(&Pool, 1, 1, 0);
+    AclCreditOpen(&Pool, 2, 3, 0);
+    for (i = 0; i < 1000; i++) {
+        AclCreditComplete(&Pool, 1, 1);
+        AclCreditComplete(&Pool, 2, 1);
+        do {
+            progress = FALSE;
+            if (AclCreditAcquire(&Pool, 1)) {
+                progress = TRUE;
+            }
+            if (AclCreditAcquire(&Pool, 2)) {
+                progress = TRUE;
+            }
+        } while (progress);
+    }
+    grantedHigh = Pool.Links[0].Held;
+    grantedLow = Pool.Links[1].Held;
+    printf("\nTwo greedy senders, 16 buffers: HIGH holds %u, LOW holds %u, %u left free\n",
+        grantedHigh, grantedLow, 16 - grantedHigh - grantedLow);
+    Check("HIGH settles at about four times LOW's share", grantedHigh >= 3 * grantedLow && grantedLow >= 1);
+    Check("Some buffers stay free for a newcomer", grantedHigh + grantedLow < 16);
+    AclCreditOpen(&Pool, 3, 2, 0);
+    Check("  and a newcomer is granted one at once", AclCreditAcquire(&Pool, 3));
+
+    // Reservations
+    AclCreditInitialize(&Pool);
+    AclCreditSetBuffers(&Pool, 8);
+    for (i = 0; i < 5; i++) {
+        AclCreditOpen(&Pool, (USHORT)(10 + i), 0, 0);
+    }
+    Check("Reservations capped at half the pool", Pool.Stats.ReservedBuffers == 4);
+    AclCreditOpen(&Pool, 20, 3, 0);
+    while (AclCreditAcquire(&Pool, 20)) {
+    }
+    Check("A LOW sender cannot touch reserved buffers", Pool.Links[5].Held <= 4);
+    Check("  while a CRITICAL link still gets its own",
+        AclCreditAcquire(&Pool, 10) && AclCreditAcquire(&Pool, 10));
+
+    // Disconnect and malformed completions
+    i = Pool.Stats.Held;
+    AclCreditClose(&Pool, 20);
+    Check("Disconnect frees what the link held",
+        Pool.Stats.Held < i && Pool.Stats.Flushed == i - Pool.Stats.Held && Pool.Stats.SharedUsed == 0);
+    AclCreditComplete(&Pool, 99, 3);
+    Check("Completions for an unknown handle are not credited",
+        Pool.Stats.UnknownCompletions == 3 && Pool.Stats.Held == 2);
+    AclCreditComplete(&Pool, 10, 50);
+    Check("Completions past what was sent are clamped", Pool.Stats.Held == 0 && Pool.Links[0].Held == 0);
+    Check("Unknown handle is refused", !AclCreditAcquire(&Pool, 99));
+
+    // Pool shrinks below what is held
+    AclCreditInitialize(&Pool);
+    AclCreditSetBuffers(&Pool, 16);
+    AclCreditOpen(&Pool, 1, 1, 0);
+    while (AclCreditAcquire(&Pool, 1)) {
+    }
+    i = Pool.Stats.Held;
+    AclCreditSetBuffers(&Pool, 4);
+    Check("Shrunk pool grants nothing until completions", !AclCreditAcquire(&Pool, 1));
+    AclCreditComplete(&Pool, 1, i);
+    Check("  then grants again", AclCreditAcquire(&Pool, 1) && Pool.Stats.SharedUsed == 1);
+}
+
+static VOID
+CpuCost(VOID)
+{
+    ACL_CREDIT_WANT wants[LINKS];
+    double start, elapsed;
+    ULONG64 granted = 0;
+    ULONG round, l;
+
+    AclCreditInitialize(&Pool);
+    AclCreditSetBuffers(&Pool, 16);
+    for (l = 0; l < LINKS; l++) {
+        AclCreditOpen(&Pool, Model[l].Handle, Model[l].Priority, 0);
+    }
+
+    start = Seconds();
+    for (round = 0; round < CPU_ROUNDS; round++) {
+        for (l = 0; l < LINKS; l++) {
+            wants[l].Handle = Model[l].Handle;
+            wants[l].Packets = (USHORT)(1 + (round + l) % 3);
+        }
+        granted += AclCreditAcquireBatch(&Pool, wants, LINKS);
+        for (l = 0; l < LINKS; l++) {
+            AclCreditComplete(&Pool, wants[l].Handle, wants[l].Granted);
+        }
+    }
+    elapsed = Seconds() - start;
+
+    printf("\nHost CPU: %.0f ns per request for %u links (%.1f buffers granted on average)\n",
+        elapsed * 1e9 / CPU_ROUNDS, LINKS, (double)granted / CPU_ROUNDS);
+}
+
+int
+main(void)
+{
+    static const ULONG pools[] = { 8, 16 };
+    BOOLEAN bounded = TRUE, audioImmediate = TRUE, hidBetter = TRUE, bulkKept = TRUE;
+    ULONG p, m, c;
+
+    printf("ACL buffer credit benchmark\n\n");
+    printf("Wait for a buffer, us (p50 / p99 / max); bulk throughput\n");
+    printf("  %-7s %-10s %-20s %-20s %-20s %10s\n", "Buffers", "Host", "audio", "HID", "sensor", "bulk pkt/s");
+    printf("  ------------------------------------------------------------------------------------------\n");
+
+    for (p = 0; p < ARRAYSIZE(pools); p++) {
+        ULONG p99[2][ClassCount], maxWait[2][ClassCount];
+
+        for (m = HostOnDemand; m <= HostAllocator; m++) {
+            RUN_RESULT* result = &Results[m];
+            char cell[ClassCount][32];
+
+            Run((HOST_MODE)m, pools[p], result);
+
+            for (c = ClassAudio; c < ClassBulk; c++) {
+                ULONG p50 = Percentile(&result->Wait[c], 50);
+
+                p99[m][c] = Percentile(&result->Wait[c], 99);
+                maxWait[m][c] = Percentile(&result->Wait[c], 100);
+                sprintf(cell[c], "%u / %u / %u", p50, p99[m][c], maxWait[m][c]);
+            }
+
+            printf("  %-7u %-10s %-20s %-20s %-20s %10.0f\n", pools[p], ModeName[m],
+                cell[ClassAudio], cell[ClassHid], cell[ClassSensor],
+                result->BulkPackets / (RUN_US / 1e6));
+
+            bounded = bounded && result->MaxBuffered <= pools[p];
+        }
+
+        audioImmediate = audioImmediate && maxWait[HostAllocator][ClassAudio] == 0;
+        hidBetter = hidBetter && p99[HostAllocator][ClassHid] < p99[HostOnDemand][ClassHid];
+        if (pools[p] >= 16) {
+            bulkKept = bulkKept && Results[HostAllocator].BulkPackets * 10 >= Results[HostOnDemand].BulkPackets * 9;
+        }
+    }
+    printf("\n");
+
+    Check("Controller pool never overrun", bounded);
+    Check("Audio packets never wait for a buffer", audioImmediate);
+    Check("HID p99 wait lower than on demand", hidBetter);
+    Check("Bulk keeps 90% of its throughput with 16 buffers", bulkKept);
+
+    AllocatorChecks();
+    CpuCost();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
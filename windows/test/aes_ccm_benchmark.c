@@ -0,0 +1,592 @@
+/*++
+
+Module Name:
+    aes_ccm_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's batched AES-CCM engine
+    (MultiDeviceBTAes.c). It runs in three parts:
+    - Known-answer tests on every instruction set: FIPS-197 C.1, NIST
+      SP 800-38C examples 1-3, the Core specification LE encryption
+      sample and the Mesh Profile network PDU sample (message #1).
+      Forged MICs must be rejected.
+    - Random packets with mixed keys, nonces and lengths must give the
+      same ciphertext on every path and decrypt to the original.
+    - Packets/s at 20-251 byte payloads, with a 13-byte nonce, a 1-byte
+      AAD and a 4-byte MIC, spread over 16 keys. The baseline is a
+      textbook byte-oriented AES with table S-box lookups, run one
+      packet per call.
+
+    Build (MSVC):
+        cl /O2 /I..\driver aes_ccm_benchmark.c ..\driver\MultiDeviceBTAes.c
+
+    Build (Linux):
+        cc -O2 -I../driver aes_ccm_benchmark.c ../driver/MultiDeviceBTAes.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTAes.h"
+
+#define BENCH_SECONDS       0.5
+#define BENCH_PACKETS       256
+#define BENCH_KEYS          16
+#define RANDOM_PACKETS      2000
+
+static const char* IsaName[] = { "portable", "aes-ni" };
+
+typedef struct _CCM_VECTOR {
+    const char* Name;
+    const char* Key;
+    const char* Nonce;
+    const char* Aad;
+    const char* Plaintext;
+    const char* Ciphertext;     // Followed by the MIC
+    UCHAR MicLength;
+} CCM_VECTOR;
+
+static const CCM_VECTOR Vectors[] = {
+    { "SP 800-38C example 1", "404142434445464748494a4b4c4d4e4f", "10111213141516",
+      "0001020304050607", "20212223", "7162015b4dac255d", 4 },
+    { "SP 800-38C example 2", "404142434445464748494a4b4c4d4e4f", "1011121314151617",
+      "000102030405060708090a0b0c0d0e0f", "202122232425262728292a2b2c2d2e2f",
+      "d2a1f0e051ea5f62081a7792073d593d1fc64fbfaccd", 6 },
+    { "SP 800-38C example 3", "404142434445464748494a4b4c4d4e4f", "101112131415161718191a1b",
+      "000102030405060708090a0b0c0d0e0f10111213",
+      "202122232425262728292a2b2c2d2e2f3031323334353637",
+      "e3b201a9f5b71a7a9b1ceaeccd97e70b6176aad9a4428aa5484392fbc1b09951", 8 },
+    { "LE encryption sample", "99ad1b5226a37e3e058e3b8e27c2c666", "000000008024abdcbabebaafde",
+      "03", "06", "9fcda7f448", 4 },
+    { "Mesh network PDU #1", "0953fa93e7caac9638f58820220a398e", "00800000011201000012345678",
+      "", "fffd034b50057e400000010000", "b5e5bfdacbaf6cb7fb6bff871f035444ce83a670df", 8 },
+};
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static ULONG
+Hex(const char* Text, UCHAR* Out)
+{
+    ULONG n = 0;
+
+    while (Text[0] != 0 && Text[1] != 0) {
+        unsigned int byte;
+
+        sscanf(Text, "%2x", &byte);
+        Out[n++] = (UCHAR)byte;
+        Text += 2;
+    }
+    return n;
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+//
+// Baseline: byte-oriented AES as written from FIPS-197, with the S-box as
+// a lookup table and one packet per call
+//
+
+static UCHAR NaiveSbox[256];
+
+static UCHAR
+NaiveXtime(UCHAR x)
+{
+    return (UCHAR)((x << 1) ^ ((x & 0x80) ? 0x1B : 0));
+}
+
+static void
+NaiveInit(void)
+{
+    UCHAR p = 1, q = 1;
+
+    // Walk GF(2^8) by powers of 3 to find each inverse, then apply the affine map
+    do {
+        UCHAR x;
+
+        p = (UCHAR)(p ^ NaiveXtime(p));
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        if (q & 0x80) {
+            q ^= 0x09;
+        }
+        x = (UCHAR)(q ^ (q << 1 | q >> 7) ^ (q << 2 | q >> 6) ^ (q << 3 | q >> 5) ^ (q << 4 | q >> 4));
+        NaiveSbox[p] = (UCHAR)(x ^ 0x63);
+    } while (p != 1);
+    NaiveSbox[0] = 0x63;
+}
+
+static void
+NaiveExpand(const UCHAR* Key, UCHAR RoundKeys[176])
+{
+    UCHAR rcon = 1;
+    ULONG i;
+
+    memcpy(RoundKeys, Key, 16);
+    for (i = 16; i < 176; i += 4) {
+        UCHAR t[4];
+
+        memcpy(t, RoundKeys + i - 4, 4);
+        if (i % 16 == 0) {
+            UCHAR first = t[0];
+
+            t[0] = (UCHAR)(NaiveSbox[t[1]] ^ rcon);
+            t[1] = NaiveSbox[t[2]];
+            t[2] = NaiveSbox[t[3]];
+            t[3] = NaiveSbox[first];
+            rcon = NaiveXtime(rcon);
+        }
+        RoundKeys[i + 0] = RoundKeys[i - 16] ^ t[0];
+        RoundKeys[i + 1] = RoundKeys[i - 15] ^ t[1];
+        RoundKeys[i + 2] = RoundKeys[i - 14] ^ t[2];
+        RoundKeys[i + 3] = RoundKeys[i - 13] ^ t[3];
+    }
+}
+
+static void
+NaiveEncrypt(const UCHAR* RoundKeys, UCHAR* Block)
+{
+    ULONG round, i;
+
+    for (i = 0; i < 16; i++) {
+        Block[i] ^= RoundKeys[i];
+    }
+
+    for (round = 1; round <= 10; round++) {
+        UCHAR s[16];
+
+        // SubBytes and ShiftRows
+        for (i = 0; i < 16; i++) {
+            s[i] = NaiveSbox[Block[(i + 4 * (i % 4)) % 16]];
+        }
+
+        // MixColumns
+        if (round < 10) {
+            for (i = 0; i < 16; i += 4) {
+                UCHAR a0 = s[i], a1 = s[i + 1], a2 = s[i + 2], a3 = s[i + 3];
+                UCHAR all = a0 ^ a1 ^ a2 ^ a3;
+
+                s[i + 0] ^= all ^ NaiveXtime(a0 ^ a1);
+                s[i + 1] ^= all ^ NaiveXtime(a1 ^ a2);
+                s[i + 2] ^= all ^ NaiveXtime(a2 ^ a3);
+                s[i + 3] ^= all ^ NaiveXtime(a3 ^ a0);
+            }
+        }
+
+        for (i = 0; i < 16; i++) {
+            Block[i] = s[i] ^ RoundKeys[16 * round + i];
+        }
+    }
+}
+
+static void
+NaiveCcmEncrypt(const UCHAR* RoundKeys, const UCHAR* Nonce, const UCHAR* Aad, ULONG AadLength,
+                const UCHAR* Input, UCHAR* Output, ULONG Length, UCHAR* Mic, ULONG MicLength)
+{
+    UCHAR x[16], a[16], s[16];
+    ULONG i, j;
+
+    // CBC-MAC over B0, AAD and payload (13-byte nonce, AAD under 14 bytes)
+    memset(x, 0, 16);
+    x[0] = (UCHAR)((AadLength ? 0x40 : 0) | (((MicLength - 2) / 2) << 3) | 1);
+    memcpy(x + 1, Nonce, 13);
+    x[14] = (UCHAR)(Length >> 8);
+    x[15] = (UCHAR)Length;
+    NaiveEncrypt(RoundKeys, x);
+    if (AadLength != 0) {
+        x[0] ^= (UCHAR)(AadLength >> 8);
+        x[1] ^= (UCHAR)AadLength;
+        for (i = 0; i < AadLength; i++) {
+            x[2 + i] ^= Aad[i];
+        }
+        NaiveEncrypt(RoundKeys, x);
+    }
+    for (i = 0; i < Length; i += 16) {
+        for (j = 0; j < 16 && i + j < Length; j++) {
+            x[j] ^= Input[i + j];
+        }
+        NaiveEncrypt(RoundKeys, x);
+    }
+
+    // CTR
+    memset(a, 0, 16);
+    a[0] = 1;
+    memcpy(a + 1, Nonce, 13);
+    for (i = 0; i < Length; i += 16) {
+        ULONG counter = i / 16 + 1;
+
+        memcpy(s, a, 16);
+        s[14] = (UCHAR)(counter >> 8);
+        s[15] = (UCHAR)counter;
+        NaiveEncrypt(RoundKeys, s);
+        for (j = 0; j < 16 && i + j < Length; j++) {
+            Output[i + j] = Input[i + j] ^ s[j];
+        }
+    }
+    memcpy(s, a, 16);
+    NaiveEncrypt(RoundKeys, s);
+    for (j = 0; j < MicLength; j++) {
+        Mic[j] = x[j] ^ s[j];
+    }
+}
+
+static int
+KnownAnswers(AES_ISA Isa)
+{
+    static const char* fipsKey = "000102030405060708090a0b0c0d0e0f";
+    static const char* fipsIn = "00112233445566778899aabbccddeeff";
+    static const char* fipsOut = "69c4e0d86a7b0430d8cdb78070b4c55a";
+    UCHAR key[16], in[32], out[32], expect[32];
+    AES_KEY expanded;
+    const AES_KEY* keys[2] = { &expanded, &expanded };
+    int failures = 0;
+    ULONG v, count;
+
+    Hex(fipsKey, key);
+    Hex(fipsIn, in);
+    Hex(fipsOut, expect);
+    AesExpandKey(&expanded, key);
+    for (count = 1; count <= 2; count++) {
+        BOOLEAN ok;
+
+        memcpy(in + 16, in, 16);
+        AesEncryptBlocks(Isa, keys, in, out, count);
+        ok = memcmp(out, expect, 16) == 0 && (count == 1 || memcmp(out + 16, expect, 16) == 0);
+        printf("  %-8s %-24s %s\n", IsaName[Isa],
+               count == 1 ? "FIPS-197 C.1" : "FIPS-197 C.1, two blocks", ok ? "ok" : "FAIL");
+        failures += ok ? 0 : 1;
+    }
+
+    for (v = 0; v < sizeof(Vectors) / sizeof(Vectors[0]); v++) {
+        const CCM_VECTOR* vector = &Vectors[v];
+        UCHAR nonce[16], aad[32], plain[64], cipher[80], buffer[64], mic[16];
+        AES_CCM_PACKET packet;
+        ULONG length, nonceLength, aadLength;
+        BOOLEAN ok;
+
+        Hex(vector->Key, key);
+        nonceLength = Hex(vector->Nonce, nonce);
+        aadLength = Hex(vector->Aad, aad);
+        length = Hex(vector->Plaintext, plain);
+        Hex(vector->Ciphertext, cipher);
+        AesExpandKey(&expanded, key);
+
+        memset(&packet, 0, sizeof(packet));
+        packet.Key = &expanded;
+        packet.Nonce = nonce;
+        packet.NonceLength = (UCHAR)nonceLength;
+        packet.Aad = aad;
+        packet.AadLength = (USHORT)aadLength;
+        packet.Input = plain;
+        packet.Output = buffer;
+        packet.Length = length;
+        packet.Mic = mic;
+        packet.MicLength = vector->MicLength;
+
+        ok = AesCcmEncrypt(Isa, &packet, 1) == 1 &&
+             memcmp(buffer, cipher, length) == 0 &&
+             memcmp(mic, cipher + length, vector->MicLength) == 0;
+
+        // Decrypt in place
+        memcpy(buffer, cipher, length);
+        memcpy(mic, cipher + length, vector->MicLength);
+        packet.Input = buffer;
+        ok = ok && AesCcmDecrypt(Isa, &packet, 1) == 1 && memcmp(buffer, plain, length) == 0;
+
+        // A flipped MIC bit must be rejected and the plaintext withheld
+        memcpy(buffer, cipher, length);
+        mic[0] ^= 0x01;
+        ok = ok && AesCcmDecrypt(Isa, &packet, 1) == 0 &&
+             packet.Status == STATUS_AUTH_TAG_MISMATCH &&
+             (length == 0 || buffer[0] == 0);
+
+        printf("  %-8s %-24s %s\n", IsaName[Isa], vector->Name, ok ? "ok" : "FAIL");
+        failures += ok ? 0 : 1;
+    }
+
+    return failures;
+}
+
+
+typedef struct _RANDOM_PACKET {
+    UCHAR Nonce[AES_CCM_NONCE_MAX];
+    UCHAR Aad[24];
+    UCHAR Plain[300];
+    UCHAR Cipher[AesIsaAesNi + 1][300];
+    UCHAR Mic[AesIsaAesNi + 1][AES_CCM_MIC_MAX];
+    AES_CCM_PACKET Packet;
+} RANDOM_PACKET;
+
+static RANDOM_PACKET RandomPackets[RANDOM_PACKETS];
+
+/*++
+Routine Description:
+    Random packets in one large batch: mixed keys, nonce, AAD, payload
+    and MIC lengths, and one malformed packet that must be refused
+    alone. Every path must agree, and decryption must round-trip.
+--*/
+static int
+CrossCheck(AES_ISA Best)
+{
+    static AES_KEY keys[8];
+    static AES_CCM_PACKET packets[RANDOM_PACKETS];
+    ULONG i, k, expected = 0;
+    int isa, failures = 0;
+
+    for (k = 0; k < 8; k++) {
+        UCHAR secret[AES_KEY_BYTES];
+
+        for (i = 0; i < AES_KEY_BYTES; i++) {
+            secret[i] = (UCHAR)Random();
+        }
+        AesExpandKey(&keys[k], secret);
+    }
+
+    for (i = 0; i < RANDOM_PACKETS; i++) {
+        RANDOM_PACKET* r = &RandomPackets[i];
+        AES_CCM_PACKET* p = &r->Packet;
+        ULONG j;
+
+        memset(p, 0, sizeof(*p));
+        p->Key = &keys[Random() % 8];
+        p->NonceLength = (UCHAR)(AES_CCM_NONCE_MIN + Random() % (AES_CCM_NONCE_MAX - AES_CCM_NONCE_MIN + 1));
+        p->AadLength = (USHORT)(Random() % 25);
+        p->Length = Random() % 301;
+        p->MicLength = (UCHAR)(AES_CCM_MIC_MIN + 2 * (Random() % 7));
+        if (i == RANDOM_PACKETS / 2) {
+            p->MicLength = 5;
+        } else {
+            expected++;
+        }
+        for (j = 0; j < sizeof(r->Nonce); j++) {
+            r->Nonce[j] = (UCHAR)Random();
+        }
+        for (j = 0; j < sizeof(r->Aad); j++) {
+            r->Aad[j] = (UCHAR)Random();
+        }
+        for (j = 0; j < sizeof(r->Plain); j++) {
+            r->Plain[j] = (UCHAR)Random();
+        }
+        p->Nonce = r->Nonce;
+        p->Aad = r->Aad;
+        p->Input = r->Plain;
+    }
+
+    for (isa = AesIsaPortable; isa <= (int)Best; isa++) {
+        ULONG done, authenticated, intact = 0;
+
+        for (i = 0; i < RANDOM_PACKETS; i++) {
+            packets[i] = RandomPackets[i].Packet;
+            packets[i].Output = RandomPackets[i].Cipher[isa];
+            packets[i].Mic = RandomPackets[i].Mic[isa];
+        }
+        done = AesCcmEncrypt((AES_ISA)isa, packets, RANDOM_PACKETS);
+
+        // Decrypt in place, then restore the ciphertext for the comparison below
+        for (i = 0; i < RANDOM_PACKETS; i++) {
+            packets[i].Input = packets[i].Output;
+        }
+        authenticated = AesCcmDecrypt((AES_ISA)isa, packets, RANDOM_PACKETS);
+        for (i = 0; i < RANDOM_PACKETS; i++) {
+            if (NT_SUCCESS(packets[i].Status) &&
+                memcmp(packets[i].Output, RandomPackets[i].Plain, packets[i].Length) == 0) {
+                intact++;
+            }
+            packets[i].Input = RandomPackets[i].Plain;
+        }
+        AesCcmEncrypt((AES_ISA)isa, packets, RANDOM_PACKETS);
+
+        printf("  %-8s %lu random packets: %lu encrypted, %lu authenticated, %lu intact, "
+               "malformed one %s\n", IsaName[isa], (unsigned long)RANDOM_PACKETS,
+               (unsigned long)done, (unsigned long)authenticated, (unsigned long)intact,
+               packets[RANDOM_PACKETS / 2].Status == STATUS_INVALID_PARAMETER ? "refused" : "ACCEPTED");
+        if (done != expected || authenticated != expected || intact != expected ||
+            packets[RANDOM_PACKETS / 2].Status != STATUS_INVALID_PARAMETER) {
+            failures++;
+        }
+    }
+
+    for (isa = AesIsaPortable + 1; isa <= (int)Best; isa++) {
+        ULONG mismatches = 0;
+
+        for (i = 0; i < RANDOM_PACKETS; i++) {
+            RANDOM_PACKET* r = &RandomPackets[i];
+
+            if (i != RANDOM_PACKETS / 2 &&
+                (memcmp(r->Cipher[isa], r->Cipher[0], r->Packet.Length) != 0 ||
+                 memcmp(r->Mic[isa], r->Mic[0], r->Packet.MicLength) != 0)) {
+                mismatches++;
+            }
+        }
+        printf("  %-8s matches portable on %lu/%lu packets\n", IsaName[isa],
+               (unsigned long)(expected - mismatches), (unsigned long)expected);
+        failures += mismatches ? 1 : 0;
+    }
+
+    return failures;
+}
+
+static AES_KEY BenchKeys[BENCH_KEYS];
+static UCHAR BenchRoundKeys[BENCH_KEYS][176];
+static AES_CCM_PACKET BenchPackets[BENCH_PACKETS];
+static UCHAR BenchNonce[BENCH_PACKETS][13];
+static UCHAR BenchPlain[BENCH_PACKETS][256];
+static UCHAR BenchCipher[BENCH_PACKETS][256];
+static UCHAR BenchMic[BENCH_PACKETS][4];
+static const UCHAR BenchAad = 0x03;
+
+// Path: -1 baseline, otherwise an AES_ISA; Batch is packets per call
+static double
+Throughput(int Path, ULONG Batch)
+{
+    double start = Seconds(), elapsed;
+    ULONG64 packets = 0;
+    ULONG i;
+
+    do {
+        for (i = 0; i < BENCH_PACKETS; i += Batch) {
+            if (Path < 0) {
+                AES_CCM_PACKET* p = &BenchPackets[i];
+
+                NaiveCcmEncrypt(BenchRoundKeys[i % BENCH_KEYS], p->Nonce, p->Aad, p->AadLength,
+                                p->Input, p->Output, p->Length, p->Mic, p->MicLength);
+            } else {
+                AesCcmEncrypt((AES_ISA)Path, &BenchPackets[i], Batch);
+            }
+        }
+        packets += BENCH_PACKETS;
+        elapsed = Seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    return packets / elapsed;
+}
+
+int
+main(void)
+{
+    static const ULONG sizes[] = { 20, 32, 64, 128, 251 };
+    AES_ISA best = AesDetectIsa();
+    int failures = 0, isa;
+    ULONG s, i;
+
+    NaiveInit();
+
+    printf("Known-answer tests\n");
+    for (isa = AesIsaPortable; isa <= (int)best; isa++) {
+        failures += KnownAnswers((AES_ISA)isa);
+    }
+
+    printf("\nBatched cross-check\n");
+    failures += CrossCheck(best);
+
+    for (i = 0; i < BENCH_KEYS; i++) {
+        UCHAR secret[AES_KEY_BYTES];
+        ULONG j;
+
+        for (j = 0; j < AES_KEY_BYTES; j++) {
+            secret[j] = (UCHAR)Random();
+        }
+        AesExpandKey(&BenchKeys[i], secret);
+        NaiveExpand(secret, BenchRoundKeys[i]);
+    }
+
+    printf("\nEncrypt throughput, packets/s (%lu packets over %d keys, 13-byte nonce, "
+           "1-byte AAD, 4-byte MIC)\n", (unsigned long)BENCH_PACKETS, BENCH_KEYS);
+    printf("%-7s | %-10s | %-10s | %-10s | %-10s | %s\n",
+           "PAYLOAD", "BASELINE", "PORTABLE", "AES-NI x1", "AES-NI", "SPEEDUP");
+    printf("--------------------------------------------------------------------------\n");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        double baseline, portable, single = 0.0, batched = 0.0;
+        BOOLEAN agree = TRUE;
+
+        for (i = 0; i < BENCH_PACKETS; i++) {
+            AES_CCM_PACKET* p = &BenchPackets[i];
+            ULONG j;
+
+            for (j = 0; j < 13; j++) {
+                BenchNonce[i][j] = (UCHAR)Random();
+            }
+            for (j = 0; j < sizes[s]; j++) {
+                BenchPlain[i][j] = (UCHAR)Random();
+            }
+            memset(p, 0, sizeof(*p));
+            p->Key = &BenchKeys[i % BENCH_KEYS];
+            p->Nonce = BenchNonce[i];
+            p->NonceLength = 13;
+            p->Aad = &BenchAad;
+            p->AadLength = 1;
+            p->Input = BenchPlain[i];
+            p->Output = BenchCipher[i];
+            p->Length = sizes[s];
+            p->Mic = BenchMic[i];
+            p->MicLength = 4;
+        }
+
+        // The baseline must agree with the engine before its speed counts
+        for (i = 0; i < BENCH_PACKETS && agree; i++) {
+            UCHAR cipher[256], mic[4];
+            AES_CCM_PACKET* p = &BenchPackets[i];
+
+            AesCcmEncrypt(AesIsaPortable, p, 1);
+            NaiveCcmEncrypt(BenchRoundKeys[i % BENCH_KEYS], p->Nonce, p->Aad, p->AadLength,
+                            p->Input, cipher, p->Length, mic, p->MicLength);
+            agree = memcmp(cipher, p->Output, p->Length) == 0 && memcmp(mic, p->Mic, 4) == 0;
+        }
+        if (!agree) {
+            printf("%-7lu | baseline disagrees with the engine\n", (unsigned long)sizes[s]);
+            failures++;
+            continue;
+        }
+
+        baseline = Throughput(-1, 1);
+        portable = Throughput(AesIsaPortable, AES_CCM_BATCH);
+        if (best == AesIsaAesNi) {
+            single = Throughput(AesIsaAesNi, 1);
+            batched = Throughput(AesIsaAesNi, AES_CCM_BATCH);
+        }
+
+        printf("%-7lu | %-10.0f | %-10.0f | %-10.0f | %-10.0f | %.1fx\n",
+               (unsigned long)sizes[s], baseline, portable, single, batched,
+               (best == AesIsaAesNi ? batched : portable) / baseline);
+    }
+
+    printf("--------------------------------------------------------------------------\n");
+    printf("BASELINE: table-lookup AES, one packet per call. PORTABLE: constant-time\n");
+    printf("bitsliced path, %d packets per call. AES-NI x1: one packet per call.\n", AES_CCM_BATCH);
+    printf("\n%s\n", failures == 0 ? "All checks passed" : "CHECKS FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,695 @@
+/*++
+
+Module Name:
+    afh_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's channel quality estimator
+    (MultiDeviceBTAfhEstimator.c). A model of the 2.4 GHz band in 1 MHz
+    bins carries Wi-Fi networks on channels 1, 6 and 11, each 22 MHz
+    wide, whose airtime varies from one half second to the next. Ten
+    LE links and one BR/EDR audio link hop over the channels their
+    maps allow. A packet fails if its link's own error rate, which
+    depends on its RSSI, or a Wi-Fi transmission on its channel gets it.
+    Two of the LE links are at the edge of their range.
+
+    The run lasts three phases of 90 simulated seconds:
+    - networks on channel 1 (about 60% airtime) and 6 (about 30%)
+    - channel 6 goes quiet and channel 11 (about 45%) starts
+    - every network off
+
+    Two hosts run it. "defaults" leaves every channel in use, as the
+    driver did. "estimator" has the transport agent submit each link's
+    per-channel counts every 250 ms, and applies the estimator's maps
+    200 ms after they change. The report gives each phase's delivery
+    rate and goodput for both kinds of link, the channels in use and
+    the map changes. Checks cover exclusion, recovery, map minimums,
+    weak links and bad input. Host CPU is measured last.
+
+    Build (MSVC):
+        cl /O2 /I..\driver afh_benchmark.c ..\driver\MultiDeviceBTAfhEstimator.c
+
+    Build (Linux):
+        cc -O2 -I../driver afh_benchmark.c ../driver/MultiDeviceBTAfhEstimator.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTAfhEstimator.h"
+
+#define TICK_US             1250        // Two BR/EDR slots
+#define PHASE_US            90000000ULL
+#define PHASES              3
+#define RUN_US              (PHASE_US * PHASES)
+#define SUBMIT_US           250000      // Transport agent's sampling period
+#define APPLY_US            200000      // Map change to the links' instant
+#define DUTY_US             500000      // Wi-Fi airtime changes this often
+#define LE_LINKS            10
+#define NETWORKS            3
+#define CPU_ROUNDS          20000
+
+typedef enum _HOST_MODE {
+    HostDefaults,
+    HostEstimator
+} HOST_MODE;
+
+static const char* ModeName[] = { "defaults", "estimator" };
+
+typedef struct _NETWORK_MODEL {
+    ULONG CentreBin;            // 2412, 2437, 2462 MHz
+    double Airtime[PHASES];     // Mean share of the time it transmits
+} NETWORK_MODEL;
+
+static const NETWORK_MODEL Networks[NETWORKS] = {
+    { 10, { 0.60, 0.60, 0.0 } },
+    { 35, { 0.30, 0.0,  0.0 } },
+    { 60, { 0.0,  0.45, 0.0 } },
+};
+
+static const char* PhaseName[PHASES] = { "Wi-Fi 1 + 6", "Wi-Fi 1 + 11", "quiet" };
+
+typedef struct _LINK_MODEL {
+    ULONG IntervalUs;           // Connection interval
+    ULONG PerEvent;             // Packets per connection event
+    CHAR Rssi;
+} LINK_MODEL;
+
+static const LINK_MODEL LeModel[LE_LINKS] = {
+    { 7500,  2, -55 },          // HID
+    { 7500,  2, -62 },
+    { 7500,  2, -68 },
+    { 10000, 4, -58 },          // Audio
+    { 15000, 6, -70 },          // Bulk
+    { 30000, 2, -74 },          // Sensors
+    { 30000, 2, -66 },
+    { 50000, 2, -78 },
+    { 15000, 4, -90 },          // At the edge of range
+    { 30000, 2, -92 },
+};
+
+#define BREDR_RSSI          (-60)
+
+typedef struct _COUNTS {
+    ULONG Packets;
+    ULONG Errors;
+} COUNTS;
+
+typedef struct _PHASE_RESULT {
+    COUNTS Le;
+    COUNTS BrEdr;
+    double LeUsedSum;           // Per tick
+    ULONG64 Ticks;
+    ULONG64 MapChanges;
+    ULONG64 BusyInUse;          // Covered LE channels in the map, per tick
+    ULONG64 BusyTotal;
+} PHASE_RESULT;
+
+typedef struct _RUN_RESULT {
+    PHASE_RESULT Phase[PHASES];
+    ULONG MinLeUsed;
+    ULONG MinBrEdrUsed;
+    double RecoveryUs;          // Channel 6's channels all back in use after it stopped; <0 if never
+    AFH_STATS Stats;
+} RUN_RESULT;
+
+static AFH_ESTIMATOR Estimator;
+static COUNTS LeWindow[LE_LINKS][AFH_LE_CHANNELS];
+static COUNTS BrEdrWindow[AFH_BREDR_CHANNELS];
+static RUN_RESULT Results[2];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+// Uniform in [0, 1)
+static double
+Uniform(void)
+{
+    return (Random() & 0xFFFFFF) / 16777216.0;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static ULONG
+LeBin(ULONG Channel)
+{
+    return (Channel <= 10) ? 2 + 2 * Channel : 26 + 2 * (Channel - 11);
+}
+
+static BOOLEAN
+InMap(const UCHAR* Map, ULONG Channel)
+{
+    return (Map[Channel / 8] & (1 << (Channel % 8))) != 0;
+}
+
+// Uniform over the channels a map allows; stands in for CSA #2 and AFH
+static ULONG
+Hop(const UCHAR* Map, ULONG Channels, ULONG Used)
+{
+    ULONG pick = Random() % Used, n;
+
+    for (n = 0; n < Channels; n++) {
+        if (InMap(Map, n) && pick-- == 0) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+// Link error rate from RSSI alone: 1% when strong, 30% at -92 dBm
+static double
+LinkErrorRate(CHAR Rssi)
+{
+    double margin = (double)Rssi + 95.0;
+
+    if (margin <= 3.0) {
+        return 0.30;
+    }
+    return min(0.30, 0.01 + 0.6 / (margin * margin));
+}
+
+// Within 8 MHz of the centre at full power, the skirts to 10 MHz at half
+static double
+BinAirtime(const double* Airtime, ULONG Bin)
+{
+    double busy = 1.0;
+    ULONG w;
+    LONG distance;
+
+    for (w = 0; w < NETWORKS; w++) {
+        distance = labs((LONG)Bin - (LONG)Networks[w].CentreBin);
+        if (distance <= 8) {
+            busy *= 1.0 - Airtime[w];
+        } else if (distance <= 10) {
+            busy *= 1.0 - Airtime[w] / 2;
+        }
+    }
+    return 1.0 - busy;
+}
+
+static BOOLEAN
+Covered(ULONG Network, ULONG Bin)
+{
+    return labs((LONG)Bin - (LONG)Networks[Network].CentreBin) <= 8;
+}
+
+static VOID
+Submit(ULONG64 NowUs)
+{
+    AFH_SAMPLE sample;
+    ULONG l, n;
+
+    memset(&sample, 0, sizeof(sample));
+
+    sample.Kind = AFH_KIND_LE;
+    for (l = 0; l < LE_LINKS; l++) {
+        for (n = 0; n < AFH_LE_CHANNELS; n++) {
+            if (LeWindow[l][n].Packets == 0) {
+                continue;
+            }
+            sample.Channel = (UCHAR)n;
+            sample.Rssi = (CHAR)(LeModel[l].Rssi + (LONG)(Random() % 7) - 3);
+            sample.Packets = (USHORT)LeWindow[l][n].Packets;
+            sample.Errors = (USHORT)LeWindow[l][n].Errors;
+            AfhEstimatorRecord(&Estimator, &sample);
+        }
+    }
+
+    sample.Kind = AFH_KIND_BREDR;
+    for (n = 0; n < AFH_BREDR_CHANNELS; n++) {
+        if (BrEdrWindow[n].Packets == 0) {
+            continue;
+        }
+        sample.Channel = (UCHAR)n;
+        sample.Rssi = (CHAR)(BREDR_RSSI + (LONG)(Random() % 7) - 3);
+        sample.Packets = (USHORT)BrEdrWindow[n].Packets;
+        sample.Errors = (USHORT)BrEdrWindow[n].Errors;
+        AfhEstimatorRecord(&Estimator, &sample);
+    }
+
+    memset(LeWindow, 0, sizeof(LeWindow));
+    memset(BrEdrWindow, 0, sizeof(BrEdrWindow));
+
+    AfhEstimatorEvaluate(&Estimator, NowUs);
+}
+
+//
+// One run
+//
+
+static VOID
+Run(HOST_MODE Mode, const double (*Airtime)[NETWORKS], RUN_RESULT* Result)
+{
+    ULONG64 nextEvent[LE_LINKS];
+    AFH_MAPS maps, pending;
+    ULONG64 applyUs = 0, lastChanges = 0;
+    double airtime[NETWORKS];
+    double busy[AFH_BINS];
+    ULONG64 now, stoppedUs = PHASE_US;
+    ULONG l, p, n, w, k, bin;
+    BOOLEAN hasPending = FALSE;
+
+    memset(Result, 0, sizeof(*Result));
+    memset(LeWindow, 0, sizeof(LeWindow));
+    memset(BrEdrWindow, 0, sizeof(BrEdrWindow));
+    RandomState = 0x2545F491;
+    Result->RecoveryUs = -1;
+
+    AfhEstimatorInitialize(&Estimator, 0);
+    maps = Estimator.Maps;
+    Result->MinLeUsed = maps.LeUsed;
+    Result->MinBrEdrUsed = maps.BrEdrUsed;
+
+    for (l = 0; l < LE_LINKS; l++) {
+        nextEvent[l] = Random() % LeModel[l].IntervalUs;
+    }
+
+    for (now = 0; now < RUN_US; now += TICK_US) {
+        PHASE_RESULT* phase;
+
+        p = (ULONG)(now / PHASE_US);
+        phase = &Result->Phase[p];
+
+        // Each network's airtime for the next half second
+        if (now % DUTY_US == 0) {
+            for (w = 0; w < NETWORKS; w++) {
+                airtime[w] = min(0.95, Airtime[p][w] * (0.5 + Uniform()));
+            }
+            for (bin = 0; bin < AFH_BINS; bin++) {
+                busy[bin] = BinAirtime(airtime, bin);
+            }
+        }
+
+        // Connection events
+        for (l = 0; l < LE_LINKS; l++) {
+            double linkError = LinkErrorRate(LeModel[l].Rssi);
+
+            if (now < nextEvent[l]) {
+                continue;
+            }
+            nextEvent[l] += LeModel[l].IntervalUs;
+
+            n = Hop(maps.Le, AFH_LE_CHANNELS, maps.LeUsed);
+            bin = LeBin(n);
+            for (k = 0; k < LeModel[l].PerEvent; k++) {
+                BOOLEAN lost = Uniform() < linkError || Uniform() < busy[bin];
+
+                LeWindow[l][n].Packets++;
+                phase->Le.Packets++;
+                if (lost) {
+                    LeWindow[l][n].Errors++;
+                    phase->Le.Errors++;
+                }
+            }
+        }
+
+        // BR/EDR audio: one packet per two slots
+        n = Hop(maps.BrEdr, AFH_BREDR_CHANNELS, maps.BrEdrUsed);
+        BrEdrWindow[n].Packets++;
+        phase->BrEdr.Packets++;
+        if (Uniform() < LinkErrorRate(BREDR_RSSI) || Uniform() < busy[n]) {
+            BrEdrWindow[n].Errors++;
+            phase->BrEdr.Errors++;
+        }
+
+        if (Mode == HostEstimator) {
+            if (now % SUBMIT_US == 0 && now != 0) {
+                Submit(now);
+                if (Estimator.Stats.MapChanges != lastChanges) {
+                    phase->MapChanges += Estimator.Stats.MapChanges - lastChanges;
+                    lastChanges = Estimator.Stats.MapChanges;
+                    pending = Estimator.Maps;
+                    applyUs = now + APPLY_US;
+                    hasPending = TRUE;
+                }
+            }
+            if (hasPending && now >= applyUs) {
+                maps = pending;
+                hasPending = FALSE;
+                Result->MinLeUsed = min(Result->MinLeUsed, maps.LeUsed);
+                Result->MinBrEdrUsed = min(Result->MinBrEdrUsed, maps.BrEdrUsed);
+            }
+        }
+
+        // Channels a network covers, and whether the links still use them
+        for (w = 0; w < NETWORKS; w++) {
+            if (Airtime[p][w] == 0) {
+                continue;
+            }
+            for (n = 0; n < AFH_LE_CHANNELS; n++) {
+                if (Covered(w, LeBin(n))) {
+                    phase->BusyTotal++;
+                    phase->BusyInUse += InMap(maps.Le, n);
+                }
+            }
+        }
+
+        // Channel 6's channels all back in use after it stopped
+        if (Result->RecoveryUs < 0 && now >= stoppedUs) {
+            BOOLEAN back = TRUE;
+
+            for (n = 0; n < AFH_LE_CHANNELS; n++) {
+                if (Covered(1, LeBin(n)) && !InMap(maps.Le, n)) {
+                    back = FALSE;
+                }
+            }
+            if (back) {
+                Result->RecoveryUs = (double)(now - stoppedUs);
+            }
+        }
+
+        phase->LeUsedSum += maps.LeUsed;
+        phase->Ticks++;
+    }
+
+    Result->Stats = Estimator.Stats;
+}
+
+static double
+Delivered(const COUNTS* Counts)
+{
+    return Counts->Packets ? 100.0 * (Counts->Packets - Counts->Errors) / Counts->Packets : 0;
+}
+
+static double
+Goodput(const COUNTS* Counts)
+{
+    return (Counts->Packets - Counts->Errors) / (PHASE_US / 1e6);
+}
+
+//
+// Estimator checks on crafted samples
+//
+
+// 100 packets on every LE data channel, 2 lost, and Errors on Channel
+static VOID
+RecordAll(ULONG Channel, USHORT Errors)
+{
+    AFH_SAMPLE sample;
+    ULONG n;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.Kind = AFH_KIND_LE;
+    sample.Rssi = AFH_RSSI_UNAVAILABLE;
+    sample.Packets = 100;
+    for (n = 0; n < AFH_LE_CHANNELS; n++) {
+        sample.Channel = (UCHAR)n;
+        sample.Errors = (n == Channel) ? Errors : 2;
+        AfhEstimatorRecord(&Estimator, &sample);
+    }
+}
+
+static VOID
+EstimatorChecks(void)
+{
+    AFH_SAMPLE sample;
+    ULONG64 now = 0;
+    ULONG round, n, used;
+    BOOLEAN minimums = TRUE;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.Rssi = AFH_RSSI_UNAVAILABLE;
+    sample.Packets = 100;
+
+    printf("\nEstimator checks\n");
+
+    // Out of range
+    AfhEstimatorInitialize(&Estimator, now);
+    sample.Kind = AFH_KIND_LE;
+    sample.Channel = AFH_LE_CHANNELS;
+    Check("LE channel 37 is rejected", !AfhEstimatorRecord(&Estimator, &sample));
+    sample.Kind = AFH_KIND_BREDR;
+    sample.Channel = AFH_BREDR_CHANNELS;
+    Check("BR/EDR channel 79 is rejected", !AfhEstimatorRecord(&Estimator, &sample));
+    sample.Kind = 2;
+    sample.Channel = 0;
+    Check("Unknown link kind is rejected", !AfhEstimatorRecord(&Estimator, &sample));
+    Check("  and none of them counted",
+        Estimator.Stats.Rejected == 3 && Estimator.Stats.Samples == 0 && !Estimator.SeenLe);
+
+    // Too few packets to judge
+    sample.Kind = AFH_KIND_LE;
+    sample.Channel = 5;
+    sample.Packets = AFH_MIN_PACKETS - 1;
+    sample.Errors = AFH_MIN_PACKETS - 1;
+    for (round = 0; round < 4; round++) {
+        AfhEstimatorRecord(&Estimator, &sample);
+        now += AFH_PERIOD_US;
+        AfhEstimatorEvaluate(&Estimator, now);
+        sample.Packets /= 2;
+        sample.Errors /= 2;
+    }
+    Check("A few lost packets exclude nothing", Estimator.Stats.Exclusions == 0);
+
+    // One bad evaluation is not enough
+    AfhEstimatorInitialize(&Estimator, now);
+    sample.Packets = 100;
+    for (n = 0; n < AFH_LE_CHANNELS; n++) {
+        sample.Channel = (UCHAR)n;
+        sample.Errors = (n == 20) ? 50 : 1;
+        AfhEstimatorRecord(&Estimator, &sample);
+    }
+    now += AFH_PERIOD_US;
+    Check("One bad evaluation leaves the map alone", !AfhEstimatorEvaluate(&Estimator, now));
+    sample.Packets = 400;
+    for (n = 0; n < AFH_LE_CHANNELS; n++) {
+        sample.Channel = (UCHAR)n;
+        sample.Errors = 1;
+        AfhEstimatorRecord(&Estimator, &sample);
+    }
+    now += AFH_PERIOD_US;
+    AfhEstimatorEvaluate(&Estimator, now);
+    Check("  and a good one clears its strike",
+        Estimator.Bins[LeBin(20)].Strikes == 0 && Estimator.Stats.Exclusions == 0);
+    sample.Packets = 100;
+
+    // Errors on every channel alike are the links, not the channels
+    for (round = 0; round < 4; round++) {
+        for (n = 0; n < AFH_LE_CHANNELS; n++) {
+            sample.Channel = (UCHAR)n;
+            sample.Errors = (USHORT)(35 + Random() % 10);
+            AfhEstimatorRecord(&Estimator, &sample);
+        }
+        now += AFH_PERIOD_US;
+        AfhEstimatorEvaluate(&Estimator, now);
+    }
+    Check("Errors on every channel alike exclude nothing", Estimator.Stats.Exclusions == 0);
+
+    // Weak links fail everywhere and must not count against a channel
+    AfhEstimatorInitialize(&Estimator, now);
+    sample.Rssi = -93;
+    for (round = 0; round < 4; round++) {
+        for (n = 0; n < 12; n++) {
+            sample.Channel = (UCHAR)n;
+            sample.Errors = 60;
+            AfhEstimatorRecord(&Estimator, &sample);
+        }
+        now += AFH_PERIOD_US;
+        AfhEstimatorEvaluate(&Estimator, now);
+    }
+    Check("Weak links' errors exclude nothing",
+        Estimator.Stats.Exclusions == 0 && Estimator.Stats.WeakSamples == 48);
+    sample.Rssi = AFH_RSSI_UNAVAILABLE;
+
+    // Interference spreading over the band: the maps stop at their minimums
+    AfhEstimatorInitialize(&Estimator, now);
+    sample.Kind = AFH_KIND_LE;
+    for (round = 0; round < 16; round++) {
+        for (n = 0; n < AFH_LE_CHANNELS; n++) {
+            sample.Channel = (UCHAR)n;
+            sample.Errors = (n < (round / 2 + 1) * 6) ? 60 : 2;
+            AfhEstimatorRecord(&Estimator, &sample);
+        }
+        now += AFH_PERIOD_US;
+        AfhEstimatorEvaluate(&Estimator, now);
+        minimums = minimums && Estimator.Maps.LeUsed >= AFH_LE_MIN_CHANNELS &&
+            Estimator.Maps.BrEdrUsed >= AFH_BREDR_MIN_CHANNELS;
+    }
+    for (n = 0, used = 0; n < AFH_LE_CHANNELS; n++) {
+        used += InMap(Estimator.Maps.Le, n);
+    }
+    Check("Maps never drop below their minimums", minimums);
+    Check("  and the counts match the maps", used == Estimator.Maps.LeUsed);
+    Check("  by using the least bad excluded channels",
+        Estimator.Stats.Readmitted > 0 && InMap(Estimator.Maps.Le, AFH_LE_CHANNELS - 1));
+
+    // Retry, and a longer wait after a relapse
+    AfhEstimatorInitialize(&Estimator, 0);
+    now = 0;
+    for (round = 0; round < 2; round++) {
+        RecordAll(3, 80);
+        now += AFH_PERIOD_US;
+        AfhEstimatorEvaluate(&Estimator, now);
+    }
+    Check("Two bad evaluations exclude a channel", !InMap(Estimator.Maps.Le, 3));
+    now += AFH_RETRY_US + AFH_RETRY_ALIGN_US;
+    AfhEstimatorEvaluate(&Estimator, now);
+    Check("  which is retried after AFH_RETRY_US",
+        InMap(Estimator.Maps.Le, 3) && Estimator.Stats.Retries == 1);
+    for (round = 0; round < 2; round++) {
+        RecordAll(3, 80);
+        now += AFH_PERIOD_US;
+        AfhEstimatorEvaluate(&Estimator, now);
+    }
+    Check("  and waits twice as long after a relapse",
+        !InMap(Estimator.Maps.Le, 3) && Estimator.Bins[LeBin(3)].BackoffUs == 2 * AFH_RETRY_US);
+}
+
+//
+// Host CPU: one agent submission of every link's channels and an evaluation
+//
+
+static VOID
+CpuCost(void)
+{
+    AFH_SAMPLE sample;
+    ULONG64 now = 0;
+    double start, elapsed;
+    ULONG round, l, n;
+
+    memset(&sample, 0, sizeof(sample));
+    AfhEstimatorInitialize(&Estimator, now);
+
+    start = Seconds();
+    for (round = 0; round < CPU_ROUNDS; round++) {
+        sample.Kind = AFH_KIND_LE;
+        for (l = 0; l < LE_LINKS; l++) {
+            for (n = 0; n < AFH_LE_CHANNELS; n++) {
+                sample.Channel = (UCHAR)n;
+                sample.Rssi = LeModel[l].Rssi;
+                sample.Packets = 8;
+                sample.Errors = (USHORT)(Random() % 3);
+                AfhEstimatorRecord(&Estimator, &sample);
+            }
+        }
+        now += AFH_PERIOD_US;
+        AfhEstimatorEvaluate(&Estimator, now);
+    }
+    elapsed = Seconds() - start;
+
+    printf("\nHost CPU: %.1f us per submission of %u samples and an evaluation\n",
+        elapsed * 1e6 / CPU_ROUNDS, LE_LINKS * AFH_LE_CHANNELS);
+}
+
+int
+main(void)
+{
+    double airtime[PHASES][NETWORKS];
+    BOOLEAN gains = TRUE, excluded = TRUE, quietCost = TRUE;
+    ULONG p, m, w;
+    ULONG64 changes;
+
+    for (p = 0; p < PHASES; p++) {
+        for (w = 0; w < NETWORKS; w++) {
+            airtime[p][w] = Networks[w].Airtime[p];
+        }
+    }
+
+    printf("AFH channel quality benchmark\n\n");
+    printf("Per phase of %.0f s: delivered %%, goodput pkt/s, LE channels in use, map changes\n",
+        PHASE_US / 1e6);
+    printf("  %-13s %-10s %9s %9s %9s %9s %8s %8s\n",
+        "Phase", "Host", "LE %", "LE pkt/s", "BR %", "BR pkt/s", "LE used", "changes");
+    printf("  ----------------------------------------------------------------------------------\n");
+
+    for (m = HostDefaults; m <= HostEstimator; m++) {
+        Run((HOST_MODE)m, (const double (*)[NETWORKS])airtime, &Results[m]);
+    }
+
+    for (p = 0; p < PHASES; p++) {
+        for (m = HostDefaults; m <= HostEstimator; m++) {
+            PHASE_RESULT* phase = &Results[m].Phase[p];
+
+            printf("  %-13s %-10s %9.1f %9.0f %9.1f %9.0f %8.1f %8llu\n",
+                PhaseName[p], ModeName[m],
+                Delivered(&phase->Le), Goodput(&phase->Le),
+                Delivered(&phase->BrEdr), Goodput(&phase->BrEdr),
+                phase->LeUsedSum / phase->Ticks, (unsigned long long)phase->MapChanges);
+        }
+    }
+
+    printf("\n  Interfered LE channels still in use:");
+    for (p = 0; p < PHASES - 1; p++) {
+        const PHASE_RESULT* phase = &Results[HostEstimator].Phase[p];
+
+        printf(" %s %.1f%%%s", PhaseName[p], 100.0 * phase->BusyInUse / phase->BusyTotal,
+            p + 1 < PHASES - 1 ? "," : "\n");
+    }
+    printf("  Channel 6's channels back in use %.1f s after it stopped\n",
+        Results[HostEstimator].RecoveryUs / 1e6);
+    printf("  Estimator: %llu exclusions, %llu retries, %llu map changes in %.0f s\n",
+        (unsigned long long)Results[HostEstimator].Stats.Exclusions,
+        (unsigned long long)Results[HostEstimator].Stats.Retries,
+        (unsigned long long)Results[HostEstimator].Stats.MapChanges, RUN_US / 1e6);
+    printf("\n");
+
+    for (p = 0; p < PHASES - 1; p++) {
+        const PHASE_RESULT* defaults = &Results[HostDefaults].Phase[p];
+        const PHASE_RESULT* estimator = &Results[HostEstimator].Phase[p];
+
+        gains = gains && Goodput(&estimator->Le) > Goodput(&defaults->Le) * 1.1 &&
+            Goodput(&estimator->BrEdr) > Goodput(&defaults->BrEdr) * 1.1;
+        excluded = excluded && estimator->BusyInUse * 4 < estimator->BusyTotal;
+    }
+    quietCost = Goodput(&Results[HostEstimator].Phase[PHASES - 1].Le) >=
+        Goodput(&Results[HostDefaults].Phase[PHASES - 1].Le) * 0.98;
+    changes = Results[HostEstimator].Stats.MapChanges;
+
+    Check("Goodput 10% higher under Wi-Fi, LE and BR/EDR", gains);
+    Check("Interfered channels out of use 75% of the time", excluded);
+    Check("Quiet band costs less than 2% of goodput", quietCost);
+    Check("Channels back in use within a phase of quiet",
+        Results[HostEstimator].RecoveryUs >= 0 && Results[HostEstimator].RecoveryUs < PHASE_US);
+    Check("Maps never below their minimums",
+        Results[HostEstimator].MinLeUsed >= AFH_LE_MIN_CHANNELS &&
+        Results[HostEstimator].MinBrEdrUsed >= AFH_BREDR_MIN_CHANNELS);
+    Check("At most one map change per 5 s on average", changes * 5000000 <= RUN_US);
+
+    EstimatorChecks();
+    CpuCost();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,486 @@
+/*++
+
+Module Name:
+    bulk_transfer_benchmark.c
+
+Abstract:
+    Event-driven benchmark for the driver's bulk transfer pacing
+    (MultiDeviceBTBulkPacer.c). A 4 MB file goes over one LE 2M
+    connection with a 7.5 ms interval: on an idle link, beside 328 kbps
+    audio, and beside 512 kbps hi-res audio.
+
+    The controller sends queued LL packets first in, first out, back to
+    back while the connection event lasts. A packet that would overrun
+    the event waits for the next one. It reports the PDUs an event
+    finished once the event closes, as one Number Of Completed Packets
+    event. Audio packets are queued every 5 ms.
+
+    The file goes two ways. The old path writes 4 KB buffers, cuts each
+    into PDUs on its own and issues the next write 250 us after the last
+    one completes. The engine path is BulkService: it refills the pacer
+    on each wake-up (completions, or its timer rounded up to the 15.6 ms
+    clock tick), then sends the bursts BulkPacerPlan allows.
+
+    The table gives the transfer time, goodput and the p99 queueing
+    delay of audio packets in the controller, which bulk data queued
+    ahead of them adds to. Checks fail the run if the engine falls
+    behind 4 KB writes under any load or delays audio more, and cover
+    the pacer's rate, queue limit, token allowance and burst planning.
+
+    Build (MSVC):
+        cl /O2 /I..\driver bulk_transfer_benchmark.c ..\driver\MultiDeviceBTBulkPacer.c
+
+    Build (Linux):
+        cc -O2 -I../driver bulk_transfer_benchmark.c ../driver/MultiDeviceBTBulkPacer.c -lm
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "MultiDeviceBTBulkPacer.h"
+
+#define US                  10          // Time unit: 100 ns
+#define FREQUENCY_HZ        10000000
+#define LINK_CAPACITY_BPS   1400000     // ADAPTER_LINK_CAPACITY_BPS
+#define INTERVAL_US         7500
+#define EVENT_GUARD_US      300
+#define LL_PAYLOAD_MAX      251
+#define CLOCK_TICK_US       15625       // Default timer resolution; engine waits round up to it
+#define MTU                 247         // One L2CAP PDU fills one LL packet
+#define WINDOW_PDUS         32          // BULK_DEFAULT_WINDOW
+#define LEGACY_WRITE_BYTES  4096
+#define WRITE_TURNAROUND_US 250
+#define FILE_BYTES          (4 * 1024 * 1024)
+#define AUDIO_PERIOD_US     5000
+#define MAX_AUDIO           20000       // Audio packets in the longest run
+#define LINK_QUEUE          65536       // LL packets; power of two
+#define SCENARIOS           3
+
+typedef enum _PATH {
+    PathLegacy,
+    PathEngine
+} PATH;
+
+typedef struct _SCENARIO {
+    const char* Name;
+    ULONG AudioBytes;           // Per 5 ms; 0 for none
+} SCENARIO;
+
+// One LL packet in the controller's queue
+typedef struct _LL_PACKET {
+    LONGLONG Queued;
+    USHORT Bytes;               // LL payload
+    USHORT PduBytes;            // Bulk payload this packet completes, 0 if none
+    BOOLEAN Bulk;
+    BOOLEAN Last;               // Last fragment of its L2CAP PDU
+} LL_PACKET;
+
+typedef struct _RESULT {
+    double Seconds;
+    double GoodputKbps;
+    ULONG Pdus;
+    ULONG AudioP99Us;
+    ULONG EngineWakes;
+} RESULT;
+
+static const SCENARIO Scenarios[SCENARIOS] = {
+    { "idle link", 0 },
+    { "with audio", 205 },
+    { "hi-res audio", 320 },
+};
+
+static LL_PACKET LinkQueue[LINK_QUEUE];
+static ULONG LinkHead, LinkTail;
+static ULONG AudioDelay[MAX_AUDIO];
+
+static unsigned int RandomState;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+// Uniform in [0, 1)
+static double
+Uniform(void)
+{
+    return (Random() & 0xFFFFFF) / 16777216.0;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static int
+CompareUlong(const void* A, const void* B)
+{
+    ULONG a = *(const ULONG*)A, b = *(const ULONG*)B;
+
+    return (a > b) - (a < b);
+}
+
+static ULONG
+Percentile(ULONG* Values, ULONG Count, ULONG Percent)
+{
+    if (Count == 0) {
+        return 0;
+    }
+    qsort(Values, Count, sizeof(ULONG), CompareUlong);
+    return Values[(Count - 1) * Percent / 100];
+}
+
+// Data packet on 2M (preamble, access address, header, payload, CRC),
+// T_IFS, empty acknowledgement, T_IFS
+static LONGLONG
+Airtime(ULONG Bytes)
+{
+    return ((2 + 4 + 2 + Bytes + 3) * 4 + 150 + (2 + 4 + 2 + 3) * 4 + 150) * US;
+}
+
+// Queues one L2CAP PDU of Payload bytes as LL fragments
+static VOID
+QueuePdu(ULONG Payload, BOOLEAN Bulk, LONGLONG Now)
+{
+    ULONG remaining = Payload + BULK_L2CAP_HEADER_BYTES;
+
+    while (remaining > 0) {
+        LL_PACKET* packet = &LinkQueue[LinkTail++ & (LINK_QUEUE - 1)];
+
+        packet->Queued = Now;
+        packet->Bytes = (USHORT)min(remaining, LL_PAYLOAD_MAX);
+        packet->Bulk = Bulk;
+        remaining -= packet->Bytes;
+        packet->Last = (remaining == 0);
+        packet->PduBytes = (USHORT)((Bulk && packet->Last) ? Payload : 0);
+    }
+
+    if (LinkTail - LinkHead > LINK_QUEUE) {
+        fprintf(stderr, "link queue overflow\n");
+        exit(2);
+    }
+}
+
+// Host side of one run
+typedef struct _HOST {
+    PATH Path;
+    BULK_PACER Pacer;
+    LONG64 TotalBytes;          // ADAPTER_LOAD.TotalBytes
+    ULONG64 NextOffset;
+    ULONG64 Sent;
+    ULONG64 Acked;
+    ULONG InFlight;
+    LONGLONG WakeAt;            // Engine timer, or the next legacy write
+    LONGLONG DoneAt;
+    ULONG AudioPackets;
+    RESULT* Result;
+} HOST;
+
+// One write on the old path: the buffer is cut on its own, so its tail
+// goes out short
+static VOID
+LegacyWrite(HOST* Host, LONGLONG Now)
+{
+    ULONG length = (ULONG)min((ULONG64)LEGACY_WRITE_BYTES, FILE_BYTES - Host->NextOffset);
+
+    while (length > 0) {
+        ULONG pdu = min(length, MTU);
+
+        QueuePdu(pdu, TRUE, Now);
+        Host->TotalBytes += pdu + BULK_L2CAP_HEADER_BYTES;
+        Host->NextOffset += pdu;
+        Host->Sent += pdu;
+        Host->InFlight++;
+        Host->Result->Pdus++;
+        length -= pdu;
+    }
+
+    Host->WakeAt = MAXLONGLONG;
+}
+
+// BulkService with one transfer
+static VOID
+EnginePass(HOST* Host, LONGLONG Now)
+{
+    USHORT lengths[BULK_BURST_PDUS];
+    LONGLONG waitHns;
+    ULONG count, i;
+
+    Host->Result->EngineWakes++;
+    BulkPacerRefill(&Host->Pacer, Now, Host->TotalBytes, Host->Acked);
+
+    while (Host->Pacer.Tokens > 0) {
+        LONG64 cost = 0;
+
+        count = BulkPacerPlan(&Host->Pacer, MTU, FILE_BYTES - Host->NextOffset,
+            WINDOW_PDUS - Host->InFlight, Host->Sent - Host->Acked, lengths);
+        if (count == 0) {
+            break;
+        }
+
+        for (i = 0; i < count; i++) {
+            QueuePdu(lengths[i], TRUE, Now);
+            Host->NextOffset += lengths[i];
+            Host->Sent += lengths[i];
+            cost += lengths[i] + BULK_L2CAP_HEADER_BYTES;
+        }
+
+        BulkPacerCharge(&Host->Pacer, cost);
+        Host->TotalBytes += cost;
+        Host->InFlight += count;
+        Host->Result->Pdus += count;
+    }
+
+    if (Host->NextOffset == FILE_BYTES) {
+        Host->WakeAt = MAXLONGLONG;
+        return;
+    }
+
+    // The wait rounds up to the clock tick; otherwise credits wake the
+    // engine, with a poll once a slice
+    waitHns = (Host->Pacer.Tokens <= 0) ? BulkPacerWait(&Host->Pacer) : (LONGLONG)BULK_SLICE_MS * 10000;
+    waitHns = (waitHns + CLOCK_TICK_US * US - 1) / (CLOCK_TICK_US * US) * (CLOCK_TICK_US * US);
+    Host->WakeAt = Now + waitHns;
+}
+
+// One connection event; returns TRUE if it completed bulk PDUs
+static BOOLEAN
+ConnectionEvent(HOST* Host, LONGLONG Start)
+{
+    LONGLONG end = Start + (INTERVAL_US - EVENT_GUARD_US) * US;
+    LONGLONG t = Start;
+    ULONG completed = 0;
+
+    while (LinkHead != LinkTail) {
+        LL_PACKET* packet = &LinkQueue[LinkHead & (LINK_QUEUE - 1)];
+        LONGLONG air = Airtime(packet->Bytes);
+
+        if (t + air > end) {
+            break;
+        }
+
+        LinkHead++;
+        t += air;
+
+        if (!packet->Bulk) {
+            if (packet->Last && Host->AudioPackets < MAX_AUDIO) {
+                AudioDelay[Host->AudioPackets++] = (ULONG)((t - packet->Queued) / US);
+            }
+        } else if (packet->Last) {
+            Host->Acked += packet->PduBytes;
+            Host->InFlight--;
+            completed++;
+            if (Host->Acked == FILE_BYTES) {
+                Host->DoneAt = t;
+            }
+        }
+    }
+
+    // Completions are reported as the event closes
+    if (completed == 0 || Host->DoneAt != 0) {
+        return FALSE;
+    }
+
+    if (Host->Path == PathEngine) {
+        EnginePass(Host, t);
+    } else if (Host->InFlight == 0) {
+        Host->WakeAt = t + WRITE_TURNAROUND_US * US;
+    }
+
+    return TRUE;
+}
+
+static VOID
+Simulate(const SCENARIO* Scenario, PATH Path, unsigned int Seed, RESULT* Result)
+{
+    HOST host;
+    LONGLONG nextEvent = 0;
+    LONGLONG nextAudio = MAXLONGLONG;
+
+    memset(Result, 0, sizeof(*Result));
+    memset(&host, 0, sizeof(host));
+    LinkHead = LinkTail = 0;
+
+    host.Path = Path;
+    host.Result = Result;
+    host.WakeAt = 0;
+    BulkPacerInitialize(&host.Pacer, LINK_CAPACITY_BPS / 8, FREQUENCY_HZ);
+    RandomState = Seed;
+
+    if (Scenario->AudioBytes != 0) {
+        nextAudio = (LONGLONG)(Uniform() * AUDIO_PERIOD_US * US);
+    }
+
+    // Pacer time starts at 1: 0 marks it unstarted
+    nextEvent = 1;
+    host.WakeAt = 1;
+
+    while (host.DoneAt == 0) {
+        if (nextEvent <= nextAudio && nextEvent <= host.WakeAt) {
+            ConnectionEvent(&host, nextEvent);
+            nextEvent += INTERVAL_US * US;
+        } else if (nextAudio <= host.WakeAt) {
+            QueuePdu(Scenario->AudioBytes, FALSE, nextAudio);
+            host.TotalBytes += Scenario->AudioBytes + BULK_L2CAP_HEADER_BYTES;
+            nextAudio += AUDIO_PERIOD_US * US;
+        } else if (Path == PathEngine) {
+            EnginePass(&host, host.WakeAt);
+        } else {
+            LegacyWrite(&host, host.WakeAt);
+        }
+    }
+
+    Result->Seconds = (double)host.DoneAt / FREQUENCY_HZ;
+    Result->GoodputKbps = FILE_BYTES * 8.0 / Result->Seconds / 1000;
+    Result->AudioP99Us = Percentile(AudioDelay, host.AudioPackets, 99);
+}
+
+static VOID
+PrintResult(const SCENARIO* Scenario, const char* Path, const RESULT* Result)
+{
+    char audio[16];
+
+    if (Scenario->AudioBytes != 0) {
+        snprintf(audio, sizeof(audio), "%.1f", Result->AudioP99Us / 1000.0);
+    } else {
+        snprintf(audio, sizeof(audio), "-");
+    }
+
+    printf("%-12s | %-11s | %-7.2f | %-12.0f | %-9.1f%% | %-6u | %s\n",
+        Scenario->Name, Path, Result->Seconds, Result->GoodputKbps,
+        Result->GoodputKbps * 100000 / LINK_CAPACITY_BPS, Result->Pdus, audio);
+}
+
+/*++
+Routine Description:
+    Drives the pacer through its rate, queue limit, tokens and burst
+    planning by hand. Time is in milliseconds.
+--*/
+static VOID
+PacerChecks(VOID)
+{
+    BULK_PACER pacer;
+    USHORT lengths[BULK_BURST_PDUS];
+    ULONG capacity = LINK_CAPACITY_BPS / 8;
+    ULONG count;
+    BOOLEAN passed;
+
+    printf("\nPacer checks\n");
+
+    // First refill starts at the target share with one slice of tokens
+    BulkPacerInitialize(&pacer, capacity, 1000);
+    BulkPacerRefill(&pacer, 1000, 0, 0);
+    passed = pacer.RateBytesPerSecond == capacity * BULK_TARGET_PERMILLE / 1000 &&
+        pacer.Tokens == (LONG64)pacer.RateBytesPerSecond * BULK_SLICE_MS / 1000 &&
+        pacer.QueueLimitBytes == BULK_QUEUE_FLOOR_BYTES;
+    Check("Starts at the target share with one slice of tokens", passed);
+
+    // Other traffic comes off the rate; bulk's own does not
+    BulkPacerCharge(&pacer, 500);
+    BulkPacerRefill(&pacer, 1000 + BULK_SLICE_MS, 500 + 300, 4000);
+    passed = pacer.OtherBytesPerSecond == 300 * 1000 / BULK_SLICE_MS &&
+        pacer.RateBytesPerSecond == (capacity - 30000) * BULK_TARGET_PERMILLE / 1000;
+    Check("Rate is the target share of the capacity left", passed);
+
+    // The queue limit follows delivery, over the token allowance
+    passed = pacer.QueueLimitBytes == 4000 * BULK_QUEUE_SLICES;
+    Check("Queue limit is what the link delivered", passed);
+
+    // Heavy other traffic leaves the floor
+    BulkPacerRefill(&pacer, 1000 + 2 * BULK_SLICE_MS, 800 + capacity, 4000);
+    passed = pacer.RateBytesPerSecond == capacity * BULK_FLOOR_PERMILLE / 1000 &&
+        pacer.QueueLimitBytes == BULK_QUEUE_FLOOR_BYTES;
+    Check("Saturated link leaves bulk its floor", passed);
+
+    // A long sleep refills no more than the token allowance
+    BulkPacerRefill(&pacer, 100000, 800 + capacity, 4000);
+    passed = pacer.Tokens == (LONG64)pacer.RateBytesPerSecond * BULK_SLICE_MS * BULK_TOKEN_SLICES / 1000;
+    Check("Tokens capped at the allowance after a long sleep", passed);
+
+    // Plans stop at the window, the queue limit, the burst and the file
+    pacer.Tokens = 1000000;
+    pacer.QueueLimitBytes = 100000;
+    count = BulkPacerPlan(&pacer, 247, 100000, 3, 0, lengths);
+    passed = count == 3;
+    count = BulkPacerPlan(&pacer, 247, 100000, 64, 0, lengths);
+    passed = passed && count == BULK_BURST_PDUS;
+    pacer.QueueLimitBytes = 600;
+    count = BulkPacerPlan(&pacer, 247, 100000, 64, 0, lengths);
+    passed = passed && count == 3;
+    count = BulkPacerPlan(&pacer, 247, 300, 64, 0, lengths);
+    passed = passed && count == 2 && lengths[0] == 247 && lengths[1] == 53;
+    Check("Burst bounded by window, queue limit and burst size", passed);
+    Check("Only the region's last PDU is short", passed && lengths[0] == 247);
+
+    // A PDU may overdraw; the debt sets the wait
+    pacer.Tokens = 1;
+    pacer.QueueLimitBytes = 100000;
+    count = BulkPacerPlan(&pacer, 247, 100000, 64, 0, lengths);
+    BulkPacerCharge(&pacer, 251);
+    passed = count == 1 && pacer.Tokens == -250 && BulkPacerWait(&pacer) >= 10000;
+    pacer.Tokens = 1;
+    passed = passed && BulkPacerWait(&pacer) == 0;
+    Check("Overdraw delays the next burst by the debt", passed);
+}
+
+int
+main(void)
+{
+    static RESULT legacy[SCENARIOS], engine[SCENARIOS];
+    ULONG s;
+    BOOLEAN fullPdus = TRUE, goodput = TRUE, audio = TRUE;
+
+    printf("Bulk transfer: %u KB file, LE 2M, %.1f ms interval, MTU %u, capacity %u kbps\n",
+        FILE_BYTES / 1024, INTERVAL_US / 1000.0, MTU, LINK_CAPACITY_BPS / 1000);
+    printf("===========================================================================================\n");
+    printf("%-12s | %-11s | %-7s | %-12s | %-10s | %-6s | %s\n",
+        "TRAFFIC", "PATH", "SECONDS", "GOODPUT kbps", "% CAPACITY", "PDUs", "AUDIO p99 ms");
+    printf("-------------------------------------------------------------------------------------------\n");
+
+    for (s = 0; s < SCENARIOS; s++) {
+        Simulate(&Scenarios[s], PathLegacy, 88, &legacy[s]);
+        Simulate(&Scenarios[s], PathEngine, 88, &engine[s]);
+
+        PrintResult(&Scenarios[s], "4 KB writes", &legacy[s]);
+        PrintResult(&Scenarios[s], "bulk engine", &engine[s]);
+        printf("-------------------------------------------------------------------------------------------\n");
+
+        fullPdus = fullPdus && engine[s].Pdus == (FILE_BYTES + MTU - 1) / MTU;
+        goodput = goodput && engine[s].GoodputKbps >= legacy[s].GoodputKbps;
+        if (Scenarios[s].AudioBytes != 0) {
+            audio = audio && engine[s].AudioP99Us <= legacy[s].AudioP99Us;
+        }
+    }
+
+    printf("GOODPUT: file bytes acknowledged per second. AUDIO p99: queueing delay of audio\n");
+    printf("packets in the controller, which bulk data queued ahead of them adds to.\n\n");
+
+    Check("Engine sends full-MTU PDUs only", fullPdus);
+    Check("Engine beats 4 KB writes on an idle link", engine[0].GoodputKbps > legacy[0].GoodputKbps);
+    Check("Engine keeps up with 4 KB writes under every load", goodput);
+    Check("Audio waits no longer behind the engine", audio);
+
+    PacerChecks();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
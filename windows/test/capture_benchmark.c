@@ -0,0 +1,864 @@
+/*++
+
+Module Name:
+    capture_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's packet capture rings and
+    btsnoop formatting (MultiDeviceBTSnoop.c). It follows the driver's
+    capture path: the filter, then a push into the current processor's
+    ring, with four processors taking turns. A writer drains the rings
+    the way MultiDeviceBTCapture.c does, in timestamp order, into a
+    64 KB buffer that stands in for the file.
+
+    The traffic is a mix of HCI commands and events and of L2CAP
+    traffic for eight devices, some of it SMP key distribution. The
+    report gives:
+    - the cost per packet on the packet path with capture off, with
+      the filter rejecting everything, with a 64-byte snap and with
+      full packets, next to formatting each packet as hex text the way
+      a debug print does
+    - the writer's cost per record and its output rate
+    - packets dropped, and the fullest ring, when 2 s of heavy traffic
+      is drained only by the writer's 100 ms timer, and when a quarter
+      full ring also wakes it
+
+    The checks read the output back as a btsnoop file: the header,
+    record lengths and flags, the rebuilt ACL and L2CAP headers,
+    timestamps, snap lengths, drop counts, filters, key redaction and
+    the ring's wrap-around.
+
+    Build (MSVC):
+        cl /O2 /I..\driver capture_benchmark.c ..\driver\MultiDeviceBTSnoop.c
+
+    Build (Linux):
+        cc -O2 -I../driver capture_benchmark.c ../driver/MultiDeviceBTSnoop.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTSnoop.h"
+
+#define PROCESSORS          4
+#define DEVICES             8
+#define PACKETS             4096        // Workload, used round and round
+#define BATCH               128         // Packets pushed between drains
+#define COST_ROUNDS         2000        // Batches per cost measurement
+#define WRITE_BYTES         65536       // CAPTURE_WRITE_BYTES
+#define FLUSH_US            100000      // CAPTURE_FLUSH_MS
+#define WAKE_LATENCY_US     2000        // Wake event to the writer running
+#define LOAD_US             2000000
+#define LOAD_STEP_US        100
+#define LOAD_PACKETS_PER_S  16000       // All processors
+#define BASE_US             1767225600000000ULL     // 2026-01-01, since 1970
+#define FILE_BYTES          (8 * 1024 * 1024)
+
+typedef struct _PACKET {
+    SNOOP_ENTRY Entry;
+    ULONG Processor;
+    UCHAR Data[SNOOP_MAX_SNAP];
+} PACKET;
+
+// The writer's view of one parsed btsnoop record
+typedef struct _RECORD {
+    ULONG OriginalLength;
+    ULONG IncludedLength;
+    ULONG Flags;
+    ULONG Drops;
+    ULONG64 TimestampUs;        // Since 1970
+    const UCHAR* Packet;        // Indicator first
+} RECORD;
+
+static PACKET Packets[PACKETS];
+static SNOOP_RING Rings[PROCESSORS];
+static UCHAR WriteBuffer[WRITE_BYTES + SNOOP_MAX_SNAP];
+static UCHAR File[FILE_BYTES];
+static ULONG FileBytes;
+static ULONG64 Clock;
+static volatile LONG Enabled;
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static ULONG
+Get32Be(const UCHAR* p)
+{
+    return ((ULONG)p[0] << 24) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 8) | p[3];
+}
+
+static ULONG64
+Get64Be(const UCHAR* p)
+{
+    return ((ULONG64)Get32Be(p) << 32) | Get32Be(p + 4);
+}
+
+static USHORT
+Get16(const UCHAR* p)
+{
+    return (USHORT)(p[0] | (p[1] << 8));
+}
+
+static BTH_ADDR
+DeviceAddress(ULONG Device)
+{
+    return 0x001122334400ULL + Device;
+}
+
+// The ACL handle the driver's credit pool would give a device
+static USHORT
+DeviceHandle(BTH_ADDR Address)
+{
+    return (Address & 0xFFFFFFFFFF00ULL) == 0x001122334400ULL ?
+        (USHORT)(0x0040 + (Address & 0xFF)) : 0;
+}
+
+//
+// Workload
+//
+
+static VOID
+BuildCommand(PACKET* Packet, USHORT Opcode, ULONG Parameters)
+{
+    ULONG i;
+
+    Packet->Entry.Type = SNOOP_TYPE_COMMAND;
+    Packet->Entry.Direction = SNOOP_SENT;
+    Packet->Entry.Length = 3 + Parameters;
+    Packet->Data[0] = (UCHAR)Opcode;
+    Packet->Data[1] = (UCHAR)(Opcode >> 8);
+    Packet->Data[2] = (UCHAR)Parameters;
+    for (i = 0; i < Parameters; i++) {
+        Packet->Data[3 + i] = (UCHAR)(0xA0 + i);
+    }
+}
+
+static VOID
+BuildEvent(PACKET* Packet, UCHAR Code, ULONG Parameters)
+{
+    ULONG i;
+
+    Packet->Entry.Type = SNOOP_TYPE_EVENT;
+    Packet->Entry.Direction = SNOOP_RECEIVED;
+    Packet->Entry.Length = 2 + Parameters;
+    Packet->Data[0] = Code;
+    Packet->Data[1] = (UCHAR)Parameters;
+    for (i = 0; i < Parameters; i++) {
+        Packet->Data[2 + i] = (UCHAR)(0xB0 + i);
+    }
+}
+
+// L2CAP traffic: payloads the mux sends, or whole frames either way
+static VOID
+BuildData(PACKET* Packet, ULONG Device, USHORT Cid, UCHAR Direction, UCHAR Framing, ULONG Payload)
+{
+    ULONG header = (Framing == SNOOP_FRAMING_L2CAP_FRAME) ? SNOOP_L2CAP_HEADER_BYTES : 0;
+    ULONG i;
+
+    Packet->Entry.Type = SNOOP_TYPE_ACL;
+    Packet->Entry.Direction = Direction;
+    Packet->Entry.Framing = Framing;
+    Packet->Entry.DeviceAddress = DeviceAddress(Device);
+    Packet->Entry.Cid = Cid;
+    Packet->Entry.Length = header + Payload;
+    if (header != 0) {
+        Packet->Data[0] = (UCHAR)Payload;
+        Packet->Data[1] = (UCHAR)(Payload >> 8);
+        Packet->Data[2] = (UCHAR)Cid;
+        Packet->Data[3] = (UCHAR)(Cid >> 8);
+    }
+    for (i = 0; i < Payload && header + i < SNOOP_MAX_SNAP; i++) {
+        Packet->Data[header + i] = (UCHAR)(Device * 16 + i);
+    }
+}
+
+static VOID
+BuildWorkload(void)
+{
+    ULONG i, pick, device;
+
+    memset(Packets, 0, sizeof(Packets));
+
+    for (i = 0; i < PACKETS; i++) {
+        PACKET* packet = &Packets[i];
+
+        pick = Random() % 100;
+        device = Random() % DEVICES;
+        packet->Processor = Random() % PROCESSORS;
+
+        if (pick < 10) {
+            BuildCommand(packet, 0x2016, 2);
+        } else if (pick < 30) {
+            BuildEvent(packet, 0x13, 5);    // Number Of Completed Packets
+        } else if (pick < 32) {
+            BuildData(packet, device, SNOOP_CID_SMP, SNOOP_RECEIVED,
+                SNOOP_FRAMING_L2CAP_FRAME, 17);
+            packet->Data[SNOOP_L2CAP_HEADER_BYTES] = 0x06;      // Encryption Information
+        } else if (pick < 72) {
+            BuildData(packet, device, (USHORT)(0x0040 + Random() % 4), SNOOP_SENT,
+                SNOOP_FRAMING_L2CAP_PAYLOAD, 27 + Random() % 225);
+        } else if (pick < 80) {
+            BuildData(packet, device, 0x0041, SNOOP_SENT,
+                SNOOP_FRAMING_L2CAP_FRAME, 6 + Random() % 1000);
+        } else {
+            BuildData(packet, device, (USHORT)(0x0040 + Random() % 4), SNOOP_RECEIVED,
+                SNOOP_FRAMING_L2CAP_FRAME, 27 + Random() % 600);
+        }
+    }
+}
+
+//
+// The driver's capture path and writer
+//
+
+static VOID
+CaptureRingsReset(void)
+{
+    ULONG i;
+
+    for (i = 0; i < PROCESSORS; i++) {
+        SnoopRingInitialize(&Rings[i]);
+    }
+    FileBytes = SnoopFormatFileHeader(File);
+}
+
+// CapturePacket, less the rundown and IRQL
+static VOID
+Capture(const SNOOP_FILTER* Filter, PACKET* Packet)
+{
+    if (!SnoopFilterMatch(Filter, &Packet->Entry)) {
+        return;
+    }
+
+    Packet->Entry.TimestampUs = ++Clock;
+    SnoopRingPush(&Rings[Packet->Processor], Filter->SnapLength, &Packet->Entry,
+        Packet->Data, Packet->Entry.Length);
+}
+
+static VOID
+CaptureWrite(ULONG Length)
+{
+    if (FileBytes + Length <= FILE_BYTES) {
+        memcpy(File + FileBytes, WriteBuffer, Length);
+        FileBytes += Length;
+    }
+}
+
+// CaptureDrain: returns records written
+static ULONG
+CaptureDrain(BOOLEAN Write)
+{
+    PUCHAR packet = WriteBuffer + WRITE_BYTES;
+    const SNOOP_ENTRY* oldest;
+    const SNOOP_ENTRY* next;
+    SNOOP_ENTRY entry;
+    ULONG64 drops = 0;
+    ULONG used = 0, records = 0;
+    ULONG i, ring;
+
+    for (i = 0; i < PROCESSORS; i++) {
+        drops += Rings[i].Dropped;
+    }
+
+    for (;;) {
+        oldest = NULL;
+        ring = 0;
+        for (i = 0; i < PROCESSORS; i++) {
+            next = SnoopRingPeek(&Rings[i]);
+            if (next != NULL && (oldest == NULL || next->TimestampUs < oldest->TimestampUs)) {
+                oldest = next;
+                ring = i;
+            }
+        }
+        if (oldest == NULL) {
+            break;
+        }
+
+        SnoopRingPop(&Rings[ring], &entry, packet);
+
+        if (used > WRITE_BYTES - SNOOP_MAX_RECORD_BYTES) {
+            if (Write) {
+                CaptureWrite(used);
+            }
+            used = 0;
+        }
+
+        used += SnoopFormatRecord(&entry, packet,
+            entry.Framing == SNOOP_FRAMING_HCI ? 0 : DeviceHandle(entry.DeviceAddress),
+            BASE_US, (ULONG)drops, WriteBuffer + used);
+        records++;
+    }
+
+    if (used != 0 && Write) {
+        CaptureWrite(used);
+    }
+
+    return records;
+}
+
+static SNOOP_FILTER
+FilterAll(ULONG SnapLength)
+{
+    SNOOP_FILTER filter;
+
+    memset(&filter, 0, sizeof(filter));
+    filter.Types = SNOOP_TYPES_ALL;
+    filter.Directions = SNOOP_DIRECTIONS_ALL;
+    filter.SnapLength = SnapLength;
+    return filter;
+}
+
+// Parses the record at Offset; returns its size, or 0 if it runs past the end
+static ULONG
+ParseRecord(ULONG Offset, RECORD* Record)
+{
+    const UCHAR* p = File + Offset;
+
+    if (FileBytes - Offset < SNOOP_RECORD_HEADER_BYTES) {
+        return 0;
+    }
+
+    Record->OriginalLength = Get32Be(p);
+    Record->IncludedLength = Get32Be(p + 4);
+    Record->Flags = Get32Be(p + 8);
+    Record->Drops = Get32Be(p + 12);
+    Record->TimestampUs = Get64Be(p + 16) - SNOOP_EPOCH_DELTA_US;
+    Record->Packet = p + SNOOP_RECORD_HEADER_BYTES;
+
+    if (Record->IncludedLength > FileBytes - Offset - SNOOP_RECORD_HEADER_BYTES) {
+        return 0;
+    }
+    return SNOOP_RECORD_HEADER_BYTES + Record->IncludedLength;
+}
+
+//
+// Packet path cost
+//
+
+static double
+HexTextCost(void)
+{
+    static char text[SNOOP_MAX_SNAP * 3 + 64];
+    volatile ULONG sink = 0;
+    double start;
+    ULONG round, i, b, used;
+
+    start = Seconds();
+    for (round = 0; round < COST_ROUNDS; round++) {
+        for (i = 0; i < BATCH; i++) {
+            const PACKET* packet = &Packets[(round * BATCH + i) % PACKETS];
+
+            used = (ULONG)sprintf(text, "MultiDeviceBT: %u %u len %u:",
+                packet->Entry.Type, packet->Entry.Direction, packet->Entry.Length);
+            for (b = 0; b < min(packet->Entry.Length, (ULONG)SNOOP_MAX_SNAP); b++) {
+                used += (ULONG)sprintf(text + used, " %02x", packet->Data[b]);
+            }
+            sink += used;
+        }
+    }
+    return (Seconds() - start) * 1e9 / ((double)COST_ROUNDS * BATCH);
+}
+
+// Packet path only; the rings are drained between batches, untimed
+static double
+CaptureCost(const SNOOP_FILTER* Filter, BOOLEAN On)
+{
+    double elapsed = 0, start;
+    ULONG round, i;
+
+    Enabled = On;
+    CaptureRingsReset();
+
+    for (round = 0; round < COST_ROUNDS; round++) {
+        start = Seconds();
+        for (i = 0; i < BATCH; i++) {
+            PACKET* packet = &Packets[(round * BATCH + i) % PACKETS];
+
+            if (ReadNoFence(&Enabled) != 0) {
+                Capture(Filter, packet);
+            }
+        }
+        elapsed += Seconds() - start;
+        CaptureDrain(FALSE);
+    }
+
+    Enabled = 0;
+    return elapsed * 1e9 / ((double)COST_ROUNDS * BATCH);
+}
+
+// Writer only: the batch is pushed untimed
+static VOID
+WriterCost(ULONG SnapLength, double* NsPerRecord, double* MegabytesPerSecond)
+{
+    SNOOP_FILTER filter = FilterAll(SnapLength);
+    double elapsed = 0, start;
+    ULONG64 bytes = 0, records = 0;
+    ULONG round, i, before;
+
+    CaptureRingsReset();
+
+    for (round = 0; round < COST_ROUNDS; round++) {
+        for (i = 0; i < BATCH; i++) {
+            Capture(&filter, &Packets[(round * BATCH + i) % PACKETS]);
+        }
+
+        if (FileBytes > FILE_BYTES - 4 * WRITE_BYTES) {
+            FileBytes = SNOOP_FILE_HEADER_BYTES;
+        }
+        before = FileBytes;
+
+        start = Seconds();
+        records += CaptureDrain(TRUE);
+        elapsed += Seconds() - start;
+
+        bytes += FileBytes - before;
+    }
+
+    *NsPerRecord = elapsed * 1e9 / records;
+    *MegabytesPerSecond = bytes / elapsed / 1e6;
+}
+
+static VOID
+CostReport(void)
+{
+    SNOOP_FILTER none = FilterAll(0);
+    SNOOP_FILTER snap64 = FilterAll(64);
+    SNOOP_FILTER full = FilterAll(0);
+    double hex, off, filtered, small, whole;
+    double recordNs[2], rate[2];
+
+    none.Types = SNOOP_TYPE_BIT(SNOOP_TYPE_ISO);
+
+    hex = HexTextCost();
+    off = CaptureCost(&full, FALSE);
+    filtered = CaptureCost(&none, TRUE);
+    small = CaptureCost(&snap64, TRUE);
+    whole = CaptureCost(&full, TRUE);
+    WriterCost(64, &recordNs[0], &rate[0]);
+    WriterCost(0, &recordNs[1], &rate[1]);
+
+    printf("Packet path, ns per packet (mix of %u packets)\n", PACKETS);
+    printf("  %-28s %10s %10s\n", "", "ns", "vs hex");
+    printf("  ------------------------------------------------------\n");
+    printf("  %-28s %10.1f %9.1fx\n", "hex text (debug print)", hex, 1.0);
+    printf("  %-28s %10.2f %9.4fx\n", "capture off", off, off / hex);
+    printf("  %-28s %10.1f %9.4fx\n", "filtered out", filtered, filtered / hex);
+    printf("  %-28s %10.1f %9.4fx\n", "snap 64", small, small / hex);
+    printf("  %-28s %10.1f %9.4fx\n", "full packets", whole, whole / hex);
+    printf("\n");
+
+    printf("Writer\n");
+    printf("  %-28s %10s %10s\n", "", "ns/record", "MB/s");
+    printf("  ------------------------------------------------------\n");
+    printf("  %-28s %10.1f %10.0f\n", "snap 64", recordNs[0], rate[0]);
+    printf("  %-28s %10.1f %10.0f\n", "full packets", recordNs[1], rate[1]);
+    printf("\n");
+
+    Check("Capture off costs under 5 ns a packet", off < 5.0);
+    Check("Full packets at least 10x cheaper than hex text", whole * 10 < hex);
+    Check("Writer keeps up with 100 MB/s of packets", rate[1] > 100);
+}
+
+//
+// Heavy traffic: drops with and without the early wake
+//
+
+typedef struct _LOAD_RESULT {
+    ULONG64 Captured;
+    ULONG64 Dropped;
+    ULONG MaxFill;              // Bytes, fullest ring
+    ULONG Drains;
+} LOAD_RESULT;
+
+static LOAD_RESULT
+Load(ULONG SnapLength, BOOLEAN Wake)
+{
+    SNOOP_FILTER filter = FilterAll(SnapLength);
+    LOAD_RESULT result;
+    ULONG64 now, nextFlush = FLUSH_US, wakeAt = 0;
+    ULONG64 due = 0;
+    ULONG next = 0, i, fill;
+
+    memset(&result, 0, sizeof(result));
+    CaptureRingsReset();
+
+    for (now = 0; now < LOAD_US; now += LOAD_STEP_US) {
+        due += LOAD_PACKETS_PER_S * LOAD_STEP_US;
+        while (due >= 1000000) {
+            PACKET* packet = &Packets[next++ % PACKETS];
+            PSNOOP_RING ring = &Rings[packet->Processor];
+
+            due -= 1000000;
+            Capture(&filter, packet);
+
+            fill = ring->DataTail - ring->DataHead;
+            result.MaxFill = max(result.MaxFill, fill);
+            if (Wake && wakeAt == 0 &&
+                (ring->Tail - ring->Head >= SNOOP_RING_ENTRIES / 4 ||
+                 fill >= SNOOP_RING_BYTES / 4)) {
+                wakeAt = now + WAKE_LATENCY_US;
+            }
+        }
+
+        if (now >= nextFlush || (wakeAt != 0 && now >= wakeAt)) {
+            if (FileBytes > FILE_BYTES - 4 * WRITE_BYTES) {
+                FileBytes = SNOOP_FILE_HEADER_BYTES;
+            }
+            CaptureDrain(TRUE);
+            result.Drains++;
+            nextFlush = now + FLUSH_US;
+            wakeAt = 0;
+        }
+    }
+
+    for (i = 0; i < PROCESSORS; i++) {
+        result.Captured += Rings[i].Captured;
+        result.Dropped += Rings[i].Dropped;
+    }
+    CaptureDrain(FALSE);
+    return result;
+}
+
+static VOID
+LoadReport(void)
+{
+    static const char* Name[4] = {
+        "snap 64, timer only", "snap 64, early wake",
+        "full, timer only", "full, early wake"
+    };
+    LOAD_RESULT results[4];
+    ULONG r;
+
+    results[0] = Load(64, FALSE);
+    results[1] = Load(64, TRUE);
+    results[2] = Load(0, FALSE);
+    results[3] = Load(0, TRUE);
+
+    printf("Heavy traffic: %u packets/s on %u processors for %.0f s\n",
+        LOAD_PACKETS_PER_S, PROCESSORS, LOAD_US / 1e6);
+    printf("  %-24s %10s %10s %10s %8s\n", "", "captured", "dropped", "max fill", "drains");
+    printf("  --------------------------------------------------------------\n");
+    for (r = 0; r < 4; r++) {
+        printf("  %-24s %10llu %10llu %9.0f%% %8u\n", Name[r],
+            (unsigned long long)results[r].Captured, (unsigned long long)results[r].Dropped,
+            100.0 * results[r].MaxFill / SNOOP_RING_BYTES, results[r].Drains);
+    }
+    printf("\n");
+
+    Check("Snap 64 drops nothing on the timer alone", results[0].Dropped == 0);
+    Check("Full packets drop on the timer alone", results[2].Dropped != 0);
+    Check("Early wake drops nothing at full snap", results[3].Dropped == 0);
+}
+
+//
+// Correctness
+//
+
+static VOID
+FileChecks(void)
+{
+    SNOOP_FILTER filter = FilterAll(0);
+    ULONG64 lastTimestamp = 0;
+    ULONG offset, size, records = 0, i;
+    BOOLEAN ordered = TRUE, lengths = TRUE, flags = TRUE, acl = TRUE;
+    BOOLEAN timestamps = TRUE, contents = TRUE;
+    RECORD record;
+
+    CaptureRingsReset();
+    Clock = 0;
+    for (i = 0; i < 512; i++) {
+        Capture(&filter, &Packets[i]);
+    }
+    CaptureDrain(TRUE);
+
+    Check("File header is btsnoop version 1, H4",
+        memcmp(File, "btsnoop\0", 8) == 0 && Get32Be(File + 8) == 1 &&
+        Get32Be(File + 12) == SNOOP_DATALINK_H4);
+
+    for (offset = SNOOP_FILE_HEADER_BYTES; offset < FileBytes; offset += size) {
+        const PACKET* packet = &Packets[records];
+        const SNOOP_ENTRY* entry = &packet->Entry;
+        const UCHAR* p;
+        ULONG headers, expectFlags;
+
+        size = ParseRecord(offset, &record);
+        if (size == 0 || records >= 512) {
+            lengths = FALSE;
+            break;
+        }
+        p = record.Packet;
+
+        ordered = ordered && record.TimestampUs > lastTimestamp && p[0] == entry->Type;
+        timestamps = timestamps && record.TimestampUs == BASE_US + records + 1;
+        lastTimestamp = record.TimestampUs;
+
+        headers = 1;
+        if (entry->Framing != SNOOP_FRAMING_HCI) {
+            headers += SNOOP_ACL_HEADER_BYTES;
+            acl = acl && (Get16(p + 1) & 0x0FFF) == DeviceHandle(entry->DeviceAddress) &&
+                (Get16(p + 1) & 0x3000) == (entry->Direction == SNOOP_RECEIVED ? 0x2000 : 0);
+            if (entry->Framing == SNOOP_FRAMING_L2CAP_PAYLOAD) {
+                headers += SNOOP_L2CAP_HEADER_BYTES;
+                acl = acl && Get16(p + 3) == entry->Length + SNOOP_L2CAP_HEADER_BYTES &&
+                    Get16(p + 5) == entry->Length && Get16(p + 7) == entry->Cid;
+            } else {
+                acl = acl && Get16(p + 3) == entry->Length && Get16(p + 7) == entry->Cid;
+            }
+        }
+        lengths = lengths && record.OriginalLength == headers + entry->Length &&
+            record.IncludedLength == headers + min(entry->Length, (ULONG)SNOOP_MAX_SNAP);
+
+        expectFlags = (entry->Direction == SNOOP_RECEIVED ? 1 : 0) |
+            (entry->Type == SNOOP_TYPE_COMMAND || entry->Type == SNOOP_TYPE_EVENT ? 2 : 0);
+        flags = flags && record.Flags == expectFlags && record.Drops == 0;
+
+        if (entry->Cid != SNOOP_CID_SMP) {
+            contents = contents && memcmp(p + headers, packet->Data,
+                record.IncludedLength - headers) == 0;
+        }
+        records++;
+    }
+
+    Check("Every packet is one record, in order", lengths && ordered && records == 512);
+    Check("Timestamps are microseconds since 1970", timestamps);
+    Check("Flags give direction and command/event", flags);
+    Check("ACL and L2CAP headers rebuilt with handles", acl);
+    Check("Packet bytes as captured", contents);
+}
+
+static VOID
+SnapAndDropChecks(void)
+{
+    SNOOP_FILTER filter = FilterAll(16);
+    PACKET packet;
+    RECORD record;
+    ULONG i, pushed = 0, offset, size;
+    BOOLEAN snapped = TRUE, dropsCarried = TRUE;
+
+    memset(&packet, 0, sizeof(packet));
+    BuildData(&packet, 1, 0x0040, SNOOP_SENT, SNOOP_FRAMING_L2CAP_PAYLOAD, 200);
+
+    CaptureRingsReset();
+    for (i = 0; i < SNOOP_RING_ENTRIES + 10; i++) {
+        pushed += SnoopRingPush(&Rings[0], filter.SnapLength, &packet.Entry,
+            packet.Data, packet.Entry.Length);
+    }
+    Check("Full ring drops and counts the packets",
+        pushed == SNOOP_RING_ENTRIES && Rings[0].Dropped == 10);
+
+    CaptureDrain(TRUE);
+    for (offset = SNOOP_FILE_HEADER_BYTES; offset < FileBytes; offset += size) {
+        size = ParseRecord(offset, &record);
+        if (size == 0) {
+            snapped = FALSE;
+            break;
+        }
+        snapped = snapped && record.IncludedLength == 9 + 16 && record.OriginalLength == 9 + 200;
+        dropsCarried = dropsCarried && record.Drops == 10;
+    }
+    Check("Snap keeps the headers and 16 bytes", snapped);
+    Check("Records carry the drops so far", dropsCarried);
+
+    // Bytes full before entries: full-size packets
+    BuildData(&packet, 1, 0x0040, SNOOP_SENT, SNOOP_FRAMING_L2CAP_PAYLOAD, 1000);
+    CaptureRingsReset();
+    for (pushed = 0, i = 0; i < 100; i++) {
+        pushed += SnoopRingPush(&Rings[0], 0, &packet.Entry, packet.Data, packet.Entry.Length);
+    }
+    Check("Full data area drops too", pushed == SNOOP_RING_BYTES / 1000 && Rings[0].Dropped != 0);
+}
+
+static VOID
+WrapChecks(void)
+{
+    static UCHAR out[SNOOP_MAX_SNAP];
+    SNOOP_ENTRY entry;
+    PACKET packet;
+    ULONG i, b, length;
+    BOOLEAN intact = TRUE, wrapped = FALSE;
+
+    memset(&packet, 0, sizeof(packet));
+    SnoopRingInitialize(&Rings[0]);
+
+    // Odd lengths, pushed and popped a few at a time, walk the data
+    // area's end through every packet position
+    for (i = 0; i < 20000; i++) {
+        length = 1 + (Random() % SNOOP_MAX_SNAP);
+        BuildData(&packet, i % DEVICES, 0x0040, SNOOP_SENT, SNOOP_FRAMING_L2CAP_PAYLOAD, length);
+        for (b = 0; b < length; b++) {
+            packet.Data[b] = (UCHAR)(i + b * 7);
+        }
+        packet.Entry.TimestampUs = i;
+        SnoopRingPush(&Rings[0], 0, &packet.Entry, packet.Data, length);
+
+        if ((Rings[0].DataTail & (SNOOP_RING_BYTES - 1)) < length) {
+            wrapped = TRUE;
+        }
+
+        if (i % 3 == 2 || Rings[0].Tail - Rings[0].Head > 40) {
+            while (SnoopRingPeek(&Rings[0]) != NULL) {
+                SnoopRingPop(&Rings[0], &entry, out);
+                for (b = 0; b < entry.Captured; b++) {
+                    intact = intact && out[b] == (UCHAR)(entry.TimestampUs + b * 7);
+                }
+            }
+        }
+    }
+
+    Check("Packets intact across the data area's end", intact && wrapped && Rings[0].Dropped == 0);
+}
+
+static ULONG
+CaptureCount(const SNOOP_FILTER* Filter)
+{
+    ULONG i, count = 0;
+
+    for (i = 0; i < PACKETS; i++) {
+        count += SnoopFilterMatch(Filter, &Packets[i].Entry);
+    }
+    return count;
+}
+
+static VOID
+FilterChecks(void)
+{
+    SNOOP_FILTER filter = FilterAll(0);
+    ULONG all, byDevice, byCid, received, events, i;
+    ULONG expectDevice = 0, expectCid = 0, expectReceived = 0, expectEvents = 0;
+
+    for (i = 0; i < PACKETS; i++) {
+        const SNOOP_ENTRY* entry = &Packets[i].Entry;
+        BOOLEAN hci = entry->Type != SNOOP_TYPE_ACL;
+
+        expectDevice += hci || entry->DeviceAddress == DeviceAddress(3);
+        expectCid += hci || entry->Cid == 0x0041;
+        expectReceived += entry->Direction == SNOOP_RECEIVED;
+        expectEvents += entry->Type == SNOOP_TYPE_EVENT;
+    }
+
+    all = CaptureCount(&filter);
+    filter.DeviceAddress = DeviceAddress(3);
+    byDevice = CaptureCount(&filter);
+    filter.DeviceAddress = 0;
+    filter.Cid = 0x0041;
+    byCid = CaptureCount(&filter);
+    filter.Cid = 0;
+    filter.Directions = SNOOP_DIRECTION_BIT(SNOOP_RECEIVED);
+    received = CaptureCount(&filter);
+    filter.Directions = SNOOP_DIRECTIONS_ALL;
+    filter.Types = SNOOP_TYPE_BIT(SNOOP_TYPE_EVENT);
+    events = CaptureCount(&filter);
+
+    Check("Filter: everything", all == PACKETS);
+    Check("Filter: one device, plus commands and events", byDevice == expectDevice);
+    Check("Filter: one channel, plus commands and events", byCid == expectCid);
+    Check("Filter: received only", received == expectReceived);
+    Check("Filter: events only", events == expectEvents);
+}
+
+static VOID
+RedactionChecks(void)
+{
+    static const UCHAR Zero[16] = { 0 };
+    SNOOP_FILTER filter = FilterAll(0);
+    PACKET packets[5];
+    RECORD record;
+    ULONG offset, size, r;
+    const UCHAR* p[5];
+
+    memset(packets, 0, sizeof(packets));
+    BuildCommand(&packets[0], 0x040B, 22);      // Link Key Request Reply
+    BuildCommand(&packets[1], 0x201A, 18);      // LE Long Term Key Request Reply
+    BuildEvent(&packets[2], 0x18, 23);          // Link Key Notification
+    BuildData(&packets[3], 2, SNOOP_CID_SMP, SNOOP_RECEIVED, SNOOP_FRAMING_L2CAP_FRAME, 17);
+    packets[3].Data[SNOOP_L2CAP_HEADER_BYTES] = 0x06;       // Encryption Information
+    BuildData(&packets[4], 2, SNOOP_CID_SMP, SNOOP_SENT, SNOOP_FRAMING_L2CAP_PAYLOAD, 17);
+    packets[4].Data[0] = 0x01;                  // Pairing Request: nothing secret
+
+    CaptureRingsReset();
+    for (r = 0; r < 5; r++) {
+        packets[r].Processor = r % PROCESSORS;
+        Capture(&filter, &packets[r]);
+    }
+    CaptureDrain(TRUE);
+
+    for (offset = SNOOP_FILE_HEADER_BYTES, r = 0; offset < FileBytes && r < 5; offset += size, r++) {
+        size = ParseRecord(offset, &record);
+        p[r] = record.Packet;
+    }
+
+    Check("Link Key Request Reply key zeroed",
+        r == 5 && memcmp(p[0] + 1 + 3 + 6, Zero, 16) == 0 && p[0][1 + 3] == 0xA0);
+    Check("LE Long Term Key Request Reply key zeroed",
+        memcmp(p[1] + 1 + 3 + 2, Zero, 16) == 0 && p[1][1 + 3] == 0xA0);
+    Check("Link Key Notification key zeroed",
+        memcmp(p[2] + 1 + 2 + 6, Zero, 16) == 0 && p[2][1 + 2 + 22] == 0xB0 + 22);
+    Check("SMP Encryption Information key zeroed",
+        memcmp(p[3] + 1 + 4 + 4 + 1, Zero, 16) == 0);
+    Check("Other SMP commands left alone",
+        memcmp(p[4] + 1 + 4 + 4, packets[4].Data, 17) == 0);
+}
+
+int
+main(void)
+{
+    BuildWorkload();
+
+    CostReport();
+    LoadReport();
+
+    printf("Checks\n");
+    FileChecks();
+    SnapAndDropChecks();
+    WrapChecks();
+    FilterChecks();
+    RedactionChecks();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
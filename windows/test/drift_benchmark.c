@@ -0,0 +1,320 @@
+/*++
+
+Module Name:
+    drift_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's multi-sink synchronization
+    (MultiDeviceBTDrift.c).
+
+    Part 1: resampler quality and CPU cost per sink on each instruction
+    set, for 48 kHz stereo at a drift-sized ratio.
+
+    Part 2: four sinks whose clocks are off by tens to hundreds of ppm.
+    They start a few milliseconds apart and send completion reports with
+    +-1 ms timestamp jitter. The run prints each sink's skew against the
+    reference, both free-running and with drift correction.
+
+    Build (MSVC):
+        cl /O2 /I..\driver drift_benchmark.c ..\driver\MultiDeviceBTDrift.c
+            ..\driver\MultiDeviceBTSimd.c
+
+    Build (Linux):
+        cc -O2 -I../driver drift_benchmark.c ../driver/MultiDeviceBTDrift.c
+            ../driver/MultiDeviceBTSimd.c -lm
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "MultiDeviceBTDrift.h"
+
+#define RATE                48000
+#define CHANNELS            2
+#define BLOCK               480         // 10 ms of source per call
+#define OUT_CAPACITY        (BLOCK * 2)
+#define BENCH_SECONDS       20
+
+#define SIM_SINKS           4
+#define SIM_SECONDS         180
+#define SIM_REPORT_US       20000       // Completion report period
+#define SIM_JITTER_US       1000        // +- on each report's timestamp
+#define SIM_SETTLE_SECONDS  20          // Skew statistics start here
+
+static const char* IsaName[] = { "scalar", "sse4.1", "avx2" };
+
+// True clock error and start offset of each simulated sink; sink 0 is the reference
+static const double SinkPpm[SIM_SINKS] = { 35.0, -60.0, 120.0, -180.0 };
+static const double SinkStartUs[SIM_SINKS] = { 0.0, 2500.0, -4000.0, 6000.0 };
+
+static RESAMPLER_FILTER Filter;
+static DRIFT_SINK Sinks[SIM_SINKS];
+static SHORT Source[BLOCK * CHANNELS];
+static SHORT Output[OUT_CAPACITY * CHANNELS];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int Seed = 2024;
+
+static double
+Uniform(void)
+{
+    Seed = Seed * 1103515245 + 12345;
+    return ((double)((Seed >> 8) & 0xFFFFFF) / 16777216.0) * 2.0 - 1.0;
+}
+
+// 1 kHz tone on the left, 5 kHz on the right, sampled at input position x
+static double
+Tone(double X, ULONG Channel)
+{
+    double f = (Channel == 0) ? 1000.0 : 5000.0;
+
+    return 12000.0 * sin(2 * 3.14159265358979 * f * X / RATE);
+}
+
+static void
+MakeBlock(ULONG64 First)
+{
+    ULONG n, c;
+
+    for (n = 0; n < BLOCK; n++) {
+        for (c = 0; c < CHANNELS; c++) {
+            Source[n * CHANNELS + c] = (SHORT)floor(Tone((double)(First + n), c) + 0.5);
+        }
+    }
+}
+
+/*++
+Routine Description:
+    Resamples a two-tone signal and compares every output against the
+    tone evaluated at the output's exact input position. Returns SNR in dB.
+--*/
+static double
+MeasureSnr(SIMD_ISA Isa, double Ratio, SHORT* Capture, ULONG CaptureFrames)
+{
+    RESAMPLER* r = &Sinks[0].Resampler;
+    double signal = 0.0, noise = 0.0;
+    ULONG64 input = 0, output = 0;
+    ULONG accepted, produced, n, c, captured = 0;
+
+    ResamplerInitialize(r, &Filter, CHANNELS, Isa);
+    ResamplerSetRatio(r, Ratio);
+
+    while (input < 5 * RATE) {
+        MakeBlock(input);
+        produced = ResamplerProcess(r, Source, BLOCK, Output, OUT_CAPACITY, &accepted);
+        input += accepted;
+
+        for (n = 0; n < produced; n++, output++) {
+            double x = (double)output * ((double)r->Step / 4294967296.0);
+
+            if (captured < CaptureFrames) {
+                memcpy(&Capture[captured * CHANNELS], &Output[n * CHANNELS], CHANNELS * sizeof(SHORT));
+                captured++;
+            }
+
+            // Skip the start, where the window still reaches into the leading silence
+            if (output < RESAMPLER_TAPS) {
+                continue;
+            }
+
+            for (c = 0; c < CHANNELS; c++) {
+                double ref = Tone(x, c);
+                double err = Output[n * CHANNELS + c] - ref;
+
+                signal += ref * ref;
+                noise += err * err;
+            }
+        }
+    }
+
+    return 10.0 * log10(signal / (noise + 1e-9));
+}
+
+static void
+BenchmarkResampler(SIMD_ISA Best)
+{
+    static SHORT capture[3][4096 * CHANNELS];
+    const double ratio = 1.0 + 183e-6;
+    SIMD_ISA isa;
+    ULONG i;
+
+    printf("Resampler: %u taps, %u phases, 48 kHz stereo, ratio 1 + 183 ppm\n\n",
+        RESAMPLER_TAPS, RESAMPLER_PHASES);
+    printf("  %-8s %8s %12s %14s %10s\n", "isa", "SNR dB", "ns/frame", "% core/sink", "max diff");
+
+    for (isa = SimdIsaScalar; isa <= Best; isa++) {
+        RESAMPLER* r = &Sinks[0].Resampler;
+        double snr = MeasureSnr(isa, ratio, capture[isa], 4096);
+        double start, elapsed;
+        ULONG64 frames = 0;
+        ULONG accepted, maxDiff = 0;
+
+        for (i = 0; i < 4096 * CHANNELS; i++) {
+            ULONG d = (ULONG)abs(capture[isa][i] - capture[SimdIsaScalar][i]);
+
+            maxDiff = (d > maxDiff) ? d : maxDiff;
+        }
+
+        MakeBlock(0);
+        ResamplerInitialize(r, &Filter, CHANNELS, isa);
+        ResamplerSetRatio(r, ratio);
+
+        start = Seconds();
+        for (i = 0; i < BENCH_SECONDS * RATE / BLOCK; i++) {
+            frames += ResamplerProcess(r, Source, BLOCK, Output, OUT_CAPACITY, &accepted);
+        }
+        elapsed = Seconds() - start;
+
+        printf("  %-8s %8.1f %12.1f %13.3f%% %10lu\n", IsaName[isa], snr,
+            elapsed * 1e9 / (double)frames, 100.0 * elapsed / BENCH_SECONDS, (unsigned long)maxDiff);
+    }
+    printf("\n");
+}
+
+/*++
+Routine Description:
+    Runs the four-sink simulation and returns the worst absolute skew,
+    in microseconds, after the settling time.
+
+    Each 10 ms tick, every sink resamples one block of source and queues
+    the result. Each sink plays its queue at its own clock rate. The true
+    skew is where the sink's playing sample came from in the source,
+    compared with the reference sink's.
+--*/
+static double
+Simulate(SIMD_ISA Isa, BOOLEAN Correct)
+{
+    PDRIFT_SINK group[SIM_SINKS];
+    LONGLONG nextReportUs = 0;
+    double worst = 0.0, sumSquares = 0.0;
+    ULONG samples = 0;
+    ULONG64 tick;
+    ULONG i;
+
+    memset(Source, 0, sizeof(Source));
+    Seed = 7;
+
+    for (i = 0; i < SIM_SINKS; i++) {
+        DriftSinkInitialize(&Sinks[i], &Filter, RATE, CHANNELS, Isa);
+        Sinks[i].Reference = (i == 0);
+        group[i] = &Sinks[i];
+    }
+
+    printf("  %-6s", "t (s)");
+    for (i = 1; i < SIM_SINKS; i++) {
+        printf("  sink%lu skew ms", (unsigned long)i);
+    }
+    printf("\n");
+
+    for (tick = 0; tick < (ULONG64)SIM_SECONDS * 100; tick++) {
+        LONGLONG nowUs = (LONGLONG)tick * 10000;
+        double played[SIM_SINKS];
+        double position[SIM_SINKS];
+        ULONG accepted;
+
+        for (i = 0; i < SIM_SINKS; i++) {
+            ResamplerProcess(&Sinks[i].Resampler, Source, BLOCK, Output, OUT_CAPACITY, &accepted);
+        }
+
+        // Sinks start after a 100 ms prefill, each with its own offset
+        for (i = 0; i < SIM_SINKS; i++) {
+            double elapsed = (double)nowUs - 100000.0 - SinkStartUs[i];
+
+            played[i] = (elapsed > 0) ? elapsed * RATE * (1.0 + SinkPpm[i] * 1e-6) / 1e6 : 0.0;
+            position[i] = ResamplerInputPosition(&Sinks[i].Resampler, (ULONG64)played[i]);
+        }
+
+        if (Correct && nowUs >= nextReportUs) {
+            for (i = 0; i < SIM_SINKS; i++) {
+                if (played[i] > 0) {
+                    DriftAddObservation(&Sinks[i].Estimator,
+                        nowUs + (LONGLONG)(Uniform() * SIM_JITTER_US), (ULONG64)played[i]);
+                }
+            }
+            DriftUpdateRatios(group, SIM_SINKS, nowUs);
+        }
+        if (nowUs >= nextReportUs) {
+            nextReportUs += SIM_REPORT_US;
+        }
+
+        if (tick % 1000 == 0) {
+            printf("  %-6lu", (unsigned long)(tick / 100));
+            for (i = 1; i < SIM_SINKS; i++) {
+                printf("  %13.3f", (position[i] - position[0]) * 1000.0 / RATE);
+            }
+            printf("\n");
+        }
+
+        if (tick >= (ULONG64)SIM_SETTLE_SECONDS * 100) {
+            for (i = 1; i < SIM_SINKS; i++) {
+                double skewUs = (position[i] - position[0]) * 1e6 / RATE;
+
+                worst = (fabs(skewUs) > worst) ? fabs(skewUs) : worst;
+                sumSquares += skewUs * skewUs;
+                samples++;
+            }
+        }
+    }
+
+    if (Correct) {
+        printf("  %-6s", "ppm");
+        for (i = 1; i < SIM_SINKS; i++) {
+            printf("  %6.1f/%6.1f", Sinks[i].DriftPpm, SinkPpm[i]);
+        }
+        printf("   (estimated/true)\n");
+    }
+
+    printf("  after %u s: worst skew %.3f ms, rms %.3f ms\n\n",
+        SIM_SETTLE_SECONDS, worst / 1000.0, sqrt(sumSquares / samples) / 1000.0);
+
+    return worst;
+}
+
+int
+main(void)
+{
+    SIMD_ISA best = SimdDetectIsa();
+    double worst;
+
+    ResamplerBuildFilter(&Filter);
+
+    printf("Best instruction set: %s\n\n", IsaName[best]);
+    BenchmarkResampler(best);
+
+    printf("Free-running sinks (no correction):\n");
+    Simulate(best, FALSE);
+
+    printf("Drift-corrected sinks (regression window %u x %u ms, report jitter +-%u us):\n",
+        DRIFT_WINDOW, DRIFT_MIN_SPACING_US / 1000, SIM_JITTER_US);
+    worst = Simulate(best, TRUE);
+
+    printf("%s: sinks %s within 1 ms\n", (worst < 1000.0) ? "PASS" : "FAIL",
+        (worst < 1000.0) ? "held" : "not held");
+
+    return (worst < 1000.0) ? 0 : 1;
+}
@@ -0,0 +1,494 @@
+/*++
+
+Module Name:
+    ertm_benchmark.c
+
+Abstract:
+    User-mode goodput benchmark for the driver's L2CAP Enhanced
+    Retransmission Mode (MultiDeviceBTErtm.c) on a simulated lossy link.
+
+    The link is full duplex: LINK_BPS each way plus a fixed one-way
+    delay. Frames in both directions are corrupted by either an
+    independent (Bernoulli) error pattern or a Gilbert-Elliott burst
+    pattern with the same average frame error rate. A corrupted frame
+    arrives with one bit flipped, and the receiver's FCS check drops it.
+
+    The baseline is the old path. The application keeps BASE_REQUESTS
+    4 KB writes in flight over a basic-mode channel, and the peer
+    answers each complete request. A request missing any frame, or
+    whose answer is lost, is written again in full after a fixed
+    BASE_TIMEOUT_US. ERTM sends the same SDUs with selective reject and
+    an adaptive RTO. The run checks that every SDU arrives intact and
+    in order, then reports goodput for each error rate.
+
+    Build (MSVC):
+        cl /O2 /I..\driver ertm_benchmark.c ..\driver\MultiDeviceBTErtm.c
+
+    Build (Linux):
+        cc -O2 -I../driver ertm_benchmark.c ../driver/MultiDeviceBTErtm.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTErtm.h"
+
+#define LINK_BPS            1400000     // ADAPTER_LINK_CAPACITY_BPS
+#define ONE_WAY_US          5000
+#define FILE_BYTES          (1024 * 1024)
+#define SDU_BYTES           4096
+#define SDUS                (FILE_BYTES / SDU_BYTES)
+#define MPS                 1010
+#define TX_WINDOW           24          // ~24 KB in flight, as BASE_REQUESTS x 4 KB below
+#define BURST_FRAMES        8           // Mean length of a Gilbert-Elliott bad state
+#define BAD_STATE_LOSS      0.5
+#define WIRE_DEPTH          256
+#define SIM_LIMIT_US        (600ULL * 1000000)
+
+#define BASE_REQUESTS       6
+#define BASE_TIMEOUT_US     250000
+#define BASE_HEADER         4           // Basic L2CAP header
+#define BASE_RESPONSE       16
+
+typedef enum { PatternBernoulli, PatternBurst } PATTERN;
+
+typedef struct _ERROR_MODEL {
+    PATTERN Pattern;
+    double Rate;
+    double GoodToBad;
+    double BadToGood;
+    BOOLEAN Bad;
+    ULONG64 Seed;
+} ERROR_MODEL;
+
+typedef struct _WIRE_FRAME {
+    ULONG64 ArrivalUs;
+    ULONG Length;
+    ULONG Tag;                  // Baseline: request, and frame index in the high word
+    BOOLEAN Damaged;
+    UCHAR Data[ERTM_FRAME_MAX];
+} WIRE_FRAME;
+
+// One direction of the link
+typedef struct _WIRE {
+    ULONG64 BusyUntilUs;
+    ULONG Head;
+    ULONG Count;
+    ULONG64 Frames;
+    WIRE_FRAME Frames_[WIRE_DEPTH];
+    ERROR_MODEL Errors;
+} WIRE;
+
+typedef struct _RESULT {
+    double Seconds;
+    double Kbps;
+    ULONG64 Frames;
+    ERTM_STATS Stats;
+    BOOLEAN Intact;
+} RESULT;
+
+static UCHAR File[FILE_BYTES];
+static WIRE Wires[2];
+static ERTM_CHANNEL Endpoints[2];
+
+static double
+Random(ULONG64* Seed)
+{
+    ULONG64 x = *Seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *Seed = x;
+    return (double)(x >> 11) / 9007199254740992.0;
+}
+
+static void
+ErrorModelInit(ERROR_MODEL* Model, PATTERN Pattern, double Rate, ULONG64 Seed)
+{
+    double bad;
+
+    memset(Model, 0, sizeof(*Model));
+    Model->Pattern = Pattern;
+    Model->Rate = Rate;
+    Model->Seed = Seed;
+
+    // Stationary bad-state share that gives the same average error rate
+    bad = Rate / BAD_STATE_LOSS;
+    Model->BadToGood = 1.0 / BURST_FRAMES;
+    Model->GoodToBad = bad < 1.0 ? bad * Model->BadToGood / (1.0 - bad) : 1.0;
+}
+
+static BOOLEAN
+ErrorModelCorrupts(ERROR_MODEL* Model)
+{
+    if (Model->Pattern == PatternBernoulli) {
+        return Random(&Model->Seed) < Model->Rate;
+    }
+
+    if (Model->Bad) {
+        Model->Bad = Random(&Model->Seed) >= Model->BadToGood;
+    } else {
+        Model->Bad = Random(&Model->Seed) < Model->GoodToBad;
+    }
+    return Model->Bad && Random(&Model->Seed) < BAD_STATE_LOSS;
+}
+
+static void
+WireReset(PATTERN Pattern, double Rate, ULONG64 Seed)
+{
+    int i;
+
+    memset(Wires, 0, sizeof(Wires));
+    for (i = 0; i < 2; i++) {
+        ErrorModelInit(&Wires[i].Errors, Pattern, Rate, Seed + 7919 * i);
+    }
+}
+
+static ULONG64
+AirtimeUs(ULONG Bytes)
+{
+    return (ULONG64)Bytes * 8 * 1000000 / LINK_BPS;
+}
+
+static WIRE_FRAME*
+WireSend(WIRE* Wire, ULONG64 NowUs, ULONG Length, ULONG Tag)
+{
+    WIRE_FRAME* frame = &Wire->Frames_[(Wire->Head + Wire->Count) % WIRE_DEPTH];
+
+    Wire->BusyUntilUs = NowUs + AirtimeUs(Length);
+    frame->ArrivalUs = Wire->BusyUntilUs + ONE_WAY_US;
+    frame->Length = Length;
+    frame->Tag = Tag;
+    Wire->Count++;
+    Wire->Frames++;
+    return frame;
+}
+
+// Flips one bit of a frame the error pattern hits; the FCS has to catch it
+static void
+WireDamage(WIRE* Wire, WIRE_FRAME* Frame)
+{
+    Frame->Damaged = ErrorModelCorrupts(&Wire->Errors);
+    if (Frame->Damaged) {
+        ULONG bit = (ULONG)(Random(&Wire->Errors.Seed) * Frame->Length * 8);
+        Frame->Data[bit / 8] ^= (UCHAR)(1 << (bit % 8));
+    }
+}
+
+static WIRE_FRAME*
+WireArrived(WIRE* Wire, ULONG64 NowUs)
+{
+    WIRE_FRAME* frame;
+
+    if (Wire->Count == 0 || Wire->Frames_[Wire->Head].ArrivalUs > NowUs) {
+        return NULL;
+    }
+    frame = &Wire->Frames_[Wire->Head];
+    Wire->Head = (Wire->Head + 1) % WIRE_DEPTH;
+    Wire->Count--;
+    return frame;
+}
+
+static ULONG64
+Min64(ULONG64 a, ULONG64 b)
+{
+    return a < b ? a : b;
+}
+
+/*++
+Routine Description:
+    ERTM run. Endpoint 0 sends the file; endpoint 1 receives it and only
+    sends supervisory frames back.
+--*/
+
+static ULONG ReceivedSdus;
+static BOOLEAN ReceivedIntact;
+static ULONG AckedSdus;
+static ULONG64 DoneUs;
+static ULONG64 NowGlobalUs;
+
+static VOID
+OnReceived(PVOID Context, const UCHAR* Data, ULONG Length)
+{
+    (void)Context;
+
+    if (ReceivedSdus >= SDUS || Length != SDU_BYTES ||
+        memcmp(Data, File + (size_t)ReceivedSdus * SDU_BYTES, SDU_BYTES) != 0) {
+        ReceivedIntact = FALSE;
+    }
+    if (++ReceivedSdus == SDUS) {
+        DoneUs = NowGlobalUs;
+    }
+}
+
+static VOID
+OnAcked(PVOID Context, PVOID Cookie)
+{
+    (void)Context;
+    (void)Cookie;
+
+    AckedSdus++;
+}
+
+static RESULT
+RunErtm(PATTERN Pattern, double Rate, ULONG64 Seed)
+{
+    ERTM_CONFIG config;
+    RESULT result;
+    ULONG queued = 0;
+    ULONG64 now = 0;
+    int side;
+
+    memset(&config, 0, sizeof(config));
+    config.RemoteCid = 0x0040;
+    config.Mps = MPS;
+    config.TxWindow = TX_WINDOW;
+
+    ErtmInitialize(&Endpoints[0], &config, OnAcked, NULL, NULL);
+    ErtmInitialize(&Endpoints[1], &config, NULL, OnReceived, NULL);
+    WireReset(Pattern, Rate, Seed);
+    ReceivedSdus = 0;
+    AckedSdus = 0;
+    ReceivedIntact = TRUE;
+    DoneUs = 0;
+
+    while (DoneUs == 0 && now < SIM_LIMIT_US) {
+        ULONG64 next = ERTM_NO_DEADLINE;
+
+        NowGlobalUs = now;
+        while (queued < SDUS && Endpoints[0].QueueCount < ERTM_SDU_QUEUE) {
+            ErtmQueueSdu(&Endpoints[0], File + (size_t)queued * SDU_BYTES, SDU_BYTES, NULL);
+            queued++;
+        }
+
+        for (side = 0; side < 2; side++) {
+            WIRE_FRAME* frame;
+
+            while ((frame = WireArrived(&Wires[side], now)) != NULL) {
+                ErtmReceiveFrame(&Endpoints[1 - side], now, frame->Data, frame->Length);
+            }
+        }
+
+        for (side = 0; side < 2; side++) {
+            WIRE* wire = &Wires[side];
+
+            if (wire->BusyUntilUs <= now && wire->Count < WIRE_DEPTH &&
+                ErtmHasWork(&Endpoints[side], now)) {
+                WIRE_FRAME* frame = WireSend(wire, now, 0, 0);
+                frame->Length = ErtmBuildFrame(&Endpoints[side], now, frame->Data, sizeof(frame->Data));
+                if (frame->Length == 0) {
+                    wire->Count--;
+                    wire->BusyUntilUs = now;
+                    continue;
+                }
+                wire->BusyUntilUs = now + AirtimeUs(frame->Length);
+                frame->ArrivalUs = wire->BusyUntilUs + ONE_WAY_US;
+                WireDamage(wire, frame);
+            }
+
+            if (wire->Count > 0) {
+                next = Min64(next, wire->Frames_[wire->Head].ArrivalUs);
+            }
+            if (wire->BusyUntilUs > now) {
+                next = Min64(next, wire->BusyUntilUs);
+            } else if (ErtmHasWork(&Endpoints[side], now)) {
+                next = now;
+            } else {
+                next = Min64(next, ErtmNextDeadline(&Endpoints[side]));
+            }
+        }
+
+        if (Endpoints[0].Failed || next == ERTM_NO_DEADLINE) {
+            break;
+        }
+        now = next > now ? next : now;
+    }
+
+    memset(&result, 0, sizeof(result));
+    result.Intact = ReceivedIntact && ReceivedSdus == SDUS;
+    result.Seconds = (DoneUs ? DoneUs : now) / 1e6;
+    result.Kbps = (double)ReceivedSdus * SDU_BYTES * 8 / result.Seconds / 1000;
+    result.Frames = Wires[0].Frames + Wires[1].Frames;
+    result.Stats = Endpoints[0].Stats;
+    result.Stats.SrejSent = Endpoints[1].Stats.SrejSent;
+    result.Stats.FcsErrors = Endpoints[0].Stats.FcsErrors + Endpoints[1].Stats.FcsErrors;
+    return result;
+}
+
+/*++
+Routine Description:
+    Baseline run. Each 4 KB write is cut into basic-mode frames of up to
+    MPS bytes. The peer answers once it has every frame of one attempt;
+    the sender writes the whole request again BASE_TIMEOUT_US after the
+    attempt went out if no answer came.
+--*/
+static RESULT
+RunBaseline(PATTERN Pattern, double Rate, ULONG64 Seed)
+{
+    static ULONG64 sentUs[SDUS];
+    static BOOLEAN answered[SDUS];
+    static BOOLEAN delivered[SDUS];
+    static ULONG answers[SDUS];
+    ULONG framesPerRequest = (SDU_BYTES + MPS - 1) / MPS;
+    ULONG active[BASE_REQUESTS];
+    ULONG activeCount = 0, nextRequest = 0, done = 0, deliveredCount = 0;
+    ULONG current = MAXULONG, currentFrame = 0;
+    ULONG receiving = MAXULONG, receivedFrames = 0;
+    BOOLEAN receivedDamaged = FALSE;
+    ULONG answerHead = 0, answerCount = 0;
+    ULONG64 now = 0, finishedUs = 0;
+    RESULT result;
+    ULONG i;
+
+    memset(sentUs, 0, sizeof(sentUs));
+    memset(answered, 0, sizeof(answered));
+    memset(delivered, 0, sizeof(delivered));
+    WireReset(Pattern, Rate, Seed);
+
+    while (done < SDUS && now < SIM_LIMIT_US) {
+        ULONG64 next = SIM_LIMIT_US;
+        WIRE_FRAME* frame;
+
+        // Peer: an attempt counts only if all of its frames arrived clean
+        while ((frame = WireArrived(&Wires[0], now)) != NULL) {
+            ULONG request = frame->Tag & 0xFFFF;
+
+            if ((frame->Tag >> 16) == 0) {
+                receiving = request;
+                receivedFrames = 0;
+                receivedDamaged = FALSE;
+            }
+            if (request != receiving) {
+                continue;
+            }
+            receivedDamaged |= frame->Damaged;
+            if (++receivedFrames == framesPerRequest && !receivedDamaged) {
+                if (!delivered[request]) {
+                    delivered[request] = TRUE;
+                    deliveredCount++;
+                }
+                answers[(answerHead + answerCount++) % SDUS] = request;
+            }
+        }
+
+        while ((frame = WireArrived(&Wires[1], now)) != NULL) {
+            if (!frame->Damaged && !answered[frame->Tag]) {
+                answered[frame->Tag] = TRUE;
+                if (++done == SDUS) {
+                    finishedUs = now;
+                }
+                for (i = 0; i < activeCount; i++) {
+                    if (active[i] == frame->Tag) {
+                        active[i] = active[--activeCount];
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Application: keep BASE_REQUESTS writes outstanding
+        while (activeCount < BASE_REQUESTS && nextRequest < SDUS) {
+            active[activeCount++] = nextRequest++;
+        }
+
+        if (Wires[0].BusyUntilUs <= now) {
+            if (current == MAXULONG) {
+                for (i = 0; i < activeCount; i++) {
+                    if (sentUs[active[i]] == 0 || sentUs[active[i]] + BASE_TIMEOUT_US <= now) {
+                        current = active[i];
+                        currentFrame = 0;
+                        break;
+                    }
+                }
+            }
+            if (current != MAXULONG) {
+                ULONG payload = currentFrame + 1 < framesPerRequest ? MPS : SDU_BYTES - currentFrame * MPS;
+
+                frame = WireSend(&Wires[0], now, BASE_HEADER + payload, current | (currentFrame << 16));
+                frame->Damaged = ErrorModelCorrupts(&Wires[0].Errors);
+                if (++currentFrame == framesPerRequest) {
+                    sentUs[current] = Wires[0].BusyUntilUs;
+                    current = MAXULONG;
+                }
+            }
+        }
+
+        if (Wires[1].BusyUntilUs <= now && answerCount > 0) {
+            frame = WireSend(&Wires[1], now, BASE_RESPONSE, answers[answerHead]);
+            frame->Damaged = ErrorModelCorrupts(&Wires[1].Errors);
+            answerHead = (answerHead + 1) % SDUS;
+            answerCount--;
+        }
+
+        for (i = 0; i < 2; i++) {
+            if (Wires[i].Count > 0) {
+                next = Min64(next, Wires[i].Frames_[Wires[i].Head].ArrivalUs);
+            }
+            if (Wires[i].BusyUntilUs > now) {
+                next = Min64(next, Wires[i].BusyUntilUs);
+            }
+        }
+        for (i = 0; i < activeCount; i++) {
+            if (sentUs[active[i]] != 0) {
+                next = Min64(next, sentUs[active[i]] + BASE_TIMEOUT_US);
+            }
+        }
+        now = next > now ? next : now + 1;
+    }
+
+    memset(&result, 0, sizeof(result));
+    result.Intact = deliveredCount == SDUS;
+    result.Seconds = (finishedUs ? finishedUs : now) / 1e6;
+    result.Kbps = (double)done * SDU_BYTES * 8 / result.Seconds / 1000;
+    result.Frames = Wires[0].Frames + Wires[1].Frames;
+    return result;
+}
+
+int
+main(void)
+{
+    static const double rates[] = { 0.0, 0.005, 0.01, 0.02, 0.05, 0.10, 0.20 };
+    static const char* names[] = { "bernoulli", "burst" };
+    BOOLEAN allIntact = TRUE;
+    ULONG i;
+    int p;
+
+    for (i = 0; i < FILE_BYTES; i++) {
+        File[i] = (UCHAR)(i * 2654435761u >> 24);
+    }
+
+    printf("ERTM: %u KB in %u-byte SDUs, %u kbps each way, %u ms one way, MPS %u, window %u\n",
+           FILE_BYTES / 1024, SDU_BYTES, LINK_BPS / 1000, ONE_WAY_US / 1000, MPS, TX_WINDOW);
+    printf("Baseline: %u x 4 KB writes in flight, whole request resent after %u ms\n",
+           BASE_REQUESTS, BASE_TIMEOUT_US / 1000);
+    printf("Burst: Gilbert-Elliott, %u-frame mean bad state losing %.0f%% of frames\n\n",
+           BURST_FRAMES, BAD_STATE_LOSS * 100);
+    printf("  %-9s %6s %13s %10s %7s %7s %6s %8s %7s %7s\n", "pattern", "loss", "baseline kbps",
+           "ertm kbps", "gain", "retx", "srej", "timeouts", "srtt ms", "rto ms");
+
+    for (p = 0; p < 2; p++) {
+        for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+            RESULT base = RunBaseline((PATTERN)p, rates[i], 90 + i);
+            RESULT ertm = RunErtm((PATTERN)p, rates[i], 90 + i);
+
+            allIntact = allIntact && ertm.Intact && base.Intact;
+            printf("  %-9s %5.1f%% %13.0f %10.0f %6.2fx %7lu %6lu %8lu %7.1f %7.1f%s\n",
+                   names[p], rates[i] * 100, base.Kbps, ertm.Kbps, ertm.Kbps / base.Kbps,
+                   (unsigned long)ertm.Stats.Retransmissions, (unsigned long)ertm.Stats.SrejSent,
+                   (unsigned long)ertm.Stats.Timeouts, ertm.Stats.SrttUs / 1000.0,
+                   ertm.Stats.RtoUs / 1000.0, ertm.Intact ? "" : "  CORRUPT");
+        }
+        printf("\n");
+    }
+
+    printf("Delivery: %s\n", allIntact ? "every SDU intact and in order" : "FAILED");
+    return allIntact ? 0 : 1;
+}
@@ -0,0 +1,674 @@
+/*++
+
+Module Name:
+    hci_command_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's HCI command scheduler
+    (MultiDeviceBTCmdQueue.c). A model controller takes commands over a
+    transport that needs 150 us to send one, runs them one at a time,
+    and holds up to its command credit count. Its events reach the host
+    on 1 ms polls, as over a USB interrupt endpoint. The workload
+    reconfigures 50 connected devices: 5 audio sinks (CRITICAL), 15 HID
+    devices (HIGH) and 30 sensors (MEDIUM, LOW). Each device gets a
+    connection update, a PHY change, a data length change and an
+    accept-list add. 5 ms later the policy refines every connection
+    update and takes 10 sensors back off the accept list.
+
+    Three hosts run it:
+    - "serial" sends one command at a time and waits for its event.
+    - "pipelined" sends in submission order while credits last.
+    - "scheduler" is the driver's: priorities, credits and merging.
+
+    For controllers with 1, 2, 4 and 8 credits, it reports the commands
+    sent, when the last CRITICAL command and the last command of all
+    were acknowledged, and whether the controller ended up in the same
+    state as under the serial host. Further checks cover aging, the
+    lost-command timeout and same-handle ordering. Host CPU per command
+    is measured last.
+
+    Build (MSVC):
+        cl /O2 /I..\driver hci_command_benchmark.c ..\driver\MultiDeviceBTCmdQueue.c
+
+    Build (Linux):
+        cc -O2 -I../driver hci_command_benchmark.c ../driver/MultiDeviceBTCmdQueue.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTCmdQueue.h"
+
+#define DEVICES             50
+#define CRITICAL_DEVICES    5
+#define HIGH_DEVICES        15
+#define REMOVED_SENSORS     10
+#define QUEUE_DEPTH         256         // HCI_COMMAND_QUEUE_DEPTH
+#define POLL_US             1000        // USB interrupt endpoint interval
+#define SEND_US             150         // Host to controller, per command
+#define REFINE_AT_US        5000
+#define MAX_COMMANDS        512
+#define HANDLE_BASE         0x40
+#define CPU_ROUNDS          2000
+
+typedef enum _HOST_MODE {
+    HostSerial,
+    HostPipelined,
+    HostScheduler
+} HOST_MODE;
+
+static const char* ModeName[] = { "serial", "pipelined", "scheduler" };
+
+typedef struct _SUBMISSION {
+    ULONG64 AtUs;
+    USHORT Opcode;
+    UCHAR Priority;
+    UCHAR Length;
+    UCHAR Parameters[16];
+} SUBMISSION;
+
+// Model controller
+typedef struct _CTRL_COMMAND {
+    ULONG64 ArriveUs;
+    USHORT Opcode;
+    UCHAR Priority;
+    UCHAR Length;
+    UCHAR Parameters[CMDQ_MAX_PARAMETERS];
+} CTRL_COMMAND;
+
+typedef struct _CTRL_EVENT {
+    ULONG64 ReadyUs;
+    USHORT Opcode;
+    UCHAR Priority;
+    UCHAR Credits;
+    BOOLEAN Lost;               // Never delivered
+} CTRL_EVENT;
+
+typedef struct _CONTROLLER {
+    ULONG Credits;              // Command buffers
+    ULONG64 FreeUs;             // When the current command finishes
+    CTRL_COMMAND Fifo[MAX_COMMANDS];
+    ULONG Head, Tail;           // Arrived commands: [Head, Tail)
+    CTRL_EVENT Events[MAX_COMMANDS + 1];
+    ULONG EventHead, EventTail;
+    ULONG Overflows;
+    ULONG SameHandleOverlap;    // Two updates for one handle buffered at once
+    ULONG LoseCommand;          // 1-based index of a command to swallow, 0 for none
+    ULONG Processed;
+    // Resulting configuration
+    UCHAR ConnParams[DEVICES][12];
+    UCHAR Phy[DEVICES][5];
+    UCHAR DataLength[DEVICES][4];
+    BOOLEAN AcceptList[DEVICES];
+} CONTROLLER;
+
+typedef struct _RUN_RESULT {
+    ULONG Sent;
+    ULONG64 CriticalDoneUs;
+    ULONG64 AllDoneUs;
+    ULONG Overflows;
+    ULONG SameHandleOverlap;
+    ULONG MaxInFlight;
+    ULONG TimedOut;
+} RUN_RESULT;
+
+static SUBMISSION Workload[MAX_COMMANDS];
+static ULONG WorkloadCount;
+static CMDQ_ENTRY Entries[QUEUE_DEPTH];
+static CONTROLLER Controller;
+static CONTROLLER Reference;
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+//
+// Workload
+//
+
+static UCHAR
+DevicePriority(ULONG Device)
+{
+    if (Device < CRITICAL_DEVICES) {
+        return 0;
+    }
+    if (Device < CRITICAL_DEVICES + HIGH_DEVICES) {
+        return 1;
+    }
+    return (UCHAR)(2 + (Device & 1));
+}
+
+static ULONG
+DeviceFromHandle(USHORT Handle)
+{
+    return (ULONG)(Handle - HANDLE_BASE);
+}
+
+static VOID
+Submit(ULONG64 AtUs, USHORT Opcode, UCHAR Priority, const UCHAR* Parameters, UCHAR Length)
+{
+    SUBMISSION* s = &Workload[WorkloadCount++];
+
+    s->AtUs = AtUs;
+    s->Opcode = Opcode;
+    s->Priority = Priority;
+    s->Length = Length;
+    memcpy(s->Parameters, Parameters, Length);
+}
+
+static VOID
+PutHandle(UCHAR* p, ULONG Device)
+{
+    p[0] = (UCHAR)(HANDLE_BASE + Device);
+    p[1] = 0;
+}
+
+static VOID
+SubmitConnectionUpdate(ULONG64 AtUs, ULONG Device, USHORT Interval)
+{
+    UCHAR p[14];
+
+    PutHandle(p, Device);
+    p[2] = (UCHAR)Interval; p[3] = (UCHAR)(Interval >> 8);      // Minimum
+    p[4] = (UCHAR)Interval; p[5] = (UCHAR)(Interval >> 8);      // Maximum
+    p[6] = (Device < CRITICAL_DEVICES) ? 0 : 4; p[7] = 0;       // Latency
+    p[8] = 0x90; p[9] = 0x01;                                   // 4 s timeout
+    p[10] = 0; p[11] = 0; p[12] = 0; p[13] = 0;
+    Submit(AtUs, HCI_OP_LE_CONNECTION_UPDATE, DevicePriority(Device), p, sizeof(p));
+}
+
+static VOID
+SubmitAcceptList(ULONG64 AtUs, USHORT Opcode, ULONG Device)
+{
+    UCHAR p[7];
+    ULONG i;
+
+    p[0] = 0x00;
+    for (i = 0; i < 6; i++) {
+        p[1 + i] = (UCHAR)((0x00A0C9000000ULL + Device) >> (8 * i));
+    }
+    Submit(AtUs, Opcode, DevicePriority(Device), p, sizeof(p));
+}
+
+static VOID
+BuildWorkload(VOID)
+{
+    UCHAR p[7];
+    ULONG d;
+
+    WorkloadCount = 0;
+
+    for (d = 0; d < DEVICES; d++) {
+        SubmitConnectionUpdate(0, d, (USHORT)(d < CRITICAL_DEVICES ? 8 : 24 + d));
+
+        PutHandle(p, d);
+        p[2] = 0; p[3] = 0x02; p[4] = 0x02; p[5] = 0; p[6] = 0;  // 2M both ways
+        Submit(0, HCI_OP_LE_SET_PHY, DevicePriority(d), p, 7);
+
+        PutHandle(p, d);
+        p[2] = 251; p[3] = 0; p[4] = 0x48; p[5] = 0x08;         // 251 octets, 2120 us
+        Submit(0, HCI_OP_LE_SET_DATA_LENGTH, DevicePriority(d), p, 6);
+
+        SubmitAcceptList(0, HCI_OP_LE_ADD_ACCEPT_LIST, d);
+    }
+
+    // The policy's second pass
+    for (d = 0; d < DEVICES; d++) {
+        SubmitConnectionUpdate(REFINE_AT_US, d, (USHORT)(d < CRITICAL_DEVICES ? 6 : 40 + d));
+    }
+    for (d = DEVICES - REMOVED_SENSORS; d < DEVICES; d++) {
+        SubmitAcceptList(REFINE_AT_US, HCI_OP_LE_REMOVE_ACCEPT_LIST, d);
+    }
+}
+
+//
+// Model controller
+//
+
+static ULONG
+CommandUs(USHORT Opcode)
+{
+    switch (Opcode) {
+    case HCI_OP_LE_CONNECTION_UPDATE:
+    case HCI_OP_LE_SET_PHY:
+        return 300;             // Command Status once the procedure is queued
+    case HCI_OP_LE_SET_DATA_LENGTH:
+        return 200;
+    default:
+        return 150;
+    }
+}
+
+static VOID
+ControllerReset(CONTROLLER* C, ULONG Credits)
+{
+    memset(C, 0, sizeof(*C));
+    C->Credits = Credits;
+
+    // Command Complete for the NOP opcode announces the credits after reset
+    C->Events[C->EventTail].ReadyUs = 0;
+    C->Events[C->EventTail].Opcode = 0;
+    C->Events[C->EventTail].Credits = (UCHAR)Credits;
+    C->EventTail++;
+}
+
+static VOID
+ControllerArrive(CONTROLLER* C, ULONG64 ArriveUs, const UCHAR* Packet, UCHAR Priority)
+{
+    CTRL_COMMAND* command = &C->Fifo[C->Tail];
+    ULONG i;
+
+    command->ArriveUs = ArriveUs;
+    command->Opcode = (USHORT)(Packet[0] | (Packet[1] << 8));
+    command->Priority = Priority;
+    command->Length = Packet[2];
+    memcpy(command->Parameters, &Packet[CMDQ_HEADER_BYTES], command->Length);
+
+    // Buffered: arrived and not finished. Checked when the command runs.
+    for (i = C->Head; i < C->Tail; i++) {
+        if (C->Fifo[i].Opcode == HCI_OP_LE_CONNECTION_UPDATE &&
+            command->Opcode == HCI_OP_LE_CONNECTION_UPDATE &&
+            C->Fifo[i].Parameters[0] == command->Parameters[0]) {
+            C->SameHandleOverlap++;
+        }
+    }
+    C->Tail++;
+}
+
+static VOID
+ControllerApply(CONTROLLER* C, const CTRL_COMMAND* Command)
+{
+    ULONG device = DeviceFromHandle((USHORT)(Command->Parameters[0] | (Command->Parameters[1] << 8)));
+
+    switch (Command->Opcode) {
+    case HCI_OP_LE_CONNECTION_UPDATE:
+        memcpy(C->ConnParams[device], &Command->Parameters[2], 12);
+        break;
+    case HCI_OP_LE_SET_PHY:
+        memcpy(C->Phy[device], &Command->Parameters[2], 5);
+        break;
+    case HCI_OP_LE_SET_DATA_LENGTH:
+        memcpy(C->DataLength[device], &Command->Parameters[2], 4);
+        break;
+    case HCI_OP_LE_ADD_ACCEPT_LIST:
+    case HCI_OP_LE_REMOVE_ACCEPT_LIST:
+        device = (ULONG)(Command->Parameters[1] | (Command->Parameters[2] << 8) |
+            (Command->Parameters[3] << 16)) & 0xFF;
+        C->AcceptList[device] = (Command->Opcode == HCI_OP_LE_ADD_ACCEPT_LIST);
+        break;
+    }
+}
+
+// Runs every command that can finish by UntilUs. Every arrival before
+// UntilUs is already known, so each event's credit count is exact.
+static VOID
+ControllerRun(CONTROLLER* C, ULONG64 UntilUs)
+{
+    while (C->Head < C->Tail) {
+        CTRL_COMMAND* command = &C->Fifo[C->Head];
+        ULONG64 start = max(command->ArriveUs, C->FreeUs);
+        ULONG64 done = start + CommandUs(command->Opcode);
+        CTRL_EVENT* event;
+        ULONG buffered = 0;
+        ULONG i;
+
+        if (done > UntilUs) {
+            break;
+        }
+
+        // Buffered when it started, itself included
+        for (i = C->Head; i < C->Tail && C->Fifo[i].ArriveUs <= start; i++) {
+            buffered++;
+        }
+        if (buffered > C->Credits) {
+            C->Overflows++;
+        }
+
+        ControllerApply(C, command);
+        C->FreeUs = done;
+        C->Head++;
+        C->Processed++;
+
+        for (buffered = 0, i = C->Head; i < C->Tail && C->Fifo[i].ArriveUs <= done; i++) {
+            buffered++;
+        }
+
+        event = &C->Events[C->EventTail++];
+        event->ReadyUs = done;
+        event->Opcode = command->Opcode;
+        event->Priority = command->Priority;
+        event->Credits = (UCHAR)(C->Credits - min(buffered, C->Credits));
+        event->Lost = (C->Processed == C->LoseCommand);
+    }
+}
+
+//
+// Hosts
+//
+
+static VOID
+RunHost(HOST_MODE Mode, ULONG Credits, ULONG LoseCommand, RUN_RESULT* Result)
+{
+    static const UCHAR* fifo[MAX_COMMANDS];
+    static UCHAR priorities[MAX_COMMANDS];
+    static UCHAR packets[MAX_COMMANDS][CMDQ_HEADER_BYTES + 16];
+    CMDQ queue;
+    ULONG64 now, transportFreeUs = 0;
+    ULONG submitted = 0, fifoHead = 0, fifoTail = 0;
+    ULONG outstanding = 0, credits = 1;
+    ULONG id;
+
+    memset(Result, 0, sizeof(*Result));
+    ControllerReset(&Controller, Credits);
+    Controller.LoseCommand = LoseCommand;
+    CmdQueueInitialize(&queue, Entries, QUEUE_DEPTH);
+
+    for (now = 0; now < 60000000; now += POLL_US) {
+        // Submissions due by this poll
+        for (; submitted < WorkloadCount && Workload[submitted].AtUs <= now; submitted++) {
+            SUBMISSION* s = &Workload[submitted];
+
+            if (Mode == HostScheduler) {
+                CmdQueueSubmit(&queue, s->Opcode, s->Priority, s->Parameters, s->Length, now, &id, NULL);
+                continue;
+            }
+
+            packets[submitted][0] = (UCHAR)s->Opcode;
+            packets[submitted][1] = (UCHAR)(s->Opcode >> 8);
+            packets[submitted][2] = s->Length;
+            memcpy(&packets[submitted][CMDQ_HEADER_BYTES], s->Parameters, s->Length);
+            priorities[fifoTail] = s->Priority;
+            fifo[fifoTail++] = packets[submitted];
+        }
+
+        // Events delivered by this poll
+        while (Controller.EventHead < Controller.EventTail &&
+               Controller.Events[Controller.EventHead].ReadyUs <= now) {
+            CTRL_EVENT* event = &Controller.Events[Controller.EventHead++];
+
+            if (event->Lost) {
+                continue;
+            }
+
+            if (event->Opcode != 0 && event->Priority == 0) {
+                Result->CriticalDoneUs = now;
+            }
+
+            if (Mode == HostScheduler) {
+                CmdQueueAcknowledge(&queue, event->Opcode, event->Credits, 0, now, NULL);
+            } else {
+                credits = event->Credits;
+                if (event->Opcode != 0) {
+                    outstanding--;
+                }
+            }
+        }
+
+        // Send what the host allows
+        for (;;) {
+            const UCHAR* packet;
+            UCHAR priority;
+
+            if (Mode == HostScheduler) {
+                const CMDQ_ENTRY* entry = CmdQueueNext(&queue, now);
+
+                if (entry == NULL) {
+                    break;
+                }
+                packet = entry->Packet;
+                priority = entry->Priority;
+            } else {
+                if (fifoHead == fifoTail || credits == 0 ||
+                    (Mode == HostSerial && outstanding != 0)) {
+                    break;
+                }
+                priority = priorities[fifoHead];
+                packet = fifo[fifoHead++];
+                credits--;
+                outstanding++;
+            }
+
+            transportFreeUs = max(transportFreeUs, now) + SEND_US;
+            ControllerArrive(&Controller, transportFreeUs, packet, priority);
+            Result->Sent++;
+        }
+
+        if (Mode == HostScheduler) {
+            outstanding = queue.Stats.InFlight;
+        }
+        Result->MaxInFlight = max(Result->MaxInFlight, outstanding);
+
+        ControllerRun(&Controller, now + POLL_US);
+
+        if (submitted == WorkloadCount && Controller.Head == Controller.Tail &&
+            Controller.EventHead == Controller.EventTail &&
+            (Mode == HostScheduler ? queue.Stats.Queued + queue.Stats.InFlight : fifoTail - fifoHead + outstanding) == 0) {
+            break;
+        }
+    }
+
+    Result->AllDoneUs = now;
+    Result->TimedOut = (ULONG)queue.Stats.TimedOut;
+    Result->Overflows = Controller.Overflows;
+    Result->SameHandleOverlap = Controller.SameHandleOverlap;
+}
+
+static BOOLEAN
+SameState(const CONTROLLER* A, const CONTROLLER* B)
+{
+    return memcmp(A->ConnParams, B->ConnParams, sizeof(A->ConnParams)) == 0 &&
+        memcmp(A->Phy, B->Phy, sizeof(A->Phy)) == 0 &&
+        memcmp(A->DataLength, B->DataLength, sizeof(A->DataLength)) == 0 &&
+        memcmp(A->AcceptList, B->AcceptList, sizeof(A->AcceptList)) == 0;
+}
+
+//
+// Scheduler checks
+//
+
+static VOID
+SchedulerChecks(VOID)
+{
+    CMDQ queue;
+    UCHAR p[14] = { HANDLE_BASE, 0 };
+    const CMDQ_ENTRY* entry;
+    ULONG64 now;
+    ULONG id, first, i;
+    BOOLEAN merged, aged;
+
+    // A LOW command behind a stream of CRITICAL ones
+    CmdQueueInitialize(&queue, Entries, QUEUE_DEPTH);
+    CmdQueueAcknowledge(&queue, 0, 1, 0, 0, NULL);
+    CmdQueueSubmit(&queue, 0x0C03, 3, NULL, 0, 0, &first, NULL);
+    aged = FALSE;
+    for (now = 0; now <= 2 * CMDQ_MAX_WAIT_US && !aged; now += POLL_US) {
+        CmdQueueSubmit(&queue, 0x1001, 0, NULL, 0, now, &id, NULL);
+        entry = CmdQueueNext(&queue, now);
+        if (entry != NULL && entry->Id == first) {
+            aged = (now >= CMDQ_MAX_WAIT_US && now < CMDQ_MAX_WAIT_US + POLL_US);
+        }
+        if (entry != NULL) {
+            CmdQueueAcknowledge(&queue, entry->Opcode, 1, 0, now, NULL);
+        }
+    }
+    Check("LOW command sent once it has waited CMDQ_MAX_WAIT_US", aged && queue.Stats.Aged == 1);
+
+    // Updates for one handle: merged while queued, serialized once sent
+    CmdQueueInitialize(&queue, Entries, QUEUE_DEPTH);
+    CmdQueueAcknowledge(&queue, 0, 4, 0, 0, NULL);
+    CmdQueueSubmit(&queue, HCI_OP_LE_CONNECTION_UPDATE, 3, p, 14, 0, &first, NULL);
+    p[2] = 6;
+    CmdQueueSubmit(&queue, HCI_OP_LE_CONNECTION_UPDATE, 1, p, 14, 0, &id, &merged);
+    Check("Queued update overwritten, priority raised",
+        merged && id == first && queue.Stats.Queued == 1 &&
+        queue.Waiting[1].Head != CMDQ_NONE && queue.Waiting[3].Head == CMDQ_NONE);
+    entry = CmdQueueNext(&queue, 0);
+    Check("  and sent with the newer parameters", entry != NULL && entry->Packet[CMDQ_HEADER_BYTES + 2] == 6);
+    p[2] = 7;
+    CmdQueueSubmit(&queue, HCI_OP_LE_CONNECTION_UPDATE, 1, p, 14, 0, &id, &merged);
+    Check("Update after one in flight waits for it",
+        !merged && id != first && CmdQueueNext(&queue, 0) == NULL);
+    CmdQueueAcknowledge(&queue, HCI_OP_LE_CONNECTION_UPDATE, 4, 0, 0, NULL);
+    entry = CmdQueueNext(&queue, 0);
+    Check("  then goes", entry != NULL && entry->Id == id);
+
+    // Accept list: Remove after a queued Add replaces it; Add after a queued Remove follows it
+    CmdQueueInitialize(&queue, Entries, QUEUE_DEPTH);
+    memset(p, 0, sizeof(p));
+    p[1] = 0x11;
+    CmdQueueSubmit(&queue, HCI_OP_LE_ADD_ACCEPT_LIST, 2, p, 7, 0, &first, NULL);
+    CmdQueueSubmit(&queue, HCI_OP_LE_REMOVE_ACCEPT_LIST, 2, p, 7, 0, &id, &merged);
+    Check("Remove supersedes a queued Add", merged && queue.Stats.Queued == 1 &&
+        queue.Entries[queue.Waiting[2].Head].Opcode == HCI_OP_LE_REMOVE_ACCEPT_LIST);
+    CmdQueueSubmit(&queue, HCI_OP_LE_ADD_ACCEPT_LIST, 0, p, 7, 0, &id, &merged);
+    CmdQueueAcknowledge(&queue, 0, 4, 0, 0, NULL);
+    entry = CmdQueueNext(&queue, 0);
+    Check("Add after a queued Remove still follows it",
+        !merged && entry != NULL && entry->Opcode == HCI_OP_LE_REMOVE_ACCEPT_LIST &&
+        CmdQueueNext(&queue, 0) == NULL);
+    p[0] = 0x01;
+    CmdQueueSubmit(&queue, HCI_OP_LE_ADD_ACCEPT_LIST, 2, p, 7, 0, &id, &merged);
+    Check("Same address value, other type, kept apart", !merged);
+
+    // A command that is never acknowledged
+    CmdQueueInitialize(&queue, Entries, QUEUE_DEPTH);
+    CmdQueueSubmit(&queue, 0x0C03, 0, NULL, 0, 0, &id, NULL);
+    CmdQueueSubmit(&queue, 0x1001, 0, NULL, 0, 0, &id, NULL);
+    CmdQueueNext(&queue, 0);
+    Check("Lost command holds the queue until CMDQ_TIMEOUT_US",
+        CmdQueueNext(&queue, CMDQ_TIMEOUT_US - 1) == NULL);
+    entry = CmdQueueNext(&queue, CMDQ_TIMEOUT_US);
+    Check("  then is dropped and the next one sent",
+        entry != NULL && entry->Opcode == 0x1001 && queue.Stats.TimedOut == 1);
+
+    // Full queue
+    CmdQueueInitialize(&queue, Entries, QUEUE_DEPTH);
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        CmdQueueSubmit(&queue, 0x1001, 0, NULL, 0, 0, &id, NULL);
+    }
+    Check("Full queue refused, not overwritten",
+        CmdQueueSubmit(&queue, 0x1001, 0, NULL, 0, 0, &id, NULL) == STATUS_INSUFFICIENT_RESOURCES);
+}
+
+//
+// Host CPU per command
+//
+
+static VOID
+CpuCost(VOID)
+{
+    CMDQ queue;
+    const CMDQ_ENTRY* entry;
+    double start, elapsed;
+    ULONG64 commands = 0;
+    ULONG round, i, id;
+
+    CmdQueueInitialize(&queue, Entries, QUEUE_DEPTH);
+    CmdQueueAcknowledge(&queue, 0, 8, 0, 0, NULL);
+
+    start = Seconds();
+    for (round = 0; round < CPU_ROUNDS; round++) {
+        for (i = 0; i < WorkloadCount; i++) {
+            CmdQueueSubmit(&queue, Workload[i].Opcode, Workload[i].Priority,
+                Workload[i].Parameters, Workload[i].Length, 0, &id, NULL);
+        }
+        while ((entry = CmdQueueNext(&queue, 0)) != NULL || queue.Stats.InFlight != 0) {
+            if (entry == NULL) {
+                entry = &queue.Entries[queue.InFlight.Head];
+            }
+            CmdQueueAcknowledge(&queue, entry->Opcode, 8, 0, 0, NULL);
+            commands++;
+        }
+    }
+    elapsed = Seconds() - start;
+
+    printf("\nHost CPU: %.0f ns per command (submit, merge, send, acknowledge; %u queued at once)\n",
+        elapsed * 1e9 / commands, WorkloadCount);
+}
+
+int
+main(void)
+{
+    static const ULONG credits[] = { 1, 2, 4, 8 };
+    RUN_RESULT result, serial = { 0 };
+    BOOLEAN allSame = TRUE, noOverflow = TRUE, noOverlap = TRUE, faster = TRUE;
+    ULONG c, m;
+
+    BuildWorkload();
+
+    printf("HCI command scheduler benchmark\n\n");
+    printf("50-device reconfiguration: %u commands submitted\n", WorkloadCount);
+    printf("  %-8s %-10s %6s %8s %12s %12s\n", "Credits", "Host", "Sent", "Unacked", "Critical ms", "All ms");
+    printf("  ------------------------------------------------------------\n");
+
+    for (c = 0; c < ARRAYSIZE(credits); c++) {
+        for (m = HostSerial; m <= HostScheduler; m++) {
+            RunHost((HOST_MODE)m, credits[c], 0, &result);
+
+            if (m == HostSerial) {
+                serial = result;
+                Reference = Controller;
+            } else {
+                allSame = allSame && SameState(&Controller, &Reference);
+            }
+            noOverflow = noOverflow && result.Overflows == 0;
+            if (m == HostScheduler) {
+                noOverlap = noOverlap && result.SameHandleOverlap == 0;
+                faster = faster && result.AllDoneUs < serial.AllDoneUs &&
+                    result.CriticalDoneUs < serial.CriticalDoneUs;
+            }
+
+            printf("  %-8u %-10s %6u %8u %12.1f %12.1f\n", credits[c], ModeName[m],
+                result.Sent, result.MaxInFlight, result.CriticalDoneUs / 1000.0, result.AllDoneUs / 1000.0);
+        }
+    }
+    printf("\n");
+
+    Check("Every host leaves the controller in the same state", allSame);
+    Check("Controller's command buffers never overrun", noOverflow);
+    Check("Scheduler never buffers two updates for one handle", noOverlap);
+    Check("Scheduler beats serial on both measures", faster);
+
+    RunHost(HostScheduler, 4, 37, &result);
+    Check("Lost event: its command times out, the rest go on",
+        result.TimedOut == 1 && result.AllDoneUs >= CMDQ_TIMEOUT_US && result.Overflows == 0);
+    Check("  and the controller still ends up in the same state", SameState(&Controller, &Reference));
+
+    SchedulerChecks();
+    CpuCost();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,763 @@
+/*++
+
+Module Name:
+    hci_event_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's zero-copy HCI event parser
+    (MultiDeviceBTHci.c). It runs in three parts:
+    - Framing: events cut across submissions resume where they
+      stopped, malformed events are skipped without losing their
+      neighbours, full events fit in one batch, and random bytes never
+      produce an item outside the buffer.
+    - Agreement: the batched parser and the baseline see the same
+      reports, in the same order, with the same data.
+    - Events/s on two traces in the shape of controller captures. "Dense
+      scan" is passive scanning in a crowded venue: 400 advertisers,
+      mostly legacy reports with one to three per event, some extended
+      reports, and a few connections. "Connected" is 50 links moving
+      data, where completed-packet events dominate. The baseline copies
+      each event into a fixed structure, decodes it into a second one
+      with its own copy of the advertising data, and dispatches it by
+      itself.
+
+    Build (MSVC):
+        cl /O2 /I..\driver hci_event_benchmark.c ..\driver\MultiDeviceBTHci.c
+
+    Build (Linux):
+        cc -O2 -I../driver hci_event_benchmark.c ../driver/MultiDeviceBTHci.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTHci.h"
+
+#define TRACE_BYTES         (8 * 1024 * 1024)
+#define TRACE_RUNS          10
+#define SCAN_ADVERTISERS    400
+#define CONNECTED_LINKS     50
+#define FUZZ_BUFFERS        200000
+
+typedef struct _TRACE {
+    const char* Name;
+    UCHAR* Data;
+    ULONG Length;
+    ULONG Events;
+} TRACE;
+
+// What a consumer makes of a trace; both parsers must agree on it
+typedef struct _TALLY {
+    ULONG64 Reports;
+    ULONG64 ReportHash;         // Order sensitive: addresses, RSSI and data
+    ULONG64 Packets;
+    ULONG64 Connections;
+    ULONG64 Commands;
+    ULONG64 Other;
+    ULONG64 Calls;              // Dispatch calls
+} TALLY;
+
+static UCHAR TraceScan[TRACE_BYTES];
+static UCHAR TraceConnected[TRACE_BYTES];
+static HCI_EVENT_BATCH Batch;
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+//
+// Trace synthesis
+//
+
+static UCHAR*
+PutAddress(UCHAR* p, BTH_ADDR Address)
+{
+    ULONG i;
+
+    for (i = 0; i < 6; i++) {
+        *p++ = (UCHAR)(Address >> (8 * i));
+    }
+    return p;
+}
+
+// IoT sensor advertisement: flags, then service data carrying a sensor packet
+static UCHAR*
+PutAdvData(UCHAR* p, ULONG Advertiser, PUCHAR Length)
+{
+    UCHAR* start = p;
+    ULONG i;
+
+    *p++ = 2; *p++ = 0x01; *p++ = 0x06;
+    *p++ = 3 + 12; *p++ = 0x16; *p++ = 0x00; *p++ = 0xFF;
+    for (i = 0; i < 12; i++) {
+        *p++ = (UCHAR)(Advertiser * 7 + i + Random());
+    }
+    *Length = (UCHAR)(p - start);
+    return p;
+}
+
+static BTH_ADDR
+AdvertiserAddress(ULONG Advertiser)
+{
+    // Every third advertiser uses a resolvable private address
+    if (Advertiser % 3 == 0) {
+        return 0x400000000000ULL | ((BTH_ADDR)Advertiser << 24) | (Random() & 0xFFFFFF);
+    }
+    return 0x00A0C9000000ULL | Advertiser;
+}
+
+static UCHAR*
+PutLegacyAdvertising(UCHAR* p, ULONG Reports)
+{
+    UCHAR* length;
+    ULONG advertiser;
+    ULONG i;
+
+    *p++ = HCI_EV_LE_META;
+    length = p++;
+    *p++ = HCI_LE_ADVERTISING_REPORT;
+    *p++ = (UCHAR)Reports;
+    for (i = 0; i < Reports; i++) {
+        advertiser = Random() % SCAN_ADVERTISERS;
+        *p++ = 0x00;                            // ADV_IND
+        *p++ = (advertiser % 3 == 0) ? 0x01 : 0x00;
+        p = PutAddress(p, AdvertiserAddress(advertiser));
+        p = PutAdvData(p + 1, advertiser, p);
+        *p++ = (UCHAR)(-40 - (CHAR)(Random() % 50));
+    }
+    *length = (UCHAR)(p - length - 1);
+    return p;
+}
+
+static UCHAR*
+PutExtendedAdvertising(UCHAR* p)
+{
+    UCHAR* length;
+    ULONG advertiser = Random() % SCAN_ADVERTISERS;
+
+    *p++ = HCI_EV_LE_META;
+    length = p++;
+    *p++ = HCI_LE_EXTENDED_ADVERTISING_REPORT;
+    *p++ = 1;
+    *p++ = 0x13; *p++ = 0x00;                   // Legacy ADV_IND as an extended report
+    *p++ = (advertiser % 3 == 0) ? 0x01 : 0x00;
+    p = PutAddress(p, AdvertiserAddress(advertiser));
+    *p++ = 0x01; *p++ = 0x00; *p++ = 0xFF;      // 1M, no secondary, no SID
+    *p++ = 0x7F;                                // TX power not available
+    *p++ = (UCHAR)(-40 - (CHAR)(Random() % 50));
+    *p++ = 0; *p++ = 0;                         // No periodic advertising
+    *p++ = 0; p = PutAddress(p, 0);             // Not directed
+    p = PutAdvData(p + 1, advertiser, p);
+    *length = (UCHAR)(p - length - 1);
+    return p;
+}
+
+static UCHAR*
+PutCompletedPackets(UCHAR* p, ULONG Handles)
+{
+    ULONG i;
+
+    *p++ = HCI_EV_NUMBER_OF_COMPLETED_PACKETS;
+    *p++ = (UCHAR)(1 + 4 * Handles);
+    *p++ = (UCHAR)Handles;
+    for (i = 0; i < Handles; i++) {
+        USHORT handle = (USHORT)(0x40 + Random() % CONNECTED_LINKS);
+        USHORT packets = (USHORT)(1 + Random() % 4);
+        *p++ = (UCHAR)handle; *p++ = (UCHAR)(handle >> 8);
+        *p++ = (UCHAR)packets; *p++ = (UCHAR)(packets >> 8);
+    }
+    return p;
+}
+
+static UCHAR*
+PutCommandComplete(UCHAR* p)
+{
+    *p++ = HCI_EV_COMMAND_COMPLETE;
+    *p++ = 4;
+    *p++ = 1;                                   // Num_HCI_Command_Packets
+    *p++ = 0x0B; *p++ = 0x20;                   // LE Set Scan Parameters
+    *p++ = 0x00;
+    return p;
+}
+
+static UCHAR*
+PutLeConnection(UCHAR* p, USHORT Handle)
+{
+    *p++ = HCI_EV_LE_META;
+    *p++ = 19;
+    *p++ = HCI_LE_CONNECTION_COMPLETE;
+    *p++ = 0x00;
+    *p++ = (UCHAR)Handle; *p++ = (UCHAR)(Handle >> 8);
+    *p++ = 0x00;                                // Central
+    *p++ = 0x00;
+    p = PutAddress(p, 0x00A0C9000000ULL | Handle);
+    *p++ = 24; *p++ = 0;                        // 30 ms
+    *p++ = 0; *p++ = 0;
+    *p++ = 0x90; *p++ = 0x01;                   // 4 s
+    *p++ = 0x00;
+    return p;
+}
+
+static UCHAR*
+PutDisconnection(UCHAR* p, USHORT Handle)
+{
+    *p++ = HCI_EV_DISCONNECTION_COMPLETE;
+    *p++ = 4;
+    *p++ = 0x00;
+    *p++ = (UCHAR)Handle; *p++ = (UCHAR)(Handle >> 8);
+    *p++ = 0x13;                                // Remote user terminated
+    return p;
+}
+
+static UCHAR*
+PutEncryptionChange(UCHAR* p, USHORT Handle)
+{
+    *p++ = 0x08;
+    *p++ = 4;
+    *p++ = 0x00;
+    *p++ = (UCHAR)Handle; *p++ = (UCHAR)(Handle >> 8);
+    *p++ = 0x01;
+    return p;
+}
+
+static VOID
+BuildTrace(TRACE* Trace, BOOLEAN Scan)
+{
+    UCHAR* p = Trace->Data;
+    UCHAR* end = Trace->Data + TRACE_BYTES - 2 * (HCI_EVENT_HEADER_BYTES + HCI_MAX_EVENT_PARAMETERS);
+    USHORT handle;
+    ULONG roll;
+
+    Trace->Events = 0;
+
+    while (p < end) {
+        roll = Random() % 1000;
+        handle = (USHORT)(0x40 + Random() % CONNECTED_LINKS);
+
+        if (Scan) {
+            if (roll < 820) {
+                p = PutLegacyAdvertising(p, 1 + (roll % 10 == 0) + (roll % 25 == 0));
+            } else if (roll < 920) {
+                p = PutExtendedAdvertising(p);
+            } else if (roll < 985) {
+                p = PutCompletedPackets(p, 1 + roll % 2);
+            } else if (roll < 990) {
+                p = PutCommandComplete(p);
+            } else if (roll < 994) {
+                p = PutLeConnection(p, handle);
+            } else if (roll < 998) {
+                p = PutDisconnection(p, handle);
+            } else {
+                p = PutEncryptionChange(p, handle);
+            }
+        } else {
+            if (roll < 850) {
+                p = PutCompletedPackets(p, 1 + roll % 4);
+            } else if (roll < 950) {
+                p = PutLegacyAdvertising(p, 1);
+            } else if (roll < 990) {
+                p = PutCommandComplete(p);
+            } else {
+                p = PutEncryptionChange(p, handle);
+            }
+        }
+        Trace->Events++;
+    }
+
+    Trace->Length = (ULONG)(p - Trace->Data);
+}
+
+//
+// Consumers. Both parsers hand every report to the same work.
+//
+
+static __forceinline VOID
+TallyReport(TALLY* Tally, BTH_ADDR Address, CHAR Rssi, const UCHAR* Data, ULONG Length)
+{
+    ULONG64 h = Tally->ReportHash;
+    ULONG i;
+
+    h = (h ^ Address) * 0x100000001B3ULL;
+    h = (h ^ (UCHAR)Rssi) * 0x100000001B3ULL;
+    for (i = 0; i < Length; i++) {
+        h = (h ^ Data[i]) * 0x100000001B3ULL;
+    }
+    Tally->ReportHash = h;
+    Tally->Reports++;
+}
+
+//
+// Baseline: copy each event, decode it into a structure with its own
+// copy of the data, dispatch it alone
+//
+
+typedef struct _COPIED_EVENT {
+    UCHAR EventCode;
+    UCHAR Length;
+    UCHAR Parameters[HCI_MAX_EVENT_PARAMETERS];
+} COPIED_EVENT;
+
+typedef struct _COPIED_REPORT {
+    BTH_ADDR Address;
+    CHAR Rssi;
+    UCHAR DataLength;
+    UCHAR Data[HCI_MAX_EVENT_PARAMETERS];
+} COPIED_REPORT;
+
+typedef struct _DECODED_EVENT {
+    ULONG Kind;
+    ULONG Count;
+    COPIED_REPORT Reports[25];
+    ULONG Packets;
+    UCHAR Credits;
+} DECODED_EVENT;
+
+typedef VOID (*EVENT_HANDLER)(TALLY* Tally, const DECODED_EVENT* Event);
+
+static VOID
+BaselineOnAdvertising(TALLY* Tally, const DECODED_EVENT* Event)
+{
+    ULONG i;
+
+    Tally->Calls++;
+    for (i = 0; i < Event->Count; i++) {
+        TallyReport(Tally, Event->Reports[i].Address, Event->Reports[i].Rssi,
+            Event->Reports[i].Data, Event->Reports[i].DataLength);
+    }
+}
+
+static VOID
+BaselineOnPackets(TALLY* Tally, const DECODED_EVENT* Event)
+{
+    Tally->Calls++;
+    Tally->Packets += Event->Packets;
+}
+
+static VOID
+BaselineOnConnection(TALLY* Tally, const DECODED_EVENT* Event)
+{
+    (void)Event;
+
+    Tally->Calls++;
+    Tally->Connections++;
+}
+
+static VOID
+BaselineOnCommand(TALLY* Tally, const DECODED_EVENT* Event)
+{
+    (void)Event;
+
+    Tally->Calls++;
+    Tally->Commands++;
+}
+
+static VOID
+BaselineOnOther(TALLY* Tally, const DECODED_EVENT* Event)
+{
+    (void)Event;
+
+    Tally->Calls++;
+    Tally->Other++;
+}
+
+static const EVENT_HANDLER BaselineHandlers[] = {
+    BaselineOnAdvertising, BaselineOnPackets, BaselineOnConnection,
+    BaselineOnCommand, BaselineOnOther
+};
+
+static BOOLEAN
+BaselineDecode(const COPIED_EVENT* Copy, DECODED_EVENT* Event)
+{
+    const UCHAR* p = Copy->Parameters;
+    const UCHAR* end = p + Copy->Length;
+    COPIED_REPORT* report;
+    ULONG i;
+
+    Event->Count = 0;
+
+    switch (Copy->EventCode) {
+    case HCI_EV_LE_META:
+        if (Copy->Length >= 2 && (p[0] == HCI_LE_ADVERTISING_REPORT ||
+                                  p[0] == HCI_LE_EXTENDED_ADVERTISING_REPORT)) {
+            BOOLEAN extended = (p[0] == HCI_LE_EXTENDED_ADVERTISING_REPORT);
+            ULONG reports = p[1];
+
+            p += 2;
+            Event->Kind = 0;
+            for (i = 0; i < reports && i < 25; i++) {
+                report = &Event->Reports[i];
+                if (end - p < (extended ? 24 : 10)) {
+                    return FALSE;
+                }
+                p += extended ? 3 : 2;
+                report->Address = (BTH_ADDR)p[0] | ((BTH_ADDR)p[1] << 8) |
+                    ((BTH_ADDR)p[2] << 16) | ((BTH_ADDR)p[3] << 24) |
+                    ((BTH_ADDR)p[4] << 32) | ((BTH_ADDR)p[5] << 40);
+                p += 6;
+                if (extended) {
+                    report->Rssi = (CHAR)p[4];
+                    p += 14;
+                }
+                report->DataLength = *p++;
+                if (end - p < report->DataLength + (extended ? 0 : 1)) {
+                    return FALSE;
+                }
+                memcpy(report->Data, p, report->DataLength);
+                p += report->DataLength;
+                if (!extended) {
+                    report->Rssi = (CHAR)*p++;
+                }
+                Event->Count++;
+            }
+            return TRUE;
+        }
+        if (Copy->Length >= 1 && p[0] == HCI_LE_CONNECTION_COMPLETE) {
+            Event->Kind = 2;
+            return Copy->Length >= 19;
+        }
+        Event->Kind = 4;
+        return TRUE;
+
+    case HCI_EV_NUMBER_OF_COMPLETED_PACKETS:
+        Event->Kind = 1;
+        Event->Packets = 0;
+        if (Copy->Length < 1 || Copy->Length < 1 + 4 * p[0]) {
+            return FALSE;
+        }
+        for (i = 0; i < p[0]; i++) {
+            Event->Packets += p[3 + 4 * i] | (p[4 + 4 * i] << 8);
+        }
+        return TRUE;
+
+    case HCI_EV_DISCONNECTION_COMPLETE:
+        Event->Kind = 2;
+        return Copy->Length >= 4;
+
+    case HCI_EV_COMMAND_COMPLETE:
+        Event->Kind = 3;
+        Event->Credits = p[0];
+        return Copy->Length >= 3;
+
+    default:
+        Event->Kind = 4;
+        return TRUE;
+    }
+}
+
+static VOID
+BaselineRun(const UCHAR* Data, ULONG Length, TALLY* Tally)
+{
+    static COPIED_EVENT copy;
+    static DECODED_EVENT event;
+    ULONG offset = 0;
+
+    while (Length - offset >= HCI_EVENT_HEADER_BYTES &&
+           Length - offset >= HCI_EVENT_HEADER_BYTES + (ULONG)Data[offset + 1]) {
+        copy.EventCode = Data[offset];
+        copy.Length = Data[offset + 1];
+        memcpy(copy.Parameters, Data + offset + HCI_EVENT_HEADER_BYTES, copy.Length);
+        offset += HCI_EVENT_HEADER_BYTES + copy.Length;
+
+        if (BaselineDecode(&copy, &event)) {
+            BaselineHandlers[event.Kind](Tally, &event);
+        }
+    }
+}
+
+//
+// Batched zero-copy parser
+//
+
+static VOID
+BatchedDispatch(TALLY* Tally, const HCI_EVENT_BATCH* Batch)
+{
+    const HCI_ADV_REPORT* report;
+    ULONG i;
+
+    Tally->Calls++;
+
+    switch (Batch->Kind) {
+    case HciBatchAdvertising:
+        for (i = 0; i < Batch->Count; i++) {
+            report = &Batch->u.Advertising[i];
+            TallyReport(Tally, report->Address, report->Rssi, report->Data, report->DataLength);
+        }
+        break;
+    case HciBatchCompletedPackets:
+        for (i = 0; i < Batch->Count; i++) {
+            Tally->Packets += Batch->u.Completed[i].Packets;
+        }
+        break;
+    case HciBatchConnections:
+    case HciBatchDisconnections:
+    case HciBatchConnectionUpdates:
+        Tally->Connections += Batch->Count;
+        break;
+    case HciBatchCommands:
+        Tally->Commands += Batch->Count;
+        break;
+    default:
+        Tally->Other++;
+        break;
+    }
+}
+
+static ULONG
+BatchedRun(const UCHAR* Data, ULONG Length, TALLY* Tally, HCI_PARSE_STATS* Stats)
+{
+    HCI_EVENT_READER reader;
+
+    HciReaderInitialize(&reader, Data, Length, Stats);
+    while (HciReadBatch(&reader, &Batch) == STATUS_SUCCESS) {
+        BatchedDispatch(Tally, &Batch);
+    }
+    return reader.Offset;
+}
+
+static BOOLEAN
+TalliesAgree(const TALLY* A, const TALLY* B)
+{
+    return A->Reports == B->Reports && A->ReportHash == B->ReportHash &&
+        A->Packets == B->Packets && A->Connections == B->Connections &&
+        A->Commands == B->Commands && A->Other == B->Other;
+}
+
+//
+// Framing checks
+//
+
+static VOID
+FramingChecks(const TRACE* Trace)
+{
+    static UCHAR carry[2 * TRACE_BYTES / 64];
+    HCI_PARSE_STATS stats;
+    TALLY whole, chunked;
+    UCHAR bad[512];
+    UCHAR* event;
+    UCHAR* p;
+    ULONG offset, chunk, pending, consumed, i;
+    BOOLEAN inside;
+
+    // Submissions of random size, each led by what the last one left over
+    memset(&whole, 0, sizeof(whole));
+    memset(&chunked, 0, sizeof(chunked));
+    memset(&stats, 0, sizeof(stats));
+    BatchedRun(Trace->Data, Trace->Length, &whole, &stats);
+
+    memset(&stats, 0, sizeof(stats));
+    offset = 0;
+    pending = 0;
+    while (offset < Trace->Length) {
+        chunk = 1 + Random() % 4096;
+        if (chunk > Trace->Length - offset) {
+            chunk = Trace->Length - offset;
+        }
+        memcpy(carry + pending, Trace->Data + offset, chunk);
+        offset += chunk;
+        pending += chunk;
+        consumed = BatchedRun(carry, pending, &chunked, &stats);
+        memmove(carry, carry + consumed, pending - consumed);
+        pending -= consumed;
+    }
+    Check("Split submissions resume at the cut event", TalliesAgree(&whole, &chunked) && pending == 0);
+    Check("  cuts counted as truncated, none as malformed", stats.Truncated > 0 && stats.Malformed == 0);
+
+    // Malformed events between good ones
+    p = bad;
+    p = PutLegacyAdvertising(p, 1);
+    event = p;
+    p = PutLegacyAdvertising(p, 2);
+    event[3] = 3;                               // Num_Reports claims a third report
+    p = PutLegacyAdvertising(p, 1);
+    p = PutCompletedPackets(p, 2);
+    event = p;
+    p = PutCompletedPackets(p, 2);
+    event[2] = 3;                               // Num_Handles claims a third handle
+    memset(&stats, 0, sizeof(stats));
+    memset(&whole, 0, sizeof(whole));
+    consumed = BatchedRun(bad, (ULONG)(p - bad), &whole, &stats);
+    Check("Malformed events skipped, neighbours kept",
+        stats.Malformed == 2 && whole.Reports == 2 && stats.CompletedHandles == 2 &&
+        consumed == (ULONG)(p - bad));
+
+    // A legacy report claiming more than 31 octets, and a meta event with no subevent
+    p = bad;
+    p = PutLegacyAdvertising(p, 1);
+    bad[12] = 40;                               // Data_Length
+    *p++ = HCI_EV_LE_META;
+    *p++ = 0;
+    memset(&stats, 0, sizeof(stats));
+    memset(&whole, 0, sizeof(whole));
+    BatchedRun(bad, (ULONG)(p - bad), &whole, &stats);
+    Check("Oversized report rejected, empty meta event passed on",
+        stats.Malformed == 1 && stats.OtherEvents == 1 && whole.Reports == 0);
+
+    // The largest events fit an empty batch; a run splits at HCI_BATCH_MAX
+    p = bad;
+    p = PutCompletedPackets(p, 63);
+    p = PutCompletedPackets(p, 2);
+    memset(&stats, 0, sizeof(stats));
+    {
+        HCI_EVENT_READER reader;
+        ULONG first, second;
+
+        HciReaderInitialize(&reader, bad, (ULONG)(p - bad), &stats);
+        HciReadBatch(&reader, &Batch);
+        first = Batch.Count;
+        HciReadBatch(&reader, &Batch);
+        second = Batch.Count;
+        Check("63 handles in one batch, the next event in another",
+            first == 63 && second == 2 && HciReadBatch(&reader, &Batch) == STATUS_NO_MORE_ENTRIES);
+    }
+
+    // Random bytes: every item must lie inside the buffer
+    inside = TRUE;
+    memset(&stats, 0, sizeof(stats));
+    for (i = 0; i < FUZZ_BUFFERS && inside; i++) {
+        HCI_EVENT_READER reader;
+        ULONG length = Random() % sizeof(bad);
+        ULONG j, k;
+
+        for (j = 0; j < length; j++) {
+            bad[j] = (UCHAR)Random();
+        }
+        // Bias toward event codes the parser decodes
+        if (length > 0) {
+            bad[0] = (UCHAR[]){ HCI_EV_LE_META, HCI_EV_NUMBER_OF_COMPLETED_PACKETS,
+                HCI_EV_COMMAND_COMPLETE, HCI_EV_CONNECTION_COMPLETE }[Random() % 4];
+        }
+        if (length > 2) {
+            bad[2] = (UCHAR)(Random() % 16);
+        }
+
+        HciReaderInitialize(&reader, bad, length, &stats);
+        while (HciReadBatch(&reader, &Batch) == STATUS_SUCCESS) {
+            if (Batch.Count == 0 || Batch.Count > HCI_BATCH_MAX) {
+                inside = FALSE;
+            }
+            for (k = 0; Batch.Kind == HciBatchAdvertising && k < Batch.Count; k++) {
+                const HCI_ADV_REPORT* report = &Batch.u.Advertising[k];
+                if (report->Data < bad || report->Data + report->DataLength > bad + length) {
+                    inside = FALSE;
+                }
+            }
+        }
+        if (reader.Offset > length) {
+            inside = FALSE;
+        }
+    }
+    Check("Random buffers stay inside their bounds", inside);
+}
+
+//
+// Throughput
+//
+
+static VOID
+Throughput(const TRACE* Trace)
+{
+    HCI_PARSE_STATS stats;
+    TALLY baseline, batched;
+    double start, baselineSeconds, batchedSeconds;
+    ULONG run;
+
+    // Warm up and compare outcomes
+    memset(&baseline, 0, sizeof(baseline));
+    memset(&batched, 0, sizeof(batched));
+    memset(&stats, 0, sizeof(stats));
+    BaselineRun(Trace->Data, Trace->Length, &baseline);
+    BatchedRun(Trace->Data, Trace->Length, &batched, &stats);
+
+    printf("\n%s: %u events, %.1f MB, %.2f reports/event, %llu items per batch call\n",
+        Trace->Name, Trace->Events, Trace->Length / 1048576.0,
+        (double)stats.AdvertisingReports / (stats.Events ? stats.Events : 1),
+        (unsigned long long)((stats.AdvertisingReports + stats.CompletedHandles +
+            stats.ConnectionEvents + stats.CommandEvents + stats.OtherEvents) / stats.Batches));
+    Check("Batched and baseline consumers agree", TalliesAgree(&baseline, &batched));
+    Check("  every event parsed", stats.Events == Trace->Events && stats.Malformed == 0);
+
+    start = Seconds();
+    for (run = 0; run < TRACE_RUNS; run++) {
+        BaselineRun(Trace->Data, Trace->Length, &baseline);
+    }
+    baselineSeconds = (Seconds() - start) / TRACE_RUNS;
+
+    start = Seconds();
+    for (run = 0; run < TRACE_RUNS; run++) {
+        BatchedRun(Trace->Data, Trace->Length, &batched, &stats);
+    }
+    batchedSeconds = (Seconds() - start) / TRACE_RUNS;
+
+    printf("  %-22s %12s %10s %12s %10s\n", "Parser", "events/s", "MB/s", "ns/event", "calls");
+    printf("  -------------------------------------------------------------------\n");
+    printf("  %-22s %12.0f %10.0f %12.1f %10llu\n", "copy per event",
+        Trace->Events / baselineSeconds, Trace->Length / 1048576.0 / baselineSeconds,
+        baselineSeconds * 1e9 / Trace->Events, (unsigned long long)(baseline.Calls / (TRACE_RUNS + 1)));
+    printf("  %-22s %12.0f %10.0f %12.1f %10llu\n", "zero-copy batched",
+        Trace->Events / batchedSeconds, Trace->Length / 1048576.0 / batchedSeconds,
+        batchedSeconds * 1e9 / Trace->Events, (unsigned long long)(batched.Calls / (TRACE_RUNS + 1)));
+    printf("  Speedup: %.2fx\n", baselineSeconds / batchedSeconds);
+}
+
+int
+main(void)
+{
+    TRACE scan = { "Dense scan", TraceScan, 0, 0 };
+    TRACE connected = { "Connected", TraceConnected, 0, 0 };
+
+    BuildTrace(&scan, TRUE);
+    BuildTrace(&connected, FALSE);
+
+    printf("HCI event parser benchmark\n\nFraming\n");
+    FramingChecks(&scan);
+
+    Throughput(&scan);
+    Throughput(&connected);
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,281 @@
+/*++
+
+Module Name:
+    hid_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's compiled HID report extractors
+    (MultiDeviceBTHid.c). The baseline is a generic interpreter, which
+    walks the report descriptor for every report and extracts fields
+    bit by bit. The device is a composite keyboard, consumer control,
+    mouse and game controller. The run checks that both decoders agree
+    on every value, then reports reports/s for each and the CPU cost of
+    8 devices polled at 1000 Hz.
+
+    Build (MSVC):
+        cl /O2 /I..\driver hid_benchmark.c ..\driver\MultiDeviceBTHid.c
+
+    Build (Linux):
+        cc -O2 -I../driver hid_benchmark.c ../driver/MultiDeviceBTHid.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTHid.h"
+
+#define REPORTS             4096
+#define BENCH_SECONDS       1.0
+#define POLL_DEVICES        8
+#define POLL_HZ             1000
+
+static const UCHAR Descriptor[] = {
+    // Keyboard, report 1: modifiers, reserved byte, LEDs (output), 6 keys
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x85, 0x01,
+    0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+    0x95, 0x01, 0x75, 0x08, 0x81, 0x01,
+    0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02,
+    0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+    0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00,
+    0xC0,
+
+    // Consumer control, report 2: one 16-bit usage selector
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x02,
+    0x15, 0x00, 0x26, 0xFF, 0x03, 0x19, 0x00, 0x2A, 0xFF, 0x03, 0x75, 0x10, 0x95, 0x01, 0x81, 0x00,
+    0xC0,
+
+    // Mouse, report 3: 5 buttons, 16-bit X/Y, wheel, AC pan
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x03, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01, 0x81, 0x02,
+    0x95, 0x01, 0x75, 0x03, 0x81, 0x01,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02, 0x81, 0x06,
+    0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x81, 0x06,
+    0x05, 0x0C, 0x0A, 0x38, 0x02, 0x95, 0x01, 0x81, 0x06,
+    0xC0, 0xC0,
+
+    // Game controller, report 4: 16 buttons, hat, 4 x 16-bit sticks, 2 x 10-bit triggers
+    0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x85, 0x04,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x10, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x10, 0x81, 0x02,
+    0x05, 0x01, 0x09, 0x39, 0x15, 0x00, 0x25, 0x07, 0x75, 0x04, 0x95, 0x01, 0x81, 0x42,
+    0x75, 0x04, 0x95, 0x01, 0x81, 0x01,
+    0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x35, 0x15, 0x00, 0x27, 0xFF, 0xFF, 0x00, 0x00,
+    0x75, 0x10, 0x95, 0x04, 0x81, 0x02,
+    0x09, 0x33, 0x09, 0x34, 0x15, 0x00, 0x26, 0xFF, 0x03, 0x75, 0x0A, 0x95, 0x02, 0x81, 0x02,
+    0x75, 0x04, 0x95, 0x01, 0x81, 0x01,
+    0xC0,
+};
+
+typedef struct _TEST_REPORT {
+    ULONG Length;
+    UCHAR Data[HID_MAX_REPORT_BYTES];
+} TEST_REPORT;
+
+static HID_COMPILED Compiled;
+static TEST_REPORT Reports[REPORTS];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+/*++
+Routine Description:
+    Generic interpreter: walks the descriptor for the report's ID and
+    extracts each field bit by bit. Value semantics match the compiler:
+    sign extension when the logical minimum is negative, and array
+    selectors biased to their usage.
+--*/
+static ULONG
+GenericDecode(const UCHAR* Desc, ULONG DescLength, const UCHAR* Report, ULONG Length, LONG* Values)
+{
+    ULONG pos = 0, count = 0, bit = 0;
+    ULONG reportSize = 0, reportCount = 0, reportId = 0;
+    ULONG minRaw = 0, maxRaw = 0, minSize = 0;
+    ULONG usageMin = 0, usages[HID_MAX_USAGES], usageCount = 0;
+    BOOLEAN hasMin = FALSE, usesIds = FALSE, started = FALSE, matched = FALSE;
+
+    while (pos < DescLength) {
+        UCHAR prefix = Desc[pos++];
+        ULONG size = prefix & 3, type, tag, data = 0, i;
+
+        size = (size == 3) ? 4 : size;
+        type = (prefix >> 2) & 3;
+        tag = prefix >> 4;
+        for (i = 0; i < size; i++) {
+            data |= (ULONG)Desc[pos + i] << (8 * i);
+        }
+        pos += size;
+
+        if (type == 1) {
+            if (tag == 1) { minRaw = data; minSize = size; }
+            else if (tag == 2) { maxRaw = data; }
+            else if (tag == 7) { reportSize = data; }
+            else if (tag == 9) { reportCount = data; }
+            else if (tag == 8) { reportId = data; usesIds = TRUE; }
+        } else if (type == 2) {
+            if (tag == 0 && usageCount < HID_MAX_USAGES) { usages[usageCount++] = data; }
+            else if (tag == 1) { usageMin = data; hasMin = TRUE; }
+        } else if (type == 0) {
+            if (tag == 8 && (!usesIds || (Length > 0 && reportId == Report[0]))) {
+                LONG logicalMin = (minSize == 1) ? (LONG)(CHAR)minRaw :
+                    (minSize == 2) ? (LONG)(SHORT)minRaw : (LONG)minRaw;
+
+                if (!started) {
+                    bit = usesIds ? 8 : 0;
+                    started = TRUE;
+                }
+                matched = TRUE;
+
+                for (i = 0; i < reportCount; i++) {
+                    ULONG raw = 0, b;
+
+                    if (bit + reportSize > Length * 8) {
+                        return 0;
+                    }
+
+                    if ((data & 1) == 0 && reportSize <= 32) {
+                        for (b = 0; b < reportSize; b++) {
+                            raw |= (ULONG)((Report[(bit + b) / 8] >> ((bit + b) % 8)) & 1) << b;
+                        }
+
+                        if (logicalMin < 0 && reportSize < 32 && (raw & (1UL << (reportSize - 1)))) {
+                            raw |= ~0UL << reportSize;
+                        }
+
+                        if ((data & 2) == 0) {
+                            ULONG usage = hasMin ? usageMin : (usageCount ? usages[0] : 0);
+
+                            raw += (ULONG)((LONG)(usage & 0xFFFF) - logicalMin);
+                        }
+
+                        Values[count++] = (LONG)raw;
+                    }
+                    bit += reportSize;
+                }
+            }
+            usageCount = 0;
+            hasMin = FALSE;
+        }
+    }
+
+    (void)maxRaw;
+    return matched ? count : 0;
+}
+
+static void
+MakeReports(void)
+{
+    static const ULONG lengths[5] = { 0, 9, 3, 8, 15 };
+    unsigned int seed = 86;
+    ULONG i, b;
+
+    for (i = 0; i < REPORTS; i++) {
+        ULONG pick, id;
+
+        seed = seed * 1103515245 + 12345;
+        pick = (seed >> 16) % 100;
+        id = (pick < 30) ? 1 : (pick < 35) ? 2 : (pick < 75) ? 3 : 4;
+
+        Reports[i].Length = lengths[id];
+        Reports[i].Data[0] = (UCHAR)id;
+        for (b = 1; b < lengths[id]; b++) {
+            seed = seed * 1103515245 + 12345;
+            Reports[i].Data[b] = (UCHAR)(seed >> 16);
+        }
+    }
+}
+
+int
+main(void)
+{
+    LONG generic[HID_MAX_FIELDS], compiled[HID_MAX_FIELDS];
+    volatile ULONG sink = 0;
+    double start, elapsed, compileUs, genericRate, compiledRate;
+    ULONG64 decoded;
+    ULONG i, n, mismatches = 0, rounds;
+
+    start = Seconds();
+    for (i = 0; i < 1000; i++) {
+        if (!NT_SUCCESS(HidCompileDescriptor(Descriptor, sizeof(Descriptor), &Compiled))) {
+            printf("descriptor failed to compile\n");
+            return 1;
+        }
+    }
+    compileUs = (Seconds() - start) * 1e6 / 1000;
+
+    printf("Descriptor: %u bytes, %lu input reports, compiled in %.2f us\n",
+        (unsigned)sizeof(Descriptor), (unsigned long)Compiled.ReportCount, compileUs);
+    for (i = 0; i < Compiled.ReportCount; i++) {
+        printf("  report %u: %u bytes, %lu fields\n", Compiled.Reports[i].ReportId,
+            Compiled.Reports[i].Length, (unsigned long)Compiled.Reports[i].Count);
+    }
+
+    MakeReports();
+
+    for (i = 0; i < REPORTS; i++) {
+        ULONG a = GenericDecode(Descriptor, sizeof(Descriptor), Reports[i].Data, Reports[i].Length, generic);
+        ULONG b = HidDecodeReport(&Compiled, Reports[i].Data, Reports[i].Length, compiled, NULL);
+
+        if (a != b || memcmp(generic, compiled, a * sizeof(LONG)) != 0) {
+            mismatches++;
+        }
+    }
+    printf("\nAgreement on %u reports: %s (%lu mismatches)\n\n", REPORTS,
+        mismatches ? "FAIL" : "identical", (unsigned long)mismatches);
+
+    decoded = 0;
+    rounds = 0;
+    start = Seconds();
+    do {
+        for (i = 0; i < REPORTS; i++) {
+            n = GenericDecode(Descriptor, sizeof(Descriptor), Reports[i].Data, Reports[i].Length, generic);
+            sink += (ULONG)generic[n - 1];
+            decoded++;
+        }
+        rounds++;
+        elapsed = Seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+    genericRate = decoded / elapsed;
+
+    decoded = 0;
+    start = Seconds();
+    do {
+        for (i = 0; i < REPORTS; i++) {
+            n = HidDecodeReport(&Compiled, Reports[i].Data, Reports[i].Length, compiled, NULL);
+            sink += (ULONG)compiled[n - 1];
+            decoded++;
+        }
+        elapsed = Seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+    compiledRate = decoded / elapsed;
+
+    printf("  %-10s %14s %10s %22s\n", "decoder", "reports/s", "ns/report", "% core, 8 dev @ 1 kHz");
+    printf("  %-10s %14.0f %10.1f %21.4f%%\n", "generic", genericRate, 1e9 / genericRate,
+        100.0 * POLL_DEVICES * POLL_HZ / genericRate);
+    printf("  %-10s %14.0f %10.1f %21.4f%%\n", "compiled", compiledRate, 1e9 / compiledRate,
+        100.0 * POLL_DEVICES * POLL_HZ / compiledRate);
+    printf("\nSpeed-up: %.1fx\n", compiledRate / genericRate);
+
+    (void)rounds;
+    return mismatches ? 1 : 0;
+}
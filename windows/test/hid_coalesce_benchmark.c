@@ -0,0 +1,521 @@
+/*++
+
+Module Name:
+    hid_coalesce_benchmark.c
+
+Abstract:
+    Event-driven benchmark for the driver's HID input report coalescing
+    (MultiDeviceBTHidCoalesce.c). Three device mixes report for 30 s
+    each:
+    - gaming: 8 kHz mouse, keyboard, 1 kHz gamepad
+    - 8 x 1 kHz: eight 1 kHz devices
+    - desktop: 1 kHz mouse, keyboard, 500 Hz pen
+    Periodic devices jitter by up to 20 us and mark a few reports a
+    second as button changes; keyboards report only on a change.
+
+    The host is modelled the way the driver sees it: the latency timer
+    expires late by an exponential 40 us with rare spikes, kept within
+    the worst case the driver budgets (HID_COALESCE_SLACK_US less one
+    completion); a completion costs 10 us; the reader reposts about
+    20 us after each completion. Every mix runs once with one completion
+    per report and once coalesced under the cap.
+
+    The table gives completions per second against reports per second,
+    arrival-to-completion latency, and the latency coalescing adds: from
+    arrival until the batch is readied (or leaves on another device's
+    completion), plus the completion. That is the figure the cap bounds;
+    time spent waiting for the reader to repost is there with or without
+    coalescing. Checks hold it to the cap and cover the core's flush
+    reasons, overruns, short reads and reconfiguration.
+
+    Build (MSVC):
+        cl /O2 /I..\driver hid_coalesce_benchmark.c ..\driver\MultiDeviceBTHidCoalesce.c
+
+    Build (Linux):
+        cc -O2 -I../driver hid_coalesce_benchmark.c ../driver/MultiDeviceBTHidCoalesce.c -lm
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "MultiDeviceBTHidCoalesce.h"
+
+#define SECONDS             30
+#define CAP_US              1000
+#define MAX_DEVICES         8
+#define MAX_REPORTS         (SECONDS * 9500)
+#define READ_EVENTS         (MAX_DEVICES * HID_COALESCE_MAX_REPORTS)
+#define TIMER_LATE_MEAN_US  40
+#define TIMER_SPIKE         0.002   // Probability of a 100-250 us spike
+#define COMPLETION_US       10
+#define REPOST_MEAN_US      15
+#define SCENARIOS           3
+#define US                  10      // Time unit: 100 ns
+
+typedef struct _DEVICE_MODEL {
+    const char* Name;
+    ULONG RateHz;               // 0: reports only on a state change
+    ULONG ChangesPerSecond;
+} DEVICE_MODEL;
+
+typedef struct _SCENARIO {
+    const char* Name;
+    ULONG Devices;
+    DEVICE_MODEL Models[MAX_DEVICES];
+} SCENARIO;
+
+typedef struct _ARRIVAL {
+    LONGLONG Time;
+    UCHAR Device;
+    UCHAR Click;
+} ARRIVAL;
+
+typedef struct _RESULT {
+    ULONG Reports;
+    ULONG Completions;
+    ULONG P50Us;
+    ULONG P99Us;
+    ULONG MaxUs;
+    ULONG ClickP99Us;
+    ULONG AddedMaxUs;           // Arrival to readied, plus the completion
+    ULONG Overruns;
+    HID_INPUT_STATS Stats;
+} RESULT;
+
+static const SCENARIO Scenarios[SCENARIOS] = {
+    { "gaming", 3, { { "8 kHz mouse", 8000, 4 }, { "keyboard", 0, 16 }, { "1 kHz gamepad", 1000, 6 } } },
+    { "8 x 1 kHz", 8, { { "device 0", 1000, 4 }, { "device 1", 1000, 4 }, { "device 2", 1000, 4 },
+                        { "device 3", 1000, 4 }, { "device 4", 1000, 4 }, { "device 5", 1000, 4 },
+                        { "device 6", 1000, 4 }, { "device 7", 1000, 4 } } },
+    { "desktop", 3, { { "1 kHz mouse", 1000, 2 }, { "keyboard", 0, 10 }, { "pen", 500, 1 } } },
+};
+
+static ARRIVAL Arrivals[MAX_REPORTS];
+static ULONG ArrivalCount;
+static ULONG Latency[MAX_REPORTS];
+static ULONG ClickLatency[MAX_REPORTS];
+static HID_COALESCE_QUEUE Queues[MAX_DEVICES];
+static LONGLONG ReadySince[MAX_DEVICES];
+static HID_INPUT_EVENT ReadBuffer[READ_EVENTS];
+static HID_COALESCER Coalescer;
+
+static unsigned int RandomState;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+// Uniform in [0, 1)
+static double
+Uniform(void)
+{
+    return (Random() & 0xFFFFFF) / 16777216.0;
+}
+
+static double
+Exponential(double Mean)
+{
+    return -Mean * log(1.0 - Uniform());
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static int
+CompareArrival(const void* A, const void* B)
+{
+    const ARRIVAL* a = (const ARRIVAL*)A;
+    const ARRIVAL* b = (const ARRIVAL*)B;
+
+    return (a->Time > b->Time) - (a->Time < b->Time);
+}
+
+static int
+CompareUlong(const void* A, const void* B)
+{
+    ULONG a = *(const ULONG*)A, b = *(const ULONG*)B;
+
+    return (a > b) - (a < b);
+}
+
+static ULONG
+Percentile(ULONG* Values, ULONG Count, ULONG Percent)
+{
+    if (Count == 0) {
+        return 0;
+    }
+    qsort(Values, Count, sizeof(ULONG), CompareUlong);
+    return Values[(Count - 1) * Percent / 100];
+}
+
+// Every report of the mix, in arrival order
+static VOID
+MakeArrivals(const SCENARIO* Scenario, unsigned int Seed)
+{
+    LONGLONG horizon = (LONGLONG)SECONDS * 1000000 * US;
+    ULONG d;
+
+    RandomState = Seed;
+    ArrivalCount = 0;
+
+    for (d = 0; d < Scenario->Devices; d++) {
+        const DEVICE_MODEL* model = &Scenario->Models[d];
+        double t;
+
+        if (model->RateHz != 0) {
+            double period = 1000000.0 / model->RateHz;
+            double changeProbability = (double)model->ChangesPerSecond / model->RateHz;
+
+            for (t = period * Uniform(); t * US < horizon; t += period) {
+                ARRIVAL* a = &Arrivals[ArrivalCount++];
+
+                a->Time = (LONGLONG)((t + 20 * Uniform()) * US);
+                a->Device = (UCHAR)d;
+                a->Click = Uniform() < changeProbability;
+            }
+        } else {
+            double mean = 1000000.0 / model->ChangesPerSecond;
+
+            for (t = Exponential(mean); t * US < horizon; t += Exponential(mean)) {
+                ARRIVAL* a = &Arrivals[ArrivalCount++];
+
+                a->Time = (LONGLONG)(t * US);
+                a->Device = (UCHAR)d;
+                a->Click = TRUE;
+            }
+        }
+    }
+
+    qsort(Arrivals, ArrivalCount, sizeof(ARRIVAL), CompareArrival);
+}
+
+// Host state of one run
+typedef struct _HOST {
+    ULONG Devices;
+    LONGLONG TimerDue;          // As HidInputArmTimer keeps it; 0 when idle
+    LONGLONG TimerFires;        // When the expiry actually runs
+    BOOLEAN Posted;             // A read is pended
+    LONGLONG RepostAt;
+    RESULT* Result;
+    ULONG Clicks;
+} HOST;
+
+// Remembers when a queue became ready, for the added latency
+static VOID
+NoteReady(ULONG Device, BOOLEAN WasReady, LONGLONG Now)
+{
+    if (!WasReady && Queues[Device].Ready) {
+        ReadySince[Device] = Now;
+    }
+}
+
+static VOID
+ArmTimer(HOST* Host, LONGLONG Deadline, LONGLONG Now)
+{
+    double lateUs;
+
+    if (Host->TimerDue != 0 && Host->TimerDue <= Deadline) {
+        return;
+    }
+
+    lateUs = Exponential(TIMER_LATE_MEAN_US);
+    if (Uniform() < TIMER_SPIKE) {
+        lateUs += 100 + 150 * Uniform();
+    }
+    lateUs = min(lateUs, HID_COALESCE_SLACK_US - COMPLETION_US);
+
+    Host->TimerDue = Deadline;
+    Host->TimerFires = max(Deadline, Now + 1) + (LONGLONG)(lateUs * US);
+}
+
+// HidInputDrain: one completion carries every device's queued reports
+static VOID
+Drain(HOST* Host, LONGLONG Now)
+{
+    RESULT* result = Host->Result;
+    LONGLONG done = Now + COMPLETION_US * US;
+    ULONG copied = 0, d, e;
+
+    if (!Host->Posted || Coalescer.ReadyQueues == 0) {
+        return;
+    }
+
+    for (d = 0; d < Host->Devices; d++) {
+        LONGLONG readied = Queues[d].Ready ? ReadySince[d] : Now;
+        ULONG take = HidCoalesceTake(&Coalescer, &Queues[d], &ReadBuffer[copied],
+            READ_EVENTS - copied, done);
+
+        for (e = copied; e < copied + take; e++) {
+            const HID_INPUT_EVENT* event = &ReadBuffer[e];
+            ULONG latencyUs = (ULONG)((done - event->Timestamp) / US);
+            ULONG addedUs = (ULONG)((readied - event->Timestamp) / US) + COMPLETION_US;
+
+            Latency[result->Reports++] = latencyUs;
+            if ((event->Flags & HID_EVENT_STATE_CHANGE) != 0) {
+                ClickLatency[Host->Clicks++] = latencyUs;
+            }
+            result->AddedMaxUs = max(result->AddedMaxUs, addedUs);
+        }
+        copied += take;
+    }
+
+    Coalescer.Stats.Completions++;
+    result->Completions++;
+    Host->Posted = FALSE;
+    Host->RepostAt = done + (LONGLONG)((5 + Exponential(REPOST_MEAN_US)) * US);
+}
+
+static VOID
+TimerExpired(HOST* Host, LONGLONG Now)
+{
+    LONGLONG next = MAXLONGLONG;
+    ULONG d;
+
+    Host->TimerDue = 0;
+    Host->TimerFires = 0;
+
+    for (d = 0; d < Host->Devices; d++) {
+        BOOLEAN wasReady = Queues[d].Ready;
+
+        next = min(next, HidCoalesceExpire(&Coalescer, &Queues[d], Now));
+        NoteReady(d, wasReady, Now);
+    }
+
+    if (next != MAXLONGLONG) {
+        ArmTimer(Host, next, Now);
+    }
+
+    Drain(Host, Now);
+}
+
+static VOID
+Simulate(const SCENARIO* Scenario, ULONG CapUs, unsigned int Seed, RESULT* Result)
+{
+    HOST host;
+    ULONG next = 0, d;
+
+    memset(Result, 0, sizeof(*Result));
+    memset(&host, 0, sizeof(host));
+    memset(&Coalescer, 0, sizeof(Coalescer));
+    memset(Queues, 0, sizeof(Queues));
+
+    host.Devices = Scenario->Devices;
+    host.Posted = TRUE;
+    host.Result = Result;
+    RandomState = Seed;
+
+    for (d = 0; d < host.Devices; d++) {
+        HidCoalesceConfigure(&Coalescer, &Queues[d], CapUs, HID_COALESCE_MAX_REPORTS);
+    }
+
+    for (;;) {
+        LONGLONG arrival = (next < ArrivalCount) ? Arrivals[next].Time : MAXLONGLONG;
+        LONGLONG timer = (host.TimerFires != 0) ? host.TimerFires : MAXLONGLONG;
+        LONGLONG repost = host.Posted ? MAXLONGLONG : host.RepostAt;
+
+        if (arrival == MAXLONGLONG && timer == MAXLONGLONG && repost == MAXLONGLONG) {
+            break;
+        }
+
+        if (arrival <= timer && arrival <= repost) {
+            const ARRIVAL* a = &Arrivals[next++];
+            HID_INPUT_EVENT event;
+            LONGLONG deadline;
+            BOOLEAN wasReady = Queues[a->Device].Ready;
+
+            memset(&event, 0, sizeof(event));
+            event.Timestamp = arrival;
+            event.DeviceAddress = a->Device;
+            event.Flags = a->Click ? HID_EVENT_STATE_CHANGE : 0;
+            event.Count = 1;
+
+            if (!NT_SUCCESS(HidCoalescePush(&Coalescer, &Queues[a->Device], &event, arrival, &deadline))) {
+                Result->Overruns++;
+                continue;
+            }
+            NoteReady(a->Device, wasReady, arrival);
+            if (deadline != 0) {
+                ArmTimer(&host, deadline, arrival);
+            }
+            Drain(&host, arrival);
+        } else if (timer <= repost) {
+            TimerExpired(&host, timer);
+        } else {
+            host.Posted = TRUE;
+            Drain(&host, repost);
+        }
+    }
+
+    Result->P50Us = Percentile(Latency, Result->Reports, 50);
+    Result->P99Us = Percentile(Latency, Result->Reports, 99);
+    Result->MaxUs = Percentile(Latency, Result->Reports, 100);
+    Result->ClickP99Us = Percentile(ClickLatency, host.Clicks, 99);
+    Result->Stats = Coalescer.Stats;
+}
+
+static VOID
+PrintResult(const char* Scenario, const char* Mode, const RESULT* Result, const RESULT* Base)
+{
+    printf("%-10s | %-10s | %-9.0f | %-8.0f | %4.1fx | %-6u | %-6u | %-6u | %-9u | %-+9d | %u\n",
+        Scenario, Mode, (double)Result->Reports / SECONDS, (double)Result->Completions / SECONDS,
+        (double)Base->Completions / Result->Completions, Result->P50Us, Result->P99Us,
+        Result->MaxUs, Result->ClickP99Us, (int)Result->P99Us - (int)Base->P99Us,
+        Result->AddedMaxUs);
+}
+
+/*++
+Routine Description:
+    Drives one queue through each flush reason by hand
+--*/
+static VOID
+CoalesceChecks(VOID)
+{
+    HID_COALESCE_QUEUE queue;
+    HID_INPUT_EVENT event, out[4];
+    LONGLONG deadline;
+    ULONG i, taken;
+    BOOLEAN passed;
+
+    printf("\nCoalescer checks\n");
+
+    memset(&event, 0, sizeof(event));
+
+    // Deadline leaves the slack inside the cap
+    memset(&Coalescer, 0, sizeof(Coalescer));
+    memset(&queue, 0, sizeof(queue));
+    HidCoalesceConfigure(&Coalescer, &queue, 1000, HID_COALESCE_MAX_REPORTS);
+    HidCoalescePush(&Coalescer, &queue, &event, 5000, &deadline);
+    passed = deadline == 5000 + (1000 - HID_COALESCE_SLACK_US) * US && !queue.Ready;
+    HidCoalescePush(&Coalescer, &queue, &event, 6000, &deadline);
+    passed = passed && deadline == 0 && queue.Pending == 2;
+    passed = passed && HidCoalesceExpire(&Coalescer, &queue, 5000 + 6999) == 5000 + 7000 && !queue.Ready;
+    passed = passed && HidCoalesceExpire(&Coalescer, &queue, 5000 + 7000) == MAXLONGLONG &&
+        queue.Ready && Coalescer.ReadyQueues == 1 && Coalescer.Stats.LatencyFlushes == 1;
+    Check("Batch readied at cap less slack, not before", passed);
+
+    // Short read keeps the remainder ready
+    taken = HidCoalesceTake(&Coalescer, &queue, out, 1, 20000);
+    passed = taken == 1 && queue.Pending == 1 && queue.Ready && Coalescer.ReadyQueues == 1;
+    taken = HidCoalesceTake(&Coalescer, &queue, out, 4, 20000);
+    passed = passed && taken == 1 && queue.Pending == 0 && !queue.Ready &&
+        Coalescer.ReadyQueues == 0 && Coalescer.Stats.ReportsCompleted == 2 &&
+        Coalescer.Stats.LatencyMaxUs == 1500;
+    Check("Short read leaves the rest ready for the next", passed);
+
+    // A state change goes at once
+    event.Flags = HID_EVENT_STATE_CHANGE;
+    HidCoalescePush(&Coalescer, &queue, &event, 30000, &deadline);
+    passed = queue.Ready && deadline == 0 && Coalescer.Stats.StateFlushes == 1;
+    HidCoalesceTake(&Coalescer, &queue, out, 4, 30000);
+    event.Flags = 0;
+    Check("Button or key change readies the batch at once", passed);
+
+    // Full batch
+    HidCoalesceConfigure(&Coalescer, &queue, 1000, 3);
+    for (i = 0; i < 3; i++) {
+        HidCoalescePush(&Coalescer, &queue, &event, 40000 + i, &deadline);
+    }
+    passed = queue.Ready && Coalescer.Stats.FullFlushes == 1;
+    HidCoalesceTake(&Coalescer, &queue, out, 4, 40010);
+    Check("MaxReports readies a full batch", passed);
+
+    // A cap inside the slack cannot hold anything
+    HidCoalesceConfigure(&Coalescer, &queue, HID_COALESCE_SLACK_US, HID_COALESCE_MAX_REPORTS);
+    HidCoalescePush(&Coalescer, &queue, &event, 50000, &deadline);
+    passed = queue.Ready && deadline == 0 && Coalescer.Stats.ImmediateFlushes == 1;
+    HidCoalesceTake(&Coalescer, &queue, out, 4, 50000);
+    Check("Cap no larger than the slack sends every report", passed);
+
+    // Turning coalescing off readies what is queued
+    HidCoalesceConfigure(&Coalescer, &queue, 8000, HID_COALESCE_MAX_REPORTS);
+    HidCoalescePush(&Coalescer, &queue, &event, 60000, &deadline);
+    passed = !queue.Ready;
+    HidCoalesceConfigure(&Coalescer, &queue, 0, HID_COALESCE_MAX_REPORTS);
+    passed = passed && queue.Ready && Coalescer.ReadyQueues == 1;
+    HidCoalesceDiscard(&Coalescer, &queue);
+    passed = passed && queue.Pending == 0 && Coalescer.ReadyQueues == 0;
+    Check("Coalescing off readies the queue; discard clears it", passed);
+
+    // Overrun
+    HidCoalesceConfigure(&Coalescer, &queue, 8000, HID_COALESCE_MAX_REPORTS);
+    for (i = 0; i < HID_COALESCE_MAX_REPORTS; i++) {
+        HidCoalescePush(&Coalescer, &queue, &event, 70000, &deadline);
+    }
+    passed = HidCoalescePush(&Coalescer, &queue, &event, 70000, &deadline) == STATUS_DEVICE_BUSY &&
+        Coalescer.Stats.Overruns == 1 && queue.Pending == HID_COALESCE_MAX_REPORTS;
+    Check("Full queue turns a report away as an overrun", passed);
+}
+
+int
+main(void)
+{
+    static RESULT base[SCENARIOS], coalesced[SCENARIOS];
+    ULONG s;
+    BOOLEAN bounded = TRUE, worst = TRUE, noLoss = TRUE, fewer = TRUE, clicks = TRUE;
+
+    printf("HID coalescing: %u s per scenario, cap %u us (slack %u us), flush at %u reports\n",
+        SECONDS, CAP_US, HID_COALESCE_SLACK_US, HID_COALESCE_MAX_REPORTS);
+    printf("=======================================================================================================\n");
+    printf("%-10s | %-10s | %-9s | %-8s | %-5s | %-6s | %-6s | %-6s | %-9s | %-9s | %s\n",
+        "SCENARIO", "MODE", "REPORTS/s", "COMPL/s", "RATIO", "p50 us", "p99 us", "MAX us",
+        "CLICK p99", "ADDED p99", "ADDED MAX");
+    printf("-------------------------------------------------------------------------------------------------------\n");
+
+    for (s = 0; s < SCENARIOS; s++) {
+        MakeArrivals(&Scenarios[s], 88);
+        Simulate(&Scenarios[s], 0, 87, &base[s]);
+        Simulate(&Scenarios[s], CAP_US, 87, &coalesced[s]);
+
+        PrintResult(Scenarios[s].Name, "per-report", &base[s], &base[s]);
+        PrintResult(Scenarios[s].Name, "coalesced", &coalesced[s], &base[s]);
+        printf("-------------------------------------------------------------------------------------------------------\n");
+
+        bounded = bounded && coalesced[s].AddedMaxUs <= CAP_US;
+        worst = worst && coalesced[s].MaxUs <= base[s].MaxUs + CAP_US;
+        noLoss = noLoss && base[s].Reports == ArrivalCount && coalesced[s].Reports == ArrivalCount &&
+            base[s].Overruns == 0 && coalesced[s].Overruns == 0;
+        if (s < 2) {
+            fewer = fewer && coalesced[s].Completions * 5 <= base[s].Completions;
+        } else {
+            fewer = fewer && coalesced[s].Completions < base[s].Completions;
+        }
+        clicks = clicks && coalesced[s].ClickP99Us <= base[s].ClickP99Us + 50;
+    }
+
+    printf("Latency: report arrival to completion of the read that carries it. CLICK: reports that\n");
+    printf("changed a button or key. RATIO: completions saved against one completion per report.\n");
+    printf("ADDED MAX: worst arrival to readied (or carried) plus the completion; the cap bounds it.\n\n");
+
+    Check("Added latency never exceeds the cap", bounded);
+    Check("Worst latency within the cap of per-report's worst", worst);
+    Check("Every report delivered, none overrun", noLoss);
+    Check("Completions cut fivefold at 8 kHz of reports", fewer);
+    Check("Click p99 within 50 us of per-report delivery", clicks);
+
+    CoalesceChecks();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,464 @@
+/*++
+
+Module Name:
+    iso_benchmark.c
+
+Abstract:
+    Load benchmark for the driver's LE Audio isochronous timeline
+    (MultiDeviceBTIsoTimeline.c). Three stream configurations (10 ms
+    SDUs in 10 ms events with RTN 2, 7.5 ms in 7.5 ms with RTN 1, and
+    framed 10 ms SDUs in 7.5 ms events) run for 120 s each under three
+    host loads. A load combines wake-up spikes of the real-time
+    scheduler thread, lateness of the producing encoder thread, and
+    queueing behind bulk ACL traffic on the shared best-effort path.
+
+    Every SDU goes out two ways:
+    - best-effort: when produced, FIFO behind the ACL traffic, judged
+      against the deadlines of a timeline started after the prefill
+    - iso lane: from the ring, through the real timeline, by a simulated
+      scheduler thread that wakes at each next release plus its wake-up
+      latency
+
+    The table gives the share of SDU intervals whose SDU reached the
+    controller before its ISO event's deadline. Checks cover slot
+    accounting, prefill, underruns, late and flushed SDUs, event
+    mapping and configuration validation.
+
+    Build (MSVC):
+        cl /O2 /I..\driver iso_benchmark.c ..\driver\MultiDeviceBTIsoTimeline.c
+
+    Build (Linux):
+        cc -O2 -I../driver iso_benchmark.c ../driver/MultiDeviceBTIsoTimeline.c -lm
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "MultiDeviceBTIsoTimeline.h"
+
+#define STREAM_SECONDS      120
+#define MAX_SDUS            (STREAM_SECONDS * 1000000 / 7500)
+#define PREFILL_SDUS        2
+#define WAKE_MEAN_US        40
+#define CONFIGS             3
+#define LOADS               3
+
+typedef struct _SPIKE {
+    double Probability;
+    double LowUs;
+    double HighUs;
+} SPIKE;
+
+typedef struct _LOAD {
+    const char* Name;
+    SPIKE RtSpike;              // Scheduler thread wake-up
+    double ProducerMeanUs;
+    SPIKE ProducerSpike;
+    double AclMeanUs;           // Best-effort path queueing
+    SPIKE AclBurst;
+} LOAD;
+
+typedef struct _CONFIG {
+    const char* Name;
+    ULONG SduIntervalUs;
+    USHORT IsoInterval;
+    UCHAR Framed;
+    UCHAR Rtn;
+} CONFIG;
+
+typedef struct _RESULT {
+    ULONG Slots;
+    ULONG OnTime;
+    ULONG Late;
+    ULONG Flushed;
+    ULONG Missed;
+    double LatencyMs;           // Nominal production of SDU 0 to its anchor
+} RESULT;
+
+static const CONFIG Configs[CONFIGS] = {
+    { "10ms RTN2",   10000, 8, FALSE, 2 },
+    { "7.5ms RTN1",  7500,  6, FALSE, 1 },
+    { "10ms/7.5 fr", 10000, 6, TRUE,  2 },
+};
+
+static const LOAD Loads[LOADS] = {
+    { "idle",   { 0.0005, 300, 1000 }, 200,  { 0.001, 1000, 3000 },  300,  { 0.0,  0,     0 } },
+    { "busy",   { 0.005, 500, 2000 },  1000, { 0.01, 2000, 12000 },  2000, { 0.02, 5000,  20000 } },
+    { "stress", { 0.02, 1000, 4000 },  2000, { 0.03, 5000, 25000 },  4000, { 0.05, 10000, 40000 } },
+};
+
+static LONGLONG Produced[MAX_SDUS];
+
+static unsigned int RandomState;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+// Uniform in [0, 1)
+static double
+Uniform(void)
+{
+    return (Random() & 0xFFFFFF) / 16777216.0;
+}
+
+static double
+Exponential(double Mean)
+{
+    return -Mean * log(1.0 - Uniform());
+}
+
+static double
+Spike(const SPIKE* Spike)
+{
+    if (Uniform() < Spike->Probability) {
+        return Spike->LowUs + (Spike->HighUs - Spike->LowUs) * Uniform();
+    }
+    return 0.0;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static ISO_STREAM_CONFIG
+MakeConfig(ULONG SduIntervalUs, USHORT IsoInterval, UCHAR Framed, UCHAR Rtn, ULONG Prefill)
+{
+    ISO_STREAM_CONFIG config;
+
+    memset(&config, 0, sizeof(config));
+    config.Type = IsoStreamCis;
+    config.Framed = Framed;
+    config.SduIntervalUs = SduIntervalUs;
+    config.IsoInterval = IsoInterval;
+    config.MaxSdu = 120;
+    config.BurstNumber = 2;
+    config.RetransmissionNumber = Rtn;
+    config.RingSdus = 16;
+    config.PrefillSdus = Prefill;
+    return config;
+}
+
+// Time each SDU reaches the driver from the encoder thread
+static VOID
+Produce(const LOAD* Load, ULONG Count, ULONG SduIntervalUs, unsigned int Seed)
+{
+    LONGLONG last = 0;
+    ULONG k;
+
+    RandomState = Seed;
+    for (k = 0; k < Count; k++) {
+        LONGLONG t = (LONGLONG)k * SduIntervalUs +
+            (LONGLONG)(Exponential(Load->ProducerMeanUs) + Spike(&Load->ProducerSpike));
+
+        // One producer: submissions stay in order
+        last = max(last, t);
+        Produced[k] = last;
+    }
+}
+
+/*++
+Routine Description:
+    Each SDU goes out when produced, queued behind ACL traffic. Its
+    deadlines come from a timeline started once the prefill would have
+    been produced, so it is allowed at least the iso lane's latency.
+--*/
+static VOID
+RunBestEffort(const ISO_STREAM_CONFIG* Config, const LOAD* Load, ULONG Count,
+    unsigned int Seed, RESULT* Result)
+{
+    ISO_TIMELINE timeline;
+    LONGLONG burstUntil = -1;
+    LONGLONG last = 0;
+    ULONG k;
+
+    memset(Result, 0, sizeof(*Result));
+    RandomState = Seed;
+
+    IsoTimelineInitialize(&timeline, Config, 1000000);
+    IsoTimelineAnchor(&timeline, (LONGLONG)Config->PrefillSdus * Config->SduIntervalUs);
+
+    for (k = 0; k < Count; k++) {
+        LONGLONG t = Produced[k];
+        LONGLONG delay;
+
+        if (t > burstUntil && Uniform() < Load->AclBurst.Probability) {
+            burstUntil = t + (LONGLONG)(Load->AclBurst.LowUs +
+                (Load->AclBurst.HighUs - Load->AclBurst.LowUs) * Uniform());
+        }
+
+        delay = (LONGLONG)Exponential(Load->AclMeanUs);
+        if (t <= burstUntil) {
+            delay += burstUntil - t;
+        }
+
+        // The ACL queue is FIFO
+        last = max(last, t + delay);
+
+        Result->Slots++;
+        if (last <= IsoTimelineDeadline(&timeline, k, 1)) {
+            Result->OnTime++;
+        } else if (last <= IsoTimelineDeadline(&timeline, k, timeline.FlushTimeout)) {
+            Result->Late++;
+        } else {
+            Result->Flushed++;
+        }
+    }
+
+    Result->LatencyMs = timeline.AnchorTicks / 1000.0;
+}
+
+/*++
+Routine Description:
+    The driver's lane: submissions fill the ring, and the scheduler
+    thread services the timeline at each next release plus its wake-up
+    latency, catching up on every slot that fell due meanwhile
+--*/
+static VOID
+RunIsoLane(const ISO_STREAM_CONFIG* Config, const LOAD* Load, ULONG Count,
+    unsigned int Seed, RESULT* Result)
+{
+    ISO_TIMELINE timeline;
+    ISO_SLOT_ACTION action;
+    ULONG64 event;
+    LONGLONG next;
+    LONGLONG now;
+    ULONG submitted = 0;
+    ULONG head = 0;
+
+    memset(Result, 0, sizeof(*Result));
+    RandomState = Seed;
+
+    IsoTimelineInitialize(&timeline, Config, 1000000);
+
+    now = Produced[0];
+    for (;;) {
+        while (submitted < Count && Produced[submitted] <= now) {
+            submitted++;
+        }
+
+        do {
+            action = IsoTimelineStep(&timeline, now, submitted - head, &event, &next);
+            if (action == IsoSlotSend || action == IsoSlotFlush) {
+                head++;
+            }
+        } while (action != IsoSlotIdle && timeline.Stats.Slots < Count);
+
+        if (timeline.Stats.Slots == Count) {
+            break;
+        }
+
+        if (next == MAXLONGLONG) {
+            // Waiting for the prefill: the submission that completes it wakes the thread
+            now = Produced[submitted];
+        } else {
+            now = next + (LONGLONG)(Exponential(WAKE_MEAN_US) + Spike(&Load->RtSpike));
+        }
+    }
+
+    Result->Slots = timeline.Stats.Slots;
+    Result->OnTime = timeline.Stats.SdusOnTime;
+    Result->Late = timeline.Stats.SdusLate;
+    Result->Flushed = timeline.Stats.SdusFlushed;
+    Result->Missed = timeline.Stats.SdusMissed;
+    Result->LatencyMs = timeline.AnchorTicks / 1000.0;
+}
+
+static double
+OnTimePercent(const RESULT* Result)
+{
+    return Result->OnTime * 100.0 / Result->Slots;
+}
+
+static VOID
+PrintResult(const char* Config, const char* Load, const char* Path, const RESULT* Result)
+{
+    printf("%-12s | %-6s | %-11s | %6.2f%% | %-6u | %-7u | %-6u | %.1f\n",
+        Config, Load, Path, OnTimePercent(Result), Result->Late, Result->Flushed,
+        Result->Missed, Result->LatencyMs);
+}
+
+/*++
+Routine Description:
+    Drives single timelines through hand-built situations
+--*/
+static VOID
+TimelineChecks(VOID)
+{
+    ISO_STREAM_CONFIG config;
+    ISO_TIMELINE timeline;
+    ISO_SLOT_ACTION action, action2;
+    ULONG64 event, event2;
+    LONGLONG next, next2, deadline;
+    BOOLEAN passed;
+
+    printf("\nTimeline checks\n");
+
+    // Validation
+    config = MakeConfig(7500, 8, FALSE, 2, 0);
+    passed = !NT_SUCCESS(IsoTimelineInitialize(&timeline, &config, 1000000));
+    config = MakeConfig(2500, 8, FALSE, 2, 0);
+    passed = passed && !NT_SUCCESS(IsoTimelineInitialize(&timeline, &config, 1000000));
+    config = MakeConfig(10000, 8, FALSE, 2, 0);
+    passed = passed && !NT_SUCCESS(IsoTimelineInitialize(&timeline, &config, 0));
+    config.IsoInterval = ISO_INTERVAL_MIN - 1;
+    passed = passed && !NT_SUCCESS(IsoTimelineInitialize(&timeline, &config, 1000000));
+    config = MakeConfig(7500, 8, TRUE, 2, 0);
+    passed = passed && NT_SUCCESS(IsoTimelineInitialize(&timeline, &config, 1000000));
+    Check("Bad interval, burst or clock rejected", passed);
+
+    // Flush timeout and latency derivation
+    config = MakeConfig(5000, 8, FALSE, 3, 0);
+    config.SyncDelayUs = 3000;
+    config.PresentationDelayUs = 40000;
+    IsoTimelineInitialize(&timeline, &config, 1000000);
+    passed = timeline.FlushTimeout == 4 && timeline.SdusPerEvent == 2 &&
+        timeline.MarginUs == ISO_DEFAULT_MARGIN_US &&
+        timeline.Stats.PresentationLatencyUs ==
+            ISO_DEFAULT_MARGIN_US + ISO_CONTROLLER_LEAD_US + 5000 + 3000 + 40000;
+    config.Type = IsoStreamBis;
+    IsoTimelineInitialize(&timeline, &config, 1000000);
+    passed = passed && timeline.FlushTimeout == 1;
+    config.FlushTimeout = 6;
+    IsoTimelineInitialize(&timeline, &config, 1000000);
+    passed = passed && timeline.FlushTimeout == 6;
+    Check("FT from RTN for CIS, 1 for BIS, explicit FT kept", passed);
+
+    // Prefill gates the anchor; SDU 0 goes out at once
+    config = MakeConfig(10000, 8, FALSE, 1, 2);
+    IsoTimelineInitialize(&timeline, &config, 1000000);
+    action = IsoTimelineStep(&timeline, 1000, 1, &event, &next);
+    passed = action == IsoSlotIdle && next == MAXLONGLONG && !timeline.Anchored;
+    action = IsoTimelineStep(&timeline, 5000, 2, &event, &next);
+    action2 = IsoTimelineStep(&timeline, 5000, 1, &event2, &next2);
+    passed = passed && action == IsoSlotSend && event == 0 &&
+        action2 == IsoSlotIdle && next2 == 15000 &&
+        timeline.Stats.SdusOnTime == 1 && timeline.Stats.Slots == 1;
+    Check("Prefill anchors the timeline; SDU 0 released on time", passed);
+
+    // Starved slot: missed, then rebuffers to the prefill
+    action = IsoTimelineStep(&timeline, 15000, 0, &event, &next);
+    passed = action == IsoSlotMissed && timeline.Stats.Underruns == 1;
+    action = IsoTimelineStep(&timeline, 25000, 1, &event, &next);
+    passed = passed && action == IsoSlotMissed && timeline.Stats.Underruns == 1;
+    action = IsoTimelineStep(&timeline, 35000, 2, &event, &next);
+    passed = passed && action == IsoSlotSend && event == 3 && timeline.Stats.SdusMissed == 2;
+    Check("Underrun is missed and rebuilds the prefill", passed);
+
+    // Late inside the flush timeout, then past it
+    config = MakeConfig(10000, 8, FALSE, 2, 0);
+    IsoTimelineInitialize(&timeline, &config, 1000000);
+    IsoTimelineAnchor(&timeline, 0);
+    deadline = IsoTimelineDeadline(&timeline, 0, 1);
+    action = IsoTimelineStep(&timeline, deadline + 1, 4, &event, &next);
+    passed = action == IsoSlotSend && timeline.Stats.SdusLate == 1 &&
+        deadline == ISO_DEFAULT_MARGIN_US;
+    deadline = IsoTimelineDeadline(&timeline, 1, timeline.FlushTimeout);
+    action = IsoTimelineStep(&timeline, deadline + 1, 4, &event, &next);
+    passed = passed && action == IsoSlotFlush && timeline.Stats.SdusFlushed == 1;
+    passed = passed && timeline.Stats.LatenessMaxUs == (ULONG)(deadline + 1 - 10000);
+    Check("Late within FT is sent, past FT is flushed", passed);
+
+    // Unframed: two SDUs per event share its deadline
+    config = MakeConfig(5000, 8, FALSE, 1, 0);
+    IsoTimelineInitialize(&timeline, &config, 1000000);
+    IsoTimelineAnchor(&timeline, 0);
+    passed = IsoTimelineDeadline(&timeline, 0, 1) == IsoTimelineDeadline(&timeline, 1, 1) &&
+        IsoTimelineDeadline(&timeline, 1, 1) == 5000 + ISO_DEFAULT_MARGIN_US &&
+        IsoTimelineDeadline(&timeline, 2, 1) == IsoTimelineDeadline(&timeline, 0, 1) + 10000;
+    action = IsoTimelineStep(&timeline, 0, 2, &event, &next);
+    action2 = IsoTimelineStep(&timeline, 5000, 1, &event2, &next);
+    passed = passed && action == IsoSlotSend && action2 == IsoSlotSend &&
+        event == 0 && event2 == 0 && timeline.Stats.SdusOnTime == 2;
+    Check("Unframed: both SDUs of an event are on time", passed);
+
+    // Framed: 10 ms SDUs in 7.5 ms events skip an event now and then
+    config = MakeConfig(10000, 6, TRUE, 1, 0);
+    IsoTimelineInitialize(&timeline, &config, 1000000);
+    IsoTimelineAnchor(&timeline, 0);
+    passed = IsoTimelineDeadline(&timeline, 1, 1) - IsoTimelineDeadline(&timeline, 0, 1) == 15000 &&
+        IsoTimelineDeadline(&timeline, 3, 1) - IsoTimelineDeadline(&timeline, 0, 1) == 30000;
+    Check("Framed: SDU lands in the first event after release", passed);
+}
+
+int
+main(void)
+{
+    static RESULT best[CONFIGS][LOADS];
+    static RESULT iso[CONFIGS][LOADS];
+    ULONG c, l;
+    BOOLEAN accounted = TRUE, better = TRUE, idleClean = TRUE, noFlush = TRUE, stressHolds = TRUE;
+
+    printf("Isochronous scheduling: %u s per stream, prefill %u SDUs, margin %u us, controller lead %u us\n",
+        STREAM_SECONDS, PREFILL_SDUS, ISO_DEFAULT_MARGIN_US, ISO_CONTROLLER_LEAD_US);
+    printf("============================================================================================\n");
+    printf("%-12s | %-6s | %-11s | %-7s | %-6s | %-7s | %-6s | %s\n",
+        "CONFIG", "LOAD", "PATH", "ON-TIME", "LATE", "FLUSHED", "MISSED", "LATENCY ms");
+    printf("--------------------------------------------------------------------------------------------\n");
+
+    for (c = 0; c < CONFIGS; c++) {
+        const CONFIG* cfg = &Configs[c];
+        ISO_STREAM_CONFIG config =
+            MakeConfig(cfg->SduIntervalUs, cfg->IsoInterval, cfg->Framed, cfg->Rtn, PREFILL_SDUS);
+        ULONG count = STREAM_SECONDS * 1000000 / cfg->SduIntervalUs;
+
+        for (l = 0; l < LOADS; l++) {
+            RESULT* b = &best[c][l];
+            RESULT* i = &iso[c][l];
+
+            Produce(&Loads[l], count, cfg->SduIntervalUs, 85);
+            RunBestEffort(&config, &Loads[l], count, 86, b);
+            RunIsoLane(&config, &Loads[l], count, 87, i);
+
+            PrintResult(cfg->Name, Loads[l].Name, "best-effort", b);
+            PrintResult(cfg->Name, Loads[l].Name, "iso lane", i);
+
+            accounted = accounted && i->Slots == count &&
+                i->OnTime + i->Late + i->Flushed + i->Missed == i->Slots;
+            better = better && i->OnTime >= b->OnTime;
+            noFlush = noFlush && i->Flushed == 0;
+            if (l == 0) {
+                idleClean = idleClean && OnTimePercent(i) >= 99.9;
+            } else if (l == LOADS - 1) {
+                stressHolds = stressHolds &&
+                    (100.0 - OnTimePercent(i)) * 5 <= 100.0 - OnTimePercent(b);
+            }
+        }
+        printf("--------------------------------------------------------------------------------------------\n");
+    }
+
+    printf("ON-TIME: SDUs at the controller before their ISO event's deadline, per SDU interval.\n");
+    printf("LATE: inside the flush timeout with fewer retransmissions; FLUSHED: dropped by the controller;\n");
+    printf("MISSED: ring empty at release. LATENCY: nominal production of SDU 0 to its anchor.\n\n");
+
+    Check("Every iso lane slot ends exactly one way", accounted);
+    Check("Iso lane on time at least as often as best-effort", better);
+    Check("Iso lane at least 99.9% on time when idle", idleClean);
+    Check("Iso lane never waits past the flush timeout", noFlush);
+    Check("Iso lane misses 5x fewer deadlines under stress", stressHolds);
+
+    TimelineChecks();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,464 @@
+/*++
+
+Module Name:
+    jitter_benchmark.c
+
+Abstract:
+    Trace-driven benchmark for the driver's inbound audio jitter buffer
+    (MultiDeviceBTJitterBuffer.c). A microphone stream of 10 ms frames
+    arrives with a 4 ms base delay plus exponential jitter, under four
+    synthetic radio conditions:
+    - clean: 0.2% loss
+    - coex: Wi-Fi coexistence lends the radio away for 20-60 ms bursts
+    - reorder: a fifth of the frames take a 12 or 25 ms detour, 1% loss
+    - lossy: up to 15 ms of extra delay, 5% loss
+    A CSV trace of media_timestamp_us,arrival_us replaces them when its
+    path is given.
+
+    Each trace is replayed through fixed depths of 1, 2, 4 and 8 frames
+    and through the adaptive policy, with the reader pulling one frame
+    per period from the first arrival. The table gives the playout
+    latency against the glitch rate (periods without a real frame once
+    playout started). Checks cover ordering, concealment, duplicates,
+    overruns and bad input.
+
+    Build (MSVC):
+        cl /O2 /I..\driver jitter_benchmark.c ..\driver\MultiDeviceBTJitterBuffer.c
+
+    Build (Linux):
+        cc -O2 -I../driver jitter_benchmark.c ../driver/MultiDeviceBTJitterBuffer.c -lm
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "MultiDeviceBTJitterBuffer.h"
+
+#define FRAME_US            10000
+#define FRAME_BYTES         40
+#define STREAM_SECONDS      120
+#define MAX_FRAMES          (STREAM_SECONDS * 1000000 / FRAME_US)
+#define MAX_TRACE           (1 << 20)
+#define ADAPTIVE_MAX_US     200000
+#define TRACE_KINDS         4
+#define POLICIES            5
+
+typedef struct _ARRIVAL {
+    LONGLONG MediaUs;
+    LONGLONG ArrivalUs;
+} ARRIVAL;
+
+typedef struct _POLICY {
+    const char* Name;
+    ULONG MinDelayUs;
+    ULONG MaxDelayUs;
+} POLICY;
+
+static const POLICY Policies[POLICIES] = {
+    { "fixed 1",  1 * FRAME_US, 1 * FRAME_US },
+    { "fixed 2",  2 * FRAME_US, 2 * FRAME_US },
+    { "fixed 4",  4 * FRAME_US, 4 * FRAME_US },
+    { "fixed 8",  8 * FRAME_US, 8 * FRAME_US },
+    { "adaptive", FRAME_US, ADAPTIVE_MAX_US },
+};
+
+static const char* TraceName[TRACE_KINDS] = { "clean", "coex", "reorder", "lossy" };
+
+typedef struct _RESULT {
+    double MeanMs;
+    double P95Ms;
+    double Glitch;              // Share of periods after playout started
+    ULONG Underruns;
+    ULONG Late;
+    ULONG Overruns;
+    ULONG Depth;                // Target frames at the end
+    BOOLEAN InOrder;            // Media time rose and every payload was intact
+} RESULT;
+
+static ARRIVAL Trace[MAX_TRACE];
+static ULONG TraceLength;
+static double Latency[MAX_TRACE];
+static JITTER_SLOT Slots[JITTER_SLOTS];
+static JITTER_BUFFER Buffer;
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+// Uniform in [0, 1)
+static double
+Uniform(void)
+{
+    return (Random() & 0xFFFFFF) / 16777216.0;
+}
+
+static double
+Exponential(double Mean)
+{
+    return -Mean * log(1.0 - Uniform());
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static int
+CompareArrival(const void* A, const void* B)
+{
+    const ARRIVAL* a = (const ARRIVAL*)A;
+    const ARRIVAL* b = (const ARRIVAL*)B;
+
+    if (a->ArrivalUs != b->ArrivalUs) {
+        return a->ArrivalUs < b->ArrivalUs ? -1 : 1;
+    }
+    return a->MediaUs < b->MediaUs ? -1 : a->MediaUs > b->MediaUs;
+}
+
+static int
+CompareDouble(const void* A, const void* B)
+{
+    double a = *(const double*)A, b = *(const double*)B;
+
+    return a < b ? -1 : a > b;
+}
+
+// Synthetic microphone stream, sorted by arrival
+static VOID
+MakeTrace(ULONG Kind)
+{
+    LONGLONG burstUntil = -1;
+    ULONG k;
+
+    RandomState = 0x2545F491 + Kind;
+    TraceLength = 0;
+
+    for (k = 0; k < MAX_FRAMES; k++) {
+        LONGLONG sent = (LONGLONG)k * FRAME_US;
+        double delay = 4000 + Exponential(1500.0);
+        double loss;
+
+        switch (Kind) {
+        case 0:
+            loss = 0.002;
+            break;
+        case 1:
+            // The radio is lent away for 20-60 ms bursts
+            if (sent > burstUntil && Uniform() < 0.01) {
+                burstUntil = sent + 20000 + Random() % 40001;
+            }
+            if (sent <= burstUntil) {
+                delay += (double)(burstUntil - sent);
+            }
+            loss = 0.005;
+            break;
+        case 2:
+            switch (Random() % 5) {
+            case 3:
+                delay += 12000;
+                break;
+            case 4:
+                delay += 25000;
+                break;
+            }
+            loss = 0.01;
+            break;
+        default:
+            delay += Uniform() * 15000;
+            loss = 0.05;
+            break;
+        }
+
+        if (Uniform() >= loss) {
+            Trace[TraceLength].MediaUs = sent;
+            Trace[TraceLength].ArrivalUs = sent + (LONGLONG)delay;
+            TraceLength++;
+        }
+    }
+
+    qsort(Trace, TraceLength, sizeof(ARRIVAL), CompareArrival);
+}
+
+static BOOLEAN
+LoadTrace(const char* Path)
+{
+    FILE* file = fopen(Path, "r");
+    char line[256];
+    long long media, arrival;
+
+    if (file == NULL) {
+        return FALSE;
+    }
+
+    TraceLength = 0;
+    while (TraceLength < MAX_TRACE && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%lld,%lld", &media, &arrival) != 2) {
+            continue;
+        }
+        Trace[TraceLength].MediaUs = media;
+        Trace[TraceLength].ArrivalUs = arrival;
+        TraceLength++;
+    }
+    fclose(file);
+
+    qsort(Trace, TraceLength, sizeof(ARRIVAL), CompareArrival);
+    return TraceLength > 0;
+}
+
+// Frame payload: its media timestamp, repeated
+static VOID
+FillFrame(UCHAR* Frame, LONGLONG MediaUs)
+{
+    ULONG i;
+
+    for (i = 0; i + sizeof(LONGLONG) <= FRAME_BYTES; i += sizeof(LONGLONG)) {
+        memcpy(Frame + i, &MediaUs, sizeof(LONGLONG));
+    }
+}
+
+static BOOLEAN
+FrameIntact(const UCHAR* Frame, ULONG Length, LONGLONG MediaUs)
+{
+    UCHAR expected[FRAME_BYTES];
+
+    FillFrame(expected, MediaUs);
+    return Length == FRAME_BYTES && memcmp(Frame, expected, FRAME_BYTES) == 0;
+}
+
+// Replays the arrivals; the reader pulls one frame per period
+static VOID
+Run(const POLICY* Policy, RESULT* Result)
+{
+    JITTER_PLAYOUT_HEADER header;
+    UCHAR frame[FRAME_BYTES];
+    UCHAR payload[JITTER_FRAME_MAX_BYTES];
+    LONGLONG now, end, lastMedia = -1;
+    ULONG i = 0, played = 0, periods = 0, glitches = 0;
+    BOOLEAN started = FALSE;
+    double sum = 0;
+
+    memset(Result, 0, sizeof(*Result));
+    Result->InOrder = TRUE;
+
+    JitterBufferInitialize(&Buffer, FRAME_US, Policy->MinDelayUs, Policy->MaxDelayUs, Slots);
+
+    now = Trace[0].ArrivalUs;
+    end = Trace[TraceLength - 1].ArrivalUs + 20 * FRAME_US;
+
+    for (; now <= end; now += FRAME_US) {
+        while (i < TraceLength && Trace[i].ArrivalUs <= now) {
+            FillFrame(frame, Trace[i].MediaUs);
+            JitterBufferInsert(&Buffer, Trace[i].MediaUs, Trace[i].ArrivalUs, frame, FRAME_BYTES);
+            i++;
+        }
+
+        JitterBufferPlayout(&Buffer, &header, payload);
+
+        if (header.Flags == 0 || header.Flags == JITTER_FRAME_AFTER_GAP) {
+            started = TRUE;
+            if (header.Timestamp <= lastMedia ||
+                !FrameIntact(payload, header.Length, header.Timestamp)) {
+                Result->InOrder = FALSE;
+            }
+            lastMedia = header.Timestamp;
+            Latency[played] = (now - header.Timestamp) / 1000.0;
+            sum += Latency[played];
+            played++;
+        } else if (started) {
+            glitches++;
+        }
+        if (started) {
+            periods++;
+        }
+    }
+
+    if (played > 0) {
+        qsort(Latency, played, sizeof(double), CompareDouble);
+        Result->MeanMs = sum / played;
+        Result->P95Ms = Latency[played * 95 / 100];
+    }
+    Result->Glitch = (double)glitches / max(periods, 1);
+    Result->Underruns = Buffer.Stats.Underruns;
+    Result->Late = Buffer.Stats.FramesLate;
+    Result->Overruns = Buffer.Stats.Overruns;
+    Result->Depth = Buffer.TargetFrames;
+}
+
+static VOID
+PrintResult(const char* Trace, const char* Policy, const RESULT* Result)
+{
+    printf("%-10s | %-9s | %7.1f | %7.1f | %6.2f%% | %9u | %5u | %u\n", Trace, Policy,
+        Result->MeanMs, Result->P95Ms, Result->Glitch * 100, Result->Underruns,
+        Result->Late, Result->Depth);
+}
+
+//
+// Buffer checks on crafted arrivals
+//
+
+static VOID
+Insert(LONGLONG MediaUs, LONGLONG ArrivalUs)
+{
+    UCHAR frame[FRAME_BYTES];
+
+    FillFrame(frame, MediaUs);
+    JitterBufferInsert(&Buffer, MediaUs, ArrivalUs, frame, FRAME_BYTES);
+}
+
+static VOID
+BufferChecks(void)
+{
+    JITTER_PLAYOUT_HEADER header;
+    JITTER_STREAM_STATS stats;
+    UCHAR payload[JITTER_FRAME_MAX_BYTES];
+    UCHAR big[JITTER_FRAME_MAX_BYTES + 1];
+    LONGLONG media;
+    BOOLEAN ordered = TRUE, repeats;
+
+    printf("\nBuffer checks\n");
+
+    Check("Frame shorter than JITTER_MIN_FRAME_US is refused",
+        JitterBufferInitialize(&Buffer, JITTER_MIN_FRAME_US - 1, 0, 0, Slots) ==
+        STATUS_INVALID_PARAMETER);
+    Check("Minimum delay above the maximum is refused",
+        JitterBufferInitialize(&Buffer, FRAME_US, 2 * FRAME_US, FRAME_US, Slots) ==
+        STATUS_INVALID_PARAMETER);
+
+    JitterBufferInitialize(&Buffer, FRAME_US, 4 * FRAME_US, 4 * FRAME_US, Slots);
+    memset(big, 0, sizeof(big));
+    Check("Frame over JITTER_FRAME_MAX_BYTES is refused",
+        JitterBufferInsert(&Buffer, 0, 0, big, sizeof(big)) == STATUS_INVALID_BUFFER_SIZE &&
+        Buffer.Stats.FramesReceived == 0);
+
+    // Frames 0-5 arrive as 0 2 1 3 5 4, with 3 twice
+    Insert(0, 5000);
+    Insert(2 * FRAME_US, 5100);
+    Insert(1 * FRAME_US, 5200);
+    Insert(3 * FRAME_US, 5300);
+    Insert(3 * FRAME_US, 5400);
+    Insert(5 * FRAME_US, 5500);
+    Insert(4 * FRAME_US, 5600);
+    Check("A duplicate is counted and dropped",
+        Buffer.Stats.FramesDuplicate == 1 && Buffer.Stats.FramesReceived == 6);
+    for (media = 0; media < 6 * FRAME_US; media += FRAME_US) {
+        JitterBufferPlayout(&Buffer, &header, payload);
+        ordered = ordered && header.Flags == 0 && header.Timestamp == media &&
+            FrameIntact(payload, header.Length, media);
+    }
+    Check("Reordered frames play in media-time order", ordered);
+
+    // Frame 7 lost, 8 and 9 in time: 6 plays, 7 repeats 6, 8 follows the gap
+    Insert(6 * FRAME_US, 65000);
+    Insert(8 * FRAME_US, 85000);
+    Insert(9 * FRAME_US, 95000);
+    JitterBufferPlayout(&Buffer, &header, payload);
+    JitterBufferPlayout(&Buffer, &header, payload);
+    repeats = header.Flags == JITTER_FRAME_CONCEALED && header.Timestamp == 7 * FRAME_US &&
+        FrameIntact(payload, header.Length, 6 * FRAME_US);
+    Check("A lost frame repeats the last good one", repeats);
+    JitterBufferPlayout(&Buffer, &header, payload);
+    Check("  and the next frame is flagged as after the gap",
+        header.Flags == JITTER_FRAME_AFTER_GAP && header.Timestamp == 8 * FRAME_US);
+
+    // Frame 7 shows up after its slot was concealed
+    Insert(7 * FRAME_US, 100000);
+    Check("A frame behind playout counts as late",
+        Buffer.Stats.FramesLate == 1 && Buffer.Stats.FramesConcealed == 1);
+
+    // Nothing after 9: playing it empties the buffer and the next period rebuffers
+    JitterBufferPlayout(&Buffer, &header, payload);
+    JitterBufferPlayout(&Buffer, &header, payload);
+    Check("Running dry counts an underrun", Buffer.Stats.Underruns == 1 && !Buffer.Playing);
+
+    // A frame a whole ring ahead pushes playout forward
+    Insert((10 + JITTER_SLOTS) * (LONGLONG)FRAME_US, 200000);
+    Check("A frame a ring ahead counts an overrun", Buffer.Stats.Overruns == 1);
+
+    JitterBufferGetStats(&Buffer, &stats);
+    Check("Stats report the target delay",
+        stats.TargetDelayUs == Buffer.TargetFrames * FRAME_US && stats.DeviceAddress == 0);
+}
+
+int
+main(int argc, char** argv)
+{
+    static RESULT results[TRACE_KINDS][POLICIES];
+    ULONG t, p;
+    BOOLEAN ordered = TRUE, fewerGlitches = TRUE, halfGlitches = TRUE;
+    BOOLEAN shorter = TRUE, counters = TRUE;
+
+    printf("Jitter buffer benchmark: %.1f ms frames, %u s per synthetic trace\n",
+        FRAME_US / 1000.0, STREAM_SECONDS);
+    printf("==================================================================================\n");
+    printf("%-10s | %-9s | %-7s | %-7s | %-7s | %-9s | %-5s | %s\n",
+        "TRACE", "POLICY", "MEAN ms", "P95 ms", "GLITCH", "UNDERRUNS", "LATE", "DEPTH");
+    printf("----------------------------------------------------------------------------------\n");
+
+    if (argc > 1) {
+        if (!LoadTrace(argv[1])) {
+            printf("%s: no media_timestamp_us,arrival_us lines\n", argv[1]);
+            return 1;
+        }
+        for (p = 0; p < POLICIES; p++) {
+            Run(&Policies[p], &results[0][p]);
+            PrintResult(argv[1], Policies[p].Name, &results[0][p]);
+        }
+        return 0;
+    }
+
+    for (t = 0; t < TRACE_KINDS; t++) {
+        MakeTrace(t);
+        for (p = 0; p < POLICIES; p++) {
+            Run(&Policies[p], &results[t][p]);
+            PrintResult(TraceName[t], Policies[p].Name, &results[t][p]);
+            ordered = ordered && results[t][p].InOrder;
+        }
+        printf("----------------------------------------------------------------------------------\n");
+
+        // Adaptive against the shallowest and the deepest fixed depth
+        fewerGlitches = fewerGlitches &&
+            results[t][POLICIES - 1].Glitch <= results[t][0].Glitch;
+        if (t == 1 || t == 2) {
+            halfGlitches = halfGlitches &&
+                results[t][POLICIES - 1].Glitch * 2 < results[t][0].Glitch;
+        }
+        shorter = shorter && results[t][POLICIES - 1].MeanMs < results[t][3].MeanMs;
+        counters = counters && (t == 0 || results[t][0].Underruns > 0);
+    }
+
+    printf("GLITCH: playout periods without a real frame after playout started (loss + late + rebuffer).\n");
+    printf("DEPTH: playout depth in frames at the end of the trace.\n\n");
+
+    Check("Frames play in media-time order, payloads intact", ordered);
+    Check("Adaptive glitches at most a fixed 1-frame depth's", fewerGlitches);
+    Check("  and under half of them with coex or reordering", halfGlitches);
+    Check("Adaptive latency below a fixed 8-frame depth", shorter);
+    Check("Underruns are counted on the rough traces", counters);
+
+    BufferChecks();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,524 @@
+/*++
+
+Module Name:
+    mesh_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's Bluetooth Mesh network layer
+    (MultiDeviceBTMeshNet.c), the same code the submit, relay fetch and
+    proxy IOCTLs run.
+
+    Checks first: duplicates and replays, TTL handling, unicast and
+    group delivery, the IV update window, proxy accept lists, a proxy
+    disconnect dropping what was queued for it, a full relay queue and
+    message cache eviction.
+
+    Then a building of 200 nodes, each with its own network layer,
+    floods 500 sensor messages to the gateway over a lossy advertising
+    bearer. Every node's relayed copies are taken from its queue and
+    heard by the nodes in range one step later, so the cache and TTL
+    rules alone bound the flood. For relay ratios from 1 to 0.15 the
+    report gives delivery, hops, transmissions per message and the
+    busiest relay's load (mesh_simulation.py models the same building
+    in Python with timing). Host CPU per PDU is measured last.
+
+    Build (MSVC):
+        cl /O2 /I..\driver mesh_benchmark.c ..\driver\MultiDeviceBTMeshNet.c
+
+    Build (Linux):
+        cc -O2 -I../driver mesh_benchmark.c ../driver/MultiDeviceBTMeshNet.c -lm
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "MultiDeviceBTMeshNet.h"
+
+#define NODES               200
+#define MESSAGES            500
+#define AREA_WIDTH_M        120.0
+#define AREA_HEIGHT_M       80.0
+#define RADIO_RANGE_M       22.0
+#define LOSS_PERCENT        5
+#define GATEWAY             0
+#define DEFAULT_TTL         7
+#define PDU_LENGTH          18          // Header, 5 bytes of transport PDU, NetMIC
+#define MAX_RECEPTIONS      262144
+#define CPU_ROUNDS          2000000
+
+typedef struct _NODE {
+    double X;
+    double Y;
+    BOOLEAN Relay;
+    ULONG NeighborCount;
+    USHORT Neighbors[NODES];
+    ULONG Relayed;
+    ULONG Seq;
+} NODE;
+
+// A PDU one node hears, processed on the next step
+typedef struct _RECEPTION {
+    USHORT Node;
+    UCHAR Pdu[PDU_LENGTH];
+} RECEPTION;
+
+static NODE Nodes[NODES];
+static MESH_NETWORK Net[NODES];
+static RECEPTION Pending[2][MAX_RECEPTIONS];
+static ULONG PendingCount[2];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static ULONG
+BuildPdu(UCHAR* Pdu, ULONG IvIndex, UCHAR Ttl, ULONG Seq, USHORT Src, USHORT Dst)
+{
+    ULONG i;
+
+    Pdu[0] = (UCHAR)(((IvIndex & 1) << 7) | 0x21);
+    Pdu[1] = Ttl;
+    Pdu[2] = (UCHAR)(Seq >> 16);
+    Pdu[3] = (UCHAR)(Seq >> 8);
+    Pdu[4] = (UCHAR)Seq;
+    Pdu[5] = (UCHAR)(Src >> 8);
+    Pdu[6] = (UCHAR)Src;
+    Pdu[7] = (UCHAR)(Dst >> 8);
+    Pdu[8] = (UCHAR)Dst;
+    for (i = MESH_NETWORK_HEADER_SIZE; i < PDU_LENGTH; i++) {
+        Pdu[i] = (UCHAR)(Seq + i);
+    }
+    return PDU_LENGTH;
+}
+
+static VOID
+Configure(PMESH_NETWORK Mesh, USHORT Address, BOOLEAN Relay, BOOLEAN Proxy, ULONG IvIndex)
+{
+    MESH_CONFIG config;
+
+    RtlZeroMemory(&config, sizeof(config));
+    config.Enable = TRUE;
+    config.RelayEnabled = Relay;
+    config.ProxyEnabled = Proxy;
+    config.DefaultTtl = DEFAULT_TTL;
+    config.PrimaryAddress = Address;
+    config.ElementCount = 1;
+    config.RelayRetransmitCount = 1;
+    config.IvIndex = IvIndex;
+
+    MeshNetInitialize(Mesh);
+    MeshNetConfigure(Mesh, &config);
+}
+
+//
+// Network layer rules
+//
+
+static VOID
+NetworkChecks(VOID)
+{
+    static MESH_NETWORK mesh;
+    MESH_CONFIG config;
+    MESH_RELAY_ITEM item;
+    UCHAR pdu[MESH_NETWORK_PDU_MAX];
+    ULONG length, result, proxy, other, i;
+    BOOLEAN ok;
+
+    printf("Network layer:\n");
+
+    Configure(&mesh, 0x0001, TRUE, TRUE, 4);
+
+    length = BuildPdu(pdu, 4, 5, 100, 0x0020, MESH_ADDR_ALL_NODES);
+    result = MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    Check("All-nodes PDU delivered and relayed",
+        result == (MESH_RESULT_DELIVERED | MESH_RESULT_RELAYED));
+    Check("Same PDU again is a duplicate",
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0) == MESH_RESULT_DUPLICATE);
+    length = BuildPdu(pdu, 4, 5, 99, 0x0020, MESH_ADDR_ALL_NODES);
+    Check("Older SEQ from the same source is a replay",
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0) == MESH_RESULT_DUPLICATE);
+
+    ok = MeshNetDequeue(&mesh, &item);
+    Check("Relayed copy has the TTL decremented",
+        ok && item.Bearer == MeshBearerAdvertising && item.Pdu[1] == 4 && item.Transmissions == 2);
+    Check("  and the rest of the PDU untouched",
+        ok && item.Length == PDU_LENGTH && item.Pdu[2] == 0 && item.Pdu[4] == 100 &&
+        item.Pdu[PDU_LENGTH - 1] == (UCHAR)(100 + PDU_LENGTH - 1));
+    Check("Queue empty after one dequeue", !MeshNetDequeue(&mesh, &item));
+
+    length = BuildPdu(pdu, 4, 1, 1, 0x0021, 0x0050);
+    result = MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    Check("TTL 1 PDU for another node is dropped",
+        result == MESH_RESULT_DROPPED && mesh.Stats.DroppedTtl == 1);
+
+    length = BuildPdu(pdu, 4, 5, 2, 0x0021, 0x0001);
+    result = MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    Check("Unicast PDU for us is delivered, not relayed",
+        result == MESH_RESULT_DELIVERED && !MeshNetDequeue(&mesh, &item));
+
+    length = BuildPdu(pdu, 4, 5, 3, 0x0001, MESH_ADDR_ALL_NODES);
+    Check("Our own PDU echoed back is dropped",
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0) == MESH_RESULT_DUPLICATE);
+
+    config = mesh.Config;
+    config.SubscriptionCount = 1;
+    config.Subscriptions[0] = 0xC010;
+    Check("Subscription added", NT_SUCCESS(MeshNetConfigure(&mesh, &config)));
+    length = BuildPdu(pdu, 4, 5, 4, 0x0021, 0xC010);
+    result = MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    Check("Subscribed group is delivered and relayed",
+        result == (MESH_RESULT_DELIVERED | MESH_RESULT_RELAYED) && MeshNetDequeue(&mesh, &item));
+
+    length = BuildPdu(pdu, 3, 5, 5, 0x0022, 0xC011);
+    result = MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    Check("Previous IV index accepted during an IV update",
+        result == MESH_RESULT_RELAYED && MeshNetDequeue(&mesh, &item));
+
+    config.IvIndex = 3;
+    Check("IV index never moves back", !NT_SUCCESS(MeshNetConfigure(&mesh, &config)));
+    config.IvIndex = 4;
+    config.PrimaryAddress = 0xC000;
+    Check("Group primary address refused", !NT_SUCCESS(MeshNetConfigure(&mesh, &config)));
+    config.PrimaryAddress = 0x0001;
+
+    length = BuildPdu(pdu, 4, 5, 6, 0x0021, 0xC012);
+    pdu[5] = 0xC0;
+    Check("Group source address is malformed",
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0) == MESH_RESULT_DROPPED &&
+        mesh.Stats.DroppedMalformed == 1);
+    Check("Short PDU is malformed",
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, MESH_NETWORK_HEADER_SIZE - 1, 0) ==
+            MESH_RESULT_DROPPED);
+
+    // Proxy clients
+    ok = NT_SUCCESS(MeshNetProxyConnect(&mesh, 0x001122334455ULL, &proxy)) &&
+        NT_SUCCESS(MeshNetProxyAddFilter(&mesh, proxy, 0xC020)) &&
+        NT_SUCCESS(MeshNetProxyConnect(&mesh, 0x001122334466ULL, &other));
+    Check("Two proxy clients connected", ok && proxy != other);
+
+    length = BuildPdu(pdu, 4, 5, 7, 0x0021, 0xC020);
+    result = MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    Check("Filtered group goes to its proxy client",
+        result == (MESH_RESULT_RELAYED | MESH_RESULT_PROXIED));
+    ok = MeshNetDequeue(&mesh, &item) && item.Bearer == MeshBearerAdvertising &&
+        MeshNetDequeue(&mesh, &item) && item.Bearer == MeshBearerProxy && item.ProxyIndex == proxy &&
+        item.Transmissions == 1 && !MeshNetDequeue(&mesh, &item);
+    Check("  and to no other client", ok);
+
+    length = BuildPdu(pdu, 4, 5, 1, 0x0030, 0xC020);
+    result = MeshNetProcess(&mesh, MeshBearerProxy, proxy, pdu, length, 0);
+    Check("Client's own PDU bridged, not sent back to it",
+        result == MESH_RESULT_RELAYED && MeshNetDequeue(&mesh, &item) &&
+        item.Bearer == MeshBearerAdvertising && !MeshNetDequeue(&mesh, &item));
+
+    length = BuildPdu(pdu, 4, 5, 8, 0x0021, 0xC020);
+    MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    Check("Disconnect succeeds", NT_SUCCESS(MeshNetProxyDisconnect(&mesh, proxy)));
+    ok = MeshNetDequeue(&mesh, &item) && item.Bearer == MeshBearerAdvertising &&
+        !MeshNetDequeue(&mesh, &item);
+    Check("  and drops what was queued for the client", ok);
+    Check("Second disconnect refused", !NT_SUCCESS(MeshNetProxyDisconnect(&mesh, proxy)));
+    Check("Filter on a free slot refused", !NT_SUCCESS(MeshNetProxyAddFilter(&mesh, proxy, 0xC021)));
+
+    // Queue limit
+    for (i = 0; i < MESH_RELAY_QUEUE_SIZE + 8; i++) {
+        length = BuildPdu(pdu, 4, 5, 1, (USHORT)(0x0100 + i), MESH_ADDR_ALL_NODES);
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    }
+    Check("Full relay queue counts what it refuses", mesh.Stats.RelayQueueFull == 8);
+    for (i = 0; MeshNetDequeue(&mesh, &item); i++) {
+    }
+    Check("  and holds exactly its size", i == MESH_RELAY_QUEUE_SIZE);
+
+    // Cache eviction: far more sources than slots
+    Configure(&mesh, 0x0001, FALSE, FALSE, 0);
+    for (i = 0; i < 4 * MESH_MESSAGE_CACHE_SIZE; i++) {
+        length = BuildPdu(pdu, 0, 5, 1, (USHORT)(0x0002 + i), MESH_ADDR_ALL_NODES);
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0);
+    }
+    Check("Overfull cache evicts instead of refusing",
+        mesh.Stats.CacheEvictions > 0 && mesh.Stats.Delivered == 4 * MESH_MESSAGE_CACHE_SIZE);
+    length = BuildPdu(pdu, 0, 5, 1, (USHORT)(0x0002 + 4 * MESH_MESSAGE_CACHE_SIZE - 1), MESH_ADDR_ALL_NODES);
+    Check("Most recent source still caught as a replay",
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0) == MESH_RESULT_DUPLICATE);
+
+    config = mesh.Config;
+    config.IvIndex = 2;
+    MeshNetConfigure(&mesh, &config);
+    length = BuildPdu(pdu, 2, 5, 1, 0x0002, MESH_ADDR_ALL_NODES);
+    Check("IV index jump clears the replay state",
+        MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, length, 0) == MESH_RESULT_DELIVERED);
+}
+
+//
+// Building flood
+//
+
+typedef struct _FLOOD_RESULT {
+    ULONG Relays;
+    ULONG Delivered;
+    ULONG Hops[MESSAGES];
+    ULONG64 Transmissions;
+    ULONG RelayMax;
+    double RelayAverage;
+    BOOLEAN Bounded;
+} FLOOD_RESULT;
+
+static VOID
+BuildBuilding(double RelayRatio)
+{
+    ULONG a, b;
+
+    RandomState = 76;
+    for (a = 0; a < NODES; a++) {
+        NODE* node = &Nodes[a];
+
+        if (a == GATEWAY) {
+            node->X = 0.0;
+            node->Y = AREA_HEIGHT_M / 2;
+        } else {
+            node->X = (Random() % 12000) / 100.0;
+            node->Y = (Random() % 8000) / 100.0;
+        }
+        node->Relay = a == GATEWAY || (Random() % 1000) < RelayRatio * 1000;
+        node->NeighborCount = 0;
+        node->Relayed = 0;
+        node->Seq = 0;
+
+        Configure(&Net[a], (USHORT)(a + 1), node->Relay, FALSE, 0);
+    }
+
+    for (a = 0; a < NODES; a++) {
+        for (b = 0; b < NODES; b++) {
+            if (a != b && hypot(Nodes[a].X - Nodes[b].X, Nodes[a].Y - Nodes[b].Y) <= RADIO_RANGE_M) {
+                Nodes[a].Neighbors[Nodes[a].NeighborCount++] = (USHORT)b;
+            }
+        }
+    }
+}
+
+// Every copy a node sends is heard by each neighbour unless lost
+static BOOLEAN
+Transmit(ULONG Sender, const UCHAR* Pdu, ULONG Copies, ULONG Slot, FLOOD_RESULT* Result)
+{
+    ULONG copy, n;
+
+    for (copy = 0; copy < Copies; copy++) {
+        Result->Transmissions++;
+        for (n = 0; n < Nodes[Sender].NeighborCount; n++) {
+            RECEPTION* reception;
+
+            if (Random() % 100 < LOSS_PERCENT) {
+                continue;
+            }
+            if (PendingCount[Slot] == MAX_RECEPTIONS) {
+                return FALSE;
+            }
+            reception = &Pending[Slot][PendingCount[Slot]++];
+            reception->Node = Nodes[Sender].Neighbors[n];
+            memcpy(reception->Pdu, Pdu, PDU_LENGTH);
+        }
+    }
+    return TRUE;
+}
+
+static VOID
+Flood(double RelayRatio, FLOOD_RESULT* Result)
+{
+    ULONG message, step, r, a, total = 0;
+    MESH_RELAY_ITEM item;
+    UCHAR pdu[MESH_NETWORK_PDU_MAX];
+
+    BuildBuilding(RelayRatio);
+    memset(Result, 0, sizeof(*Result));
+    Result->Bounded = TRUE;
+
+    for (message = 0; message < MESSAGES; message++) {
+        ULONG src = 1 + Random() % (NODES - 1);
+        ULONG cur = 0;
+
+        Result->Hops[message] = 0;
+        BuildPdu(pdu, 0, DEFAULT_TTL, ++Nodes[src].Seq, (USHORT)(src + 1), GATEWAY + 1);
+        PendingCount[0] = 0;
+        Transmit(src, pdu, 1, 0, Result);
+
+        // Each step delivers what was sent in the last one; the cache
+        // and TTL have to end the flood well within DEFAULT_TTL steps
+        for (step = 1; PendingCount[cur] != 0; step++) {
+            ULONG next = cur ^ 1;
+
+            if (step > DEFAULT_TTL + 1) {
+                Result->Bounded = FALSE;
+                break;
+            }
+
+            PendingCount[next] = 0;
+            for (r = 0; r < PendingCount[cur]; r++) {
+                RECEPTION* reception = &Pending[cur][r];
+                ULONG result = MeshNetProcess(&Net[reception->Node], MeshBearerAdvertising, 0,
+                    reception->Pdu, PDU_LENGTH, step);
+
+                if ((result & MESH_RESULT_DELIVERED) && reception->Node == GATEWAY) {
+                    Result->Delivered++;
+                    Result->Hops[message] = step;
+                }
+            }
+
+            for (a = 0; a < NODES; a++) {
+                while (MeshNetDequeue(&Net[a], &item)) {
+                    Nodes[a].Relayed++;
+                    if (!Transmit(a, item.Pdu, item.Transmissions, next, Result)) {
+                        Result->Bounded = FALSE;
+                    }
+                }
+            }
+
+            cur = next;
+        }
+    }
+
+    for (a = 0; a < NODES; a++) {
+        if (a != GATEWAY && Nodes[a].Relay) {
+            Result->Relays++;
+            total += Nodes[a].Relayed;
+            if (Nodes[a].Relayed > Result->RelayMax) {
+                Result->RelayMax = Nodes[a].Relayed;
+            }
+        }
+    }
+    Result->RelayAverage = Result->Relays != 0 ? (double)total / Result->Relays : 0.0;
+}
+
+static int
+CompareUlong(const void* A, const void* B)
+{
+    ULONG a = *(const ULONG*)A, b = *(const ULONG*)B;
+
+    return (a > b) - (a < b);
+}
+
+static VOID
+CpuCost(VOID)
+{
+    static MESH_NETWORK mesh;
+    MESH_RELAY_ITEM item;
+    UCHAR pdu[MESH_NETWORK_PDU_MAX];
+    double start, elapsed;
+    ULONG round, relayed = 0;
+
+    Configure(&mesh, 0x0001, TRUE, FALSE, 0);
+
+    start = Seconds();
+    for (round = 0; round < CPU_ROUNDS; round++) {
+        // 512 sources; each PDU arrives twice, as from two relays
+        ULONG src = (round >> 1) & 511;
+        ULONG seq = (round >> 10) + 1;
+
+        BuildPdu(pdu, 0, 5, seq, (USHORT)(0x0100 + src), MESH_ADDR_ALL_NODES);
+        if (MeshNetProcess(&mesh, MeshBearerAdvertising, 0, pdu, PDU_LENGTH, round) & MESH_RESULT_RELAYED) {
+            relayed += MeshNetDequeue(&mesh, &item);
+        }
+    }
+    elapsed = Seconds() - start;
+
+    printf("\nHost CPU: %.0f ns per PDU (cache check, delivery, relay enqueue and dequeue; %u relayed)\n",
+        elapsed * 1e9 / CPU_ROUNDS, relayed);
+}
+
+int
+main(void)
+{
+    static const double ratios[] = { 1.0, 0.5, 0.3, 0.15 };
+    static FLOOD_RESULT results[ARRAYSIZE(ratios)];
+    BOOLEAN bounded = TRUE;
+    ULONG i;
+
+    NetworkChecks();
+
+    printf("\nFlood: %u nodes in %.0fx%.0f m, range %.0f m, %u%% loss, TTL %u, %u messages to the gateway\n",
+        NODES, AREA_WIDTH_M, AREA_HEIGHT_M, RADIO_RANGE_M, LOSS_PERCENT, DEFAULT_TTL, MESSAGES);
+    printf("  %-8s %-7s %-9s %-9s %-9s %-8s %-10s %s\n",
+        "RATIO", "RELAYS", "DELIVERY", "HOPS P50", "HOPS MAX", "TX/MSG", "RELAY AVG", "RELAY MAX");
+
+    for (i = 0; i < ARRAYSIZE(ratios); i++) {
+        FLOOD_RESULT* result = &results[i];
+        ULONG hops[MESSAGES];
+        ULONG count = 0, m;
+
+        Flood(ratios[i], result);
+        for (m = 0; m < MESSAGES; m++) {
+            if (result->Hops[m] != 0) {
+                hops[count++] = result->Hops[m];
+            }
+        }
+        qsort(hops, count, sizeof(ULONG), CompareUlong);
+
+        printf("  %-8.2f %-7u %7.1f%%  %-9u %-9u %-8.1f %-10.3f %.3f\n",
+            ratios[i], result->Relays, result->Delivered * 100.0 / MESSAGES,
+            count != 0 ? hops[(count - 1) / 2] : 0, count != 0 ? hops[count - 1] : 0,
+            (double)result->Transmissions / MESSAGES,
+            result->RelayAverage / MESSAGES, (double)result->RelayMax / MESSAGES);
+
+        bounded = bounded && result->Bounded;
+    }
+    printf("  RELAY AVG/MAX: copies relayed per message per relay node\n\n");
+
+    Check("Every flood ends within TTL steps", bounded);
+    Check("Gateway never delivers a message twice",
+        results[0].Delivered <= MESSAGES && results[3].Delivered <= MESSAGES);
+    Check("Full relay coverage delivers 95% of messages", results[0].Delivered * 100 >= MESSAGES * 95);
+    Check("Fewer relays send fewer copies per message",
+        results[3].Transmissions < results[0].Transmissions);
+    Check("Each relay forwards a message at most once",
+        results[0].RelayMax <= MESSAGES && results[1].RelayMax <= MESSAGES);
+
+    CpuCost();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+import heapq
+import math
+import random
+import statistics
+from datetime import datetime
+
+# Building floor plan and radio model
+AREA_WIDTH_M = 120.0
+AREA_HEIGHT_M = 80.0
+RADIO_RANGE_M = 22.0
+LINK_LOSS_RATE = 0.05
+
+# Advertising bearer timing (ms)
+ADV_TX_TIME_MS = 0.4
+RELAY_DELAY_MIN_MS = 10.0
+RELAY_DELAY_MAX_MS = 30.0
+RELAY_RETRANSMIT_COUNT = 1
+RELAY_RETRANSMIT_INTERVAL_MS = 20.0
+
+DEFAULT_TTL = 7
+GATEWAY = 0
+
+
+def ts():
+    return datetime.now().strftime('%H:%M:%S')
+
+
+class MeshNode:
+    def __init__(self, address, x, y, relay):
+        self.address = address
+        self.x = x
+        self.y = y
+        self.relay = relay
+        self.neighbors = []
+        # Message cache: highest SEQ seen per source (same rule as the driver)
+        self.cache = {}
+        self.relayed = 0
+
+    def seen(self, src, seq):
+        if self.cache.get(src, -1) >= seq:
+            return True
+        self.cache[src] = seq
+        return False
+
+
+class MeshSimulator:
+    def __init__(self, node_count, relay_ratio, seed):
+        self.rng = random.Random(seed)
+        self.nodes = []
+        for address in range(node_count):
+            if address == GATEWAY:
+                x, y = 0.0, AREA_HEIGHT_M / 2
+            else:
+                x = self.rng.uniform(0, AREA_WIDTH_M)
+                y = self.rng.uniform(0, AREA_HEIGHT_M)
+            relay = address == GATEWAY or self.rng.random() < relay_ratio
+            self.nodes.append(MeshNode(address, x, y, relay))
+
+        for a in self.nodes:
+            for b in self.nodes:
+                if a is not b and math.hypot(a.x - b.x, a.y - b.y) <= RADIO_RANGE_M:
+                    a.neighbors.append(b)
+
+        self.events = []
+        self.event_id = 0
+        self.transmissions = 0
+        self.delivered = {}
+
+    def schedule(self, time_ms, node, src, seq, ttl, sent_at):
+        self.event_id += 1
+        heapq.heappush(self.events, (time_ms, self.event_id, node.address, src, seq, ttl, sent_at))
+
+    def transmit(self, time_ms, sender, src, seq, ttl, sent_at):
+        copies = 1 + (RELAY_RETRANSMIT_COUNT if sender.address != src else 0)
+        for copy in range(copies):
+            tx_time = time_ms + copy * RELAY_RETRANSMIT_INTERVAL_MS
+            self.transmissions += 1
+            for neighbor in sender.neighbors:
+                if self.rng.random() >= LINK_LOSS_RATE:
+                    self.schedule(tx_time + ADV_TX_TIME_MS, neighbor, src, seq, ttl, sent_at)
+
+    def run_message(self, src, seq, start_ms):
+        sender = self.nodes[src]
+        sender.seen(src, seq)
+        self.transmit(start_ms, sender, src, seq, DEFAULT_TTL, start_ms)
+
+        while self.events:
+            time_ms, _, address, msg_src, msg_seq, ttl, sent_at = heapq.heappop(self.events)
+            node = self.nodes[address]
+
+            if node.seen(msg_src, msg_seq):
+                continue
+
+            if address == GATEWAY:
+                self.delivered[(msg_src, msg_seq)] = time_ms - sent_at
+                continue
+
+            if node.relay and ttl >= 2:
+                node.relayed += 1
+                delay = self.rng.uniform(RELAY_DELAY_MIN_MS, RELAY_DELAY_MAX_MS)
+                self.transmit(time_ms + delay, node, msg_src, msg_seq, ttl - 1, sent_at)
+
+    def run(self, messages):
+        sources = [n.address for n in self.nodes if n.address != GATEWAY]
+        seq = {}
+        for i in range(messages):
+            src = self.rng.choice(sources)
+            seq[src] = seq.get(src, 0) + 1
+            self.run_message(src, seq[src], i * 1000.0)
+
+        latencies = sorted(self.delivered.values())
+        relay_loads = [n.relayed for n in self.nodes if n.relay and n.address != GATEWAY]
+        return {
+            "delivery": len(latencies) / messages,
+            "p50": statistics.median(latencies) if latencies else float('nan'),
+            "p95": latencies[int(len(latencies) * 0.95) - 1] if latencies else float('nan'),
+            "tx_per_msg": self.transmissions / messages,
+            "relay_avg": statistics.mean(relay_loads) / messages if relay_loads else 0.0,
+            "relay_max": max(relay_loads) / messages if relay_loads else 0.0,
+            "relays": len(relay_loads),
+        }
+
+
+def main():
+    node_count = 200
+    messages = 500
+
+    print(f"[{ts()}] Mesh relay simulation: {node_count} nodes, {messages} messages to gateway")
+    print(f"Area {AREA_WIDTH_M:.0f}x{AREA_HEIGHT_M:.0f} m, range {RADIO_RANGE_M:.0f} m, "
+          f"link loss {LINK_LOSS_RATE * 100:.0f}%, TTL {DEFAULT_TTL}")
+    print("=" * 86)
+    print(f"{'RELAY RATIO':<12} | {'RELAYS':<6} | {'DELIVERY':<8} | {'P50 ms':<7} | {'P95 ms':<7} | "
+          f"{'TX/MSG':<7} | {'RELAY AVG':<9} | {'RELAY MAX'}")
+    print("-" * 86)
+
+    for relay_ratio in (1.0, 0.5, 0.3, 0.15):
+        result = MeshSimulator(node_count, relay_ratio, seed=76).run(messages)
+        print(f"{relay_ratio:<12.2f} | {result['relays']:<6} | {result['delivery'] * 100:<7.1f}% | "
+              f"{result['p50']:<7.1f} | {result['p95']:<7.1f} | {result['tx_per_msg']:<7.1f} | "
+              f"{result['relay_avg']:<9.3f} | {result['relay_max']:.3f}")
+
+    print("=" * 86)
+    print("RELAY AVG/MAX: relayed copies per message per relay node (message cache drops repeats).")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,353 @@
+/*++
+
+Module Name:
+    p256_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's LE Secure Connections P-256
+    code (MultiDeviceBTP256.c). It runs in three parts:
+    - Known answers: the Core specification's sample key pair (Vol 3
+      Part H, 2.3.5.6.1) and Diffie-Hellman vectors checked against an
+      independent implementation. The edge private key n - 1 is among
+      them. Both key generation paths must agree, and off-curve peer
+      keys must be refused.
+    - Operation cost: key generation through the base table, alone and
+      in batches, and without it; the DHKey.
+    - An installer pairing 50 appliances back to back, measured as the
+      pairing crypto each one waits for. "On demand" generates the key
+      pair without the table, as a plain implementation would.
+      "Table" generates it through the base table. "Pooled" takes a key
+      pair generated in idle time, as the driver's generator thread
+      does, so only the DHKey remains.
+
+    Build (MSVC):
+        cl /O2 /I..\driver p256_benchmark.c ..\driver\MultiDeviceBTP256.c
+
+    Build (Linux):
+        cc -O2 -I../driver p256_benchmark.c ../driver/MultiDeviceBTP256.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTP256.h"
+
+#define APPLIANCES          50
+#define OPS_SECONDS         0.5
+#define POOL_KEYS           64          // PAIRING_POOL_KEYS
+
+// Most significant word first, as the specification prints them
+typedef struct _DH_VECTOR {
+    const char* PrivateKey;
+    const char* PublicX;
+    const char* PublicY;
+    const char* PeerX;
+    const char* PeerY;
+    const char* DhKey;
+} DH_VECTOR;
+
+static const DH_VECTOR Vectors[] = {
+    {   // Core Vol 3 Part H 2.3.5.6.1, private key A, against a random peer
+        "3f49f6d4 a3c55f38 74c9b3e3 d2103f50 4aff607b eb40b799 5899b8a6 cd3c1abd",
+        "20b003d2 f297be2c 5e2c83a7 e9f9a5b9 eff49111 acf4fddb cc030148 0e359de6",
+        "dc809c49 652aeb6d 63329abf 5a52155c 766345c2 8fed3024 741c8ed0 1589d28b",
+        "2023f27b 059f4203 c5d8d96f 731cccf5 92ccabc8 b4b995b1 0e9d4414 593e8f81",
+        "cb429e85 19b0a4e0 531fbf8f 79347b6e 685a81bf 82274a07 33337301 e5099796",
+        "364881c7 97eae307 49778726 5a03f09b 5ec6e059 243d7d22 d6ddcf99 952ac114"
+    },
+    {
+        "e042d32c 3886b777 d53c68db 1d969e0e ca8b4382 8b863916 f3cb0026 80986de4",
+        "595b4aab afa4ed89 63dd3a55 a5bbe5b1 c725d49b 029667b1 c5a75fe2 fb6c37c7",
+        "8e3e246b bdeb0b8e 9cbc09ff de11cfa9 c9d03199 82d552b1 fcfa4590 6bc2d16a",
+        "6b4b5bee 7cfbe51e cda1c705 b98a26ee 981627a9 d599811e fccc183e d707c6fa",
+        "13053a75 8792d562 adb7dfa9 e73b2750 b0a4e12d dc4b547f d0aa5006 b6346670",
+        "db9dd9be 745194d5 321e8314 afc37c97 817fc907 1df776e1 9677c6f1 77a487ef"
+    },
+    {   // n - 1: the public key is -G, and the DHKey is the peer's own x
+        "ffffffff 00000000 ffffffff ffffffff bce6faad a7179e84 f3b9cac2 fc632550",
+        "6b17d1f2 e12c4247 f8bce6e5 63a440f2 77037d81 2deb33a0 f4a13945 d898c296",
+        "b01cbd1c 01e58065 711814b5 83f061e9 d431cca9 94cea131 3449bf97 c840ae0a",
+        "6bfcc378 d642db38 8c15e230 cca9d1b3 0c07b00b 6666d9e5 f3b0cfbb 8cb63640",
+        "199bca8b 7cf5f7f6 e1d2b1f5 8bd4dcd3 09d873ea 72dffb42 6ac349ba e704391e",
+        "6bfcc378 d642db38 8c15e230 cca9d1b3 0c07b00b 6666d9e5 f3b0cfbb 8cb63640"
+    },
+};
+
+static P256_BASE_TABLE Table;
+static P256_KEYPAIR Appliances[APPLIANCES];
+static P256_KEYPAIR Pool[POOL_KEYS];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+// Benchmark keys only; the driver draws from the system RNG
+static VOID
+RandomPrivateKey(PUCHAR PrivateKey)
+{
+    ULONG i;
+
+    do {
+        for (i = 0; i < P256_BYTES; i++) {
+            PrivateKey[i] = (UCHAR)Random();
+        }
+    } while (!P256PrivateKeyValid(PrivateKey));
+}
+
+// Hex words, most significant first, into octets least significant first
+static VOID
+Parse(const char* Hex, PUCHAR Bytes)
+{
+    ULONG digits = 0;
+
+    memset(Bytes, 0, P256_BYTES);
+    for (; *Hex != '\0'; Hex++) {
+        int v;
+
+        if (*Hex == ' ') {
+            continue;
+        }
+        v = (*Hex <= '9') ? *Hex - '0' : (*Hex | 0x20) - 'a' + 10;
+        digits++;
+        Bytes[(64 - digits) / 2] |= (UCHAR)(v << (((64 - digits) & 1) ? 4 : 0));
+    }
+}
+
+static int
+Check(const char* Name, int Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    return Passed ? 0 : 1;
+}
+
+static int
+KnownAnswers(void)
+{
+    UCHAR d[P256_BYTES], x[P256_BYTES], y[P256_BYTES], qx[P256_BYTES], qy[P256_BYTES];
+    UCHAR s[P256_BYTES], dh[P256_BYTES];
+    P256_KEYPAIR pair[2];
+    char name[64];
+    int failures = 0;
+    ULONG i;
+
+    printf("Known answers\n");
+
+    for (i = 0; i < ARRAYSIZE(Vectors); i++) {
+        Parse(Vectors[i].PrivateKey, d);
+        Parse(Vectors[i].PublicX, x);
+        Parse(Vectors[i].PublicY, y);
+        Parse(Vectors[i].PeerX, qx);
+        Parse(Vectors[i].PeerY, qy);
+        Parse(Vectors[i].DhKey, s);
+
+        memcpy(pair[0].PrivateKey, d, P256_BYTES);
+        memcpy(pair[1].PrivateKey, d, P256_BYTES);
+        P256GenerateKeyPairs(&Table, &pair[0], 1);
+        P256GenerateKeyPairs(NULL, &pair[1], 1);
+
+        sprintf(name, "vector %lu public key, table and on demand", (unsigned long)i);
+        failures += Check(name,
+            memcmp(pair[0].PublicX, x, P256_BYTES) == 0 &&
+            memcmp(pair[0].PublicY, y, P256_BYTES) == 0 &&
+            memcmp(pair[1].PublicX, x, P256_BYTES) == 0 &&
+            memcmp(pair[1].PublicY, y, P256_BYTES) == 0);
+
+        sprintf(name, "vector %lu DHKey", (unsigned long)i);
+        failures += Check(name,
+            NT_SUCCESS(P256ComputeDhKey(d, qx, qy, dh)) && memcmp(dh, s, P256_BYTES) == 0);
+    }
+
+    // Invalid-curve attack: a point off the curve must never be multiplied
+    qy[0] ^= 1;
+    failures += Check("off-curve peer key refused",
+        !P256PublicKeyValid(qx, qy) && P256ComputeDhKey(d, qx, qy, dh) == STATUS_INVALID_PARAMETER);
+    memset(qx, 0xFF, P256_BYTES);
+    failures += Check("coordinate above p refused", !P256PublicKeyValid(qx, qy));
+
+    memset(d, 0, P256_BYTES);
+    failures += Check("private key 0 refused", !P256PrivateKeyValid(d));
+    Parse("ffffffff 00000000 ffffffff ffffffff bce6faad a7179e84 f3b9cac2 fc632551", d);
+    failures += Check("private key n refused", !P256PrivateKeyValid(d));
+
+    return failures;
+}
+
+// Operations per second of Operation, run for OPS_SECONDS
+static double
+Rate(int Operation)
+{
+    P256_KEYPAIR batch[P256_BATCH];
+    UCHAR dh[P256_BYTES];
+    double start, elapsed;
+    ULONG ops = 0, i;
+
+    for (i = 0; i < P256_BATCH; i++) {
+        RandomPrivateKey(batch[i].PrivateKey);
+    }
+
+    start = Seconds();
+    do {
+        switch (Operation) {
+        case 0:
+            P256GenerateKeyPairs(NULL, batch, 1);
+            ops += 1;
+            break;
+        case 1:
+            P256GenerateKeyPairs(&Table, batch, 1);
+            ops += 1;
+            break;
+        case 2:
+            P256GenerateKeyPairs(&Table, batch, P256_BATCH);
+            ops += P256_BATCH;
+            break;
+        default:
+            P256ComputeDhKey(batch[ops % P256_BATCH].PrivateKey,
+                Appliances[ops % APPLIANCES].PublicX, Appliances[ops % APPLIANCES].PublicY, dh);
+            ops += 1;
+            break;
+        }
+        elapsed = Seconds() - start;
+    } while (elapsed < OPS_SECONDS);
+
+    return ops / elapsed;
+}
+
+static int
+CompareDouble(const void* A, const void* B)
+{
+    double a = *(const double*)A, b = *(const double*)B;
+
+    return (a > b) - (a < b);
+}
+
+typedef enum _MODE {
+    ModeOnDemand,
+    ModeTable,
+    ModePooled
+} MODE;
+
+// Pairs every appliance in turn; returns pairings/s and fills the latencies
+static double
+Install(MODE Mode, double* Latency)
+{
+    P256_KEYPAIR local;
+    UCHAR dh[P256_BYTES];
+    double start, begin;
+    ULONG i, pooled = POOL_KEYS;
+
+    if (Mode == ModePooled) {
+        // Idle time before the installer starts, as the generator thread spends it
+        for (i = 0; i < POOL_KEYS; i++) {
+            RandomPrivateKey(Pool[i].PrivateKey);
+        }
+        P256GenerateKeyPairs(&Table, Pool, POOL_KEYS);
+    }
+
+    begin = Seconds();
+    for (i = 0; i < APPLIANCES; i++) {
+        start = Seconds();
+
+        if (Mode == ModePooled) {
+            local = Pool[--pooled];
+        } else {
+            RandomPrivateKey(local.PrivateKey);
+            P256GenerateKeyPairs(Mode == ModeTable ? &Table : NULL, &local, 1);
+        }
+        P256ComputeDhKey(local.PrivateKey, Appliances[i].PublicX, Appliances[i].PublicY, dh);
+
+        Latency[i] = (Seconds() - start) * 1e6;
+    }
+
+    return APPLIANCES / (Seconds() - begin);
+}
+
+int
+main(void)
+{
+    static const char* modeName[] = { "ON DEMAND", "TABLE", "POOLED" };
+    double latency[APPLIANCES], rates[4], start, build, pairings[3], p50[3], p99[3], worst[3];
+    int failures = 0;
+    ULONG i;
+
+    start = Seconds();
+    P256BuildBaseTable(&Table);
+    build = Seconds() - start;
+
+    failures += KnownAnswers();
+
+    for (i = 0; i < APPLIANCES; i++) {
+        RandomPrivateKey(Appliances[i].PrivateKey);
+    }
+    P256GenerateKeyPairs(&Table, Appliances, APPLIANCES);
+
+    for (i = 0; i < 4; i++) {
+        rates[i] = Rate((int)i);
+    }
+
+    printf("\nOperations/s\n");
+    printf("%-28s | %-10s | %s\n", "OPERATION", "OPS/S", "US EACH");
+    printf("----------------------------------------------------\n");
+    printf("%-28s | %-10.0f | %.1f\n", "keygen, no table", rates[0], 1e6 / rates[0]);
+    printf("%-28s | %-10.0f | %.1f\n", "keygen, table", rates[1], 1e6 / rates[1]);
+    printf("%-28s | %-10.0f | %.1f\n", "keygen, table, batch of 16", rates[2], 1e6 / rates[2]);
+    printf("%-28s | %-10.0f | %.1f\n", "DHKey", rates[3], 1e6 / rates[3]);
+    printf("----------------------------------------------------\n");
+    printf("Base table: %.1f ms to build, %lu KB\n",
+           build * 1e3, (unsigned long)(sizeof(P256_BASE_TABLE) / 1024));
+
+    for (i = 0; i < 3; i++) {
+        pairings[i] = Install((MODE)i, latency);
+        qsort(latency, APPLIANCES, sizeof(double), CompareDouble);
+        p50[i] = latency[APPLIANCES / 2];
+        p99[i] = latency[APPLIANCES * 99 / 100];
+        worst[i] = latency[APPLIANCES - 1];
+    }
+
+    printf("\nInstalling %d appliances back to back, pairing crypto per appliance\n", APPLIANCES);
+    printf("%-10s | %-10s | %-10s | %-10s | %-10s | %s\n",
+           "MODE", "PAIRINGS/S", "P50 US", "P99 US", "MAX US", "SPEEDUP");
+    printf("---------------------------------------------------------------------\n");
+    for (i = 0; i < 3; i++) {
+        printf("%-10s | %-10.0f | %-10.1f | %-10.1f | %-10.1f | %.1fx\n",
+               modeName[i], pairings[i], p50[i], p99[i], worst[i], pairings[i] / pairings[0]);
+    }
+    printf("---------------------------------------------------------------------\n");
+    printf("ON DEMAND: key pair generated per pairing without the table. TABLE: through\n");
+    printf("the base table. POOLED: key pairs generated beforehand in batches of %d;\n", P256_BATCH);
+    printf("each pairing pays only the DHKey.\n");
+    printf("\n%s\n", failures == 0 ? "All checks passed" : "CHECKS FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,530 @@
+/*++
+
+Module Name:
+    placement_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's adapter placement policy
+    (MultiDeviceBTPlacement.c), fed the way the event intake feeds it.
+
+    A flat has three radios: adapter 0 in the living room, adapter 1
+    in the study next door and adapter 2 in a garage down the street
+    side. Thirty devices sit around the flat. Each adapter's controller
+    reports every device it hears as an LE advertising report, and
+    answers Read RSSI for its own links with a Command Complete; both
+    are raw HCI events parsed by MultiDeviceBTHci.c, and a link's
+    handle is mapped to its peer through MultiDeviceBTAclCredit.c, as
+    in MultiDeviceBTHciEvent.c.
+
+    Every device first connects to adapter 0, which soon carries more
+    airtime than it can. Once a load window passes, the policy moves
+    at most one LOW priority link per window, as AdapterRebalance does.
+    The report follows adapter 0's airtime until it is relieved, and
+    where each link went. Checks cover the RSSI cache, placement of new
+    connections, and which adapters a link may and may not migrate to.
+    Host CPU per placement is measured last.
+
+    Build (MSVC):
+        cl /O2 /I..\driver placement_benchmark.c ..\driver\MultiDeviceBTPlacement.c
+            ..\driver\MultiDeviceBTHci.c ..\driver\MultiDeviceBTAclCredit.c
+
+    Build (Linux):
+        cc -O2 -I../driver placement_benchmark.c ../driver/MultiDeviceBTPlacement.c
+            ../driver/MultiDeviceBTHci.c ../driver/MultiDeviceBTAclCredit.c -lm
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "MultiDeviceBTPlacement.h"
+#include "MultiDeviceBTHci.h"
+#include "MultiDeviceBTAclCredit.h"
+#include "MultiDeviceBTCmdQueue.h"
+
+#define ADAPTERS            3
+#define DEVICES             30
+#define MAX_CONNECTIONS     32
+#define SENSITIVITY_DBM     (-95)       // Controllers hear nothing weaker
+#define CONGESTED_PERMILLE  800
+#define RELIEVED_PERMILLE   650
+#define WINDOWS             40
+#define EVENT_BYTES         (64 * 1024)
+#define CPU_ROUNDS          2000000
+
+#define PRIORITY_HIGH       1
+#define PRIORITY_MEDIUM     2
+#define PRIORITY_LOW        3
+
+typedef struct _ADAPTER_MODEL {
+    const char* Name;
+    double X;
+    double Y;
+} ADAPTER_MODEL;
+
+static const ADAPTER_MODEL Model[ADAPTERS] = {
+    { "living room", 0.0,  0.0 },
+    { "study",       9.0,  2.0 },
+    { "garage",      70.0, 0.0 },
+};
+
+typedef struct _DEVICE {
+    BTH_ADDR Address;
+    double X;
+    double Y;
+    ULONG Priority;
+    ULONG AirtimePermille;
+    ULONG Adapter;
+    USHORT Handle;
+} DEVICE;
+
+static DEVICE Devices[DEVICES];
+static ADAPTER_RSSI_ENTRY Cache[ADAPTER_RSSI_CACHE_SIZE];
+static ADAPTER_STATE States[MAX_BLUETOOTH_ADAPTERS];
+static ACL_CREDIT_POOL Links[ADAPTERS];
+static HCI_EVENT_BATCH Batch;
+static UCHAR Events[EVENT_BYTES];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+// Log-distance path loss with a wall between the living room and the
+// study, and a few dB of fading
+static LONG
+PathRssi(ULONG Adapter, const DEVICE* Device)
+{
+    double dx = Device->X - Model[Adapter].X;
+    double dy = Device->Y - Model[Adapter].Y;
+    double distance = sqrt(dx * dx + dy * dy);
+    double rssi;
+
+    if (distance < 1.0) {
+        distance = 1.0;
+    }
+    rssi = -45.0 - 25.0 * log10(distance);
+    if ((Device->X < 6.0) != (Model[Adapter].X < 6.0)) {
+        rssi -= 6.0;
+    }
+    return (LONG)rssi - (LONG)(Random() % 4);
+}
+
+static UCHAR*
+PutAddress(UCHAR* p, BTH_ADDR Address)
+{
+    ULONG i;
+
+    for (i = 0; i < 6; i++) {
+        *p++ = (UCHAR)(Address >> (8 * i));
+    }
+    return p;
+}
+
+static UCHAR*
+PutAdvertisingReport(UCHAR* p, BTH_ADDR Address, CHAR Rssi)
+{
+    *p++ = HCI_EV_LE_META;
+    *p++ = 12;
+    *p++ = HCI_LE_ADVERTISING_REPORT;
+    *p++ = 1;
+    *p++ = 0x00;                                // ADV_IND
+    *p++ = 0x00;                                // Public address
+    p = PutAddress(p, Address);
+    *p++ = 0;                                   // No data
+    *p++ = (UCHAR)Rssi;
+    return p;
+}
+
+static UCHAR*
+PutReadRssiComplete(UCHAR* p, USHORT Handle, CHAR Rssi)
+{
+    *p++ = HCI_EV_COMMAND_COMPLETE;
+    *p++ = 7;
+    *p++ = 1;                                   // Num_HCI_Command_Packets
+    *p++ = 0x05; *p++ = 0x14;                   // HCI_Read_RSSI
+    *p++ = 0x00;                                // Success
+    *p++ = (UCHAR)Handle; *p++ = (UCHAR)(Handle >> 8);
+    *p++ = (UCHAR)Rssi;
+    return p;
+}
+
+//
+// What the event intake does with one submission from an adapter
+//
+
+static ULONG
+Intake(ULONG Adapter, const UCHAR* Buffer, ULONG Length)
+{
+    HCI_PARSE_STATS stats;
+    HCI_EVENT_READER reader;
+    ULONG recorded = 0;
+    ULONG i;
+
+    memset(&stats, 0, sizeof(stats));
+    HciReaderInitialize(&reader, Buffer, Length, &stats);
+
+    while (NT_SUCCESS(HciReadBatch(&reader, &Batch))) {
+        if (Batch.Kind == HciBatchAdvertising) {
+            for (i = 0; i < Batch.Count; i++) {
+                if (Batch.u.Advertising[i].Rssi != HCI_RSSI_UNAVAILABLE) {
+                    AdapterRssiRecord(Cache, Adapter, Batch.u.Advertising[i].Address,
+                        Batch.u.Advertising[i].Rssi);
+                    recorded++;
+                }
+            }
+        } else if (Batch.Kind == HciBatchCommands) {
+            for (i = 0; i < Batch.Count; i++) {
+                const HCI_COMMAND_EVENT* event = &Batch.u.Commands[i];
+                BTH_ADDR address;
+
+                if (!event->Complete || event->Opcode != HCI_OP_READ_RSSI ||
+                    event->Status != 0 || event->ReturnLength < 4) {
+                    continue;
+                }
+                address = AclCreditPeerAddress(&Links[Adapter],
+                    (USHORT)((event->ReturnParameters[1] | (event->ReturnParameters[2] << 8)) & 0x0FFF));
+                if (address != BTH_ADDR_NULL) {
+                    AdapterRssiRecord(Cache, Adapter, address, (CHAR)event->ReturnParameters[3]);
+                    recorded++;
+                }
+            }
+        }
+    }
+
+    return recorded;
+}
+
+// One scan window on every adapter: advertising from every device it
+// can hear, Read RSSI replies for its own links
+static ULONG
+ScanAll(VOID)
+{
+    ULONG recorded = 0;
+    ULONG a, d;
+
+    for (a = 0; a < ADAPTERS; a++) {
+        UCHAR* p = Events;
+
+        for (d = 0; d < DEVICES; d++) {
+            LONG rssi = PathRssi(a, &Devices[d]);
+
+            if (rssi < SENSITIVITY_DBM) {
+                continue;
+            }
+            if (Devices[d].Adapter == a) {
+                p = PutReadRssiComplete(p, Devices[d].Handle, (CHAR)rssi);
+            } else {
+                p = PutAdvertisingReport(p, Devices[d].Address, (CHAR)rssi);
+            }
+        }
+        recorded += Intake(a, Events, (ULONG)(p - Events));
+    }
+    return recorded;
+}
+
+static VOID
+Connect(ULONG Device, ULONG Adapter)
+{
+    DEVICE* device = &Devices[Device];
+
+    device->Adapter = Adapter;
+    device->Handle = (USHORT)(0x40 + Device);
+    AclCreditOpen(&Links[Adapter], device->Handle, (UCHAR)device->Priority, device->Address);
+    States[Adapter].Connections++;
+    States[Adapter].AirtimePermille += device->AirtimePermille;
+}
+
+static VOID
+Disconnect(ULONG Device)
+{
+    DEVICE* device = &Devices[Device];
+
+    AclCreditClose(&Links[device->Adapter], device->Handle);
+    States[device->Adapter].Connections--;
+    States[device->Adapter].AirtimePermille -= device->AirtimePermille;
+}
+
+static VOID
+UpdateCongestion(VOID)
+{
+    ULONG a;
+
+    for (a = 0; a < ADAPTERS; a++) {
+        if (!States[a].Congested && States[a].AirtimePermille >= CONGESTED_PERMILLE) {
+            States[a].Congested = TRUE;
+        } else if (States[a].Congested && States[a].AirtimePermille < RELIEVED_PERMILLE) {
+            States[a].Congested = FALSE;
+        }
+    }
+}
+
+static VOID
+BuildFlat(VOID)
+{
+    ULONG a, d;
+
+    memset(States, 0, sizeof(States));
+    for (a = 0; a < ADAPTERS; a++) {
+        States[a].Present = TRUE;
+        States[a].MaxConnections = MAX_CONNECTIONS;
+        AclCreditInitialize(&Links[a]);
+    }
+    AdapterRssiInitialize(Cache);
+
+    // Devices spread over the living room and study (x 0-14 m, y 0-8 m);
+    // a third are LOW priority background sync
+    for (d = 0; d < DEVICES; d++) {
+        Devices[d].Address = 0x00A0C9100000ULL + d;
+        Devices[d].X = (Random() % 1400) / 100.0;
+        Devices[d].Y = (Random() % 800) / 100.0;
+        Devices[d].Priority = (d % 3 == 0) ? PRIORITY_LOW : (d % 3 == 1) ? PRIORITY_HIGH : PRIORITY_MEDIUM;
+        Devices[d].AirtimePermille = (Devices[d].Priority == PRIORITY_LOW) ? 60 : 20;
+    }
+}
+
+//
+// Cache and policy rules
+//
+
+static VOID
+PolicyChecks(VOID)
+{
+    static ADAPTER_RSSI_ENTRY cache[ADAPTER_RSSI_CACHE_SIZE];
+    ADAPTER_STATE states[MAX_BLUETOOTH_ADAPTERS];
+    BTH_ADDR device = 0x00A0C9200001ULL;
+    BTH_ADDR other;
+    ULONG score, i;
+
+    printf("Policy:\n");
+
+    AdapterRssiInitialize(cache);
+    memset(states, 0, sizeof(states));
+    for (i = 0; i < 3; i++) {
+        states[i].Present = TRUE;
+        states[i].MaxConnections = 7;
+    }
+    states[0].Congested = TRUE;
+    states[0].AirtimePermille = 900;
+
+    Check("Unknown RSSI never chosen as a migration target",
+        AdapterPlacementMigrationTarget(cache, states, 0, device) == ADAPTER_NONE);
+
+    AdapterRssiRecord(cache, 1, device, -60);
+    AdapterRssiRecord(cache, 2, device, -90);
+    Check("Target hears the device at a usable RSSI",
+        AdapterPlacementMigrationTarget(cache, states, 0, device) == 1);
+    AdapterRssiRecord(cache, 1, device, -88);
+    Check("Below -85 dBm on every other adapter: stays put",
+        AdapterPlacementMigrationTarget(cache, states, 0, device) == ADAPTER_NONE);
+
+    AdapterRssiRecord(cache, 1, device, -60);
+    AdapterRssiRecord(cache, 2, device, -55);
+    states[2].AirtimePermille = 600;
+    Check("Busy adapter (>= 50% airtime) is not a target",
+        AdapterPlacementMigrationTarget(cache, states, 0, device) == 1);
+    states[1].Congested = TRUE;
+    Check("Congested adapter is not a target",
+        AdapterPlacementMigrationTarget(cache, states, 0, device) == ADAPTER_NONE);
+    states[1].Congested = FALSE;
+    states[2].AirtimePermille = 0;
+
+    AdapterRssiRecord(cache, 1, device, -75);
+    AdapterRssiRecord(cache, 2, device, -50);
+    Check("New HIGH link placed where the signal is best",
+        AdapterPlacementSelect(cache, states, device, PRIORITY_HIGH, &score) == 2 && score == 0);
+    states[2].Connections = 7;
+    Check("Full adapter is never selected",
+        AdapterPlacementSelect(cache, states, device, PRIORITY_HIGH, NULL) == 1);
+    for (i = 0; i < 3; i++) {
+        states[i].Connections = 7;
+    }
+    Check("Every adapter full: none selected",
+        AdapterPlacementSelect(cache, states, device, PRIORITY_LOW, &score) == ADAPTER_NONE &&
+        score == MAXULONG);
+
+    AdapterRssiForget(cache, 2);
+    Check("Forgetting an adapter drops what it heard",
+        AdapterRssiLookup(cache, 2, device) == ADAPTER_RSSI_UNKNOWN &&
+        AdapterRssiLookup(cache, 1, device) == -75);
+
+    // Find a device that maps to the same cache slot
+    for (other = device + 1; ; other++) {
+        AdapterRssiRecord(cache, 0, other, -40);
+        if (AdapterRssiLookup(cache, 1, device) == ADAPTER_RSSI_UNKNOWN) {
+            break;
+        }
+    }
+    Check("Colliding device replaces the entry whole",
+        AdapterRssiLookup(cache, 0, other) == -40 && AdapterRssiLookup(cache, 1, other) == ADAPTER_RSSI_UNKNOWN);
+    Check("Out of range adapter index ignored",
+        (AdapterRssiRecord(cache, MAX_BLUETOOTH_ADAPTERS, device, -40),
+         AdapterRssiLookup(cache, MAX_BLUETOOTH_ADAPTERS, device) == ADAPTER_RSSI_UNKNOWN));
+}
+
+//
+// Flat: everything starts on adapter 0
+//
+
+static VOID
+Migration(VOID)
+{
+    ULONG moved[ADAPTERS] = { 0 };
+    ULONG window, relievedAt = 0, migrations = 0, d, a;
+    ULONG recorded, firstScan = 0;
+    BOOLEAN heard = TRUE, quiet = TRUE, settled = TRUE, blind;
+
+    BuildFlat();
+    for (d = 0; d < DEVICES; d++) {
+        Connect(d, 0);
+    }
+    UpdateCongestion();
+
+    // Before any RSSI reaches the cache, nothing can move
+    blind = TRUE;
+    for (d = 0; d < DEVICES; d++) {
+        if (AdapterPlacementMigrationTarget(Cache, States, 0, Devices[d].Address) != ADAPTER_NONE) {
+            blind = FALSE;
+        }
+    }
+
+    printf("\nFlat: %u devices on adapter 0; one LOW link may move per load window\n", DEVICES);
+    printf("  %-7s %-9s %-9s %-9s %s\n", "WINDOW", "AIRTIME 0", "AIRTIME 1", "AIRTIME 2", "MIGRATION");
+
+    for (window = 1; window <= WINDOWS; window++) {
+        char action[64] = "-";
+
+        recorded = ScanAll();
+        UpdateCongestion();
+
+        if (window == 1) {
+            firstScan = recorded;
+        }
+
+        if (States[0].Congested) {
+            for (d = 0; d < DEVICES; d++) {
+                ULONG target;
+                CHAR rssi;
+
+                if (Devices[d].Adapter != 0 || Devices[d].Priority != PRIORITY_LOW) {
+                    continue;
+                }
+                target = AdapterPlacementMigrationTarget(Cache, States, 0, Devices[d].Address);
+                if (target == ADAPTER_NONE) {
+                    continue;
+                }
+
+                rssi = AdapterRssiLookup(Cache, target, Devices[d].Address);
+                heard = heard && rssi != ADAPTER_RSSI_UNKNOWN && rssi >= -85;
+                quiet = quiet && !States[target].Congested &&
+                    States[target].AirtimePermille < ADAPTER_TARGET_MAX_PERMILLE;
+
+                Disconnect(d);
+                Connect(d, target);
+                moved[target]++;
+                migrations++;
+                sprintf(action, "device %u to adapter %u (%d dBm)", d, target, rssi);
+                break;
+            }
+        } else if (relievedAt == 0) {
+            relievedAt = window;
+        }
+
+        if (window <= 12 || strcmp(action, "-") != 0) {
+            printf("  %-7u %-9u %-9u %-9u %s\n", window, States[0].AirtimePermille,
+                States[1].AirtimePermille, States[2].AirtimePermille, action);
+        }
+    }
+
+    printf("  Moved: %u to the %s, %u to the %s; adapter 0 relieved in window %u\n\n",
+        moved[1], Model[1].Name, moved[2], Model[2].Name, relievedAt);
+
+    Check("RSSI from reports and link reads reaches the cache", firstScan >= 2 * DEVICES);
+    Check("Nothing migrates before RSSI is known", blind);
+    Check("Congested adapter sheds LOW links", migrations > 0);
+    Check("  and is relieved by it", relievedAt != 0 && !States[0].Congested);
+    Check("Every target heard the device at -85 dBm or better", heard);
+    Check("Every target was quiet when chosen", quiet);
+    Check("Garage too far to take a link", moved[2] == 0);
+
+    for (a = 1; a < ADAPTERS; a++) {
+        if (States[a].Congested) {
+            settled = FALSE;
+        }
+    }
+    Check("No target ends up congested", settled);
+}
+
+static VOID
+CpuCost(VOID)
+{
+    double start, elapsed;
+    ULONG round, sum = 0;
+
+    BuildFlat();
+    ScanAll();
+
+    start = Seconds();
+    for (round = 0; round < CPU_ROUNDS; round++) {
+        sum += AdapterPlacementSelect(Cache, States, Devices[round % DEVICES].Address,
+            round & 3, NULL);
+    }
+    elapsed = Seconds() - start;
+
+    printf("\nHost CPU: %.0f ns per placement over %u adapters (checksum %u)\n",
+        elapsed * 1e9 / CPU_ROUNDS, ADAPTERS, sum);
+}
+
+int
+main(void)
+{
+    PolicyChecks();
+    Migration();
+    CpuCost();
+
+    printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+    return Failures == 0 ? 0 : 1;
+}
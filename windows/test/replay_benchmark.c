@@ -0,0 +1,1357 @@
+/*++
+
+Module Name:
+    replay_benchmark.c
+
+Abstract:
+    Replays btsnoop captures through the driver's portable core, to
+    reproduce field performance problems and as a regression benchmark.
+
+    Each record goes where the driver would send it:
+    - events the controller sent are gathered into submissions, as the
+      transport agent reads them, and parsed in batches by the HCI
+      event reader (MultiDeviceBTHci.c)
+    - commands the host sent go through the command scheduler
+      (MultiDeviceBTCmdQueue.c), which sends them as the recorded
+      Command Complete and Command Status events return credits
+    - ACL packets the host sent wait for a buffer from the credit
+      allocator (MultiDeviceBTAclCredit.c), which connection,
+      disconnection, buffer size and completed-packet events keep
+      current
+    The core runs on the capture's clock, so its decisions depend only
+    on the trace. A digest of those decisions is the same at any
+    replay speed, and a change to the core that alters them shows up
+    as a different digest.
+
+    Timing is the capture's own (-s 1), scaled (-s 10 replays ten
+    times faster), or none: as fast as possible (-s 0, the default).
+    The report gives each stage's items, CPU cost and throughput, the
+    trace-time latency the scheduler and allocator add, and for paced
+    runs how far the replay fell behind its schedule. Files are read a
+    piece at a time, so captures of any size replay in constant
+    memory.
+
+    Usage:
+        replay_benchmark [-s speed] [-e digest] [-w file] [file.btsnoop]
+
+    Without a file it replays a synthetic capture and runs its checks;
+    -w saves that capture. -e fails the run if the digest differs.
+
+    Build (MSVC):
+        cl /O2 /I..\driver replay_benchmark.c ..\driver\MultiDeviceBTSnoop.c
+            ..\driver\MultiDeviceBTHci.c ..\driver\MultiDeviceBTCmdQueue.c
+            ..\driver\MultiDeviceBTAclCredit.c
+
+    Build (Linux):
+        cc -O2 -I../driver replay_benchmark.c ../driver/MultiDeviceBTSnoop.c
+            ../driver/MultiDeviceBTHci.c ../driver/MultiDeviceBTCmdQueue.c
+            ../driver/MultiDeviceBTAclCredit.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTSnoop.h"
+#include "MultiDeviceBTHci.h"
+#include "MultiDeviceBTCmdQueue.h"
+#include "MultiDeviceBTAclCredit.h"
+
+#define CHUNK_BYTES         (16 * 1024 * 1024)  // File read this much at a time
+#define SUBMIT_BYTES        65536       // HCI_EVENT_MAX_SUBMIT
+#define SUBMIT_WINDOW_US    1000        // Events this close together go in one submission
+#define QUEUE_DEPTH         256         // HCI_COMMAND_QUEUE_DEPTH
+#define COMMAND_SLOTS       1024        // Queued times by command id; more than QUEUE_DEPTH
+#define BACKLOG             4096        // ACL packets waiting, per link
+#define REPLAY_PRIORITY     2           // PRIORITY_MEDIUM: a capture does not say which device is which
+#define HISTOGRAM_BUCKETS   512         // 8 per power of two
+
+// HCI opcodes and events the replay reads beyond what the parser decodes
+#define OP_READ_BUFFER_SIZE             0x1005
+#define OP_LE_READ_BUFFER_SIZE          0x2002
+#define OP_LE_READ_BUFFER_SIZE_V2       0x2060
+
+// Synthetic capture
+#define SYNTH_US            5000000
+#define SYNTH_STEP_US       250
+#define SYNTH_DEVICES       6
+#define SYNTH_BUFFERS       12
+#define SYNTH_BASE_US       1767225600000000ULL     // 2026-01-01, since 1970
+#define SYNTH_BYTES         (8 * 1024 * 1024)
+
+typedef enum _STAGE_ID {
+    StageRead,
+    StageEvents,
+    StageCommands,
+    StageAcl,
+    Stages
+} STAGE_ID;
+
+static const char* StageName[Stages] = { "read", "events", "commands", "acl credits" };
+
+typedef struct _HISTOGRAM {
+    ULONG64 Count;
+    ULONG64 Max;
+    ULONG64 Buckets[HISTOGRAM_BUCKETS];
+} HISTOGRAM;
+
+typedef struct _STAGE {
+    ULONG64 Items;
+    ULONG64 Bytes;
+    double Seconds;             // CPU, timer cost taken off
+    HISTOGRAM Latency;          // Trace time the stage held items, us
+} STAGE;
+
+// ACL packets ready to send on one link, oldest first
+typedef struct _LINK_BACKLOG {
+    USHORT Handle;
+    BOOLEAN InUse;
+    UCHAR Reserved;
+    ULONG Head;
+    ULONG Tail;
+    ULONG Outstanding;          // Granted, not yet completed
+    ULONG Owed;                 // Completed by the recorded controller before the replay granted them
+    ULONG64 ReadyUs[BACKLOG];
+} LINK_BACKLOG;
+
+typedef struct _REPLAY_OPTIONS {
+    double Speed;               // 0: as fast as possible
+    ULONG ChunkBytes;
+} REPLAY_OPTIONS;
+
+typedef struct _SOURCE {
+    FILE* File;                 // Or, without one, memory
+    const UCHAR* Data;
+    ULONG64 Length;
+    ULONG64 Offset;
+} SOURCE;
+
+typedef struct _REPLAY {
+    REPLAY_OPTIONS Options;
+    NTSTATUS Status;
+    ULONG Datalink;
+    SNOOP_READER Reader;
+    ULONG64 FileBytes;
+    ULONG64 Truncated;          // Bytes after the last whole record
+    ULONG64 FirstUs;
+    ULONG64 LastUs;
+    ULONG64 Drops;              // The capture's own
+    ULONG64 Types[SNOOP_TYPE_ISO + 1];
+    ULONG64 Snapped;            // Commands and events cut short by the capture: skipped
+
+    // Events
+    UCHAR Submit[SUBMIT_BYTES];
+    ULONG SubmitBytes;
+    ULONG64 SubmitFirstUs;
+    ULONG64 SubmitLastUs;
+    ULONG64 Submissions;
+    HCI_PARSE_STATS Parse;
+    HCI_EVENT_BATCH Batch;
+
+    // Commands
+    CMDQ Queue;
+    CMDQ_ENTRY Entries[QUEUE_DEPTH];
+    ULONG64 QueuedUs[COMMAND_SLOTS];
+    ULONG64 Rejected;           // Queue full
+
+    // ACL
+    ACL_CREDIT_POOL Pool;
+    BOOLEAN LeBuffers;
+    LINK_BACKLOG Links[ACL_CREDIT_MAX_LINKS];
+    ULONG64 ImplicitLinks;      // Sending before the capture saw them connect
+    ULONG64 Unknown;            // No link slot
+    ULONG64 Overflow;           // Backlog full
+    ULONG64 Flushed;            // Waiting at a disconnection
+    ULONG64 LateCompletions;    // Owed completions applied at grant
+
+    STAGE Stages[Stages];
+    HISTOGRAM Lag;              // Paced runs: wall time behind schedule, us
+    double WallStart;
+    double WallSeconds;
+    double TimerCost;
+    ULONG64 Digest;
+} REPLAY;
+
+static REPLAY Replay;
+static UCHAR Chunk[CHUNK_BYTES];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// Waits until a Seconds() time: sleeps while well ahead, then spins
+static VOID
+WaitUntil(double Due)
+{
+    double ahead;
+
+    while ((ahead = Due - Seconds()) > 0) {
+        if (ahead > 0.002) {
+#ifdef _WIN32
+            Sleep((DWORD)((ahead - 0.001) * 1000));
+#else
+            struct timespec nap;
+
+            nap.tv_sec = 0;
+            nap.tv_nsec = (long)((ahead - 0.001) * 1e9);
+            if (ahead > 1) {
+                nap.tv_sec = 1;
+                nap.tv_nsec = 0;
+            }
+            nanosleep(&nap, NULL);
+#endif
+        }
+    }
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+static int Failures = 0;
+
+static VOID
+Check(const char* Name, BOOLEAN Passed)
+{
+    printf("  %-52s %s\n", Name, Passed ? "ok" : "FAILED");
+    if (!Passed) {
+        Failures++;
+    }
+}
+
+static USHORT
+Get16(const UCHAR* p)
+{
+    return (USHORT)(p[0] | (p[1] << 8));
+}
+
+//
+// Histograms: 8 buckets per power of two, so percentiles are within 12%
+//
+
+static ULONG
+HistogramBucket(ULONG64 Value)
+{
+    ULONG top = 3;
+
+    if (Value < 8) {
+        return (ULONG)Value;
+    }
+    while ((Value >> (top + 1)) != 0) {
+        top++;
+    }
+    return (top - 2) * 8 + (ULONG)((Value >> (top - 3)) & 7);
+}
+
+static ULONG64
+HistogramLowest(ULONG Bucket)
+{
+    if (Bucket < 8) {
+        return Bucket;
+    }
+    return (ULONG64)(8 + Bucket % 8) << (Bucket / 8 - 1);
+}
+
+static VOID
+HistogramAdd(HISTOGRAM* Histogram, ULONG64 Value)
+{
+    Histogram->Count++;
+    Histogram->Max = max(Histogram->Max, Value);
+    Histogram->Buckets[HistogramBucket(Value)]++;
+}
+
+static ULONG64
+HistogramPercentile(const HISTOGRAM* Histogram, ULONG Percent)
+{
+    ULONG64 rank = (Histogram->Count * Percent + 99) / 100;
+    ULONG64 seen = 0;
+    ULONG b;
+
+    for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += Histogram->Buckets[b];
+        if (seen >= rank && seen != 0) {
+            return min(HistogramLowest(b), Histogram->Max);
+        }
+    }
+    return Histogram->Max;
+}
+
+//
+// The core, driven as the driver drives it
+//
+
+// FNV-1a over the core's decisions
+static VOID
+Fold(REPLAY* Replay, ULONG64 Value)
+{
+    ULONG i;
+
+    for (i = 0; i < 8; i++) {
+        Replay->Digest ^= (UCHAR)(Value >> (8 * i));
+        Replay->Digest *= 0x100000001B3ULL;
+    }
+}
+
+static VOID
+StageAdd(REPLAY* Replay, STAGE_ID Stage, double Start, ULONG64 Items, ULONG64 Bytes)
+{
+    double elapsed = Seconds() - Start - Replay->TimerCost;
+
+    Replay->Stages[Stage].Seconds += max(elapsed, 0.0);
+    Replay->Stages[Stage].Items += Items;
+    Replay->Stages[Stage].Bytes += Bytes;
+}
+
+// Hands the transport agent every command the credits allow
+static VOID
+ReplaySendCommands(REPLAY* Replay, ULONG64 NowUs)
+{
+    const CMDQ_ENTRY* entry;
+
+    while ((entry = CmdQueueNext(&Replay->Queue, NowUs)) != NULL) {
+        Fold(Replay, ((ULONG64)entry->Opcode << 32) | entry->Id);
+    }
+}
+
+static LINK_BACKLOG*
+ReplayFindLink(REPLAY* Replay, USHORT Handle)
+{
+    ULONG i;
+
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        if (Replay->Links[i].InUse && Replay->Links[i].Handle == Handle) {
+            return &Replay->Links[i];
+        }
+    }
+    return NULL;
+}
+
+static LINK_BACKLOG*
+ReplayOpenLink(REPLAY* Replay, USHORT Handle, BTH_ADDR PeerAddress)
+{
+    ULONG i;
+
+    if (!NT_SUCCESS(AclCreditOpen(&Replay->Pool, Handle, REPLAY_PRIORITY, PeerAddress))) {
+        return NULL;
+    }
+
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        if (!Replay->Links[i].InUse) {
+            memset(&Replay->Links[i], 0, FIELD_OFFSET(LINK_BACKLOG, ReadyUs));
+            Replay->Links[i].Handle = Handle;
+            Replay->Links[i].InUse = TRUE;
+            return &Replay->Links[i];
+        }
+    }
+
+    AclCreditClose(&Replay->Pool, Handle);
+    return NULL;
+}
+
+static VOID
+ReplayCloseLink(REPLAY* Replay, USHORT Handle)
+{
+    LINK_BACKLOG* link = ReplayFindLink(Replay, Handle);
+
+    AclCreditClose(&Replay->Pool, Handle);
+    if (link != NULL) {
+        Replay->Flushed += link->Tail - link->Head;
+        link->InUse = FALSE;
+    }
+}
+
+// The oldest Granted packets leave the link's backlog
+static VOID
+ReplayGranted(REPLAY* Replay, LINK_BACKLOG* Link, ULONG Granted, ULONG64 NowUs)
+{
+    HISTOGRAM* latency = &Replay->Stages[StageAcl].Latency;
+
+    while (Granted-- != 0) {
+        HistogramAdd(latency, NowUs - Link->ReadyUs[Link->Head % BACKLOG]);
+        Link->Head++;
+        Link->Outstanding++;
+        Fold(Replay, Link->Handle);
+
+        // The recorded controller finished this one before we sent it
+        if (Link->Owed != 0) {
+            Link->Owed--;
+            Link->Outstanding--;
+            Replay->LateCompletions++;
+            AclCreditComplete(&Replay->Pool, Link->Handle, 1);
+        }
+    }
+}
+
+// Offers every waiting link its share, as one credit request does
+static VOID
+ReplayServeLinks(REPLAY* Replay, ULONG64 NowUs)
+{
+    ACL_CREDIT_WANT wants[ACL_CREDIT_MAX_LINKS];
+    LINK_BACKLOG* links[ACL_CREDIT_MAX_LINKS];
+    ULONG count = 0, i;
+
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        LINK_BACKLOG* link = &Replay->Links[i];
+
+        if (link->InUse && link->Tail != link->Head) {
+            wants[count].Handle = link->Handle;
+            wants[count].Packets = (USHORT)min(link->Tail - link->Head, 0xFFFFU);
+            links[count++] = link;
+        }
+    }
+
+    if (count != 0 && AclCreditAcquireBatch(&Replay->Pool, wants, count) != 0) {
+        for (i = 0; i < count; i++) {
+            ReplayGranted(Replay, links[i], wants[i].Granted, NowUs);
+        }
+    }
+}
+
+// Command Complete for the buffer size commands, as AclCommandsCompleted reads it
+static VOID
+ReplayBufferSize(REPLAY* Replay, const HCI_COMMAND_EVENT* Event)
+{
+    ULONG buffers;
+
+    if (!Event->Complete || Event->Status != 0) {
+        return;
+    }
+
+    switch (Event->Opcode) {
+    case OP_READ_BUFFER_SIZE:
+        if (Event->ReturnLength < 6 || Replay->LeBuffers) {
+            return;
+        }
+        buffers = Event->ReturnParameters[4] | (Event->ReturnParameters[5] << 8);
+        break;
+
+    case OP_LE_READ_BUFFER_SIZE:
+    case OP_LE_READ_BUFFER_SIZE_V2:
+        if (Event->ReturnLength < 4 || Event->ReturnParameters[3] == 0) {
+            return;
+        }
+        buffers = Event->ReturnParameters[3];
+        Replay->LeBuffers = TRUE;
+        break;
+
+    default:
+        return;
+    }
+
+    AclCreditSetBuffers(&Replay->Pool, buffers);
+}
+
+// HciEventDispatch, for the parts of the driver in the portable core
+static VOID
+ReplayDispatch(REPLAY* Replay, const HCI_EVENT_BATCH* Batch, ULONG64 NowUs)
+{
+    LINK_BACKLOG* link;
+    double start;
+    ULONG i, id, packets;
+
+    Fold(Replay, ((ULONG64)Batch->Kind << 32) | Batch->Count);
+
+    switch (Batch->Kind) {
+    case HciBatchCompletedPackets:
+        start = Seconds();
+        for (i = 0; i < Batch->Count; i++) {
+            const HCI_COMPLETED_PACKETS* completed = &Batch->u.Completed[i];
+
+            link = ReplayFindLink(Replay, completed->Handle);
+            if (link == NULL) {
+                AclCreditComplete(&Replay->Pool, completed->Handle, completed->Packets);
+                continue;
+            }
+            packets = min((ULONG)completed->Packets, link->Outstanding);
+            link->Owed += completed->Packets - packets;
+            link->Outstanding -= packets;
+            AclCreditComplete(&Replay->Pool, completed->Handle, packets);
+        }
+        ReplayServeLinks(Replay, NowUs);
+        StageAdd(Replay, StageAcl, start, 0, 0);
+        break;
+
+    case HciBatchConnections:
+        start = Seconds();
+        for (i = 0; i < Batch->Count; i++) {
+            const HCI_CONNECTION_COMPLETE* connection = &Batch->u.Connections[i];
+
+            if (connection->Status == 0 && connection->LinkType != HCI_LINK_SCO &&
+                ReplayFindLink(Replay, connection->Handle) == NULL) {
+                ReplayOpenLink(Replay, connection->Handle, connection->PeerAddress);
+            }
+        }
+        StageAdd(Replay, StageAcl, start, 0, 0);
+        break;
+
+    case HciBatchDisconnections:
+        start = Seconds();
+        for (i = 0; i < Batch->Count; i++) {
+            if (Batch->u.Disconnections[i].Status == 0) {
+                ReplayCloseLink(Replay, Batch->u.Disconnections[i].Handle);
+            }
+        }
+        ReplayServeLinks(Replay, NowUs);
+        StageAdd(Replay, StageAcl, start, 0, 0);
+        break;
+
+    case HciBatchCommands:
+        start = Seconds();
+        for (i = 0; i < Batch->Count; i++) {
+            const HCI_COMMAND_EVENT* event = &Batch->u.Commands[i];
+
+            ReplayBufferSize(Replay, event);
+            if (CmdQueueAcknowledge(&Replay->Queue, event->Opcode, event->NumCommandPackets,
+                    event->Status, NowUs, &id)) {
+                HistogramAdd(&Replay->Stages[StageCommands].Latency,
+                    NowUs - Replay->QueuedUs[id % COMMAND_SLOTS]);
+            }
+        }
+        ReplaySendCommands(Replay, NowUs);
+        StageAdd(Replay, StageCommands, start, 0, 0);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// One submission of events, as IOCTL_MULTI_BT_HCI_SUBMIT_EVENTS takes it
+static VOID
+ReplaySubmitEvents(REPLAY* Replay)
+{
+    HCI_EVENT_READER reader;
+    ULONG64 events = Replay->Parse.Events;
+    double start;
+    NTSTATUS status;
+
+    if (Replay->SubmitBytes == 0) {
+        return;
+    }
+
+    HciReaderInitialize(&reader, Replay->Submit, Replay->SubmitBytes, &Replay->Parse);
+
+    for (;;) {
+        start = Seconds();
+        status = HciReadBatch(&reader, &Replay->Batch);
+        StageAdd(Replay, StageEvents, start, 0, 0);
+        if (status != STATUS_SUCCESS) {
+            break;
+        }
+        ReplayDispatch(Replay, &Replay->Batch, Replay->SubmitLastUs);
+    }
+
+    Replay->Stages[StageEvents].Items += Replay->Parse.Events - events;
+    Replay->Stages[StageEvents].Bytes += Replay->SubmitBytes;
+    Replay->Submissions++;
+    Replay->SubmitBytes = 0;
+}
+
+static VOID
+ReplayCommand(REPLAY* Replay, const SNOOP_RECORD* Record, ULONG64 NowUs)
+{
+    double start = Seconds();
+    ULONG id;
+
+    if (CmdQueueSubmit(&Replay->Queue, Get16(Record->Packet), REPLAY_PRIORITY,
+            Record->Packet + CMDQ_HEADER_BYTES, Record->Length - CMDQ_HEADER_BYTES,
+            NowUs, &id, NULL) == STATUS_SUCCESS) {
+        Replay->QueuedUs[id % COMMAND_SLOTS] = NowUs;
+        ReplaySendCommands(Replay, NowUs);
+    } else {
+        Replay->Rejected++;
+    }
+
+    StageAdd(Replay, StageCommands, start, 1, Record->Length);
+}
+
+static VOID
+ReplayAclPacket(REPLAY* Replay, const SNOOP_RECORD* Record, ULONG64 NowUs)
+{
+    USHORT handle = Get16(Record->Packet) & 0x0FFF;
+    double start = Seconds();
+    LINK_BACKLOG* link;
+
+    link = ReplayFindLink(Replay, handle);
+    if (link == NULL) {
+        link = ReplayOpenLink(Replay, handle, 0);
+        Replay->ImplicitLinks += (link != NULL);
+    }
+
+    if (link == NULL) {
+        Replay->Unknown++;
+    } else if (link->Tail - link->Head >= BACKLOG) {
+        Replay->Overflow++;
+    } else {
+        link->ReadyUs[link->Tail++ % BACKLOG] = NowUs;
+        if (link->Tail - link->Head == 1 && AclCreditAcquire(&Replay->Pool, handle)) {
+            ReplayGranted(Replay, link, 1, NowUs);
+        }
+    }
+
+    StageAdd(Replay, StageAcl, start, 1, Record->Length);
+}
+
+static VOID
+ReplayRecord(REPLAY* Replay, const SNOOP_RECORD* Record)
+{
+    ULONG64 nowUs = Record->TimestampUs;
+    double due, now;
+
+    if (Replay->Reader.Records == 1) {
+        Replay->FirstUs = nowUs;
+    }
+    // A capture's clock can step back; the core's must not
+    nowUs = max(nowUs, Replay->LastUs);
+    Replay->LastUs = nowUs;
+    Replay->Types[Record->Type]++;
+    Replay->Drops = Record->Drops;
+
+    if (Replay->Options.Speed > 0) {
+        due = Replay->WallStart + (nowUs - Replay->FirstUs) / 1e6 / Replay->Options.Speed;
+        WaitUntil(due);
+        now = Seconds();
+        HistogramAdd(&Replay->Lag, (ULONG64)((now - due) * 1e6));
+    }
+
+    if (Record->Type == SNOOP_TYPE_EVENT && Record->Direction == SNOOP_RECEIVED) {
+        if (Record->Length != Record->OriginalLength || Record->Length < HCI_EVENT_HEADER_BYTES) {
+            Replay->Snapped++;
+            return;
+        }
+        if (Replay->SubmitBytes != 0 &&
+            (nowUs - Replay->SubmitFirstUs > SUBMIT_WINDOW_US ||
+             Replay->SubmitBytes + Record->Length > SUBMIT_BYTES)) {
+            ReplaySubmitEvents(Replay);
+        }
+        if (Replay->SubmitBytes == 0) {
+            Replay->SubmitFirstUs = nowUs;
+        }
+        memcpy(Replay->Submit + Replay->SubmitBytes, Record->Packet, Record->Length);
+        Replay->SubmitBytes += Record->Length;
+        Replay->SubmitLastUs = nowUs;
+        return;
+    }
+
+    // Whatever the agent read before this went in first
+    ReplaySubmitEvents(Replay);
+
+    if (Record->Type == SNOOP_TYPE_COMMAND && Record->Direction == SNOOP_SENT) {
+        if (Record->Length != Record->OriginalLength || Record->Length < CMDQ_HEADER_BYTES) {
+            Replay->Snapped++;
+            return;
+        }
+        ReplayCommand(Replay, Record, nowUs);
+    } else if (Record->Type == SNOOP_TYPE_ACL && Record->Direction == SNOOP_SENT &&
+               Record->Length >= SNOOP_ACL_HEADER_BYTES) {
+        ReplayAclPacket(Replay, Record, nowUs);
+    }
+}
+
+static ULONG
+SourceRead(SOURCE* Source, PUCHAR Buffer, ULONG Length)
+{
+    ULONG bytes;
+
+    if (Source->File != NULL) {
+        return (ULONG)fread(Buffer, 1, Length, Source->File);
+    }
+
+    bytes = (ULONG)min((ULONG64)Length, Source->Length - Source->Offset);
+    memcpy(Buffer, Source->Data + Source->Offset, bytes);
+    Source->Offset += bytes;
+    return bytes;
+}
+
+static double
+TimerCost(void)
+{
+    double start = Seconds(), stop = start;
+    ULONG i;
+
+    for (i = 0; i < 10000; i++) {
+        stop = Seconds();
+    }
+    return (stop - start) / 10000;
+}
+
+/*++
+Routine Description:
+    Replays one capture. Replay->Status is STATUS_SUCCESS, or why the
+    file could not be replayed (to its end, if it is cut short).
+--*/
+static VOID
+ReplayRun(REPLAY* Replay, SOURCE* Source, const REPLAY_OPTIONS* Options)
+{
+    SNOOP_RECORD record;
+    ULONG length = 0, bytes;
+    double start;
+    NTSTATUS status;
+
+    memset(Replay, 0, sizeof(*Replay));
+    Replay->Options = *Options;
+    Replay->Digest = 0xCBF29CE484222325ULL;
+    Replay->TimerCost = TimerCost();
+
+    CmdQueueInitialize(&Replay->Queue, Replay->Entries, QUEUE_DEPTH);
+    AclCreditInitialize(&Replay->Pool);
+
+    length = SourceRead(Source, Chunk, SNOOP_FILE_HEADER_BYTES);
+    Replay->Status = SnoopParseFileHeader(Chunk, length, &Replay->Datalink);
+    if (!NT_SUCCESS(Replay->Status)) {
+        return;
+    }
+    Replay->Reader.Datalink = Replay->Datalink;
+    Replay->FileBytes = length;
+
+    Replay->WallStart = Seconds();
+    length = 0;
+
+    for (;;) {
+        bytes = SourceRead(Source, Chunk + length, Options->ChunkBytes - length);
+        Replay->FileBytes += bytes;
+        length += bytes;
+
+        SnoopReaderReset(&Replay->Reader, Chunk, length);
+        for (;;) {
+            start = Seconds();
+            status = SnoopReadRecord(&Replay->Reader, &record);
+            StageAdd(Replay, StageRead, start, status == STATUS_SUCCESS,
+                status == STATUS_SUCCESS ? SNOOP_RECORD_HEADER_BYTES + record.Length : 0);
+            if (status != STATUS_SUCCESS) {
+                break;
+            }
+            ReplayRecord(Replay, &record);
+        }
+
+        if (status == STATUS_FILE_CORRUPT_ERROR) {
+            Replay->Status = status;
+            break;
+        }
+
+        // The cut-off record starts the next piece
+        length -= Replay->Reader.Offset;
+        memmove(Chunk, Chunk + Replay->Reader.Offset, length);
+
+        if (bytes == 0) {
+            Replay->Truncated = length;
+            break;
+        }
+    }
+
+    ReplaySubmitEvents(Replay);
+    Replay->WallSeconds = Seconds() - Replay->WallStart;
+}
+
+static VOID
+PrintLatency(const HISTOGRAM* Histogram)
+{
+    if (Histogram->Count == 0) {
+        printf(" %9s %9s %9s\n", "-", "-", "-");
+        return;
+    }
+    printf(" %9llu %9llu %9llu\n",
+        (unsigned long long)HistogramPercentile(Histogram, 50),
+        (unsigned long long)HistogramPercentile(Histogram, 99),
+        (unsigned long long)Histogram->Max);
+}
+
+static VOID
+ReplayReport(const REPLAY* Replay, const char* Name)
+{
+    double traceSeconds = (Replay->LastUs - Replay->FirstUs) / 1e6;
+    ULONG64 waiting = 0, owed = 0;
+    ULONG s, i;
+
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        if (Replay->Links[i].InUse) {
+            waiting += Replay->Links[i].Tail - Replay->Links[i].Head;
+            owed += Replay->Links[i].Owed;
+        }
+    }
+
+    printf("Trace %s: %s, %llu records, %.1f MB over %.1f s\n", Name,
+        Replay->Datalink == SNOOP_DATALINK_H1 ? "H1" : "H4",
+        (unsigned long long)Replay->Reader.Records, Replay->FileBytes / 1e6, traceSeconds);
+    printf("  %llu commands, %llu ACL, %llu SCO, %llu events, %llu ISO; "
+        "%llu malformed, %llu snapped, %llu dropped by the capture\n",
+        (unsigned long long)Replay->Types[SNOOP_TYPE_COMMAND],
+        (unsigned long long)Replay->Types[SNOOP_TYPE_ACL],
+        (unsigned long long)Replay->Types[SNOOP_TYPE_SCO],
+        (unsigned long long)Replay->Types[SNOOP_TYPE_EVENT],
+        (unsigned long long)Replay->Types[SNOOP_TYPE_ISO],
+        (unsigned long long)Replay->Reader.Malformed, (unsigned long long)Replay->Snapped,
+        (unsigned long long)Replay->Drops);
+    if (Replay->Truncated != 0) {
+        printf("  File ends inside a record: last %llu bytes not replayed\n",
+            (unsigned long long)Replay->Truncated);
+    }
+    if (Replay->Options.Speed > 0) {
+        printf("Replay at %gx: %.2f s wall\n", Replay->Options.Speed, Replay->WallSeconds);
+    } else {
+        printf("Replay as fast as possible: %.3f s wall, %.0fx the capture's speed\n",
+            Replay->WallSeconds, Replay->WallSeconds > 0 ? traceSeconds / Replay->WallSeconds : 0);
+    }
+
+    printf("  %-12s %10s %9s %9s %10s %9s %9s %9s\n",
+        "stage", "items", "MB", "ns/item", "items/s", "p50 us", "p99 us", "max us");
+    printf("  ------------------------------------------------------------------------------\n");
+    for (s = 0; s < Stages; s++) {
+        const STAGE* stage = &Replay->Stages[s];
+
+        printf("  %-12s %10llu %9.2f %9.1f %10.3g", StageName[s],
+            (unsigned long long)stage->Items, stage->Bytes / 1e6,
+            stage->Items ? stage->Seconds * 1e9 / stage->Items : 0.0,
+            stage->Seconds > 0 ? stage->Items / stage->Seconds : 0.0);
+        PrintLatency(&stage->Latency);
+    }
+    printf("  Latency is trace time: commands queued to acknowledged, ACL packets ready to granted\n");
+    if (Replay->Options.Speed > 0) {
+        printf("  %-12s %10llu %9s %9s %10s", "behind",
+            (unsigned long long)Replay->Lag.Count, "", "", "");
+        PrintLatency(&Replay->Lag);
+    }
+
+    printf("  Event submissions %llu, batches %llu, malformed %llu\n",
+        (unsigned long long)Replay->Submissions, (unsigned long long)Replay->Parse.Batches,
+        (unsigned long long)Replay->Parse.Malformed);
+    printf("  Commands: %llu submitted, %llu merged, %llu sent, %llu completed, "
+        "%llu failed, %llu timed out, %llu rejected\n",
+        (unsigned long long)Replay->Queue.Stats.Submitted, (unsigned long long)Replay->Queue.Stats.Merged,
+        (unsigned long long)Replay->Queue.Stats.Sent, (unsigned long long)Replay->Queue.Stats.Completed,
+        (unsigned long long)Replay->Queue.Stats.Failed, (unsigned long long)Replay->Queue.Stats.TimedOut,
+        (unsigned long long)Replay->Rejected);
+    printf("  ACL: %u buffers, %llu granted, %llu denied, %llu waiting at the end, "
+        "%llu flushed at disconnection\n",
+        Replay->Pool.Stats.Buffers, (unsigned long long)Replay->Pool.Stats.Granted,
+        (unsigned long long)Replay->Pool.Stats.Denied, (unsigned long long)waiting,
+        (unsigned long long)Replay->Flushed);
+    printf("  ACL: %llu links opened on first packet, %llu completions before the grant, "
+        "%llu still owed, %llu without a link\n",
+        (unsigned long long)Replay->ImplicitLinks, (unsigned long long)Replay->LateCompletions,
+        (unsigned long long)owed, (unsigned long long)(Replay->Unknown + Replay->Overflow));
+    printf("  Digest %016llx\n", (unsigned long long)Replay->Digest);
+}
+
+//
+// Synthetic capture: a host with six links moving data, reconfiguring
+// them, and scanning
+//
+
+typedef struct _SYNTH {
+    PUCHAR Data;
+    ULONG Length;
+    ULONG Datalink;
+    ULONG Records;
+} SYNTH;
+
+typedef struct _SYNTH_DEVICE {
+    USHORT Handle;
+    BOOLEAN Connected;
+    ULONG Queued;               // Host packets not yet sent
+    ULONG InController;
+    ULONG Completed;            // Not yet reported
+    ULONG64 DoneUs[64];         // Controller finishes each packet
+    ULONG DoneHead;
+    ULONG DoneTail;
+} SYNTH_DEVICE;
+
+static UCHAR SynthData[SYNTH_BYTES];
+static UCHAR SynthH1[SYNTH_BYTES];
+
+static VOID
+SynthRecord(SYNTH* Synth, UCHAR Type, UCHAR Direction, ULONG64 NowUs, const UCHAR* Packet, ULONG Length)
+{
+    static UCHAR copy[SNOOP_MAX_SNAP];
+    SNOOP_ENTRY entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.TimestampUs = NowUs;
+    entry.Length = Length;
+    entry.Captured = (USHORT)Length;
+    entry.Type = Type;
+    entry.Direction = Direction;
+    entry.Framing = SNOOP_FRAMING_HCI;
+
+    memcpy(copy, Packet, Length);
+    Synth->Length += SnoopFormatRecord(&entry, copy, 0, SYNTH_BASE_US, 0, Synth->Data + Synth->Length);
+    Synth->Records++;
+}
+
+static VOID
+SynthEvent(SYNTH* Synth, ULONG64 NowUs, UCHAR Code, const UCHAR* Parameters, ULONG Length)
+{
+    UCHAR packet[2 + 255];
+
+    packet[0] = Code;
+    packet[1] = (UCHAR)Length;
+    memcpy(packet + 2, Parameters, Length);
+    SynthRecord(Synth, SNOOP_TYPE_EVENT, SNOOP_RECEIVED, NowUs, packet, 2 + Length);
+}
+
+static VOID
+SynthCommand(SYNTH* Synth, ULONG64 NowUs, USHORT Opcode, ULONG Length)
+{
+    UCHAR packet[3 + 255];
+    ULONG i;
+
+    packet[0] = (UCHAR)Opcode;
+    packet[1] = (UCHAR)(Opcode >> 8);
+    packet[2] = (UCHAR)Length;
+    for (i = 0; i < Length; i++) {
+        packet[3 + i] = (UCHAR)(Random() & 0xFF);
+    }
+    SynthRecord(Synth, SNOOP_TYPE_COMMAND, SNOOP_SENT, NowUs, packet, 3 + Length);
+}
+
+static VOID
+SynthCommandComplete(SYNTH* Synth, ULONG64 NowUs, USHORT Opcode, const UCHAR* Return, ULONG Length)
+{
+    UCHAR parameters[3 + 16];
+
+    parameters[0] = 1;
+    parameters[1] = (UCHAR)Opcode;
+    parameters[2] = (UCHAR)(Opcode >> 8);
+    memcpy(parameters + 3, Return, Length);
+    SynthEvent(Synth, NowUs, HCI_EV_COMMAND_COMPLETE, parameters, 3 + Length);
+}
+
+static VOID
+SynthAcl(SYNTH* Synth, ULONG64 NowUs, USHORT Handle, UCHAR Direction, ULONG Length)
+{
+    UCHAR packet[SNOOP_ACL_HEADER_BYTES + 251];
+    ULONG i;
+
+    packet[0] = (UCHAR)Handle;
+    packet[1] = (UCHAR)((Handle >> 8) | (Direction == SNOOP_RECEIVED ? 0x20 : 0));
+    packet[2] = (UCHAR)Length;
+    packet[3] = 0;
+    for (i = 0; i < Length; i++) {
+        packet[4 + i] = (UCHAR)i;
+    }
+    SynthRecord(Synth, SNOOP_TYPE_ACL, Direction, NowUs, packet, 4 + Length);
+}
+
+static VOID
+SynthConnection(SYNTH* Synth, ULONG64 NowUs, USHORT Handle, ULONG Device)
+{
+    UCHAR p[11];
+
+    memset(p, 0, sizeof(p));
+    p[1] = (UCHAR)Handle;
+    p[2] = (UCHAR)(Handle >> 8);
+    p[3] = (UCHAR)Device;
+    p[4] = 0x44; p[5] = 0x33; p[6] = 0x22; p[7] = 0x11; p[8] = 0x00;
+    p[9] = HCI_LINK_BR_EDR;
+    SynthEvent(Synth, NowUs, HCI_EV_CONNECTION_COMPLETE, p, sizeof(p));
+}
+
+// Five seconds of capture: buffer size read at the start, links
+// connecting, steady data with bursts, a connection update every
+// 40 ms answered by Command Status, advertising reports, and one link
+// dropping and coming back with a new handle
+static VOID
+SynthBuild(SYNTH* Synth)
+{
+    static const UCHAR ResetReturn[1] = { 0 };
+    static const UCHAR BufferReturn[7] = { 0, 0xFD, 0x03, 0, SYNTH_BUFFERS, 0, 0 };
+    SYNTH_DEVICE devices[SYNTH_DEVICES];
+    ULONG64 now, commandDoneUs = 0, nextUpdateUs = 100000, nextScanUs = 20000;
+    ULONG inController = 0, commandsOwed = 0, pendingCommands = 0, d;
+    UCHAR p[32];
+
+    RandomState = 0x2545F491;
+    memset(Synth, 0, sizeof(*Synth));
+    memset(devices, 0, sizeof(devices));
+    Synth->Data = SynthData;
+    Synth->Datalink = SNOOP_DATALINK_H4;
+    Synth->Length = SnoopFormatFileHeader(Synth->Data);
+
+    SynthCommand(Synth, 0, 0x0C03, 0);
+    SynthCommandComplete(Synth, 800, 0x0C03, ResetReturn, sizeof(ResetReturn));
+    SynthCommand(Synth, 1000, OP_READ_BUFFER_SIZE, 0);
+    SynthCommandComplete(Synth, 1500, OP_READ_BUFFER_SIZE, BufferReturn, sizeof(BufferReturn));
+
+    for (d = 0; d < SYNTH_DEVICES; d++) {
+        devices[d].Handle = (USHORT)(0x0040 + d);
+        devices[d].Connected = TRUE;
+        SynthConnection(Synth, 10000 + d * 5000, devices[d].Handle, d);
+    }
+
+    for (now = 50000; now < SYNTH_US; now += SYNTH_STEP_US) {
+        BOOLEAN burst = (now / 500000) % 4 == 1;
+
+        // Host: new data, then send while the controller has buffers
+        for (d = 0; d < SYNTH_DEVICES; d++) {
+            SYNTH_DEVICE* device = &devices[d];
+
+            if (!device->Connected) {
+                continue;
+            }
+            if (Random() % 100 < (burst && d < 2 ? 60U : 8U)) {
+                device->Queued += 1 + (burst ? Random() % 3 : 0);
+            }
+            while (device->Queued != 0 && inController < SYNTH_BUFFERS &&
+                   device->DoneTail - device->DoneHead < 64) {
+                SynthAcl(Synth, now, device->Handle, SNOOP_SENT, 27 + Random() % 225);
+                device->DoneUs[device->DoneTail++ % 64] = now + 1250 + Random() % 3750;
+                device->Queued--;
+                inController++;
+            }
+            if (Random() % 100 < 4) {
+                SynthAcl(Synth, now, device->Handle, SNOOP_RECEIVED, 27 + Random() % 100);
+            }
+        }
+
+        // Controller: finishes packets in order per link, reports every 1 ms
+        for (d = 0; d < SYNTH_DEVICES; d++) {
+            SYNTH_DEVICE* device = &devices[d];
+
+            while (device->DoneHead != device->DoneTail && device->DoneUs[device->DoneHead % 64] <= now) {
+                device->DoneHead++;
+                device->Completed++;
+            }
+        }
+        if (now % 1000 == 0) {
+            ULONG handles = 0, offset = 1;
+
+            for (d = 0; d < SYNTH_DEVICES; d++) {
+                if (devices[d].Completed != 0) {
+                    p[offset++] = (UCHAR)devices[d].Handle;
+                    p[offset++] = (UCHAR)(devices[d].Handle >> 8);
+                    p[offset++] = (UCHAR)devices[d].Completed;
+                    p[offset++] = 0;
+                    inController -= devices[d].Completed;
+                    devices[d].Completed = 0;
+                    handles++;
+                }
+            }
+            if (handles != 0) {
+                p[0] = (UCHAR)handles;
+                SynthEvent(Synth, now, HCI_EV_NUMBER_OF_COMPLETED_PACKETS, p, offset);
+            }
+        }
+
+        // Connection updates, one command credit at a time
+        if (now >= nextUpdateUs) {
+            pendingCommands++;
+            nextUpdateUs = now + 40000;
+        }
+        if (pendingCommands != 0 && commandsOwed == 0) {
+            SynthCommand(Synth, now, 0x2013, 14);
+            pendingCommands--;
+            commandsOwed = 1;
+            commandDoneUs = now + 500 + Random() % 1500;
+        }
+        if (commandsOwed != 0 && now >= commandDoneUs) {
+            p[0] = 0;
+            p[1] = 1;
+            p[2] = 0x13;
+            p[3] = 0x20;
+            SynthEvent(Synth, now, HCI_EV_COMMAND_STATUS, p, 4);
+            commandsOwed = 0;
+        }
+
+        // Scanning
+        if (now >= nextScanUs) {
+            p[0] = HCI_LE_ADVERTISING_REPORT;
+            p[1] = 1;
+            p[2] = 0;
+            p[3] = 1;
+            p[4] = (UCHAR)Random(); p[5] = 0x42; p[6] = 0x42; p[7] = 0x42; p[8] = 0x42; p[9] = 0xC2;
+            p[10] = 3;
+            p[11] = 2; p[12] = 0x01; p[13] = 0x06;
+            p[14] = (UCHAR)(-60 - (LONG)(Random() % 30));
+            SynthEvent(Synth, now, HCI_EV_LE_META, p, 15);
+            nextScanUs = now + 2000 + Random() % 8000;
+        }
+
+        // The last link drops at 3 s, once its packets are done, and is back at 3.5 s
+        if (now == 3000000) {
+            SYNTH_DEVICE* device = &devices[SYNTH_DEVICES - 1];
+
+            p[0] = 0;
+            p[1] = (UCHAR)device->Handle;
+            p[2] = (UCHAR)(device->Handle >> 8);
+            p[3] = 0x13;
+            inController -= device->DoneTail - device->DoneHead + device->Completed;
+            SynthEvent(Synth, now, HCI_EV_DISCONNECTION_COMPLETE, p, 4);
+            device->Connected = FALSE;
+            device->DoneHead = device->DoneTail = 0;
+            device->Completed = 0;
+            device->Queued = 0;
+        }
+        if (now == 3500000) {
+            SYNTH_DEVICE* device = &devices[SYNTH_DEVICES - 1];
+
+            device->Handle = 0x0050;
+            device->Connected = TRUE;
+            SynthConnection(Synth, now, device->Handle, SYNTH_DEVICES - 1);
+        }
+    }
+
+    // The controller finishes what it holds before the capture stops
+    p[0] = 0;
+    for (d = 0; d < SYNTH_DEVICES; d++) {
+        ULONG packets = devices[d].Completed + devices[d].DoneTail - devices[d].DoneHead;
+
+        if (packets != 0) {
+            p[1 + p[0] * 4] = (UCHAR)devices[d].Handle;
+            p[2 + p[0] * 4] = (UCHAR)(devices[d].Handle >> 8);
+            p[3 + p[0] * 4] = (UCHAR)packets;
+            p[4 + p[0] * 4] = 0;
+            p[0]++;
+        }
+    }
+    if (p[0] != 0) {
+        SynthEvent(Synth, now, HCI_EV_NUMBER_OF_COMPLETED_PACKETS, p, 1 + p[0] * 4);
+    }
+}
+
+// The same capture as datalink H1: no indicators, flags say what each is
+static VOID
+SynthToH1(const SYNTH* H4, SYNTH* H1)
+{
+    SNOOP_READER reader;
+    SNOOP_RECORD record;
+    PUCHAR out;
+    ULONG64 timestamp;
+    ULONG flags;
+
+    *H1 = *H4;
+    H1->Data = SynthH1;
+    H1->Datalink = SNOOP_DATALINK_H1;
+    memcpy(H1->Data, H4->Data, SNOOP_FILE_HEADER_BYTES);
+    H1->Data[15] = (UCHAR)(SNOOP_DATALINK_H1 & 0xFF);
+    H1->Data[14] = (UCHAR)(SNOOP_DATALINK_H1 >> 8);
+    H1->Length = SNOOP_FILE_HEADER_BYTES;
+
+    memset(&reader, 0, sizeof(reader));
+    reader.Datalink = SNOOP_DATALINK_H4;
+    SnoopReaderReset(&reader, H4->Data + SNOOP_FILE_HEADER_BYTES, H4->Length - SNOOP_FILE_HEADER_BYTES);
+
+    while (SnoopReadRecord(&reader, &record) == STATUS_SUCCESS) {
+        out = H1->Data + H1->Length;
+        flags = (record.Direction == SNOOP_RECEIVED ? 1 : 0) |
+            (record.Type == SNOOP_TYPE_COMMAND || record.Type == SNOOP_TYPE_EVENT ? 2 : 0);
+        timestamp = record.TimestampUs + SNOOP_EPOCH_DELTA_US;
+
+        out[0] = 0; out[1] = 0; out[2] = (UCHAR)(record.Length >> 8); out[3] = (UCHAR)record.Length;
+        memcpy(out + 4, out, 4);
+        out[8] = 0; out[9] = 0; out[10] = 0; out[11] = (UCHAR)flags;
+        memset(out + 12, 0, 4);
+        out[16] = (UCHAR)(timestamp >> 56); out[17] = (UCHAR)(timestamp >> 48);
+        out[18] = (UCHAR)(timestamp >> 40); out[19] = (UCHAR)(timestamp >> 32);
+        out[20] = (UCHAR)(timestamp >> 24); out[21] = (UCHAR)(timestamp >> 16);
+        out[22] = (UCHAR)(timestamp >> 8); out[23] = (UCHAR)timestamp;
+        memcpy(out + SNOOP_RECORD_HEADER_BYTES, record.Packet, record.Length);
+        H1->Length += SNOOP_RECORD_HEADER_BYTES + record.Length;
+    }
+}
+
+static VOID
+RunMemory(const UCHAR* Data, ULONG Length, double Speed, ULONG ChunkBytes)
+{
+    REPLAY_OPTIONS options;
+    SOURCE source;
+
+    memset(&source, 0, sizeof(source));
+    source.Data = Data;
+    source.Length = Length;
+    options.Speed = Speed;
+    options.ChunkBytes = ChunkBytes;
+    ReplayRun(&Replay, &source, &options);
+}
+
+static VOID
+SelfTest(const char* SavePath)
+{
+    SYNTH synth, h1;
+    ULONG64 digest, acked, waiting = 0, owed = 0;
+    double wall;
+    BOOLEAN ordered;
+    UCHAR header[SNOOP_FILE_HEADER_BYTES];
+    FILE* file;
+    ULONG i, datalink;
+
+    SynthBuild(&synth);
+
+    if (SavePath != NULL) {
+        file = fopen(SavePath, "wb");
+        if (file == NULL || fwrite(synth.Data, 1, synth.Length, file) != synth.Length) {
+            printf("Could not write %s\n", SavePath);
+            Failures++;
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+
+    RunMemory(synth.Data, synth.Length, 0, CHUNK_BYTES);
+    ReplayReport(&Replay, "synthetic");
+    printf("\n");
+
+    digest = Replay.Digest;
+    acked = Replay.Queue.Stats.Completed;
+    for (i = 0; i < ACL_CREDIT_MAX_LINKS; i++) {
+        if (Replay.Links[i].InUse) {
+            waiting += Replay.Links[i].Tail - Replay.Links[i].Head;
+            owed += Replay.Links[i].Owed;
+        }
+    }
+    ordered = Replay.FirstUs == SYNTH_BASE_US && Replay.LastUs <= SYNTH_BASE_US + SYNTH_US;
+
+    printf("Checks\n");
+    Check("Every record read, timestamps since 1970",
+        NT_SUCCESS(Replay.Status) && Replay.Reader.Records == synth.Records &&
+        Replay.Reader.Malformed == 0 && Replay.Truncated == 0 && ordered);
+    Check("Every event parsed, none malformed",
+        Replay.Parse.Events == Replay.Types[SNOOP_TYPE_EVENT] && Replay.Parse.Malformed == 0);
+    Check("Controller's buffer count from Read Buffer Size", Replay.Pool.Stats.Buffers == SYNTH_BUFFERS);
+    Check("Every command sent and acknowledged",
+        Replay.Queue.Stats.Sent == Replay.Types[SNOOP_TYPE_COMMAND] &&
+        acked == Replay.Queue.Stats.Sent && Replay.Queue.Stats.TimedOut == 0);
+    Check("Every ACL packet granted, none owed at the end",
+        waiting == 0 && owed == 0 && Replay.Unknown == 0 && Replay.ImplicitLinks == 0 &&
+        Replay.Pool.Stats.Granted + Replay.Flushed == Replay.Stages[StageAcl].Items);
+
+    RunMemory(synth.Data, synth.Length, 0, 4096);
+    Check("Same digest reading 4 KB at a time", Replay.Digest == digest && Replay.Truncated == 0);
+
+    SynthToH1(&synth, &h1);
+    RunMemory(h1.Data, h1.Length, 0, CHUNK_BYTES);
+    Check("Same digest from the H1 form of the capture",
+        Replay.Datalink == SNOOP_DATALINK_H1 && Replay.Digest == digest);
+
+    RunMemory(synth.Data, synth.Length, 25, CHUNK_BYTES);
+    wall = Replay.WallSeconds;
+    Check("Same digest paced at 25x", Replay.Digest == digest);
+    Check("25x takes a 25th of the capture, within 10%",
+        wall > (SYNTH_US - 50000) / 1e6 / 25 * 0.9 && wall < SYNTH_US / 1e6 / 25 * 1.1);
+    printf("    paced 25x: %.3f s wall, behind schedule p99 %llu us\n", wall,
+        (unsigned long long)HistogramPercentile(&Replay.Lag, 99));
+
+    RunMemory(synth.Data, synth.Length - 10, 0, 4096);
+    Check("File cut short: replayed to its last whole record",
+        NT_SUCCESS(Replay.Status) && Replay.Reader.Records == synth.Records - 1 &&
+        Replay.Truncated != 0);
+
+    memcpy(header, synth.Data, sizeof(header));
+    header[0] = 'B';
+    Check("Not btsnoop: refused",
+        SnoopParseFileHeader(header, sizeof(header), &datalink) == STATUS_INVALID_PARAMETER);
+    header[0] = 'b';
+    header[15] = 201;           // BT monitor
+    Check("Unsupported datalink: refused",
+        SnoopParseFileHeader(header, sizeof(header), &datalink) == STATUS_NOT_SUPPORTED);
+
+    // A record claiming more than any packet
+    memcpy(SynthH1, synth.Data, SNOOP_FILE_HEADER_BYTES + SNOOP_RECORD_HEADER_BYTES);
+    SynthH1[SNOOP_FILE_HEADER_BYTES + 5] = 0x7F;
+    RunMemory(SynthH1, SNOOP_FILE_HEADER_BYTES + SNOOP_RECORD_HEADER_BYTES + 1024, 0, 4096);
+    Check("Corrupt record length: stops", Replay.Status == STATUS_FILE_CORRUPT_ERROR);
+}
+
+static VOID
+Usage(void)
+{
+    printf("Usage: replay_benchmark [-s speed] [-e digest] [-w file] [file.btsnoop]\n");
+    printf("  -s speed   1 for the capture's timing, 10 for ten times faster, 0 (default) unpaced\n");
+    printf("  -e digest  fail unless the replay's digest is this\n");
+    printf("  -w file    without a capture: save the synthetic one\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    REPLAY_OPTIONS options;
+    SOURCE source;
+    const char* path = NULL;
+    const char* save = NULL;
+    const char* expected = NULL;
+    int i;
+
+    options.Speed = 0;
+    options.ChunkBytes = CHUNK_BYTES;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            options.Speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            expected = argv[++i];
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            save = argv[++i];
+        } else if (argv[i][0] == '-' || path != NULL) {
+            Usage();
+            return 2;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (options.Speed < 0) {
+        Usage();
+        return 2;
+    }
+
+    if (path == NULL) {
+        SelfTest(save);
+        printf("\n%s\n", Failures == 0 ? "All checks passed" : "CHECKS FAILED");
+        return Failures == 0 ? 0 : 1;
+    }
+
+    memset(&source, 0, sizeof(source));
+    source.File = fopen(path, "rb");
+    if (source.File == NULL) {
+        printf("Cannot open %s\n", path);
+        return 2;
+    }
+
+    ReplayRun(&Replay, &source, &options);
+    fclose(source.File);
+
+    if (Replay.Status == STATUS_INVALID_PARAMETER || Replay.Status == STATUS_NOT_SUPPORTED) {
+        printf("%s: %s\n", path, Replay.Status == STATUS_NOT_SUPPORTED ?
+            "datalink not H1 or H4" : "not a btsnoop file");
+        return 2;
+    }
+
+    ReplayReport(&Replay, path);
+    if (Replay.Status == STATUS_FILE_CORRUPT_ERROR) {
+        printf("Stopped at a corrupt record\n");
+        return 1;
+    }
+
+    if (expected != NULL && strtoull(expected, NULL, 16) != Replay.Digest) {
+        printf("Digest differs from %s\n", expected);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,383 @@
+/*++
+
+Module Name:
+    rpa_benchmark.c
+
+Abstract:
+    User-mode benchmark for the driver's resolvable private address
+    resolver (MultiDeviceBTRpa.c) with 500 bonded IRKs. It runs in three
+    parts:
+    - The Core specification ah sample (Vol 3 Part H, D.7) on every
+      instruction set.
+    - Correctness: every nearby bonded device resolves to its identity,
+      strangers stay unresolved, public addresses pass through, and
+      removing an IRK takes effect at once despite the cache.
+    - Resolutions/s. The baseline runs one AES call per IRK for every
+      address, with no cache. "Cold" is the batched search with every
+      lookup a cache miss. "Dense scan" replays a crowded venue: 1,500
+      advertisers, of which 100 are bonded and 900 more use RPAs from
+      keys we do not hold. Reports arrive at 25,000/s, one per call, and
+      one in 1,000 comes from a device that has just rotated its RPA.
+
+    Build (MSVC):
+        cl /O2 /I..\driver rpa_benchmark.c ..\driver\MultiDeviceBTRpa.c ..\driver\MultiDeviceBTAes.c
+
+    Build (Linux):
+        cc -O2 -I../driver rpa_benchmark.c ../driver/MultiDeviceBTRpa.c ../driver/MultiDeviceBTAes.c
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bthdef.h>
+#else
+#include <time.h>
+#include "MultiDeviceBTPortable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MultiDeviceBTRpa.h"
+
+#define BENCH_SECONDS       0.5
+#define BONDS               500
+#define NEARBY_BONDED       100
+#define STRANGERS           900
+#define PUBLIC_ADVERTISERS  500
+#define ADVERTISERS         (NEARBY_BONDED + STRANGERS + PUBLIC_ADVERTISERS)
+#define SCAN_REPORTS        200000
+#define SCAN_INTERVAL_US    40          // 25,000 reports/s
+#define ROTATE_ONE_IN       1000
+#define CACHE_SIZE          2048        // PRIVACY_CACHE_SIZE
+
+static const char* IsaName[] = { "portable", "aes-ni" };
+
+typedef struct _ADVERTISER {
+    UCHAR Irk[RPA_IRK_BYTES];
+    BTH_ADDR Identity;          // BTH_ADDR_NULL for strangers
+    BTH_ADDR Address;           // Current advertising address
+    BOOLEAN Private;
+} ADVERTISER;
+
+static RPA_IRK Irks[BONDS];
+static RPA_CACHE_ENTRY Cache[CACHE_SIZE];
+static UCHAR BondIrks[BONDS][RPA_IRK_BYTES];
+static ADVERTISER Advertisers[ADVERTISERS];
+static BTH_ADDR ScanAddresses[SCAN_REPORTS];
+static BTH_ADDR ScanExpected[SCAN_REPORTS];
+static BTH_ADDR ColdAddresses[ADVERTISERS];
+
+static double
+Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int RandomState = 0x2545F491;
+
+static ULONG
+Random(void)
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 17;
+    RandomState ^= RandomState << 5;
+    return RandomState;
+}
+
+static BTH_ADDR
+BondIdentity(ULONG Bond)
+{
+    return 0x001A7D000000ULL | Bond;
+}
+
+static VOID
+Bond(PRPA_RESOLVER Resolver, AES_ISA Isa)
+{
+    ULONG i;
+
+    RpaInitialize(Resolver, Isa, Irks, BONDS, Cache, CACHE_SIZE);
+    for (i = 0; i < BONDS; i++) {
+        RpaAddIrk(Resolver, BondIdentity(i), RPA_IDENTITY_PUBLIC, BondIrks[i]);
+    }
+}
+
+static VOID
+Rotate(ADVERTISER* Advertiser)
+{
+    if (Advertiser->Private) {
+        Advertiser->Address = RpaGenerate(AesIsaBest, Advertiser->Irk, Random());
+    }
+}
+
+//
+// Baseline: every IRK in turn, one AES call each, no cache
+//
+
+static BTH_ADDR
+BaselineResolve(const RPA_RESOLVER* Resolver, AES_ISA Isa, BTH_ADDR Address)
+{
+    UCHAR block[AES_BLOCK_BYTES];
+    ULONG prand = (ULONG)(Address >> 24) & 0xFFFFFF;
+    ULONG i;
+
+    if (!RPA_IS_RESOLVABLE(Address)) {
+        return Address;
+    }
+
+    for (i = 0; i < Resolver->IrkCount; i++) {
+        const AES_KEY* key = &Resolver->Irks[i].Key;
+
+        memset(block, 0, sizeof(block));
+        block[13] = (UCHAR)(prand >> 16);
+        block[14] = (UCHAR)(prand >> 8);
+        block[15] = (UCHAR)prand;
+        AesEncryptBlocks(Isa, &key, block, block, 1);
+        if ((((ULONG)block[13] << 16) | ((ULONG)block[14] << 8) | block[15]) ==
+            ((ULONG)Address & 0xFFFFFF)) {
+            return Resolver->Irks[i].IdentityAddress;
+        }
+    }
+
+    return BTH_ADDR_NULL;
+}
+
+static int
+SpecVector(AES_ISA Isa)
+{
+    // IRK ec0234a357c8ad05341010a60a397d9b, prand 708194 -> hash 0dfbaa
+    static const UCHAR irk[RPA_IRK_BYTES] = {
+        0x9b, 0x7d, 0x39, 0x0a, 0xa6, 0x10, 0x10, 0x34,
+        0x05, 0xad, 0xc8, 0x57, 0xa3, 0x34, 0x02, 0xec
+    };
+    BTH_ADDR rpa = RpaGenerate(Isa, irk, 0x708194);
+    BOOLEAN ok = rpa == 0x7081940DFBAAULL;
+
+    printf("  %-8s %-24s %s\n", IsaName[Isa], "ah sample", ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+static int
+Correctness(AES_ISA Isa)
+{
+    RPA_RESOLVER resolver;
+    RPA_RESULT result;
+    ULONG i, pass, right = 0, wrong = 0, cached = 0;
+    BTH_ADDR removed;
+    BOOLEAN forgotten, restored;
+
+    Bond(&resolver, Isa);
+
+    // The second pass is answered from the cache, bar any evictions
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < ADVERTISERS; i++) {
+            const ADVERTISER* a = &Advertisers[i];
+            UCHAR expected = !a->Private ? RPA_OUTCOME_NOT_RPA :
+                a->Identity != BTH_ADDR_NULL ? RPA_OUTCOME_RESOLVED : RPA_OUTCOME_UNRESOLVED;
+
+            RpaResolve(&resolver, 0, &a->Address, 1, &result);
+            cached += result.Cached ? 1 : 0;
+            if (result.Outcome == expected && (pass == 1 || !result.Cached) &&
+                result.Address == (expected == RPA_OUTCOME_RESOLVED ? a->Identity : a->Address) &&
+                BaselineResolve(&resolver, Isa, a->Address) ==
+                    (expected == RPA_OUTCOME_UNRESOLVED ? BTH_ADDR_NULL : result.Address)) {
+                right++;
+            } else {
+                wrong++;
+            }
+        }
+    }
+
+    // Removing an IRK must not leave its cached identity behind
+    removed = Advertisers[0].Identity;
+    RpaRemoveIrk(&resolver, removed);
+    RpaResolve(&resolver, 0, &Advertisers[0].Address, 1, &result);
+    forgotten = result.Outcome == RPA_OUTCOME_UNRESOLVED && !result.Cached;
+    RpaAddIrk(&resolver, removed, RPA_IDENTITY_PUBLIC, Advertisers[0].Irk);
+    RpaResolve(&resolver, 0, &Advertisers[0].Address, 1, &result);
+    restored = result.Outcome == RPA_OUTCOME_RESOLVED && result.Address == removed;
+
+    printf("  %-8s %lu lookups: %lu right, %lu wrong, %lu/%d repeats cached; removal %s, re-add %s\n",
+           IsaName[Isa], (unsigned long)(right + wrong), (unsigned long)right,
+           (unsigned long)wrong, (unsigned long)cached, NEARBY_BONDED + STRANGERS,
+           forgotten ? "ok" : "FAIL", restored ? "ok" : "FAIL");
+
+    return (wrong == 0 && forgotten && restored) ? 0 : 1;
+}
+
+static double
+Baseline(AES_ISA Isa)
+{
+    RPA_RESOLVER resolver;
+    double start, elapsed;
+    ULONG64 lookups = 0;
+    ULONG i;
+
+    Bond(&resolver, Isa);
+    start = Seconds();
+    do {
+        for (i = 0; i < ADVERTISERS; i++) {
+            BaselineResolve(&resolver, Isa, ColdAddresses[i]);
+        }
+        lookups += ADVERTISERS;
+        elapsed = Seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    return lookups / elapsed;
+}
+
+static double
+Cold(AES_ISA Isa)
+{
+    RPA_RESOLVER resolver;
+    RPA_RESULT result;
+    double start, elapsed;
+    ULONG64 lookups = 0, now = 0;
+    ULONG i;
+
+    Bond(&resolver, Isa);
+    start = Seconds();
+    do {
+        // Each lookup lands after every cached entry has expired
+        for (i = 0; i < ADVERTISERS; i++) {
+            now += RPA_CACHE_TTL_US + 1;
+            RpaResolve(&resolver, now, &ColdAddresses[i], 1, &result);
+        }
+        lookups += ADVERTISERS;
+        elapsed = Seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    return lookups / elapsed;
+}
+
+static double
+DenseScan(AES_ISA Isa, PRPA_STATS Stats, ULONG* Wrong)
+{
+    RPA_RESOLVER resolver;
+    RPA_RESULT result;
+    double start, elapsed;
+    ULONG64 lookups = 0, now = 0;
+    ULONG i;
+
+    Bond(&resolver, Isa);
+    *Wrong = 0;
+    start = Seconds();
+    do {
+        for (i = 0; i < SCAN_REPORTS; i++) {
+            now += SCAN_INTERVAL_US;
+            RpaResolve(&resolver, now, &ScanAddresses[i], 1, &result);
+            if (ScanExpected[i] != BTH_ADDR_NULL && result.Address != ScanExpected[i]) {
+                (*Wrong)++;
+            }
+        }
+        lookups += SCAN_REPORTS;
+        elapsed = Seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    *Stats = resolver.Stats;
+    return lookups / elapsed;
+}
+
+int
+main(void)
+{
+    AES_ISA best = AesDetectIsa();
+    int failures = 0, isa;
+    ULONG i, j;
+
+    for (i = 0; i < BONDS; i++) {
+        for (j = 0; j < RPA_IRK_BYTES; j++) {
+            BondIrks[i][j] = (UCHAR)Random();
+        }
+    }
+
+    // Nearby bonded devices first, then strangers, then public advertisers
+    for (i = 0; i < ADVERTISERS; i++) {
+        ADVERTISER* a = &Advertisers[i];
+
+        if (i < NEARBY_BONDED) {
+            ULONG bond = i * (BONDS / NEARBY_BONDED);
+
+            memcpy(a->Irk, BondIrks[bond], RPA_IRK_BYTES);
+            a->Identity = BondIdentity(bond);
+            a->Private = TRUE;
+        } else if (i < NEARBY_BONDED + STRANGERS) {
+            for (j = 0; j < RPA_IRK_BYTES; j++) {
+                a->Irk[j] = (UCHAR)Random();
+            }
+            a->Private = TRUE;
+        } else {
+            a->Address = 0x00025B000000ULL | i;
+        }
+        Rotate(a);
+        ColdAddresses[i] = a->Address;
+    }
+
+    printf("Known-answer tests\n");
+    for (isa = AesIsaPortable; isa <= (int)best; isa++) {
+        failures += SpecVector((AES_ISA)isa);
+    }
+
+    printf("\nCorrectness, %d bonds\n", BONDS);
+    for (isa = AesIsaPortable; isa <= (int)best; isa++) {
+        failures += Correctness((AES_ISA)isa);
+    }
+
+    // The scan is generated after the correctness pass, which uses the first RPAs
+    for (i = 0; i < SCAN_REPORTS; i++) {
+        ADVERTISER* a = &Advertisers[Random() % ADVERTISERS];
+
+        if (Random() % ROTATE_ONE_IN == 0) {
+            Rotate(a);
+        }
+        ScanAddresses[i] = a->Address;
+        ScanExpected[i] = a->Identity != BTH_ADDR_NULL ? a->Identity : a->Address;
+        if (a->Private && a->Identity == BTH_ADDR_NULL) {
+            ScanExpected[i] = BTH_ADDR_NULL;
+        }
+    }
+
+    printf("\nResolutions/s, %d bonds, %d advertisers (%d bonded, %d strangers with RPAs, "
+           "%d public)\n", BONDS, ADVERTISERS, NEARBY_BONDED, STRANGERS, PUBLIC_ADVERTISERS);
+    printf("%-8s | %-10s | %-10s | %-10s | %-8s | %-7s | %s\n",
+           "ISA", "BASELINE", "COLD", "SCAN", "HIT RATE", "AES/LKP", "SPEEDUP");
+    printf("------------------------------------------------------------------------\n");
+
+    for (isa = AesIsaPortable; isa <= (int)best; isa++) {
+        RPA_STATS stats;
+        double baseline, cold, scan;
+        ULONG wrong;
+
+        baseline = Baseline((AES_ISA)isa);
+        cold = Cold((AES_ISA)isa);
+        scan = DenseScan((AES_ISA)isa, &stats, &wrong);
+
+        printf("%-8s | %-10.0f | %-10.0f | %-10.0f | %7.1f%% | %-7.2f | %.0fx\n",
+               IsaName[isa], baseline, cold, scan,
+               100.0 * stats.CacheHits / (stats.Lookups - stats.NotResolvable),
+               (double)stats.AesBlocks / stats.Lookups, scan / baseline);
+        if (wrong != 0) {
+            printf("%-8s | %lu scan reports resolved wrongly\n", IsaName[isa], (unsigned long)wrong);
+            failures++;
+        }
+    }
+
+    printf("------------------------------------------------------------------------\n");
+    printf("BASELINE: one AES call per IRK per address, no cache. COLD: batched search,\n");
+    printf("every lookup a miss. SCAN: dense scan through the cache. HIT RATE: share of\n");
+    printf("RPA lookups answered from the cache. AES/LKP: AES blocks per scan lookup.\n");
+    printf("\n%s\n", failures == 0 ? "All checks passed" : "CHECKS FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
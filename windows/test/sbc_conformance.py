@@ -0,0 +1,287 @@
+import argparse
+import math
+import os
+import struct
+from datetime import datetime
+
+# Reference SBC decoder written from the A2DP specification (Appendix B),
+# independent of MultiDeviceBTSbc.c. Checks syncword, header CRC, frame
+# length and bit allocation on every frame, then reconstructs the audio
+# and compares it with the source PCM written by sbc_benchmark.c.
+
+FREQUENCIES = (16000, 32000, 44100, 48000)
+MODES = ('mono', 'dual', 'stereo', 'joint')
+
+OFFSET4 = ((-1, 0, 0, 0), (-2, 0, 0, 1), (-2, 0, 0, 1), (-2, 0, 0, 1))
+OFFSET8 = ((-2, 0, 0, 0, 0, 0, 0, 1), (-3, 0, 0, 0, 0, 0, 1, 2),
+           (-4, 0, 0, 0, 0, 0, 1, 2), (-4, 0, 0, 0, 0, 0, 1, 2))
+
+PROTO4_HALF = (0.00000000E+00, 5.36548976E-04, 1.49188357E-03, 2.73370904E-03,
+               3.83720193E-03, 3.89205149E-03, 1.86581691E-03, 3.06012286E-03,
+               1.09137620E-02, 2.04385087E-02, 2.88757392E-02, 3.21939290E-02,
+               2.58767811E-02, 6.13245186E-03, 2.88217274E-02, 7.76463494E-02,
+               1.35593274E-01, 1.94987841E-01, 2.46636662E-01, 2.81828203E-01,
+               2.94315332E-01)
+PROTO8_HALF = (0.00000000E+00, 1.56575398E-04, 3.43256425E-04, 5.54620202E-04,
+               8.23919506E-04, 1.13992507E-03, 1.47640169E-03, 1.78371725E-03,
+               2.01182542E-03, 2.10371989E-03, 1.99454554E-03, 1.61656283E-03,
+               9.02154502E-04, 1.78805361E-04, 1.64973098E-03, 3.49717454E-03,
+               5.65949473E-03, 8.02941163E-03, 1.04584443E-02, 1.27472335E-02,
+               1.46525263E-02, 1.59045603E-02, 1.62208471E-02, 1.53184106E-02,
+               1.29371806E-02, 8.85757540E-03, 2.92408442E-03, 4.91578024E-03,
+               1.46404076E-02, 2.61098752E-02, 3.90751381E-02, 5.31873032E-02,
+               6.79989431E-02, 8.29847578E-02, 9.75753918E-02, 1.11196689E-01,
+               1.23264548E-01, 1.33264415E-01, 1.40753505E-01, 1.45389847E-01,
+               1.46955068E-01)
+# Magnitudes above; these indices of the first half are negative
+PROTO4_NEGATIVE = {7, 14, 15}
+PROTO8_NEGATIVE = {13, 14, 15, 27, 28, 29, 30, 31}
+
+
+def ts():
+    return datetime.now().strftime('%H:%M:%S')
+
+
+def window(m):
+    """Synthesis window D = -M * C over 10M taps."""
+    half, negative = (PROTO4_HALF, PROTO4_NEGATIVE) if m == 4 else (PROTO8_HALF, PROTO8_NEGATIVE)
+    table = [(-v if i in negative else v) for i, v in enumerate(half)]
+    # Table values carry the (-1)^floor(i / 2M) pattern; undo it, mirror, reapply
+    proto = [table[i] * (-1) ** (i // (2 * m)) for i in range(5 * m + 1)]
+    coeffs = []
+    for i in range(10 * m):
+        j = i if i <= 5 * m else 10 * m - i
+        coeffs.append(proto[j] * (-1) ** (i // (2 * m)) * -m)
+    return coeffs
+
+
+class BitReader:
+    def __init__(self, data, offset):
+        self.data = data
+        self.pos = offset * 8
+
+    def read(self, count):
+        value = 0
+        for _ in range(count):
+            byte = self.data[self.pos >> 3]
+            value = (value << 1) | ((byte >> (7 - (self.pos & 7))) & 1)
+            self.pos += 1
+        return value
+
+
+def crc8(crc, value, count):
+    for i in range(count - 1, -1, -1):
+        bit = ((value >> i) & 1) ^ (crc >> 7)
+        crc = (crc << 1) & 0xFF
+        if bit:
+            crc ^= 0x1D
+    return crc
+
+
+def allocate(sf, channels, m, bitpool, freq, snr):
+    bitneed = [[0] * m for _ in channels]
+    for ci, ch in enumerate(channels):
+        for sb in range(m):
+            if snr:
+                bitneed[ci][sb] = sf[ch][sb]
+            elif sf[ch][sb] == 0:
+                bitneed[ci][sb] = -5
+            else:
+                loudness = sf[ch][sb] - (OFFSET4 if m == 4 else OFFSET8)[freq][sb]
+                bitneed[ci][sb] = loudness // 2 if loudness > 0 else loudness
+    max_bitneed = max(max(row) for row in bitneed)
+    max_bitneed = max(max_bitneed, 0)
+
+    bitcount = slicecount = 0
+    bitslice = max_bitneed + 1
+    while True:
+        bitslice -= 1
+        bitcount += slicecount
+        slicecount = 0
+        for row in bitneed:
+            for need in row:
+                if bitslice + 1 < need < bitslice + 16:
+                    slicecount += 1
+                elif need == bitslice + 1:
+                    slicecount += 2
+        if bitcount + slicecount >= bitpool:
+            break
+    if bitcount + slicecount == bitpool:
+        bitcount += slicecount
+        bitslice -= 1
+
+    bits = [[0 if need < bitslice + 2 else min(need - bitslice, 16) for need in row] for row in bitneed]
+
+    order = [(ci, sb) for sb in range(m) for ci in range(len(channels))]
+    for ci, sb in order:
+        if bitcount >= bitpool:
+            break
+        if 2 <= bits[ci][sb] < 16:
+            bits[ci][sb] += 1
+            bitcount += 1
+        elif bitneed[ci][sb] == bitslice + 1 and bitpool > bitcount + 1:
+            bits[ci][sb] = 2
+            bitcount += 2
+    for ci, sb in order:
+        if bitcount >= bitpool:
+            break
+        if bits[ci][sb] < 16:
+            bits[ci][sb] += 1
+            bitcount += 1
+    return {ch: bits[ci] for ci, ch in enumerate(channels)}
+
+
+class Decoder:
+    def __init__(self):
+        self.state = {}
+        self.tables = {}
+
+    def synthesize(self, ch, m, samples):
+        if m not in self.tables:
+            matrix = [[math.cos((i + m / 2) * (2 * k + 1) * math.pi / (2 * m)) for k in range(m)]
+                      for i in range(2 * m)]
+            self.tables[m] = (matrix, window(m))
+        matrix, d = self.tables[m]
+        v = self.state.setdefault((ch, m), [0.0] * (20 * m))
+        v[2 * m:] = v[:18 * m]
+        for i in range(2 * m):
+            v[i] = sum(matrix[i][k] * samples[k] for k in range(m))
+        u = [0.0] * (10 * m)
+        for i in range(5):
+            for j in range(m):
+                u[i * 2 * m + j] = v[i * 4 * m + j]
+                u[i * 2 * m + m + j] = v[i * 4 * m + 3 * m + j]
+        w = [u[i] * d[i] for i in range(10 * m)]
+        return [sum(w[j + m * i] for i in range(10)) for j in range(m)]
+
+    def frame(self, data, offset):
+        if data[offset] != 0x9C:
+            raise ValueError("bad syncword at %d" % offset)
+        h1, bitpool, crc = data[offset + 1], data[offset + 2], data[offset + 3]
+        freq = h1 >> 6
+        blocks = ((h1 >> 4) & 3) * 4 + 4
+        mode = (h1 >> 2) & 3
+        snr = (h1 >> 1) & 1
+        m = 8 if h1 & 1 else 4
+        nch = 1 if mode == 0 else 2
+
+        reader = BitReader(data, offset + 4)
+        check = crc8(crc8(0x0F, h1, 8), bitpool, 8)
+        join = 0
+        if mode == 3:
+            join = reader.read(m)
+            check = crc8(check, join, m)
+        sf = [[0] * m for _ in range(nch)]
+        for ch in range(nch):
+            for sb in range(m):
+                sf[ch][sb] = reader.read(4)
+                check = crc8(check, sf[ch][sb], 4)
+        if check != crc:
+            raise ValueError("CRC mismatch at %d" % offset)
+
+        if mode >= 2:
+            bits = allocate(sf, [0, 1], m, bitpool, freq, snr)
+        else:
+            bits = {}
+            for ch in range(nch):
+                bits.update(allocate(sf, [ch], m, bitpool, freq, snr))
+
+        data_bits = blocks * nch * bitpool if mode <= 1 else blocks * bitpool + (m if mode == 3 else 0)
+        length = 4 + (4 * m * nch) // 8 + (data_bits + 7) // 8
+
+        pcm = [[] for _ in range(nch)]
+        for blk in range(blocks):
+            sb_samples = [[0.0] * m for _ in range(nch)]
+            for ch in range(nch):
+                for sb in range(m):
+                    b = bits[ch][sb]
+                    if b:
+                        levels = (1 << b) - 1
+                        q = reader.read(b)
+                        sb_samples[ch][sb] = 2.0 ** (sf[ch][sb] + 1) * ((2 * q + 1) / levels - 1)
+            if mode == 3:
+                for sb in range(m):
+                    if join & (1 << (m - 1 - sb)):
+                        a, b = sb_samples[0][sb], sb_samples[1][sb]
+                        sb_samples[0][sb], sb_samples[1][sb] = a + b, a - b
+            for ch in range(nch):
+                pcm[ch].extend(self.synthesize(ch, m, sb_samples[ch]))
+
+        used = (reader.pos + 7) // 8 - offset
+        if used > length:
+            raise ValueError("frame overruns its length at %d" % offset)
+        info = dict(rate=FREQUENCIES[freq], mode=MODES[mode], blocks=blocks, subbands=m,
+                    bitpool=bitpool, channels=nch)
+        return length, pcm, info
+
+
+def snr_db(source, decoded, delay):
+    signal = noise = 0.0
+    for n in range(delay, min(len(decoded), len(source) + delay)):
+        s = source[n - delay]
+        signal += s * s
+        noise += (decoded[n] - s) ** 2
+    return 10 * math.log10(signal / max(noise, 1e-9))
+
+
+def check(sbc_path, pcm_path, max_frames):
+    data = open(sbc_path, 'rb').read()
+    decoder = Decoder()
+    offset = frames = 0
+    out = None
+    info = None
+    while offset < len(data) and frames < max_frames:
+        length, pcm, info = decoder.frame(data, offset)
+        if out is None:
+            out = [[] for _ in pcm]
+        for ch, samples in enumerate(pcm):
+            out[ch].extend(samples)
+        offset += length
+        frames += 1
+
+    raw = open(pcm_path, 'rb').read()
+    nch = info['channels']
+    total = len(out[0])
+    src = struct.unpack('<%dh' % (total * nch), raw[:total * nch * 2])
+    # Filterbank delay: analysis plus synthesis, 10M - M + 1 samples
+    delay = 9 * info['subbands'] + 1
+    snrs = [snr_db(src[ch::nch], out[ch], delay) for ch in range(nch)]
+    return frames, info, snrs
+
+
+def main():
+    parser = argparse.ArgumentParser(description="SBC bitstream conformance check")
+    parser.add_argument('directory', help="Directory written by sbc_benchmark <directory>")
+    parser.add_argument('--frames', type=int, default=150, help="Frames to decode per stream")
+    parser.add_argument('--min-snr', type=float, default=20.0)
+    args = parser.parse_args()
+
+    print(f"[{ts()}] SBC conformance: reference decoder, {args.frames} frames per stream")
+    print("=" * 78)
+    print(f"{'STREAM':<10} | {'RATE':<6} | {'MODE':<6} | {'BLK/SB':<6} | {'BP':<4} | {'FRAMES':<6} | {'SNR dB':<12} | RESULT")
+    print("-" * 78)
+
+    failures = 0
+    index = 0
+    while os.path.exists(os.path.join(args.directory, f"sbc_{index}.sbc")):
+        base = os.path.join(args.directory, f"sbc_{index}")
+        try:
+            frames, info, snrs = check(base + '.sbc', base + '.pcm', args.frames)
+            ok = min(snrs) >= args.min_snr
+            snr_text = "/".join(f"{s:.1f}" for s in snrs)
+            print(f"sbc_{index:<6} | {info['rate']:<6} | {info['mode']:<6} | "
+                  f"{info['blocks']:>2}/{info['subbands']:<3} | {info['bitpool']:<4} | {frames:<6} | "
+                  f"{snr_text:<12} | {'PASS' if ok else 'FAIL'}")
+        except ValueError as error:
+            ok = False
+            print(f"sbc_{index:<6} | FAIL: {error}")
+        failures += 0 if ok else 1
+        index += 1
+
+    print("-" * 78)
+    print(f"{index - failures}/{index} streams conform (syncword, CRC, frame length, allocation, SNR).")
+    raise SystemExit(1 if failures or index == 0 else 0)
+
+
+if __name__ == "__main__":
+    main()